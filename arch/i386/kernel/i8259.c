@@ -83,6 +83,7 @@ BUILD_16_IRQS(0xc) BUILD_16_IRQS(0xd)
 BUILD_SMP_INTERRUPT(reschedule_interrupt,RESCHEDULE_VECTOR)
 BUILD_SMP_INTERRUPT(invalidate_interrupt,INVALIDATE_TLB_VECTOR)
 BUILD_SMP_INTERRUPT(call_function_interrupt,CALL_FUNCTION_VECTOR)
+BUILD_SMP_INTERRUPT(remote_softirq_interrupt,REMOTE_SOFTIRQ_VECTOR)
 #endif
 
 /*
@@ -479,6 +480,9 @@ void __init init_IRQ(void)
 
 	/* IPI for generic function call */
 	set_intr_gate(CALL_FUNCTION_VECTOR, call_function_interrupt);
+
+	/* IPI for raising a softirq on another CPU */
+	set_intr_gate(REMOTE_SOFTIRQ_VECTOR, remote_softirq_interrupt);
 #endif	
 
 #ifdef CONFIG_X86_LOCAL_APIC
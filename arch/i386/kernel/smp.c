@@ -12,6 +12,7 @@
 
 #include <linux/mm.h>
 #include <linux/irq.h>
+#include <linux/interrupt.h>
 #include <linux/delay.h>
 #include <linux/spinlock.h>
 #include <linux/smp_lock.h>
@@ -502,6 +503,31 @@ void fastcall smp_send_reschedule(int cpu)
 	send_IPI_mask(1 << cpu, RESCHEDULE_VECTOR);
 }
 
+/*
+ * Softirqs raised on a CPU by the others, waiting for it to take the
+ * REMOTE_SOFTIRQ_VECTOR IPI and move them into its softirq_pending().
+ */
+static unsigned long remote_softirq_pending[NR_CPUS] __cacheline_aligned;
+
+/*
+ * Raise softirq @nr on @cpu, which need not be this one.  Unlike
+ * cpu_raise_softirq() this is safe against the other CPU touching
+ * its own softirq_pending() at the same time.  Any context.
+ */
+void smp_raise_softirq(int cpu, int nr)
+{
+	if (cpu == smp_processor_id()) {
+		unsigned long flags;
+
+		local_irq_save(flags);
+		cpu_raise_softirq(cpu, nr);
+		local_irq_restore(flags);
+		return;
+	}
+	if (!test_and_set_bit(nr, &remote_softirq_pending[cpu]))
+		send_IPI_mask(1 << cpu, REMOTE_SOFTIRQ_VECTOR);
+}
+
 /*
  * Structure and data for smp_call_function(). This is designed to minimise
  * static memory requirements. It also looks cleaner.
@@ -606,6 +632,19 @@ asmlinkage void smp_reschedule_interrupt(void)
 	ack_APIC_irq();
 }
 
+asmlinkage void smp_remote_softirq_interrupt(void)
+{
+	int cpu = smp_processor_id();
+
+	ack_APIC_irq();
+	softirq_pending(cpu) |= xchg(&remote_softirq_pending[cpu], 0);
+
+	/* Like the local APIC timer: run them now unless we interrupted
+	   an interrupt handler or bh-disabled code, which will. */
+	if (softirq_pending(cpu))
+		do_softirq();
+}
+
 asmlinkage void smp_call_function_interrupt(void)
 {
 	void (*func) (void *info) = call_data->func;
@@ -92,16 +92,14 @@ out_of_memory:
 	goto bad_area;
 }
 
-extern spinlock_t timerlist_lock;
-
 /*
  * Unlock any spinlocks which will prevent us from getting the
- * message out (timerlist_lock is acquired through the
+ * message out (the timer locks are acquired through the
  * console unblank code)
  */
 void bust_spinlocks(int yes)
 {
-	spin_lock_init(&timerlist_lock);
+	bust_timer_locks();
 	if (yes) {
 		oops_in_progress = 1;
 #ifdef CONFIG_SMP
@@ -41,8 +41,6 @@ register double f30 asm ("f30"); register double f31 asm ("f31");
 
 #include <asm/fpswa.h>
 
-extern spinlock_t timerlist_lock;
-
 static fpswa_interface_t *fpswa_interface;
 
 void __init
@@ -60,13 +58,13 @@ trap_init (void)
 }
 
 /*
- * Unlock any spinlocks which will prevent us from getting the message out (timerlist_lock
- * is acquired through the console unblank code)
+ * Unlock any spinlocks which will prevent us from getting the message out (the timer locks
+ * are acquired through the console unblank code)
  */
 void
 bust_spinlocks (int yes)
 {
-	spin_lock_init(&timerlist_lock);
+	bust_timer_locks();
 	if (yes) {
 		oops_in_progress = 1;
 #ifdef CONFIG_SMP
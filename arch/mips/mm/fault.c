@@ -36,16 +36,14 @@
  */
 #define dpf_reg(r) (regs->regs[r])
 
-extern spinlock_t timerlist_lock;
-
 /*
  * Unlock any spinlocks which will prevent us from getting the
- * message out (timerlist_lock is acquired through the
+ * message out (the timer locks are acquired through the
  * console unblank code)
  */
 void bust_spinlocks(int yes)
 {
-	spin_lock_init(&timerlist_lock);
+	bust_timer_locks();
 	if (yes) {
 		oops_in_progress = 1;
 #ifdef CONFIG_SMP
@@ -57,16 +57,14 @@ asmlinkage void dodebug2(abi64_no_regargs, struct pt_regs regs)
 	       regs.cp0_epc);
 }
 
-extern spinlock_t timerlist_lock;
-
 /*
  * Unlock any spinlocks which will prevent us from getting the
- * message out (timerlist_lock is acquired through the
+ * message out (the timer locks are acquired through the
  * console unblank code)
  */
 void bust_spinlocks(int yes)
 {
-	spin_lock_init(&timerlist_lock);
+	bust_timer_locks();
 	if (yes) {
 		oops_in_progress = 1;
 #ifdef CONFIG_SMP
@@ -227,13 +227,13 @@ static int cciss_proc_get_info(char *buffer, char **start, off_t offset,
 	unsigned long flags;
 	unsigned int vol_sz, vol_sz_frac;
 
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	if (h->busy_configuring) {
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 		return -EBUSY;
 	}
 	h->busy_configuring = 1;
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 		
 	ctlr = h->ctlr;
 	size = sprintf(buffer, "%s: HP %s Controller\n"
@@ -768,10 +768,10 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 			return -EINVAL;
 		}
 
-		spin_lock_irqsave(&io_request_lock, flags);
+		spin_lock_irqsave(CCISS_LOCK(ctlr), flags);
 		/* Can only safely update if no commands outstanding */ 
 		if (c->commands_outstanding > 0 ) {
-			spin_unlock_irqrestore(&io_request_lock, flags);
+			spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 			return -EINVAL;
 		}
 		/* Update the field, and then ring the doorbell */ 
@@ -788,7 +788,7 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 			/* delay and try again */
 			udelay(1000);
 		}	
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 		if (i >= MAX_IOCTL_CONFIG_WAIT)
 			/* there is an unlikely case where this can happen,
 			 * involving hot replacing a failed 144 GB drive in a 
@@ -825,7 +825,7 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 		if (copy_from_user(NodeName, (void *) arg, sizeof( NodeName_type)))
 			return -EFAULT;
 
-		spin_lock_irqsave(&io_request_lock, flags);
+		spin_lock_irqsave(CCISS_LOCK(ctlr), flags);
 
 			/* Update the field, and then ring the doorbell */ 
 		for(i=0;i<16;i++)
@@ -840,7 +840,7 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 			/* delay and try again */
 			udelay(1000);
 		}	
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 		if (i >= MAX_IOCTL_CONFIG_WAIT)
 			/* there is an unlikely case where this can happen,
 			 * involving hot replacing a failed 144 GB drive in a 
@@ -1014,11 +1014,11 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 		c->waiting = &wait;
 
 		/* Put the request on the tail of the request queue */
-		spin_lock_irqsave(&io_request_lock, flags);
+		spin_lock_irqsave(CCISS_LOCK(ctlr), flags);
 		addQ(&h->reqQ, c);
 		h->Qdepth++;
 		start_io(h);
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 
 		wait_for_completion(&wait);
 
@@ -1149,11 +1149,11 @@ static int cciss_ioctl(struct inode *inode, struct file *filep,
 	}
 	c->waiting = &wait;
 	/* Put the request on the tail of the request queue */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(CCISS_LOCK(ctlr), flags);
 	addQ(&h->reqQ, c);
 	h->Qdepth++;
 	start_io(h);
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 	wait_for_completion(&wait);
 	/* unlock the buffers from DMA */
 	for(i=0; i< sg_used; i++) {
@@ -1214,16 +1214,16 @@ static int revalidate_logvol(kdev_t dev, int maxusage)
 	ctlr = map_major_to_ctlr[MAJOR(dev)];
         gdev = &(hba[ctlr]->gendisk);
 
-        spin_lock_irqsave(&io_request_lock, flags);
+        spin_lock_irqsave(CCISS_LOCK(ctlr), flags);
         if (hba[ctlr]->drv[target].usage_count > maxusage) {
-                spin_unlock_irqrestore(&io_request_lock, flags);
+                spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
                 printk(KERN_WARNING "cciss: Device busy for "
                         "revalidation (usage=%d)\n",
                         hba[ctlr]->drv[target].usage_count);
                 return -EBUSY;
         }
         hba[ctlr]->drv[target].usage_count++;
-        spin_unlock_irqrestore(&io_request_lock, flags);
+        spin_unlock_irqrestore(CCISS_LOCK(ctlr), flags);
 
         max_p = gdev->max_p;
         start = target << gdev->minor_shift;
@@ -1261,14 +1261,14 @@ static int deregister_disk(int ctlr, int logvol)
 	if (!capable(CAP_SYS_RAWIO))
 		return -EPERM;
 
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	/* make sure logical volume is NOT is use */
 	if (h->drv[logvol].usage_count > 1 || h->busy_configuring) {
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 		return -EBUSY;
 	}
 	h->busy_configuring = 1;
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 
 	/* invalidate the devices and deregister the disk */
 	max_p = gdev->max_p;
@@ -1428,11 +1428,11 @@ static int sendcmd_withirq(__u8	cmd,
 resend_cmd2:
 	c->waiting = &wait;
 	/* Put the request on the tail of the queue and send it */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	addQ(&h->reqQ, c);
 	h->Qdepth++;
 	start_io(h);
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 
 	wait_for_completion(&wait);
 
@@ -1540,17 +1540,17 @@ static int register_new_disk(int ctlr, int opened_vol, __u64 requested_lun)
 	if (!capable(CAP_SYS_RAWIO))
 		return -EPERM;
 	/* if we have no space in our disk array left to add anything */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	if (h->num_luns >= CISS_MAX_LUN) {
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 		return -EINVAL;
 	}
 	if (h->busy_configuring) {
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 		return -EBUSY;
 	}
 	h->busy_configuring = 1;
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 
 	ld_buff = kmalloc(sizeof(ReportLunData_struct), GFP_KERNEL);
 	if (ld_buff == NULL) {
@@ -2205,7 +2205,7 @@ static inline void complete_buffers( struct buffer_head *bh, int status)
 		bh = xbh;
 	}
 } 
-/* This code assumes io_request_lock is already held */
+/* This code assumes the controller lock is already held */
 /* Zeros out the error record and then resends the command back */
 /* to the controller */ 
 static inline void resend_cciss_cmd( ctlr_info_t *h, CommandList_struct *c)
@@ -2397,7 +2397,7 @@ static int cpq_merge_requests_fn(request_queue_t *q, struct request *rq,
  * Get a request and submit it to the controller. 
  * Currently we do one request at a time.  Ideally we would like to send
  * everything to the controller on the first call, but there is a danger
- * of holding the io_request_lock for to long.  
+ * of holding the controller lock for to long.  
  */
 static void do_cciss_request(request_queue_t *q)
 {
@@ -2446,7 +2446,7 @@ next:
 
 	blkdev_dequeue_request(creq);
 
-	spin_unlock_irq(&io_request_lock);
+	spin_unlock_irq(&h->lock);
 
 	c->cmd_type = CMD_RWREQ;      
 	c->rq = creq;
@@ -2524,7 +2524,7 @@ next:
 	c->Request.CDB[8]= creq->nr_sectors & 0xff; 
 	c->Request.CDB[9] = c->Request.CDB[11] = c->Request.CDB[12] = 0;
 
-	spin_lock_irq(&io_request_lock);
+	spin_lock_irq(&h->lock);
 
 	addQ(&(h->reqQ),c);
 	h->Qdepth++;
@@ -2553,7 +2553,7 @@ static void do_cciss_intr(int irq, void *dev_id, struct pt_regs *regs)
 	 * If there are completed commands in the completion queue,
 	 * we had better do something about it.
 	 */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	while( h->access.intr_pending(h)) {
 		while((a = h->access.command_completed(h)) != FIFO_EMPTY) {
 			a1 = a;
@@ -2591,7 +2591,7 @@ static void do_cciss_intr(int irq, void *dev_id, struct pt_regs *regs)
 	 * See if we can queue up some more IO
 	 */
 	do_cciss_request(BLK_DEFAULT_QUEUE(h->major));
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 }
 /* 
  *  We cannot read the structure directly, for portablity we must use 
@@ -3076,7 +3076,7 @@ static void fail_all_cmds(unsigned long ctlr)
 	printk(KERN_WARNING "cciss%d: controller not responding.\n", h->ctlr);
 	h->alive = 0;	/* the controller apparently died... */ 
 
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 
 	pci_disable_device(h->pdev); /* Make sure it is really dead. */
 
@@ -3100,7 +3100,7 @@ static void fail_all_cmds(unsigned long ctlr)
 				complete_scsi_command(c, 0, 0);
 #		endif
 	}
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 	return;
 }
 static int cciss_monitor(void *ctlr)
@@ -3160,10 +3160,10 @@ static int cciss_monitor(void *ctlr)
 			break;
 	}
 	printk(KERN_INFO "%s exiting.\n", current->comm);
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	h->monitor_started = 0;
 	h->monitor_thread = NULL;
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 	return 0;
 }
 static int start_monitor_thread(ctlr_info_t *h, unsigned char *cmd, 
@@ -3174,14 +3174,14 @@ static int start_monitor_thread(ctlr_info_t *h, unsigned char *cmd,
 
 	if (strncmp("monitor", cmd, 7) == 0) {
 		new_period = simple_strtol(cmd + 8, NULL, 10);
-		spin_lock_irqsave(&io_request_lock, flags);
+		spin_lock_irqsave(&h->lock, flags);
 		new_deadline = h->monitor_deadline;
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 	} else if (strncmp("deadline", cmd, 8) == 0) {
 		new_deadline = simple_strtol(cmd + 9, NULL, 10);
-		spin_lock_irqsave(&io_request_lock, flags);
+		spin_lock_irqsave(&h->lock, flags);
 		new_period = h->monitor_period;
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 	} else
 		return -1;
 	if (new_period != 0 && new_period < CCISS_MIN_PERIOD)
@@ -3192,13 +3192,13 @@ static int start_monitor_thread(ctlr_info_t *h, unsigned char *cmd,
 		new_deadline = new_period - 5;
 		printk(KERN_INFO "setting deadline to %d\n", new_deadline);
 	}
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&h->lock, flags);
 	if (h->monitor_started != 0)  {
 		old_period = h->monitor_period;
 		old_deadline = h->monitor_deadline;
 		h->monitor_period = new_period;
 		h->monitor_deadline = new_deadline;
-		spin_unlock_irqrestore(&io_request_lock, flags);
+		spin_unlock_irqrestore(&h->lock, flags);
 		if (new_period == 0) {
 			printk(KERN_INFO "cciss%d: stopping monitor thread\n",
 				h->ctlr);
@@ -3219,7 +3219,7 @@ static int start_monitor_thread(ctlr_info_t *h, unsigned char *cmd,
 	h->monitor_started = 1;
 	h->monitor_period = new_period;
 	h->monitor_deadline = new_deadline;
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&h->lock, flags);
 	kernel_thread(cciss_monitor, h, 0);
 	*rc = count;
 	return 0;
@@ -3260,6 +3260,7 @@ static int __init cciss_init_one(struct pci_dev *pdev,
 	}
 	sprintf(hba[i]->devname, "cciss%d", i);
 	hba[i]->ctlr = i;
+	spin_lock_init(&hba[i]->lock);
 
 	/* register with the major number, or get a dynamic major number */
 	/* by passing 0 as argument */
@@ -3356,6 +3357,7 @@ static int __init cciss_init_one(struct pci_dev *pdev,
 	q = BLK_DEFAULT_QUEUE(hba[i]->major);
 	q->queuedata = hba[i];
 	blk_init_queue(q, do_cciss_request);
+	blk_queue_lock(q, CCISS_LOCK(i));
 	blk_queue_bounce_limit(q, hba[i]->pdev->dma_mask);
 	blk_queue_headactive(q, 0);		
 
@@ -18,6 +18,8 @@
 struct ctlr_info;
 typedef struct ctlr_info ctlr_info_t;
 
+#define CCISS_LOCK(ctlr)	(&hba[ctlr]->lock)
+
 struct access_method {
 	void (*submit_command)(ctlr_info_t *h, CommandList_struct *c);
 	void (*set_intr_mask)(ctlr_info_t *h, unsigned long val);
@@ -71,6 +73,7 @@ struct ctlr_info
 	unsigned int Qdepth;
 	unsigned int maxQsinceinit;
 	unsigned int maxSG;
+	spinlock_t lock;	/* the request queue, reqQ and cmpQ */
 
 	//* pointers to command and error info pool */ 
 	CommandList_struct 	*cmd_pool;
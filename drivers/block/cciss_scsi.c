@@ -893,11 +893,11 @@ cciss_scsi_do_simple_cmd(ctlr_info_t *c,
 	cp->waiting = &wait;
 
 	/* Put the request on the tail of the request queue */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(&c->lock, flags);
 	addQ(&c->reqQ, cp);
 	c->Qdepth++;
 	start_io(c);
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(&c->lock, flags);
 
 	wait_for_completion(&wait);
 
@@ -1380,8 +1380,12 @@ cciss_scsi_queue_command (Scsi_Cmnd *cmd, void (* done)(Scsi_Cmnd *))
 	/* Ok, we have a reasonable scsi nexus, so send the cmd down, and
 		see what the device thinks of it. */
 
+	/* the SCSI midlayer holds io_request_lock, the block half of the
+	   driver (and its interrupt handler) the controller lock */
+	spin_lock(&(*c)->lock);
 	cp = scsi_cmd_alloc(*c);
 	if (cp == NULL) {			/* trouble... */
+		spin_unlock(&(*c)->lock);
 		printk("scsi_cmd_alloc returned NULL!\n");
 		/* FIXME: next 3 lines are -> BAD! <- */
 		cmd->result = DID_NO_CONNECT << 16;
@@ -1446,6 +1450,7 @@ cciss_scsi_queue_command (Scsi_Cmnd *cmd, void (* done)(Scsi_Cmnd *))
 	addQ(&(*c)->reqQ, cp);
 	(*c)->Qdepth++;
 	start_io(*c);
+	spin_unlock(&(*c)->lock);
 
 	/* the cmd'll come back via intr handler in complete_scsi_command()  */
 	return 0;
@@ -18,6 +18,14 @@
  * Removed tests for max-bomb-segments, which was breaking elvtune
  *  when run without -bN
  *
+ * Deadline and anticipatory elevators, selectable per queue at runtime
+ * through BLKELVSET or /proc/elevator.  Instead of sorting into
+ * queue_head they keep requests on lists of their own, and hand the
+ * driver the next one whenever queue_head runs empty:
+ * - elevator_add_req_fn, takes a new request
+ * - elevator_next_req_fn, picks the request to give the driver next
+ * - elevator_completed_req_fn, called when a request has completed
+ *
  */
 
 #include <linux/fs.h>
@@ -25,6 +33,10 @@
 #include <linux/elevator.h>
 #include <linux/blk.h>
 #include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/genhd.h>
 #include <asm/uaccess.h>
 
 /*
@@ -180,6 +192,520 @@ int elevator_noop_merge(request_queue_t *q, struct request **req,
 
 void elevator_noop_merge_req(struct request *req, struct request *next) {}
 
+/*
+ * The deadline elevator.  Requests are kept sorted by sector, one list
+ * for reads and one for writes, and are dispatched in one-way elevator
+ * order in batches of DEADLINE_FIFO_BATCH from one direction.  Each
+ * new batch goes to reads, unless writes have been passed over
+ * DEADLINE_WRITES_STARVED times; it starts at the oldest request if
+ * that has been waiting longer than its expiry time (read_latency or
+ * write_latency milliseconds), else where the last one left off.
+ *
+ * The anticipatory elevator is deadline plus one thing: when a read
+ * has been dispatched, it keeps the disk idle for a short while after
+ * the read has completed, waiting for the same process to ask for a
+ * nearby read, rather than seeking away to serve somebody else.  A
+ * process reading a file sequentially thus isn't broken up by a stream
+ * of writeback, which used to starve synchronous reads for seconds.
+ *
+ * All of it runs under the queue lock.
+ */
+#define DEADLINE_FIFO_BATCH	16
+#define DEADLINE_WRITES_STARVED	2
+
+/* How long to wait for the next read, about 10ms */
+#define AS_ANTIC_EXPIRE		(HZ / 100 + 1)
+/* How far from the last read a read is close enough to go first */
+#define AS_CLOSE_SECTORS	2048
+
+#define AS_NONE		0	/* not anticipating */
+#define AS_WAIT_REQ	1	/* waiting for the last read to complete */
+#define AS_WAIT_NEXT	2	/* waiting for the next read */
+
+struct deadline_data {
+	request_queue_t *q;
+
+	struct list_head sort_list[2];	/* by device and sector */
+	struct list_head fifo_list[2];	/* by age */
+	struct request *next_rq[2];	/* where the elevator goes on */
+
+	int last_dir;
+	kdev_t last_dev;
+	unsigned long last_sector;
+	int batching;			/* requests in this batch */
+	int starved;			/* read batches while writes waited */
+
+	/* anticipatory only */
+	int antic_status;
+	pid_t antic_pid;		/* 0 unless the last one was a read */
+	struct request *antic_rq;	/* the last read, until it completes */
+	struct timer_list antic_timer;
+};
+
+#define DL_NEW_BATCH	1
+#define DL_EXPIRED	2
+
+static inline unsigned long deadline_expire(elevator_t *e, int dir)
+{
+	unsigned long ms = dir == READ ? e->read_latency : e->write_latency;
+
+	return (ms * HZ + 999) / 1000;
+}
+
+static inline int deadline_fifo_expired(struct deadline_data *dd, int dir)
+{
+	struct request *rq;
+
+	if (list_empty(&dd->fifo_list[dir]))
+		return 0;
+	rq = list_entry(dd->fifo_list[dir].next, struct request, fifo);
+	return time_after_eq(jiffies, rq->start_time +
+			     deadline_expire(&dd->q->elevator, dir));
+}
+
+/* Is @rq at or beyond where the last request left the disk head? */
+static inline int deadline_after_last(struct deadline_data *dd,
+				      struct request *rq)
+{
+	if (rq->rq_dev != dd->last_dev)
+		return rq->rq_dev > dd->last_dev;
+	return rq->sector >= dd->last_sector;
+}
+
+static struct request *deadline_sort_next(struct deadline_data *dd,
+					  struct request *rq)
+{
+	struct list_head *next = rq->queue.next;
+
+	if (next == &dd->sort_list[rq_data_dir(rq)])
+		return NULL;
+	return blkdev_entry_to_request(next);
+}
+
+struct list_head *elevator_deadline_list(request_queue_t *q,
+					 struct request *rq)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+
+	return &dd->sort_list[rq_data_dir(rq)];
+}
+
+int elevator_deadline_merge(request_queue_t *q, struct request **req,
+			    struct list_head * head,
+			    struct buffer_head *bh, int rw,
+			    int max_sectors)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+	struct list_head *sort = &dd->sort_list[rw], *entry = sort;
+	unsigned int count = bh->b_size >> 9;
+
+	while ((entry = entry->prev) != sort) {
+		struct request *__rq = blkdev_entry_to_request(entry);
+
+		if (__rq->rq_dev != bh->b_rdev)
+			continue;
+		if (__rq->nr_sectors + count > max_sectors)
+			continue;
+		if (__rq->waiting)
+			continue;
+		if (__rq->sector + __rq->nr_sectors == bh->b_rsector) {
+			*req = __rq;
+			return ELEVATOR_BACK_MERGE;
+		} else if (__rq->sector - count == bh->b_rsector) {
+			*req = __rq;
+			return ELEVATOR_FRONT_MERGE;
+		}
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+/*
+ * @next is about to be merged into @req, which comes right before it:
+ * @req takes over the earlier of the two FIFO positions.
+ */
+void elevator_deadline_merge_req(struct request *req, struct request *next)
+{
+	request_queue_t *q = req->q;
+	struct deadline_data *dd = q->elevator.elevator_data;
+	int dir = rq_data_dir(req);
+
+	if (time_before(next->start_time, req->start_time)) {
+		list_del(&req->fifo);
+		list_add(&req->fifo, &next->fifo);
+	}
+	list_del(&next->fifo);
+	if (dd->next_rq[dir] == next)
+		dd->next_rq[dir] = req;
+	q->elevator.nr_queued--;
+}
+
+void elevator_deadline_add_req(request_queue_t *q, struct request *rq)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+	int dir = rq_data_dir(rq);
+	struct list_head *sort = &dd->sort_list[dir], *entry = sort;
+	struct request *next = dd->next_rq[dir];
+
+	while ((entry = entry->prev) != sort)
+		if (IN_ORDER(blkdev_entry_to_request(entry), rq))
+			break;
+	list_add(&rq->queue, entry);
+	list_add_tail(&rq->fifo, &dd->fifo_list[dir]);
+	q->elevator.nr_queued++;
+
+	if (deadline_after_last(dd, rq) && (!next || IN_ORDER(rq, next)))
+		dd->next_rq[dir] = rq;
+}
+
+/*
+ * The request deadline would dispatch next.  Nothing is changed, so
+ * that the anticipatory elevator can still decide to wait instead.
+ */
+static struct request *deadline_choose(struct deadline_data *dd, int *flags)
+{
+	int reads = !list_empty(&dd->sort_list[READ]);
+	int writes = !list_empty(&dd->sort_list[WRITE]);
+	struct request *rq;
+	int dir;
+
+	*flags = 0;
+	rq = dd->next_rq[dd->last_dir];
+	if (rq && dd->batching < DEADLINE_FIFO_BATCH)
+		return rq;
+
+	if (reads && !(writes && dd->starved >= DEADLINE_WRITES_STARVED))
+		dir = READ;
+	else if (writes)
+		dir = WRITE;
+	else
+		return NULL;
+
+	*flags = DL_NEW_BATCH;
+	if (deadline_fifo_expired(dd, dir)) {
+		*flags |= DL_EXPIRED;
+		return list_entry(dd->fifo_list[dir].next, struct request, fifo);
+	}
+
+	rq = dd->next_rq[dir];
+	if (!rq)
+		rq = blkdev_entry_next_request(&dd->sort_list[dir]);
+	return rq;
+}
+
+static struct request *deadline_dispatch(struct deadline_data *dd,
+					 struct request *rq, int flags)
+{
+	elevator_t *e = &dd->q->elevator;
+	int dir = rq_data_dir(rq);
+
+	if (flags & DL_NEW_BATCH) {
+		dd->batching = 0;
+		if (dir == READ && !list_empty(&dd->sort_list[WRITE]))
+			dd->starved++;
+		else
+			dd->starved = 0;
+	}
+	if (flags & DL_EXPIRED)
+		e->nr_expired++;
+
+	dd->next_rq[dir] = deadline_sort_next(dd, rq);
+	list_del(&rq->queue);
+	list_del(&rq->fifo);
+	e->nr_queued--;
+
+	dd->last_dir = dir;
+	dd->last_dev = rq->rq_dev;
+	dd->last_sector = rq->sector + rq->nr_sectors;
+	dd->batching++;
+	return rq;
+}
+
+struct request *elevator_deadline_next_req(request_queue_t *q)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+	struct request *rq;
+	int flags;
+
+	rq = deadline_choose(dd, &flags);
+	if (rq)
+		rq = deadline_dispatch(dd, rq, flags);
+	return rq;
+}
+
+/* Hand everything over to queue_head, reads first */
+void elevator_deadline_drain(request_queue_t *q)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+	int dir;
+
+	for (dir = READ; dir <= WRITE; dir++) {
+		list_splice(&dd->sort_list[dir], q->queue_head.prev);
+		INIT_LIST_HEAD(&dd->sort_list[dir]);
+		INIT_LIST_HEAD(&dd->fifo_list[dir]);
+		dd->next_rq[dir] = NULL;
+	}
+	q->elevator.nr_queued = 0;
+
+	dd->antic_status = AS_NONE;
+	dd->antic_pid = 0;
+	dd->antic_rq = NULL;
+	del_timer(&dd->antic_timer);
+}
+
+static void as_antic_timeout(unsigned long data);
+
+int elevator_deadline_init(request_queue_t *q, elevator_t *e)
+{
+	struct deadline_data *dd;
+	int dir;
+
+	dd = kmalloc(sizeof(*dd), GFP_KERNEL);
+	if (!dd)
+		return -ENOMEM;
+	memset(dd, 0, sizeof(*dd));
+
+	dd->q = q;
+	for (dir = READ; dir <= WRITE; dir++) {
+		INIT_LIST_HEAD(&dd->sort_list[dir]);
+		INIT_LIST_HEAD(&dd->fifo_list[dir]);
+	}
+	init_timer(&dd->antic_timer);
+	dd->antic_timer.function = as_antic_timeout;
+	dd->antic_timer.data = (unsigned long) dd;
+
+	e->elevator_data = dd;
+	return 0;
+}
+
+void elevator_deadline_exit(elevator_t *e)
+{
+	struct deadline_data *dd = e->elevator_data;
+
+	del_timer_sync(&dd->antic_timer);
+	kfree(dd);
+}
+
+static void as_antic_stop(struct deadline_data *dd)
+{
+	dd->antic_status = AS_NONE;
+	dd->antic_pid = 0;
+	del_timer(&dd->antic_timer);
+}
+
+/* Is it worth seeking away from the last read to do @rq? */
+static inline int as_antic_close(struct deadline_data *dd, struct request *rq)
+{
+	unsigned long delta;
+
+	if (rq_data_dir(rq) != READ)
+		return 0;
+	if (rq->pid == dd->antic_pid)
+		return 1;
+	if (rq->rq_dev != dd->last_dev)
+		return 0;
+	if (rq->sector > dd->last_sector)
+		delta = rq->sector - dd->last_sector;
+	else
+		delta = dd->last_sector - rq->sector;
+	return delta <= AS_CLOSE_SECTORS;
+}
+
+/*
+ * Should the disk stay idle rather than take on @rq?  Yes while the
+ * process of the last read may still come back with another one
+ * nearby, unless a request has waited too long already.
+ */
+static int as_antic_wait(struct deadline_data *dd, struct request *rq)
+{
+	if (!dd->antic_pid || as_antic_close(dd, rq) ||
+	    deadline_fifo_expired(dd, READ) ||
+	    deadline_fifo_expired(dd, WRITE)) {
+		as_antic_stop(dd);
+		return 0;
+	}
+
+	if (dd->antic_status == AS_NONE) {
+		/*
+		 * The wait proper only starts once the read is done; a
+		 * read which never completes gives up after read expiry
+		 */
+		if (dd->antic_rq) {
+			dd->antic_status = AS_WAIT_REQ;
+			mod_timer(&dd->antic_timer, jiffies +
+				  deadline_expire(&dd->q->elevator, READ));
+		} else {
+			dd->antic_status = AS_WAIT_NEXT;
+			mod_timer(&dd->antic_timer, jiffies + AS_ANTIC_EXPIRE);
+		}
+	}
+	return 1;
+}
+
+static void as_antic_timeout(unsigned long data)
+{
+	struct deadline_data *dd = (struct deadline_data *) data;
+	unsigned long flags;
+
+	spin_lock_irqsave(dd->q->queue_lock, flags);
+	if (dd->antic_status != AS_NONE) {
+		dd->antic_status = AS_NONE;
+		dd->antic_pid = 0;
+		elevator_start(dd->q);
+	}
+	spin_unlock_irqrestore(dd->q->queue_lock, flags);
+}
+
+void elevator_as_add_req(request_queue_t *q, struct request *rq)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+
+	elevator_deadline_add_req(q, rq);
+
+	/* the read we have been waiting for: go for it straight away */
+	if (dd->antic_status != AS_NONE && as_antic_close(dd, rq)) {
+		as_antic_stop(dd);
+		dd->next_rq[READ] = rq;
+		dd->last_dir = READ;
+	}
+}
+
+struct request *elevator_as_next_req(request_queue_t *q)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+	struct request *rq;
+	int flags;
+
+	rq = deadline_choose(dd, &flags);
+	if (!rq || as_antic_wait(dd, rq))
+		return NULL;
+
+	rq = deadline_dispatch(dd, rq, flags);
+	if (rq_data_dir(rq) == READ && rq->pid) {
+		dd->antic_pid = rq->pid;
+		dd->antic_rq = rq;
+	} else {
+		dd->antic_pid = 0;
+		dd->antic_rq = NULL;
+	}
+	return rq;
+}
+
+void elevator_as_completed_req(request_queue_t *q, struct request *rq)
+{
+	struct deadline_data *dd = q->elevator.elevator_data;
+
+	if (rq != dd->antic_rq)
+		return;
+	dd->antic_rq = NULL;
+	if (dd->antic_status == AS_WAIT_REQ) {
+		dd->antic_status = AS_WAIT_NEXT;
+		mod_timer(&dd->antic_timer, jiffies + AS_ANTIC_EXPIRE);
+	}
+}
+
+/*
+ * Move the next request the elevator holds back onto queue_head, for
+ * the driver to find.  Called with the queue lock held whenever
+ * queue_head has run empty.
+ */
+void elevator_dispatch(request_queue_t *q)
+{
+	elevator_t *e = &q->elevator;
+	struct request *rq;
+
+	if (!e->elevator_next_req_fn || !e->nr_queued)
+		return;
+	rq = e->elevator_next_req_fn(q);
+	if (rq)
+		list_add_tail(&rq->queue, &q->queue_head);
+}
+
+/*
+ * The driver may be idle with the elevator holding requests: get it
+ * going.  Called with the queue lock held.
+ */
+void elevator_start(request_queue_t *q)
+{
+	if (q->plugged || !list_empty(&q->queue_head))
+		return;
+	elevator_dispatch(q);
+	if (!list_empty(&q->queue_head))
+		q->request_fn(q);
+}
+
+static int elevator_get_type(int type, elevator_t *elevator)
+{
+	switch (type) {
+	case ELEVATOR_TYPE_NOOP:
+		*elevator = ELEVATOR_NOOP;
+		break;
+	case ELEVATOR_TYPE_LINUS:
+		*elevator = ELEVATOR_LINUS;
+		break;
+	case ELEVATOR_TYPE_DEADLINE:
+		*elevator = ELEVATOR_DEADLINE;
+		break;
+	case ELEVATOR_TYPE_ANTICIPATORY:
+		*elevator = ELEVATOR_ANTICIPATORY;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * elevator_select - switch a queue to another elevator
+ * @q: the queue
+ * @type: ELEVATOR_TYPE_*
+ *
+ * The requests the old elevator holds back are handed to the driver.
+ * Latencies go back to the defaults of the new elevator, statistics
+ * are kept.  May sleep.
+ */
+int elevator_select(request_queue_t *q, int type)
+{
+	elevator_t new, old;
+	unsigned long flags;
+	int was_empty;
+
+	if (elevator_get_type(type, &new))
+		return -EINVAL;
+	if (q->elevator.elevator_type == type)
+		return 0;
+	if (new.elevator_init_fn && new.elevator_init_fn(q, &new))
+		return -ENOMEM;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	old = q->elevator;
+	was_empty = list_empty(&q->queue_head);
+	if (old.elevator_drain_fn)
+		old.elevator_drain_fn(q);
+
+	new.queue_ID = old.queue_ID;
+	new.nr_dispatched = old.nr_dispatched;
+	new.nr_merged = old.nr_merged;
+	new.nr_expired = old.nr_expired;
+	q->elevator = new;
+
+	/* requests held back may just have landed on an idle driver */
+	if (was_empty && !q->plugged && !list_empty(&q->queue_head))
+		q->request_fn(q);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	if (old.elevator_exit_fn)
+		old.elevator_exit_fn(&old);
+	return 0;
+}
+
+/* The queue is going away, with no requests left */
+void elevator_exit(request_queue_t *q)
+{
+	if (q->elevator.elevator_exit_fn)
+		q->elevator.elevator_exit_fn(&q->elevator);
+}
+
 int blkelvget_ioctl(elevator_t * elevator, blkelv_ioctl_arg_t * arg)
 {
 	blkelv_ioctl_arg_t output;
@@ -187,7 +713,7 @@ int blkelvget_ioctl(elevator_t * elevator, blkelv_ioctl_arg_t * arg)
 	output.queue_ID			= elevator->queue_ID;
 	output.read_latency		= elevator->read_latency;
 	output.write_latency		= elevator->write_latency;
-	output.max_bomb_segments	= 0;
+	output.max_bomb_segments	= elevator->elevator_type;
 
 	if (copy_to_user(arg, &output, sizeof(blkelv_ioctl_arg_t)))
 		return -EFAULT;
@@ -195,8 +721,13 @@ int blkelvget_ioctl(elevator_t * elevator, blkelv_ioctl_arg_t * arg)
 	return 0;
 }
 
-int blkelvset_ioctl(elevator_t * elevator, const blkelv_ioctl_arg_t * arg)
+/*
+ * A change of elevator leaves the latencies at the new elevator's
+ * defaults, as those of the old one usually mean something else.
+ */
+int blkelvset_ioctl(request_queue_t * q, const blkelv_ioctl_arg_t * arg)
 {
+	elevator_t *elevator = &q->elevator;
 	blkelv_ioctl_arg_t input;
 
 	if (copy_from_user(&input, arg, sizeof(blkelv_ioctl_arg_t)))
@@ -207,11 +738,19 @@ int blkelvset_ioctl(elevator_t * elevator, const blkelv_ioctl_arg_t * arg)
 	if (input.write_latency < 0)
 		return -EINVAL;
 
+	if (input.max_bomb_segments &&
+	    input.max_bomb_segments != elevator->elevator_type)
+		return elevator_select(q, input.max_bomb_segments);
+
 	elevator->read_latency		= input.read_latency;
 	elevator->write_latency		= input.write_latency;
 	return 0;
 }
 
+/*
+ * Elevators with private data (elevator_init_fn) can only be set up
+ * through elevator_select().
+ */
 void elevator_init(elevator_t * elevator, elevator_t type)
 {
 	static unsigned int queue_ID;
@@ -219,3 +758,136 @@ void elevator_init(elevator_t * elevator, elevator_t type)
 	*elevator = type;
 	elevator->queue_ID = queue_ID++;
 }
+
+#ifdef CONFIG_PROC_FS
+/*
+ * /proc/elevator lists the elevator and statistics of every disk's
+ * queue.  Writing "<disk> <elevator>" to it, as in "hda deadline",
+ * switches the queue of that disk.
+ */
+struct elevator_proc_info {
+	char *page;
+	int len;
+	const char *name;	/* the disk to look for, when writing */
+	kdev_t dev;
+};
+
+static int elevator_proc_show(struct gendisk *gp, void *data)
+{
+	struct elevator_proc_info *info = data;
+	request_queue_t *q;
+	char buf[64];
+	int drive;
+
+	for (drive = 0; drive < gp->nr_real; drive++) {
+		int minor = drive << gp->minor_shift;
+
+		if (info->len > PAGE_SIZE - 128)
+			return 1;
+		q = blk_get_queue(MKDEV(gp->major, minor));
+		if (!q || !q->request_fn)
+			continue;
+		info->len += sprintf(info->page + info->len,
+			"%-12s %-12s %10lu %10lu %10lu\n",
+			disk_name(gp, minor, buf), q->elevator.elevator_name,
+			q->elevator.nr_dispatched, q->elevator.nr_merged,
+			q->elevator.nr_expired);
+	}
+	return 0;
+}
+
+static int elevator_proc_find(struct gendisk *gp, void *data)
+{
+	struct elevator_proc_info *info = data;
+	char buf[64];
+	int drive;
+
+	for (drive = 0; drive < gp->nr_real; drive++) {
+		int minor = drive << gp->minor_shift;
+
+		if (!strcmp(disk_name(gp, minor, buf), info->name)) {
+			info->dev = MKDEV(gp->major, minor);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int elevator_read_proc(char *page, char **start, off_t off,
+			      int count, int *eof, void *data)
+{
+	struct elevator_proc_info info;
+	int len;
+
+	info.page = page;
+	info.len = sprintf(page, "%-12s %-12s %10s %10s %10s\n", "disk",
+			   "elevator", "dispatched", "merged", "expired");
+	walk_gendisk(elevator_proc_show, &info);
+
+	len = info.len;
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+static int elevator_write_proc(struct file *file, const char *buffer,
+			       unsigned long count, void *data)
+{
+	struct elevator_proc_info info;
+	char line[64], *type;
+	request_queue_t *q;
+	elevator_t e;
+	int i, err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EACCES;
+	if (count >= sizeof(line))
+		return -EINVAL;
+	if (copy_from_user(line, buffer, count))
+		return -EFAULT;
+	line[count] = '\0';
+	if (count && line[count - 1] == '\n')
+		line[count - 1] = '\0';
+
+	type = strchr(line, ' ');
+	if (!type)
+		return -EINVAL;
+	*type++ = '\0';
+
+	for (i = ELEVATOR_TYPE_NOOP; !elevator_get_type(i, &e); i++)
+		if (!strcmp(e.elevator_name, type))
+			break;
+	if (elevator_get_type(i, &e))
+		return -EINVAL;
+
+	info.name = line;
+	if (!walk_gendisk(elevator_proc_find, &info))
+		return -ENODEV;
+	q = blk_get_queue(info.dev);
+	if (!q || !q->request_fn)
+		return -ENODEV;
+
+	err = elevator_select(q, i);
+	return err ? err : count;
+}
+
+static int __init elevator_proc_init(void)
+{
+	struct proc_dir_entry *p;
+
+	p = create_proc_entry("elevator", S_IFREG | S_IRUGO | S_IWUSR, NULL);
+	if (p) {
+		p->read_proc = elevator_read_proc;
+		p->write_proc = elevator_write_proc;
+	}
+	return 0;
+}
+
+module_init(elevator_proc_init);
+#endif
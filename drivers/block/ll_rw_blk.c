@@ -24,6 +24,7 @@
 #include <linux/smp_lock.h>
 #include <linux/completion.h>
 #include <linux/bootmem.h>
+#include <linux/bio.h>
 
 #include <asm/system.h>
 #include <asm/io.h>
@@ -192,6 +193,7 @@ void blk_cleanup_queue(request_queue_t * q)
 	if (atomic_read(&q->nr_sectors))
 		printk("blk_cleanup_queue: leaked sectors (%d)\n", atomic_read(&q->nr_sectors));
 
+	elevator_exit(q);
 	memset(q, 0, sizeof(*q));
 }
 
@@ -242,6 +244,26 @@ void blk_queue_throttle_sectors(request_queue_t * q, int active)
 	q->can_throttle = active;
 }
 
+/**
+ * blk_queue_lock - give a queue a lock of its own
+ * @q:       The queue which this applies to.
+ * @lock:    The spin lock which is to protect it
+ *
+ * Description:
+ *    Queues are protected by the global io_request_lock by default, so
+ *    that I/O to one device holds up all the others.  A driver which
+ *    calls blk_queue_lock() right after blk_init_queue() will find
+ *    @lock, rather than io_request_lock, held when its request_fn is
+ *    called, and must take @lock itself where it would otherwise have
+ *    taken io_request_lock: around end_that_request_last() and so on.
+ *    Several queues may share one lock.
+ **/
+
+void blk_queue_lock(request_queue_t * q, spinlock_t * lock)
+{
+	q->queue_lock = lock;
+}
+
 /**
  * blk_queue_make_request - define an alternate make_request function for a device
  * @q:  the request queue for the device to be affected
@@ -379,7 +401,7 @@ static void generic_plug_device(request_queue_t *q, kdev_t dev)
 	/*
 	 * no need to replug device
 	 */
-	if (!list_empty(&q->queue_head) || q->plugged)
+	if (!elevator_queue_empty(q) || q->plugged)
 		return;
 
 	q->plugged = 1;
@@ -393,6 +415,8 @@ static inline void __generic_unplug_device(request_queue_t *q)
 {
 	if (q->plugged) {
 		q->plugged = 0;
+		if (list_empty(&q->queue_head))
+			elevator_dispatch(q);
 		if (!list_empty(&q->queue_head))
 			q->request_fn(q);
 	}
@@ -403,9 +427,9 @@ void generic_unplug_device(void *data)
 	request_queue_t *q = (request_queue_t *) data;
 	unsigned long flags;
 
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(q->queue_lock, flags);
 	__generic_unplug_device(q);
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
 /** blk_grow_request_list
@@ -429,7 +453,7 @@ int blk_grow_request_list(request_queue_t *q, int nr_requests, int max_queue_sec
 	 * this causes system hangs during boot.
 	 * As a temporary fix, make the function non-blocking.
 	 */
-	spin_lock_irqsave(&io_request_lock, flags);
+	spin_lock_irqsave(q->queue_lock, flags);
 	while (q->nr_requests < nr_requests) {
 		struct request *rq;
 
@@ -460,7 +484,7 @@ int blk_grow_request_list(request_queue_t *q, int nr_requests, int max_queue_sec
  	BUG_ON(!q->batch_sectors);
  	atomic_set(&q->nr_sectors, 0);
 
-	spin_unlock_irqrestore(&io_request_lock, flags);
+	spin_unlock_irqrestore(q->queue_lock, flags);
 	return q->nr_requests;
 }
 
@@ -471,6 +495,7 @@ static void blk_init_free_list(request_queue_t *q)
  	int nr_requests, max_queue_sectors = MAX_QUEUE_SECTORS;
   
  	INIT_LIST_HEAD(&q->rq.free);
+	q->queue_lock = &io_request_lock;
 	q->rq.count = 0;
 	q->rq.pending[READ] = q->rq.pending[WRITE] = 0;
 	q->nr_requests = 0;
@@ -489,8 +514,6 @@ static void blk_init_free_list(request_queue_t *q)
  	blk_grow_request_list(q, nr_requests, max_queue_sectors);
 
  	init_waitqueue_head(&q->wait_for_requests);
-
-	spin_lock_init(&q->queue_lock);
 }
 
 static int __make_request(request_queue_t * q, int rw, struct buffer_head * bh);
@@ -516,8 +539,9 @@ static int __make_request(request_queue_t * q, int rw, struct buffer_head * bh);
  *    requests on the queue, it is responsible for arranging that the requests
  *    get dealt with eventually.
  *
- *    A global spin lock $io_request_lock must be held while manipulating the
- *    requests on the request queue.
+ *    The queue's spin lock, q->queue_lock, must be held while manipulating
+ *    the requests on the request queue.  It is the global $io_request_lock
+ *    unless the driver hands in a lock of its own with blk_queue_lock().
  *
  *    The request on the head of the queue is by default assumed to be
  *    potentially active, and it is not considered for re-ordering or merging
@@ -558,7 +582,7 @@ void blk_init_queue(request_queue_t * q, request_fn_proc * rfn)
 
 #define blkdev_free_rq(list) list_entry((list)->next, struct request, queue);
 /*
- * Get a free request. io_request_lock must be held and interrupts
+ * Get a free request. q->queue_lock must be held and interrupts
  * disabled on the way in.  Returns NULL if there are no free requests.
  */
 static struct request *get_request(request_queue_t *q, int rw)
@@ -649,15 +673,15 @@ static struct request *__get_request_wait(request_queue_t *q, int rw)
 
 	do {
 		set_current_state(TASK_UNINTERRUPTIBLE);
-		spin_lock_irq(&io_request_lock);
+		spin_lock_irq(q->queue_lock);
 		if (blk_oversized_queue(q) || q->rq.count == 0) {
 			__generic_unplug_device(q);
-			spin_unlock_irq(&io_request_lock);
+			spin_unlock_irq(q->queue_lock);
 			schedule();
-			spin_lock_irq(&io_request_lock);
+			spin_lock_irq(q->queue_lock);
 		}
 		rq = get_request(q, rw);
-		spin_unlock_irq(&io_request_lock);
+		spin_unlock_irq(q->queue_lock);
 	} while (rq == NULL);
 	remove_wait_queue(&q->wait_for_requests, &wait);
 	current->state = TASK_RUNNING;
@@ -860,7 +884,7 @@ EXPORT_SYMBOL(req_finished_io);
 
 /*
  * add-request adds a request to the linked list.
- * io_request_lock is held and interrupts disabled, as we muck with the
+ * q->queue_lock is held and interrupts disabled, as we muck with the
  * request queue list.
  *
  * By this point, req->cmd is always either READ/WRITE, never READA,
@@ -871,8 +895,18 @@ static inline void add_request(request_queue_t * q, struct request * req,
 {
 	drive_stat_acct(req->rq_dev, req->cmd, req->nr_sectors, 1);
 
+	/*
+	 * the elevator keeps the request to itself, but the driver may
+	 * be idle waiting for one
+	 */
+	if (q->elevator.elevator_add_req_fn) {
+		q->elevator.elevator_add_req_fn(q, req);
+		elevator_start(q);
+		return;
+	}
+
 	if (!q->plugged && q->head_active && insert_here == &q->queue_head) {
-		spin_unlock_irq(&io_request_lock);
+		spin_unlock_irq(q->queue_lock);
 		BUG();
 	}
 
@@ -884,7 +918,7 @@ static inline void add_request(request_queue_t * q, struct request * req,
 }
 
 /*
- * Must be called with io_request_lock held and interrupts disabled
+ * Must be called with the queue lock held and interrupts disabled
  */
 void blkdev_release_request(struct request *req)
 {
@@ -952,6 +986,7 @@ static void attempt_merge(request_queue_t * q,
 		return;
 
 	q->elevator.elevator_merge_req_fn(req, next);
+	q->elevator.nr_merged++;
 	
 	/* At this point we have either done a back merge
 	 * or front merge. We need the smaller start_time of
@@ -973,12 +1008,25 @@ static void attempt_merge(request_queue_t * q,
 	blkdev_release_request(next);
 }
 
+/*
+ * The list @req is sorted on: queue_head (starting at @head, past an
+ * active request), or the elevator's own if it holds requests back.
+ */
+static inline struct list_head *req_sort_head(request_queue_t * q,
+					      struct request *req,
+					      struct list_head *head)
+{
+	if (q->elevator.elevator_list_fn)
+		return q->elevator.elevator_list_fn(q, req);
+	return head;
+}
+
 static inline void attempt_back_merge(request_queue_t * q,
 				      struct request *req,
 				      int max_sectors,
 				      int max_segments)
 {
-	if (&req->queue == q->queue_head.prev)
+	if (req->queue.next == req_sort_head(q, req, &q->queue_head))
 		return;
 	attempt_merge(q, req, max_sectors, max_segments);
 }
@@ -992,7 +1040,7 @@ static inline void attempt_front_merge(request_queue_t * q,
 	struct list_head * prev;
 
 	prev = req->queue.prev;
-	if (head == prev)
+	if (req_sort_head(q, req, head) == prev)
 		return;
 	attempt_merge(q, blkdev_entry_to_request(prev), max_sectors, max_segments);
 }
@@ -1055,12 +1103,12 @@ static int __make_request(request_queue_t * q, int rw,
 	 * Now we acquire the request spinlock, we have to be mega careful
 	 * not to schedule or do something nonatomic
 	 */
-	spin_lock_irq(&io_request_lock);
+	spin_lock_irq(q->queue_lock);
 
 again:
 	insert_here = head->prev;
 
-	if (list_empty(head)) {
+	if (elevator_queue_empty(q)) {
 		q->plug_device_fn(q, bh->b_rdev); /* is atomic */
 		goto get_rq;
 	} else if (q->head_active && !q->plugged)
@@ -1081,6 +1129,7 @@ again:
 			blk_started_sectors(req, count);
 			drive_stat_acct(req->rq_dev, req->cmd, count, 0);
 			req_new_io(req, 1, count);
+			elevator->nr_merged++;
 			attempt_back_merge(q, req, max_sectors, max_segments);
 			goto out;
 
@@ -1104,6 +1153,7 @@ again:
 			blk_started_sectors(req, count);
 			drive_stat_acct(req->rq_dev, req->cmd, count, 0);
 			req_new_io(req, 1, count);
+			elevator->nr_merged++;
 			attempt_front_merge(q, head, req, max_sectors, max_segments);
 			goto out;
 
@@ -1135,7 +1185,7 @@ get_rq:
 		 */
 		if (rw_ahead) {
 			if (q->rq.count < q->batch_requests || blk_oversized_queue_batch(q)) {
-				spin_unlock_irq(&io_request_lock);
+				spin_unlock_irq(q->queue_lock);
 				goto end_io;
 			}
 			req = get_request(q, rw);
@@ -1144,10 +1194,10 @@ get_rq:
 		} else {
 			req = get_request(q, rw);
 			if (req == NULL) {
-				spin_unlock_irq(&io_request_lock);
+				spin_unlock_irq(q->queue_lock);
 				freereq = __get_request_wait(q, rw);
 				head = &q->queue_head;
-				spin_lock_irq(&io_request_lock);
+				spin_lock_irq(q->queue_lock);
 				should_wake = 1;
 				goto again;
 			}
@@ -1169,6 +1219,7 @@ get_rq:
 	req->bhtail = bh;
 	req->rq_dev = bh->b_rdev;
 	req->start_time = jiffies;
+	req->pid = current->pid;
 	req_new_io(req, 0, count);
 	blk_started_io(count);
 	blk_started_sectors(req, count);
@@ -1180,13 +1231,173 @@ out:
 		get_request_wait_wakeup(q, rw);
 	if (sync)
 		__generic_unplug_device(q);
-	spin_unlock_irq(&io_request_lock);
+	spin_unlock_irq(q->queue_lock);
 	return 0;
 end_io:
 	bh->b_end_io(bh, test_bit(BH_Uptodate, &bh->b_state));
 	return 0;
 }
 
+/*
+ * Account for, and queue, the request a bio has been building up:
+ * @req was either found by the elevator (@merged), or is new and goes
+ * in at @insert_here.  @sectors is what the bio added to it.
+ */
+static void bio_end_request(request_queue_t * q, struct request *req,
+			    int merged, int sectors,
+			    struct list_head *insert_here,
+			    int max_sectors, int max_segments)
+{
+	if (merged) {
+		drive_stat_acct(req->rq_dev, req->cmd, sectors, 0);
+		req_new_io(req, 1, sectors);
+		q->elevator.nr_merged++;
+		attempt_back_merge(q, req, max_sectors, max_segments);
+	} else {
+		req_new_io(req, 0, sectors);
+		add_request(q, req, insert_here);
+	}
+}
+
+/*
+ * __make_request() for a whole chain of buffer_heads, as made by
+ * bio_to_bh(): contiguous on the disk, and already bounced.
+ *
+ * The elevator is only asked about the first buffer of each request;
+ * the buffers after it are appended to that request for as long as
+ * max_sectors and the segment limit allow, and the request is only
+ * accounted for and queued once it is complete.
+ */
+static void __make_request_bio(request_queue_t * q, int rw,
+			       struct buffer_head * bh, int sync)
+{
+	int max_segments = MAX_SEGMENTS;
+	struct request * req = NULL, *freereq = NULL;
+	int max_sectors, latency, el_ret;
+	int merged = 0, sectors = 0;
+	struct list_head *head, *insert_here = NULL;
+	elevator_t *elevator = &q->elevator;
+	struct buffer_head *next;
+	unsigned int count;
+	int should_wake = 0;
+
+	if (rw == READA)
+		rw = READ;
+	latency = elevator_request_latency(elevator, rw);
+	max_sectors = get_max_sectors(bh->b_rdev);
+
+	spin_lock_irq(q->queue_lock);
+
+	for (; bh; bh = next) {
+		next = bh->b_reqnext;
+		bh->b_reqnext = NULL;
+		count = bh->b_size >> 9;
+
+		if (req && req->nr_sectors + count <= max_sectors &&
+		    q->back_merge_fn(q, req, bh, max_segments)) {
+			req->bhtail->b_reqnext = bh;
+			req->bhtail = bh;
+			req->nr_sectors = req->hard_nr_sectors += count;
+			blk_started_io(count);
+			blk_started_sectors(req, count);
+			sectors += count;
+			continue;
+		}
+
+		if (req)
+			bio_end_request(q, req, merged, sectors, insert_here,
+					max_sectors, max_segments);
+		merged = 0;
+again:
+		req = NULL;
+		head = &q->queue_head;
+		insert_here = head->prev;
+
+		if (elevator_queue_empty(q)) {
+			q->plug_device_fn(q, bh->b_rdev); /* is atomic */
+			goto get_rq;
+		} else if (q->head_active && !q->plugged)
+			head = head->next;
+
+		el_ret = elevator->elevator_merge_fn(q, &req, head, bh, rw,
+						     max_sectors);
+		switch (el_ret) {
+			case ELEVATOR_BACK_MERGE:
+				if (q->back_merge_fn(q, req, bh, max_segments)) {
+					req->bhtail->b_reqnext = bh;
+					req->bhtail = bh;
+					req->nr_sectors = req->hard_nr_sectors += count;
+					blk_started_io(count);
+					blk_started_sectors(req, count);
+					merged = 1;
+					sectors = count;
+					continue;
+				}
+				insert_here = &req->queue;
+				break;
+
+			/* front merges would have to walk the chain backwards */
+			case ELEVATOR_FRONT_MERGE:
+				insert_here = req->queue.prev;
+				break;
+
+			case ELEVATOR_NO_MERGE:
+				if (req)
+					insert_here = &req->queue;
+				break;
+
+			default:
+				printk("elevator returned crap (%d)\n", el_ret);
+				BUG();
+		}
+
+get_rq:
+		if (freereq) {
+			req = freereq;
+			freereq = NULL;
+		} else {
+			req = get_request(q, rw);
+			if (req == NULL) {
+				spin_unlock_irq(q->queue_lock);
+				freereq = __get_request_wait(q, rw);
+				spin_lock_irq(q->queue_lock);
+				should_wake = 1;
+				goto again;
+			}
+		}
+
+		req->elevator_sequence = latency;
+		req->cmd = rw;
+		req->errors = 0;
+		req->hard_sector = req->sector = bh->b_rsector;
+		req->hard_nr_sectors = req->nr_sectors = count;
+		req->current_nr_sectors = req->hard_cur_sectors = count;
+		req->nr_segments = 1; /* Always 1 for a new request. */
+		req->nr_hw_segments = 1; /* Always 1 for a new request. */
+		req->buffer = bh->b_data;
+		req->waiting = NULL;
+		req->bh = bh;
+		req->bhtail = bh;
+		req->rq_dev = bh->b_rdev;
+		req->start_time = jiffies;
+		req->pid = current->pid;
+		blk_started_io(count);
+		blk_started_sectors(req, count);
+		sectors = count;
+	}
+
+	if (req)
+		bio_end_request(q, req, merged, sectors, insert_here,
+				max_sectors, max_segments);
+	if (freereq)
+		blkdev_release_request(freereq);
+	if (should_wake)
+		get_request_wait_wakeup(q, rw);
+	if (sync)
+		__generic_unplug_device(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
 /**
  * generic_make_request: hand a buffer head to it's device driver for I/O
  * @rw:  READ, WRITE, or READA - what sort of I/O is desired.
@@ -1330,6 +1541,94 @@ void submit_bh(int rw, struct buffer_head * bh)
 	}
 }
 
+/**
+ * submit_bio: submit a bio to the block device for I/O
+ * @rw: whether to %READ or %WRITE, or maybe to %READA (read ahead)
+ * @bio: The &struct bio which describes the I/O
+ *
+ * The bio must have bi_dev, bi_sector and at least one segment set up.
+ * Completion, and the outcome, is reported through bio->bi_end_io,
+ * which may well run before submit_bio() returns.
+ *
+ * Queues using the generic __make_request() take the whole bio under
+ * a single acquisition of the queue lock, making as few requests of
+ * it as max_sectors and max_segments allow.  Any other make_request_fn
+ * (RAID, LVM, loop...) is handed its buffer_heads one by one, as
+ * generic_make_request() would.
+ */
+void submit_bio(int rw, struct bio *bio)
+{
+	int major = MAJOR(bio->bi_dev);
+	unsigned int count = bio_sectors(bio);
+	struct buffer_head *bh, *next, **tail;
+	request_queue_t *q;
+	int minorsize = 0;
+
+	if (!bio->bi_vcnt || !bio->bi_end_io)
+		BUG();
+
+	/* Test device size, when known. */
+	if (blk_size[major])
+		minorsize = blk_size[major][MINOR(bio->bi_dev)];
+	if (minorsize) {
+		unsigned long maxsector = (minorsize << 1) + 1;
+
+		if (maxsector < count || maxsector - count < bio->bi_sector) {
+			printk(KERN_INFO
+			       "attempt to access beyond end of device\n");
+			printk(KERN_INFO "%s: rw=%d, want=%ld, limit=%d\n",
+			       kdevname(bio->bi_dev), rw,
+			       (bio->bi_sector + count)>>1, minorsize);
+			goto fail;
+		}
+	}
+
+	q = __blk_get_queue(bio->bi_dev);
+	if (!q) {
+		printk(KERN_ERR
+		       "submit_bio: Trying to access nonexistent block-device %s (%ld)\n",
+		       kdevname(bio->bi_dev), bio->bi_sector);
+		goto fail;
+	}
+
+	if (block_dump)
+		printk(KERN_DEBUG "%s: %s bio %lu/%u on %s\n", current->comm, rw == WRITE ? "WRITE" : "READ", bio->bi_sector, count, kdevname(bio->bi_dev));
+
+	switch (rw) {
+		case WRITE:
+			kstat.pgpgout += count;
+			break;
+		default:
+			kstat.pgpgin += count;
+			break;
+	}
+
+	bh = bio_to_bh(rw, bio);
+
+	if (q->make_request_fn != __make_request) {
+		for (; bh; bh = next) {
+			next = bh->b_reqnext;
+			bh->b_reqnext = NULL;
+			generic_make_request(rw, bh);
+		}
+		return;
+	}
+
+	/* bounce buffers may sleep, so they are set up front */
+	for (tail = &bh; *tail; tail = &(*tail)->b_reqnext) {
+		next = (*tail)->b_reqnext;
+		*tail = blk_queue_bounce(q, rw, *tail);
+		(*tail)->b_reqnext = next;
+	}
+
+	__make_request_bio(q, rw, bh, test_bit(BIO_SYNC, &bio->bi_flags));
+	return;
+
+fail:
+	clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio->bi_end_io(bio, 0);
+}
+
 /**
  * ll_rw_block: low-level access to block devices
  * @rw: whether to %READ or %WRITE or maybe %READA (readahead)
@@ -1510,6 +1809,9 @@ void end_that_request_last(struct request *req)
 	if (laptop_mode && req->cmd == READ)
 		mod_timer(&writeback_timer, jiffies + 5 * HZ);
 
+	if (req->q && req->q->elevator.elevator_completed_req_fn)
+		req->q->elevator.elevator_completed_req_fn(req->q, req);
+
 	req_finished_io(req);
 	blkdev_release_request(req);
 	if (waiting)
@@ -1527,8 +1829,10 @@ int __init blk_dev_init(void)
 	if (!request_cachep)
 		panic("Can't create request pool slab cache\n");
 
-	for (dev = blk_dev + MAX_BLKDEV; dev-- != blk_dev;)
+	for (dev = blk_dev + MAX_BLKDEV; dev-- != blk_dev;) {
 		dev->queue = NULL;
+		dev->request_queue.queue_lock = &io_request_lock;
+	}
 
 	memset(ro_bits,0,sizeof(ro_bits));
 	memset(max_readahead, 0, sizeof(max_readahead));
@@ -1647,8 +1951,10 @@ EXPORT_SYMBOL(blk_get_queue);
 EXPORT_SYMBOL(blk_cleanup_queue);
 EXPORT_SYMBOL(blk_queue_headactive);
 EXPORT_SYMBOL(blk_queue_throttle_sectors);
+EXPORT_SYMBOL(blk_queue_lock);
 EXPORT_SYMBOL(blk_queue_make_request);
 EXPORT_SYMBOL(generic_make_request);
+EXPORT_SYMBOL(submit_bio);
 EXPORT_SYMBOL(blkdev_release_request);
 EXPORT_SYMBOL(generic_unplug_device);
 EXPORT_SYMBOL(blk_queue_bounce_limit);
@@ -0,0 +1,1038 @@
+/*
+ *  linux/fs/aio.c
+ *
+ *  Kernel asynchronous I/O: io_setup(2), io_destroy(2), io_submit(2),
+ *  io_cancel(2), io_getevents(2).
+ *
+ *  An AIO context owns a ring of completion events, which is mapped
+ *  into the process as well so that userland can reap events without
+ *  entering the kernel.  io_submit() never waits for the I/O itself:
+ *
+ *  - O_DIRECT reads and writes have their blocks mapped by the
+ *    submitter and go to the disk as an async kiobuf (brw_kiovec()).
+ *    The event is written from keventd once the last bio has
+ *    completed.
+ *  - Buffered reads of data which is all in the page cache already
+ *    are copied by io_submit() itself.  Otherwise the missing pages
+ *    are read in and the request is handed to an aiod thread.
+ *  - Anything else, fsync included, is handed to an aiod thread, which
+ *    runs it synchronously in the submitter's address space.
+ *
+ *  Only regular files and block devices are accepted, so that no
+ *  request can block forever and hold up io_destroy() or exit.
+ *
+ *  Locking:
+ *	mm->ioctx_list_lock	the contexts of an mm
+ *	ctx->ctx_lock		reqs_active and the kiobuf cache
+ *	ring_info->ring_lock	the ring
+ *	aio_run_lock		the aiod run list
+ *  None of them nests inside another.
+ */
+
+#include <linux/config.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/iobuf.h>
+#include <linux/dnotify.h>
+#include <linux/aio.h>
+
+#include <asm/uaccess.h>
+#include <asm/mmu_context.h>
+
+#define AIO_EVENTS_PER_PAGE	(PAGE_SIZE / sizeof(struct io_event))
+#define AIO_EVENTS_FIRST_PAGE	((PAGE_SIZE - sizeof(struct aio_ring)) / sizeof(struct io_event))
+#define AIO_EVENTS_OFFSET	(AIO_EVENTS_PER_PAGE - AIO_EVENTS_FIRST_PAGE)
+
+/* What aio_key is set to in a submitted iocb */
+#define KIOCB_KEY		0
+
+/* Ring slots, system wide: /proc/sys/fs/aio-nr and aio-max-nr */
+int aio_nr;
+int aio_max_nr = 0x10000;
+static spinlock_t aio_nr_lock = SPIN_LOCK_UNLOCKED;
+
+static kmem_cache_t *kiocb_cachep;
+static kmem_cache_t *kioctx_cachep;
+
+/* Requests waiting for an aiod thread */
+static LIST_HEAD(aio_run_list);
+static spinlock_t aio_run_lock = SPIN_LOCK_UNLOCKED;
+static DECLARE_WAIT_QUEUE_HEAD(aio_run_wait);
+
+static void aio_direct_done(void *data);
+
+#define get_ioctx(ctx)	atomic_inc(&(ctx)->users)
+
+static void __put_ioctx(struct kioctx *ctx)
+{
+	struct aio_ring_info *info = &ctx->ring_info;
+	int i;
+
+	for (i = 0; i < info->nr_pages; i++)
+		put_page(info->ring_pages[i]);
+	kfree(info->ring_pages);
+
+	if (ctx->nr_iobufs)
+		free_kiovec(ctx->nr_iobufs, ctx->iobufs);
+
+	spin_lock(&aio_nr_lock);
+	aio_nr -= ctx->max_reqs;
+	spin_unlock(&aio_nr_lock);
+
+	kmem_cache_free(kioctx_cachep, ctx);
+}
+
+static inline void put_ioctx(struct kioctx *ctx)
+{
+	if (atomic_dec_and_test(&ctx->users))
+		__put_ioctx(ctx);
+}
+
+/*
+ * Map an anonymous shared area for the ring and pin its pages.  Being
+ * shared, the pages are never copied on write, so the kernel and the
+ * process keep looking at the same memory across fork() and swapping.
+ */
+static int aio_setup_ring(struct kioctx *ctx, unsigned nr_events)
+{
+	struct aio_ring_info *info = &ctx->ring_info;
+	struct mm_struct *mm = current->mm;
+	struct aio_ring *ring;
+	unsigned long size;
+	int nr_pages, ret;
+
+	/* One slot is always left empty, to tell a full ring from an empty one */
+	nr_events++;
+
+	size = sizeof(struct aio_ring) + nr_events * sizeof(struct io_event);
+	nr_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	nr_events = ((nr_pages << PAGE_SHIFT) - sizeof(struct aio_ring)) / sizeof(struct io_event);
+
+	info->ring_pages = kmalloc(nr_pages * sizeof(struct page *), GFP_KERNEL);
+	if (!info->ring_pages)
+		return -ENOMEM;
+	info->nr_pages = 0;
+	info->mmap_size = nr_pages << PAGE_SHIFT;
+
+	down_write(&mm->mmap_sem);
+	info->mmap_base = do_mmap(NULL, 0, info->mmap_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, 0);
+	if (info->mmap_base & ~PAGE_MASK) {
+		up_write(&mm->mmap_sem);
+		ret = (int) info->mmap_base;
+		goto out_free;
+	}
+
+	ret = get_user_pages(current, mm, info->mmap_base, nr_pages,
+			     1, 0, info->ring_pages, NULL);
+	if (ret != nr_pages) {
+		while (ret > 0)
+			put_page(info->ring_pages[--ret]);
+		do_munmap(mm, info->mmap_base, info->mmap_size);
+		up_write(&mm->mmap_sem);
+		ret = -EAGAIN;
+		goto out_free;
+	}
+	up_write(&mm->mmap_sem);
+
+	ctx->user_id = info->mmap_base;
+	info->nr_pages = nr_pages;
+	info->nr = nr_events;
+	info->tail = 0;
+
+	ring = kmap_atomic(info->ring_pages[0], KM_USER0);
+	ring->id = ctx->user_id;
+	ring->nr = nr_events;
+	ring->head = ring->tail = 0;
+	ring->magic = AIO_RING_MAGIC;
+	ring->compat_features = AIO_RING_COMPAT_FEATURES;
+	ring->incompat_features = AIO_RING_INCOMPAT_FEATURES;
+	ring->header_length = sizeof(struct aio_ring);
+	kunmap_atomic(ring, KM_USER0);
+	return 0;
+
+out_free:
+	kfree(info->ring_pages);
+	return ret;
+}
+
+/* Map ring slot @nr.  The header takes up the first slots of page 0. */
+#define aio_ring_event(info, nr, km) ({					\
+	unsigned __pos = (nr) + AIO_EVENTS_OFFSET;			\
+	struct io_event *__events;					\
+	__events = kmap_atomic((info)->ring_pages[__pos / AIO_EVENTS_PER_PAGE], km); \
+	__events + __pos % AIO_EVENTS_PER_PAGE;				\
+})
+
+#define put_aio_ring_event(event, km) \
+	kunmap_atomic((void *)((unsigned long)(event) & PAGE_MASK), km)
+
+/* Free slots, not counting the one which is always kept empty */
+static inline int aio_ring_avail(struct aio_ring_info *info,
+				 struct aio_ring *ring)
+{
+	return (ring->head % info->nr + info->nr - 1 - info->tail) % info->nr;
+}
+
+static int ioctx_alloc(unsigned nr_events, struct kioctx **ctxp)
+{
+	struct mm_struct *mm = current->mm;
+	struct kioctx *ctx;
+	int ret;
+
+	/* Prevent overflows */
+	if (nr_events > 0x10000000U / sizeof(struct io_event) ||
+	    nr_events > aio_max_nr)
+		return -EINVAL;
+
+	ctx = kmem_cache_alloc(kioctx_cachep, GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->max_reqs = nr_events;
+	ctx->mm = mm;
+	atomic_set(&ctx->users, 1);	/* mm->ioctx_list's */
+	spin_lock_init(&ctx->ctx_lock);
+	spin_lock_init(&ctx->ring_info.ring_lock);
+	init_waitqueue_head(&ctx->wait);
+
+	ret = -EAGAIN;
+	spin_lock(&aio_nr_lock);
+	if (aio_nr + nr_events > aio_max_nr) {
+		spin_unlock(&aio_nr_lock);
+		goto out_freectx;
+	}
+	aio_nr += nr_events;
+	spin_unlock(&aio_nr_lock);
+
+	ret = aio_setup_ring(ctx, nr_events);
+	if (ret)
+		goto out_undo;
+
+	write_lock(&mm->ioctx_list_lock);
+	list_add(&ctx->list, &mm->ioctx_list);
+	write_unlock(&mm->ioctx_list_lock);
+
+	*ctxp = ctx;
+	return 0;
+
+out_undo:
+	spin_lock(&aio_nr_lock);
+	aio_nr -= nr_events;
+	spin_unlock(&aio_nr_lock);
+out_freectx:
+	kmem_cache_free(kioctx_cachep, ctx);
+	return ret;
+}
+
+static struct kioctx *lookup_ioctx(unsigned long ctx_id)
+{
+	struct mm_struct *mm = current->mm;
+	struct kioctx *ctx = NULL;
+	struct list_head *p;
+
+	read_lock(&mm->ioctx_list_lock);
+	list_for_each(p, &mm->ioctx_list) {
+		struct kioctx *c = list_entry(p, struct kioctx, list);
+
+		if (c->user_id == ctx_id && !c->dead) {
+			get_ioctx(c);
+			ctx = c;
+			break;
+		}
+	}
+	read_unlock(&mm->ioctx_list_lock);
+	return ctx;
+}
+
+/*
+ * Allocate a request, provided the ring has room for its completion
+ * on top of those of the requests already in flight.
+ */
+static struct kiocb *aio_get_req(struct kioctx *ctx)
+{
+	struct aio_ring_info *info = &ctx->ring_info;
+	struct aio_ring *ring;
+	struct kiocb *req;
+	int okay = 0;
+
+	req = kmem_cache_alloc(kiocb_cachep, GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	spin_lock(&ctx->ctx_lock);
+	ring = kmap_atomic(info->ring_pages[0], KM_USER0);
+	if (ctx->reqs_active < aio_ring_avail(info, ring)) {
+		ctx->reqs_active++;
+		okay = 1;
+	}
+	kunmap_atomic(ring, KM_USER0);
+	spin_unlock(&ctx->ctx_lock);
+
+	if (!okay) {
+		kmem_cache_free(kiocb_cachep, req);
+		return NULL;
+	}
+
+	get_ioctx(ctx);
+	INIT_LIST_HEAD(&req->ki_list);
+	req->ki_ctx = ctx;
+	req->ki_filp = NULL;
+	req->ki_iobuf = NULL;
+	return req;
+}
+
+static void aio_put_req(struct kiocb *req)
+{
+	struct kioctx *ctx = req->ki_ctx;
+
+	spin_lock(&ctx->ctx_lock);
+	ctx->reqs_active--;
+	spin_unlock(&ctx->ctx_lock);
+	wake_up(&ctx->wait);
+
+	if (req->ki_filp)
+		fput(req->ki_filp);
+	kmem_cache_free(kiocb_cachep, req);
+	put_ioctx(ctx);
+}
+
+/*
+ * Post the completion of a request to its ring and free the request.
+ * Process context only.
+ */
+static void aio_complete(struct kiocb *req, long res, long res2)
+{
+	struct aio_ring_info *info = &req->ki_ctx->ring_info;
+	struct io_event *event;
+	struct aio_ring *ring;
+	unsigned tail;
+
+	spin_lock(&info->ring_lock);
+
+	tail = info->tail;
+	event = aio_ring_event(info, tail, KM_USER0);
+	event->obj = (__u64)(unsigned long) req->ki_user_iocb;
+	event->data = req->ki_user_data;
+	event->res = res;
+	event->res2 = res2;
+	put_aio_ring_event(event, KM_USER0);
+
+	/* The event must be visible before the tail which covers it */
+	smp_wmb();
+	if (++tail >= info->nr)
+		tail = 0;
+	info->tail = tail;
+
+	ring = kmap_atomic(info->ring_pages[0], KM_USER1);
+	ring->tail = tail;
+	kunmap_atomic(ring, KM_USER1);
+
+	spin_unlock(&info->ring_lock);
+
+	aio_put_req(req);
+}
+
+/*
+ * Take one event off the ring.  ring->head may have been moved by
+ * userland, so it is only trusted modulo the ring size.
+ */
+static int aio_read_evt(struct kioctx *ctx, struct io_event *ent)
+{
+	struct aio_ring_info *info = &ctx->ring_info;
+	struct aio_ring *ring;
+	struct io_event *evp;
+	unsigned head;
+	int ret = 0;
+
+	spin_lock(&info->ring_lock);
+	ring = kmap_atomic(info->ring_pages[0], KM_USER0);
+	head = ring->head % info->nr;
+	if (head != info->tail) {
+		evp = aio_ring_event(info, head, KM_USER1);
+		*ent = *evp;
+		put_aio_ring_event(evp, KM_USER1);
+
+		/* Done with the slot before it is handed back */
+		smp_mb();
+		ring->head = (head + 1) % info->nr;
+		ret = 1;
+	}
+	kunmap_atomic(ring, KM_USER0);
+	spin_unlock(&info->ring_lock);
+	return ret;
+}
+
+static long read_events(struct kioctx *ctx, long min_nr, long nr,
+			struct io_event *events, struct timespec *timeout)
+{
+	DECLARE_WAITQUEUE(wait, current);
+	signed long timeo = MAX_SCHEDULE_TIMEOUT;
+	struct io_event ent;
+	long i = 0;
+	int ret = 0;
+
+	if (timeout) {
+		struct timespec ts;
+
+		if (copy_from_user(&ts, timeout, sizeof(ts)))
+			return -EFAULT;
+		if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000L)
+			return -EINVAL;
+		timeo = timespec_to_jiffies(&ts) + (ts.tv_sec || ts.tv_nsec);
+	}
+
+	add_wait_queue(&ctx->wait, &wait);
+	while (i < nr) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!aio_read_evt(ctx, &ent)) {
+			if (i >= min_nr || !timeo)
+				break;
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+			if (ctx->dead) {
+				ret = -EINVAL;
+				break;
+			}
+			timeo = schedule_timeout(timeo);
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		if (copy_to_user(events + i, &ent, sizeof(ent))) {
+			ret = -EFAULT;
+			break;
+		}
+		i++;
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&ctx->wait, &wait);
+
+	return i ? i : ret;
+}
+
+/*
+ * Cancel the requests of a dead context which are still waiting for
+ * aiod, then wait for the ones under way.
+ */
+static void kill_ctx(struct kioctx *ctx)
+{
+	DECLARE_WAITQUEUE(wait, current);
+	struct list_head *p, *n;
+	LIST_HEAD(cancelled);
+
+	spin_lock(&aio_run_lock);
+	list_for_each_safe(p, n, &aio_run_list) {
+		struct kiocb *req = list_entry(p, struct kiocb, ki_list);
+
+		if (req->ki_ctx == ctx) {
+			list_del(p);
+			list_add(p, &cancelled);
+		}
+	}
+	spin_unlock(&aio_run_lock);
+
+	while (!list_empty(&cancelled)) {
+		struct kiocb *req = list_entry(cancelled.next, struct kiocb, ki_list);
+
+		list_del(&req->ki_list);
+		aio_complete(req, -EINTR, 0);
+	}
+
+	add_wait_queue(&ctx->wait, &wait);
+	for (;;) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		if (!ctx->reqs_active)
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&ctx->wait, &wait);
+}
+
+static void io_destroy(struct kioctx *ctx)
+{
+	struct mm_struct *mm = ctx->mm;
+	int was_dead;
+
+	write_lock(&mm->ioctx_list_lock);
+	was_dead = ctx->dead;
+	ctx->dead = 1;
+	if (!was_dead)
+		list_del(&ctx->list);
+	write_unlock(&mm->ioctx_list_lock);
+
+	if (was_dead)
+		return;
+
+	/* Kick io_getevents() callers */
+	wake_up(&ctx->wait);
+	kill_ctx(ctx);
+
+	down_write(&mm->mmap_sem);
+	do_munmap(mm, ctx->ring_info.mmap_base, ctx->ring_info.mmap_size);
+	up_write(&mm->mmap_sem);
+
+	put_ioctx(ctx);		/* mm->ioctx_list's */
+}
+
+/*
+ * Called from mmput() when the last user of @mm is gone, before the
+ * address space is torn down: requests still under way may be using
+ * it.
+ */
+void exit_aio(struct mm_struct *mm)
+{
+	struct kioctx *ctx;
+
+	while (!list_empty(&mm->ioctx_list)) {
+		write_lock(&mm->ioctx_list_lock);
+		ctx = list_entry(mm->ioctx_list.next, struct kioctx, list);
+		list_del(&ctx->list);
+		ctx->dead = 1;
+		write_unlock(&mm->ioctx_list_lock);
+
+		kill_ctx(ctx);
+		put_ioctx(ctx);
+	}
+}
+
+static struct kiobuf *aio_get_iobuf(struct kioctx *ctx)
+{
+	struct kiobuf *iobuf = NULL;
+
+	spin_lock(&ctx->ctx_lock);
+	if (ctx->nr_iobufs)
+		iobuf = ctx->iobufs[--ctx->nr_iobufs];
+	spin_unlock(&ctx->ctx_lock);
+
+	if (!iobuf && alloc_kiovec(1, &iobuf))
+		return NULL;
+	return iobuf;
+}
+
+static void aio_put_iobuf(struct kioctx *ctx, struct kiobuf *iobuf)
+{
+	spin_lock(&ctx->ctx_lock);
+	if (ctx->nr_iobufs < AIO_IOBUF_CACHE) {
+		ctx->iobufs[ctx->nr_iobufs++] = iobuf;
+		iobuf = NULL;
+	}
+	spin_unlock(&ctx->ctx_lock);
+
+	if (iobuf)
+		free_kiovec(1, &iobuf);
+}
+
+/* The last buffer_head of an O_DIRECT request is done: any context */
+static void aio_kiobuf_end_io(struct kiobuf *iobuf)
+{
+	struct kiocb *req = iobuf->private;
+
+	schedule_task(&req->ki_tq);
+}
+
+static void aio_direct_done(void *data)
+{
+	struct kiocb *req = data;
+	struct kiobuf *iobuf = req->ki_iobuf;
+	int rw = req->ki_opcode == IOCB_CMD_PREAD ? READ : WRITE;
+	ssize_t res;
+
+	res = iobuf->errno ? iobuf->errno : req->ki_res;
+	generic_file_aio_direct_done(rw, req->ki_filp, iobuf, res);
+
+	req->ki_iobuf = NULL;
+	aio_put_iobuf(req->ki_ctx, iobuf);
+	aio_complete(req, res, 0);
+}
+
+/*
+ * Start an O_DIRECT transfer.  Returns -ENOTBLK if it has to be done
+ * synchronously, -EIOCBQUEUED otherwise.
+ */
+static ssize_t aio_direct_IO(int rw, struct kiocb *req)
+{
+	struct kiobuf *iobuf;
+	ssize_t ret;
+
+	iobuf = aio_get_iobuf(req->ki_ctx);
+	if (!iobuf)
+		return -ENOTBLK;
+
+	iobuf->end_io = aio_kiobuf_end_io;
+	iobuf->private = req;
+	iobuf->errno = 0;
+	/* Our own count, so that end_io can't run before we are done here */
+	atomic_set(&iobuf->io_count, 1);
+
+	ret = generic_file_aio_direct_IO(rw, req->ki_filp, iobuf,
+					 req->ki_buf, req->ki_nbytes,
+					 req->ki_pos);
+	if (ret == -ENOTBLK) {
+		aio_put_iobuf(req->ki_ctx, iobuf);
+		return ret;
+	}
+
+	req->ki_iobuf = iobuf;
+	req->ki_res = ret;
+	INIT_TQUEUE(&req->ki_tq, aio_direct_done, req);
+
+	/* If nothing was submitted, or it has all finished, complete now */
+	if (atomic_dec_and_test(&iobuf->io_count))
+		aio_direct_done(req);
+	return -EIOCBQUEUED;
+}
+
+static ssize_t aio_fsync(struct file *file, int datasync)
+{
+	struct dentry *dentry = file->f_dentry;
+	struct inode *inode = dentry->d_inode;
+	int ret, err;
+
+	down(&inode->i_sem);
+	ret = filemap_fdatasync(inode->i_mapping);
+	err = file->f_op->fsync(file, dentry, datasync);
+	if (err && !ret)
+		ret = err;
+	err = filemap_fdatawait(inode->i_mapping);
+	if (err && !ret)
+		ret = err;
+	up(&inode->i_sem);
+	return ret;
+}
+
+/* Carry out a request synchronously, in the submitter's address space */
+static ssize_t aio_run_sync(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+	loff_t pos = req->ki_pos;
+	ssize_t ret = -EINVAL;
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_PREAD:
+		ret = file->f_op->read(file, req->ki_buf, req->ki_nbytes, &pos);
+		if (ret > 0)
+			dnotify_parent(file->f_dentry, DN_ACCESS);
+		break;
+	case IOCB_CMD_PWRITE:
+		ret = file->f_op->write(file, req->ki_buf, req->ki_nbytes, &pos);
+		if (ret > 0)
+			dnotify_parent(file->f_dentry, DN_MODIFY);
+		break;
+	case IOCB_CMD_FSYNC:
+	case IOCB_CMD_FDSYNC:
+		ret = aio_fsync(file, req->ki_opcode == IOCB_CMD_FDSYNC);
+		break;
+	}
+	return ret;
+}
+
+static void aio_queue(struct kiocb *req)
+{
+	spin_lock(&aio_run_lock);
+	list_add_tail(&req->ki_list, &aio_run_list);
+	spin_unlock(&aio_run_lock);
+	wake_up(&aio_run_wait);
+}
+
+/*
+ * Get a request going.  Returns -EIOCBQUEUED if it will complete
+ * later, else its result.
+ */
+static ssize_t aio_start(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+	ssize_t ret;
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_PREAD:
+		if (file->f_flags & O_DIRECT) {
+			ret = aio_direct_IO(READ, req);
+			if (ret != -ENOTBLK)
+				return ret;
+		} else if (file->f_op->read == generic_file_read) {
+			if (!filemap_start_read(file, req->ki_pos, req->ki_nbytes))
+				return aio_run_sync(req);
+		}
+		break;
+	case IOCB_CMD_PWRITE:
+		if (file->f_flags & O_DIRECT) {
+			ret = aio_direct_IO(WRITE, req);
+			if (ret != -ENOTBLK)
+				return ret;
+		}
+		break;
+	}
+
+	aio_queue(req);
+	return -EIOCBQUEUED;
+}
+
+/* Check a request the way the synchronous system call would */
+static ssize_t aio_check(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+	struct inode *inode = file->f_dentry->d_inode;
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_PREAD:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (!file->f_op || !file->f_op->read)
+			return -EINVAL;
+		if (!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode))
+			return -EINVAL;
+		if (verify_area(VERIFY_WRITE, req->ki_buf, req->ki_nbytes))
+			return -EFAULT;
+		return rw_verify_area(READ, file, &req->ki_pos, req->ki_nbytes);
+	case IOCB_CMD_PWRITE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (!file->f_op || !file->f_op->write)
+			return -EINVAL;
+		if (!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode))
+			return -EINVAL;
+		if (verify_area(VERIFY_READ, req->ki_buf, req->ki_nbytes))
+			return -EFAULT;
+		return rw_verify_area(WRITE, file, &req->ki_pos, req->ki_nbytes);
+	case IOCB_CMD_FSYNC:
+	case IOCB_CMD_FDSYNC:
+		if (!file->f_op || !file->f_op->fsync)
+			return -EINVAL;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static int io_submit_one(struct kioctx *ctx, struct iocb *user_iocb,
+			 struct iocb *iocb)
+{
+	struct kiocb *req;
+	struct file *file;
+	ssize_t ret;
+
+	/* Enforce forwards compatibility on users */
+	if (iocb->aio_reserved1 || iocb->aio_reserved2 || iocb->aio_reserved3)
+		return -EINVAL;
+
+	/* Prevent overflows */
+	if (iocb->aio_buf != (unsigned long) iocb->aio_buf ||
+	    iocb->aio_nbytes != (size_t) iocb->aio_nbytes ||
+	    (ssize_t) iocb->aio_nbytes < 0)
+		return -EINVAL;
+
+	file = fget(iocb->aio_fildes);
+	if (!file)
+		return -EBADF;
+
+	req = aio_get_req(ctx);
+	if (!req) {
+		fput(file);
+		return -EAGAIN;
+	}
+
+	req->ki_filp = file;
+	req->ki_user_iocb = user_iocb;
+	req->ki_user_data = iocb->aio_data;
+	req->ki_opcode = iocb->aio_lio_opcode;
+	req->ki_buf = (char *)(unsigned long) iocb->aio_buf;
+	req->ki_nbytes = iocb->aio_nbytes;
+	req->ki_pos = iocb->aio_offset;
+
+	ret = put_user(KIOCB_KEY, &user_iocb->aio_key);
+	if (ret)
+		goto out_put_req;
+
+	ret = aio_check(req);
+	if (ret)
+		goto out_put_req;
+
+	ret = aio_start(req);
+	if (ret != -EIOCBQUEUED)
+		aio_complete(req, ret, 0);
+	return 0;
+
+out_put_req:
+	aio_put_req(req);
+	return ret;
+}
+
+/*
+ * aiod threads borrow the address space of the process whose request
+ * they are running, the way a lazy TLB kernel thread borrows whatever
+ * was running before it.
+ */
+static void use_mm(struct mm_struct *mm)
+{
+	struct task_struct *tsk = current;
+	struct mm_struct *active_mm;
+
+	atomic_inc(&mm->mm_count);
+	task_lock(tsk);
+	active_mm = tsk->active_mm;
+	tsk->mm = mm;
+	tsk->active_mm = mm;
+	activate_mm(active_mm, mm);
+	task_unlock(tsk);
+	mmdrop(active_mm);
+}
+
+static void unuse_mm(struct mm_struct *mm)
+{
+	struct task_struct *tsk = current;
+
+	/* mm stays our active_mm, until somebody else's is used */
+	task_lock(tsk);
+	tsk->mm = NULL;
+	task_unlock(tsk);
+}
+
+static int aiod(void *data)
+{
+	struct task_struct *tsk = current;
+	DECLARE_WAITQUEUE(wait, tsk);
+
+	daemonize();
+	sprintf(tsk->comm, "aiod/%ld", (long) data);
+
+	spin_lock_irq(&tsk->sigmask_lock);
+	sigfillset(&tsk->blocked);
+	recalc_sigpending(tsk);
+	spin_unlock_irq(&tsk->sigmask_lock);
+
+	/* The buffers are user addresses */
+	set_fs(USER_DS);
+
+	for (;;) {
+		struct kiocb *req;
+		ssize_t ret;
+
+		if (signal_pending(tsk)) {
+			spin_lock_irq(&tsk->sigmask_lock);
+			flush_signals(tsk);
+			recalc_sigpending(tsk);
+			spin_unlock_irq(&tsk->sigmask_lock);
+		}
+
+		spin_lock(&aio_run_lock);
+		if (list_empty(&aio_run_list)) {
+			spin_unlock(&aio_run_lock);
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			add_wait_queue_exclusive(&aio_run_wait, &wait);
+			if (list_empty(&aio_run_list))
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			remove_wait_queue(&aio_run_wait, &wait);
+			continue;
+		}
+		req = list_entry(aio_run_list.next, struct kiocb, ki_list);
+		list_del_init(&req->ki_list);
+		spin_unlock(&aio_run_lock);
+
+		use_mm(req->ki_ctx->mm);
+		ret = aio_run_sync(req);
+		unuse_mm(req->ki_ctx->mm);
+
+		aio_complete(req, ret, 0);
+	}
+	return 0;
+}
+
+/*
+ * Create an AIO context able to hold @nr_events requests in flight.
+ * *ctxp must be zero on entry, and receives the context's handle.
+ */
+asmlinkage long sys_io_setup(unsigned nr_events, aio_context_t *ctxp)
+{
+	struct kioctx *ctx;
+	unsigned long ctx_id;
+	long ret;
+
+	ret = get_user(ctx_id, ctxp);
+	if (ret)
+		goto out;
+
+	ret = -EINVAL;
+	if (ctx_id || (int) nr_events <= 0)
+		goto out;
+
+	ret = ioctx_alloc(nr_events, &ctx);
+	if (ret)
+		goto out;
+
+	ret = put_user(ctx->user_id, ctxp);
+	if (ret)
+		io_destroy(ctx);
+out:
+	return ret;
+}
+
+/*
+ * Destroy an AIO context: requests which have not started are
+ * cancelled, the others are waited for.
+ */
+asmlinkage long sys_io_destroy(aio_context_t ctx_id)
+{
+	struct kioctx *ctx = lookup_ioctx(ctx_id);
+
+	if (!ctx)
+		return -EINVAL;
+	io_destroy(ctx);
+	put_ioctx(ctx);
+	return 0;
+}
+
+/*
+ * Queue @nr requests.  Returns the number queued, or an error if the
+ * first one could not be.
+ */
+asmlinkage long sys_io_submit(aio_context_t ctx_id, long nr,
+			      struct iocb **iocbpp)
+{
+	struct kioctx *ctx;
+	long ret = 0;
+	long i;
+
+	if (nr < 0)
+		return -EINVAL;
+	/* Keep the size below from wrapping; no array could be that big */
+	if (nr > LONG_MAX / sizeof(*iocbpp))
+		nr = LONG_MAX / sizeof(*iocbpp);
+	if (verify_area(VERIFY_READ, iocbpp, nr * sizeof(*iocbpp)))
+		return -EFAULT;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (!ctx)
+		return -EINVAL;
+
+	for (i = 0; i < nr; i++) {
+		struct iocb *user_iocb, tmp;
+
+		if (__get_user(user_iocb, iocbpp + i)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (copy_from_user(&tmp, user_iocb, sizeof(tmp))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = io_submit_one(ctx, user_iocb, &tmp);
+		if (ret)
+			break;
+	}
+
+	put_ioctx(ctx);
+	return i ? i : ret;
+}
+
+/*
+ * Cancel a request which no aiod thread has picked up yet.  Its
+ * completion is returned in *result instead of going to the ring.
+ * Requests which are under way give -EAGAIN.
+ */
+asmlinkage long sys_io_cancel(aio_context_t ctx_id, struct iocb *iocb,
+			      struct io_event *result)
+{
+	struct kioctx *ctx;
+	struct kiocb *req = NULL;
+	struct list_head *p;
+	struct io_event tmp;
+	__u32 key;
+	long ret;
+
+	if (get_user(key, &iocb->aio_key))
+		return -EFAULT;
+	if (key != KIOCB_KEY)
+		return -EINVAL;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (!ctx)
+		return -EINVAL;
+
+	spin_lock(&aio_run_lock);
+	list_for_each(p, &aio_run_list) {
+		struct kiocb *r = list_entry(p, struct kiocb, ki_list);
+
+		if (r->ki_ctx == ctx && r->ki_user_iocb == iocb) {
+			list_del(p);
+			req = r;
+			break;
+		}
+	}
+	spin_unlock(&aio_run_lock);
+
+	ret = -EAGAIN;
+	if (req) {
+		tmp.obj = (__u64)(unsigned long) iocb;
+		tmp.data = req->ki_user_data;
+		tmp.res = -EINTR;
+		tmp.res2 = 0;
+		aio_put_req(req);
+
+		ret = 0;
+		if (copy_to_user(result, &tmp, sizeof(tmp)))
+			ret = -EFAULT;
+	}
+
+	put_ioctx(ctx);
+	return ret;
+}
+
+/*
+ * Wait for at least @min_nr and return up to @nr completions, or
+ * fewer if @timeout expires first.
+ */
+asmlinkage long sys_io_getevents(aio_context_t ctx_id, long min_nr, long nr,
+				 struct io_event *events,
+				 struct timespec *timeout)
+{
+	struct kioctx *ctx;
+	long ret;
+
+	if (min_nr < 0 || nr < 0 || min_nr > nr)
+		return -EINVAL;
+	if (verify_area(VERIFY_WRITE, events, nr * sizeof(*events)))
+		return -EFAULT;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (!ctx)
+		return -EINVAL;
+
+	ret = read_events(ctx, min_nr, nr, events, timeout);
+
+	put_ioctx(ctx);
+	return ret;
+}
+
+static int __init aio_setup(void)
+{
+	long i;
+
+	kiocb_cachep = kmem_cache_create("kiocb", sizeof(struct kiocb),
+					 0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+	kioctx_cachep = kmem_cache_create("kioctx", sizeof(struct kioctx),
+					  0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+	if (!kiocb_cachep || !kioctx_cachep)
+		panic("aio_setup: cannot create slab caches");
+
+	for (i = 0; i < smp_num_cpus; i++)
+		kernel_thread(aiod, (void *) i,
+			      CLONE_FS | CLONE_FILES | CLONE_SIGNAL);
+	return 0;
+}
+
+module_init(aio_setup);
@@ -0,0 +1,152 @@
+/*
+ *  linux/fs/bio.c
+ *
+ *  Multi-page block I/O descriptors.
+ *
+ *  A bio is built up by its owner with bio_add_page() and handed to
+ *  submit_bio() (drivers/block/ll_rw_blk.c) as a whole.  Underneath,
+ *  every segment still travels as a buffer_head, so that drivers and
+ *  stacking drivers need not know about bios: bio_to_bh() makes those
+ *  buffer_heads when the bio is submitted, and the bio's bi_end_io is
+ *  called once the last of them has completed.
+ */
+
+#include <linux/config.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/tqueue.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+
+/**
+ * bio_alloc - allocate a bio
+ * @gfp_mask: allocation flags
+ * @nr_vecs: number of segments it is to hold, at most %BIO_MAX_VECS
+ *
+ * The bio is returned with one reference, BIO_UPTODATE set and no
+ * segments.  The caller fills in bi_dev, bi_sector and bi_end_io.
+ */
+struct bio *bio_alloc(int gfp_mask, int nr_vecs)
+{
+	struct bio *bio;
+
+	if (nr_vecs <= 0 || nr_vecs > BIO_MAX_VECS)
+		BUG();
+
+	bio = kmalloc(sizeof(*bio) + nr_vecs * sizeof(struct bio_vec),
+		      gfp_mask);
+	if (!bio)
+		return NULL;
+
+	memset(bio, 0, sizeof(*bio));
+	bio->bi_flags = 1 << BIO_UPTODATE;
+	bio->bi_max_vecs = nr_vecs;
+	atomic_set(&bio->bi_cnt, 1);
+	bio->bi_io_vec = (struct bio_vec *) (bio + 1);
+	return bio;
+}
+EXPORT_SYMBOL(bio_alloc);
+
+void bio_put(struct bio *bio)
+{
+	if (atomic_dec_and_test(&bio->bi_cnt))
+		kfree(bio);
+}
+EXPORT_SYMBOL(bio_put);
+
+/**
+ * bio_add_page - add a segment to a bio
+ * @bio: the bio, not yet submitted
+ * @page: the page
+ * @len: bytes, a multiple of 512
+ * @offset: where in @page they start
+ *
+ * The segment goes to the disk right after the ones already added.
+ * Returns the number of bytes added: 0 if the bio is full.
+ */
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len,
+		 unsigned int offset)
+{
+	struct bio_vec *bv;
+
+	if ((len & 511) || (offset & 511) || !len || offset + len > PAGE_SIZE)
+		BUG();
+
+	if (bio->bi_vcnt >= bio->bi_max_vecs)
+		return 0;
+
+	bv = &bio->bi_io_vec[bio->bi_vcnt++];
+	bv->bv_page = page;
+	bv->bv_len = len;
+	bv->bv_offset = offset;
+	bio->bi_size += len;
+	return len;
+}
+EXPORT_SYMBOL(bio_add_page);
+
+static void end_buffer_io_bio(struct buffer_head *bh, int uptodate)
+{
+	struct bio *bio = bh->b_private;
+
+	if (!uptodate)
+		clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	kmem_cache_free(bh_cachep, bh);
+
+	if (atomic_dec_and_test(&bio->bi_remaining))
+		bio->bi_end_io(bio, test_bit(BIO_UPTODATE, &bio->bi_flags));
+}
+
+static struct buffer_head *alloc_bio_bh(void)
+{
+	struct buffer_head *bh;
+
+	for (;;) {
+		bh = kmem_cache_alloc(bh_cachep, SLAB_NOIO);
+		if (bh)
+			return bh;
+		/* the I/O already queued will give some back */
+		run_task_queue(&tq_disk);
+		yield();
+	}
+}
+
+/**
+ * bio_to_bh - make the buffer_heads which carry a bio
+ * @rw: %READ or %WRITE
+ * @bio: the bio
+ *
+ * Returns a chain, linked through b_reqnext, of locked buffer_heads,
+ * one per segment and in disk order, with b_rdev and b_rsector set.
+ * Each of them completes into the bio.  May sleep.
+ */
+struct buffer_head *bio_to_bh(int rw, struct bio *bio)
+{
+	struct buffer_head *bh, *head = NULL, **tail = &head;
+	unsigned long sector = bio->bi_sector;
+	int i;
+
+	atomic_set(&bio->bi_remaining, bio->bi_vcnt);
+
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct bio_vec *bv = &bio->bi_io_vec[i];
+
+		bh = alloc_bio_bh();
+		bh->b_size = bv->bv_len;
+		set_bh_page(bh, bv->bv_page, bv->bv_offset);
+		bh->b_this_page = bh;
+		init_buffer(bh, end_buffer_io_bio, bio);
+		bh->b_dev = bh->b_rdev = bio->bi_dev;
+		bh->b_blocknr = sector / (bv->bv_len >> 9);
+		bh->b_rsector = sector;
+		bh->b_state = (1 << BH_Mapped) | (1 << BH_Lock) |
+			      (1 << BH_Req) | (1 << BH_Uptodate);
+		sector += bv->bv_len >> 9;
+
+		*tail = bh;
+		tail = &bh->b_reqnext;
+	}
+	*tail = NULL;
+
+	return head;
+}
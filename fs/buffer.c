@@ -44,6 +44,7 @@
 #include <linux/init.h>
 #include <linux/quotaops.h>
 #include <linux/iobuf.h>
+#include <linux/bio.h>
 #include <linux/highmem.h>
 #include <linux/module.h>
 #include <linux/completion.h>
@@ -1497,7 +1498,7 @@ EXPORT_SYMBOL(create_empty_buffers);
  * anyone who might pick it with bread() afterwards...
  */
 
-static void unmap_underlying_metadata(struct buffer_head * bh)
+void unmap_underlying_metadata(struct buffer_head * bh)
 {
 	struct buffer_head *old_bh;
 
@@ -1509,6 +1510,7 @@ static void unmap_underlying_metadata(struct buffer_head * bh)
 		__brelse(old_bh);
 	}
 }
+EXPORT_SYMBOL(unmap_underlying_metadata);
 
 /*
  * NOTE! All mapped/uptodate combinations are valid:
@@ -1655,7 +1657,9 @@ static int __block_prepare_write(struct inode *inode, struct page *page,
 			if (err)
 				goto out;
 			if (buffer_new(bh)) {
-				unmap_underlying_metadata(bh);
+				/* A delayed buffer has no block yet */
+				if (!buffer_delay(bh))
+					unmap_underlying_metadata(bh);
 				if (Page_Uptodate(page)) {
 					set_bit(BH_Uptodate, &bh->b_state);
 					continue;
@@ -2057,7 +2061,7 @@ int block_truncate_page(struct address_space *mapping, loff_t from, get_block_t
 	}
 
 	err = 0;
-	if (!buffer_mapped(bh)) {
+	if (!buffer_mapped(bh) && !buffer_delay(bh)) {
 		/* Hole? Nothing to do */
 		if (buffer_uptodate(bh))
 			goto unlock;
@@ -2254,47 +2258,98 @@ int generic_direct_IO(int rw, struct inode * inode, struct kiobuf * iobuf, unsig
 }
 
 /*
- * IO completion routine for a buffer_head being used for kiobuf IO: we
- * can't dispatch the kiobuf callback until io_count reaches 0.  
+ * bio completion for a kiobuf someone waits on: the bio is kept for
+ * wait_kio() to look at.
  */
 
-static void end_buffer_io_kiobuf(struct buffer_head *bh, int uptodate)
+static void end_bio_kiobuf(struct bio *bio, int uptodate)
 {
-	struct kiobuf *kiobuf;
-	
-	mark_buffer_uptodate(bh, uptodate);
+	end_kio_request(bio->bi_private, uptodate);
+}
 
-	kiobuf = bh->b_private;
-	end_kio_request(kiobuf, uptodate);
-	unlock_buffer(bh);
+/*
+ * The same for an async kiobuf, which nobody waits on: the kiobuf may
+ * be gone as soon as end_io has run, so the bio is finished with
+ * before io_count is dropped.
+ */
+static void end_bio_kiobuf_async(struct bio *bio, int uptodate)
+{
+	struct kiobuf *kiobuf = bio->bi_private;
+
+	if (!uptodate)
+		kiobuf->errno = -EIO;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&kiobuf->io_count))
+		kiobuf->end_io(kiobuf);
+}
+
+static struct bio *alloc_kio_bio(struct kiobuf *iobuf, kdev_t dev,
+				 unsigned long blocknr, int size, int nr_vecs)
+{
+	struct bio *bio;
+
+	if (nr_vecs > BIO_MAX_VECS)
+		nr_vecs = BIO_MAX_VECS;
+	while (!(bio = bio_alloc(GFP_NOIO, nr_vecs))) {
+		run_task_queue(&tq_disk);
+		yield();
+	}
+
+	bio->bi_dev = dev;
+	bio->bi_sector = blocknr * (size >> 9);
+	bio->bi_end_io = iobuf->async ? end_bio_kiobuf_async : end_bio_kiobuf;
+	bio->bi_private = iobuf;
+	return bio;
+}
+
+/*
+ * Returns the bytes submitted.  The bio of a synchronous kiobuf goes
+ * on the front of @done, for wait_kio().
+ */
+static int submit_kio_bio(int rw, struct bio *bio, struct bio **done)
+{
+	struct kiobuf *iobuf = bio->bi_private;
+	int size = bio->bi_size;
+
+	if (!iobuf->async) {
+		bio->bi_next = *done;
+		*done = bio;
+	}
+	atomic_inc(&iobuf->io_count);
+	submit_bio(rw, bio);
+	return size;
 }
 
 /*
- * For brw_kiovec: submit a set of buffer_head temporary IOs and wait
- * for them to complete.  Clean up the buffer_heads afterwards.  
+ * For brw_kiovec: wait for the bios of a synchronous kiovec to
+ * complete, and free them.
  */
 
-static int wait_kio(int rw, int nr, struct buffer_head *bh[], int size)
+static int wait_kio(int nr, struct kiobuf *iovec[], struct bio *bio)
 {
 	int iosize, err;
 	int i;
-	struct buffer_head *tmp;
+	struct bio *next;
+
+	for (i = 0; i < nr; i++)
+		kiobuf_wait_for_io(iovec[i]); /* wake-one */
 
 	iosize = 0;
 	err = 0;
 
-	for (i = nr; --i >= 0; ) {
-		iosize += size;
-		tmp = bh[i];
-		wait_on_buffer(tmp);
-		
-		if (!buffer_uptodate(tmp)) {
-			/* We are traversing bh'es in reverse order so
-                           clearing iosize on error calculates the
-                           amount of IO before the first error. */
+	for (; bio; bio = next) {
+		next = bio->bi_next;
+		iosize += bio->bi_size;
+
+		if (!test_bit(BIO_UPTODATE, &bio->bi_flags)) {
+			/* The list is in reverse order, so clearing
+			   iosize on error calculates the amount of IO
+			   before the first error. */
 			iosize = 0;
 			err = -EIO;
 		}
+		bio_put(bio);
 	}
 	
 	if (iosize)
@@ -2306,11 +2361,17 @@ static int wait_kio(int rw, int nr, struct buffer_head *bh[], int size)
  * Start I/O on a physical range of kernel memory, defined by a vector
  * of kiobuf structs (much like a user-space iovec list).
  *
- * The kiobuf must already be locked for IO.  IO is submitted
- * asynchronously: you need to check page->locked and page->uptodate.
+ * The kiobuf must already be locked for IO.  Each run of blocks which
+ * is contiguous on the disk goes to the block layer as a single bio.
  *
  * It is up to the caller to make sure that there are enough blocks
  * passed in to completely map the iobufs to disk.
+ *
+ * A single kiobuf marked async, of no more than KIO_MAX_SECTORS
+ * blocks, is only submitted: the return value counts the bytes
+ * submitted and iobuf->end_io reports completion.  The caller must
+ * hold a count of its own on io_count to keep end_io from running
+ * before brw_kiovec() has returned.
  */
 
 int brw_kiovec(int rw, int nr, struct kiobuf *iovec[], 
@@ -2319,15 +2380,15 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 	int		err;
 	int		length;
 	int		transferred;
+	int		submitted;
 	int		i;
 	int		bufind;
 	int		pageind;
-	int		bhind;
 	int		offset;
-	unsigned long	blocknr;
+	unsigned long	blocknr, lastnr = 0;
 	struct kiobuf *	iobuf = NULL;
 	struct page *	map;
-	struct buffer_head *tmp, **bhs = NULL;
+	struct bio *	bio = NULL, *done = NULL;
 
 	if (!nr)
 		return 0;
@@ -2342,19 +2403,20 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 			return -EINVAL;
 		if (!iobuf->nr_pages)
 			panic("brw_kiovec: iobuf not initialised");
+		if (iobuf->async &&
+		    (nr != 1 || iobuf->length / size > KIO_MAX_SECTORS))
+			return -EINVAL;
 	}
 
 	/* 
 	 * OK to walk down the iovec doing page IO on each page we find. 
 	 */
-	bufind = bhind = transferred = err = 0;
+	bufind = transferred = submitted = err = 0;
 	for (i = 0; i < nr; i++) {
 		iobuf = iovec[i];
 		offset = iobuf->offset;
 		length = iobuf->length;
 		iobuf->errno = 0;
-		if (!bhs)
-			bhs = iobuf->bh;
 		
 		for (pageind = 0; pageind < iobuf->nr_pages; pageind++) {
 			map  = iobuf->maplist[pageind];
@@ -2377,37 +2439,20 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 					} else
 						BUG();
 				}
-				tmp = bhs[bhind++];
-
-				tmp->b_size = size;
-				set_bh_page(tmp, map, offset);
-				tmp->b_this_page = tmp;
-
-				init_buffer(tmp, end_buffer_io_kiobuf, iobuf);
-				tmp->b_dev = dev;
-				tmp->b_blocknr = blocknr;
-				tmp->b_state = (1 << BH_Mapped) | (1 << BH_Lock) | (1 << BH_Req);
-
-				if (rw == WRITE) {
-					set_bit(BH_Uptodate, &tmp->b_state);
-					clear_bit(BH_Dirty, &tmp->b_state);
-				} else
-					set_bit(BH_Uptodate, &tmp->b_state);
-
-				atomic_inc(&iobuf->io_count);
-				submit_bh(rw, tmp);
-				/* 
-				 * Wait for IO if we have got too much 
-				 */
-				if (bhind >= KIO_MAX_SECTORS) {
-					kiobuf_wait_for_io(iobuf); /* wake-one */
-					err = wait_kio(rw, bhind, bhs, size);
-					if (err >= 0)
-						transferred += err;
-					else
-						goto finished;
-					bhind = 0;
+
+				/* Extend the bio while the disk allows */
+				if (bio && (bio->bi_private != iobuf ||
+					    blocknr != lastnr + 1 ||
+					    !bio_add_page(bio, map, size, offset))) {
+					submitted += submit_kio_bio(rw, bio, &done);
+					bio = NULL;
 				}
+				if (!bio) {
+					bio = alloc_kio_bio(iobuf, dev, blocknr,
+							    size, length / size);
+					bio_add_page(bio, map, size, offset);
+				}
+				lastnr = blocknr;
 
 			skip_block:
 				length -= size;
@@ -2421,17 +2466,21 @@ int brw_kiovec(int rw, int nr, struct kiobuf *iovec[],
 		} /* End of page loop */		
 	} /* End of iovec loop */
 
+ finished:
 	/* Is there any IO still left to submit? */
-	if (bhind) {
-		kiobuf_wait_for_io(iobuf); /* wake-one */
-		err = wait_kio(rw, bhind, bhs, size);
-		if (err >= 0)
-			transferred += err;
-		else
-			goto finished;
+	if (bio)
+		submitted += submit_kio_bio(rw, bio, &done);
+
+	if (iobuf->async)
+		transferred += submitted;
+	else if (done) {
+		i = wait_kio(nr, iovec, done);
+		if (i >= 0)
+			transferred += i;
+		else if (!err)
+			err = i;
 	}
 
- finished:
 	if (transferred)
 		return transferred;
 	return err;
@@ -2683,6 +2732,12 @@ static int sync_page_buffers(struct buffer_head *head)
 		if (!buffer_dirty(bh) && !buffer_locked(bh))
 			continue;
 
+		/* No block to write to yet: leave it to bdflush */
+		if (buffer_delay(bh)) {
+			tryagain = 0;
+			continue;
+		}
+
 		/* Don't start IO first time around.. */
 		if (!test_and_set_bit(BH_Wait_IO, &bh->b_state)) {
 			tryagain = 0;
@@ -39,6 +39,7 @@
 #include <linux/utsname.h>
 #define __NO_VERSION__
 #include <linux/module.h>
+#include <linux/rmap.h>
 
 #include <asm/uaccess.h>
 #include <asm/pgalloc.h>
@@ -288,12 +289,16 @@ void put_dirty_page(struct task_struct * tsk, struct page *page, unsigned long a
 	pmd_t * pmd;
 	pte_t * pte;
 	struct vm_area_struct *vma; 
+	struct pte_chain *pte_chain;
 	pgprot_t prot = PAGE_COPY; 
 
 	if (page_count(page) != 1)
 		printk(KERN_ERR "mem_map disagrees with %p at %08lx\n", page, address);
 	pgd = pgd_offset(tsk->mm, address);
 
+	pte_chain = pte_chain_alloc(GFP_KERNEL);
+	if (!pte_chain)
+		goto out_nolock;
 	spin_lock(&tsk->mm->page_table_lock);
 	pmd = pmd_alloc(tsk->mm, pgd, address);
 	if (!pmd)
@@ -311,13 +316,17 @@ void put_dirty_page(struct task_struct * tsk, struct page *page, unsigned long a
 	if (vma) 
 		prot = vma->vm_page_prot;
 	set_pte(pte, pte_mkdirty(pte_mkwrite(mk_pte(page, prot))));
+	pte_chain = page_add_rmap(page, pte, pte_chain);
 	tsk->mm->rss++;
 	spin_unlock(&tsk->mm->page_table_lock);
+	pte_chain_free(pte_chain);
 
 	/* no need for flush_tlb */
 	return;
 out:
 	spin_unlock(&tsk->mm->page_table_lock);
+out_nolock:
+	pte_chain_free(pte_chain);
 	__free_page(page);
 	force_sig(SIGKILL, tsk);
 	return;
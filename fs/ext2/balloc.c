@@ -16,6 +16,7 @@
 #include <linux/ext2_fs.h>
 #include <linux/locks.h>
 #include <linux/quotaops.h>
+#include <linux/slab.h>
 
 /*
  * balloc.c contains the blocks allocation and deallocation routines
@@ -70,194 +71,85 @@ struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 }
 
 /*
- * Read the bitmap for a given block_group, reading into the specified 
- * slot in the superblock's bitmap cache.
- *
- * Return >=0 on success or a -ve error code.
+ * Read the bitmap for a given block_group.  The caller gets a reference
+ * on the buffer and must brelse() it; bits in it are only changed under
+ * ext2_bg_lock() for the group.
  */
-
-static int read_block_bitmap (struct super_block * sb,
-			       unsigned int block_group,
-			       unsigned long bitmap_nr)
+static struct buffer_head *read_block_bitmap (struct super_block * sb,
+					      unsigned int block_group)
 {
 	struct ext2_group_desc * gdp;
-	struct buffer_head * bh = NULL;
-	int retval = -EIO;
-	
+	struct buffer_head * bh;
+
 	gdp = ext2_get_group_desc (sb, block_group, NULL);
 	if (!gdp)
-		goto error_out;
-	retval = 0;
+		return NULL;
 	bh = sb_bread(sb, le32_to_cpu(gdp->bg_block_bitmap));
-	if (!bh) {
+	if (!bh)
 		ext2_error (sb, "read_block_bitmap",
 			    "Cannot read block bitmap - "
 			    "block_group = %d, block_bitmap = %lu",
 			    block_group, (unsigned long) gdp->bg_block_bitmap);
-		retval = -EIO;
-	}
-	/*
-	 * On IO error, just leave a zero in the superblock's block pointer for
-	 * this group.  The IO will be retried next time.
-	 */
-error_out:
-	sb->u.ext2_sb.s_block_bitmap_number[bitmap_nr] = block_group;
-	sb->u.ext2_sb.s_block_bitmap[bitmap_nr] = bh;
-	return retval;
+	return bh;
 }
 
 /*
- * load_block_bitmap loads the block bitmap for a blocks group
- *
- * It maintains a cache for the last bitmaps loaded.  This cache is managed
- * with a LRU algorithm.
- *
- * Notes:
- * 1/ There is one cache per mounted file system.
- * 2/ If the file system contains less than EXT2_MAX_GROUP_LOADED groups,
- *    this function reads the bitmap without maintaining a LRU cache.
- * 
- * Return the slot used to store the bitmap, or a -ve error code.
+ * Set up the allocator state at mount time: the group locks, the free
+ * and delayed blocks counters and the (empty) tree of reservation windows.
  */
-static int __load_block_bitmap (struct super_block * sb,
-			        unsigned int block_group)
+int ext2_init_balloc (struct super_block * sb)
 {
-	int i, j, retval = 0;
-	unsigned long block_bitmap_number;
-	struct buffer_head * block_bitmap;
-
-	if (block_group >= sb->u.ext2_sb.s_groups_count)
-		ext2_panic (sb, "load_block_bitmap",
-			    "block_group >= groups_count - "
-			    "block_group = %d, groups_count = %lu",
-			    block_group, sb->u.ext2_sb.s_groups_count);
-
-	if (sb->u.ext2_sb.s_groups_count <= EXT2_MAX_GROUP_LOADED) {
-		if (sb->u.ext2_sb.s_block_bitmap[block_group]) {
-			if (sb->u.ext2_sb.s_block_bitmap_number[block_group] ==
-			    block_group)
-				return block_group;
-			ext2_error (sb, "__load_block_bitmap",
-				    "block_group != block_bitmap_number");
-		}
-		retval = read_block_bitmap (sb, block_group, block_group);
-		if (retval < 0)
-			return retval;
-		return block_group;
-	}
-
-	for (i = 0; i < sb->u.ext2_sb.s_loaded_block_bitmaps &&
-		    sb->u.ext2_sb.s_block_bitmap_number[i] != block_group; i++)
-		;
-	if (i < sb->u.ext2_sb.s_loaded_block_bitmaps &&
-  	    sb->u.ext2_sb.s_block_bitmap_number[i] == block_group) {
-		block_bitmap_number = sb->u.ext2_sb.s_block_bitmap_number[i];
-		block_bitmap = sb->u.ext2_sb.s_block_bitmap[i];
-		for (j = i; j > 0; j--) {
-			sb->u.ext2_sb.s_block_bitmap_number[j] =
-				sb->u.ext2_sb.s_block_bitmap_number[j - 1];
-			sb->u.ext2_sb.s_block_bitmap[j] =
-				sb->u.ext2_sb.s_block_bitmap[j - 1];
-		}
-		sb->u.ext2_sb.s_block_bitmap_number[0] = block_bitmap_number;
-		sb->u.ext2_sb.s_block_bitmap[0] = block_bitmap;
+	struct ext2_balloc_info * bi;
+	int i;
 
-		/*
-		 * There's still one special case here --- if block_bitmap == 0
-		 * then our last attempt to read the bitmap failed and we have
-		 * just ended up caching that failure.  Try again to read it.
-		 */
-		if (!block_bitmap)
-			retval = read_block_bitmap (sb, block_group, 0);
-	} else {
-		if (sb->u.ext2_sb.s_loaded_block_bitmaps < EXT2_MAX_GROUP_LOADED)
-			sb->u.ext2_sb.s_loaded_block_bitmaps++;
-		else
-			brelse (sb->u.ext2_sb.s_block_bitmap[EXT2_MAX_GROUP_LOADED - 1]);
-		for (j = sb->u.ext2_sb.s_loaded_block_bitmaps - 1; j > 0; j--) {
-			sb->u.ext2_sb.s_block_bitmap_number[j] =
-				sb->u.ext2_sb.s_block_bitmap_number[j - 1];
-			sb->u.ext2_sb.s_block_bitmap[j] =
-				sb->u.ext2_sb.s_block_bitmap[j - 1];
-		}
-		retval = read_block_bitmap (sb, block_group, 0);
-	}
-	return retval;
+	bi = kmalloc (sizeof (struct ext2_balloc_info), GFP_KERNEL);
+	if (!bi)
+		return -ENOMEM;
+	for (i = 0; i < EXT2_BG_LOCKS; i++)
+		spin_lock_init(&bi->bg_locks[i].lock);
+	percpu_counter_init(&bi->free_blocks,
+		le32_to_cpu(sb->u.ext2_sb.s_es->s_free_blocks_count));
+	percpu_counter_init(&bi->delayed_blocks, 0);
+	spin_lock_init(&bi->rsv_lock);
+	bi->rsv_root = RB_ROOT;
+	percpu_counter_init(&bi->rsv_windows, 0);
+	percpu_counter_init(&bi->rsv_hits, 0);
+	percpu_counter_init(&bi->rsv_misses, 0);
+	sb->u.ext2_sb.s_balloc = bi;
+	return 0;
 }
 
 /*
- * Load the block bitmap for a given block group.  First of all do a couple
- * of fast lookups for common cases and then pass the request onto the guts
- * of the bitmap loader.
- *
- * Return the slot number of the group in the superblock bitmap cache's on
- * success, or a -ve error code.
- *
- * There is still one inconsistency here --- if the number of groups in this
- * filesystems is <= EXT2_MAX_GROUP_LOADED, then we have no way of 
- * differentiating between a group for which we have never performed a bitmap
- * IO request, and a group for which the last bitmap read request failed.
+ * Change the file's count of delayed blocks by @count, and the blocks
+ * held back for delayed allocation along with it.
  */
-static inline int load_block_bitmap (struct super_block * sb,
-				     unsigned int block_group)
+static void ext2_delayed_mod (struct inode * inode, long count)
 {
-	int slot;
-	
-	/*
-	 * Do the lookup for the slot.  First of all, check if we're asking
-	 * for the same slot as last time, and did we succeed that last time?
-	 */
-	if (sb->u.ext2_sb.s_loaded_block_bitmaps > 0 &&
-	    sb->u.ext2_sb.s_block_bitmap_number[0] == block_group &&
-	    sb->u.ext2_sb.s_block_bitmap[0]) {
-		return 0;
-	}
-	/*
-	 * Or can we do a fast lookup based on a loaded group on a filesystem
-	 * small enough to be mapped directly into the superblock?
-	 */
-	else if (sb->u.ext2_sb.s_groups_count <= EXT2_MAX_GROUP_LOADED && 
-		 sb->u.ext2_sb.s_block_bitmap_number[block_group] == block_group &&
-		 sb->u.ext2_sb.s_block_bitmap[block_group]) {
-		slot = block_group;
-	}
-	/*
-	 * If not, then do a full lookup for this block group.
-	 */
-	else {
-		slot = __load_block_bitmap (sb, block_group);
-	}
+	struct ext2_inode_info * ei = &inode->u.ext2_i;
 
-	/*
-	 * <0 means we just got an error
-	 */
-	if (slot < 0)
-		return slot;
-	
-	/*
-	 * If it's a valid slot, we may still have cached a previous IO error,
-	 * in which case the bh in the superblock cache will be zero.
-	 */
-	if (!sb->u.ext2_sb.s_block_bitmap[slot])
-		return -EIO;
-	
-	/*
-	 * Must have been read in OK to get this far.
-	 */
-	return slot;
+	write_lock(&ei->i_meta_lock);
+	ei->i_delayed_blocks += count;
+	write_unlock(&ei->i_meta_lock);
+	percpu_counter_mod(&inode->i_sb->u.ext2_sb.s_balloc->delayed_blocks,
+			   count);
 }
 
-/* Free given blocks, update quota and i_blocks field */
-void ext2_free_blocks (struct inode * inode, unsigned long block,
-		       unsigned long count)
+/*
+ * Free given blocks, update quota and i_blocks field.  Blocks which
+ * were allocated for delayed data (EXT2_ALLOC_RESERVED) and never made
+ * it into the file go back to the reservation instead: the data is
+ * still waiting for them, and is still charged to quota.
+ */
+static void __ext2_free_blocks (struct inode * inode, unsigned long block,
+				unsigned long count, int reserved)
 {
-	struct buffer_head * bh;
+	struct buffer_head * bh = NULL;
 	struct buffer_head * bh2;
 	unsigned long block_group;
 	unsigned long bit;
 	unsigned long i;
-	int bitmap_nr;
 	unsigned long overflow;
+	unsigned long group_freed, freed = 0;
 	struct super_block * sb;
 	struct ext2_group_desc * gdp;
 	struct ext2_super_block * es;
@@ -267,7 +159,6 @@ void ext2_free_blocks (struct inode * inode, unsigned long block,
 		printk ("ext2_free_blocks: nonexistent device");
 		return;
 	}
-	lock_super (sb);
 	es = sb->u.ext2_sb.s_es;
 	if (block < le32_to_cpu(es->s_first_data_block) ||
 	    block + count < block ||
@@ -294,126 +185,173 @@ do_more:
 		overflow = bit + count - EXT2_BLOCKS_PER_GROUP(sb);
 		count -= overflow;
 	}
-	bitmap_nr = load_block_bitmap (sb, block_group);
-	if (bitmap_nr < 0)
+	brelse (bh);
+	bh = read_block_bitmap (sb, block_group);
+	if (!bh)
 		goto error_return;
-	
-	bh = sb->u.ext2_sb.s_block_bitmap[bitmap_nr];
 	gdp = ext2_get_group_desc (sb, block_group, &bh2);
 	if (!gdp)
 		goto error_return;
 
-	for (i = 0; i < count; i++, block++) {
-		if (block == le32_to_cpu(gdp->bg_block_bitmap) ||
-		    block == le32_to_cpu(gdp->bg_inode_bitmap) ||
-		    in_range(block, le32_to_cpu(gdp->bg_inode_table),
-			     EXT2_SB(sb)->s_itb_per_group)) {
-			ext2_error(sb, __FUNCTION__,
-				   "Freeing block in system zone - block = %lu",
-				   block);
-			continue;
-		}
-
-		if (!ext2_clear_bit (bit + i, bh->b_data))
-			ext2_error(sb, __FUNCTION__,
-				   "bit already cleared for block %lu", block);
-		else {
-			DQUOT_FREE_BLOCK(inode, 1);
-			gdp->bg_free_blocks_count =
-				cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count)+1);
-			es->s_free_blocks_count =
-				cpu_to_le32(le32_to_cpu(es->s_free_blocks_count)+1);
-		}
+	if (in_range (le32_to_cpu(gdp->bg_block_bitmap), block, count) ||
+	    in_range (le32_to_cpu(gdp->bg_inode_bitmap), block, count) ||
+	    in_range (block, le32_to_cpu(gdp->bg_inode_table),
+		      EXT2_SB(sb)->s_itb_per_group) ||
+	    in_range (block + count - 1, le32_to_cpu(gdp->bg_inode_table),
+		      EXT2_SB(sb)->s_itb_per_group)) {
+		ext2_error (sb, __FUNCTION__,
+			    "Freeing blocks in system zones - "
+			    "Block = %lu, count = %lu", block, count);
+		goto error_return;
 	}
-	
-	mark_buffer_dirty(bh2);
-	mark_buffer_dirty(sb->u.ext2_sb.s_sbh);
 
+	group_freed = 0;
+	spin_lock(ext2_bg_lock(sb, block_group));
+	for (i = 0; i < count; i++)
+		if (ext2_clear_bit (bit + i, bh->b_data))
+			group_freed++;
+	gdp->bg_free_blocks_count =
+		cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) + group_freed);
+	spin_unlock(ext2_bg_lock(sb, block_group));
+
+	if (group_freed != count)
+		ext2_error(sb, __FUNCTION__,
+			   "bit already cleared for %lu of blocks %lu-%lu",
+			   count - group_freed, block, block + count - 1);
+	freed += group_freed;
+
+	mark_buffer_dirty(bh2);
 	mark_buffer_dirty(bh);
 	if (sb->s_flags & MS_SYNCHRONOUS) {
 		ll_rw_block (WRITE, 1, &bh);
 		wait_on_buffer (bh);
 	}
 	if (overflow) {
+		block += count;
 		count = overflow;
 		goto do_more;
 	}
-	sb->s_dirt = 1;
 error_return:
-	unlock_super (sb);
-	return;
+	brelse (bh);
+	if (freed) {
+		if (reserved)
+			ext2_delayed_mod (inode, freed);
+		else
+			DQUOT_FREE_BLOCK(inode, freed);
+		percpu_counter_mod(&sb->u.ext2_sb.s_balloc->free_blocks, freed);
+		sb->s_dirt = 1;
+	}
+}
+
+void ext2_free_blocks (struct inode * inode, unsigned long block,
+		       unsigned long count)
+{
+	__ext2_free_blocks (inode, block, count, 0);
+}
+
+void ext2_free_reserved_blocks (struct inode * inode, unsigned long block,
+				unsigned long count)
+{
+	__ext2_free_blocks (inode, block, count, 1);
 }
 
 /*
- * ext2_new_block uses a goal block to assist allocation.  If the goal is
- * free, or there is a free block within 32 blocks of the goal, that block
- * is allocated.  Otherwise a forward search is made for a free block; within 
- * each block group the search first looks for an entire free byte in the block
- * bitmap, and then for any free bit if that fails.
- * This function also updates quota and i_blocks field.
+ * Is there room for count more blocks, beyond those promised to delayed
+ * allocation?  The root reserve is only for the privileged.
  */
-int ext2_new_block (struct inode * inode, unsigned long goal,
-    u32 * prealloc_count, u32 * prealloc_block, int * err)
+static int ext2_has_free_blocks (struct super_block * sb, unsigned long count)
 {
-	struct buffer_head * bh;
-	struct buffer_head * bh2;
-	char * p, * r;
-	int i, j, k, tmp;
-	int bitmap_nr;
-	struct super_block * sb;
-	struct ext2_group_desc * gdp;
-	struct ext2_super_block * es;
-#ifdef EXT2FS_DEBUG
-	static int goal_hits = 0, goal_attempts = 0;
-#endif
-	*err = -ENOSPC;
-	sb = inode->i_sb;
-	if (!sb) {
-		printk ("ext2_new_block: nonexistent device");
-		return 0;
-	}
+	struct ext2_balloc_info * bi = sb->u.ext2_sb.s_balloc;
+	long free;
 
-	lock_super (sb);
-	es = sb->u.ext2_sb.s_es;
-	if (le32_to_cpu(es->s_free_blocks_count) <= le32_to_cpu(es->s_r_blocks_count) &&
-	    ((sb->u.ext2_sb.s_resuid != current->fsuid) &&
-	     (sb->u.ext2_sb.s_resgid == 0 ||
-	      !in_group_p (sb->u.ext2_sb.s_resgid)) && 
-	     !capable(CAP_SYS_RESOURCE)))
-		goto out;
+	free = percpu_counter_read_positive(&bi->free_blocks) -
+	       percpu_counter_read_positive(&bi->delayed_blocks) - (long) count;
+	if (free >= (long) le32_to_cpu(sb->u.ext2_sb.s_es->s_r_blocks_count))
+		return 1;
+	if (free >= 0 &&
+	    (sb->u.ext2_sb.s_resuid == current->fsuid ||
+	     (sb->u.ext2_sb.s_resgid != 0 &&
+	      in_group_p (sb->u.ext2_sb.s_resgid)) ||
+	     capable(CAP_SYS_RESOURCE)))
+		return 1;
+	return 0;
+}
 
-	ext2_debug ("goal=%lu.\n", goal);
+/*
+ * Delayed allocation: a block written through the page cache gets no
+ * disk block until its page is written out, but is charged to quota and
+ * taken out of the free space here, at write() time, so that the writer
+ * still sees EDQUOT and ENOSPC.  ext2_new_blocks() with
+ * EXT2_ALLOC_RESERVED turns the reservation into real blocks;
+ * ext2_release_blocks() gives it back if the data goes away first.
+ *
+ * Only data blocks are reserved: a block is delayed only if the
+ * indirect blocks above it are there already (see ext2_get_block_delay()),
+ * so write-out has nothing else to allocate.
+ */
+int ext2_reserve_blocks (struct inode * inode, unsigned long count)
+{
+	if (DQUOT_ALLOC_BLOCK(inode, count))
+		return -EDQUOT;
+	if (!ext2_has_free_blocks (inode->i_sb, count)) {
+		DQUOT_FREE_BLOCK(inode, count);
+		return -ENOSPC;
+	}
+	ext2_delayed_mod (inode, count);
+	return 0;
+}
 
-repeat:
-	/*
-	 * First, test whether the goal block is free.
-	 */
-	if (goal < le32_to_cpu(es->s_first_data_block) ||
-	    goal >= le32_to_cpu(es->s_blocks_count))
-		goal = le32_to_cpu(es->s_first_data_block);
-	i = (goal - le32_to_cpu(es->s_first_data_block)) / EXT2_BLOCKS_PER_GROUP(sb);
-	gdp = ext2_get_group_desc (sb, i, &bh2);
-	if (!gdp)
-		goto io_error;
+void ext2_release_blocks (struct inode * inode, unsigned long count)
+{
+	DQUOT_FREE_BLOCK(inode, count);
+	ext2_delayed_mod (inode, -(long) count);
+}
 
-	if (le16_to_cpu(gdp->bg_free_blocks_count) > 0) {
-		j = ((goal - le32_to_cpu(es->s_first_data_block)) % EXT2_BLOCKS_PER_GROUP(sb));
-#ifdef EXT2FS_DEBUG
-		if (j)
-			goal_attempts++;
-#endif
-		bitmap_nr = load_block_bitmap (sb, i);
-		if (bitmap_nr < 0)
-			goto io_error;
-		
-		bh = sb->u.ext2_sb.s_block_bitmap[bitmap_nr];
+/*
+ * Take bit j of the group's bitmap.  Fails if somebody else got there
+ * first.
+ */
+static int claim_block (struct super_block * sb, int group,
+			struct ext2_group_desc * gdp,
+			struct buffer_head * bh, int j)
+{
+	int ret = 0;
+
+	spin_lock(ext2_bg_lock(sb, group));
+	if (!ext2_set_bit (j, bh->b_data)) {
+		gdp->bg_free_blocks_count =
+			cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) - 1);
+		ret = 1;
+	}
+	spin_unlock(ext2_bg_lock(sb, group));
+	return ret;
+}
 
-		ext2_debug ("goal is at %d:%d.\n", i, j);
+/*
+ * Look for a free bit in [goal, end) of the group's bitmap and take it.
+ * If goal is -1 there is no goal: start at the beginning.  If the goal
+ * is taken, anything within the next 64 bits will do; failing that the
+ * search prefers a whole free byte, backing up to the start of the free
+ * run it belongs to.  The search is done without the group lock and
+ * repeated if we lose the race for the bit.
+ *
+ * Returns the bit taken, or -1.
+ */
+static int try_to_allocate (struct super_block * sb, int group,
+			    struct ext2_group_desc * gdp,
+			    struct buffer_head * bh, int goal, int end)
+{
+	char * p, * r;
+	int j, k, start;
 
-		if (!ext2_test_bit(j, bh->b_data)) {
-			ext2_debug("goal bit allocated, %d hits\n",++goal_hits);
+	start = goal < 0 ? 0 : goal;
+repeat:
+	if (start >= end)
+		return -1;
+	j = start;
+	if (goal >= 0) {
+		if (!ext2_test_bit (j, bh->b_data))
 			goto got_block;
-		}
 		if (j) {
 			/*
 			 * The goal was occupied; search forward for a free 
@@ -424,208 +362,457 @@ repeat:
 			 * next 64-bit boundary is simple..
 			 */
 			int end_goal = (j + 63) & ~63;
+			if (end_goal > end)
+				end_goal = end;
 			j = ext2_find_next_zero_bit(bh->b_data, end_goal, j);
 			if (j < end_goal)
 				goto got_block;
+			j = start;
 		}
-	
-		ext2_debug ("Bit not found near goal\n");
+	}
 
-		/*
-		 * There has been no free block found in the near vicinity
-		 * of the goal: do a search forward through the block groups,
-		 * searching in each group first for an entire free byte in
-		 * the bitmap and then for any free bit.
-		 * 
-		 * Search first in the remainder of the current group; then,
-		 * cyclicly search through the rest of the groups.
-		 */
-		p = ((char *) bh->b_data) + (j >> 3);
-		r = memscan(p, 0, (EXT2_BLOCKS_PER_GROUP(sb) - j + 7) >> 3);
+	k = (j + 7) >> 3;
+	if (k < (end >> 3)) {
+		p = ((char *) bh->b_data) + k;
+		r = memscan(p, 0, (end >> 3) - k);
 		k = (r - ((char *) bh->b_data)) << 3;
-		if (k < EXT2_BLOCKS_PER_GROUP(sb)) {
+		if (k + 8 <= end) {
+			/*
+			 * We have succeeded in finding a free byte in the
+			 * block bitmap.  Now search backwards up to 7 bits
+			 * to find the start of this group of free blocks.
+			 */
 			j = k;
-			goto search_back;
+			for (k = 0; k < 7 && j > start &&
+				    !ext2_test_bit (j - 1, bh->b_data); k++, j--)
+				;
+			goto got_block;
 		}
+	}
 
-		k = ext2_find_next_zero_bit ((unsigned long *) bh->b_data, 
-					EXT2_BLOCKS_PER_GROUP(sb),
-					j);
-		if (k < EXT2_BLOCKS_PER_GROUP(sb)) {
-			j = k;
-			goto got_block;
+	j = ext2_find_next_zero_bit ((unsigned long *) bh->b_data, end, j);
+	if (j >= end)
+		return -1;
+
+got_block:
+	if (!claim_block (sb, group, gdp, bh, j)) {
+		start = j + 1;
+		goal = -1;
+		goto repeat;
+	}
+	return j;
+}
+
+/*
+ * Reservation windows.
+ *
+ * A regular file which is being written gets a window of blocks just
+ * ahead of where it is writing, confined to one group.  Its allocations
+ * are satisfied from the window first, and nobody else's new window may
+ * overlap it, so parallel writers in a group each grow a contiguous run
+ * rather than interleaving block by block.  The blocks are not marked
+ * in the bitmap: a window is a hint, and allocations without one take
+ * from it if they have to.  The windows of the filesystem are kept in
+ * an rbtree sorted by start block, under rsv_lock.
+ */
+
+/* The first window which ends at or after block */
+static struct ext2_reserve_window *rsv_search (rb_root_t * root,
+					       unsigned long block)
+{
+	rb_node_t * n = root->rb_node;
+	struct ext2_reserve_window * rsv, * ret = NULL;
+
+	while (n) {
+		rsv = rb_entry(n, struct ext2_reserve_window, rsv_node);
+		if (rsv->rsv_end < block)
+			n = n->rb_right;
+		else {
+			ret = rsv;
+			n = n->rb_left;
 		}
 	}
+	return ret;
+}
 
-	ext2_debug ("Bit not found in block group %d.\n", i);
+static void rsv_insert (rb_root_t * root, struct ext2_reserve_window * rsv)
+{
+	rb_node_t ** p = &root->rb_node;
+	rb_node_t * parent = NULL;
+	struct ext2_reserve_window * this;
+
+	while (*p) {
+		parent = *p;
+		this = rb_entry(parent, struct ext2_reserve_window, rsv_node);
+		if (rsv->rsv_start < this->rsv_start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&rsv->rsv_node, parent, p);
+	rb_insert_color(&rsv->rsv_node, root);
+}
 
-	/*
-	 * Now search the rest of the groups.  We assume that 
-	 * i and gdp correctly point to the last group visited.
-	 */
-	for (k = 0; k < sb->u.ext2_sb.s_groups_count; k++) {
-		i++;
-		if (i >= sb->u.ext2_sb.s_groups_count)
-			i = 0;
-		gdp = ext2_get_group_desc (sb, i, &bh2);
-		if (!gdp)
-			goto io_error;
-		if (le16_to_cpu(gdp->bg_free_blocks_count) > 0)
+void ext2_discard_reservation (struct inode * inode)
+{
+	struct ext2_reserve_window * rsv = &inode->u.ext2_i.i_rsv_window;
+	struct ext2_balloc_info * bi = inode->i_sb->u.ext2_sb.s_balloc;
+
+	if (!rsv->rsv_end)
+		return;
+	spin_lock(&bi->rsv_lock);
+	if (rsv->rsv_end) {
+		rb_erase(&rsv->rsv_node, &bi->rsv_root);
+		rsv->rsv_end = 0;
+	}
+	spin_unlock(&bi->rsv_lock);
+}
+
+/*
+ * Give the file a new window in this group, starting at the first free
+ * block at or after bit goal (or the start of the group).  The window
+ * grows each time the last one was more than half used.
+ *
+ * Returns 0, or -1 if there is no room for one in the group.
+ */
+static int alloc_new_reservation (struct super_block * sb, int group,
+				  struct buffer_head * bh, int goal,
+				  struct ext2_reserve_window * rsv)
+{
+	struct ext2_balloc_info * bi = sb->u.ext2_sb.s_balloc;
+	struct ext2_reserve_window * next;
+	unsigned long group_first, group_end, start, end;
+	unsigned long size = rsv->rsv_goal_size;
+	int bit;
+
+	if (rsv->rsv_end &&
+	    rsv->rsv_alloc_hit > (rsv->rsv_end - rsv->rsv_start + 1) / 2) {
+		size *= 2;
+		if (size > EXT2_MAX_RESERVE_BLOCKS)
+			size = EXT2_MAX_RESERVE_BLOCKS;
+		rsv->rsv_goal_size = size;
+	}
+
+	group_first = group * EXT2_BLOCKS_PER_GROUP(sb) +
+		      le32_to_cpu(sb->u.ext2_sb.s_es->s_first_data_block);
+	group_end = EXT2_BLOCKS_PER_GROUP(sb);
+	if (group_first + group_end >
+	    le32_to_cpu(sb->u.ext2_sb.s_es->s_blocks_count))
+		group_end = le32_to_cpu(sb->u.ext2_sb.s_es->s_blocks_count) -
+			    group_first;
+	bit = goal < 0 ? 0 : goal;
+
+	spin_lock(&bi->rsv_lock);
+	if (rsv->rsv_end) {
+		rb_erase(&rsv->rsv_node, &bi->rsv_root);
+		rsv->rsv_end = 0;
+	}
+	for (;;) {
+		bit = ext2_find_next_zero_bit ((unsigned long *) bh->b_data,
+					       group_end, bit);
+		if (bit >= group_end)
+			goto fail;
+		start = group_first + bit;
+		end = start + size - 1;
+		if (end >= group_first + group_end)
+			end = group_first + group_end - 1;
+		next = rsv_search (&bi->rsv_root, start);
+		if (!next || next->rsv_start > end)
+			break;
+		if (next->rsv_start > start) {
+			/* Take what there is up to the next window */
+			end = next->rsv_start - 1;
 			break;
+		}
+		/* Inside someone else's window: go past it */
+		bit = next->rsv_end + 1 - group_first;
+		if (bit >= group_end)
+			goto fail;
 	}
-	if (k >= sb->u.ext2_sb.s_groups_count)
-		goto out;
-	bitmap_nr = load_block_bitmap (sb, i);
-	if (bitmap_nr < 0)
-		goto io_error;
-	
-	bh = sb->u.ext2_sb.s_block_bitmap[bitmap_nr];
-	r = memscan(bh->b_data, 0, EXT2_BLOCKS_PER_GROUP(sb) >> 3);
-	j = (r - bh->b_data) << 3;
-	if (j < EXT2_BLOCKS_PER_GROUP(sb))
-		goto search_back;
-	else
-		j = ext2_find_first_zero_bit ((unsigned long *) bh->b_data,
-					 EXT2_BLOCKS_PER_GROUP(sb));
-	if (j >= EXT2_BLOCKS_PER_GROUP(sb)) {
-		ext2_error (sb, "ext2_new_block",
-			    "Free blocks count corrupted for block group %d", i);
-		goto out;
+	rsv->rsv_start = start;
+	rsv->rsv_end = end;
+	rsv->rsv_alloc_hit = 0;
+	rsv_insert (&bi->rsv_root, rsv);
+	spin_unlock(&bi->rsv_lock);
+	percpu_counter_inc(&bi->rsv_windows);
+	return 0;
+
+fail:
+	spin_unlock(&bi->rsv_lock);
+	return -1;
+}
+
+/*
+ * Allocate from the file's window, moving the window on, within this
+ * group, each time it fills up.  Returns the bit taken, or -1 if the
+ * group has no room for a window.
+ */
+static int alloc_with_reservation (struct super_block * sb, int group,
+				   struct ext2_group_desc * gdp,
+				   struct buffer_head * bh, int goal,
+				   struct ext2_reserve_window * rsv)
+{
+	unsigned long group_first;
+	int start, end, j;
+
+	group_first = group * EXT2_BLOCKS_PER_GROUP(sb) +
+		      le32_to_cpu(sb->u.ext2_sb.s_es->s_first_data_block);
+	for (;;) {
+		/*
+		 * The window is ours, but may be moved under us by another
+		 * allocation for the same file; it is only a hint.
+		 */
+		start = rsv->rsv_start - group_first;
+		end = rsv->rsv_end - group_first + 1;
+		if (!rsv->rsv_end || rsv->rsv_start < group_first ||
+		    end > EXT2_BLOCKS_PER_GROUP(sb) ||
+		    (goal >= 0 && (goal < start || goal >= end))) {
+			if (alloc_new_reservation (sb, group, bh, goal, rsv))
+				return -1;
+			goal = -1;
+			continue;
+		}
+		if (goal < 0)
+			goal = start;
+		j = try_to_allocate (sb, group, gdp, bh, goal, end);
+		if (j >= 0) {
+			rsv->rsv_alloc_hit++;
+			return j;
+		}
+		/* The window is full: the next one starts after it */
+		goal = end;
+		if (goal >= EXT2_BLOCKS_PER_GROUP(sb))
+			return -1;
+	}
+}
+
+/*
+ * ext2_new_blocks uses a goal block to assist allocation.  If the goal is
+ * free, or there is a free block within 32 blocks of the goal, that block
+ * is allocated.  Otherwise a forward search is made for a free block; within 
+ * each block group the search first looks for an entire free byte in the block
+ * bitmap, and then for any free bit if that fails.  Regular files allocate
+ * from their reservation window, if the filesystem is mounted with them.
+ * This function also updates quota and i_blocks field.
+ *
+ * Up to *count blocks are taken: the first one found, and as many of
+ * the blocks directly after it as are free, within its group.  *count is
+ * set to the length of the run, and its first block returned.  With
+ * EXT2_ALLOC_RESERVED the blocks were charged to quota and counted out
+ * of the free space by ext2_reserve_blocks() already.
+ *
+ * No filesystem-wide lock is taken: bits are claimed under the lock of
+ * their group, and the free blocks count in the superblock is brought up
+ * to date from the per-CPU counter by ext2_write_super().
+ */
+int ext2_new_blocks (struct inode * inode, unsigned long goal,
+		     unsigned long * count, int flags, int * err)
+{
+	struct buffer_head * bh;
+	struct buffer_head * bh2;
+	int group, bit, j, k, n, ngroups;
+	unsigned long block, want;
+	struct super_block * sb;
+	struct ext2_balloc_info * bi;
+	struct ext2_reserve_window * rsv = NULL;
+	struct ext2_group_desc * gdp;
+	struct ext2_super_block * es;
+
+	want = *count;
+	*count = 0;
+	*err = -ENOSPC;
+	sb = inode->i_sb;
+	if (!sb) {
+		printk ("ext2_new_blocks: nonexistent device");
+		return 0;
 	}
+	es = sb->u.ext2_sb.s_es;
+	bi = sb->u.ext2_sb.s_balloc;
 
-search_back:
-	/* 
-	 * We have succeeded in finding a free byte in the block
-	 * bitmap.  Now search backwards up to 7 bits to find the
-	 * start of this group of free blocks.
+	/*
+	 * Check quota for allocation of the first block; the rest of the
+	 * run is charged once we know how long it is.
 	 */
-	for (k = 0; k < 7 && j > 0 && !ext2_test_bit (j - 1, bh->b_data); k++, j--);
-	
-got_block:
+	if (!(flags & EXT2_ALLOC_RESERVED)) {
+		if (DQUOT_ALLOC_BLOCK(inode, 1)) {
+			*err = -EDQUOT;
+			return 0;
+		}
+		if (!ext2_has_free_blocks (sb, 1))
+			goto out;
+	}
 
-	ext2_debug ("using block group %d(%d)\n", i, gdp->bg_free_blocks_count);
+	if (test_opt (sb, RESERVATION) && S_ISREG(inode->i_mode))
+		rsv = &inode->u.ext2_i.i_rsv_window;
+
+	ext2_debug ("goal=%lu.\n", goal);
+
+	if (goal < le32_to_cpu(es->s_first_data_block) ||
+	    goal >= le32_to_cpu(es->s_blocks_count))
+		goal = le32_to_cpu(es->s_first_data_block);
+	group = (goal - le32_to_cpu(es->s_first_data_block)) /
+		EXT2_BLOCKS_PER_GROUP(sb);
+	bit = (goal - le32_to_cpu(es->s_first_data_block)) %
+	      EXT2_BLOCKS_PER_GROUP(sb);
 
 	/*
-	 * Check quota for allocation of this block.
+	 * Search the goal's group, then cyclicly the rest of the groups.
+	 * If no group has room for a window, go round once more taking
+	 * any free block.
 	 */
-	if(DQUOT_ALLOC_BLOCK(inode, 1)) {
-		*err = -EDQUOT;
-		goto out;
+	ngroups = sb->u.ext2_sb.s_groups_count;
+	for (n = 0; n < 2 * ngroups; n++) {
+		if (n == ngroups) {
+			if (!rsv)
+				break;
+			rsv = NULL;
+		}
+		gdp = ext2_get_group_desc (sb, group, &bh2);
+		if (!gdp)
+			goto io_error;
+		if (le16_to_cpu(gdp->bg_free_blocks_count) > 0) {
+			bh = read_block_bitmap (sb, group);
+			if (!bh)
+				goto io_error;
+retry:
+			if (rsv)
+				j = alloc_with_reservation (sb, group, gdp, bh,
+							    bit, rsv);
+			else
+				j = try_to_allocate (sb, group, gdp, bh, bit,
+						     EXT2_BLOCKS_PER_GROUP(sb));
+			if (j >= 0)
+				goto got_block;
+			brelse (bh);
+		}
+		ext2_debug ("Bit not found in block group %d.\n", group);
+		if (++group >= ngroups)
+			group = 0;
+		bit = -1;
 	}
+	goto out;
 
-	tmp = j + i * EXT2_BLOCKS_PER_GROUP(sb) + le32_to_cpu(es->s_first_data_block);
+got_block:
+	block = j + group * EXT2_BLOCKS_PER_GROUP(sb) +
+		le32_to_cpu(es->s_first_data_block);
 
-	if (tmp == le32_to_cpu(gdp->bg_block_bitmap) ||
-	    tmp == le32_to_cpu(gdp->bg_inode_bitmap) ||
-	    in_range (tmp, le32_to_cpu(gdp->bg_inode_table),
+	if (block == le32_to_cpu(gdp->bg_block_bitmap) ||
+	    block == le32_to_cpu(gdp->bg_inode_bitmap) ||
+	    in_range (block, le32_to_cpu(gdp->bg_inode_table),
 		      EXT2_SB(sb)->s_itb_per_group)) {
 		ext2_error (sb, "ext2_new_block",
-			    "Allocating block in system zone - block = %u",
-			    tmp);
-		ext2_set_bit(j, bh->b_data);
-		DQUOT_FREE_BLOCK(inode, 1);
-		goto repeat;
+			    "Allocating block in system zone - block = %lu",
+			    block);
+		/* It stays marked in use; look on from there */
+		bit = j;
+		goto retry;
 	}
 
-	if (ext2_set_bit (j, bh->b_data)) {
-		ext2_warning (sb, "ext2_new_block",
-			      "bit already set for block %d", j);
-		DQUOT_FREE_BLOCK(inode, 1);
-		goto repeat;
+	if (block >= le32_to_cpu(es->s_blocks_count)) {
+		ext2_error (sb, "ext2_new_block",
+			    "block(%lu) >= blocks count(%d) - "
+			    "block_group = %d, es == %p ", block,
+			le32_to_cpu(es->s_blocks_count), group, es);
+		brelse (bh);
+		goto out;
 	}
 
-	ext2_debug ("found bit %d\n", j);
+	ext2_debug ("allocating block %lu in group %d\n", block, group);
 
 	/*
-	 * Do block preallocation now if required.
+	 * Extend the run over the free blocks which follow, as far as the
+	 * caller wants and the group goes.  Blocks in use, the group's own
+	 * bitmaps and inode table included, end it.
 	 */
-#ifdef EXT2_PREALLOCATE
-	/* Writer: ->i_prealloc* */
-	if (prealloc_count && !*prealloc_count) {
-		int	prealloc_goal;
-		unsigned long next_block = tmp + 1;
-
-		prealloc_goal = es->s_prealloc_blocks ?
-			es->s_prealloc_blocks : EXT2_DEFAULT_PREALLOC_BLOCKS;
-
-		*prealloc_block = next_block;
-		/* Writer: end */
-		for (k = 1;
-		     k < prealloc_goal && (j + k) < EXT2_BLOCKS_PER_GROUP(sb);
-		     k++, next_block++) {
-			if (DQUOT_PREALLOC_BLOCK(inode, 1))
-				break;
-			/* Writer: ->i_prealloc* */
-			if (*prealloc_block + *prealloc_count != next_block ||
-			    ext2_set_bit (j + k, bh->b_data)) {
-				/* Writer: end */
-				DQUOT_FREE_BLOCK(inode, 1);
- 				break;
-			}
-			(*prealloc_count)++;
-			/* Writer: end */
-		}	
-		/*
-		 * As soon as we go for per-group spinlocks we'll need these
-		 * done inside the loop above.
-		 */
-		gdp->bg_free_blocks_count =
-			cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) -
-			       (k - 1));
-		es->s_free_blocks_count =
-			cpu_to_le32(le32_to_cpu(es->s_free_blocks_count) -
-			       (k - 1));
-		ext2_debug ("Preallocated a further %lu bits.\n",
-			       (k - 1));
+	k = 0;
+	if (want > 1) {
+		int ext = want - 1;
+
+		if (j + 1 + ext > EXT2_BLOCKS_PER_GROUP(sb))
+			ext = EXT2_BLOCKS_PER_GROUP(sb) - j - 1;
+		if (ext > 0 && ((flags & EXT2_ALLOC_RESERVED) ||
+				!DQUOT_PREALLOC_BLOCK(inode, ext))) {
+			spin_lock(ext2_bg_lock(sb, group));
+			for (k = 0; k < ext; k++)
+				if (ext2_set_bit (j + 1 + k, bh->b_data))
+					break;
+			gdp->bg_free_blocks_count =
+				cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) - k);
+			spin_unlock(ext2_bg_lock(sb, group));
+			if (k < ext && !(flags & EXT2_ALLOC_RESERVED))
+				DQUOT_FREE_BLOCK(inode, ext - k);
+			if (rsv)
+				rsv->rsv_alloc_hit += k;
+			ext2_debug ("Extended the run by %d bits.\n", k);
+		}
 	}
-#endif
 
-	j = tmp;
+	percpu_counter_mod(&bi->free_blocks, -(k + 1));
+	if (flags & EXT2_ALLOC_RESERVED)
+		ext2_delayed_mod (inode, -(k + 1));
+	if (rsv)
+		percpu_counter_mod(&bi->rsv_hits, k + 1);
+	else
+		percpu_counter_mod(&bi->rsv_misses, k + 1);
 
 	mark_buffer_dirty(bh);
 	if (sb->s_flags & MS_SYNCHRONOUS) {
 		ll_rw_block (WRITE, 1, &bh);
 		wait_on_buffer (bh);
 	}
+	brelse (bh);
 
-	if (j >= le32_to_cpu(es->s_blocks_count)) {
-		ext2_error (sb, "ext2_new_block",
-			    "block(%d) >= blocks count(%d) - "
-			    "block_group = %d, es == %p ",j,
-			le32_to_cpu(es->s_blocks_count), i, es);
-		goto out;
-	}
-
-	ext2_debug ("allocating block %d. "
-		    "Goal hits %d of %d.\n", j, goal_hits, goal_attempts);
-
-	gdp->bg_free_blocks_count = cpu_to_le16(le16_to_cpu(gdp->bg_free_blocks_count) - 1);
 	mark_buffer_dirty(bh2);
-	es->s_free_blocks_count = cpu_to_le32(le32_to_cpu(es->s_free_blocks_count) - 1);
-	mark_buffer_dirty(sb->u.ext2_sb.s_sbh);
 	sb->s_dirt = 1;
-	unlock_super (sb);
+	*count = k + 1;
 	*err = 0;
-	return j;
+	return block;
 	
 io_error:
 	*err = -EIO;
 out:
-	unlock_super (sb);
+	if (!(flags & EXT2_ALLOC_RESERVED))
+		DQUOT_FREE_BLOCK(inode, 1);
 	return 0;
 	
 }
 
+/*
+ * Allocate one block, and preallocate the blocks after it if the caller
+ * has room for them: they are returned through *prealloc_block and
+ * *prealloc_count, which the caller must install in the inode itself.
+ */
+int ext2_new_block (struct inode * inode, unsigned long goal,
+    u32 * prealloc_count, u32 * prealloc_block, int * err)
+{
+	unsigned long count = 1;
+	int block;
+
+#ifdef EXT2_PREALLOCATE
+	if (prealloc_count && !*prealloc_count) {
+		struct ext2_super_block * es = inode->i_sb->u.ext2_sb.s_es;
+
+		count = es->s_prealloc_blocks ?
+			es->s_prealloc_blocks : EXT2_DEFAULT_PREALLOC_BLOCKS;
+	}
+#endif
+	block = ext2_new_blocks (inode, goal, &count, 0, err);
+	if (block && count > 1) {
+		*prealloc_block = block + 1;
+		*prealloc_count = count - 1;
+	}
+	return block;
+}
+
 unsigned long ext2_count_free_blocks (struct super_block * sb)
 {
 #ifdef EXT2FS_DEBUG
 	struct ext2_super_block * es;
 	unsigned long desc_count, bitmap_count, x;
-	int bitmap_nr;
+	struct buffer_head * bh;
 	struct ext2_group_desc * gdp;
 	int i;
 	
-	lock_super (sb);
 	es = sb->u.ext2_sb.s_es;
 	desc_count = 0;
 	bitmap_count = 0;
@@ -635,22 +822,24 @@ unsigned long ext2_count_free_blocks (struct super_block * sb)
 		if (!gdp)
 			continue;
 		desc_count += le16_to_cpu(gdp->bg_free_blocks_count);
-		bitmap_nr = load_block_bitmap (sb, i);
-		if (bitmap_nr < 0)
+		bh = read_block_bitmap (sb, i);
+		if (!bh)
 			continue;
 		
-		x = ext2_count_free (sb->u.ext2_sb.s_block_bitmap[bitmap_nr],
-				     sb->s_blocksize);
+		x = ext2_count_free (bh, sb->s_blocksize);
+		brelse (bh);
 		printk ("group %d: stored = %d, counted = %lu\n",
 			i, le16_to_cpu(gdp->bg_free_blocks_count), x);
 		bitmap_count += x;
 	}
-	printk("ext2_count_free_blocks: stored = %lu, computed = %lu, %lu\n",
-	       le32_to_cpu(es->s_free_blocks_count), desc_count, bitmap_count);
-	unlock_super (sb);
+	printk("ext2_count_free_blocks: stored = %ld, computed = %lu, %lu\n",
+	       percpu_counter_read(&sb->u.ext2_sb.s_balloc->free_blocks),
+	       desc_count, bitmap_count);
 	return bitmap_count;
 #else
-	return le32_to_cpu(sb->u.ext2_sb.s_es->s_free_blocks_count);
+	long count = percpu_counter_read(&sb->u.ext2_sb.s_balloc->free_blocks);
+
+	return count > 0 ? count : 0;
 #endif
 }
 
@@ -722,7 +911,6 @@ void ext2_check_blocks_bitmap (struct super_block * sb)
 	struct ext2_super_block * es;
 	unsigned long desc_count, bitmap_count, x, j;
 	unsigned long desc_blocks;
-	int bitmap_nr;
 	struct ext2_group_desc * gdp;
 	int i;
 
@@ -735,12 +923,10 @@ void ext2_check_blocks_bitmap (struct super_block * sb)
 		if (!gdp)
 			continue;
 		desc_count += le16_to_cpu(gdp->bg_free_blocks_count);
-		bitmap_nr = load_block_bitmap (sb, i);
-		if (bitmap_nr < 0)
+		bh = read_block_bitmap (sb, i);
+		if (!bh)
 			continue;
 
-		bh = EXT2_SB(sb)->s_block_bitmap[bitmap_nr];
-
 		if (ext2_bg_has_super(sb, i) && !ext2_test_bit(0, bh->b_data))
 			ext2_error(sb, __FUNCTION__,
 				   "Superblock in group %d is marked free", i);
@@ -775,6 +961,7 @@ void ext2_check_blocks_bitmap (struct super_block * sb)
 				    "stored = %d, counted = %lu", i,
 				    le16_to_cpu(gdp->bg_free_blocks_count), x);
 		bitmap_count += x;
+		brelse (bh);
 	}
 	if (le32_to_cpu(es->s_free_blocks_count) != bitmap_count)
 		ext2_error (sb, "ext2_check_blocks_bitmap",
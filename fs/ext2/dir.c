@@ -24,6 +24,8 @@
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
 #include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
 
 typedef struct ext2_dir_entry_2 ext2_dirent;
 
@@ -234,6 +236,9 @@ static inline void ext2_set_de_type(ext2_dirent *de, struct inode *inode)
 		de->file_type = 0;
 }
 
+static inline int ext2_is_dx(struct inode *dir);
+static int ext2_dx_readdir(struct file *filp, void *dirent, filldir_t filldir);
+
 static int
 ext2_readdir (struct file * filp, void * dirent, filldir_t filldir)
 {
@@ -247,6 +252,15 @@ ext2_readdir (struct file * filp, void * dirent, filldir_t filldir)
 	unsigned char *types = NULL;
 	int need_revalidate = (filp->f_version != inode->i_version);
 
+	if (ext2_is_dx(inode)) {
+		int err = ext2_dx_readdir(filp, dirent, filldir);
+
+		if (err != ERR_BAD_DX_DIR)
+			return err;
+		/* Read it the old way from now on; no need to write that */
+		inode->u.ext2_i.i_flags &= ~EXT2_INDEX_FL;
+	}
+
 	if (pos > inode->i_size - EXT2_DIR_REC_LEN(1))
 		goto done;
 
@@ -294,6 +308,629 @@ done:
 	return 0;
 }
 
+/*
+ * Hashed directory indexes
+ *
+ * The layout is the one ext3 uses.  Block 0 keeps "." and "..", with
+ * ".." covering the rest of the block and hiding the root of a tree
+ * of (hash, block) pairs; index nodes are blocks holding one empty
+ * entry which hides more pairs.  Leaves are ordinary directory blocks.
+ * To kernels which know nothing of the index it all looks like a
+ * directory with some empty blocks.
+ *
+ * Two levels of index are all we handle.  A directory whose index we
+ * cannot make sense of is searched the old way.
+ */
+
+struct fake_dirent
+{
+	__u32 inode;
+	__u16 rec_len;
+	__u8 name_len;
+	__u8 file_type;
+};
+
+struct dx_countlimit
+{
+	__u16 limit;
+	__u16 count;
+};
+
+struct dx_entry
+{
+	__u32 hash;
+	__u32 block;
+};
+
+/*
+ * dx_root_info is laid out so that if it should somehow get overlaid
+ * by a dirent the two low bits of the hash version will be zero.
+ */
+struct dx_root
+{
+	struct fake_dirent dot;
+	char dot_name[4];
+	struct fake_dirent dotdot;
+	char dotdot_name[4];
+	struct dx_root_info
+	{
+		__u32 reserved_zero;
+		__u8 hash_version;
+		__u8 info_length; /* 8 */
+		__u8 indirect_levels;
+		__u8 unused_flags;
+	}
+	info;
+	struct dx_entry	entries[0];
+};
+
+struct dx_node
+{
+	struct fake_dirent fake;
+	struct dx_entry	entries[0];
+};
+
+/* One level of a path from the root down to a leaf */
+struct dx_frame
+{
+	struct page *page;
+	struct dx_entry *entries;
+	struct dx_entry *at;
+};
+
+struct dx_map_entry
+{
+	u32 hash;
+	u16 offs;
+	u16 size;
+};
+
+/*
+ * The first entry of each index block holds the count and the limit
+ * in place of a hash; its block is the leaf for the lowest hashes.
+ */
+static inline unsigned dx_get_block (struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->block) & 0x00ffffff;
+}
+
+static inline void dx_set_block (struct dx_entry *entry, unsigned value)
+{
+	entry->block = cpu_to_le32(value);
+}
+
+static inline unsigned dx_get_hash (struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->hash);
+}
+
+static inline void dx_set_hash (struct dx_entry *entry, unsigned value)
+{
+	entry->hash = cpu_to_le32(value);
+}
+
+static inline unsigned dx_get_count (struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *) entries)->count);
+}
+
+static inline unsigned dx_get_limit (struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *) entries)->limit);
+}
+
+static inline void dx_set_count (struct dx_entry *entries, unsigned value)
+{
+	((struct dx_countlimit *) entries)->count = cpu_to_le16(value);
+}
+
+static inline void dx_set_limit (struct dx_entry *entries, unsigned value)
+{
+	((struct dx_countlimit *) entries)->limit = cpu_to_le16(value);
+}
+
+static inline unsigned dx_root_limit (struct inode *dir, unsigned infosize)
+{
+	unsigned entry_space = ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(1) -
+		EXT2_DIR_REC_LEN(2) - infosize;
+	return entry_space / sizeof(struct dx_entry);
+}
+
+static inline unsigned dx_node_limit (struct inode *dir)
+{
+	unsigned entry_space = ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(0);
+	return entry_space / sizeof(struct dx_entry);
+}
+
+static inline int ext2_is_dx(struct inode *dir)
+{
+	return EXT2_HAS_COMPAT_FEATURE(dir->i_sb,
+				       EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+	       (dir->u.ext2_i.i_flags & EXT2_INDEX_FL);
+}
+
+/*
+ * Without the DIR_INDEX feature an index cannot be trusted to be kept
+ * up to date, so any change to the directory drops it.
+ */
+static inline void ext2_update_dx_flag(struct inode *dir)
+{
+	if (!EXT2_HAS_COMPAT_FEATURE(dir->i_sb,
+				     EXT2_FEATURE_COMPAT_DIR_INDEX))
+		dir->u.ext2_i.i_flags &= ~EXT2_INDEX_FL;
+}
+
+/*
+ * The index code works a block at a time: map block n of the
+ * directory, returning the page it lives in and its address in *data.
+ */
+static struct page *ext2_get_dir_block(struct inode *dir, unsigned long n,
+				       char **data)
+{
+	unsigned bits = dir->i_sb->s_blocksize_bits;
+	struct page *page = ext2_get_page(dir, n >> (PAGE_CACHE_SHIFT - bits));
+
+	if (!IS_ERR(page))
+		*data = (char *) page_address(page) +
+			((n << bits) & ~PAGE_CACHE_MASK);
+	return page;
+}
+
+static void dx_release (struct dx_frame *frames)
+{
+	if (frames[1].page)
+		ext2_put_page(frames[1].page);
+	if (frames[0].page)
+		ext2_put_page(frames[0].page);
+}
+
+/*
+ * Walk the index from the root down to the leaf which would hold the
+ * name, filling in one frame per level and the name's hash; without a
+ * name, down to the leaf for hinfo->hash.  Returns the bottom frame, or
+ * NULL with *err set; ERR_BAD_DX_DIR means the index is not one we
+ * understand.
+ */
+static struct dx_frame *dx_probe(struct inode *dir, struct qstr *name,
+				 struct dx_hash_info *hinfo,
+				 struct dx_frame *frame_in, int *err)
+{
+	unsigned count, indirect;
+	struct dx_entry *at, *entries, *p, *q, *m;
+	struct dx_root *root;
+	struct dx_frame *frame = frame_in;
+	struct page *page;
+	char *data, *error;
+	u32 hash;
+
+	frame_in[0].page = frame_in[1].page = NULL;
+	page = ext2_get_dir_block(dir, 0, &data);
+	if (IS_ERR(page)) {
+		*err = PTR_ERR(page);
+		return NULL;
+	}
+	root = (struct dx_root *) data;
+	error = "unrecognised hash version";
+	if (root->info.hash_version > EXT2_HASH_TEA)
+		goto bad;
+	error = "unimplemented hash flags";
+	if (root->info.unused_flags & 1)
+		goto bad;
+	error = "unimplemented hash depth";
+	if ((indirect = root->info.indirect_levels) > 1)
+		goto bad;
+
+	hinfo->hash_version = root->info.hash_version;
+	hinfo->seed = dir->i_sb->u.ext2_sb.s_hash_seed;
+	if (name)
+		dx_hash((const char *) name->name, name->len, hinfo);
+	hash = hinfo->hash;
+
+	entries = (struct dx_entry *) (((char *)&root->info) +
+				       root->info.info_length);
+	error = "limit != root limit";
+	if (dx_get_limit(entries) != dx_root_limit(dir,
+						   root->info.info_length))
+		goto bad;
+
+	while (1) {
+		count = dx_get_count(entries);
+		error = "no count or count > limit";
+		if (!count || count > dx_get_limit(entries))
+			goto bad;
+
+		/* Binary search for the last key not above the hash */
+		p = entries + 1;
+		q = entries + count - 1;
+		while (p <= q) {
+			m = p + (q - p)/2;
+			if (dx_get_hash(m) > hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		at = p - 1;
+
+		frame->page = page;
+		frame->entries = entries;
+		frame->at = at;
+		if (!indirect--)
+			return frame;
+		page = ext2_get_dir_block(dir, dx_get_block(at), &data);
+		if (IS_ERR(page)) {
+			*err = PTR_ERR(page);
+			goto fail;
+		}
+		entries = ((struct dx_node *) data)->entries;
+		error = "limit != node limit";
+		if (dx_get_limit(entries) != dx_node_limit(dir))
+			goto bad;
+		frame++;
+	}
+
+bad:
+	ext2_put_page(page);
+	ext2_warning(dir->i_sb, "dx_probe", "bad index in directory #%lu: "
+		     "%s, running e2fsck is recommended", dir->i_ino, error);
+	*err = ERR_BAD_DX_DIR;
+fail:
+	dx_release(frame_in);
+	return NULL;
+}
+
+/*
+ * Step the path in frames to the next leaf, if that leaf continues
+ * the run of names with this hash: the low bit of a leaf's key is set
+ * when a split left names with the same hash on both sides.  With
+ * @next_hash, step to the next leaf whatever its key, and store the
+ * key there.  Returns 1 if the caller should search the next leaf, 0
+ * if not, or an error.
+ */
+static int dx_next_block(struct inode *dir, u32 hash, u32 *next_hash,
+			 struct dx_frame *frame, struct dx_frame *frames)
+{
+	struct dx_frame *p;
+	struct page *page;
+	char *data;
+	int num_frames = 0;
+
+	p = frame;
+	while (1) {
+		if (++(p->at) < p->entries + dx_get_count(p->entries))
+			break;
+		if (p == frames)
+			return 0;
+		num_frames++;
+		p--;
+	}
+
+	if (next_hash)
+		*next_hash = dx_get_hash(p->at);
+	else if ((dx_get_hash(p->at) & ~1) != hash)
+		return 0;
+
+	while (num_frames--) {
+		page = ext2_get_dir_block(dir, dx_get_block(p->at), &data);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		p++;
+		ext2_put_page(p->page);
+		p->page = page;
+		p->at = p->entries = ((struct dx_node *) data)->entries;
+	}
+	return 1;
+}
+
+static ext2_dirent *ext2_dx_find_entry(struct inode *dir,
+			struct dentry *dentry, struct page **res_page, int *err)
+{
+	const char *name = (const char *) dentry->d_name.name;
+	int namelen = dentry->d_name.len;
+	struct dx_hash_info hinfo;
+	struct dx_frame frames[2], *frame;
+	struct page *page;
+	ext2_dirent *de;
+	char *data, *top;
+	int retval;
+
+	if (!(frame = dx_probe(dir, &dentry->d_name, &hinfo, frames, err)))
+		return NULL;
+	do {
+		page = ext2_get_dir_block(dir, dx_get_block(frame->at), &data);
+		if (IS_ERR(page)) {
+			*err = PTR_ERR(page);
+			goto errout;
+		}
+		top = data + ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(namelen);
+		for (de = (ext2_dirent *) data; (char *) de <= top;
+		     de = ext2_next_entry(de))
+			if (ext2_match (namelen, name, de)) {
+				dx_release (frames);
+				*res_page = page;
+				return de;
+			}
+		ext2_put_page(page);
+		retval = dx_next_block(dir, hinfo.hash, NULL, frame, frames);
+		if (retval < 0) {
+			*err = retval;
+			goto errout;
+		}
+	} while (retval == 1);
+
+	*err = -ENOENT;
+errout:
+	dx_release (frames);
+	return NULL;
+}
+
+/*
+ * readdir of an indexed directory
+ *
+ * A split moves names from a full leaf to a new block, so a readdir
+ * which went by block offsets would miss some names, and see others
+ * twice, if a split came between two of its calls.  An indexed
+ * directory is read in hash order instead, and f_pos is the hash of the
+ * next name to go out (shifted down a bit: hashes are even, and f_pos
+ * must stay below EXT2_HTREE_EOF).  A name keeps its hash wherever it
+ * is moved.  The names of one leaf, and of any leaves carrying on its
+ * last hash, are read into a tree sorted by hash, kept with the file
+ * until they have all gone out or the directory changes.
+ */
+
+struct ext2_fname {
+	rb_node_t		rb_hash;
+	struct ext2_fname	*next;		/* more with the same hashes */
+	u32			hash;
+	u32			minor_hash;
+	u32			inode;
+	u8			name_len;
+	u8			file_type;
+	char			name[0];
+};
+
+struct ext2_dir_private {
+	rb_root_t		root;		/* names read in, by hash */
+	rb_node_t		*curr_node;	/* the next to go out */
+	struct ext2_fname	*extra_fname;	/* filldir had no room */
+	loff_t			last_pos;	/* f_pos as we left it */
+	u32			curr_hash;	/* where we are */
+	u32			curr_minor_hash;
+	u32			next_hash;	/* key of the next leaf, or ~0 */
+};
+
+#define hash2pos(hash)	((loff_t) ((hash) >> 1))
+#define pos2hash(pos)	((u32) ((pos) << 1))
+
+static void ext2_free_fnames(rb_root_t *root)
+{
+	struct ext2_fname *fname, *next;
+	rb_node_t *n;
+
+	while ((n = rb_first(root)) != NULL) {
+		rb_erase(n, root);
+		fname = rb_entry(n, struct ext2_fname, rb_hash);
+		for (; fname; fname = next) {
+			next = fname->next;
+			kfree(fname);
+		}
+	}
+}
+
+static int ext2_store_fname(struct ext2_dir_private *info, u32 hash,
+			    u32 minor_hash, ext2_dirent *de)
+{
+	rb_node_t **p = &info->root.rb_node, *parent = NULL;
+	struct ext2_fname *fname, *new;
+
+	new = kmalloc(sizeof(*new) + de->name_len + 1, GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	new->next = NULL;
+	new->hash = hash;
+	new->minor_hash = minor_hash;
+	new->inode = le32_to_cpu(de->inode);
+	new->name_len = de->name_len;
+	new->file_type = de->file_type;
+	memcpy(new->name, de->name, de->name_len);
+	new->name[de->name_len] = 0;
+
+	while (*p) {
+		parent = *p;
+		fname = rb_entry(parent, struct ext2_fname, rb_hash);
+		if (hash < fname->hash ||
+		    (hash == fname->hash && minor_hash < fname->minor_hash))
+			p = &parent->rb_left;
+		else if (hash > fname->hash || minor_hash > fname->minor_hash)
+			p = &parent->rb_right;
+		else {
+			/* Both hashes collide: chain it on */
+			new->next = fname->next;
+			fname->next = new;
+			return 0;
+		}
+	}
+	rb_link_node(&new->rb_hash, parent, p);
+	rb_insert_color(&new->rb_hash, &info->root);
+	return 0;
+}
+
+/*
+ * Read the names from info->curr_hash on into the tree: those of the
+ * leaf it falls in, and of the leaves after that until one which does
+ * not carry on the last hash - or, if none were found, until some are.
+ * "." and ".." count as hashes 0 and 2.  Returns how many were read,
+ * or an error.
+ */
+static int ext2_dx_fill_tree(struct inode *dir, struct ext2_dir_private *info)
+{
+	u32 start_hash = info->curr_hash;
+	u32 start_minor_hash = info->curr_minor_hash;
+	struct dx_hash_info hinfo;
+	struct dx_frame frames[2], *frame;
+	struct page *page;
+	ext2_dirent *de;
+	char *data, *top;
+	int count = 0, err;
+
+	hinfo.hash = start_hash;
+	hinfo.minor_hash = 0;
+	if (!(frame = dx_probe(dir, NULL, &hinfo, frames, &err)))
+		return err;
+
+	de = (ext2_dirent *) page_address(frames[0].page);
+	if (!start_hash && !start_minor_hash) {
+		if ((err = ext2_store_fname(info, 0, 0, de)) != 0)
+			goto out;
+		count++;
+	}
+	if (start_hash < 2 || (start_hash == 2 && !start_minor_hash)) {
+		if ((err = ext2_store_fname(info, 2, 0,
+					    ext2_next_entry(de))) != 0)
+			goto out;
+		count++;
+	}
+
+	while (1) {
+		page = ext2_get_dir_block(dir, dx_get_block(frame->at), &data);
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			goto out;
+		}
+		top = data + ext2_chunk_size(dir) - EXT2_DIR_REC_LEN(1);
+		for (de = (ext2_dirent *) data; (char *) de <= top;
+		     de = ext2_next_entry(de)) {
+			if (!de->inode)
+				continue;
+			dx_hash(de->name, de->name_len, &hinfo);
+			if (hinfo.hash < start_hash ||
+			    (hinfo.hash == start_hash &&
+			     hinfo.minor_hash < start_minor_hash))
+				continue;
+			err = ext2_store_fname(info, hinfo.hash,
+					       hinfo.minor_hash, de);
+			if (err) {
+				ext2_put_page(page);
+				goto out;
+			}
+			count++;
+		}
+		ext2_put_page(page);
+
+		info->next_hash = ~0;
+		err = dx_next_block(dir, 0, &info->next_hash, frame, frames);
+		if (err < 0)
+			goto out;
+		if (!err || (count && !(info->next_hash & 1)))
+			break;
+	}
+	err = count;
+out:
+	dx_release(frames);
+	return err;
+}
+
+static int ext2_dx_readdir(struct file *filp, void *dirent, filldir_t filldir)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct ext2_dir_private *info = filp->private_data;
+	unsigned char *types = NULL;
+	struct ext2_fname *fname;
+	int err = 0;
+
+	if (!info) {
+		info = kmalloc(sizeof(*info), GFP_KERNEL);
+		if (!info)
+			return -ENOMEM;
+		memset(info, 0, sizeof(*info));
+		info->root = RB_ROOT;
+		info->last_pos = -1;
+		filp->private_data = info;
+	}
+	if (filp->f_pos == EXT2_HTREE_EOF)
+		return 0;
+
+	if (EXT2_HAS_INCOMPAT_FEATURE(inode->i_sb,
+				      EXT2_FEATURE_INCOMPAT_FILETYPE))
+		types = ext2_filetype_table;
+
+	/* Somebody has moved f_pos, or the names read in are stale */
+	if (info->last_pos != filp->f_pos ||
+	    filp->f_version != inode->i_version) {
+		ext2_free_fnames(&info->root);
+		info->curr_node = NULL;
+		info->extra_fname = NULL;
+		if (info->last_pos != filp->f_pos) {
+			info->curr_hash = pos2hash(filp->f_pos);
+			info->curr_minor_hash = 0;
+		}
+		filp->f_version = inode->i_version;
+	}
+
+	/* The rest of a chain which filldir had no room for goes first */
+	fname = info->extra_fname;
+	info->extra_fname = NULL;
+	while (1) {
+		if (!fname) {
+			if (!info->curr_node) {
+				err = ext2_dx_fill_tree(inode, info);
+				if (err < 0) {
+					ext2_free_fnames(&info->root);
+					goto out;
+				}
+				if (!err) {
+					filp->f_pos = EXT2_HTREE_EOF;
+					break;
+				}
+				err = 0;
+				info->curr_node = rb_first(&info->root);
+			}
+			fname = rb_entry(info->curr_node, struct ext2_fname,
+					 rb_hash);
+			info->curr_hash = fname->hash;
+			info->curr_minor_hash = fname->minor_hash;
+		}
+
+		filp->f_pos = hash2pos(info->curr_hash);
+		for (; fname; fname = fname->next) {
+			unsigned char d_type = DT_UNKNOWN;
+
+			if (types && fname->file_type < EXT2_FT_MAX)
+				d_type = types[fname->file_type];
+			if (filldir(dirent, fname->name, fname->name_len,
+				    filp->f_pos, fname->inode, d_type)) {
+				info->extra_fname = fname;
+				goto out;
+			}
+		}
+
+		info->curr_node = rb_next(info->curr_node);
+		if (!info->curr_node) {
+			ext2_free_fnames(&info->root);
+			if (info->next_hash == ~0) {
+				filp->f_pos = EXT2_HTREE_EOF;
+				break;
+			}
+			info->curr_hash = info->next_hash & ~1;
+			info->curr_minor_hash = 0;
+		}
+	}
+out:
+	info->last_pos = filp->f_pos;
+	UPDATE_ATIME(inode);
+	return err;
+}
+
+static int ext2_release_dir(struct inode *inode, struct file *filp)
+{
+	struct ext2_dir_private *info = filp->private_data;
+
+	if (info) {
+		ext2_free_fnames(&info->root);
+		kfree(info);
+	}
+	return 0;
+}
+
 /*
  *	ext2_find_entry()
  *
@@ -316,6 +953,14 @@ struct ext2_dir_entry_2 * ext2_find_entry (struct inode * dir,
 	/* OFFSET_CACHE */
 	*res_page = NULL;
 
+	if (ext2_is_dx(dir)) {
+		int err;
+
+		de = ext2_dx_find_entry(dir, dentry, res_page, &err);
+		if (de || err != ERR_BAD_DX_DIR)
+			return de;
+	}
+
 	start = dir->u.ext2_i.i_dir_start_lookup;
 	if (start >= npages)
 		start = 0;
@@ -390,12 +1035,601 @@ void ext2_set_link(struct inode *dir, struct ext2_dir_entry_2 *de,
 	UnlockPage(page);
 	ext2_put_page(page);
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-	dir->u.ext2_i.i_flags &= ~EXT2_BTREE_FL;
+	ext2_update_dx_flag(dir);
 	mark_inode_dirty(dir);
 }
 
+/*
+ * Bracket a change to the directory block at data; the page must be
+ * locked across the pair.
+ */
+static int ext2_prepare_block(struct page *page, char *data)
+{
+	unsigned from = data - (char *) page_address(page);
+
+	return page->mapping->a_ops->prepare_write(NULL, page, from,
+				from + ext2_chunk_size(page->mapping->host));
+}
+
+static int ext2_commit_block(struct page *page, char *data)
+{
+	unsigned from = data - (char *) page_address(page);
+
+	return ext2_commit_chunk(page, from,
+				 from + ext2_chunk_size(page->mapping->host));
+}
+
+/* The start of the directory block p points into */
+static inline char *dx_block_data(struct inode *dir, void *p)
+{
+	return (char *) ((unsigned long) p & ~(ext2_chunk_size(dir) - 1UL));
+}
+
+/*
+ * Hash the live entries of a leaf into a map growing down from
+ * map_tail.  Returns the number of entries.
+ */
+static int dx_make_map (ext2_dirent *de, int size,
+			struct dx_hash_info *hinfo,
+			struct dx_map_entry *map_tail)
+{
+	int count = 0;
+	char *base = (char *) de;
+	struct dx_hash_info h = *hinfo;
+
+	while ((char *) de < base + size) {
+		if (de->name_len && de->inode) {
+			dx_hash(de->name, de->name_len, &h);
+			map_tail--;
+			map_tail->hash = h.hash;
+			map_tail->offs = (char *) de - base;
+			map_tail->size = EXT2_DIR_REC_LEN(de->name_len);
+			count++;
+		}
+		de = ext2_next_entry(de);
+	}
+	return count;
+}
+
+/* Sort map by hash value */
+static void dx_sort_map (struct dx_map_entry *map, unsigned count)
+{
+	struct dx_map_entry *p, *q, *top = map + count - 1;
+	struct dx_map_entry tmp;
+	int more;
+
+	/* Combsort until bubble sort doesn't suck */
+	while (count > 2) {
+		count = count*10/13;
+		if (count - 9 < 2) /* 9, 10 -> 11 */
+			count = 11;
+		for (p = top, q = p - count; q >= map; p--, q--)
+			if (p->hash < q->hash) {
+				tmp = *p;
+				*p = *q;
+				*q = tmp;
+			}
+	}
+	/* Garden variety bubble sort */
+	do {
+		more = 0;
+		q = top;
+		while (q-- > map) {
+			if (q[1].hash >= q[0].hash)
+				continue;
+			tmp = q[1];
+			q[1] = q[0];
+			q[0] = tmp;
+			more = 1;
+		}
+	} while (more);
+}
+
+/* Add a key for a new block just after frame->at */
+static void dx_insert_block(struct dx_frame *frame, u32 hash, u32 block)
+{
+	struct dx_entry *entries = frame->entries;
+	struct dx_entry *old = frame->at, *new = old + 1;
+	int count = dx_get_count(entries);
+
+	memmove(new + 1, new, (char *)(entries + count) - (char *)(new));
+	dx_set_hash(new, hash);
+	dx_set_block(new, block);
+	dx_set_count(entries, count + 1);
+}
+
+/*
+ * Move count entries from end of map between two memory locations.
+ * Returns pointer to last entry moved.
+ */
+static ext2_dirent *
+dx_move_dirents(char *from, char *to, struct dx_map_entry *map, int count)
+{
+	unsigned rec_len = 0;
+
+	while (count--) {
+		ext2_dirent *de = (ext2_dirent *) (from + map->offs);
+		rec_len = EXT2_DIR_REC_LEN(de->name_len);
+		memcpy (to, de, rec_len);
+		((ext2_dirent *) to)->rec_len = cpu_to_le16(rec_len);
+		de->inode = 0;
+		map++;
+		to += rec_len;
+	}
+	return (ext2_dirent *) (to - rec_len);
+}
+
+/*
+ * Compact each dir entry in the range to the minimal rec_len.
+ * Returns pointer to last entry in range.
+ */
+static ext2_dirent *dx_pack_dirents(char *base, int size)
+{
+	ext2_dirent *next, *to, *prev;
+	ext2_dirent *de = (ext2_dirent *) base;
+	unsigned rec_len = 0;
+
+	prev = to = de;
+	while ((char *) de < base + size) {
+		next = ext2_next_entry(de);
+		if (de->inode && de->name_len) {
+			rec_len = EXT2_DIR_REC_LEN(de->name_len);
+			if (de > to)
+				memmove(to, de, rec_len);
+			to->rec_len = cpu_to_le16(rec_len);
+			prev = to;
+			to = (ext2_dirent *) (((char *) to) + rec_len);
+		}
+		de = next;
+	}
+	return prev;
+}
+
+/*
+ * Add the name to a directory block: after de if it is given, or else
+ * in the first gap big enough.  Returns -ENOSPC, keeping the page, if
+ * there is no such gap; otherwise the page is released.
+ */
+static int ext2_add_to_block(struct dentry *dentry, struct inode *inode,
+			     struct page *page, char *data, ext2_dirent *de)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	const char *name = (const char *) dentry->d_name.name;
+	int namelen = dentry->d_name.len;
+	unsigned reclen = EXT2_DIR_REC_LEN(namelen);
+	unsigned short rec_len, name_len;
+	unsigned from, to;
+	char *top;
+	int err;
+
+	if (!de) {
+		top = data + ext2_chunk_size(dir) - reclen;
+		for (de = (ext2_dirent *) data; (char *) de <= top;
+		     de = ext2_next_entry(de)) {
+			err = -EEXIST;
+			if (ext2_match (namelen, name, de))
+				goto out_page;
+			name_len = EXT2_DIR_REC_LEN(de->name_len);
+			rec_len = le16_to_cpu(de->rec_len);
+			if ((de->inode ? rec_len - name_len : rec_len) >= reclen)
+				break;
+		}
+		if ((char *) de > top)
+			return -ENOSPC;
+	}
+	name_len = EXT2_DIR_REC_LEN(de->name_len);
+	rec_len = le16_to_cpu(de->rec_len);
+	from = (char*)de - (char*)page_address(page);
+	to = from + rec_len;
+	lock_page(page);
+	err = page->mapping->a_ops->prepare_write(NULL, page, from, to);
+	if (err)
+		goto out_unlock;
+	if (de->inode) {
+		ext2_dirent *de1 = (ext2_dirent *) ((char *) de + name_len);
+		de1->rec_len = cpu_to_le16(rec_len - name_len);
+		de->rec_len = cpu_to_le16(name_len);
+		de = de1;
+	}
+	de->name_len = namelen;
+	memcpy (de->name, name, namelen);
+	de->inode = cpu_to_le32(inode->i_ino);
+	ext2_set_de_type (de, inode);
+	err = ext2_commit_chunk(page, from, to);
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+	ext2_update_dx_flag(dir);
+	mark_inode_dirty(dir);
+	/* OFFSET_CACHE */
+out_unlock:
+	UnlockPage(page);
+out_page:
+	ext2_put_page(page);
+	return err;
+}
+
+/*
+ * Split a full leaf into itself and a new block, the upper half of
+ * the hashes, by size, going to the new one.  *pagep and *datap are
+ * left as the block the new name belongs in, and its last entry, with
+ * room after it, is returned.  Releases *pagep on failure.
+ */
+static ext2_dirent *do_split(struct inode *dir, struct page **pagep,
+			     char **datap, struct dx_frame *frame,
+			     struct dx_hash_info *hinfo, int *error)
+{
+	unsigned blocksize = ext2_chunk_size(dir);
+	unsigned count, continued, split, size;
+	struct page *page = *pagep, *page2;
+	char *data1 = *datap, *data2, *index;
+	unsigned long newblock;
+	u32 hash2;
+	struct dx_map_entry *map;
+	ext2_dirent *de, *de2;
+	int err, err2;
+
+	newblock = dir->i_size >> dir->i_sb->s_blocksize_bits;
+	page2 = ext2_get_dir_block(dir, newblock, &data2);
+	if (IS_ERR(page2)) {
+		err = PTR_ERR(page2);
+		goto out;
+	}
+
+	/*
+	 * Both leaves change together.  The new block is at the end of
+	 * the directory, so its page never comes before the old one.
+	 */
+	lock_page(page);
+	if (page2 != page)
+		lock_page(page2);
+	err = ext2_prepare_block(page2, data2);
+	if (!err)
+		err = ext2_prepare_block(page, data1);
+	if (err) {
+		if (page2 != page)
+			UnlockPage(page2);
+		UnlockPage(page);
+		ext2_put_page(page2);
+		goto out;
+	}
+
+	/* The map is built at the end of the new block, and the entries
+	 * moved there fill it from the start without reaching the part
+	 * of the map still to be read. */
+	map = (struct dx_map_entry *) (data2 + blocksize);
+	count = dx_make_map ((ext2_dirent *) data1, blocksize, hinfo, map);
+	map -= count;
+	dx_sort_map (map, count);
+
+	/* Move the top half of the hashes, by size; at least one stays */
+	size = 0;
+	for (split = count; split > 1; split--) {
+		if (size + map[split - 1].size/2 > blocksize/2)
+			break;
+		size += map[split - 1].size;
+	}
+	hash2 = map[split].hash;
+	continued = hash2 == map[split - 1].hash;
+
+	de2 = dx_move_dirents(data1, data2, map + split, count - split);
+	de = dx_pack_dirents(data1, blocksize);
+	de->rec_len = cpu_to_le16(data1 + blocksize - (char *) de);
+	de2->rec_len = cpu_to_le16(data2 + blocksize - (char *) de2);
+
+	err = ext2_commit_block(page2, data2);
+	err2 = ext2_commit_block(page, data1);
+	if (!err)
+		err = err2;
+	if (page2 != page)
+		UnlockPage(page2);
+	UnlockPage(page);
+
+	/* The moved names are only found once the index has the key */
+	index = dx_block_data(dir, frame->entries);
+	lock_page(frame->page);
+	err2 = ext2_prepare_block(frame->page, index);
+	if (!err2) {
+		dx_insert_block (frame, hash2 + continued, newblock);
+		err2 = ext2_commit_block(frame->page, index);
+	}
+	UnlockPage(frame->page);
+	if (!err)
+		err = err2;
+	if (err) {
+		ext2_put_page(page2);
+		goto out;
+	}
+
+	/* Which block gets the new entry? */
+	if (hinfo->hash >= hash2) {
+		*pagep = page2;
+		*datap = data2;
+		page2 = page;
+		de = de2;
+	}
+	ext2_put_page(page2);
+	return de;
+
+out:
+	ext2_put_page(*pagep);
+	*pagep = NULL;
+	*error = err;
+	return NULL;
+}
+
+/*
+ * The index block at *framep is full.  Split it in two, or if it is
+ * the root, move its keys down into a new node, leaving *framep at the
+ * key the name now comes under.
+ */
+static int dx_split_index(struct inode *dir, struct dx_frame *frames,
+			  struct dx_frame **framep)
+{
+	struct dx_frame *frame = *framep;
+	struct dx_entry *entries = frame->entries, *at = frame->at;
+	unsigned icount = dx_get_count(entries);
+	int levels = frame - frames;
+	struct dx_entry *entries2;
+	struct dx_node *node2;
+	struct page *page2;
+	unsigned long newblock;
+	char *data, *data2;
+	int err;
+
+	if (levels && (dx_get_count(frames->entries) ==
+		       dx_get_limit(frames->entries))) {
+		ext2_warning(dir->i_sb, "ext2_dx_add_link",
+			     "Directory index full!");
+		return -ENOSPC;
+	}
+	newblock = dir->i_size >> dir->i_sb->s_blocksize_bits;
+	page2 = ext2_get_dir_block(dir, newblock, &data2);
+	if (IS_ERR(page2))
+		return PTR_ERR(page2);
+	lock_page(page2);
+	err = ext2_prepare_block(page2, data2);
+	if (err) {
+		UnlockPage(page2);
+		goto out;
+	}
+	node2 = (struct dx_node *) data2;
+	entries2 = node2->entries;
+	memset(&node2->fake, 0, sizeof(node2->fake));
+	node2->fake.rec_len = cpu_to_le16(ext2_chunk_size(dir));
+
+	if (levels) {
+		unsigned icount1 = icount/2, icount2 = icount - icount1;
+		unsigned hash2 = dx_get_hash(entries + icount1);
+
+		memcpy ((char *) entries2, (char *) (entries + icount1),
+			icount2 * sizeof(struct dx_entry));
+		dx_set_count (entries2, icount2);
+		dx_set_limit (entries2, dx_node_limit(dir));
+		err = ext2_commit_block(page2, data2);
+		UnlockPage(page2);
+		if (err)
+			goto out;
+
+		/* The root learns of the new node before the old one
+		 * gives up its upper half */
+		data = dx_block_data(dir, frames[0].entries);
+		lock_page(frames[0].page);
+		err = ext2_prepare_block(frames[0].page, data);
+		if (!err) {
+			dx_insert_block (frames + 0, hash2, newblock);
+			err = ext2_commit_block(frames[0].page, data);
+		}
+		UnlockPage(frames[0].page);
+		if (err)
+			goto out;
+
+		data = dx_block_data(dir, entries);
+		lock_page(frame->page);
+		err = ext2_prepare_block(frame->page, data);
+		if (!err) {
+			dx_set_count (entries, icount1);
+			err = ext2_commit_block(frame->page, data);
+		}
+		UnlockPage(frame->page);
+		if (err)
+			goto out;
+
+		/* Which index block gets the new entry? */
+		if (at - entries >= icount1) {
+			struct page *tmp = frame->page;
+
+			frame->at = at - entries - icount1 + entries2;
+			frame->entries = entries2;
+			frame->page = page2;
+			page2 = tmp;
+		}
+	} else {
+		memcpy((char *) entries2, (char *) entries,
+		       icount * sizeof(struct dx_entry));
+		dx_set_limit(entries2, dx_node_limit(dir));
+		err = ext2_commit_block(page2, data2);
+		UnlockPage(page2);
+		if (err)
+			goto out;
+
+		/* The root is left with one key, for the new node */
+		data = dx_block_data(dir, entries);
+		lock_page(frame->page);
+		err = ext2_prepare_block(frame->page, data);
+		if (!err) {
+			dx_set_count(entries, 1);
+			dx_set_block(entries + 0, newblock);
+			((struct dx_root *) data)->info.indirect_levels = 1;
+			err = ext2_commit_block(frame->page, data);
+		}
+		UnlockPage(frame->page);
+		if (err)
+			goto out;
+
+		/* Add new access path frame */
+		frame = frames + 1;
+		frame->at = at - entries + entries2;
+		frame->entries = entries2;
+		frame->page = page2;
+		*framep = frame;
+		return 0;
+	}
+out:
+	ext2_put_page(page2);
+	return err;
+}
+
+static int ext2_dx_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	struct dx_frame frames[2], *frame;
+	struct dx_hash_info hinfo;
+	struct page *page;
+	ext2_dirent *de;
+	char *data;
+	int err;
+
+	frame = dx_probe(dir, &dentry->d_name, &hinfo, frames, &err);
+	if (!frame)
+		return err;
+
+	page = ext2_get_dir_block(dir, dx_get_block(frame->at), &data);
+	if (IS_ERR(page)) {
+		err = PTR_ERR(page);
+		goto cleanup;
+	}
+	err = ext2_add_to_block(dentry, inode, page, data, NULL);
+	if (err != -ENOSPC)
+		goto cleanup;
+
+	/* Block full, should compress but for now just split */
+	if (dx_get_count(frame->entries) == dx_get_limit(frame->entries)) {
+		err = dx_split_index(dir, frames, &frame);
+		if (err) {
+			ext2_put_page(page);
+			goto cleanup;
+		}
+	}
+	de = do_split(dir, &page, &data, frame, &hinfo, &err);
+	if (de)
+		err = ext2_add_to_block(dentry, inode, page, data, de);
+cleanup:
+	dx_release(frames);
+	return err;
+}
+
+/*
+ * Can block 0 become an index root?  It must start with "." and ".."
+ * as ext2_make_empty() lays them out.
+ */
+static int dx_indexable(struct dx_root *root)
+{
+	return le16_to_cpu(root->dot.rec_len) == EXT2_DIR_REC_LEN(1) &&
+	       root->dot.name_len == 1 && root->dot_name[0] == '.' &&
+	       root->dotdot.name_len == 2 &&
+	       root->dotdot_name[0] == '.' && root->dotdot_name[1] == '.';
+}
+
+/*
+ * The single block of the directory is full: move its entries to a
+ * new block, turn block 0 into an index root over it, and split it as
+ * for any full leaf.  Returns ERR_BAD_DX_DIR, having changed nothing,
+ * if block 0 cannot be made a root.
+ */
+static int ext2_make_indexed_dir(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	unsigned blocksize = ext2_chunk_size(dir);
+	struct page *page, *page2;
+	struct dx_root *root;
+	struct dx_frame frames[2];
+	struct dx_entry *entries;
+	struct dx_hash_info hinfo;
+	ext2_dirent *de, *de2;
+	char *data, *data1, *top;
+	unsigned len;
+	int err, err2;
+
+	page = ext2_get_dir_block(dir, 0, &data);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	root = (struct dx_root *) data;
+	if (!dx_indexable(root)) {
+		ext2_put_page(page);
+		return ERR_BAD_DX_DIR;
+	}
+	page2 = ext2_get_dir_block(dir, 1, &data1);
+	if (IS_ERR(page2)) {
+		ext2_put_page(page);
+		return PTR_ERR(page2);
+	}
+
+	lock_page(page);
+	if (page2 != page)
+		lock_page(page2);
+	err = ext2_prepare_block(page2, data1);
+	if (!err)
+		err = ext2_prepare_block(page, data);
+	if (err)
+		goto out_unlock;
+
+	/* The 0th block becomes the root, move the dirents out */
+	de = (ext2_dirent *)((char *) &root->dotdot +
+			     le16_to_cpu(root->dotdot.rec_len));
+	len = data + blocksize - (char *) de;
+	memcpy (data1, de, len);
+	de = (ext2_dirent *) data1;
+	top = data1 + len;
+	while ((char *)(de2 = ext2_next_entry(de)) < top)
+		de = de2;
+	de->rec_len = cpu_to_le16(data1 + blocksize - (char *) de);
+
+	/* Initialize the root; the dot dirents already exist */
+	root->dotdot.rec_len = cpu_to_le16(blocksize - EXT2_DIR_REC_LEN(1));
+	memset (&root->info, 0, sizeof(root->info));
+	root->info.info_length = sizeof(root->info);
+	root->info.hash_version = dir->i_sb->u.ext2_sb.s_def_hash_version;
+	entries = root->entries;
+	dx_set_block (entries, 1);
+	dx_set_count (entries, 1);
+	dx_set_limit (entries, dx_root_limit(dir, sizeof(root->info)));
+
+	err = ext2_commit_block(page2, data1);
+	err2 = ext2_commit_block(page, data);
+	if (!err)
+		err = err2;
+	dir->u.ext2_i.i_flags |= EXT2_INDEX_FL;
+	mark_inode_dirty(dir);
+out_unlock:
+	if (page2 != page)
+		UnlockPage(page2);
+	UnlockPage(page);
+	if (err) {
+		ext2_put_page(page2);
+		ext2_put_page(page);
+		return err;
+	}
+
+	/* Initialize as for dx_probe */
+	hinfo.hash_version = root->info.hash_version;
+	hinfo.seed = dir->i_sb->u.ext2_sb.s_hash_seed;
+	dx_hash((const char *) dentry->d_name.name, dentry->d_name.len,
+		&hinfo);
+	frames[0].page = page;
+	frames[0].entries = entries;
+	frames[0].at = entries;
+	frames[1].page = NULL;
+	de = do_split(dir, &page2, &data1, frames, &hinfo, &err);
+	if (de)
+		err = ext2_add_to_block(dentry, inode, page2, data1, de);
+	dx_release(frames);
+	return err;
+}
+
 /*
  *	Parent is locked.
+ *
+ * A directory which outgrows its first block is indexed, if the
+ * filesystem allows it.
  */
 int ext2_add_link (struct dentry *dentry, struct inode *inode)
 {
@@ -409,9 +1643,18 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	unsigned long npages = dir_pages(dir);
 	unsigned long n;
 	char *kaddr;
-	unsigned from, to;
+	int dx_fallback = 0;
 	int err;
 
+	if (ext2_is_dx(dir)) {
+		err = ext2_dx_add_link(dentry, inode);
+		if (err != ERR_BAD_DX_DIR)
+			return err;
+		dir->u.ext2_i.i_flags &= ~EXT2_INDEX_FL;
+		mark_inode_dirty(dir);
+		dx_fallback = 1;
+	}
+
 	/* We take care of directory expansion in the same loop */
 	for (n = 0; n <= npages; n++) {
 		page = ext2_get_page(dir, n);
@@ -439,29 +1682,17 @@ int ext2_add_link (struct dentry *dentry, struct inode *inode)
 	return -EINVAL;
 
 got_it:
-	from = (char*)de - (char*)page_address(page);
-	to = from + rec_len;
-	lock_page(page);
-	err = page->mapping->a_ops->prepare_write(NULL, page, from, to);
-	if (err)
-		goto out_unlock;
-	if (de->inode) {
-		ext2_dirent *de1 = (ext2_dirent *) ((char *) de + name_len);
-		de1->rec_len = cpu_to_le16(rec_len - name_len);
-		de->rec_len = cpu_to_le16(name_len);
-		de = de1;
+	/* Is the gap past the end of a directory of one full block? */
+	if (!dx_fallback && dir->i_size == ext2_chunk_size(dir) &&
+	    (n << PAGE_CACHE_SHIFT) + ((char *) de - (char *) page_address(page))
+						>= dir->i_size &&
+	    EXT2_HAS_COMPAT_FEATURE(dir->i_sb, EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		err = ext2_make_indexed_dir(dentry, inode);
+		if (err != ERR_BAD_DX_DIR)
+			goto out_page;
 	}
-	de->name_len = namelen;
-	memcpy (de->name, name, namelen);
-	de->inode = cpu_to_le32(inode->i_ino);
-	ext2_set_de_type (de, inode);
-	err = ext2_commit_chunk(page, from, to);
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-	dir->u.ext2_i.i_flags &= ~EXT2_BTREE_FL;
-	mark_inode_dirty(dir);
-	/* OFFSET_CACHE */
-out_unlock:
-	UnlockPage(page);
+	return ext2_add_to_block(dentry, inode, page, NULL, de);
+
 out_page:
 	ext2_put_page(page);
 out:
@@ -500,7 +1731,7 @@ int ext2_delete_entry (struct ext2_dir_entry_2 * dir, struct page * page )
 	UnlockPage(page);
 	ext2_put_page(page);
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME;
-	inode->u.ext2_i.i_flags &= ~EXT2_BTREE_FL;
+	ext2_update_dx_flag(inode);
 	mark_inode_dirty(inode);
 	return err;
 }
@@ -597,4 +1828,5 @@ struct file_operations ext2_dir_operations = {
 	readdir:	ext2_readdir,
 	ioctl:		ext2_ioctl,
 	fsync:		ext2_sync_file,
+	release:	ext2_release_dir,
 };
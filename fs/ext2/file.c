@@ -29,8 +29,10 @@
  */
 static int ext2_release_file (struct inode * inode, struct file * filp)
 {
-	if (filp->f_mode & FMODE_WRITE)
+	if (filp->f_mode & FMODE_WRITE) {
 		ext2_discard_prealloc (inode);
+		ext2_discard_reservation (inode);
+	}
 	return 0;
 }
 
@@ -327,6 +327,10 @@ struct inode * ext2_new_inode (const struct inode * dir, int mode)
 	inode = new_inode(sb);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
+	rwlock_init(&inode->u.ext2_i.i_meta_lock);
+	inode->u.ext2_i.i_delayed_blocks = 0;
+	inode->u.ext2_i.i_rsv_window.rsv_end = 0;
+	inode->u.ext2_i.i_rsv_window.rsv_goal_size = EXT2_DEFAULT_RESERVE_BLOCKS;
 
 	lock_super (sb);
 	es = sb->u.ext2_sb.s_es;
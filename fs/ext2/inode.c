@@ -29,6 +29,7 @@
 #include <linux/sched.h>
 #include <linux/highuid.h>
 #include <linux/quotaops.h>
+#include <linux/pagemap.h>
 #include <linux/module.h>
 
 MODULE_AUTHOR("Remy Card and others");
@@ -55,6 +56,17 @@ static int ext2_update_inode(struct inode * inode, int do_sync);
 void ext2_put_inode (struct inode * inode)
 {
 	ext2_discard_prealloc (inode);
+	ext2_discard_reservation (inode);
+}
+
+/*
+ * Called when the inode is thrown out of the cache.  Write-out of delayed
+ * data may have opened a reservation window after the last iput(), and
+ * the window must not outlive the inode.
+ */
+void ext2_clear_inode (struct inode * inode)
+{
+	ext2_discard_reservation (inode);
 }
 
 /*
@@ -86,17 +98,18 @@ no_delete:
 void ext2_discard_prealloc (struct inode * inode)
 {
 #ifdef EXT2_PREALLOCATE
-	lock_kernel();
-	/* Writer: ->i_prealloc* */
-	if (inode->u.ext2_i.i_prealloc_count) {
-		unsigned short total = inode->u.ext2_i.i_prealloc_count;
-		unsigned long block = inode->u.ext2_i.i_prealloc_block;
-		inode->u.ext2_i.i_prealloc_count = 0;
-		inode->u.ext2_i.i_prealloc_block = 0;
-		/* Writer: end */
+	struct ext2_inode_info *ei = &inode->u.ext2_i;
+	unsigned short total;
+	unsigned long block;
+
+	write_lock(&ei->i_meta_lock);
+	total = ei->i_prealloc_count;
+	block = ei->i_prealloc_block;
+	ei->i_prealloc_count = 0;
+	ei->i_prealloc_block = 0;
+	write_unlock(&ei->i_meta_lock);
+	if (total)
 		ext2_free_blocks (inode, block, total);
-	}
-	unlock_kernel();
 #endif
 }
 
@@ -109,26 +122,45 @@ static int ext2_alloc_block (struct inode * inode, unsigned long goal, int *err)
 
 
 #ifdef EXT2_PREALLOCATE
-	/* Writer: ->i_prealloc* */
-	if (inode->u.ext2_i.i_prealloc_count &&
-	    (goal == inode->u.ext2_i.i_prealloc_block ||
-	     goal + 1 == inode->u.ext2_i.i_prealloc_block))
+	struct ext2_inode_info *ei = &inode->u.ext2_i;
+	u32 count = 0, block = 0;
+
+	write_lock(&ei->i_meta_lock);
+	if (ei->i_prealloc_count &&
+	    (goal == ei->i_prealloc_block ||
+	     goal + 1 == ei->i_prealloc_block))
 	{		
-		result = inode->u.ext2_i.i_prealloc_block++;
-		inode->u.ext2_i.i_prealloc_count--;
-		/* Writer: end */
+		result = ei->i_prealloc_block++;
+		ei->i_prealloc_count--;
+		write_unlock(&ei->i_meta_lock);
 		ext2_debug ("preallocation hit (%lu/%lu).\n",
 			    ++alloc_hits, ++alloc_attempts);
-	} else {
-		ext2_discard_prealloc (inode);
-		ext2_debug ("preallocation miss (%lu/%lu).\n",
-			    alloc_hits, ++alloc_attempts);
-		if (S_ISREG(inode->i_mode))
-			result = ext2_new_block (inode, goal, 
-				 &inode->u.ext2_i.i_prealloc_count,
-				 &inode->u.ext2_i.i_prealloc_block, err);
-		else
-			result = ext2_new_block (inode, goal, 0, 0, err);
+		return result;
+	}
+	write_unlock(&ei->i_meta_lock);
+
+	ext2_discard_prealloc (inode);
+	ext2_debug ("preallocation miss (%lu/%lu).\n",
+		    alloc_hits, ++alloc_attempts);
+	if (S_ISREG(inode->i_mode))
+		result = ext2_new_block (inode, goal, &count, &block, err);
+	else
+		result = ext2_new_block (inode, goal, 0, 0, err);
+
+	/*
+	 * ext2_new_block() runs without our lock, so the new run goes in
+	 * here - unless someone else has put one in meanwhile.
+	 */
+	if (count) {
+		write_lock(&ei->i_meta_lock);
+		if (!ei->i_prealloc_count) {
+			ei->i_prealloc_block = block;
+			ei->i_prealloc_count = count;
+			count = 0;
+		}
+		write_unlock(&ei->i_meta_lock);
+		if (count)
+			ext2_free_blocks (inode, block, count);
 	}
 #else
 	result = ext2_new_block (inode, goal, 0, 0, err);
@@ -160,6 +192,8 @@ static inline int verify_chain(Indirect *from, Indirect *to)
  *	@inode: inode in question (we are only interested in its superblock)
  *	@i_block: block number to be parsed
  *	@offsets: array to store the offsets in
+ *	@boundary: set this to the number of blocks after @i_block which
+ *		have their pointers in the same node (if non-NULL)
  *
  *	To store the locations of file's data ext2 uses a data structure common
  *	for UNIX filesystems - tree of pointers anchored in the inode, with
@@ -184,7 +218,8 @@ static inline int verify_chain(Indirect *from, Indirect *to)
  * get there at all.
  */
 
-static int ext2_block_to_path(struct inode *inode, long i_block, int offsets[4])
+static int ext2_block_to_path(struct inode *inode, long i_block,
+			      int offsets[4], int *boundary)
 {
 	int ptrs = EXT2_ADDR_PER_BLOCK(inode->i_sb);
 	int ptrs_bits = EXT2_ADDR_PER_BLOCK_BITS(inode->i_sb);
@@ -192,26 +227,33 @@ static int ext2_block_to_path(struct inode *inode, long i_block, int offsets[4])
 		indirect_blocks = ptrs,
 		double_blocks = (1 << (ptrs_bits * 2));
 	int n = 0;
+	int final = 0;
 
 	if (i_block < 0) {
 		ext2_warning (inode->i_sb, "ext2_block_to_path", "block < 0");
 	} else if (i_block < direct_blocks) {
 		offsets[n++] = i_block;
+		final = direct_blocks;
 	} else if ( (i_block -= direct_blocks) < indirect_blocks) {
 		offsets[n++] = EXT2_IND_BLOCK;
 		offsets[n++] = i_block;
+		final = ptrs;
 	} else if ((i_block -= indirect_blocks) < double_blocks) {
 		offsets[n++] = EXT2_DIND_BLOCK;
 		offsets[n++] = i_block >> ptrs_bits;
 		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
 	} else if (((i_block -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
 		offsets[n++] = EXT2_TIND_BLOCK;
 		offsets[n++] = i_block >> (ptrs_bits * 2);
 		offsets[n++] = (i_block >> ptrs_bits) & (ptrs - 1);
 		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
 	} else {
 		ext2_warning (inode->i_sb, "ext2_block_to_path", "block > big");
 	}
+	if (boundary && n)
+		*boundary = final - 1 - offsets[n - 1];
 	return n;
 }
 
@@ -263,11 +305,13 @@ static Indirect *ext2_get_branch(struct inode *inode,
 		bh = sb_bread(sb, le32_to_cpu(p->key));
 		if (!bh)
 			goto failure;
-		/* Reader: pointers */
-		if (!verify_chain(chain, p))
+		read_lock(&inode->u.ext2_i.i_meta_lock);
+		if (!verify_chain(chain, p)) {
+			read_unlock(&inode->u.ext2_i.i_meta_lock);
 			goto changed;
+		}
 		add_chain(++p, bh, (u32*)bh->b_data + *++offsets);
-		/* Reader: end */
+		read_unlock(&inode->u.ext2_i.i_meta_lock);
 		if (!p->key)
 			goto no_block;
 	}
@@ -338,13 +382,11 @@ static inline int ext2_find_goal(struct inode *inode,
 				 Indirect *partial,
 				 unsigned long *goal)
 {
-	/* Writer: ->i_next_alloc* */
+	write_lock(&inode->u.ext2_i.i_meta_lock);
 	if (block == inode->u.ext2_i.i_next_alloc_block + 1) {
 		inode->u.ext2_i.i_next_alloc_block++;
 		inode->u.ext2_i.i_next_alloc_goal++;
 	} 
-	/* Writer: end */
-	/* Reader: pointers, ->i_next_alloc* */
 	if (verify_chain(chain, partial)) {
 		/*
 		 * try the heuristic for sequential allocation,
@@ -354,18 +396,33 @@ static inline int ext2_find_goal(struct inode *inode,
 			*goal = inode->u.ext2_i.i_next_alloc_goal;
 		if (!*goal)
 			*goal = ext2_find_near(inode, partial);
+		write_unlock(&inode->u.ext2_i.i_meta_lock);
 		return 0;
 	}
-	/* Reader: end */
+	write_unlock(&inode->u.ext2_i.i_meta_lock);
 	return -EAGAIN;
 }
 
+/*
+ * Allocate one block of a new branch - the last one if @data.  Delayed
+ * data blocks are allocated as a run out of the reservation.
+ */
+static int ext2_alloc_one(struct inode *inode, unsigned long goal, int data,
+			  unsigned long *blks, int delayed, int *err)
+{
+	if (!delayed || !data)
+		return ext2_alloc_block(inode, goal, err);
+	return ext2_new_blocks(inode, goal, blks, EXT2_ALLOC_RESERVED, err);
+}
+
 /**
  *	ext2_alloc_branch - allocate and set up a chain of blocks.
  *	@inode: owner
  *	@num: depth of the chain (number of blocks to allocate)
  *	@offsets: offsets (in the blocks) to store the pointers to next.
  *	@branch: place to store the chain in.
+ *	@blks: number of data blocks wanted; set to the number allocated
+ *	@delayed: the data blocks were reserved by ext2_get_block_delay()
  *
  *	This function allocates @num blocks, zeroes out all but the last one,
  *	links them into chain and (if we are synchronous) writes them to disk.
@@ -379,6 +436,10 @@ static inline int ext2_find_goal(struct inode *inode,
  *	set the last link), but branch->key contains the number that should
  *	be placed into *branch->p to fill that gap.
  *
+ *	Delayed data is written out a run at a time: the last block of the
+ *	chain is then the first of up to *@blks contiguous data blocks, and
+ *	if their node is new it gets the pointers to all of them at once.
+ *
  *	If allocation fails we free all blocks we've allocated (and forget
  *	their buffer_heads) and return the error value the from failed
  *	ext2_alloc_block() (normally -ENOSPC). Otherwise we set the chain
@@ -389,19 +450,22 @@ static int ext2_alloc_branch(struct inode *inode,
 			     int num,
 			     unsigned long goal,
 			     int *offsets,
-			     Indirect *branch)
+			     Indirect *branch,
+			     unsigned long *blks,
+			     int delayed)
 {
 	int blocksize = inode->i_sb->s_blocksize;
 	int n = 0;
 	int err;
 	int i;
-	int parent = ext2_alloc_block(inode, goal, &err);
+	int parent = ext2_alloc_one(inode, goal, num == 1, blks, delayed, &err);
 
 	branch[0].key = cpu_to_le32(parent);
 	if (parent) for (n = 1; n < num; n++) {
 		struct buffer_head *bh;
 		/* Allocate the next block */
-		int nr = ext2_alloc_block(inode, parent, &err);
+		int nr = ext2_alloc_one(inode, parent, n == num - 1, blks,
+					delayed, &err);
 		if (!nr)
 			break;
 		branch[n].key = cpu_to_le32(nr);
@@ -415,6 +479,9 @@ static int ext2_alloc_branch(struct inode *inode,
 		branch[n].bh = bh;
 		branch[n].p = (u32*) bh->b_data + offsets[n];
 		*branch[n].p = branch[n].key;
+		if (n == num - 1)
+			for (i = 1; i < *blks; i++)
+				branch[n].p[i] = cpu_to_le32(nr + i);
 		mark_buffer_uptodate(bh, 1);
 		unlock_buffer(bh);
 		mark_buffer_dirty_inode(bh, inode);
@@ -447,37 +514,60 @@ static int ext2_alloc_branch(struct inode *inode,
  *		ext2_alloc_branch)
  *	@where: location of missing link
  *	@num:   number of blocks we are adding
+ *	@blks:  number of data blocks at the end of the branch
+ *	@delayed: they were reserved by ext2_get_block_delay()
  *
  *	This function verifies that chain (up to the missing link) had not
  *	changed, fills the missing link and does all housekeeping needed in
  *	inode (->i_blocks, etc.). In case of success we end up with the full
- *	chain to new block and return 0. Otherwise (== chain had been changed)
- *	we free the new blocks (forgetting their buffer_heads, indeed) and
- *	return -EAGAIN.
+ *	chain to new block and return the number of data blocks now in the
+ *	file. Otherwise (== chain had been changed) we free the new blocks
+ *	(forgetting their buffer_heads, indeed) and return -EAGAIN.
+ *
+ *	A run of data blocks going straight into an existing node stops short
+ *	at the first pointer somebody else has filled in meanwhile; the data
+ *	blocks past that are freed.
  */
 
 static inline int ext2_splice_branch(struct inode *inode,
 				     long block,
 				     Indirect chain[4],
 				     Indirect *where,
-				     int num)
+				     int num,
+				     unsigned long blks,
+				     int delayed)
 {
+	unsigned long data = le32_to_cpu(where[num-1].key);
+	unsigned long done = blks;
 	int i;
 
 	/* Verify that place we are splicing to is still there and vacant */
 
-	/* Writer: pointers, ->i_next_alloc* */
-	if (!verify_chain(chain, where-1) || *where->p)
-		/* Writer: end */
+	write_lock(&inode->u.ext2_i.i_meta_lock);
+	if (!verify_chain(chain, where-1) || *where->p) {
+		write_unlock(&inode->u.ext2_i.i_meta_lock);
 		goto changed;
+	}
 
 	/* That's it */
 
 	*where->p = where->key;
-	inode->u.ext2_i.i_next_alloc_block = block;
-	inode->u.ext2_i.i_next_alloc_goal = le32_to_cpu(where[num-1].key);
+	if (num == 1) {
+		for (done = 1; done < blks && !where->p[done]; done++)
+			where->p[done] = cpu_to_le32(data + done);
+	}
+	inode->u.ext2_i.i_next_alloc_block = block + done - 1;
+	inode->u.ext2_i.i_next_alloc_goal = data + done - 1;
 
-	/* Writer: end */
+	write_unlock(&inode->u.ext2_i.i_meta_lock);
+
+	if (done < blks) {
+		if (delayed)
+			ext2_free_reserved_blocks(inode, data + done,
+						  blks - done);
+		else
+			ext2_free_blocks(inode, data + done, blks - done);
+	}
 
 	/* We are done with atomic stuff, now do the rest of housekeeping */
 
@@ -493,13 +583,17 @@ static inline int ext2_splice_branch(struct inode *inode,
 	}
 
 	mark_inode_dirty(inode);
-	return 0;
+	return done;
 
 changed:
 	for (i = 1; i < num; i++)
 		bforget(where[i].bh);
-	for (i = 0; i < num; i++)
+	for (i = 0; i < num - 1; i++)
 		ext2_free_blocks(inode, le32_to_cpu(where[i].key), 1);
+	if (delayed)
+		ext2_free_reserved_blocks(inode, data, blks);
+	else
+		ext2_free_blocks(inode, data, blks);
 	return -EAGAIN;
 }
 
@@ -514,27 +608,35 @@ changed:
  * That has a nice additional property: no special recovery from the failed
  * allocations is needed - we simply release blocks and do not touch anything
  * reachable from inode.
+ *
+ * With @blks non-NULL the block is delayed data, and up to *@blks blocks
+ * of it, as far as the node holding the pointer goes, are allocated at
+ * once; *@blks is set to the number allocated, 0 if there was a block
+ * there already.
  */
 
-static int ext2_get_block(struct inode *inode, long iblock, struct buffer_head *bh_result, int create)
+static int ext2_get_blocks(struct inode *inode, long iblock,
+			   struct buffer_head *bh_result, int create,
+			   unsigned long *blks)
 {
 	int err = -EIO;
 	int offsets[4];
 	Indirect chain[4];
 	Indirect *partial;
-	unsigned long goal;
-	int left;
-	int depth = ext2_block_to_path(inode, iblock, offsets);
+	unsigned long goal, count;
+	int left, boundary = 0;
+	int depth = ext2_block_to_path(inode, iblock, offsets, &boundary);
 
 	if (depth == 0)
 		goto out;
 
-	lock_kernel();
 reread:
 	partial = ext2_get_branch(inode, depth, offsets, chain, &err);
 
 	/* Simplest case - block found, no allocation needed */
 	if (!partial) {
+		if (blks)
+			*blks = 0;
 got_it:
 		bh_result->b_dev = inode->i_dev;
 		bh_result->b_blocknr = le32_to_cpu(chain[depth-1].key);
@@ -551,7 +653,6 @@ cleanup:
 			brelse(partial->bh);
 			partial--;
 		}
-		unlock_kernel();
 out:
 		return err;
 	}
@@ -569,13 +670,25 @@ out:
 		goto changed;
 
 	left = (chain + depth) - partial;
+	count = 1;
+	if (blks) {
+		count = *blks;
+		if (count > boundary + 1)
+			count = boundary + 1;
+	}
 	err = ext2_alloc_branch(inode, left, goal,
-					offsets+(partial-chain), partial);
+				offsets+(partial-chain), partial, &count,
+				blks != NULL);
 	if (err)
 		goto cleanup;
 
-	if (ext2_splice_branch(inode, iblock, chain, partial, left) < 0)
+	err = ext2_splice_branch(inode, iblock, chain, partial, left, count,
+				 blks != NULL);
+	if (err < 0)
 		goto changed;
+	if (blks)
+		*blks = err;
+	err = 0;
 
 	bh_result->b_state |= (1UL << BH_New);
 	goto got_it;
@@ -588,8 +701,206 @@ changed:
 	goto reread;
 }
 
+/*
+ * Delayed allocation.  write() only reserves room for the blocks it
+ * fills in holes (see ext2_reserve_blocks()) and marks their buffers
+ * BH_Delay; the blocks are allocated when the buffers are written out,
+ * by which time the file has usually grown by much more than one block,
+ * and they are allocated a run at a time.
+ */
+
+/* The most pages a run is gathered from */
+#define EXT2_DELAYED_PAGES	16
+
+static inline void ext2_map_mate(struct inode *inode, struct buffer_head *bh,
+				 unsigned long block)
+{
+	bh->b_dev = inode->i_dev;
+	bh->b_blocknr = block;
+	set_bit(BH_Mapped, &bh->b_state);
+	smp_mb__before_clear_bit();
+	clear_bit(BH_Delay, &bh->b_state);
+	unmap_underlying_metadata(bh);
+}
+
+/*
+ * Write-out of a delayed buffer.  The delayed buffers after it - the
+ * rest of its page, and the pages after that which can be locked
+ * without waiting - get their blocks along with it, as one run.
+ */
+static int ext2_map_delayed(struct inode *inode, long iblock,
+			    struct buffer_head *bh_result)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct page *pages[EXT2_DELAYED_PAGES];
+	struct buffer_head *bh, *head = bh_result->b_page->buffers;
+	unsigned long index = bh_result->b_page->index;
+	unsigned long end_index;
+	unsigned long count = 1, first, i;
+	int nr = 0, n, err;
+
+	end_index = (inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	for (bh = bh_result->b_this_page; bh != head && buffer_delay(bh);
+	     bh = bh->b_this_page)
+		count++;
+	while (bh == head && nr < EXT2_DELAYED_PAGES && ++index < end_index) {
+		struct page *page = find_get_page(mapping, index);
+
+		if (!page)
+			break;
+		if (TryLockPage(page)) {
+			page_cache_release(page);
+			break;
+		}
+		if (page->mapping != mapping || !page->buffers ||
+		    !buffer_delay(page->buffers)) {
+			UnlockPage(page);
+			page_cache_release(page);
+			break;
+		}
+		pages[nr++] = page;
+		bh = head = page->buffers;
+		do {
+			count++;
+			bh = bh->b_this_page;
+		} while (bh != head && buffer_delay(bh));
+	}
+
+	clear_bit(BH_New, &bh_result->b_state);
+	err = ext2_get_blocks(inode, iblock, bh_result, 1, &count);
+	if (err)
+		goto out;
+	clear_bit(BH_Delay, &bh_result->b_state);
+	if (!count) {
+		/* It had a block after all: the reservation goes back */
+		ext2_release_blocks(inode, 1);
+		goto out;
+	}
+	/*
+	 * The buffer holds its data already: BH_New would have
+	 * __block_prepare_write() zero what lies outside the write.
+	 */
+	if (test_and_clear_bit(BH_New, &bh_result->b_state))
+		unmap_underlying_metadata(bh_result);
+
+	first = bh_result->b_blocknr;
+	i = 1;
+	head = bh_result->b_page->buffers;
+	for (bh = bh_result->b_this_page; i < count && bh != head;
+	     bh = bh->b_this_page)
+		ext2_map_mate(inode, bh, first + i++);
+	for (n = 0; i < count && n < nr; n++) {
+		bh = head = pages[n]->buffers;
+		do {
+			ext2_map_mate(inode, bh, first + i++);
+			bh = bh->b_this_page;
+		} while (i < count && bh != head);
+	}
+out:
+	while (nr--) {
+		UnlockPage(pages[nr]);
+		page_cache_release(pages[nr]);
+	}
+	return err;
+}
+
+static int ext2_get_block(struct inode *inode, long iblock, struct buffer_head *bh_result, int create)
+{
+	if (create && buffer_delay(bh_result))
+		return ext2_map_delayed(inode, iblock, bh_result);
+	return ext2_get_blocks(inode, iblock, bh_result, create, NULL);
+}
+
+/*
+ * Are the indirect blocks leading to @iblock all there already?
+ */
+static int ext2_has_indirect(struct inode *inode, long iblock)
+{
+	int err;
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	int depth = ext2_block_to_path(inode, iblock, offsets, NULL);
+	int ret;
+
+	if (depth == 0)
+		return 0;
+	partial = ext2_get_branch(inode, depth, offsets, chain, &err);
+	if (!partial)
+		partial = chain + depth - 1;
+	ret = !err && partial == chain + depth - 1;
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return ret;
+}
+
+/*
+ * get_block for write(): a hole is not filled, only reserved.  The buffer
+ * is left unmapped, BH_Delay, until it is written out.
+ *
+ * Nothing is reserved for indirect blocks, which a sparse file may need
+ * one or more of per data block: a block whose indirect blocks are not
+ * there yet is allocated at once, along with them.
+ */
+static int ext2_get_block_delay(struct inode *inode, long iblock, struct buffer_head *bh_result, int create)
+{
+	int err;
+
+	if (buffer_delay(bh_result))
+		return 0;
+	err = ext2_get_blocks(inode, iblock, bh_result, 0, NULL);
+	if (err || buffer_mapped(bh_result))
+		return err;
+	if (!ext2_has_indirect(inode, iblock))
+		return ext2_get_blocks(inode, iblock, bh_result, 1, NULL);
+	err = ext2_reserve_blocks(inode, 1);
+	if (err)
+		return err;
+	bh_result->b_state |= (1UL << BH_Delay) | (1UL << BH_New);
+	return 0;
+}
+
+/*
+ * Give back the reservations of the delayed buffers from @offset on,
+ * which are about to be thrown away.
+ */
+static void ext2_drop_delayed(struct inode *inode, struct page *page,
+			      unsigned long offset)
+{
+	struct buffer_head *bh, *head = page->buffers;
+	unsigned long curr_off = 0;
+	unsigned long count = 0;
+
+	if (!head)
+		return;
+	bh = head;
+	do {
+		if (offset <= curr_off &&
+		    test_and_clear_bit(BH_Delay, &bh->b_state)) {
+			mark_buffer_clean(bh);
+			count++;
+		}
+		curr_off += bh->b_size;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	if (count)
+		ext2_release_blocks(inode, count);
+}
+
 static int ext2_writepage(struct page *page)
 {
+	struct inode *inode = page->mapping->host;
+	unsigned long end_index = inode->i_size >> PAGE_CACHE_SHIFT;
+
+	/*
+	 * Delayed buffers past EOF are left over from a failed write.
+	 * Drop them, or bdflush would hand us this page for ever.
+	 */
+	if (page->index >= end_index)
+		ext2_drop_delayed(inode, page, page->index > end_index ? 0 :
+				  inode->i_size & (PAGE_CACHE_SIZE-1));
 	return block_write_full_page(page,ext2_get_block);
 }
 static int ext2_readpage(struct file *file, struct page *page)
@@ -598,10 +909,24 @@ static int ext2_readpage(struct file *file, struct page *page)
 }
 static int ext2_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to)
 {
+	struct inode *inode = page->mapping->host;
+
+	/* O_SYNC wants its blocks now, to write them with the data */
+	if (file && S_ISREG(inode->i_mode) && test_opt(inode->i_sb, DELALLOC) &&
+	    !(file->f_flags & O_SYNC) && !IS_SYNC(inode))
+		return block_prepare_write(page,from,to,ext2_get_block_delay);
 	return block_prepare_write(page,from,to,ext2_get_block);
 }
+static int ext2_flushpage(struct page *page, unsigned long offset)
+{
+	ext2_drop_delayed(page->mapping->host, page, offset);
+	return block_flushpage(page, offset);
+}
 static int ext2_bmap(struct address_space *mapping, long block)
 {
+	/* Delayed blocks have no number yet: give them one */
+	if (test_opt(mapping->host->i_sb, DELALLOC))
+		fsync_inode_data_buffers(mapping->host);
 	return generic_block_bmap(mapping,block,ext2_get_block);
 }
 static int ext2_direct_IO(int rw, struct inode * inode, struct kiobuf * iobuf, unsigned long blocknr, int blocksize)
@@ -614,6 +939,7 @@ struct address_space_operations ext2_aops = {
 	sync_page: block_sync_page,
 	prepare_write: ext2_prepare_write,
 	commit_write: generic_commit_write,
+	flushpage: ext2_flushpage,
 	bmap: ext2_bmap,
 	direct_IO: ext2_direct_IO,
 };
@@ -678,16 +1004,17 @@ static Indirect *ext2_find_shared(struct inode *inode,
 	for (k = depth; k > 1 && !offsets[k-1]; k--)
 		;
 	partial = ext2_get_branch(inode, k, offsets, chain, &err);
-	/* Writer: pointers */
+	write_lock(&inode->u.ext2_i.i_meta_lock);
 	if (!partial)
 		partial = chain + k-1;
 	/*
 	 * If the branch acquired continuation since we've looked at it -
 	 * fine, it should all survive and (new) top doesn't belong to us.
 	 */
-	if (!partial->key && *partial->p)
-		/* Writer: end */
+	if (!partial->key && *partial->p) {
+		write_unlock(&inode->u.ext2_i.i_meta_lock);
 		goto no_top;
+	}
 	for (p=partial; p>chain && all_zeroes((u32*)p->bh->b_data,p->p); p--)
 		;
 	/*
@@ -702,7 +1029,7 @@ static Indirect *ext2_find_shared(struct inode *inode,
 		*top = *p->p;
 		*p->p = 0;
 	}
-	/* Writer: end */
+	write_unlock(&inode->u.ext2_i.i_meta_lock);
 
 	while(partial > p)
 	{
@@ -819,6 +1146,7 @@ void ext2_truncate (struct inode * inode)
 		return;
 
 	ext2_discard_prealloc(inode);
+	ext2_discard_reservation(inode);
 
 	blocksize = inode->i_sb->s_blocksize;
 	iblock = (inode->i_size + blocksize-1)
@@ -826,7 +1154,7 @@ void ext2_truncate (struct inode * inode)
 
 	block_truncate_page(inode->i_mapping, inode->i_size, ext2_get_block);
 
-	n = ext2_block_to_path(inode, iblock, offsets);
+	n = ext2_block_to_path(inode, iblock, offsets, NULL);
 	if (n == 0)
 		return;
 
@@ -917,6 +1245,10 @@ void ext2_read_inode (struct inode * inode)
 	unsigned long offset;
 	struct ext2_group_desc * gdp;
 
+	rwlock_init(&inode->u.ext2_i.i_meta_lock);
+	inode->u.ext2_i.i_delayed_blocks = 0;
+	inode->u.ext2_i.i_rsv_window.rsv_end = 0;
+	inode->u.ext2_i.i_rsv_window.rsv_goal_size = EXT2_DEFAULT_RESERVE_BLOCKS;
 	if ((inode->i_ino != EXT2_ROOT_INO && inode->i_ino != EXT2_ACL_IDX_INO &&
 	     inode->i_ino != EXT2_ACL_DATA_INO &&
 	     inode->i_ino < EXT2_FIRST_INO(inode->i_sb)) ||
@@ -12,6 +12,39 @@
 #include <linux/sched.h>
 #include <asm/uaccess.h>
 
+/*
+ * Count the file's data blocks and the contiguous runs they make up,
+ * going through ->bmap() block by block.
+ */
+static int ext2_getfrag (struct inode * inode, struct ext2_frag_stats * arg)
+{
+	struct ext2_balloc_info * bi = inode->i_sb->u.ext2_sb.s_balloc;
+	struct address_space * mapping = inode->i_mapping;
+	struct ext2_frag_stats fs;
+	unsigned long i, nr, phys, prev = 0;
+
+	memset(&fs, 0, sizeof(fs));
+	if (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) {
+		nr = (inode->i_size + inode->i_sb->s_blocksize - 1) >>
+			inode->i_sb->s_blocksize_bits;
+		for (i = 0; i < nr; i++) {
+			phys = mapping->a_ops->bmap(mapping, i);
+			if (phys) {
+				fs.fs_blocks++;
+				if (phys != prev + 1)
+					fs.fs_extents++;
+			}
+			prev = phys;
+			if (current->need_resched)
+				schedule();
+		}
+	}
+	fs.fs_rsv_windows = percpu_counter_read(&bi->rsv_windows);
+	fs.fs_rsv_hits = percpu_counter_read(&bi->rsv_hits);
+	fs.fs_rsv_misses = percpu_counter_read(&bi->rsv_misses);
+	return copy_to_user(arg, &fs, sizeof(fs)) ? -EFAULT : 0;
+}
+
 
 int ext2_ioctl (struct inode * inode, struct file * filp, unsigned int cmd,
 		unsigned long arg)
@@ -70,6 +103,8 @@ int ext2_ioctl (struct inode * inode, struct file * filp, unsigned int cmd,
 		inode->i_ctime = CURRENT_TIME;
 		mark_inode_dirty(inode);
 		return 0;
+	case EXT2_IOC_GETFRAG:
+		return ext2_getfrag(inode, (struct ext2_frag_stats *) arg);
 	default:
 		return -ENOTTY;
 	}
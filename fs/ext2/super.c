@@ -139,9 +139,7 @@ void ext2_put_super (struct super_block * sb)
 	for (i = 0; i < EXT2_MAX_GROUP_LOADED; i++)
 		if (sb->u.ext2_sb.s_inode_bitmap[i])
 			brelse (sb->u.ext2_sb.s_inode_bitmap[i]);
-	for (i = 0; i < EXT2_MAX_GROUP_LOADED; i++)
-		if (sb->u.ext2_sb.s_block_bitmap[i])
-			brelse (sb->u.ext2_sb.s_block_bitmap[i]);
+	kfree(sb->u.ext2_sb.s_balloc);
 	brelse (sb->u.ext2_sb.s_sbh);
 
 	return;
@@ -152,6 +150,7 @@ static struct super_operations ext2_sops = {
 	write_inode:	ext2_write_inode,
 	put_inode:	ext2_put_inode,
 	delete_inode:	ext2_delete_inode,
+	clear_inode:	ext2_clear_inode,
 	put_super:	ext2_put_super,
 	write_super:	ext2_write_super,
 	statfs:		ext2_statfs,
@@ -226,6 +225,14 @@ static int parse_options (char * options, unsigned long * sb_block,
 			set_opt (*mount_options, MINIX_DF);
 		else if (!strcmp (this_char, "nocheck"))
 			clear_opt (*mount_options, CHECK);
+		else if (!strcmp (this_char, "reservation"))
+			set_opt (*mount_options, RESERVATION);
+		else if (!strcmp (this_char, "noreservation"))
+			clear_opt (*mount_options, RESERVATION);
+		else if (!strcmp (this_char, "delalloc"))
+			set_opt (*mount_options, DELALLOC);
+		else if (!strcmp (this_char, "nodelalloc"))
+			clear_opt (*mount_options, DELALLOC);
 		else if (!strcmp (this_char, "nogrpid") ||
 			 !strcmp (this_char, "sysvgroups"))
 			clear_opt (*mount_options, GRPID);
@@ -445,7 +452,10 @@ struct super_block * ext2_read_super (struct super_block * sb, void * data,
 	if(blocksize < BLOCK_SIZE )
 	    blocksize = BLOCK_SIZE;
 
+	sb->u.ext2_sb.s_balloc = NULL;
 	sb->u.ext2_sb.s_mount_opt = 0;
+	set_opt (sb->u.ext2_sb.s_mount_opt, RESERVATION);
+	set_opt (sb->u.ext2_sb.s_mount_opt, DELALLOC);
 	if (!parse_options ((char *) data, &sb_block, &resuid, &resgid,
 	    &sb->u.ext2_sb.s_mount_opt)) {
 		return NULL;
@@ -589,6 +599,11 @@ struct super_block * ext2_read_super (struct super_block * sb, void * data,
 		log2 (EXT2_ADDR_PER_BLOCK(sb));
 	sb->u.ext2_sb.s_desc_per_block_bits =
 		log2 (EXT2_DESC_PER_BLOCK(sb));
+	for (i = 0; i < 4; i++)
+		sb->u.ext2_sb.s_hash_seed[i] = le32_to_cpu(es->s_hash_seed[i]);
+	sb->u.ext2_sb.s_def_hash_version = es->s_def_hash_version;
+	if (sb->u.ext2_sb.s_def_hash_version > EXT2_HASH_TEA)
+		sb->u.ext2_sb.s_def_hash_version = EXT2_HASH_HALF_MD4;
 	if (sb->s_magic != EXT2_SUPER_MAGIC) {
 		if (!silent)
 			printk ("VFS: Can't find an ext2 filesystem on dev "
@@ -655,12 +670,13 @@ struct super_block * ext2_read_super (struct super_block * sb, void * data,
 	for (i = 0; i < EXT2_MAX_GROUP_LOADED; i++) {
 		sb->u.ext2_sb.s_inode_bitmap_number[i] = 0;
 		sb->u.ext2_sb.s_inode_bitmap[i] = NULL;
-		sb->u.ext2_sb.s_block_bitmap_number[i] = 0;
-		sb->u.ext2_sb.s_block_bitmap[i] = NULL;
 	}
 	sb->u.ext2_sb.s_loaded_inode_bitmaps = 0;
-	sb->u.ext2_sb.s_loaded_block_bitmaps = 0;
 	sb->u.ext2_sb.s_gdb_count = db_count;
+	if (ext2_init_balloc (sb)) {
+		printk ("EXT2-fs: not enough memory\n");
+		goto failed_mount2;
+	}
 	/*
 	 * set up enough so that it can read an inode
 	 */
@@ -674,10 +690,13 @@ struct super_block * ext2_read_super (struct super_block * sb, void * data,
 			printk(KERN_ERR "EXT2-fs: corrupt root inode, run e2fsck\n");
 		} else
 			printk(KERN_ERR "EXT2-fs: get root inode failed\n");
-		goto failed_mount2;
+		goto failed_mount3;
 	}
 	ext2_setup_super (sb, es, sb->s_flags & MS_RDONLY);
 	return sb;
+failed_mount3:
+	kfree(sb->u.ext2_sb.s_balloc);
+	sb->u.ext2_sb.s_balloc = NULL;
 failed_mount2:
 	for (i = 0; i < db_count; i++)
 		brelse(sb->u.ext2_sb.s_group_desc[i]);
@@ -687,9 +706,26 @@ failed_mount:
 	return NULL;
 }
 
+/*
+ * The free blocks count is kept in a per-CPU counter while mounted, and
+ * only copied into the superblock buffer when that is written - exactly,
+ * not the approximation the allocator goes by.
+ */
+static void ext2_update_free_blocks(struct super_block *sb,
+				    struct ext2_super_block *es)
+{
+	long count;
+
+	if (!EXT2_SB(sb)->s_balloc)	/* still mounting */
+		return;
+	count = percpu_counter_sum(&EXT2_SB(sb)->s_balloc->free_blocks);
+	es->s_free_blocks_count = cpu_to_le32(count > 0 ? count : 0);
+}
+
 static void ext2_commit_super (struct super_block * sb,
 			       struct ext2_super_block * es)
 {
+	ext2_update_free_blocks(sb, es);
 	es->s_wtime = cpu_to_le32(CURRENT_TIME);
 	mark_buffer_dirty(sb->u.ext2_sb.s_sbh);
 	sb->s_dirt = 0;
@@ -697,6 +733,7 @@ static void ext2_commit_super (struct super_block * sb,
 
 static void ext2_sync_super(struct super_block *sb, struct ext2_super_block *es)
 {
+	ext2_update_free_blocks(sb, es);
 	es->s_wtime = cpu_to_le32(CURRENT_TIME);
 	mark_buffer_dirty(EXT2_SB(sb)->s_sbh);
 	ll_rw_block(WRITE, 1, &EXT2_SB(sb)->s_sbh);
@@ -781,6 +818,8 @@ int ext2_remount (struct super_block * sb, int * flags, char * data)
 		 * by e2fsck since we originally mounted the partition.)
 		 */
 		sb->u.ext2_sb.s_mount_state = le16_to_cpu(es->s_state);
+		percpu_counter_init(&EXT2_SB(sb)->s_balloc->free_blocks,
+				    le32_to_cpu(es->s_free_blocks_count));
 		if (!ext2_setup_super (sb, es, 0))
 			sb->s_flags &= ~MS_RDONLY;
 	}
@@ -791,6 +830,7 @@ int ext2_remount (struct super_block * sb, int * flags, char * data)
 int ext2_statfs (struct super_block * sb, struct statfs * buf)
 {
 	unsigned long overhead;
+	long delayed;
 	int i;
 
 	if (test_opt (sb, MINIX_DF))
@@ -827,6 +867,10 @@ int ext2_statfs (struct super_block * sb, struct statfs * buf)
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = le32_to_cpu(sb->u.ext2_sb.s_es->s_blocks_count) - overhead;
 	buf->f_bfree = ext2_count_free_blocks (sb);
+	/* Blocks promised to delayed allocation are as good as gone */
+	delayed = percpu_counter_read_positive(
+			&sb->u.ext2_sb.s_balloc->delayed_blocks);
+	buf->f_bfree = buf->f_bfree > delayed ? buf->f_bfree - delayed : 0;
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(sb->u.ext2_sb.s_es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(sb->u.ext2_sb.s_es->s_r_blocks_count))
 		buf->f_bavail = 0;
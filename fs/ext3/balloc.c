@@ -394,9 +394,11 @@ do_more:
 		 * reallocate it.  
 		 */
 		BUFFER_TRACE(bitmap_bh, "clear in b_committed_data");
+		jbd_lock_bh_state(bitmap_bh);
 		J_ASSERT_BH(bitmap_bh,
 				bh2jh(bitmap_bh)->b_committed_data != NULL);
 		ext3_set_bit(bit + i, bh2jh(bitmap_bh)->b_committed_data);
+		jbd_unlock_bh_state(bitmap_bh);
 	}
 
 	/* We dirtied the bitmap block */
@@ -443,11 +445,21 @@ error_return:
  */
 static int ext3_test_allocatable(int nr, struct buffer_head *bh)
 {
+	int ret;
+
 	if (ext3_test_bit(nr, bh->b_data))
 		return 0;
-	if (!buffer_jbd(bh) || !bh2jh(bh)->b_committed_data)
+	if (!buffer_jbd(bh))
 		return 1;
-	return !ext3_test_bit(nr, bh2jh(bh)->b_committed_data);
+
+	/* commit may swap b_committed_data under us */
+	jbd_lock_bh_state(bh);
+	if (!bh2jh(bh)->b_committed_data)
+		ret = 1;
+	else
+		ret = !ext3_test_bit(nr, bh2jh(bh)->b_committed_data);
+	jbd_unlock_bh_state(bh);
+	return ret;
 }
 
 /*
@@ -512,10 +524,16 @@ static int find_next_usable_block(int start,
 		if (ext3_test_allocatable(next, bh))
 			return next;
 
-		J_ASSERT_BH(bh, bh2jh(bh)->b_committed_data);
-		here = ext3_find_next_zero_bit
-			((unsigned long *) bh2jh(bh)->b_committed_data, 
-			 maxblocks, next);
+		/* If commit dropped the committed copy since we looked,
+		 * retrying at the same bit will succeed */
+		jbd_lock_bh_state(bh);
+		if (bh2jh(bh)->b_committed_data)
+			here = ext3_find_next_zero_bit
+				((unsigned long *) bh2jh(bh)->b_committed_data,
+				 maxblocks, next);
+		else
+			here = next;
+		jbd_unlock_bh_state(bh);
 	}
 	return -1;
 }
@@ -719,8 +737,13 @@ got_block:
 		}
 	}
 #endif
-	if (buffer_jbd(bh) && bh2jh(bh)->b_committed_data)
-		J_ASSERT_BH(bh, !ext3_test_bit(j, bh2jh(bh)->b_committed_data));
+	if (buffer_jbd(bh)) {
+		jbd_lock_bh_state(bh);
+		if (bh2jh(bh)->b_committed_data)
+			J_ASSERT_BH(bh, !ext3_test_bit(j,
+					bh2jh(bh)->b_committed_data));
+		jbd_unlock_bh_state(bh);
+	}
 	bhtmp = bh;
 	alloctmp = j;
 
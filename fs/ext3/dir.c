@@ -21,18 +21,23 @@
 #include <linux/fs.h>
 #include <linux/jbd.h>
 #include <linux/ext3_fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
 
 static unsigned char ext3_filetype_table[] = {
 	DT_UNKNOWN, DT_REG, DT_DIR, DT_CHR, DT_BLK, DT_FIFO, DT_SOCK, DT_LNK
 };
 
 static int ext3_readdir(struct file *, void *, filldir_t);
+static int ext3_dx_readdir(struct file *, void *, filldir_t);
+static int ext3_release_dir(struct inode *, struct file *);
 
 struct file_operations ext3_dir_operations = {
 	read:		generic_read_dir,
 	readdir:	ext3_readdir,		/* BKL held */
 	ioctl:		ext3_ioctl,		/* BKL held */
 	fsync:		ext3_sync_file,		/* BKL held */
+	release:	ext3_release_dir,
 };
 
 int ext3_check_dir_entry (const char * function, struct inode * dir,
@@ -79,6 +84,17 @@ static int ext3_readdir(struct file * filp,
 
 	sb = inode->i_sb;
 
+	if (is_dx(inode)) {
+		err = ext3_dx_readdir(filp, dirent, filldir);
+		if (err != ERR_BAD_DX_DIR)
+			return err;
+		/*
+		 * Read it the old way from now on.  The flag need not
+		 * reach the disk: e2fsck will deal with the index.
+		 */
+		EXT3_I(inode)->i_flags &= ~EXT3_INDEX_FL;
+	}
+
 	stored = 0;
 	bh = NULL;
 	offset = filp->f_pos & (sb->s_blocksize - 1);
@@ -188,3 +204,203 @@ revalidate:
 	UPDATE_ATIME(inode);
 	return 0;
 }
+
+/*
+ * readdir of an indexed directory
+ *
+ * A split moves names from a full leaf to a new block, so a readdir
+ * which went by block offsets would miss some names, and see others
+ * twice, if a split came between two of its calls.  An indexed
+ * directory is read in hash order instead, and f_pos is the hash of the
+ * next name to go out (shifted down a bit: hashes are even, and f_pos
+ * must stay below EXT3_HTREE_EOF).  A name keeps its hash wherever it
+ * is moved.  ext3_htree_fill_tree() reads the names of one leaf, and of
+ * any leaves carrying on its last hash, into a tree sorted by hash; it
+ * is kept with the file until they have all gone out or the directory
+ * changes.
+ */
+
+struct fname {
+	rb_node_t	rb_hash;
+	struct fname	*next;		/* more with the same hashes */
+	__u32		hash;
+	__u32		minor_hash;
+	__u32		inode;
+	__u8		name_len;
+	__u8		file_type;
+	char		name[0];
+};
+
+struct dir_private_info {
+	rb_root_t	root;		/* names read in, by hash */
+	rb_node_t	*curr_node;	/* the next to go out */
+	struct fname	*extra_fname;	/* filldir had no room */
+	loff_t		last_pos;	/* f_pos as we left it */
+	__u32		curr_hash;	/* where we are */
+	__u32		curr_minor_hash;
+	__u32		next_hash;	/* key of the next leaf, or ~0 */
+};
+
+#define hash2pos(hash)	((loff_t) ((hash) >> 1))
+#define pos2hash(pos)	((__u32) ((pos) << 1))
+
+static void free_rb_tree_fname(rb_root_t *root)
+{
+	struct fname *fname, *next;
+	rb_node_t *n;
+
+	while ((n = rb_first(root)) != NULL) {
+		rb_erase(n, root);
+		fname = rb_entry(n, struct fname, rb_hash);
+		for (; fname; fname = next) {
+			next = fname->next;
+			kfree(fname);
+		}
+	}
+}
+
+/*
+ * Called by ext3_htree_fill_tree() for each name it finds.
+ */
+int ext3_htree_store_dirent(struct file *dir_file, __u32 hash,
+			    __u32 minor_hash, struct ext3_dir_entry_2 *dirent)
+{
+	struct dir_private_info *info = dir_file->private_data;
+	rb_node_t **p = &info->root.rb_node, *parent = NULL;
+	struct fname *fname, *new;
+
+	new = kmalloc(sizeof(*new) + dirent->name_len + 1, GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	new->next = NULL;
+	new->hash = hash;
+	new->minor_hash = minor_hash;
+	new->inode = le32_to_cpu(dirent->inode);
+	new->name_len = dirent->name_len;
+	new->file_type = dirent->file_type;
+	memcpy(new->name, dirent->name, dirent->name_len);
+	new->name[dirent->name_len] = 0;
+
+	while (*p) {
+		parent = *p;
+		fname = rb_entry(parent, struct fname, rb_hash);
+		if (hash < fname->hash ||
+		    (hash == fname->hash && minor_hash < fname->minor_hash))
+			p = &parent->rb_left;
+		else if (hash > fname->hash || minor_hash > fname->minor_hash)
+			p = &parent->rb_right;
+		else {
+			/* Both hashes collide: chain it on */
+			new->next = fname->next;
+			fname->next = new;
+			return 0;
+		}
+	}
+	rb_link_node(&new->rb_hash, parent, p);
+	rb_insert_color(&new->rb_hash, &info->root);
+	return 0;
+}
+
+static int ext3_dx_readdir(struct file * filp,
+			   void * dirent, filldir_t filldir)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	struct dir_private_info *info = filp->private_data;
+	struct fname *fname;
+	int err = 0;
+
+	if (!info) {
+		info = kmalloc(sizeof(*info), GFP_KERNEL);
+		if (!info)
+			return -ENOMEM;
+		memset(info, 0, sizeof(*info));
+		info->root = RB_ROOT;
+		info->last_pos = -1;
+		filp->private_data = info;
+	}
+	if (filp->f_pos == EXT3_HTREE_EOF)
+		return 0;
+
+	/* Somebody has moved f_pos, or the names read in are stale */
+	if (info->last_pos != filp->f_pos ||
+	    filp->f_version != inode->i_version) {
+		free_rb_tree_fname(&info->root);
+		info->curr_node = NULL;
+		info->extra_fname = NULL;
+		if (info->last_pos != filp->f_pos) {
+			info->curr_hash = pos2hash(filp->f_pos);
+			info->curr_minor_hash = 0;
+		}
+		filp->f_version = inode->i_version;
+	}
+
+	/* The rest of a chain which filldir had no room for goes first */
+	fname = info->extra_fname;
+	info->extra_fname = NULL;
+	while (1) {
+		if (!fname) {
+			if (!info->curr_node) {
+				err = ext3_htree_fill_tree(filp,
+						info->curr_hash,
+						info->curr_minor_hash,
+						&info->next_hash);
+				if (err < 0) {
+					free_rb_tree_fname(&info->root);
+					goto out;
+				}
+				if (!err) {
+					filp->f_pos = EXT3_HTREE_EOF;
+					break;
+				}
+				err = 0;
+				info->curr_node = rb_first(&info->root);
+			}
+			fname = rb_entry(info->curr_node, struct fname,
+					 rb_hash);
+			info->curr_hash = fname->hash;
+			info->curr_minor_hash = fname->minor_hash;
+		}
+
+		filp->f_pos = hash2pos(info->curr_hash);
+		for (; fname; fname = fname->next) {
+			unsigned char d_type = DT_UNKNOWN;
+
+			if (EXT3_HAS_INCOMPAT_FEATURE(sb,
+					EXT3_FEATURE_INCOMPAT_FILETYPE) &&
+			    fname->file_type < EXT3_FT_MAX)
+				d_type = ext3_filetype_table[fname->file_type];
+			if (filldir(dirent, fname->name, fname->name_len,
+				    filp->f_pos, fname->inode, d_type)) {
+				info->extra_fname = fname;
+				goto out;
+			}
+		}
+
+		info->curr_node = rb_next(info->curr_node);
+		if (!info->curr_node) {
+			free_rb_tree_fname(&info->root);
+			if (info->next_hash == ~0) {
+				filp->f_pos = EXT3_HTREE_EOF;
+				break;
+			}
+			info->curr_hash = info->next_hash & ~1;
+			info->curr_minor_hash = 0;
+		}
+	}
+out:
+	info->last_pos = filp->f_pos;
+	UPDATE_ATIME(inode);
+	return err;
+}
+
+static int ext3_release_dir(struct inode * inode, struct file * filp)
+{
+	struct dir_private_info *info = filp->private_data;
+
+	if (info) {
+		free_rb_tree_fname(&info->root);
+		kfree(info);
+	}
+	return 0;
+}
@@ -768,11 +768,11 @@ reread:
 
 	/* Simplest case - block found, no allocation needed */
 	if (!partial) {
-		bh_result->b_state &= ~(1UL << BH_New);
+		clear_bit(BH_New, &bh_result->b_state);
 got_it:
 		bh_result->b_dev = inode->i_dev;
 		bh_result->b_blocknr = le32_to_cpu(chain[depth-1].key);
-		bh_result->b_state |= (1UL << BH_Mapped);
+		set_bit(BH_Mapped, &bh_result->b_state);
 		/* Clean up and exit */
 		partial = chain+depth-1; /* the whole chain */
 		goto cleanup;
@@ -837,7 +837,7 @@ out:
 	if (new_size > inode->u.ext3_i.i_disksize)
 		inode->u.ext3_i.i_disksize = new_size;
 
-	bh_result->b_state |= (1UL << BH_New);
+	set_bit(BH_New, &bh_result->b_state);
 	goto got_it;
 
 changed:
@@ -1257,7 +1257,7 @@ static int bget_one(handle_t *handle, struct inode *inode,
  *	ext3_file_write() -> generic_file_write() -> __alloc_pages() -> ...
  *
  * Same applies to ext3_get_block().  We will deadlock on various things like
- * lock_journal and i_truncate_sem.
+ * the journal locks and i_truncate_sem.
  *
  * Setting PF_MEMALLOC here doesn't work - too many internal memory
  * allocations fail.
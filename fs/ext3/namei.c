@@ -94,6 +94,441 @@ static int inline search_dirblock(struct buffer_head * bh,
 	return 0;
 }
 
+/*
+ * Hashed directory indexes
+ *
+ * Block 0 of an indexed directory still starts with "." and "..", but
+ * ".." covers the rest of the block, and hidden behind it is the root
+ * of a tree of (hash, block) pairs sorted by hash.  The leaves are
+ * ordinary directory blocks, each holding the names whose hashes fall
+ * between its key and the next one.  A tree of more than one level has
+ * index nodes, which are blocks with a single empty entry hiding their
+ * (hash, block) pairs.  So the index is invisible to code which walks
+ * the directory block by block, e2fsck aside.
+ *
+ * Two levels are enough for over a million entries with 1k blocks, so
+ * that is all we handle.  A directory whose index we cannot make sense
+ * of is searched the old way.
+ */
+
+struct fake_dirent
+{
+	__u32 inode;
+	__u16 rec_len;
+	__u8 name_len;
+	__u8 file_type;
+};
+
+struct dx_countlimit
+{
+	__u16 limit;
+	__u16 count;
+};
+
+struct dx_entry
+{
+	__u32 hash;
+	__u32 block;
+};
+
+/*
+ * dx_root_info is laid out so that if it should somehow get overlaid
+ * by a dirent the two low bits of the hash version will be zero.
+ * Therefore, the hash version mod 4 should never be 0.
+ */
+struct dx_root
+{
+	struct fake_dirent dot;
+	char dot_name[4];
+	struct fake_dirent dotdot;
+	char dotdot_name[4];
+	struct dx_root_info
+	{
+		__u32 reserved_zero;
+		__u8 hash_version;
+		__u8 info_length; /* 8 */
+		__u8 indirect_levels;
+		__u8 unused_flags;
+	}
+	info;
+	struct dx_entry	entries[0];
+};
+
+struct dx_node
+{
+	struct fake_dirent fake;
+	struct dx_entry	entries[0];
+};
+
+/* One level of a path from the root down to a leaf */
+struct dx_frame
+{
+	struct buffer_head *bh;
+	struct dx_entry *entries;
+	struct dx_entry *at;
+};
+
+struct dx_map_entry
+{
+	u32 hash;
+	u16 offs;
+	u16 size;
+};
+
+/*
+ * The first entry of each index block holds the count and the limit
+ * in place of a hash; its block is the leaf for the lowest hashes.
+ */
+static inline unsigned dx_get_block (struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->block) & 0x00ffffff;
+}
+
+static inline void dx_set_block (struct dx_entry *entry, unsigned value)
+{
+	entry->block = cpu_to_le32(value);
+}
+
+static inline unsigned dx_get_hash (struct dx_entry *entry)
+{
+	return le32_to_cpu(entry->hash);
+}
+
+static inline void dx_set_hash (struct dx_entry *entry, unsigned value)
+{
+	entry->hash = cpu_to_le32(value);
+}
+
+static inline unsigned dx_get_count (struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *) entries)->count);
+}
+
+static inline unsigned dx_get_limit (struct dx_entry *entries)
+{
+	return le16_to_cpu(((struct dx_countlimit *) entries)->limit);
+}
+
+static inline void dx_set_count (struct dx_entry *entries, unsigned value)
+{
+	((struct dx_countlimit *) entries)->count = cpu_to_le16(value);
+}
+
+static inline void dx_set_limit (struct dx_entry *entries, unsigned value)
+{
+	((struct dx_countlimit *) entries)->limit = cpu_to_le16(value);
+}
+
+static inline unsigned dx_root_limit (struct inode *dir, unsigned infosize)
+{
+	unsigned entry_space = dir->i_sb->s_blocksize - EXT3_DIR_REC_LEN(1) -
+		EXT3_DIR_REC_LEN(2) - infosize;
+	return entry_space / sizeof(struct dx_entry);
+}
+
+static inline unsigned dx_node_limit (struct inode *dir)
+{
+	unsigned entry_space = dir->i_sb->s_blocksize - EXT3_DIR_REC_LEN(0);
+	return entry_space / sizeof(struct dx_entry);
+}
+
+/*
+ * Walk the index from the root down to the leaf which would hold the
+ * name, filling in one frame per level and the name's hash; without a
+ * name, down to the leaf for hinfo->hash.  Returns the bottom frame, or
+ * NULL with *err set; ERR_BAD_DX_DIR means the index is not one we
+ * understand.
+ */
+static struct dx_frame *dx_probe(struct inode *dir, struct qstr *name,
+				 struct dx_hash_info *hinfo,
+				 struct dx_frame *frame_in, int *err)
+{
+	unsigned count, indirect;
+	struct dx_entry *at, *entries, *p, *q, *m;
+	struct dx_root *root;
+	struct buffer_head *bh;
+	struct dx_frame *frame = frame_in;
+	u32 hash;
+
+	frame->bh = NULL;
+	if (!(bh = ext3_bread (NULL, dir, 0, 0, err)))
+		goto fail;
+	root = (struct dx_root *) bh->b_data;
+	if (root->info.hash_version != DX_HASH_TEA &&
+	    root->info.hash_version != DX_HASH_HALF_MD4 &&
+	    root->info.hash_version != DX_HASH_LEGACY) {
+		ext3_warning(dir->i_sb, "dx_probe",
+			     "Unrecognised inode hash code %d",
+			     root->info.hash_version);
+		goto bad;
+	}
+	if (root->info.unused_flags & 1) {
+		ext3_warning(dir->i_sb, "dx_probe",
+			     "Unimplemented inode hash flags: %#06x",
+			     root->info.unused_flags);
+		goto bad;
+	}
+	if ((indirect = root->info.indirect_levels) > 1) {
+		ext3_warning(dir->i_sb, "dx_probe",
+			     "Unimplemented inode hash depth: %#06x",
+			     root->info.indirect_levels);
+		goto bad;
+	}
+
+	hinfo->hash_version = root->info.hash_version;
+	hinfo->seed = EXT3_SB(dir->i_sb)->s_hash_seed;
+	if (name)
+		dx_hash((const char *) name->name, name->len, hinfo);
+	hash = hinfo->hash;
+
+	entries = (struct dx_entry *) (((char *)&root->info) +
+				       root->info.info_length);
+	if (dx_get_limit(entries) != dx_root_limit(dir,
+						   root->info.info_length)) {
+		ext3_warning(dir->i_sb, "dx_probe",
+			     "dx entry: limit != root limit");
+		goto bad;
+	}
+
+	while (1) {
+		count = dx_get_count(entries);
+		if (!count || count > dx_get_limit(entries)) {
+			ext3_warning(dir->i_sb, "dx_probe",
+				     "dx entry: no count or count > limit");
+			goto bad2;
+		}
+
+		/* Binary search for the last key not above the hash */
+		p = entries + 1;
+		q = entries + count - 1;
+		while (p <= q) {
+			m = p + (q - p)/2;
+			if (dx_get_hash(m) > hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		at = p - 1;
+
+		frame->bh = bh;
+		frame->entries = entries;
+		frame->at = at;
+		if (!indirect--)
+			return frame;
+		if (!(bh = ext3_bread (NULL, dir, dx_get_block(at), 0, err)))
+			goto fail2;
+		entries = ((struct dx_node *) bh->b_data)->entries;
+		if (dx_get_limit(entries) != dx_node_limit (dir)) {
+			ext3_warning(dir->i_sb, "dx_probe",
+				     "dx entry: limit != node limit");
+			goto bad2;
+		}
+		frame++;
+		frame->bh = NULL;
+	}
+
+bad2:
+	brelse(bh);
+	*err = ERR_BAD_DX_DIR;
+fail2:
+	while (frame >= frame_in) {
+		brelse(frame->bh);
+		frame--;
+	}
+	goto fail;
+bad:
+	brelse(bh);
+	*err = ERR_BAD_DX_DIR;
+fail:
+	if (*err == ERR_BAD_DX_DIR)
+		ext3_warning(dir->i_sb, "dx_probe",
+			     "Corrupt dir inode %ld, running e2fsck is "
+			     "recommended.", dir->i_ino);
+	return NULL;
+}
+
+static void dx_release (struct dx_frame *frames)
+{
+	if (frames[0].bh == NULL)
+		return;
+
+	if (((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels)
+		brelse(frames[1].bh);
+	brelse(frames[0].bh);
+}
+
+/*
+ * Step the path in frames to the next leaf, if that leaf continues
+ * the run of names with this hash: the low bit of a leaf's key is set
+ * when a split left names with the same hash on both sides.  With
+ * @next_hash, step to the next leaf whatever its key, and store the
+ * key there.  Returns 1 if the caller should search the next leaf, 0
+ * if not, or an error.
+ */
+static int dx_next_block(struct inode *dir, u32 hash, u32 *next_hash,
+			 struct dx_frame *frame, struct dx_frame *frames)
+{
+	struct dx_frame *p;
+	struct buffer_head *bh;
+	int err, num_frames = 0;
+
+	p = frame;
+	while (1) {
+		if (++(p->at) < p->entries + dx_get_count(p->entries))
+			break;
+		if (p == frames)
+			return 0;
+		num_frames++;
+		p--;
+	}
+
+	if (next_hash)
+		*next_hash = dx_get_hash(p->at);
+	else if ((dx_get_hash(p->at) & ~1) != hash)
+		return 0;
+
+	while (num_frames--) {
+		if (!(bh = ext3_bread(NULL, dir, dx_get_block(p->at), 0, &err)))
+			return err;
+		p++;
+		brelse(p->bh);
+		p->bh = bh;
+		p->at = p->entries = ((struct dx_node *) bh->b_data)->entries;
+	}
+	return 1;
+}
+
+static struct buffer_head * ext3_dx_find_entry(struct dentry *dentry,
+			struct ext3_dir_entry_2 **res_dir, int *err)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	struct super_block *sb = dir->i_sb;
+	struct dx_hash_info hinfo;
+	struct dx_frame frames[2], *frame;
+	struct buffer_head *bh;
+	unsigned long block;
+	int retval;
+
+	if (!(frame = dx_probe(dir, &dentry->d_name, &hinfo, frames, err)))
+		return NULL;
+	do {
+		block = dx_get_block(frame->at);
+		if (!(bh = ext3_bread (NULL, dir, block, 0, err)))
+			goto errout;
+		retval = search_dirblock(bh, dir, dentry,
+				block << EXT3_BLOCK_SIZE_BITS(sb), res_dir);
+		if (retval == 1) {
+			dx_release (frames);
+			return bh;
+		}
+		brelse (bh);
+		if (retval < 0) {
+			*err = -EIO;
+			goto errout;
+		}
+		retval = dx_next_block(dir, hinfo.hash, NULL, frame, frames);
+		if (retval < 0) {
+			ext3_warning(sb, "ext3_dx_find_entry",
+				     "error reading index page in directory #%lu",
+				     dir->i_ino);
+			*err = retval;
+			goto errout;
+		}
+	} while (retval == 1);
+
+	*err = -ENOENT;
+errout:
+	dx_release (frames);
+	return NULL;
+}
+
+/*
+ * For readdir in hash order (see fs/ext3/dir.c): hand the names from
+ * start_hash on to ext3_htree_store_dirent() - those of the leaf it
+ * falls in, and of the leaves after that until one which does not
+ * carry on the last hash or, if none were found, until some are.
+ * "." and ".." count as hashes 0 and 2.  The key of the leaf after the
+ * last one read, or ~0, goes in *next_hash.  Returns how many names
+ * were stored, or an error.
+ */
+int ext3_htree_fill_tree(struct file *dir_file, __u32 start_hash,
+			 __u32 start_minor_hash, __u32 *next_hash)
+{
+	struct inode *dir = dir_file->f_dentry->d_inode;
+	struct super_block *sb = dir->i_sb;
+	struct dx_hash_info hinfo;
+	struct dx_frame frames[2], *frame;
+	struct ext3_dir_entry_2 *de, *top;
+	struct buffer_head *bh;
+	unsigned long block;
+	int count = 0, err;
+
+	hinfo.hash = start_hash;
+	hinfo.minor_hash = 0;
+	if (!(frame = dx_probe(dir, NULL, &hinfo, frames, &err)))
+		return err;
+
+	de = (struct ext3_dir_entry_2 *) frames[0].bh->b_data;
+	if (!start_hash && !start_minor_hash) {
+		if ((err = ext3_htree_store_dirent(dir_file, 0, 0, de)) != 0)
+			goto out;
+		count++;
+	}
+	if (start_hash < 2 || (start_hash == 2 && !start_minor_hash)) {
+		de = (struct ext3_dir_entry_2 *)
+			((char *) de + le16_to_cpu(de->rec_len));
+		if ((err = ext3_htree_store_dirent(dir_file, 2, 0, de)) != 0)
+			goto out;
+		count++;
+	}
+
+	while (1) {
+		block = dx_get_block(frame->at);
+		if (!(bh = ext3_bread(NULL, dir, block, 0, &err))) {
+			if (!err)
+				err = -EIO;
+			goto out;
+		}
+		de = (struct ext3_dir_entry_2 *) bh->b_data;
+		top = (struct ext3_dir_entry_2 *) (bh->b_data + sb->s_blocksize -
+						   EXT3_DIR_REC_LEN(0));
+		for (; de < top; de = (struct ext3_dir_entry_2 *)
+			     ((char *) de + le16_to_cpu(de->rec_len))) {
+			if (!ext3_check_dir_entry("ext3_htree_fill_tree", dir,
+						  de, bh, (block <<
+						  EXT3_BLOCK_SIZE_BITS(sb)) +
+						  ((char *) de - bh->b_data)))
+				break;
+			if (!de->inode)
+				continue;
+			dx_hash(de->name, de->name_len, &hinfo);
+			if (hinfo.hash < start_hash ||
+			    (hinfo.hash == start_hash &&
+			     hinfo.minor_hash < start_minor_hash))
+				continue;
+			err = ext3_htree_store_dirent(dir_file, hinfo.hash,
+						      hinfo.minor_hash, de);
+			if (err) {
+				brelse(bh);
+				goto out;
+			}
+			count++;
+		}
+		brelse(bh);
+
+		*next_hash = ~0;
+		err = dx_next_block(dir, 0, next_hash, frame, frames);
+		if (err < 0)
+			goto out;
+		if (!err || (count && !(*next_hash & 1)))
+			break;
+	}
+	err = count;
+out:
+	dx_release(frames);
+	return err;
+}
+
 /*
  *	ext3_find_entry()
  *
@@ -123,6 +558,16 @@ static struct buffer_head * ext3_find_entry (struct dentry *dentry,
 	*res_dir = NULL;
 	sb = dir->i_sb;
 
+	if (is_dx(dir)) {
+		bh = ext3_dx_find_entry(dentry, res_dir, &err);
+		/*
+		 * Unless the index itself is at fault, its answer
+		 * stands; otherwise search the directory the old way.
+		 */
+		if (bh || err != ERR_BAD_DX_DIR)
+			return bh;
+	}
+
 	nblocks = dir->i_size >> EXT3_BLOCK_SIZE_BITS(sb);
 	start = dir->u.ext3_i.i_dir_start_lookup;
 	if (start >= nblocks)
@@ -237,6 +682,588 @@ static inline void ext3_set_de_type(struct super_block *sb,
 		de->file_type = ext3_type_by_mode[(mode & S_IFMT)>>S_SHIFT];
 }
 
+/*
+ * Without the DIR_INDEX feature an index cannot be trusted to be kept
+ * up to date, so any change to the directory drops it.
+ */
+static inline void ext3_update_dx_flag(struct inode *dir)
+{
+	if (!EXT3_HAS_COMPAT_FEATURE(dir->i_sb,
+				     EXT3_FEATURE_COMPAT_DIR_INDEX))
+		dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+}
+
+/*
+ * Add a block to the end of the directory and get write access to it.
+ */
+static struct buffer_head *ext3_append(handle_t *handle,
+					struct inode *inode,
+					u32 *block, int *err)
+{
+	struct buffer_head *bh;
+
+	*block = inode->i_size >> inode->i_sb->s_blocksize_bits;
+
+	bh = ext3_bread(handle, inode, *block, 1, err);
+	if (!bh)
+		return NULL;
+	BUFFER_TRACE(bh, "get_write_access");
+	*err = ext3_journal_get_write_access(handle, bh);
+	if (*err) {
+		ext3_std_error(inode->i_sb, *err);
+		brelse(bh);
+		return NULL;
+	}
+	inode->i_size += inode->i_sb->s_blocksize;
+	inode->u.ext3_i.i_disksize = inode->i_size;
+	ext3_mark_inode_dirty(handle, inode);
+	return bh;
+}
+
+/*
+ * Hash the live entries of a leaf into a map growing down from
+ * map_tail.  Returns the number of entries.
+ */
+static int dx_make_map (struct ext3_dir_entry_2 *de, int size,
+			struct dx_hash_info *hinfo,
+			struct dx_map_entry *map_tail)
+{
+	int count = 0;
+	char *base = (char *) de;
+	struct dx_hash_info h = *hinfo;
+
+	while ((char *) de < base + size) {
+		if (de->name_len && de->inode) {
+			dx_hash(de->name, de->name_len, &h);
+			map_tail--;
+			map_tail->hash = h.hash;
+			map_tail->offs = (char *) de - base;
+			map_tail->size = EXT3_DIR_REC_LEN(de->name_len);
+			count++;
+		}
+		if (!le16_to_cpu(de->rec_len))
+			break;
+		de = (struct ext3_dir_entry_2 *)
+			((char *) de + le16_to_cpu(de->rec_len));
+	}
+	return count;
+}
+
+/* Sort map by hash value */
+static void dx_sort_map (struct dx_map_entry *map, unsigned count)
+{
+	struct dx_map_entry *p, *q, *top = map + count - 1;
+	struct dx_map_entry tmp;
+	int more;
+
+	/* Combsort until bubble sort doesn't suck */
+	while (count > 2) {
+		count = count*10/13;
+		if (count - 9 < 2) /* 9, 10 -> 11 */
+			count = 11;
+		for (p = top, q = p - count; q >= map; p--, q--)
+			if (p->hash < q->hash) {
+				tmp = *p;
+				*p = *q;
+				*q = tmp;
+			}
+	}
+	/* Garden variety bubble sort */
+	do {
+		more = 0;
+		q = top;
+		while (q-- > map) {
+			if (q[1].hash >= q[0].hash)
+				continue;
+			tmp = q[1];
+			q[1] = q[0];
+			q[0] = tmp;
+			more = 1;
+		}
+	} while (more);
+}
+
+/* Add a key for a new block just after frame->at */
+static void dx_insert_block(struct dx_frame *frame, u32 hash, u32 block)
+{
+	struct dx_entry *entries = frame->entries;
+	struct dx_entry *old = frame->at, *new = old + 1;
+	int count = dx_get_count(entries);
+
+	memmove(new + 1, new, (char *)(entries + count) - (char *)(new));
+	dx_set_hash(new, hash);
+	dx_set_block(new, block);
+	dx_set_count(entries, count + 1);
+}
+
+/*
+ * Move count entries from end of map between two memory locations.
+ * Returns pointer to last entry moved.
+ */
+static struct ext3_dir_entry_2 *
+dx_move_dirents(char *from, char *to, struct dx_map_entry *map, int count)
+{
+	unsigned rec_len = 0;
+
+	while (count--) {
+		struct ext3_dir_entry_2 *de =
+			(struct ext3_dir_entry_2 *) (from + map->offs);
+		rec_len = EXT3_DIR_REC_LEN(de->name_len);
+		memcpy (to, de, rec_len);
+		((struct ext3_dir_entry_2 *) to)->rec_len =
+				cpu_to_le16(rec_len);
+		de->inode = 0;
+		map++;
+		to += rec_len;
+	}
+	return (struct ext3_dir_entry_2 *) (to - rec_len);
+}
+
+/*
+ * Compact each dir entry in the range to the minimal rec_len.
+ * Returns pointer to last entry in range.
+ */
+static struct ext3_dir_entry_2 *dx_pack_dirents(char *base, int size)
+{
+	struct ext3_dir_entry_2 *next, *to, *prev;
+	struct ext3_dir_entry_2 *de = (struct ext3_dir_entry_2 *) base;
+	unsigned rec_len = 0;
+
+	prev = to = de;
+	while ((char *) de < base + size) {
+		next = (struct ext3_dir_entry_2 *) ((char *) de +
+						    le16_to_cpu(de->rec_len));
+		if (de->inode && de->name_len) {
+			rec_len = EXT3_DIR_REC_LEN(de->name_len);
+			if (de > to)
+				memmove(to, de, rec_len);
+			to->rec_len = cpu_to_le16(rec_len);
+			prev = to;
+			to = (struct ext3_dir_entry_2 *) (((char *) to) + rec_len);
+		}
+		de = next;
+	}
+	return prev;
+}
+
+/*
+ * Split a full leaf into itself and a new block, the upper half of
+ * the hashes, by size, going to the new one.  *bh is left as the
+ * block the new name belongs in, and its last entry, with room after
+ * it, is returned.  Releases *bh on failure.
+ */
+static struct ext3_dir_entry_2 *do_split(handle_t *handle, struct inode *dir,
+			struct buffer_head **bh, struct dx_frame *frame,
+			struct dx_hash_info *hinfo, int *error)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	unsigned count, continued, split, size;
+	struct buffer_head *bh2;
+	u32 newblock;
+	u32 hash2;
+	struct dx_map_entry *map;
+	char *data1 = (*bh)->b_data, *data2;
+	struct ext3_dir_entry_2 *de, *de2;
+	int err;
+
+	bh2 = ext3_append (handle, dir, &newblock, &err);
+	if (!bh2) {
+		brelse(*bh);
+		*bh = NULL;
+		goto errout;
+	}
+
+	BUFFER_TRACE(*bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, *bh);
+	if (err)
+		goto journal_error;
+
+	BUFFER_TRACE(frame->bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, frame->bh);
+	if (err)
+		goto journal_error;
+
+	data2 = bh2->b_data;
+
+	/* The map is built at the end of the new block, and the entries
+	 * moved there fill it from the start without reaching the part
+	 * of the map still to be read. */
+	map = (struct dx_map_entry *) (data2 + blocksize);
+	count = dx_make_map ((struct ext3_dir_entry_2 *) data1,
+			     blocksize, hinfo, map);
+	map -= count;
+	dx_sort_map (map, count);
+
+	/* Move the top half of the hashes, by size; at least one stays */
+	size = 0;
+	for (split = count; split > 1; split--) {
+		if (size + map[split - 1].size/2 > blocksize/2)
+			break;
+		size += map[split - 1].size;
+	}
+	hash2 = map[split].hash;
+	continued = hash2 == map[split - 1].hash;
+
+	de2 = dx_move_dirents(data1, data2, map + split, count - split);
+	de = dx_pack_dirents(data1, blocksize);
+	de->rec_len = cpu_to_le16(data1 + blocksize - (char *) de);
+	de2->rec_len = cpu_to_le16(data2 + blocksize - (char *) de2);
+
+	/* Which block gets the new entry? */
+	if (hinfo->hash >= hash2) {
+		struct buffer_head *tmp = *bh;
+
+		*bh = bh2;
+		bh2 = tmp;
+		de = de2;
+	}
+	dx_insert_block (frame, hash2 + continued, newblock);
+	err = ext3_journal_dirty_metadata (handle, bh2);
+	if (err)
+		goto journal_error;
+	err = ext3_journal_dirty_metadata (handle, frame->bh);
+	if (err)
+		goto journal_error;
+	brelse (bh2);
+	return de;
+
+journal_error:
+	brelse(*bh);
+	brelse(bh2);
+	*bh = NULL;
+	ext3_std_error(dir->i_sb, err);
+errout:
+	*error = err;
+	return NULL;
+}
+
+/*
+ * Add the name to a directory block: after de if it is given, or else
+ * in the first gap big enough.  Returns -ENOSPC, keeping bh, if there
+ * is no such gap; otherwise bh is released.
+ */
+static int add_dirent_to_buf(handle_t *handle, struct dentry *dentry,
+			     struct inode *inode, struct ext3_dir_entry_2 *de,
+			     struct buffer_head * bh)
+{
+	struct inode	*dir = dentry->d_parent->d_inode;
+	const char	*name = (const char *) dentry->d_name.name;
+	int		namelen = dentry->d_name.len;
+	unsigned long	offset = 0;
+	unsigned short	reclen;
+	int		nlen, rlen, err;
+	char		*top;
+
+	reclen = EXT3_DIR_REC_LEN(namelen);
+	if (!de) {
+		de = (struct ext3_dir_entry_2 *)bh->b_data;
+		top = bh->b_data + dir->i_sb->s_blocksize - reclen;
+		while ((char *) de <= top) {
+			if (!ext3_check_dir_entry("ext3_add_entry", dir, de,
+						  bh, offset)) {
+				brelse (bh);
+				return -EIO;
+			}
+			if (ext3_match (namelen, name, de)) {
+				brelse (bh);
+				return -EEXIST;
+			}
+			nlen = EXT3_DIR_REC_LEN(de->name_len);
+			rlen = le16_to_cpu(de->rec_len);
+			if ((de->inode? rlen - nlen: rlen) >= reclen)
+				break;
+			de = (struct ext3_dir_entry_2 *)((char *)de + rlen);
+			offset += rlen;
+		}
+		if ((char *) de > top)
+			return -ENOSPC;
+	}
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err) {
+		ext3_std_error(dir->i_sb, err);
+		brelse(bh);
+		return err;
+	}
+
+	/* By now the buffer is marked for journaling */
+	nlen = EXT3_DIR_REC_LEN(de->name_len);
+	rlen = le16_to_cpu(de->rec_len);
+	if (de->inode) {
+		struct ext3_dir_entry_2 *de1 =
+			(struct ext3_dir_entry_2 *)((char *)de + nlen);
+		de1->rec_len = cpu_to_le16(rlen - nlen);
+		de->rec_len = cpu_to_le16(nlen);
+		de = de1;
+	}
+	de->file_type = EXT3_FT_UNKNOWN;
+	if (inode) {
+		de->inode = cpu_to_le32(inode->i_ino);
+		ext3_set_de_type(dir->i_sb, de, inode->i_mode);
+	} else
+		de->inode = 0;
+	de->name_len = namelen;
+	memcpy (de->name, name, namelen);
+	/*
+	 * XXX shouldn't update any times until successful
+	 * completion of syscall, but too many callers depend
+	 * on this.
+	 *
+	 * XXX similarly, too many callers depend on
+	 * ext3_new_inode() setting the times, but error
+	 * recovery deletes the inode, so the worst that can
+	 * happen is that the times are slightly out of date
+	 * and/or different from the directory change time.
+	 */
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+	ext3_update_dx_flag(dir);
+	dir->i_version = ++event;
+	ext3_mark_inode_dirty(handle, dir);
+	BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
+	err = ext3_journal_dirty_metadata(handle, bh);
+	if (err)
+		ext3_std_error(dir->i_sb, err);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Can block 0 become an index root?  It must start with "." and ".."
+ * as mkdir lays them out.
+ */
+static int dx_indexable(struct inode *dir, struct buffer_head *bh)
+{
+	struct dx_root *root = (struct dx_root *) bh->b_data;
+
+	if (!EXT3_HAS_COMPAT_FEATURE(dir->i_sb, EXT3_FEATURE_COMPAT_DIR_INDEX))
+		return 0;
+	return le16_to_cpu(root->dot.rec_len) == EXT3_DIR_REC_LEN(1) &&
+	       root->dot.name_len == 1 && root->dot_name[0] == '.' &&
+	       root->dotdot.name_len == 2 &&
+	       root->dotdot_name[0] == '.' && root->dotdot_name[1] == '.';
+}
+
+/*
+ * The single block of the directory is full: move its entries to a
+ * new block, turn block 0 into an index root over it, and split it as
+ * for any full leaf.  Releases bh.
+ */
+static int make_indexed_dir(handle_t *handle, struct dentry *dentry,
+			    struct inode *inode, struct buffer_head *bh)
+{
+	struct inode	*dir = dentry->d_parent->d_inode;
+	const char	*name = (const char *) dentry->d_name.name;
+	int		namelen = dentry->d_name.len;
+	struct buffer_head *bh2;
+	struct dx_root	*root;
+	struct dx_frame	frames[2], *frame;
+	struct dx_entry *entries;
+	struct ext3_dir_entry_2	*de, *de2;
+	char		*data1, *top;
+	unsigned	len;
+	int		retval;
+	unsigned	blocksize;
+	struct dx_hash_info hinfo;
+	u32		block;
+
+	blocksize = dir->i_sb->s_blocksize;
+	BUFFER_TRACE(bh, "get_write_access");
+	retval = ext3_journal_get_write_access(handle, bh);
+	if (retval) {
+		ext3_std_error(dir->i_sb, retval);
+		brelse(bh);
+		return retval;
+	}
+	root = (struct dx_root *) bh->b_data;
+
+	bh2 = ext3_append (handle, dir, &block, &retval);
+	if (!bh2) {
+		brelse(bh);
+		return retval;
+	}
+	data1 = bh2->b_data;
+
+	/* The 0th block becomes the root, move the dirents out */
+	de = (struct ext3_dir_entry_2 *)((char *) &root->dotdot +
+				le16_to_cpu(root->dotdot.rec_len));
+	len = ((char *) root) + blocksize - (char *) de;
+	memcpy (data1, de, len);
+	de = (struct ext3_dir_entry_2 *) data1;
+	top = data1 + len;
+	while ((char *)(de2 = (struct ext3_dir_entry_2 *)
+			((char *) de + le16_to_cpu(de->rec_len))) < top)
+		de = de2;
+	de->rec_len = cpu_to_le16(data1 + blocksize - (char *) de);
+
+	/* Initialize the root; the dot dirents already exist */
+	root->dotdot.rec_len = cpu_to_le16(blocksize - EXT3_DIR_REC_LEN(1));
+	memset (&root->info, 0, sizeof(root->info));
+	root->info.info_length = sizeof(root->info);
+	root->info.hash_version = EXT3_SB(dir->i_sb)->s_def_hash_version;
+	entries = root->entries;
+	dx_set_block (entries, 1);
+	dx_set_count (entries, 1);
+	dx_set_limit (entries, dx_root_limit(dir, sizeof(root->info)));
+
+	/* From here on it is a good index with a single leaf, even if
+	 * the split below fails */
+	BUFFER_TRACE(bh2, "call ext3_journal_dirty_metadata");
+	retval = ext3_journal_dirty_metadata(handle, bh2);
+	if (!retval) {
+		BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
+		retval = ext3_journal_dirty_metadata(handle, bh);
+	}
+	if (retval) {
+		ext3_std_error(dir->i_sb, retval);
+		brelse(bh2);
+		brelse(bh);
+		return retval;
+	}
+	dir->u.ext3_i.i_flags |= EXT3_INDEX_FL;
+	ext3_mark_inode_dirty(handle, dir);
+
+	/* Initialize as for dx_probe */
+	hinfo.hash_version = root->info.hash_version;
+	hinfo.seed = EXT3_SB(dir->i_sb)->s_hash_seed;
+	dx_hash(name, namelen, &hinfo);
+	frame = frames;
+	frame->entries = entries;
+	frame->at = entries;
+	frame->bh = bh;
+	bh = bh2;
+	de = do_split(handle, dir, &bh, frame, &hinfo, &retval);
+	dx_release (frames);
+	if (!de)
+		return retval;
+
+	return add_dirent_to_buf(handle, dentry, inode, de, bh);
+}
+
+static int ext3_dx_add_entry(handle_t *handle, struct dentry *dentry,
+			     struct inode *inode)
+{
+	struct dx_frame frames[2], *frame;
+	struct dx_entry *entries, *at;
+	struct dx_hash_info hinfo;
+	struct buffer_head * bh;
+	struct inode *dir = dentry->d_parent->d_inode;
+	struct super_block * sb = dir->i_sb;
+	struct ext3_dir_entry_2 *de;
+	int err;
+
+	frame = dx_probe(dir, &dentry->d_name, &hinfo, frames, &err);
+	if (!frame)
+		return err;
+	entries = frame->entries;
+	at = frame->at;
+
+	if (!(bh = ext3_bread(handle, dir, dx_get_block(frame->at), 0, &err)))
+		goto cleanup;
+
+	err = add_dirent_to_buf(handle, dentry, inode, NULL, bh);
+	if (err != -ENOSPC) {
+		bh = NULL;
+		goto cleanup;
+	}
+
+	/* Block full, should compress but for now just split */
+	if (dx_get_count(entries) == dx_get_limit(entries)) {
+		/* Need to split index */
+		u32 newblock;
+		unsigned icount = dx_get_count(entries);
+		int levels = frame - frames;
+		struct dx_entry *entries2;
+		struct dx_node *node2;
+		struct buffer_head *bh2;
+
+		if (levels && (dx_get_count(frames->entries) ==
+			       dx_get_limit(frames->entries))) {
+			ext3_warning(sb, "ext3_dx_add_entry",
+				     "Directory index full!");
+			err = -ENOSPC;
+			goto cleanup;
+		}
+		bh2 = ext3_append (handle, dir, &newblock, &err);
+		if (!bh2)
+			goto cleanup;
+		node2 = (struct dx_node *)(bh2->b_data);
+		entries2 = node2->entries;
+		memset(&node2->fake, 0, sizeof(node2->fake));
+		node2->fake.rec_len = cpu_to_le16(sb->s_blocksize);
+		BUFFER_TRACE(frame->bh, "get_write_access");
+		err = ext3_journal_get_write_access(handle, frame->bh);
+		if (err) {
+			brelse(bh2);
+			goto journal_error;
+		}
+		if (levels) {
+			unsigned icount1 = icount/2, icount2 = icount - icount1;
+			unsigned hash2 = dx_get_hash(entries + icount1);
+
+			BUFFER_TRACE(frames[0].bh, "get_write_access");
+			err = ext3_journal_get_write_access(handle,
+							    frames[0].bh);
+			if (err) {
+				brelse(bh2);
+				goto journal_error;
+			}
+
+			memcpy ((char *) entries2, (char *) (entries + icount1),
+				icount2 * sizeof(struct dx_entry));
+			dx_set_count (entries, icount1);
+			dx_set_count (entries2, icount2);
+			dx_set_limit (entries2, dx_node_limit(dir));
+
+			/* Which index block gets the new entry? */
+			if (at - entries >= icount1) {
+				struct buffer_head *tmp = frame->bh;
+
+				frame->at = at = at - entries - icount1 + entries2;
+				frame->entries = entries = entries2;
+				frame->bh = bh2;
+				bh2 = tmp;
+			}
+			dx_insert_block (frames + 0, hash2, newblock);
+			err = ext3_journal_dirty_metadata(handle, bh2);
+			brelse (bh2);
+			if (err)
+				goto journal_error;
+		} else {
+			memcpy((char *) entries2, (char *) entries,
+			       icount * sizeof(struct dx_entry));
+			dx_set_limit(entries2, dx_node_limit(dir));
+
+			/* Set up root */
+			dx_set_count(entries, 1);
+			dx_set_block(entries + 0, newblock);
+			((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels = 1;
+
+			/* Add new access path frame */
+			frame = frames + 1;
+			frame->at = at = at - entries + entries2;
+			frame->entries = entries = entries2;
+			frame->bh = bh2;
+		}
+		err = ext3_journal_dirty_metadata(handle, frames[0].bh);
+		if (err)
+			goto journal_error;
+	}
+	de = do_split(handle, dir, &bh, frame, &hinfo, &err);
+	if (!de)
+		goto cleanup;
+	err = add_dirent_to_buf(handle, dentry, inode, de, bh);
+	bh = NULL;
+	goto cleanup;
+
+journal_error:
+	ext3_std_error(dir->i_sb, err);
+cleanup:
+	if (bh)
+		brelse(bh);
+	dx_release(frames);
+	return err;
+}
+
 /*
  *	ext3_add_entry()
  *
@@ -246,127 +1273,55 @@ static inline void ext3_set_de_type(struct super_block *sb,
  * NOTE!! The inode part of 'de' is left at 0 - which means you
  * may not sleep between calling this and putting something into
  * the entry, as someone else might have used it while you slept.
- */
-
-/*
- * AKPM: the journalling code here looks wrong on the error paths
+ *
+ * A directory which outgrows its first block is indexed, if the
+ * filesystem allows it.
  */
 static int ext3_add_entry (handle_t *handle, struct dentry *dentry,
 	struct inode *inode)
 {
 	struct inode *dir = dentry->d_parent->d_inode;
-	const char *name = dentry->d_name.name;
-	int namelen = dentry->d_name.len;
-	unsigned long offset;
-	unsigned short rec_len;
 	struct buffer_head * bh;
-	struct ext3_dir_entry_2 * de, * de1;
+	struct ext3_dir_entry_2 *de;
 	struct super_block * sb;
 	int	retval;
+	int	dx_fallback = 0;
+	u32	block, blocks;
 
 	sb = dir->i_sb;
 
-	if (!namelen)
+	if (!dentry->d_name.len)
 		return -EINVAL;
-	bh = ext3_bread (handle, dir, 0, 0, &retval);
+	if (is_dx(dir)) {
+		retval = ext3_dx_add_entry(handle, dentry, inode);
+		if (retval != ERR_BAD_DX_DIR)
+			return retval;
+		dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+		dx_fallback++;
+		ext3_mark_inode_dirty(handle, dir);
+	}
+	blocks = dir->i_size >> EXT3_BLOCK_SIZE_BITS(sb);
+	if (!blocks)
+		return -ENOENT;
+	for (block = 0; block < blocks; block++) {
+		bh = ext3_bread(handle, dir, block, 0, &retval);
+		if (!bh)
+			return retval;
+		retval = add_dirent_to_buf(handle, dentry, inode, NULL, bh);
+		if (retval != -ENOSPC)
+			return retval;
+
+		if (blocks == 1 && !dx_fallback && dx_indexable(dir, bh))
+			return make_indexed_dir(handle, dentry, inode, bh);
+		brelse(bh);
+	}
+	bh = ext3_append(handle, dir, &block, &retval);
 	if (!bh)
 		return retval;
-	rec_len = EXT3_DIR_REC_LEN(namelen);
-	offset = 0;
 	de = (struct ext3_dir_entry_2 *) bh->b_data;
-	while (1) {
-		if ((char *)de >= sb->s_blocksize + bh->b_data) {
-			brelse (bh);
-			bh = NULL;
-			bh = ext3_bread (handle, dir,
-				offset >> EXT3_BLOCK_SIZE_BITS(sb), 1, &retval);
-			if (!bh)
-				return retval;
-			if (dir->i_size <= offset) {
-				if (dir->i_size == 0) {
-					brelse(bh);
-					return -ENOENT;
-				}
-
-				ext3_debug ("creating next block\n");
-
-				BUFFER_TRACE(bh, "get_write_access");
-				ext3_journal_get_write_access(handle, bh);
-				de = (struct ext3_dir_entry_2 *) bh->b_data;
-				de->inode = 0;
-				de->rec_len = le16_to_cpu(sb->s_blocksize);
-				dir->u.ext3_i.i_disksize =
-					dir->i_size = offset + sb->s_blocksize;
-				dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
-				ext3_mark_inode_dirty(handle, dir);
-			} else {
-
-				ext3_debug ("skipping to next block\n");
-
-				de = (struct ext3_dir_entry_2 *) bh->b_data;
-			}
-		}
-		if (!ext3_check_dir_entry ("ext3_add_entry", dir, de, bh,
-					   offset)) {
-			brelse (bh);
-			return -ENOENT;
-		}
-		if (ext3_match (namelen, name, de)) {
-				brelse (bh);
-				return -EEXIST;
-		}
-		if ((le32_to_cpu(de->inode) == 0 &&
-				le16_to_cpu(de->rec_len) >= rec_len) ||
-		    (le16_to_cpu(de->rec_len) >=
-				EXT3_DIR_REC_LEN(de->name_len) + rec_len)) {
-			BUFFER_TRACE(bh, "get_write_access");
-			ext3_journal_get_write_access(handle, bh);
-			/* By now the buffer is marked for journaling */
-			offset += le16_to_cpu(de->rec_len);
-			if (le32_to_cpu(de->inode)) {
-				de1 = (struct ext3_dir_entry_2 *) ((char *) de +
-					EXT3_DIR_REC_LEN(de->name_len));
-				de1->rec_len =
-					cpu_to_le16(le16_to_cpu(de->rec_len) -
-					EXT3_DIR_REC_LEN(de->name_len));
-				de->rec_len = cpu_to_le16(
-						EXT3_DIR_REC_LEN(de->name_len));
-				de = de1;
-			}
-			de->file_type = EXT3_FT_UNKNOWN;
-			if (inode) {
-				de->inode = cpu_to_le32(inode->i_ino);
-				ext3_set_de_type(dir->i_sb, de, inode->i_mode);
-			} else
-				de->inode = 0;
-			de->name_len = namelen;
-			memcpy (de->name, name, namelen);
-			/*
-			 * XXX shouldn't update any times until successful
-			 * completion of syscall, but too many callers depend
-			 * on this.
-			 *
-			 * XXX similarly, too many callers depend on
-			 * ext3_new_inode() setting the times, but error
-			 * recovery deletes the inode, so the worst that can
-			 * happen is that the times are slightly out of date
-			 * and/or different from the directory change time.
-			 */
-			dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-			dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
-			dir->i_version = ++event;
-			ext3_mark_inode_dirty(handle, dir);
-			BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
-			ext3_journal_dirty_metadata(handle, bh);
-			brelse(bh);
-			return 0;
-		}
-		offset += le16_to_cpu(de->rec_len);
-		de = (struct ext3_dir_entry_2 *)
-			((char *) de + le16_to_cpu(de->rec_len));
-	}
-	brelse (bh);
-	return -ENOSPC;
+	de->inode = 0;
+	de->rec_len = cpu_to_le16(sb->s_blocksize);
+	return add_dirent_to_buf(handle, dentry, inode, de, bh);
 }
 
 /*
@@ -454,7 +1409,8 @@ static int ext3_create (struct inode * dir, struct dentry * dentry, int mode)
 	struct inode * inode;
 	int err;
 
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS + 3);
+	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 3);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -480,7 +1436,8 @@ static int ext3_mknod (struct inode * dir, struct dentry *dentry,
 	struct inode *inode;
 	int err;
 
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS + 3);
+	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 3);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -508,7 +1465,8 @@ static int ext3_mkdir(struct inode * dir, struct dentry * dentry, int mode)
 	if (dir->i_nlink >= EXT3_LINK_MAX)
 		return -EMLINK;
 
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS + 3);
+	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 3);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -558,7 +1516,7 @@ static int ext3_mkdir(struct inode * dir, struct dentry * dentry, int mode)
 	if (err)
 		goto out_no_entry;
 	dir->i_nlink++;
-	dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+	ext3_update_dx_flag(dir);
 	ext3_mark_inode_dirty(handle, dir);
 	d_instantiate(dentry, inode);
 out_stop:
@@ -833,7 +1791,7 @@ static int ext3_rmdir (struct inode * dir, struct dentry *dentry)
 	dir->i_nlink--;
 	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
 	ext3_mark_inode_dirty(handle, inode);
-	dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+	ext3_update_dx_flag(dir);
 	ext3_mark_inode_dirty(handle, dir);
 
 end_rmdir:
@@ -879,7 +1837,7 @@ static int ext3_unlink(struct inode * dir, struct dentry *dentry)
 	if (retval)
 		goto end_unlink;
 	dir->i_ctime = dir->i_mtime = CURRENT_TIME;
-	dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+	ext3_update_dx_flag(dir);
 	ext3_mark_inode_dirty(handle, dir);
 	inode->i_nlink--;
 	if (!inode->i_nlink)
@@ -905,7 +1863,8 @@ static int ext3_symlink (struct inode * dir,
 	if (l > dir->i_sb->s_blocksize)
 		return -ENAMETOOLONG;
 
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS + 5);
+	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 5);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -959,7 +1918,8 @@ static int ext3_link (struct dentry * old_dentry,
 	if (inode->i_nlink >= EXT3_LINK_MAX)
 		return -EMLINK;
 
-	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS);
+	handle = ext3_journal_start(dir, EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -994,7 +1954,8 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 
 	old_bh = new_bh = dir_bh = NULL;
 
-	handle = ext3_journal_start(old_dir, 2 * EXT3_DATA_TRANS_BLOCKS + 2);
+	handle = ext3_journal_start(old_dir, 2 * EXT3_DATA_TRANS_BLOCKS +
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 2);
 	if (IS_ERR(handle))
 		return PTR_ERR(handle);
 
@@ -1076,7 +2037,7 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 		new_inode->i_ctime = CURRENT_TIME;
 	}
 	old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME;
-	old_dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+	ext3_update_dx_flag(old_dir);
 	if (dir_bh) {
 		BUFFER_TRACE(dir_bh, "get_write_access");
 		ext3_journal_get_write_access(handle, dir_bh);
@@ -1088,7 +2049,7 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 			new_inode->i_nlink--;
 		} else {
 			new_dir->i_nlink++;
-			new_dir->u.ext3_i.i_flags &= ~EXT3_INDEX_FL;
+			ext3_update_dx_flag(new_dir);
 			ext3_mark_inode_dirty(handle, new_dir);
 		}
 	}
@@ -1094,6 +1094,11 @@ struct super_block * ext3_read_super (struct super_block * sb, void * data,
 	sbi->s_mount_state = le16_to_cpu(es->s_state);
 	sbi->s_addr_per_block_bits = log2(EXT3_ADDR_PER_BLOCK(sb));
 	sbi->s_desc_per_block_bits = log2(EXT3_DESC_PER_BLOCK(sb));
+	for (i = 0; i < 4; i++)
+		sbi->s_hash_seed[i] = le32_to_cpu(es->s_hash_seed[i]);
+	sbi->s_def_hash_version = es->s_def_hash_version;
+	if (sbi->s_def_hash_version > DX_HASH_TEA)
+		sbi->s_def_hash_version = DX_HASH_HALF_MD4;
 
 	if (sbi->s_blocks_per_group > blocksize * 8) {
 		printk (KERN_ERR
@@ -12,6 +12,7 @@
 #include <linux/module.h>
 #include <linux/smp_lock.h>
 #include <linux/iobuf.h>
+#include <linux/eventpoll.h>
 
 /* sysctl tunables... */
 struct files_stat_struct files_stat = {0, 0, NR_FILE};
@@ -47,6 +48,7 @@ struct file * get_empty_filp(void)
 		f->f_uid = current->fsuid;
 		f->f_gid = current->fsgid;
 		f->f_maxcount = INT_MAX;
+		eventpoll_init_file(f);
 		list_add(&f->f_list, &anon_list);
 		file_list_unlock();
 		return f;
@@ -93,6 +95,7 @@ int init_private_file(struct file *filp, struct dentry *dentry, int mode)
 	filp->f_gid    = current->fsgid;
 	filp->f_op     = dentry->d_inode->i_fop;
 	filp->f_maxcount = INT_MAX;
+	eventpoll_init_file(filp);
 
 	if (filp->f_op->open)
 		return filp->f_op->open(dentry->d_inode, filp);
@@ -107,6 +110,11 @@ void fastcall fput(struct file * file)
 	struct inode * inode = dentry->d_inode;
 
 	if (atomic_dec_and_test(&file->f_count)) {
+		/*
+		 * Unhook the file from any epoll sets before the
+		 * ->release() method can tear down its wait queues.
+		 */
+		eventpoll_release(file);
 		locks_remove_flock(file);
 
 		if (file->f_iobuf)
@@ -31,58 +31,30 @@ static int kiobuf_init(struct kiobuf *iobuf)
 	iobuf->array_len = 0;
 	iobuf->nr_pages = 0;
 	iobuf->locked = 0;
-	iobuf->bh = NULL;
+	iobuf->async = 0;
 	iobuf->blocks = NULL;
 	atomic_set(&iobuf->io_count, 0);
 	iobuf->end_io = NULL;
+	iobuf->private = NULL;
 	return expand_kiobuf(iobuf, KIO_STATIC_PAGES);
 }
 
+/*
+ * Only the block list is preallocated nowadays: brw_kiovec() builds
+ * its bios as it goes.
+ */
 int alloc_kiobuf_bhs(struct kiobuf * kiobuf)
 {
-	int i;
-
 	kiobuf->blocks =
 		kmalloc(sizeof(*kiobuf->blocks) * KIO_MAX_SECTORS, GFP_KERNEL);
 	if (unlikely(!kiobuf->blocks))
-		goto nomem;
-	kiobuf->bh =
-		kmalloc(sizeof(*kiobuf->bh) * KIO_MAX_SECTORS, GFP_KERNEL);
-	if (unlikely(!kiobuf->bh))
-		goto nomem;
-
-	for (i = 0; i < KIO_MAX_SECTORS; i++) {
-		kiobuf->bh[i] = kmem_cache_alloc(bh_cachep, GFP_KERNEL);
-		if (unlikely(!kiobuf->bh[i]))
-			goto nomem2;
-	}
+		return -ENOMEM;
 
 	return 0;
-
-nomem2:
-	while (i--) {
-		kmem_cache_free(bh_cachep, kiobuf->bh[i]);
-		kiobuf->bh[i] = NULL;
-	}
-	memset(kiobuf->bh, 0, sizeof(*kiobuf->bh) * KIO_MAX_SECTORS);
-
-nomem:
-	free_kiobuf_bhs(kiobuf);
-	return -ENOMEM;
 }
 
 void free_kiobuf_bhs(struct kiobuf * kiobuf)
 {
-	int i;
-
-	if (kiobuf->bh) {
-		for (i = 0; i < KIO_MAX_SECTORS; i++)
-			if (kiobuf->bh[i])
-				kmem_cache_free(bh_cachep, kiobuf->bh[i]);
-		kfree(kiobuf->bh);
-		kiobuf->bh = NULL;
-	}
-
 	if (kiobuf->blocks) {
 		kfree(kiobuf->blocks);
 		kiobuf->blocks = NULL;
@@ -24,12 +24,10 @@
 #include <linux/slab.h>
 #include <linux/locks.h>
 
-extern spinlock_t journal_datalist_lock;
-
 /*
  * Unlink a buffer from a transaction. 
  *
- * Called with journal_datalist_lock held.
+ * Called with j_list_lock held.
  */
 
 static inline void __buffer_unlink(struct journal_head *jh)
@@ -50,17 +48,20 @@ static inline void __buffer_unlink(struct journal_head *jh)
 /*
  * Try to release a checkpointed buffer from its transaction.
  * Returns 1 if we released it.
- * Requires journal_datalist_lock
+ * Requires j_list_lock.  The buffer's state lock ranks outside that,
+ * so we only trylock it: a busy buffer is simply left for next time.
  */
 static int __try_to_free_cp_buf(struct journal_head *jh)
 {
 	int ret = 0;
 	struct buffer_head *bh = jh2bh(jh);
 
-	if (jh->b_jlist == BJ_None && !buffer_locked(bh) && !buffer_dirty(bh)) {
+	if (jh->b_jlist == BJ_None && !buffer_locked(bh) &&
+	    !buffer_dirty(bh) && jbd_trylock_bh_state(bh)) {
 		JBUFFER_TRACE(jh, "remove from checkpoint list");
 		__journal_remove_checkpoint(jh);
-		__journal_remove_journal_head(bh);
+		journal_remove_journal_head(bh);
+		jbd_unlock_bh_state(bh);
 		BUFFER_TRACE(bh, "release");
 		/* BUF_LOCKED -> BUF_CLEAN (fwiw) */
 		refile_buffer(bh);
@@ -73,28 +74,49 @@ static int __try_to_free_cp_buf(struct journal_head *jh)
 /*
  * log_wait_for_space: wait until there is space in the journal.
  *
- * Called with the journal already locked, but it will be unlocked if we have
- * to wait for a checkpoint to free up some space in the log.
+ * Called with j_state_lock held, and returns with it held; it is dropped
+ * if we have to wait for a checkpoint to free up some space in the log.
  */
 
 void log_wait_for_space(journal_t *journal, int nblocks)
 {
+	assert_spin_locked(&journal->j_state_lock);
+
 	while (log_space_left(journal) < nblocks) {
 		if (journal->j_flags & JFS_ABORT)
 			return;
-		unlock_journal(journal);
+		spin_unlock(&journal->j_state_lock);
 		down(&journal->j_checkpoint_sem);
-		lock_journal(journal);
-		
+
 		/* Test again, another process may have checkpointed
 		 * while we were waiting for the checkpoint lock */
+		spin_lock(&journal->j_state_lock);
 		if (log_space_left(journal) < nblocks) {
+			spin_unlock(&journal->j_state_lock);
 			log_do_checkpoint(journal, nblocks);
+			spin_lock(&journal->j_state_lock);
 		}
+		spin_unlock(&journal->j_state_lock);
 		up(&journal->j_checkpoint_sem);
+		spin_lock(&journal->j_state_lock);
 	}
 }
 
+/*
+ * We were unable to get a buffer's state lock while walking a checkpoint
+ * list under j_list_lock.  Pin the buffer, drop the list lock and wait
+ * for whoever holds the state lock to let go of it.  Returns with
+ * j_list_lock dropped.
+ */
+static void jbd_sync_bh(journal_t *journal, struct buffer_head *bh)
+{
+	atomic_inc(&bh->b_count);
+	spin_unlock(&journal->j_list_lock);
+	jbd_lock_bh_state(bh);
+	jbd_unlock_bh_state(bh);
+	__brelse(bh);
+}
+
 /*
  * Clean up a transaction's checkpoint list.  
  *
@@ -105,8 +127,8 @@ void log_wait_for_space(journal_t *journal, int nblocks)
  * checkpoint.  (journal_remove_checkpoint() deletes the transaction when
  * the last checkpoint buffer is cleansed)
  *
- * Called with the journal locked.
- * Called with journal_datalist_lock held.
+ * Called with j_checkpoint_sem and j_list_lock held.  The list lock is
+ * dropped and retaken whenever we return 1.
  */
 static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 {
@@ -114,7 +136,7 @@ static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 	struct buffer_head *bh;
 	int ret = 0;
 
-	assert_spin_locked(&journal_datalist_lock);
+	assert_spin_locked(&journal->j_list_lock);
 	jh = transaction->t_checkpoint_list;
 	if (!jh)
 		return 0;
@@ -126,8 +148,7 @@ static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 		bh = jh2bh(jh);
 		if (buffer_locked(bh)) {
 			atomic_inc(&bh->b_count);
-			spin_unlock(&journal_datalist_lock);
-			unlock_journal(journal);
+			spin_unlock(&journal->j_list_lock);
 			wait_on_buffer(bh);
 			/* the journal_head may have gone by now */
 			BUFFER_TRACE(bh, "brelse");
@@ -139,9 +160,10 @@ static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 			transaction_t *transaction = jh->b_transaction;
 			tid_t tid = transaction->t_tid;
 
-			spin_unlock(&journal_datalist_lock);
-			log_start_commit(journal, transaction);
-			unlock_journal(journal);
+			spin_unlock(&journal->j_list_lock);
+			spin_lock(&journal->j_state_lock);
+			__log_start_commit(journal, tid);
+			spin_unlock(&journal->j_state_lock);
 			log_wait_commit(journal, tid);
 			goto out_return_1;
 		}
@@ -158,9 +180,14 @@ static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 		 */
 		next_jh = jh->b_cpnext;
 		if (!buffer_dirty(bh) && !buffer_jdirty(bh)) {
+			if (!jbd_trylock_bh_state(bh)) {
+				jbd_sync_bh(journal, bh);
+				goto out_return_1;
+			}
 			BUFFER_TRACE(bh, "remove from checkpoint");
 			__journal_remove_checkpoint(jh);
-			__journal_remove_journal_head(bh);
+			journal_remove_journal_head(bh);
+			jbd_unlock_bh_state(bh);
 			refile_buffer(bh);
 			__brelse(bh);
 			ret = 1;
@@ -171,21 +198,21 @@ static int __cleanup_transaction(journal_t *journal, transaction_t *transaction)
 
 	return ret;
 out_return_1:
-	lock_journal(journal);
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 	return 1;
 }
 
 #define NR_BATCH	64
 
-static void __flush_batch(struct buffer_head **bhs, int *batch_count)
+static void __flush_batch(journal_t *journal, struct buffer_head **bhs,
+			  int *batch_count)
 {
 	int i;
 
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 	ll_rw_block(WRITE, *batch_count, bhs);
 	run_task_queue(&tq_disk);
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 	for (i = 0; i < *batch_count; i++) {
 		struct buffer_head *bh = bhs[i];
 		clear_bit(BH_JWrite, &bh->b_state);
@@ -201,7 +228,7 @@ static void __flush_batch(struct buffer_head **bhs, int *batch_count)
  * Return 1 if something happened which requires us to abort the current
  * scan of the checkpoint list.  
  *
- * Called with journal_datalist_lock held.
+ * Called with j_list_lock held.
  */
 static int __flush_buffer(journal_t *journal, struct journal_head *jh,
 			struct buffer_head **bhs, int *batch_count,
@@ -215,7 +242,7 @@ static int __flush_buffer(journal_t *journal, struct journal_head *jh,
 		
 		/*
 		 * Important: we are about to write the buffer, and
-		 * possibly block, while still holding the journal lock.
+		 * possibly block, while still holding j_checkpoint_sem.
 		 * We cannot afford to let the transaction logic start
 		 * messing around with this buffer before we write it to
 		 * disk, as that would break recoverability.  
@@ -227,7 +254,7 @@ static int __flush_buffer(journal_t *journal, struct journal_head *jh,
 		bhs[*batch_count] = bh;
 		(*batch_count)++;
 		if (*batch_count == NR_BATCH) {
-			__flush_batch(bhs, batch_count);
+			__flush_batch(journal, bhs, batch_count);
 			ret = 1;
 		}
 	} else {
@@ -257,7 +284,7 @@ static int __flush_buffer(journal_t *journal, struct journal_head *jh,
  * the IO has been queued, we can return as soon as enough of it has
  * completed to disk.  
  *
- * The journal should be locked before calling this function.
+ * Called with j_checkpoint_sem held and no spinlocks.
  */
 
 /* @@@ `nblocks' is unused.  Should it be used? */
@@ -291,7 +318,7 @@ int log_do_checkpoint (journal_t *journal, int nblocks)
 	 */
 	target = (journal->j_last - journal->j_first) / 4;
 
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 repeat:
 	transaction = journal->j_checkpoint_transactions;
 	if (transaction == NULL)
@@ -316,7 +343,7 @@ repeat:
 						&drop_count);
 		} while (jh != last_jh && !retry);
 		if (batch_count) {
-			__flush_batch(bhs, &batch_count);
+			__flush_batch(journal, bhs, &batch_count);
 			goto repeat;
 		}
 		if (retry)
@@ -332,7 +359,7 @@ repeat:
 	} while (transaction != last_transaction);
 
 done:
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 	result = cleanup_journal_tail(journal);
 	if (result < 0)
 		return result;
@@ -348,7 +375,7 @@ done:
  * 
  * Return <0 on error, 0 on success, 1 if there was nothing to clean up.
  * 
- * Called with the journal lock held.
+ * Takes j_state_lock and j_list_lock itself.
  *
  * This is the only part of the journaling code which really needs to be
  * aware of transaction aborts.  Checkpointing involves writing to the
@@ -370,8 +397,10 @@ int cleanup_journal_tail(journal_t *journal)
 	 * next transaction ID we will write, and where it will
 	 * start. */
 
-	/* j_checkpoint_transactions needs locking */
-	spin_lock(&journal_datalist_lock);
+	/* j_checkpoint_transactions needs j_list_lock, the others
+	 * j_state_lock */
+	spin_lock(&journal->j_state_lock);
+	spin_lock(&journal->j_list_lock);
 	transaction = journal->j_checkpoint_transactions;
 	if (transaction) {
 		first_tid = transaction->t_tid;
@@ -386,13 +415,15 @@ int cleanup_journal_tail(journal_t *journal)
 		first_tid = journal->j_transaction_sequence;
 		blocknr = journal->j_head;
 	}
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 	J_ASSERT (blocknr != 0);
 
 	/* If the oldest pinned transaction is at the tail of the log
            already then there's not much we can do right now. */
-	if (journal->j_tail_sequence == first_tid)
+	if (journal->j_tail_sequence == first_tid) {
+		spin_unlock(&journal->j_state_lock);
 		return 1;
+	}
 
 	/* OK, update the superblock to recover the freed space.
 	 * Physical blocks come first: have we wrapped beyond the end of
@@ -409,6 +440,7 @@ int cleanup_journal_tail(journal_t *journal)
 	journal->j_free += freed;
 	journal->j_tail_sequence = first_tid;
 	journal->j_tail = blocknr;
+	spin_unlock(&journal->j_state_lock);
 	if (!(journal->j_flags & JFS_ABORT))
 		journal_update_superblock(journal, 1);
 	return 0;
@@ -422,8 +454,7 @@ int cleanup_journal_tail(journal_t *journal)
  *
  * Find all the written-back checkpoint buffers in the journal and release them.
  *
- * Called with the journal locked.
- * Called with journal_datalist_lock held.
+ * Called with j_list_lock held.
  * Returns number of bufers reaped (for debug)
  */
 
@@ -471,8 +502,7 @@ out:
  * called to remove the buffer from the existing transaction's
  * checkpoint list.  
  *
- * This function is called with the journal locked.
- * This function is called with journal_datalist_lock held.
+ * This function is called with j_list_lock held.
  */
 
 void __journal_remove_checkpoint(struct journal_head *jh)
@@ -519,9 +549,11 @@ out:
 
 void journal_remove_checkpoint(struct journal_head *jh)
 {
-	spin_lock(&journal_datalist_lock);
+	journal_t *journal = jh->b_cp_transaction->t_journal;
+
+	spin_lock(&journal->j_list_lock);
 	__journal_remove_checkpoint(jh);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 }
 
 /*
@@ -529,8 +561,7 @@ void journal_remove_checkpoint(struct journal_head *jh)
  * list so that we know when it is safe to clean the transaction out of
  * the log.
  *
- * Called with the journal locked.
- * Called with journal_datalist_lock held.
+ * Called with j_list_lock held.
  */
 void __journal_insert_checkpoint(struct journal_head *jh, 
 			       transaction_t *transaction)
@@ -539,7 +570,7 @@ void __journal_insert_checkpoint(struct journal_head *jh,
 	J_ASSERT_JH(jh, buffer_dirty(jh2bh(jh)) || buffer_jdirty(jh2bh(jh)));
 	J_ASSERT_JH(jh, jh->b_cp_transaction == NULL);
 
-	assert_spin_locked(&journal_datalist_lock);
+	assert_spin_locked(&transaction->t_journal->j_list_lock);
 	jh->b_cp_transaction = transaction;
 
 	if (!transaction->t_checkpoint_list) {
@@ -556,9 +587,9 @@ void __journal_insert_checkpoint(struct journal_head *jh,
 void journal_insert_checkpoint(struct journal_head *jh, 
 			       transaction_t *transaction)
 {
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&transaction->t_journal->j_list_lock);
 	__journal_insert_checkpoint(jh, transaction);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&transaction->t_journal->j_list_lock);
 }
 
 /*
@@ -567,13 +598,12 @@ void journal_insert_checkpoint(struct journal_head *jh,
  * The transaction must have no links except for the checkpoint by this
  * point.
  *
- * Called with the journal locked.
- * Called with journal_datalist_lock held.
+ * Called with j_list_lock held.
  */
 
 void __journal_drop_transaction(journal_t *journal, transaction_t *transaction)
 {
-	assert_spin_locked(&journal_datalist_lock);
+	assert_spin_locked(&journal->j_list_lock);
 	if (transaction->t_cpnext) {
 		transaction->t_cpnext->t_cpprev = transaction->t_cpprev;
 		transaction->t_cpprev->t_cpnext = transaction->t_cpnext;
@@ -21,9 +21,6 @@
 #include <linux/locks.h>
 #include <linux/mm.h>
 #include <linux/pagemap.h>
-#include <linux/smp_lock.h>
-
-extern spinlock_t journal_datalist_lock;
 
 /*
  * Default IO end handler for temporary BJ_IO buffer_heads.
@@ -46,8 +43,8 @@ void journal_end_buffer_io_sync(struct buffer_head *bh, int uptodate)
  * So here, we have a buffer which has just come off the forget list.  Look to
  * see if we can strip all buffers from the backing page.
  *
- * Called under lock_journal(), and possibly under journal_datalist_lock.  The
- * caller provided us with a ref against the buffer, and we drop that here.
+ * Called from the commit thread, possibly under j_list_lock.  The caller
+ * provided us with a ref against the buffer, and we drop that here.
  */
 static void release_buffer_page(struct buffer_head *bh)
 {
@@ -78,11 +75,34 @@ nope:
 	__brelse(bh);
 }
 
+/*
+ * Take jbd_lock_bh_state() on a buffer found on one of the committing
+ * transaction's lists.  We find it with j_list_lock held, but the bit
+ * lock ranks outside j_list_lock, so we can only trylock it.  If that
+ * fails we pin the buffer, drop the list lock and wait for the holder
+ * to finish.  Returns zero in that case, with j_list_lock retaken but
+ * without the bit lock: the caller must look at its list again.
+ */
+static int commit_lock_bh_state(journal_t *journal, struct buffer_head *bh)
+{
+	if (jbd_trylock_bh_state(bh))
+		return 1;
+
+	atomic_inc(&bh->b_count);
+	spin_unlock(&journal->j_list_lock);
+	jbd_lock_bh_state(bh);
+	jbd_unlock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
+	__brelse(bh);
+	return 0;
+}
+
 /*
  * journal_commit_transaction
  *
  * The primary function for committing a transaction to the log.  This
  * function is called by the journal thread to begin a complete commit.
+ * It is called with no locks held, and does not need the BKL.
  */
 void journal_commit_transaction(journal_t *journal)
 {
@@ -94,6 +114,8 @@ void journal_commit_transaction(journal_t *journal)
 	int flags;
 	int err;
 	unsigned long blocknr;
+	unsigned long commit_start = jiffies, commit_time;
+	unsigned long nr_logged = 0;
 	char *tagp = NULL;
 	journal_header_t *header;
 	journal_block_tag_t *tag = NULL;
@@ -107,15 +129,13 @@ void journal_commit_transaction(journal_t *journal)
 	 * all outstanding updates to complete.
 	 */
 
-	lock_journal(journal); /* Protect journal->j_running_transaction */
-
 #ifdef COMMIT_STATS
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 	summarise_journal_usage(journal);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 #endif
 
-	lock_kernel();
+	spin_lock(&journal->j_state_lock);
 	
 	J_ASSERT (journal->j_running_transaction != NULL);
 	J_ASSERT (journal->j_committing_transaction == NULL);
@@ -127,14 +147,20 @@ void journal_commit_transaction(journal_t *journal)
 		   commit_transaction->t_tid);
 
 	commit_transaction->t_state = T_LOCKED;
+
+	spin_lock(&commit_transaction->t_handle_lock);
 	while (commit_transaction->t_updates != 0) {
-		unlock_journal(journal);
-		sleep_on(&journal->j_wait_updates);
-		lock_journal(journal);
+		spin_unlock(&journal->j_state_lock);
+		jbd_sleep_on_unlock(&journal->j_wait_updates,
+				    &commit_transaction->t_handle_lock);
+		spin_lock(&journal->j_state_lock);
+		spin_lock(&commit_transaction->t_handle_lock);
 	}
+	spin_unlock(&commit_transaction->t_handle_lock);
 
 	J_ASSERT (commit_transaction->t_outstanding_credits <=
 			journal->j_max_transaction_buffers);
+	spin_unlock(&journal->j_state_lock);
 
 	/* Do we need to erase the effects of a prior journal_flush? */
 	if (journal->j_flags & JFS_FLUSHED) {
@@ -161,10 +187,19 @@ void journal_commit_transaction(journal_t *journal)
 	 * buffer are perfectly permissable.
 	 */
 
+	spin_lock(&journal->j_list_lock);
 	while (commit_transaction->t_reserved_list) {
+		struct buffer_head *bh;
+
 		jh = commit_transaction->t_reserved_list;
+		bh = jh2bh(jh);
+		if (!commit_lock_bh_state(journal, bh))
+			continue;
 		JBUFFER_TRACE(jh, "reserved, unused: refile");
-		journal_refile_buffer(jh);
+		__journal_refile_buffer(jh);
+		journal_remove_journal_head(bh);
+		jbd_unlock_bh_state(bh);
+		__brelse(bh);
 	}
 
 	/*
@@ -172,9 +207,8 @@ void journal_commit_transaction(journal_t *journal)
 	 * checkpoint lists.  We do this *before* commit because it potentially
 	 * frees some memory
 	 */
-	spin_lock(&journal_datalist_lock);
 	__journal_clean_checkpoint_list(journal);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 
 	/* First part of the commit: force the revoke list out to disk.
 	 * The revoke code generates its own metadata blocks on disk for this.
@@ -198,16 +232,16 @@ void journal_commit_transaction(journal_t *journal)
 	 * get a new running transaction for incoming filesystem updates
 	 */
 
+	spin_lock(&journal->j_state_lock);
 	commit_transaction->t_state = T_FLUSH;
 
-	wake_up(&journal->j_wait_transaction_locked);
-
 	journal->j_committing_transaction = commit_transaction;
 	journal->j_running_transaction = NULL;
 
 	commit_transaction->t_log_start = journal->j_head;
 
-	unlock_kernel();
+	wake_up(&journal->j_wait_transaction_locked);
+	spin_unlock(&journal->j_state_lock);
 	
 	jbd_debug (3, "JBD: commit phase 2\n");
 
@@ -217,7 +251,7 @@ void journal_commit_transaction(journal_t *journal)
 	 */
 
 	/*
-	 * Whenever we unlock the journal and sleep, things can get added
+	 * Whenever we drop j_list_lock and sleep, things can get added
 	 * onto ->t_datalist, so we have to keep looping back to write_out_data
 	 * until we *know* that the list is empty.
 	 */
@@ -227,10 +261,10 @@ write_out_data:
 	 * Cleanup any flushed data buffers from the data list.  Even in
 	 * abort mode, we want to flush this out as soon as possible.
 	 *
-	 * We take journal_datalist_lock to protect the lists from
+	 * We take j_list_lock to protect the lists from
 	 * journal_try_to_free_buffers().
 	 */
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 
 write_out_data_locked:
 	bufs = 0;
@@ -250,14 +284,17 @@ write_out_data_locked:
 				BUFFER_TRACE(bh, "start journal writeout");
 				atomic_inc(&bh->b_count);
 				wbuf[bufs++] = bh;
-			} else {
+			} else if (jbd_trylock_bh_state(bh)) {
 				BUFFER_TRACE(bh, "writeout complete: unfile");
 				__journal_unfile_buffer(jh);
 				jh->b_transaction = NULL;
-				__journal_remove_journal_head(bh);
+				journal_remove_journal_head(bh);
+				jbd_unlock_bh_state(bh);
 				refile_buffer(bh);
 				release_buffer_page(bh);
 			}
+			/* else someone else is looking at it: we will
+			 * come back for it on a later pass */
 		}
 		if (bufs == ARRAY_SIZE(wbuf)) {
 			/*
@@ -271,15 +308,13 @@ write_out_data_locked:
 
 	if (bufs || current->need_resched) {
 		jbd_debug(2, "submit %d writes\n", bufs);
-		spin_unlock(&journal_datalist_lock);
-		unlock_journal(journal);
+		spin_unlock(&journal->j_list_lock);
 		if (bufs)
 			ll_rw_block(WRITE, bufs, wbuf);
 		if (current->need_resched)
 			schedule();
 		journal_brelse_array(wbuf, bufs);
-		lock_journal(journal);
-		spin_lock(&journal_datalist_lock);
+		spin_lock(&journal->j_list_lock);
 		if (bufs)
 			goto write_out_data_locked;
 	}
@@ -296,17 +331,21 @@ write_out_data_locked:
 		jh = jh->b_tprev;	/* Wait on the last written */
 		bh = jh2bh(jh);
 		if (buffer_locked(bh)) {
-			spin_unlock(&journal_datalist_lock);
-			unlock_journal(journal);
+			atomic_inc(&bh->b_count);
+			spin_unlock(&journal->j_list_lock);
 			wait_on_buffer(bh);
 			/* the journal_head may have been removed now */
-			lock_journal(journal);
+			__brelse(bh);
 			goto write_out_data;
 		} else if (buffer_dirty(bh)) {
 			goto write_out_data_locked;
 		}
 	} while (jh != commit_transaction->t_sync_datalist);
-	goto write_out_data_locked;
+
+	/* Whatever is left was skipped because its bh_state lock was
+	 * busy: let the holder have j_list_lock before trying again. */
+	spin_unlock(&journal->j_list_lock);
+	goto write_out_data;
 
 sync_datalist_empty:
 	/*
@@ -323,24 +362,28 @@ sync_datalist_empty:
 			clear_bit(BH_Dirty, &bh->b_state);
 		}
 		if (buffer_locked(bh)) {
-			spin_unlock(&journal_datalist_lock);
-			unlock_journal(journal);
+			atomic_inc(&bh->b_count);
+			spin_unlock(&journal->j_list_lock);
 			wait_on_buffer(bh);
-			lock_journal(journal);
-			spin_lock(&journal_datalist_lock);
+			__brelse(bh);
+			spin_lock(&journal->j_list_lock);
 			continue;	/* List may have changed */
 		}
+		if (!commit_lock_bh_state(journal, bh))
+			continue;	/* List may have changed */
 		if (jh->b_next_transaction) {
 			/*
 			 * For writepage() buffers in journalled data mode: a
 			 * later transaction may want the buffer for "metadata"
 			 */
 			__journal_refile_buffer(jh);
+			jbd_unlock_bh_state(bh);
 		} else {
 			BUFFER_TRACE(bh, "finished async writeout: unfile");
 			__journal_unfile_buffer(jh);
 			jh->b_transaction = NULL;
-			__journal_remove_journal_head(bh);
+			journal_remove_journal_head(bh);
+			jbd_unlock_bh_state(bh);
 			BUFFER_TRACE(bh, "finished async writeout: refile");
 			/* It can sometimes be on BUF_LOCKED due to migration
 			 * from syncdata to asyncdata */
@@ -349,7 +392,7 @@ sync_datalist_empty:
 			__brelse(bh);
 		}
 	}
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 
 	/*
 	 * If we found any dirty or locked buffers, then we should have
@@ -367,7 +410,9 @@ sync_datalist_empty:
 	 * transaction!  Now comes the tricky part: we need to write out
 	 * metadata.  Loop over the transaction's entire buffer list:
 	 */
+	spin_lock(&journal->j_state_lock);
 	commit_transaction->t_state = T_COMMIT;
+	spin_unlock(&journal->j_state_lock);
 
 	descriptor = 0;
 	bufs = 0;
@@ -382,7 +427,7 @@ sync_datalist_empty:
 
 		if (is_journal_aborted(journal)) {
 			JBUFFER_TRACE(jh, "journal is aborting: refile");
-			journal_refile_buffer(jh);
+			journal_refile_buffer(journal, jh);
 			/* If that was the last one, we need to clean up
 			 * any descriptor buffers which may have been
 			 * already allocated, even if we are now
@@ -462,6 +507,7 @@ sync_datalist_empty:
 		set_bit(BH_JWrite, &jh2bh(new_jh)->b_state);
 		set_bit(BH_Lock, &jh2bh(new_jh)->b_state);
 		wbuf[bufs++] = jh2bh(new_jh);
+		nr_logged++;
 
 		/* Record the new block's tag in the current descriptor
                    buffer */
@@ -501,7 +547,6 @@ sync_datalist_empty:
 			tag->t_flags |= htonl(JFS_FLAG_LAST_TAG);
 
 start_journal_io:
-			unlock_journal(journal);
 			for (i=0; i<bufs; i++) {
 				struct buffer_head *bh = wbuf[i];
 				clear_bit(BH_Dirty, &bh->b_state);
@@ -510,7 +555,6 @@ start_journal_io:
 			}
 			if (current->need_resched)
 				schedule();
-			lock_journal(journal);
 
 			/* Force a new descriptor to be generated next
                            time round the loop. */
@@ -532,23 +576,24 @@ start_journal_io:
 
 	jbd_debug(3, "JBD: commit phase 4\n");
 
-	/* akpm: these are BJ_IO, and journal_datalist_lock is not needed */
+	/*
+	 * akpm: these are BJ_IO, and nobody else looks at the iobuf or
+	 * shadow lists, so we can walk them without j_list_lock
+	 */
  wait_for_iobuf:
 	while (commit_transaction->t_iobuf_list != NULL) {
 		struct buffer_head *bh;
 		jh = commit_transaction->t_iobuf_list->b_tprev;
 		bh = jh2bh(jh);
 		if (buffer_locked(bh)) {
-			unlock_journal(journal);
 			wait_on_buffer(bh);
-			lock_journal(journal);
 			goto wait_for_iobuf;
 		}
 
 		clear_bit(BH_JWrite, &jh2bh(jh)->b_state);
 
 		JBUFFER_TRACE(jh, "ph4: unfile after journal write");
-		journal_unfile_buffer(jh);
+		journal_unfile_buffer(journal, jh);
 
 		/*
 		 * akpm: don't put back a buffer_head with stale pointers
@@ -600,15 +645,13 @@ start_journal_io:
 		jh = commit_transaction->t_log_list->b_tprev;
 		bh = jh2bh(jh);
 		if (buffer_locked(bh)) {
-			unlock_journal(journal);
 			wait_on_buffer(bh);
-			lock_journal(journal);
 			goto wait_for_ctlbuf;
 		}
 
 		BUFFER_TRACE(bh, "ph5: control buffer writeout done: unfile");
 		clear_bit(BH_JWrite, &bh->b_state);
-		journal_unfile_buffer(jh);
+		journal_unfile_buffer(journal, jh);
 		jh->b_transaction = NULL;
 		journal_unlock_journal_head(jh);
 		put_bh(bh);			/* One for getblk */
@@ -616,10 +659,8 @@ start_journal_io:
 
 	jbd_debug(3, "JBD: commit phase 6\n");
 
-	if (is_journal_aborted(journal)) {
-		unlock_journal(journal);
+	if (is_journal_aborted(journal))
 		goto skip_commit;
-	}
 
 	/* Done it all: now write the commit record.  We should have
 	 * cleaned up our previous buffers by now, so if we are in abort
@@ -629,7 +670,6 @@ start_journal_io:
 	descriptor = journal_get_descriptor_buffer(journal);
 	if (!descriptor) {
 		__journal_abort_hard(journal);
-		unlock_journal(journal);
 		goto skip_commit;
 	}
 
@@ -642,7 +682,6 @@ start_journal_io:
 		tmp->h_sequence = htonl(commit_transaction->t_tid);
 	}
 
-	unlock_journal(journal);
 	JBUFFER_TRACE(descriptor, "write commit block");
 	{
 		struct buffer_head *bh = jh2bh(descriptor);
@@ -659,7 +698,7 @@ start_journal_io:
            transaction can be removed from any checkpoint list it was on
            before. */
 
-skip_commit: /* The journal should be unlocked by now. */
+skip_commit:
 
 	/* Call any callbacks that had been registered for handles in this
 	 * transaction.  It is up to the callback to free any allocated
@@ -678,8 +717,6 @@ skip_commit: /* The journal should be unlocked by now. */
 		}
 	}
 
-	lock_journal(journal);
-
 	jbd_debug(3, "JBD: commit phase 7\n");
 
 	J_ASSERT(commit_transaction->t_sync_datalist == NULL);
@@ -690,12 +727,22 @@ skip_commit: /* The journal should be unlocked by now. */
 	J_ASSERT(commit_transaction->t_shadow_list == NULL);
 	J_ASSERT(commit_transaction->t_log_list == NULL);
 
+restart_loop:
+	/*
+	 * journal_unmap_buffer() can still hand buffers to the
+	 * committing transaction's forget list, so walk it under
+	 * j_list_lock until it stays empty.
+	 */
+	spin_lock(&journal->j_list_lock);
 	while (commit_transaction->t_forget) {
 		transaction_t *cp_transaction;
 		struct buffer_head *bh;
 		int was_freed = 0;
 		
 		jh = commit_transaction->t_forget;
+		bh = jh2bh(jh);
+		if (!commit_lock_bh_state(journal, bh))
+			continue;
 		J_ASSERT_JH(jh,	jh->b_transaction == commit_transaction ||
 			jh->b_transaction == journal->j_running_transaction);
 
@@ -721,7 +768,6 @@ skip_commit: /* The journal should be unlocked by now. */
 			jh->b_frozen_data = NULL;
 		}
 
-		spin_lock(&journal_datalist_lock);
 		cp_transaction = jh->b_cp_transaction;
 		if (cp_transaction) {
 			JBUFFER_TRACE(jh, "remove from old cp transaction");
@@ -734,7 +780,6 @@ skip_commit: /* The journal should be unlocked by now. */
 		 * by journal_forget, it may no longer be dirty and
 		 * there's no point in keeping a checkpoint record for
 		 * it. */
-		bh = jh2bh(jh);
 
 		/* A buffer which has been freed while still being
 		 * journaled by a previous transaction may end up still
@@ -755,26 +800,41 @@ skip_commit: /* The journal should be unlocked by now. */
 			__journal_insert_checkpoint(jh, commit_transaction);
 			JBUFFER_TRACE(jh, "refile for checkpoint writeback");
 			__journal_refile_buffer(jh);
+			jbd_unlock_bh_state(bh);
 		} else {
 			J_ASSERT_BH(bh, !buffer_dirty(bh));
 			J_ASSERT_JH(jh, jh->b_next_transaction == NULL);
 			__journal_unfile_buffer(jh);
 			jh->b_transaction = 0;
-			__journal_remove_journal_head(bh);
-			spin_unlock(&journal_datalist_lock);
+			journal_remove_journal_head(bh);
+			jbd_unlock_bh_state(bh);
+			spin_unlock(&journal->j_list_lock);
 			if (was_freed)
 				release_buffer_page(bh);
 			else
 				__brelse(bh);
-			continue;
+			spin_lock(&journal->j_list_lock);
 		}
-		spin_unlock(&journal_datalist_lock);
 	}
+	spin_unlock(&journal->j_list_lock);
 
 	/* Done with this transaction! */
 
 	jbd_debug(3, "JBD: commit phase 8\n");
 
+	spin_lock(&journal->j_state_lock);
+	spin_lock(&journal->j_list_lock);
+	/*
+	 * journal_unmap_buffer() may have put another buffer on
+	 * t_forget since we last looked.  Once j_committing_transaction
+	 * is cleared under j_state_lock nobody else can, so recheck here.
+	 */
+	if (commit_transaction->t_forget) {
+		spin_unlock(&journal->j_list_lock);
+		spin_unlock(&journal->j_state_lock);
+		goto restart_loop;
+	}
+
 	J_ASSERT (commit_transaction->t_state == T_COMMIT);
 	commit_transaction->t_state = T_FINISHED;
 
@@ -782,7 +842,13 @@ skip_commit: /* The journal should be unlocked by now. */
 	journal->j_commit_sequence = commit_transaction->t_tid;
 	journal->j_committing_transaction = NULL;
 
-	spin_lock(&journal_datalist_lock);
+	commit_time = jiffies - commit_start;
+	journal->j_stats.js_commits++;
+	journal->j_stats.js_commit_time += commit_time;
+	if (commit_time > journal->j_stats.js_commit_time_max)
+		journal->j_stats.js_commit_time_max = commit_time;
+	journal->j_stats.js_commit_blocks += nr_logged;
+
 	if (commit_transaction->t_checkpoint_list == NULL) {
 		__journal_drop_transaction(journal, commit_transaction);
 	} else {
@@ -801,11 +867,11 @@ skip_commit: /* The journal should be unlocked by now. */
 				commit_transaction;
 		}
 	}
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
 
 	jbd_debug(1, "JBD: commit %d complete, head %d\n",
 		  journal->j_commit_sequence, journal->j_tail_sequence);
 
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
 	wake_up(&journal->j_wait_done_commit);
 }
@@ -33,6 +33,7 @@
 #include <linux/sched.h>
 #include <linux/init.h>
 #include <linux/mm.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h>
 #include <linux/proc_fs.h>
 
@@ -86,74 +87,18 @@ EXPORT_SYMBOL(journal_force_commit);
 static int journal_convert_superblock_v1(journal_t *, journal_superblock_t *);
 
 /*
- * journal_datalist_lock is used to protect data buffers:
- *
- *	bh->b_transaction
- *	bh->b_tprev
- *	bh->b_tnext
- *
- * journal_free_buffer() is called from journal_try_to_free_buffer(), and is
- * async wrt everything else.
- *
- * It is also used for checkpoint data, also to protect against
- * journal_try_to_free_buffer():
- *
- *	bh->b_cp_transaction
- *	bh->b_cpnext
- *	bh->b_cpprev
- *	transaction->t_checkpoint_list
- *	transaction->t_cpnext
- *	transaction->t_cpprev
- *	journal->j_checkpoint_transactions
- *
- * It is global at this time rather than per-journal because it's
- * impossible for __journal_free_buffer to go from a buffer_head
- * back to a journal_t unracily (well, not true.  Fix later)
- *
- *
- * The `datalist' and `checkpoint list' functions are quite
- * separate and we could use two spinlocks here.
- *
- * lru_list_lock nests inside journal_datalist_lock.
- */
-spinlock_t journal_datalist_lock = SPIN_LOCK_UNLOCKED;
-
-/*
- * jh_splice_lock needs explantion.
- *
- * In a number of places we want to do things like:
- *
- *	if (buffer_jbd(bh) && bh2jh(bh)->foo)
- *
- * This is racy on SMP, because another CPU could remove the journal_head
- * in the middle of this expression.  We need locking.
- *
- * But we can greatly optimise the locking cost by testing BH_JBD
- * outside the lock.  So, effectively:
- *
- *	ret = 0;
- *	if (buffer_jbd(bh)) {
- *		spin_lock(&jh_splice_lock);
- *		if (buffer_jbd(bh)) {	 (* Still there? *)
- *			ret = bh2jh(bh)->foo;
- *		}
- *		spin_unlock(&jh_splice_lock);
- *	}
- *	return ret;
- *
- * Now, that protects us from races where another CPU can remove the
- * journal_head.  But it doesn't defend us from the situation where another
- * CPU can *add* a journal_head.  This is a correctness issue.  But it's not
- * a problem because a) the calling code was *already* racy and b) it often
- * can't happen at the call site and c) the places where we add journal_heads
- * tend to be under external locking.
- */
-spinlock_t jh_splice_lock = SPIN_LOCK_UNLOCKED;
-
-/*
- * List of all journals in the system.  Protected by the BKL.
+ * List of all journals in the system.  Protected by all_journals_lock.
  */
 static LIST_HEAD(all_journals);
+static spinlock_t all_journals_lock = SPIN_LOCK_UNLOCKED;
+
+#ifdef CONFIG_PROC_FS
+static void journal_proc_init(journal_t *journal);
+static void journal_proc_remove(journal_t *journal);
+#else
+#define journal_proc_init(journal)	do {} while (0)
+#define journal_proc_remove(journal)	do {} while (0)
+#endif
 
 /*
  * Helper function used to manage commit timeouts
@@ -209,6 +154,7 @@ int kjournald(void *arg)
 	sigfillset(&current->blocked);
 	recalc_sigpending(current);
 	spin_unlock_irq(&current->sigmask_lock);
+	unlock_kernel();
 
 	sprintf(current->comm, "kjournald");
 
@@ -225,10 +171,15 @@ int kjournald(void *arg)
 
 	printk(KERN_INFO "kjournald starting.  Commit interval %ld seconds\n",
 			journal->j_commit_interval / HZ);
+	spin_lock(&all_journals_lock);
 	list_add(&journal->j_all_journals, &all_journals);
+	spin_unlock(&all_journals_lock);
 
 	/* And now, wait forever for commit wakeup events. */
+	spin_lock(&journal->j_state_lock);
 	while (1) {
+		DECLARE_WAITQUEUE(wait, current);
+
 		if (journal->j_flags & JFS_UNMOUNT)
 			break;
 
@@ -242,12 +193,29 @@ int kjournald(void *arg)
 				del_timer(journal->j_commit_timer);
 			}
 
+			spin_unlock(&journal->j_state_lock);
 			journal_commit_transaction(journal);
+			spin_lock(&journal->j_state_lock);
 			continue;
 		}
 
 		wake_up(&journal->j_wait_done_commit);
-		interruptible_sleep_on(&journal->j_wait_commit);
+
+		/* We are on the queue before j_state_lock goes, so a
+		 * commit request made after the test above still wakes
+		 * us.  The commit timer wakes us directly, but it may
+		 * have fired already. */
+		set_current_state(TASK_INTERRUPTIBLE);
+		add_wait_queue(&journal->j_wait_commit, &wait);
+		transaction = journal->j_running_transaction;
+		if (!transaction || !journal->j_commit_interval ||
+		    time_before(jiffies, transaction->t_expires)) {
+			spin_unlock(&journal->j_state_lock);
+			schedule();
+			spin_lock(&journal->j_state_lock);
+		}
+		set_current_state(TASK_RUNNING);
+		remove_wait_queue(&journal->j_wait_commit, &wait);
 
 		jbd_debug(1, "kjournald wakes\n");
 
@@ -260,13 +228,20 @@ int kjournald(void *arg)
 		}
 	}
 
-	if (journal->j_commit_timer_active) {
-		journal->j_commit_timer_active = 0;
-		del_timer_sync(journal->j_commit_timer);
-	}
+	journal->j_commit_timer_active = 0;
+	spin_unlock(&journal->j_state_lock);
+	del_timer_sync(journal->j_commit_timer);
 
+	spin_lock(&all_journals_lock);
 	list_del(&journal->j_all_journals);
+	spin_unlock(&all_journals_lock);
 
+	/*
+	 * journal_destroy() runs under the BKL, and may free the journal
+	 * as soon as it sees j_task go.  Holding the BKL here keeps it
+	 * off until our wakeup is done with the journal.
+	 */
+	lock_kernel();
 	journal->j_task = NULL;
 	wake_up(&journal->j_wait_done_commit);
 	unlock_kernel();
@@ -278,18 +253,22 @@ static void journal_start_thread(journal_t *journal)
 {
 	kernel_thread(kjournald, (void *) journal,
 		      CLONE_VM | CLONE_FS | CLONE_FILES);
-	while (!journal->j_task)
-		sleep_on(&journal->j_wait_done_commit);
+	wait_event(journal->j_wait_done_commit, journal->j_task != NULL);
 }
 
 static void journal_kill_thread(journal_t *journal)
 {
+	spin_lock(&journal->j_state_lock);
 	journal->j_flags |= JFS_UNMOUNT;
 
 	while (journal->j_task) {
 		wake_up(&journal->j_wait_commit);
-		sleep_on(&journal->j_wait_done_commit);
+		spin_unlock(&journal->j_state_lock);
+		wait_event(journal->j_wait_done_commit,
+			   journal->j_task == NULL);
+		spin_lock(&journal->j_state_lock);
 	}
+	spin_unlock(&journal->j_state_lock);
 }
 
 #if 0
@@ -305,8 +284,7 @@ be reorganised into the next_jh/last_jh algorithm.
  * data list, we can remove those buffers from the list.  This function
  * scans the list for such buffers and removes them cleanly.
  *
- * We assume that the journal is already locked.
- * We are called with journal_datalist_lock held.
+ * We are called with j_list_lock held.
  *
  * AKPM: This function looks inefficient.  Approximately O(n^2)
  * for potentially thousands of buffers.  It no longer shows on profiles
@@ -317,7 +295,7 @@ void __journal_clean_data_list(transaction_t *transaction)
 {
 	struct journal_head *jh, *next;
 
-	assert_spin_locked(&journal_datalist_lock);
+	assert_spin_locked(&transaction->t_journal->j_list_lock);
 
 restart:
 	jh = transaction->t_sync_datalist;
@@ -330,7 +308,7 @@ restart:
 			BUFFER_TRACE(bh, "data writeout complete: unfile");
 			__journal_unfile_buffer(jh);
 			jh->b_transaction = NULL;
-			__journal_remove_journal_head(bh);
+			journal_remove_journal_head(bh);
 			refile_buffer(bh);
 			__brelse(bh);
 			goto restart;
@@ -369,7 +347,7 @@ out:
  *
  * The function returns a pointer to the buffer_heads to be used for IO.
  *
- * We assume that the journal has already been locked in this function.
+ * Called from commit with no locks held.
  *
  * Return value:
  *  <0: Error
@@ -388,12 +366,15 @@ int journal_write_metadata_buffer(transaction_t *transaction,
 				  struct journal_head **jh_out,
 				  int blocknr)
 {
-	int need_copy_out = 0;
+	int need_copy_out;
 	int done_copy_out = 0;
-	int do_escape = 0;
+	int do_escape;
 	char *mapped_data;
+	char *tmp;
 	struct buffer_head *new_bh;
 	struct journal_head * new_jh;
+	struct buffer_head *bh_in = jh2bh(jh_in);
+	journal_t *journal = transaction->t_journal;
 	struct page *new_page;
 	unsigned int new_offset;
 
@@ -406,100 +387,112 @@ int journal_write_metadata_buffer(transaction_t *transaction,
 	 * also part of a shared mapping, and another thread has
 	 * decided to launch a writepage() against this buffer.
 	 */
-	J_ASSERT_JH(jh_in, buffer_jdirty(jh2bh(jh_in)));
+	J_ASSERT_JH(jh_in, buffer_jdirty(bh_in));
+
+	/*
+	 * Make up the new buffer_head first: that can sleep, and we want
+	 * to hold the source buffer's state lock from the frozen data
+	 * test until it is safely on the shadow list.
+	 */
+	do {
+		new_bh = get_unused_buffer_head(0);
+		if (!new_bh) {
+			printk (KERN_NOTICE "%s: ENOMEM at "
+				"get_unused_buffer_head, trying again.\n",
+				__FUNCTION__);
+			yield();
+		}
+	} while (!new_bh);
+	/* keep subsequent assertions sane */
+	new_bh->b_prev_free = 0;
+	new_bh->b_next_free = 0;
+	new_bh->b_state = 0;
+	init_buffer(new_bh, NULL, NULL);
+	atomic_set(&new_bh->b_count, 1);
+	set_bit(BH_Mapped, &new_bh->b_state);
+	set_bit(BH_Dirty, &new_bh->b_state);
+	new_jh = journal_add_journal_head(new_bh);
+
+	jbd_lock_bh_state(bh_in);
+repeat:
+	need_copy_out = do_escape = 0;
 
 	/*
 	 * If a new transaction has already done a buffer copy-out, then
 	 * we use that version of the data for the commit.
 	 */
-
 	if (jh_in->b_frozen_data) {
 		done_copy_out = 1;
 		new_page = virt_to_page(jh_in->b_frozen_data);
 		new_offset = virt_to_offset(jh_in->b_frozen_data);
 	} else {
-		new_page = jh2bh(jh_in)->b_page;
-		new_offset = virt_to_offset(jh2bh(jh_in)->b_data);
+		new_page = bh_in->b_page;
+		new_offset = virt_to_offset(bh_in->b_data);
 	}
 
-	mapped_data = ((char *) kmap(new_page)) + new_offset;
-
 	/*
 	 * Check for escaping
 	 */
-	if (* ((unsigned int *) mapped_data) == htonl(JFS_MAGIC_NUMBER)) {
+	mapped_data = kmap_atomic(new_page, KM_USER0);
+	if (* ((unsigned int *) (mapped_data + new_offset)) ==
+				htonl(JFS_MAGIC_NUMBER)) {
 		need_copy_out = 1;
 		do_escape = 1;
 	}
+	kunmap_atomic(mapped_data, KM_USER0);
 
 	/*
 	 * Do we need to do a data copy?
 	 */
-
 	if (need_copy_out && !done_copy_out) {
-		char *tmp;
-		tmp = jbd_rep_kmalloc(jh2bh(jh_in)->b_size, GFP_NOFS);
+		jbd_unlock_bh_state(bh_in);
+		tmp = jbd_rep_kmalloc(bh_in->b_size, GFP_NOFS);
+		jbd_lock_bh_state(bh_in);
+		if (jh_in->b_frozen_data) {
+			/* Somebody froze it while we slept: use theirs */
+			kfree(tmp);
+			goto repeat;
+		}
 
 		jh_in->b_frozen_data = tmp;
-		memcpy (tmp, mapped_data, jh2bh(jh_in)->b_size);
-		
-		/* If we get to this path, we'll always need the new
-		   address kmapped so that we can clear the escaped
-		   magic number below. */
-		kunmap(new_page);
+		mapped_data = kmap_atomic(new_page, KM_USER0);
+		memcpy(tmp, mapped_data + new_offset, bh_in->b_size);
+		kunmap_atomic(mapped_data, KM_USER0);
+
 		new_page = virt_to_page(tmp);
 		new_offset = virt_to_offset(tmp);
-		mapped_data = ((char *) kmap(new_page)) + new_offset;
-		
 		done_copy_out = 1;
 	}
 
 	/*
-	 * Right, time to make up the new buffer_head.
+	 * Did we need to do an escaping?  Now we've done all the
+	 * copying, we can finally do so.
 	 */
-	do {
-		new_bh = get_unused_buffer_head(0);
-		if (!new_bh) {
-			printk (KERN_NOTICE "%s: ENOMEM at "
-				"get_unused_buffer_head, trying again.\n",
-				__FUNCTION__);
-			yield();
-		}
-	} while (!new_bh);
-	/* keep subsequent assertions sane */
-	new_bh->b_prev_free = 0;
-	new_bh->b_next_free = 0;
-	new_bh->b_state = 0;
-	init_buffer(new_bh, NULL, NULL);
-	atomic_set(&new_bh->b_count, 1);
-	new_jh = journal_add_journal_head(new_bh);
+	if (do_escape) {
+		mapped_data = kmap_atomic(new_page, KM_USER0);
+		* ((unsigned int *) (mapped_data + new_offset)) = 0;
+		kunmap_atomic(mapped_data, KM_USER0);
+	}
 
 	set_bh_page(new_bh, new_page, new_offset);
-
 	new_jh->b_transaction = NULL;
-	new_bh->b_size = jh2bh(jh_in)->b_size;
-	new_bh->b_dev = transaction->t_journal->j_dev;
+	new_bh->b_size = bh_in->b_size;
+	new_bh->b_dev = journal->j_dev;
 	new_bh->b_blocknr = blocknr;
-	new_bh->b_state |= (1 << BH_Mapped) | (1 << BH_Dirty);
 
 	*jh_out = new_jh;
 
-	/*
-	 * Did we need to do an escaping?  Now we've done all the
-	 * copying, we can finally do so.
-	 */
-
-	if (do_escape)
-		* ((unsigned int *) mapped_data) = 0;
-	kunmap(new_page);
-	
 	/*
 	 * The to-be-written buffer needs to get moved to the io queue,
 	 * and the original buffer whose contents we are shadowing or
 	 * copying is moved to the transaction's shadow queue.
 	 */
 	JBUFFER_TRACE(jh_in, "file as BJ_Shadow");
-	journal_file_buffer(jh_in, transaction, BJ_Shadow);
+	spin_lock(&journal->j_list_lock);
+	__journal_file_buffer(jh_in, transaction, BJ_Shadow);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh_in);
+
 	JBUFFER_TRACE(new_jh, "file as BJ_IO");
 	journal_file_buffer(new_jh, transaction, BJ_IO);
 
@@ -514,7 +507,7 @@ int journal_write_metadata_buffer(transaction_t *transaction,
 /*
  * log_space_left: Return the number of free blocks left in the journal.
  *
- * Called with the journal already locked.
+ * Called with j_state_lock held.
  */
 
 int log_space_left (journal_t *journal)
@@ -535,32 +528,19 @@ int log_space_left (journal_t *journal)
 }
 
 /*
- * This function must be non-allocating for PF_MEMALLOC tasks
+ * Ask kjournald to commit transaction `target'.  Returns true if that
+ * is a new request.
+ *
+ * Called with j_state_lock held.  This function must be non-allocating
+ * for PF_MEMALLOC tasks.
  */
-tid_t log_start_commit (journal_t *journal, transaction_t *transaction)
+int __log_start_commit(journal_t *journal, tid_t target)
 {
-	tid_t target = journal->j_commit_request;
-
-	lock_kernel(); /* Protect journal->j_running_transaction */
-	
-	/*
-	 * A NULL transaction asks us to commit the currently running
-	 * transaction, if there is one.  
-	 */
-	if (transaction)
-		target = transaction->t_tid;
-	else {
-		transaction = journal->j_running_transaction;
-		if (!transaction)
-			goto out;
-		target = transaction->t_tid;
-	}
-		
 	/*
 	 * Are we already doing a recent enough commit?
 	 */
 	if (tid_geq(journal->j_commit_request, target))
-		goto out;
+		return 0;
 
 	/*
 	 * We want a new commit: OK, mark the request and wakup the
@@ -572,34 +552,69 @@ tid_t log_start_commit (journal_t *journal, transaction_t *transaction)
 		  journal->j_commit_request,
 		  journal->j_commit_sequence);
 	wake_up(&journal->j_wait_commit);
+	return 1;
+}
 
-out:
-	unlock_kernel();
+/*
+ * A NULL transaction asks us to commit the currently running
+ * transaction, if there is one.  Otherwise the caller must hold a
+ * handle on `transaction', or otherwise know that it is still live.
+ */
+tid_t log_start_commit (journal_t *journal, transaction_t *transaction)
+{
+	tid_t target;
+
+	spin_lock(&journal->j_state_lock);
+	target = journal->j_commit_request;
+	if (!transaction)
+		transaction = journal->j_running_transaction;
+	if (transaction) {
+		target = transaction->t_tid;
+		__log_start_commit(journal, target);
+	}
+	spin_unlock(&journal->j_state_lock);
 	return target;
 }
 
 /*
  * Wait for a specified commit to complete.
- * The caller may not hold the journal lock.
+ * The caller may not hold j_state_lock.
  */
 void log_wait_commit (journal_t *journal, tid_t tid)
 {
-	lock_kernel();
+	spin_lock(&journal->j_state_lock);
 #ifdef CONFIG_JBD_DEBUG
-	lock_journal(journal);
 	if (!tid_geq(journal->j_commit_request, tid)) {
 		printk(KERN_EMERG "%s: error: j_commit_request=%d, tid=%d\n",
 			__FUNCTION__, journal->j_commit_request, tid);
 	}
-	unlock_journal(journal);
 #endif
 	while (tid_gt(tid, journal->j_commit_sequence)) {
 		jbd_debug(1, "JBD: want %d, j_commit_sequence=%d\n",
 				  tid, journal->j_commit_sequence);
 		wake_up(&journal->j_wait_commit);
-		sleep_on(&journal->j_wait_done_commit);
+		jbd_sleep_on_unlock(&journal->j_wait_done_commit,
+				    &journal->j_state_lock);
+		spin_lock(&journal->j_state_lock);
 	}
-	unlock_kernel();
+	spin_unlock(&journal->j_state_lock);
+}
+
+/*
+ * Sleep on `wq', dropping the spinlock which protects the condition
+ * being waited for.  We are on the queue before the lock goes, so a
+ * wakeup which follows the caller's test of the condition cannot be
+ * lost.  Returns with the lock dropped.
+ */
+void jbd_sleep_on_unlock(wait_queue_head_t *wq, spinlock_t *lock)
+{
+	DECLARE_WAITQUEUE(wait, current);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	add_wait_queue(wq, &wait);
+	spin_unlock(lock);
+	schedule();
+	remove_wait_queue(wq, &wait);
 }
 
 /*
@@ -610,6 +625,7 @@ int journal_next_log_block(journal_t *journal, unsigned long *retp)
 {
 	unsigned long blocknr;
 
+	spin_lock(&journal->j_state_lock);
 	J_ASSERT(journal->j_free > 1);
 
 	blocknr = journal->j_head;
@@ -617,6 +633,7 @@ int journal_next_log_block(journal_t *journal, unsigned long *retp)
 	journal->j_free--;
 	if (journal->j_head == journal->j_last)
 		journal->j_head = journal->j_first;
+	spin_unlock(&journal->j_state_lock);
 	return journal_bmap(journal, blocknr, retp);
 }
 
@@ -705,7 +722,9 @@ static journal_t * journal_init_common (void)
 	init_waitqueue_head(&journal->j_wait_updates);
 	init_MUTEX(&journal->j_barrier);
 	init_MUTEX(&journal->j_checkpoint_sem);
-	init_MUTEX(&journal->j_sem);
+	spin_lock_init(&journal->j_state_lock);
+	spin_lock_init(&journal->j_list_lock);
+	spin_lock_init(&journal->j_revoke_lock);
 
 	journal->j_commit_interval = get_buffer_flushtime();
 
@@ -859,9 +878,8 @@ static int journal_reset (journal_t *journal)
 	/* Add the dynamic fields and write it to disk. */
 	journal_update_superblock(journal, 1);
 
-	lock_journal(journal);
 	journal_start_thread(journal);
-	unlock_journal(journal);
+	journal_proc_init(journal);
 
 	return 0;
 }
@@ -948,12 +966,14 @@ void journal_update_superblock(journal_t *journal, int wait)
 	journal_superblock_t *sb = journal->j_superblock;
 	struct buffer_head *bh = journal->j_sb_buffer;
 
+	spin_lock(&journal->j_state_lock);
 	jbd_debug(1,"JBD: updating superblock (start %ld, seq %d, errno %d)\n",
 		  journal->j_tail, journal->j_tail_sequence, journal->j_errno);
 
 	sb->s_sequence = htonl(journal->j_tail_sequence);
 	sb->s_start    = htonl(journal->j_tail);
 	sb->s_errno    = htonl(journal->j_errno);
+	spin_unlock(&journal->j_state_lock);
 
 	BUFFER_TRACE(bh, "marking dirty");
 	mark_buffer_dirty(bh);
@@ -965,10 +985,12 @@ void journal_update_superblock(journal_t *journal, int wait)
 	 * any future commit will have to be careful to update the
 	 * superblock again to re-record the true start of the log. */
 
+	spin_lock(&journal->j_state_lock);
 	if (sb->s_start)
 		journal->j_flags &= ~JFS_FLUSHED;
 	else
 		journal->j_flags |= JFS_FLUSHED;
+	spin_unlock(&journal->j_state_lock);
 }
 
 
@@ -1127,9 +1149,17 @@ void journal_destroy (journal_t *journal)
 		journal_commit_transaction(journal);
 
 	/* Force any old transactions to disk */
-	lock_journal(journal);
-	while (journal->j_checkpoint_transactions != NULL)
+
+	/* Totally anal locking here... */
+	spin_lock(&journal->j_list_lock);
+	while (journal->j_checkpoint_transactions != NULL) {
+		spin_unlock(&journal->j_list_lock);
+		down(&journal->j_checkpoint_sem);
 		log_do_checkpoint(journal, 1);
+		up(&journal->j_checkpoint_sem);
+		spin_lock(&journal->j_list_lock);
+	}
+	spin_unlock(&journal->j_list_lock);
 
 	J_ASSERT(journal->j_running_transaction == NULL);
 	J_ASSERT(journal->j_committing_transaction == NULL);
@@ -1148,7 +1178,7 @@ void journal_destroy (journal_t *journal)
 	if (journal->j_revoke)
 		journal_destroy_revoke(journal);
 
-	unlock_journal(journal);
+	journal_proc_remove(journal);
 	kfree(journal);
 	MOD_DEC_USE_COUNT;
 }
@@ -1315,23 +1345,35 @@ int journal_flush (journal_t *journal)
 	transaction_t *transaction = NULL;
 	unsigned long old_tail;
 
-	lock_kernel();
-	
+	spin_lock(&journal->j_state_lock);
+
 	/* Force everything buffered to the log... */
 	if (journal->j_running_transaction) {
 		transaction = journal->j_running_transaction;
-		log_start_commit(journal, transaction);
+		__log_start_commit(journal, transaction->t_tid);
 	} else if (journal->j_committing_transaction)
 		transaction = journal->j_committing_transaction;
 
 	/* Wait for the log commit to complete... */
-	if (transaction)
-		log_wait_commit(journal, transaction->t_tid);
+	if (transaction) {
+		tid_t tid = transaction->t_tid;
+
+		spin_unlock(&journal->j_state_lock);
+		log_wait_commit(journal, tid);
+	} else {
+		spin_unlock(&journal->j_state_lock);
+	}
 
 	/* ...and flush everything in the log out to disk. */
-	lock_journal(journal);
-	while (!err && journal->j_checkpoint_transactions != NULL)
+	spin_lock(&journal->j_list_lock);
+	while (!err && journal->j_checkpoint_transactions != NULL) {
+		spin_unlock(&journal->j_list_lock);
+		down(&journal->j_checkpoint_sem);
 		err = log_do_checkpoint(journal, journal->j_maxlen);
+		up(&journal->j_checkpoint_sem);
+		spin_lock(&journal->j_list_lock);
+	}
+	spin_unlock(&journal->j_list_lock);
 	cleanup_journal_tail(journal);
 
 	/* Finally, mark the journal as really needing no recovery.
@@ -1339,21 +1381,21 @@ int journal_flush (journal_t *journal)
 	 * the magic code for a fully-recovered superblock.  Any future
 	 * commits of data to the journal will restore the current
 	 * s_start value. */
+	spin_lock(&journal->j_state_lock);
 	old_tail = journal->j_tail;
 	journal->j_tail = 0;
+	spin_unlock(&journal->j_state_lock);
 	journal_update_superblock(journal, 1);
+	spin_lock(&journal->j_state_lock);
 	journal->j_tail = old_tail;
 
-	unlock_journal(journal);
-
 	J_ASSERT(!journal->j_running_transaction);
 	J_ASSERT(!journal->j_committing_transaction);
 	J_ASSERT(!journal->j_checkpoint_transactions);
 	J_ASSERT(journal->j_head == journal->j_tail);
 	J_ASSERT(journal->j_tail_sequence == journal->j_transaction_sequence);
+	spin_unlock(&journal->j_state_lock);
 
-	unlock_kernel();
-	
 	return err;
 }
 
@@ -1422,7 +1464,7 @@ const char * journal_dev_name(journal_t *journal)
  * itself are here.
  */
 
-/* Quick version for internal journal use (doesn't lock the journal).
+/* Quick version for internal journal use (takes only j_state_lock).
  * Aborts hard --- we mark the abort as occurred, but do _nothing_ else,
  * and don't attempt to make any other journal updates. */
 void __journal_abort_hard (journal_t *journal)
@@ -1435,10 +1477,12 @@ void __journal_abort_hard (journal_t *journal)
 	printk (KERN_ERR "Aborting journal on device %s.\n",
 		journal_dev_name(journal));
 
+	spin_lock(&journal->j_state_lock);
 	journal->j_flags |= JFS_ABORT;
 	transaction = journal->j_running_transaction;
 	if (transaction)
-		log_start_commit(journal, transaction);
+		__log_start_commit(journal, transaction->t_tid);
+	spin_unlock(&journal->j_state_lock);
 }
 
 /* Soft abort: record the abort error status in the journal superblock,
@@ -1448,8 +1492,10 @@ void __journal_abort_soft (journal_t *journal, int errno)
 	if (journal->j_flags & JFS_ABORT)
 		return;
 
+	spin_lock(&journal->j_state_lock);
 	if (!journal->j_errno)
 		journal->j_errno = errno;
+	spin_unlock(&journal->j_state_lock);
 
 	__journal_abort_hard(journal);
 
@@ -1505,9 +1551,7 @@ void __journal_abort_soft (journal_t *journal, int errno)
 
 void journal_abort (journal_t *journal, int errno)
 {
-	lock_journal(journal);
 	__journal_abort_soft(journal, errno);
-	unlock_journal(journal);
 }
 
 /** 
@@ -1525,12 +1569,12 @@ int journal_errno (journal_t *journal)
 {
 	int err;
 
-	lock_journal(journal);
+	spin_lock(&journal->j_state_lock);
 	if (journal->j_flags & JFS_ABORT)
 		err = -EROFS;
 	else
 		err = journal->j_errno;
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
 	return err;
 }
 
@@ -1546,12 +1590,12 @@ int journal_clear_err (journal_t *journal)
 {
 	int err = 0;
 
-	lock_journal(journal);
+	spin_lock(&journal->j_state_lock);
 	if (journal->j_flags & JFS_ABORT)
 		err = -EROFS;
 	else
 		journal->j_errno = 0;
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
 	return err;
 }
 
@@ -1564,10 +1608,10 @@ int journal_clear_err (journal_t *journal)
  */
 void journal_ack_err (journal_t *journal)
 {
-	lock_journal(journal);
+	spin_lock(&journal->j_state_lock);
 	if (journal->j_errno)
 		journal->j_flags |= JFS_ACK_ERR;
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
 }
 
 
@@ -1577,9 +1621,9 @@ void journal_ack_err (journal_t *journal)
  * tune2fs to modify the live filesystem, so we need the option of
  * continuing as gracefully as possible.  #
  *
- * The caller should already hold the journal lock and
- * journal_datalist_lock spinlock: most callers will need those anyway
- * in order to probe the buffer's journaling state safely.
+ * The caller should already hold jbd_lock_bh_state(): most callers
+ * will need it anyway in order to probe the buffer's journaling state
+ * safely.
  */
 void __jbd_unexpected_dirty_buffer(const char *function, int line, 
 				 struct journal_head *jh)
@@ -1627,15 +1671,15 @@ void shrink_journal_memory(void)
 {
 	struct list_head *list;
 
-	lock_kernel();
+	spin_lock(&all_journals_lock);
 	list_for_each(list, &all_journals) {
 		journal_t *journal =
 			list_entry(list, journal_t, j_all_journals);
-		spin_lock(&journal_datalist_lock);
+		spin_lock(&journal->j_list_lock);
 		__journal_clean_checkpoint_list(journal);
-		spin_unlock(&journal_datalist_lock);
+		spin_unlock(&journal->j_list_lock);
 	}
-	unlock_kernel();
+	spin_unlock(&all_journals_lock);
 }
 
 /*
@@ -1784,48 +1828,63 @@ static void journal_free_journal_head(struct journal_head *jh)
  *
  * Doesn't need the journal lock.
  * May sleep.
- * Cannot be called with journal_datalist_lock held.
  */
 struct journal_head *journal_add_journal_head(struct buffer_head *bh)
 {
 	struct journal_head *jh;
+	struct journal_head *new_jh = NULL;
+
+repeat:
+	if (!buffer_jbd(bh)) {
+		new_jh = journal_alloc_journal_head();
+		memset(new_jh, 0, sizeof(*new_jh));
+	}
 
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_journal_head(bh);
 	if (buffer_jbd(bh)) {
 		jh = bh2jh(bh);
 	} else {
 		J_ASSERT_BH(bh,
 			(atomic_read(&bh->b_count) > 0) ||
 			(bh->b_page && bh->b_page->mapping));
-		spin_unlock(&journal_datalist_lock);
-		jh = journal_alloc_journal_head();
-		memset(jh, 0, sizeof(*jh));
-		spin_lock(&journal_datalist_lock);
-
-		if (buffer_jbd(bh)) {
-			/* Someone did it for us! */
-			J_ASSERT_BH(bh, bh->b_private != NULL);
-			journal_free_journal_head(jh);
-			jh = bh->b_private;
-		} else {
-			/*
-			 * We actually don't need jh_splice_lock when
-			 * adding a journal_head - only on removal.
-			 */
-			spin_lock(&jh_splice_lock);
-			set_bit(BH_JBD, &bh->b_state);
-			bh->b_private = jh;
-			jh->b_bh = bh;
-			atomic_inc(&bh->b_count);
-			spin_unlock(&jh_splice_lock);
-			BUFFER_TRACE(bh, "added journal_head");
+
+		if (!new_jh) {
+			jbd_unlock_bh_journal_head(bh);
+			goto repeat;
 		}
+
+		jh = new_jh;
+		new_jh = NULL;		/* We consumed it */
+		set_bit(BH_JBD, &bh->b_state);
+		bh->b_private = jh;
+		jh->b_bh = bh;
+		atomic_inc(&bh->b_count);
+		BUFFER_TRACE(bh, "added journal_head");
 	}
 	jh->b_jcount++;
-	spin_unlock(&journal_datalist_lock);
+	jbd_unlock_bh_journal_head(bh);
+	if (new_jh)
+		journal_free_journal_head(new_jh);
 	return bh->b_private;
 }
 
+/*
+ * Grab a ref against this buffer_head's journal_head.  If it ended up not
+ * having a journal_head, return NULL
+ */
+struct journal_head *journal_grab_journal_head(struct buffer_head *bh)
+{
+	struct journal_head *jh = NULL;
+
+	jbd_lock_bh_journal_head(bh);
+	if (buffer_jbd(bh)) {
+		jh = bh2jh(bh);
+		jh->b_jcount++;
+	}
+	jbd_unlock_bh_journal_head(bh);
+	return jh;
+}
+
 /*
  * journal_remove_journal_head(): if the buffer isn't attached to a transaction
  * and has a zero b_jcount then remove and release its journal_head.   If we did
@@ -1839,13 +1898,14 @@ struct journal_head *journal_add_journal_head(struct buffer_head *bh)
  * time.  Once the caller has run __brelse(), the buffer is eligible for
  * reaping by try_to_free_buffers().
  *
- * Requires journal_datalist_lock.
+ * Requires jbd_lock_bh_journal_head().  The caller will normally hold
+ * jbd_lock_bh_state() as well, so that the transaction pointers cannot
+ * change underneath the test.
  */
-void __journal_remove_journal_head(struct buffer_head *bh)
+static void __journal_remove_journal_head(struct buffer_head *bh)
 {
 	struct journal_head *jh = bh2jh(bh);
 
-	assert_spin_locked(&journal_datalist_lock);
 	J_ASSERT_JH(jh, jh->b_jcount >= 0);
 	atomic_inc(&bh->b_count);
 	if (jh->b_jcount == 0) {
@@ -1855,12 +1915,16 @@ void __journal_remove_journal_head(struct buffer_head *bh)
 			J_ASSERT_BH(bh, buffer_jbd(bh));
 			J_ASSERT_BH(bh, jh2bh(jh) == bh);
 			BUFFER_TRACE(bh, "remove journal_head");
-			spin_lock(&jh_splice_lock);
+			J_ASSERT_JH(jh, jh->b_frozen_data == NULL);
+			if (jh->b_committed_data) {
+				/* Left behind by the last commit */
+				kfree(jh->b_committed_data);
+				jh->b_committed_data = NULL;
+			}
 			bh->b_private = NULL;
 			jh->b_bh = NULL;	/* debug, really */
 			clear_bit(BH_JBD, &bh->b_state);
 			__brelse(bh);
-			spin_unlock(&jh_splice_lock);
 			journal_free_journal_head(jh);
 		} else {
 			BUFFER_TRACE(bh, "journal_head was locked");
@@ -1868,26 +1932,32 @@ void __journal_remove_journal_head(struct buffer_head *bh)
 	}
 }
 
+/*
+ * Drop a reference taken by journal_add_journal_head() or
+ * journal_grab_journal_head(), releasing the journal_head if that was
+ * the last thing holding it.
+ */
 void journal_unlock_journal_head(struct journal_head *jh)
 {
-	spin_lock(&journal_datalist_lock);
+	struct buffer_head *bh = jh2bh(jh);
+
+	jbd_lock_bh_journal_head(bh);
 	J_ASSERT_JH(jh, jh->b_jcount > 0);
 	--jh->b_jcount;
 	if (!jh->b_jcount && !jh->b_transaction) {
-		struct buffer_head *bh;
-		bh = jh2bh(jh);
 		__journal_remove_journal_head(bh);
+		jbd_unlock_bh_journal_head(bh);
 		__brelse(bh);
+		return;
 	}
-	
-	spin_unlock(&journal_datalist_lock);
+	jbd_unlock_bh_journal_head(bh);
 }
 
 void journal_remove_journal_head(struct buffer_head *bh)
 {
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_journal_head(bh);
 	__journal_remove_journal_head(bh);
-	spin_unlock(&journal_datalist_lock);
+	jbd_unlock_bh_journal_head(bh);
 }
 
 /*
@@ -1951,6 +2021,103 @@ static void __exit remove_jbd_proc_entry(void)
 
 #endif
 
+/*
+ * Per-journal statistics, in /proc/fs/jbd/<fs device>/info
+ */
+#ifdef CONFIG_PROC_FS
+
+static struct proc_dir_entry *proc_jbd;
+
+#define JBD_MSECS(j)	((j) * 1000 / HZ)
+
+static int read_jbd_info(char *page, char **start, off_t off,
+			 int count, int *eof, void *data)
+{
+	journal_t *journal = data;
+	struct journal_stats s;
+	int len;
+
+	spin_lock(&journal->j_state_lock);
+	s = journal->j_stats;
+	spin_unlock(&journal->j_state_lock);
+
+	len = sprintf(page,
+		"commits:          %lu\n"
+		"commit time:      %lu ms average, %lu ms max\n"
+		"blocks logged:    %lu\n"
+		"handles:          %lu\n"
+		"handle waits:     %lu\n"
+		"handle wait time: %lu ms average, %lu ms max\n",
+		s.js_commits,
+		s.js_commits ?
+			JBD_MSECS(s.js_commit_time / s.js_commits) : 0,
+		JBD_MSECS(s.js_commit_time_max),
+		s.js_commit_blocks,
+		s.js_handles,
+		s.js_handle_waits,
+		s.js_handle_waits ?
+			JBD_MSECS(s.js_handle_wait_time / s.js_handle_waits) : 0,
+		JBD_MSECS(s.js_handle_wait_max));
+
+	if (len <= off + count)
+		*eof = 1;
+	*start = page + off;
+	len -= off;
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+static void journal_proc_init(journal_t *journal)
+{
+	struct proc_dir_entry *dir, *info;
+
+	if (!proc_jbd || journal->j_proc_entry)
+		return;
+
+	dir = proc_mkdir(kdevname(journal->j_fs_dev), proc_jbd);
+	if (!dir)
+		return;
+	info = create_proc_read_entry("info", 0444, dir,
+				      read_jbd_info, journal);
+	if (!info) {
+		remove_proc_entry(dir->name, proc_jbd);
+		return;
+	}
+	journal->j_proc_entry = dir;
+}
+
+static void journal_proc_remove(journal_t *journal)
+{
+	struct proc_dir_entry *dir = journal->j_proc_entry;
+
+	if (!dir)
+		return;
+	remove_proc_entry("info", dir);
+	remove_proc_entry(dir->name, proc_jbd);
+	journal->j_proc_entry = NULL;
+}
+
+static void __init create_jbd_stats_dir(void)
+{
+	proc_jbd = proc_mkdir("fs/jbd", NULL);
+}
+
+static void __exit remove_jbd_stats_dir(void)
+{
+	if (proc_jbd)
+		remove_proc_entry("fs/jbd", NULL);
+}
+
+#else
+
+#define create_jbd_stats_dir() do {} while (0)
+#define remove_jbd_stats_dir() do {} while (0)
+
+#endif
+
 /*
  * Module startup and shutdown
  */
@@ -1980,6 +2147,7 @@ static int __init journal_init(void)
 	if (ret != 0)
 		journal_destroy_caches();
 	create_jbd_proc_entry();
+	create_jbd_stats_dir();
 	return ret;
 }
 
@@ -1990,6 +2158,7 @@ static void __exit journal_exit(void)
 	if (n)
 		printk(KERN_EMERG "JBD: leaked %d journal_heads!\n", n);
 #endif
+	remove_jbd_stats_dir();
 	remove_jbd_proc_entry();
 	journal_destroy_caches();
 }
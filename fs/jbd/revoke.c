@@ -130,7 +130,9 @@ repeat:
 	record->sequence = seq;
 	record->blocknr = blocknr;
 	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
+	spin_lock(&journal->j_revoke_lock);
 	list_add(&record->hash, hash_list);
+	spin_unlock(&journal->j_revoke_lock);
 	return 0;
 
 oom:
@@ -141,7 +143,8 @@ oom:
 	goto repeat;
 }
 
-/* Find a revoke record in the journal's hash table. */
+/* Find a revoke record in the journal's hash table.  Recovery is single
+ * threaded; anyone else must hold j_revoke_lock. */
 
 static struct jbd_revoke_record_s *find_revoke_record(journal_t *journal,
 						      unsigned long blocknr)
@@ -338,11 +341,9 @@ int journal_revoke(handle_t *handle, unsigned long blocknr,
 		}
 	}
 
-	lock_journal(journal);
 	jbd_debug(2, "insert revoke for block %lu, bh_in=%p\n", blocknr, bh_in);
 	err = insert_revoke_hash(journal, blocknr,
 				handle->h_transaction->t_tid);
-	unlock_journal(journal);
 	BUFFER_TRACE(bh_in, "exit");
 	return err;
 }
@@ -362,7 +363,7 @@ int journal_revoke(handle_t *handle, unsigned long blocknr,
  * do not trust the Revoked bit on buffers unless RevokeValid is also
  * set.
  *
- * The caller must have the journal locked.
+ * Takes j_revoke_lock itself; the caller need hold no other JBD locks.
  */
 int journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
 {
@@ -386,19 +387,24 @@ int journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
 	}
 
 	if (need_cancel) {
+		spin_lock(&journal->j_revoke_lock);
 		record = find_revoke_record(journal, bh->b_blocknr);
 		if (record) {
 			jbd_debug(4, "cancelled existing revoke on "
 				  "blocknr %lu\n", bh->b_blocknr);
 			list_del(&record->hash);
-			kmem_cache_free(revoke_record_cache, record);
 			did_revoke = 1;
 		}
+		spin_unlock(&journal->j_revoke_lock);
+		if (record)
+			kmem_cache_free(revoke_record_cache, record);
 	}
 
 #ifdef JBD_EXPENSIVE_CHECKING
 	/* There better not be one left behind by now! */
+	spin_lock(&journal->j_revoke_lock);
 	record = find_revoke_record(journal, bh->b_blocknr);
+	spin_unlock(&journal->j_revoke_lock);
 	J_ASSERT_JH(jh, record == NULL);
 #endif
 
@@ -423,7 +429,8 @@ int journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
  * Write revoke records to the journal for all entries in the current
  * revoke hash, deleting the entries as we go.
  *
- * Called with the journal lock held.
+ * Called by the commit thread while the transaction is T_LOCKED: there
+ * are no handles running, so nobody can add or cancel revokes under us.
  */
 
 void journal_write_revoke_records(journal_t *journal, 
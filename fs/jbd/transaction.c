@@ -27,36 +27,30 @@
 #include <linux/smp_lock.h>
 #include <linux/mm.h>
 
-extern spinlock_t journal_datalist_lock;
-
 /*
  * get_transaction: obtain a new transaction_t object.
  *
- * Simply allocate and initialise a new transaction.  Create it in
- * RUNNING state and add it to the current journal (which should not
- * have an existing running transaction: we only make a new transaction
- * once we have started to commit the old one).
+ * Simply initialise a new transaction.  Create it in RUNNING state and
+ * add it to the current journal (which should not have an existing
+ * running transaction: we only make a new transaction once we have
+ * started to commit the old one).
  *
  * Preconditions:
- *	The journal MUST be locked.  We don't perform atomic mallocs on the
- *	new transaction	and we can't block without protecting against other
- *	processes trying to touch the journal while it is in transition.
+ *	The journal's j_state_lock is held.  The transaction was
+ *	allocated by the caller before taking the lock, since we cannot
+ *	sleep here.
  */
 
-static transaction_t * get_transaction (journal_t * journal, int is_try)
+static transaction_t *
+get_transaction(journal_t *journal, transaction_t *transaction)
 {
-	transaction_t * transaction;
-
-	transaction = jbd_kmalloc (sizeof (transaction_t), GFP_NOFS);
-	if (!transaction)
-		return NULL;
-	
 	memset (transaction, 0, sizeof (transaction_t));
 	
 	transaction->t_journal = journal;
 	transaction->t_state = T_RUNNING;
 	transaction->t_tid = journal->j_transaction_sequence++;
 	transaction->t_expires = jiffies + journal->j_commit_interval;
+	spin_lock_init(&transaction->t_handle_lock);
 	INIT_LIST_HEAD(&transaction->t_jcb);
 
 	if (journal->j_commit_interval) {
@@ -91,8 +85,12 @@ static transaction_t * get_transaction (journal_t * journal, int is_try)
 static int start_this_handle(journal_t *journal, handle_t *handle)
 {
 	transaction_t *transaction;
+	transaction_t *new_transaction = NULL;
+	unsigned long start = jiffies;
+	int waited = 0;
 	int needed;
 	int nblocks = handle->h_buffer_credits;
+	int ret = 0;
 
 	if (nblocks > journal->j_max_transaction_buffers) {
 		jbd_debug(1, "JBD: %s wants too many credits (%d > %d)\n",
@@ -101,41 +99,54 @@ static int start_this_handle(journal_t *journal, handle_t *handle)
 		return -ENOSPC;
 	}
 
+alloc_transaction:
+	if (!journal->j_running_transaction) {
+		new_transaction = jbd_kmalloc(sizeof(*new_transaction),
+						GFP_NOFS);
+		if (!new_transaction)
+			return -ENOMEM;
+	}
+
 	jbd_debug(3, "New handle %p going live.\n", handle);
 
 repeat:
-
-	lock_journal(journal);
+	spin_lock(&journal->j_state_lock);
 
 repeat_locked:
-
 	if (is_journal_aborted(journal) ||
 	    (journal->j_errno != 0 && !(journal->j_flags & JFS_ACK_ERR))) {
-		unlock_journal(journal);
-		return -EROFS; 
+		spin_unlock(&journal->j_state_lock);
+		ret = -EROFS; 
+		goto out;
 	}
 
 	/* Wait on the journal's transaction barrier if necessary */
 	if (journal->j_barrier_count) {
-		unlock_journal(journal);
-		sleep_on(&journal->j_wait_transaction_locked);
+		jbd_sleep_on_unlock(&journal->j_wait_transaction_locked,
+				    &journal->j_state_lock);
+		waited = 1;
 		goto repeat;
 	}
 	
-	if (!journal->j_running_transaction)
-		get_transaction(journal, 0);
-	/* @@@ Error? */
-	J_ASSERT(journal->j_running_transaction);
-	
+	if (!journal->j_running_transaction) {
+		if (!new_transaction) {
+			spin_unlock(&journal->j_state_lock);
+			goto alloc_transaction;
+		}
+		get_transaction(journal, new_transaction);
+		new_transaction = NULL;
+	}
+
 	transaction = journal->j_running_transaction;
 
 	/* If the current transaction is locked down for commit, wait
 	 * for the lock to be released. */
 
 	if (transaction->t_state == T_LOCKED) {
-		unlock_journal(journal);
 		jbd_debug(3, "Handle %p stalling...\n", handle);
-		sleep_on(&journal->j_wait_transaction_locked);
+		jbd_sleep_on_unlock(&journal->j_wait_transaction_locked,
+				    &journal->j_state_lock);
+		waited = 1;
 		goto repeat;
 	}
 	
@@ -144,6 +155,7 @@ repeat_locked:
 	 * stall pending a log checkpoint to free some more log
 	 * space. */
 
+	spin_lock(&transaction->t_handle_lock);
 	needed = transaction->t_outstanding_credits + nblocks;
 
 	if (needed > journal->j_max_transaction_buffers) {
@@ -152,11 +164,12 @@ repeat_locked:
 		 * this handle to a new transaction. */
 		
 		jbd_debug(2, "Handle %p starting new commit...\n", handle);
-		log_start_commit(journal, transaction);
-		unlock_journal(journal);
-		sleep_on(&journal->j_wait_transaction_locked);
-		lock_journal(journal);
-		goto repeat_locked;
+		spin_unlock(&transaction->t_handle_lock);
+		__log_start_commit(journal, transaction->t_tid);
+		jbd_sleep_on_unlock(&journal->j_wait_transaction_locked,
+				    &journal->j_state_lock);
+		waited = 1;
+		goto repeat;
 	}
 
 	/* 
@@ -191,7 +204,9 @@ repeat_locked:
 	
 	if (log_space_left(journal) < needed) {
 		jbd_debug(2, "Handle %p waiting for checkpoint...\n", handle);
+		spin_unlock(&transaction->t_handle_lock);
 		log_wait_for_space(journal, needed);
+		waited = 1;
 		goto repeat_locked;
 	}
 
@@ -205,10 +220,22 @@ repeat_locked:
 	jbd_debug(4, "Handle %p given %d credits (total %d, free %d)\n",
 		  handle, nblocks, transaction->t_outstanding_credits,
 		  log_space_left(journal));
+	spin_unlock(&transaction->t_handle_lock);
 
-	unlock_journal(journal);
-	
-	return 0;
+	journal->j_stats.js_handles++;
+	if (waited) {
+		unsigned long wait = jiffies - start;
+
+		journal->j_stats.js_handle_waits++;
+		journal->j_stats.js_handle_wait_time += wait;
+		if (wait > journal->j_stats.js_handle_wait_max)
+			journal->j_stats.js_handle_wait_max = wait;
+	}
+	spin_unlock(&journal->j_state_lock);
+out:
+	if (new_transaction)
+		kfree(new_transaction);
+	return ret;
 }
 
 /* Allocate a new handle.  This should probably be in a slab... */
@@ -275,13 +302,21 @@ handle_t *journal_start(journal_t *journal, int nblocks)
 static int try_start_this_handle(journal_t *journal, handle_t *handle)
 {
 	transaction_t *transaction;
+	transaction_t *new_transaction = NULL;
 	int needed;
 	int nblocks = handle->h_buffer_credits;
 	int ret = 0;
 
 	jbd_debug(3, "New handle %p maybe going live.\n", handle);
 
-	lock_journal(journal);
+	if (!journal->j_running_transaction) {
+		new_transaction = jbd_kmalloc(sizeof(*new_transaction),
+						GFP_NOFS);
+		if (!new_transaction)
+			goto fail;
+	}
+
+	spin_lock(&journal->j_state_lock);
 
 	if (is_journal_aborted(journal) ||
 	    (journal->j_errno != 0 && !(journal->j_flags & JFS_ACK_ERR))) {
@@ -292,17 +327,22 @@ static int try_start_this_handle(journal_t *journal, handle_t *handle)
 	if (journal->j_barrier_count)
 		goto fail_unlock;
 
-	if (!journal->j_running_transaction && get_transaction(journal, 1) == 0)
-		goto fail_unlock;
+	if (!journal->j_running_transaction) {
+		if (!new_transaction)
+			goto fail_unlock;
+		get_transaction(journal, new_transaction);
+		new_transaction = NULL;
+	}
 	
 	transaction = journal->j_running_transaction;
 	if (transaction->t_state == T_LOCKED)
 		goto fail_unlock;
 	
+	spin_lock(&transaction->t_handle_lock);
 	needed = transaction->t_outstanding_credits + nblocks;
 	/* We could run log_start_commit here */
 	if (needed > journal->j_max_transaction_buffers)
-		goto fail_unlock;
+		goto fail_unlock_handle;
 
 	needed = journal->j_max_transaction_buffers;
 	if (journal->j_committing_transaction) 
@@ -310,19 +350,27 @@ static int try_start_this_handle(journal_t *journal, handle_t *handle)
 						t_outstanding_credits;
 	
 	if (log_space_left(journal) < needed)
-		goto fail_unlock;
+		goto fail_unlock_handle;
 
 	handle->h_transaction = transaction;
 	transaction->t_outstanding_credits += nblocks;
 	transaction->t_updates++;
+	transaction->t_handle_count++;
 	jbd_debug(4, "Handle %p given %d credits (total %d, free %d)\n",
 		  handle, nblocks, transaction->t_outstanding_credits,
 		  log_space_left(journal));
-	unlock_journal(journal);
+	spin_unlock(&transaction->t_handle_lock);
+	journal->j_stats.js_handles++;
+	spin_unlock(&journal->j_state_lock);
 	return 0;
 
+fail_unlock_handle:
+	spin_unlock(&transaction->t_handle_lock);
 fail_unlock:
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
+fail:
+	if (new_transaction)
+		kfree(new_transaction);
 	if (ret >= 0)
 		ret = -1;
 	return ret;
@@ -403,13 +451,13 @@ int journal_extend (handle_t *handle, int nblocks)
 	int result;
 	int wanted;
 
-	lock_journal (journal);
-
 	result = -EIO;
 	if (is_handle_aborted(handle))
-		goto error_out;
+		goto out;
 
 	result = 1;
+
+	spin_lock(&journal->j_state_lock);
 	       
 	/* Don't extend a locked-down transaction! */
 	if (handle->h_transaction->t_state != T_RUNNING) {
@@ -417,19 +465,21 @@ int journal_extend (handle_t *handle, int nblocks)
 			  "transaction not running\n", handle, nblocks);
 		goto error_out;
 	}
+
+	spin_lock(&transaction->t_handle_lock);
 	
 	wanted = transaction->t_outstanding_credits + nblocks;
 	
 	if (wanted > journal->j_max_transaction_buffers) {
 		jbd_debug(3, "denied handle %p %d blocks: "
 			  "transaction too large\n", handle, nblocks);
-		goto error_out;
+		goto unlock;
 	}
 
 	if (wanted > log_space_left(journal)) {
 		jbd_debug(3, "denied handle %p %d blocks: "
 			  "insufficient log space\n", handle, nblocks);
-		goto error_out;
+		goto unlock;
 	}
 	
 	handle->h_buffer_credits += nblocks;
@@ -437,9 +487,11 @@ int journal_extend (handle_t *handle, int nblocks)
 	result = 0;
 
 	jbd_debug(3, "extended handle %p by %d\n", handle, nblocks);
-	
+unlock:
+	spin_unlock(&transaction->t_handle_lock);
 error_out:
-	unlock_journal (journal);
+	spin_unlock(&journal->j_state_lock);
+out:
 	return result;
 }
 
@@ -476,14 +528,18 @@ int journal_restart(handle_t *handle, int nblocks)
 	J_ASSERT (transaction->t_updates > 0);
 	J_ASSERT (journal_current_handle() == handle);
 
+	spin_lock(&journal->j_state_lock);
+	spin_lock(&transaction->t_handle_lock);
 	transaction->t_outstanding_credits -= handle->h_buffer_credits;
 	transaction->t_updates--;
 
 	if (!transaction->t_updates)
 		wake_up(&journal->j_wait_updates);
+	spin_unlock(&transaction->t_handle_lock);
 
 	jbd_debug(2, "restarting handle %p\n", handle);
-	log_start_commit(journal, transaction);
+	__log_start_commit(journal, transaction->t_tid);
+	spin_unlock(&journal->j_state_lock);
 
 	handle->h_buffer_credits = nblocks;
 	ret = start_this_handle(journal, handle);
@@ -503,23 +559,27 @@ int journal_restart(handle_t *handle, int nblocks)
  */
 void journal_lock_updates (journal_t *journal)
 {
-	lock_journal(journal);
+	spin_lock(&journal->j_state_lock);
 	++journal->j_barrier_count;
 
 	/* Wait until there are no running updates */
 	while (1) {
 		transaction_t *transaction = journal->j_running_transaction;
+
 		if (!transaction)
 			break;
-		if (!transaction->t_updates)
+
+		spin_lock(&transaction->t_handle_lock);
+		if (!transaction->t_updates) {
+			spin_unlock(&transaction->t_handle_lock);
 			break;
-		
-		unlock_journal(journal);
-		sleep_on(&journal->j_wait_updates);
-		lock_journal(journal);
+		}
+		spin_unlock(&journal->j_state_lock);
+		jbd_sleep_on_unlock(&journal->j_wait_updates,
+				    &transaction->t_handle_lock);
+		spin_lock(&journal->j_state_lock);
 	}
-
-	unlock_journal(journal);
+	spin_unlock(&journal->j_state_lock);
 
 	/* We have now established a barrier against other normal
 	 * updates, but we also need to barrier against other
@@ -538,14 +598,13 @@ void journal_lock_updates (journal_t *journal)
  */
 void journal_unlock_updates (journal_t *journal)
 {
-	lock_journal(journal);
-
 	J_ASSERT (journal->j_barrier_count != 0);
 	
 	up(&journal->j_barrier);
+	spin_lock(&journal->j_state_lock);
 	--journal->j_barrier_count;
+	spin_unlock(&journal->j_state_lock);
 	wake_up(&journal->j_wait_transaction_locked);
-	unlock_journal(journal);
 }
 
 /*
@@ -576,18 +635,12 @@ repeat:
 
 	/* @@@ Need to check for errors here at some point. */
 
-	/*
-	 * AKPM: we have replaced all the lock_journal_bh_wait() stuff with a
-	 * simple lock_journal().  This code here will care for locked buffers.
-	 */
 	locked = test_and_set_bit(BH_Lock, &bh->b_state);
 	if (locked) {
 		/* We can't reliably test the buffer state if we found
 		 * it already locked, so just wait for the lock and
 		 * retry. */
-		unlock_journal(journal);
 		__wait_on_buffer(bh);
-		lock_journal(journal);
 		goto repeat;
 	}
 	
@@ -604,8 +657,8 @@ repeat:
 	 * ie. locked but not dirty) or tune2fs (which may actually have
 	 * the buffer dirtied, ugh.)  */
 
+	jbd_lock_bh_state(bh);
 	if (buffer_dirty(bh)) {
-		spin_lock(&journal_datalist_lock);
 		/* First question: is this buffer already part of the
 		 * current transaction or the existing committing
 		 * transaction? */
@@ -617,24 +670,23 @@ repeat:
 			JBUFFER_TRACE(jh, "Unexpected dirty buffer");
 			jbd_unexpected_dirty_buffer(jh);
 		}
-		spin_unlock(&journal_datalist_lock);
 	}
 
 	unlock_buffer(bh);
 
 	error = -EROFS;
-	if (is_handle_aborted(handle)) 
+	if (is_handle_aborted(handle)) {
+		jbd_unlock_bh_state(bh);
 		goto out_unlocked;
+	}
 	error = 0;
 
-	spin_lock(&journal_datalist_lock);
-
 	/* The buffer is already part of this transaction if
 	 * b_transaction or b_next_transaction points to it. */
 
 	if (jh->b_transaction == transaction ||
 	    jh->b_next_transaction == transaction)
-		goto done_locked;
+		goto done;
 
 	/* If there is already a copy-out version of this buffer, then
 	 * we don't need to make another one. */
@@ -642,11 +694,13 @@ repeat:
 	if (jh->b_frozen_data) {
 		JBUFFER_TRACE(jh, "has frozen data");
 		J_ASSERT_JH(jh, jh->b_next_transaction == NULL);
+		spin_lock(&journal->j_list_lock);
 		jh->b_next_transaction = transaction;
+		spin_unlock(&journal->j_list_lock);
 
 		J_ASSERT_JH(jh, handle->h_buffer_credits > 0);
 		handle->h_buffer_credits--;
-		goto done_locked;
+		goto done;
 	}
 	
 	/* Is there data here we need to preserve? */
@@ -668,12 +722,9 @@ repeat:
 
 		if (jh->b_jlist == BJ_Shadow) {
 			JBUFFER_TRACE(jh, "on shadow: sleep");
-			spin_unlock(&journal_datalist_lock);
-			unlock_journal(journal);
+			jbd_unlock_bh_state(bh);
 			/* commit wakes up all shadow buffers after IO */
-			wait_event(jh2bh(jh)->b_wait,
-						jh->b_jlist != BJ_Shadow);
-			lock_journal(journal);
+			wait_event(bh->b_wait, jh->b_jlist != BJ_Shadow);
 			goto repeat;
 		}
 			
@@ -695,19 +746,17 @@ repeat:
 			JBUFFER_TRACE(jh, "generate frozen data");
 			if (!frozen_buffer) {
 				JBUFFER_TRACE(jh, "allocate memory for buffer");
-				spin_unlock(&journal_datalist_lock);
-				unlock_journal(journal);
-				frozen_buffer = jbd_kmalloc(jh2bh(jh)->b_size,
+				jbd_unlock_bh_state(bh);
+				frozen_buffer = jbd_kmalloc(bh->b_size,
 							    GFP_NOFS);
-				lock_journal(journal);
 				if (!frozen_buffer) {
 					printk(KERN_EMERG
 						"%s: OOM for frozen_buffer\n",
 						__FUNCTION__);
 					JBUFFER_TRACE(jh, "oom!");
 					error = -ENOMEM;
-					spin_lock(&journal_datalist_lock);
-					goto done_locked;
+					jbd_lock_bh_state(bh);
+					goto done;
 				}
 				goto repeat;
 			}
@@ -716,7 +765,9 @@ repeat:
 			frozen_buffer = NULL;
 			need_copy = 1;
 		}
+		spin_lock(&journal->j_list_lock);
 		jh->b_next_transaction = transaction;
+		spin_unlock(&journal->j_list_lock);
 	}
 
 	J_ASSERT(handle->h_buffer_credits > 0);
@@ -729,27 +780,27 @@ repeat:
 	if (!jh->b_transaction) {
 		JBUFFER_TRACE(jh, "no transaction");
 		J_ASSERT_JH(jh, !jh->b_next_transaction);
-		jh->b_transaction = transaction;
 		JBUFFER_TRACE(jh, "file as BJ_Reserved");
+		spin_lock(&journal->j_list_lock);
 		__journal_file_buffer(jh, transaction, BJ_Reserved);
+		spin_unlock(&journal->j_list_lock);
 	}
 	
-done_locked:
-	spin_unlock(&journal_datalist_lock);
+done:
 	if (need_copy) {
 		struct page *page;
 		int offset;
 		char *source;
 
-		J_EXPECT_JH(jh, buffer_uptodate(jh2bh(jh)),
+		J_EXPECT_JH(jh, buffer_uptodate(bh),
 			    "Possible IO failure.\n");
-		page = jh2bh(jh)->b_page;
-		offset = ((unsigned long) jh2bh(jh)->b_data) & ~PAGE_MASK;
-		source = kmap(page);
-		memcpy(jh->b_frozen_data, source+offset, jh2bh(jh)->b_size);
-		kunmap(page);
+		page = bh->b_page;
+		offset = ((unsigned long) bh->b_data) & ~PAGE_MASK;
+		source = kmap_atomic(page, KM_USER0);
+		memcpy(jh->b_frozen_data, source+offset, bh->b_size);
+		kunmap_atomic(source, KM_USER0);
 	}
-	
+	jbd_unlock_bh_state(bh);
 
 	/* If we are about to journal a buffer, then any revoke pending
            on it is no longer valid. */
@@ -776,18 +827,14 @@ out_unlocked:
 
 int journal_get_write_access (handle_t *handle, struct buffer_head *bh) 
 {
-	transaction_t *transaction = handle->h_transaction;
-	journal_t *journal = transaction->t_journal;
 	struct journal_head *jh = journal_add_journal_head(bh);
 	int rc;
 
 	/* We do not want to get caught playing with fields which the
 	 * log thread also manipulates.  Make sure that the buffer
 	 * completes any outstanding IO before proceeding. */
-	lock_journal(journal);
 	rc = do_get_write_access(handle, jh, 0);
 	journal_unlock_journal_head(jh);
-	unlock_journal(journal);
 	return rc;
 }
 
@@ -816,16 +863,17 @@ int journal_get_create_access (handle_t *handle, struct buffer_head *bh)
 	transaction_t *transaction = handle->h_transaction;
 	journal_t *journal = transaction->t_journal;
 	struct journal_head *jh = journal_add_journal_head(bh);
+	int need_refile = 0;
 	int err;
 	
 	jbd_debug(5, "journal_head %p\n", jh);
-	lock_journal(journal);
 	err = -EROFS;
 	if (is_handle_aborted(handle))
 		goto out;
 	err = 0;
 	
 	JBUFFER_TRACE(jh, "entry");
+	jbd_lock_bh_state(bh);
 	/* The buffer may already belong to this transaction due to
 	 * pre-zeroing in the filesystem's new_block code.  It may also
 	 * be on the previous, committing transaction's lists, but it
@@ -842,18 +890,22 @@ int journal_get_create_access (handle_t *handle, struct buffer_head *bh)
 	J_ASSERT_JH(jh, handle->h_buffer_credits > 0);
 	handle->h_buffer_credits--;
 
-	spin_lock(&journal_datalist_lock);
+	spin_lock(&journal->j_list_lock);
 	if (jh->b_transaction == NULL) {
-		jh->b_transaction = transaction;
 		JBUFFER_TRACE(jh, "file as BJ_Reserved");
 		__journal_file_buffer(jh, transaction, BJ_Reserved);
-		JBUFFER_TRACE(jh, "refile");
-		refile_buffer(jh2bh(jh));
+		need_refile = 1;
 	} else if (jh->b_transaction == journal->j_committing_transaction) {
 		JBUFFER_TRACE(jh, "set next transaction");
 		jh->b_next_transaction = transaction;
 	}
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
+
+	if (need_refile) {
+		JBUFFER_TRACE(jh, "refile");
+		refile_buffer(bh);
+	}
 
 	/*
 	 * akpm: I added this.  ext3_alloc_branch can pick up new indirect
@@ -864,9 +916,8 @@ int journal_get_create_access (handle_t *handle, struct buffer_head *bh)
 	 */
 	JBUFFER_TRACE(jh, "cancelling revoke");
 	journal_cancel_revoke(handle, jh);
-	journal_unlock_journal_head(jh);
 out:
-	unlock_journal(journal);
+	journal_unlock_journal_head(jh);
 	return err;
 }
 
@@ -899,12 +950,11 @@ out:
  */
 int journal_get_undo_access (handle_t *handle, struct buffer_head *bh)
 {
-	journal_t *journal = handle->h_transaction->t_journal;
 	int err;
 	struct journal_head *jh = journal_add_journal_head(bh);
+	char *committed_data = NULL;
 
 	JBUFFER_TRACE(jh, "entry");
-	lock_journal(journal);
 
 	/* Do this first --- it can drop the journal lock, so we want to
 	 * make sure that obtaining the committed_data is done
@@ -913,28 +963,38 @@ int journal_get_undo_access (handle_t *handle, struct buffer_head *bh)
 	if (err)
 		goto out;
 	
+repeat:
 	if (!jh->b_committed_data) {
-		/* Copy out the current buffer contents into the
-		 * preserved, committed copy. */
-		JBUFFER_TRACE(jh, "generate b_committed data");
-		jh->b_committed_data = jbd_kmalloc(jh2bh(jh)->b_size, 
-						   GFP_NOFS);
-		if (!jh->b_committed_data) {
+		committed_data = jbd_kmalloc(bh->b_size, GFP_NOFS);
+		if (!committed_data) {
 			printk(KERN_EMERG "%s: No memory for committed data!\n",
 				__FUNCTION__);
 			err = -ENOMEM;
 			goto out;
 		}
-		
-		memcpy (jh->b_committed_data, jh2bh(jh)->b_data,
-				jh2bh(jh)->b_size);
 	}
 
+	jbd_lock_bh_state(bh);
+	if (!jh->b_committed_data) {
+		/* Copy out the current buffer contents into the
+		 * preserved, committed copy. */
+		JBUFFER_TRACE(jh, "generate b_committed data");
+		if (!committed_data) {
+			jbd_unlock_bh_state(bh);
+			goto repeat;
+		}
+
+		jh->b_committed_data = committed_data;
+		committed_data = NULL;
+		memcpy(jh->b_committed_data, bh->b_data, bh->b_size);
+	}
+	jbd_unlock_bh_state(bh);
 out:
 	if (!err)
 		J_ASSERT_JH(jh, jh->b_committed_data);
 	journal_unlock_journal_head(jh);
-	unlock_journal(journal);
+	if (committed_data)
+		kfree(committed_data);
 	return err;
 }
 
@@ -957,8 +1017,8 @@ int journal_dirty_data (handle_t *handle, struct buffer_head *bh, int async)
 {
 /*
  * journal_dirty_data() can be called via page_launder->ext3_writepage
- * by kswapd.  So it cannot block.  Happily, there's nothing here
- * which needs lock_journal if `async' is set.
+ * by kswapd.  So it cannot block.  Happily, the only sleep below is
+ * skipped if `async' is set: the rest of it is spinlocks.
  *
  * When the buffer is on the current transaction we freely move it
  * between BJ_AsyncData and BJ_SyncData according to who tried to
@@ -1002,7 +1062,8 @@ int journal_dirty_data (handle_t *handle, struct buffer_head *bh, int async)
 	 * never, ever allow this to happen: there's nothing we can do
 	 * about it in this layer.
 	 */
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
 	if (jh->b_transaction) {
 		JBUFFER_TRACE(jh, "has transaction");
 		if (jh->b_transaction != handle->h_transaction) {
@@ -1058,11 +1119,13 @@ int journal_dirty_data (handle_t *handle, struct buffer_head *bh, int async)
 			 */
 			if (!async && buffer_dirty(bh)) {
 				atomic_inc(&bh->b_count);
-				spin_unlock(&journal_datalist_lock);
+				spin_unlock(&journal->j_list_lock);
+				jbd_unlock_bh_state(bh);
 				need_brelse = 1;
 				ll_rw_block(WRITE, 1, &bh);
 				wait_on_buffer(bh);
-				spin_lock(&journal_datalist_lock);
+				jbd_lock_bh_state(bh);
+				spin_lock(&journal->j_list_lock);
 				/* The buffer may become locked again at any
 				   time if it is redirtied */
 			}
@@ -1096,7 +1159,8 @@ int journal_dirty_data (handle_t *handle, struct buffer_head *bh, int async)
 		__journal_file_buffer(jh, handle->h_transaction, wanted_jlist);
 	}
 no_journal:
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
 	if (need_brelse) {
 		BUFFER_TRACE(bh, "brelse");
 		__brelse(bh);
@@ -1134,11 +1198,11 @@ int journal_dirty_metadata (handle_t *handle, struct buffer_head *bh)
 
 	jbd_debug(5, "journal_head %p\n", jh);
 	JBUFFER_TRACE(jh, "entry");
-	lock_journal(journal);
 	if (is_handle_aborted(handle))
-		goto out_unlock;
+		goto out;
 	
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
 	set_bit(BH_JBDDirty, &bh->b_state);
 
 	J_ASSERT_JH(jh, jh->b_transaction != NULL);
@@ -1169,10 +1233,10 @@ int journal_dirty_metadata (handle_t *handle, struct buffer_head *bh)
 	__journal_file_buffer(jh, handle->h_transaction, BJ_Metadata);
 
 done_locked:
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
 	JBUFFER_TRACE(jh, "exit");
-out_unlock:
-	unlock_journal(journal);
+out:
 	return 0;
 }
 
@@ -1191,24 +1255,24 @@ void journal_release_buffer (handle_t *handle, struct buffer_head *bh)
 	journal_t *journal = transaction->t_journal;
 	struct journal_head *jh = bh2jh(bh);
 
-	lock_journal(journal);
 	JBUFFER_TRACE(jh, "entry");
 
 	/* If the buffer is reserved but not modified by this
 	 * transaction, then it is safe to release it.  In all other
 	 * cases, just leave the buffer as it is. */
 
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
 	if (jh->b_jlist == BJ_Reserved && jh->b_transaction == transaction &&
 	    !buffer_jdirty(jh2bh(jh))) {
 		JBUFFER_TRACE(jh, "unused: refiling it");
 		handle->h_buffer_credits++;
 		__journal_refile_buffer(jh);
 	}
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
 
 	JBUFFER_TRACE(jh, "exit");
-	unlock_journal(journal);
 }
 #endif
 
@@ -1237,8 +1301,8 @@ void journal_forget (handle_t *handle, struct buffer_head *bh)
 
 	BUFFER_TRACE(bh, "entry");
 
-	lock_journal(journal);
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
 
 	if (!buffer_jbd(bh))
 		goto not_jbd;
@@ -1274,11 +1338,11 @@ void journal_forget (handle_t *handle, struct buffer_head *bh)
 		if (jh->b_cp_transaction) {
 			__journal_file_buffer(jh, transaction, BJ_Forget);
 		} else {
-			__journal_remove_journal_head(bh);
+			journal_remove_journal_head(bh);
 			__brelse(bh);
 			if (!buffer_jbd(bh)) {
-				spin_unlock(&journal_datalist_lock);
-				unlock_journal(journal);
+				spin_unlock(&journal->j_list_lock);
+				jbd_unlock_bh_state(bh);
 				__bforget(bh);
 				return;
 			}
@@ -1300,8 +1364,8 @@ void journal_forget (handle_t *handle, struct buffer_head *bh)
 	}
 
 not_jbd:
-	spin_unlock(&journal_datalist_lock);
-	unlock_journal(journal);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
 	__brelse(bh);
 	return;
 }
@@ -1327,9 +1391,9 @@ void journal_sync_buffer(struct buffer_head *bh)
 	 * disk.  */
 	BUFFER_TRACE(bh, "entry");
 
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(bh);
 	if (!buffer_jbd(bh)) {
-		spin_unlock(&journal_datalist_lock);
+		jbd_unlock_bh_state(bh);
 		return;
 	}
 	jh = bh2jh(bh);
@@ -1337,11 +1401,11 @@ void journal_sync_buffer(struct buffer_head *bh)
 		/* If the buffer has already been journaled, then this
 		 * is a noop. */
 		if (jh->b_cp_transaction == NULL) {
-			spin_unlock(&journal_datalist_lock);
+			jbd_unlock_bh_state(bh);
 			return;
 		}
 		atomic_inc(&bh->b_count);
-		spin_unlock(&journal_datalist_lock);
+		jbd_unlock_bh_state(bh);
 		ll_rw_block (WRITE, 1, &bh);
 		wait_on_buffer(bh);
 		__brelse(bh);
@@ -1352,7 +1416,7 @@ void journal_sync_buffer(struct buffer_head *bh)
 	transaction = jh->b_transaction;
 	journal = transaction->t_journal;
 	sequence = transaction->t_tid;
-	spin_unlock(&journal_datalist_lock);
+	jbd_unlock_bh_state(bh);
 
 	jbd_debug(2, "requesting commit for jh %p\n", jh);
 	log_start_commit (journal, transaction);
@@ -1447,6 +1511,8 @@ int journal_stop(handle_t *handle)
 	}
 
 	current->journal_info = NULL;
+	spin_lock(&journal->j_state_lock);
+	spin_lock(&transaction->t_handle_lock);
 	transaction->t_outstanding_credits -= handle->h_buffer_credits;
 	transaction->t_updates--;
 	if (!transaction->t_updates) {
@@ -1474,10 +1540,12 @@ int journal_stop(handle_t *handle)
 		 * anything to disk. */
 		tid_t tid = transaction->t_tid;
 		
+		spin_unlock(&transaction->t_handle_lock);
 		jbd_debug(2, "transaction too old, requesting commit for "
 					"handle %p\n", handle);
 		/* This is non-blocking */
-		log_start_commit(journal, transaction);
+		__log_start_commit(journal, tid);
+		spin_unlock(&journal->j_state_lock);
 		
 		/*
 		 * Special case: JFS_SYNC synchronous updates require us
@@ -1485,6 +1553,9 @@ int journal_stop(handle_t *handle)
 		 */
 		if (handle->h_sync && !(current->flags & PF_MEMALLOC))
 			log_wait_commit(journal, tid);
+	} else {
+		spin_unlock(&transaction->t_handle_lock);
+		spin_unlock(&journal->j_state_lock);
 	}
 	kfree(handle);
 	return err;
@@ -1502,7 +1573,6 @@ int journal_force_commit(journal_t *journal)
 	handle_t *handle;
 	int ret = 0;
 
-	lock_kernel();
 	handle = journal_start(journal, 1);
 	if (IS_ERR(handle)) {
 		ret = PTR_ERR(handle);
@@ -1511,7 +1581,6 @@ int journal_force_commit(journal_t *journal)
 	handle->h_sync = 1;
 	journal_stop(handle);
 out:
-	unlock_kernel();
 	return ret;
 }
 
@@ -1525,7 +1594,7 @@ out:
 /*
  * Append a buffer to a transaction list, given the transaction's list head
  * pointer.
- * journal_datalist_lock is held.
+ * j_list_lock is held.
  */
 
 static inline void 
@@ -1547,8 +1616,7 @@ __blist_add_buffer(struct journal_head **list, struct journal_head *jh)
  * Remove a buffer from a transaction list, given the transaction's list
  * head pointer.
  *
- * Called with journal_datalist_lock held, and the journal may not
- * be locked.
+ * Called with j_list_lock held.
  */
 
 static inline void
@@ -1572,17 +1640,17 @@ __blist_del_buffer(struct journal_head **list, struct journal_head *jh)
  * is holding onto a copy of one of thee pointers, it could go bad.
  * Generally the caller needs to re-read the pointer from the transaction_t.
  *
- * If bh->b_jlist is BJ_SyncData or BJ_AsyncData then we may have been called
- * via journal_try_to_free_buffer() or journal_clean_data_list().  In that
- * case, journal_datalist_lock will be held, and the journal may not be locked.
+ * Called with j_list_lock held.  Callers which go on to change
+ * b_transaction must hold jbd_lock_bh_state() as well.
  */
 void __journal_unfile_buffer(struct journal_head *jh)
 {
 	struct journal_head **list = 0;
 	transaction_t * transaction;
 
-	assert_spin_locked(&journal_datalist_lock);
 	transaction = jh->b_transaction;
+	if (transaction)
+		assert_spin_locked(&transaction->t_journal->j_list_lock);
 
 	J_ASSERT_JH(jh, jh->b_jlist < BJ_Types);
 
@@ -1627,47 +1695,42 @@ void __journal_unfile_buffer(struct journal_head *jh)
 	}
 }
 
-void journal_unfile_buffer(struct journal_head *jh)
+void journal_unfile_buffer(journal_t *journal, struct journal_head *jh)
 {
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(jh2bh(jh));
+	spin_lock(&journal->j_list_lock);
 	__journal_unfile_buffer(jh);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(jh2bh(jh));
 }
 
 /*
  * Called from journal_try_to_free_buffers().  The journal is not
  * locked. lru_list_lock is not held.
  *
- * Here we see why journal_datalist_lock is global and not per-journal.
- * We cannot get back to this buffer's journal pointer without locking
- * out journal_clean_data_list() in some manner.
- *
- * One could use journal_datalist_lock to get unracy access to a
- * per-journal lock.
- *
- * Called with journal_datalist_lock held.
- *
- * Returns non-zero iff we were able to free the journal_head.
+ * Called with jbd_lock_bh_state() and j_list_lock held.  The caller
+ * also holds a b_jcount reference, so the journal_head stays put; it
+ * is that reference's release which actually frees the journal_head
+ * once we have cut it loose from its transaction here.
  */
-static int __journal_try_to_free_buffer(struct buffer_head *bh,
-					int *locked_or_dirty)
+static void __journal_try_to_free_buffer(journal_t *journal,
+					 struct journal_head *jh,
+					 int *locked_or_dirty)
 {
-	struct journal_head *jh;
-
-	assert_spin_locked(&journal_datalist_lock);
+	struct buffer_head *bh = jh2bh(jh);
 
-	jh = bh2jh(bh);
+	assert_spin_locked(&journal->j_list_lock);
 
 	if (buffer_locked(bh) || buffer_dirty(bh)) {
 		*locked_or_dirty = 1;
-		goto out;
+		return;
 	}
 
 	if (!buffer_uptodate(bh))
-		goto out;
+		return;
 
 	if (jh->b_next_transaction != 0)
-		goto out;
+		return;
 
 	if (jh->b_transaction != 0 && jh->b_cp_transaction == 0) {
 		if (jh->b_jlist == BJ_SyncData || jh->b_jlist==BJ_AsyncData) {
@@ -1675,8 +1738,6 @@ static int __journal_try_to_free_buffer(struct buffer_head *bh,
 			JBUFFER_TRACE(jh, "release data");
 			__journal_unfile_buffer(jh);
 			jh->b_transaction = 0;
-			__journal_remove_journal_head(bh);
-			__brelse(bh);
 		}
 	}
 	else if (jh->b_cp_transaction != 0 && jh->b_transaction == 0) {
@@ -1684,14 +1745,8 @@ static int __journal_try_to_free_buffer(struct buffer_head *bh,
 		if (jh->b_jlist == BJ_None) {
 			JBUFFER_TRACE(jh, "remove from checkpoint list");
 			__journal_remove_checkpoint(jh);
-			__journal_remove_journal_head(bh);
-			__brelse(bh);
 		}
 	}
-	return !buffer_jbd(bh);
-
-out:
-	return 0;
 }
 
 void debug_page(struct page *p)
@@ -1765,9 +1820,9 @@ int journal_try_to_free_buffers(journal_t *journal,
 
 	bh = page->buffers;
 	tmp = bh;
-	spin_lock(&journal_datalist_lock);
 	do {
 		struct buffer_head *p = tmp;
+		struct journal_head *jh;
 
 		if (unlikely(!tmp)) {
 			debug_page(page);
@@ -1775,11 +1830,19 @@ int journal_try_to_free_buffers(journal_t *journal,
 		}
 			
 		tmp = tmp->b_this_page;
+		jh = journal_grab_journal_head(p);
+		if (!jh)
+			continue;
+
+		jbd_lock_bh_state(p);
+		spin_lock(&journal->j_list_lock);
+		__journal_try_to_free_buffer(journal, jh, &locked_or_dirty);
+		spin_unlock(&journal->j_list_lock);
+		jbd_unlock_bh_state(p);
+		journal_unlock_journal_head(jh);
 		if (buffer_jbd(p))
-			if (!__journal_try_to_free_buffer(p, &locked_or_dirty))
-				call_ttfb = 0;
+			call_ttfb = 0;
 	} while (tmp != bh);
-	spin_unlock(&journal_datalist_lock);
 
 	if (!(gfp_mask & (__GFP_IO|__GFP_WAIT)))
 		goto out;
@@ -1809,7 +1872,6 @@ static int dispose_buffer(struct journal_head *jh,
 	int may_free = 1;
 	struct buffer_head *bh = jh2bh(jh);
 
-	spin_lock(&journal_datalist_lock);
 	__journal_unfile_buffer(jh);
 	jh->b_transaction = 0;
 
@@ -1820,10 +1882,9 @@ static int dispose_buffer(struct journal_head *jh,
 		may_free = 0;
 	} else {
 		JBUFFER_TRACE(jh, "on running transaction");
-		__journal_remove_journal_head(bh);
+		journal_remove_journal_head(bh);
 		__brelse(bh);
 	}
-	spin_unlock(&journal_datalist_lock);
 	return may_free;
 }
 
@@ -1885,15 +1946,21 @@ static int journal_unmap_buffer(journal_t *journal, struct buffer_head *bh)
 	if (!buffer_mapped(bh))
 		return 1;
 
-	/* It is safe to proceed here without the
-	 * journal_datalist_spinlock because the buffers cannot be
-	 * stolen by try_to_free_buffers as long as we are holding the
-	 * page lock. --sct */
+	/* It is safe to proceed here without the j_list_lock because
+	 * the buffers cannot be stolen by try_to_free_buffers as long
+	 * as we are holding the page lock. --sct */
 
 	if (!buffer_jbd(bh))
-		goto zap_buffer;
+		goto zap_buffer_unlocked;
+
+	spin_lock(&journal->j_state_lock);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
+
+	jh = journal_grab_journal_head(bh);
+	if (!jh)
+		goto zap_buffer_no_jh;
 
-	jh = bh2jh(bh);
 	transaction = jh->b_transaction;
 	if (transaction == NULL) {
 		/* First case: not on any transaction.  If it
@@ -1919,8 +1986,9 @@ static int journal_unmap_buffer(journal_t *journal, struct buffer_head *bh)
 			 * committed, the buffer won't be needed any
 			 * longer. */
 			JBUFFER_TRACE(jh, "checkpointed: add to BJ_Forget");
-			return dispose_buffer(jh,
+			may_free = dispose_buffer(jh,
 					journal->j_running_transaction);
+			goto out_unlock;
 		} else {
 			/* There is no currently-running transaction. So the
 			 * orphan record which we wrote for this file must have
@@ -1928,8 +1996,9 @@ static int journal_unmap_buffer(journal_t *journal, struct buffer_head *bh)
 			 * the committing transaction, if it exists. */
 			if (journal->j_committing_transaction) {
 				JBUFFER_TRACE(jh, "give to committing trans");
-				return dispose_buffer(jh,
+				may_free = dispose_buffer(jh,
 					journal->j_committing_transaction);
+				goto out_unlock;
 			} else {
 				/* The orphan record's transaction has
 				 * committed.  We can cleanse this buffer */
@@ -1949,7 +2018,8 @@ static int journal_unmap_buffer(journal_t *journal, struct buffer_head *bh)
 					journal->j_running_transaction);
 			jh->b_next_transaction = NULL;
 		}
-		return 0;
+		may_free = 0;
+		goto out_unlock;
 	} else {
 		/* Good, the buffer belongs to the running transaction.
 		 * We are writing our own transaction's data, not any
@@ -1961,7 +2031,13 @@ static int journal_unmap_buffer(journal_t *journal, struct buffer_head *bh)
 		may_free = dispose_buffer(jh, transaction);
 	}
 
-zap_buffer:	
+zap_buffer:
+	journal_unlock_journal_head(jh);
+zap_buffer_no_jh:
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
+	spin_unlock(&journal->j_state_lock);
+zap_buffer_unlocked:
 	if (buffer_dirty(bh))
 		mark_buffer_clean(bh);
 	J_ASSERT_BH(bh, !buffer_jdirty(bh));
@@ -1970,6 +2046,13 @@ zap_buffer:
 	clear_bit(BH_Req, &bh->b_state);
 	clear_bit(BH_New, &bh->b_state);
 	return may_free;
+
+out_unlock:
+	journal_unlock_journal_head(jh);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
+	spin_unlock(&journal->j_state_lock);
+	return may_free;
 }
 
 /** 
@@ -1996,9 +2079,8 @@ int journal_flushpage(journal_t *journal,
 		return 1;
 
 	/* We will potentially be playing with lists other than just the
-	 * data lists (especially for journaled data mode), so be
-	 * cautious in our locking. */
-	lock_journal(journal);
+	 * data lists (especially for journaled data mode), so
+	 * journal_unmap_buffer() takes all of the journal's locks. */
 
 	head = bh = page->buffers;
 	do {
@@ -2017,8 +2099,6 @@ int journal_flushpage(journal_t *journal,
 
 	} while (bh != head);
 
-	unlock_journal(journal);
-
 	if (!offset) {
 		if (!may_free || !try_to_free_buffers(page, 0))
 			return 0;
@@ -2036,7 +2116,7 @@ void __journal_file_buffer(struct journal_head *jh,
 	struct journal_head **list = 0;
 	int was_dirty = 0;
 
-	assert_spin_locked(&journal_datalist_lock);
+	assert_spin_locked(&transaction->t_journal->j_list_lock);
 	
 	J_ASSERT_JH(jh, jh->b_jlist < BJ_Types);
 	J_ASSERT_JH(jh, jh->b_transaction == transaction ||
@@ -2103,9 +2183,11 @@ void __journal_file_buffer(struct journal_head *jh,
 void journal_file_buffer(struct journal_head *jh,
 				transaction_t *transaction, int jlist)
 {
-	spin_lock(&journal_datalist_lock);
+	jbd_lock_bh_state(jh2bh(jh));
+	spin_lock(&transaction->t_journal->j_list_lock);
 	__journal_file_buffer(jh, transaction, jlist);
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&transaction->t_journal->j_list_lock);
+	jbd_unlock_bh_state(jh2bh(jh));
 }
 
 static void jbd_refile_buffer(struct buffer_head *bh)
@@ -2126,7 +2208,8 @@ void __journal_refile_buffer(struct journal_head *jh)
 {
 	int was_dirty = 0;
 
-	assert_spin_locked(&journal_datalist_lock);
+	J_ASSERT_JH(jh, jh->b_transaction != NULL);
+	assert_spin_locked(&jh->b_transaction->t_journal->j_list_lock);
 	/* If the buffer is now unused, just drop it. */
 	if (jh->b_next_transaction == NULL) {
 		__journal_unfile_buffer(jh);
@@ -2167,16 +2250,17 @@ void __journal_refile_buffer(struct journal_head *jh)
  *
  * *** The journal_head may be freed by this call! ***
  */
-void journal_refile_buffer(struct journal_head *jh)
+void journal_refile_buffer(journal_t *journal, struct journal_head *jh)
 {
-	struct buffer_head *bh;
+	struct buffer_head *bh = jh2bh(jh);
 
-	spin_lock(&journal_datalist_lock);
-	bh = jh2bh(jh);
+	jbd_lock_bh_state(bh);
+	spin_lock(&journal->j_list_lock);
 
 	__journal_refile_buffer(jh);
-	__journal_remove_journal_head(bh);
+	journal_remove_journal_head(bh);
 
-	spin_unlock(&journal_datalist_lock);
+	spin_unlock(&journal->j_list_lock);
+	jbd_unlock_bh_state(bh);
 	__brelse(bh);
 }
@@ -10,19 +10,23 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
 
 #include <asm/uaccess.h>
 #include <asm/ioctls.h>
 
 /*
- * We use a start+len construction, which provides full use of the 
- * allocated memory.
- * -- Florian Coosmann (FGC)
+ * The data lives in a ring of page buffers (see pipe_fs_i.h), so that
+ * splice() can move pages in and out of a pipe without copying them.
  * 
  * Reads with count = 0 should always return 0.
  * -- Julian Bradfield 1999-06-07.
  */
 
+/* Unprivileged users may not grow a pipe beyond this, in bytes */
+int pipe_max_size = 1024 * 1024;
+
 /* Drop the inode semaphore and wait for a pipe event, atomically */
 void pipe_wait(struct inode * inode)
 {
@@ -36,11 +40,69 @@ void pipe_wait(struct inode * inode)
 	down(PIPE_SEM(*inode));
 }
 
+/*
+ * A page for pipe_write() to fill.  The last page a reader emptied is
+ * kept around for this, it saves going to the page allocator for every
+ * page which passes through the pipe.
+ */
+struct page *pipe_alloc_page(struct inode *inode)
+{
+	struct page *page = inode->i_pipe->tmp_page;
+
+	if (page) {
+		inode->i_pipe->tmp_page = NULL;
+		return page;
+	}
+	return alloc_page(GFP_HIGHUSER);
+}
+
+void pipe_buf_release(struct inode *inode, struct pipe_buffer *buf)
+{
+	struct page *page = buf->page;
+
+	buf->page = NULL;
+	if ((buf->flags & PIPE_BUF_FLAG_CAN_MERGE) &&
+	    page_count(page) == 1 && !inode->i_pipe->tmp_page) {
+		inode->i_pipe->tmp_page = page;
+		return;
+	}
+	page_cache_release(page);
+}
+
+/* @len bytes of the first buffer have been used up */
+void pipe_consume(struct inode *inode, struct pipe_buffer *buf, size_t len)
+{
+	buf->offset += len;
+	buf->len -= len;
+	if (buf->len)
+		return;
+
+	pipe_buf_release(inode, buf);
+	PIPE_CURBUF(*inode) = (PIPE_CURBUF(*inode) + 1) &
+			      (PIPE_BUFFERS(*inode) - 1);
+	PIPE_NRBUFS(*inode)--;
+}
+
+/* Bytes pipe_write() can take without waiting */
+static size_t pipe_space(struct inode *inode)
+{
+	size_t space;
+
+	space = (PIPE_BUFFERS(*inode) - PIPE_NRBUFS(*inode)) * PAGE_SIZE;
+	if (!PIPE_EMPTY(*inode)) {
+		struct pipe_buffer *buf = PIPE_LAST_BUF(*inode);
+
+		if (buf->flags & PIPE_BUF_FLAG_CAN_MERGE)
+			space += PAGE_SIZE - (buf->offset + buf->len);
+	}
+	return space;
+}
+
 static ssize_t
 pipe_read(struct file *filp, char *buf, size_t count, loff_t *ppos)
 {
 	struct inode *inode = filp->f_dentry->d_inode;
-	ssize_t size, read, ret;
+	ssize_t read, ret;
 
 	/* Seeks are not allowed on pipes.  */
 	ret = -ESPIPE;
@@ -85,30 +147,25 @@ do_more_read:
 
 	/* Read what data is available.  */
 	ret = -EFAULT;
-	while (count > 0 && (size = PIPE_LEN(*inode))) {
-		char *pipebuf = PIPE_BASE(*inode) + PIPE_START(*inode);
-		ssize_t chars = PIPE_MAX_RCHUNK(*inode);
+	while (count > 0 && !PIPE_EMPTY(*inode)) {
+		struct pipe_buffer *pbuf = PIPE_FIRST_BUF(*inode);
+		ssize_t chars = pbuf->len;
+		unsigned long left;
 
 		if (chars > count)
 			chars = count;
-		if (chars > size)
-			chars = size;
 
-		if (copy_to_user(buf, pipebuf, chars))
+		left = copy_to_user(buf, kmap(pbuf->page) + pbuf->offset, chars);
+		kunmap(pbuf->page);
+		if (left)
 			goto out;
 
 		read += chars;
-		PIPE_START(*inode) += chars;
-		PIPE_START(*inode) &= (PIPE_SIZE - 1);
-		PIPE_LEN(*inode) -= chars;
+		pipe_consume(inode, pbuf, chars);
 		count -= chars;
 		buf += chars;
 	}
 
-	/* Cache behaviour optimization */
-	if (!PIPE_LEN(*inode))
-		PIPE_START(*inode) = 0;
-
 	if (count && PIPE_WAITING_WRITERS(*inode) && !(filp->f_flags & O_NONBLOCK)) {
 		/*
 		 * We know that we are going to sleep: signal
@@ -165,10 +222,10 @@ pipe_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
 	/* Wait, or check for, available space.  */
 	if (filp->f_flags & O_NONBLOCK) {
 		ret = -EAGAIN;
-		if (PIPE_FREE(*inode) < free)
+		if (pipe_space(inode) < free)
 			goto out;
 	} else {
-		while (PIPE_FREE(*inode) < free) {
+		while (pipe_space(inode) < free) {
 			PIPE_WAITING_WRITERS(*inode)++;
 			pipe_wait(inode);
 			PIPE_WAITING_WRITERS(*inode)--;
@@ -184,24 +241,62 @@ pipe_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
 	/* Copy into available space.  */
 	ret = -EFAULT;
 	while (count > 0) {
-		int space;
-		char *pipebuf = PIPE_BASE(*inode) + PIPE_END(*inode);
-		ssize_t chars = PIPE_MAX_WCHUNK(*inode);
+		struct pipe_buffer *pbuf;
+		ssize_t chars;
+		unsigned long left;
+
+		/* Top up the last page, if it is ours */
+		if (!PIPE_EMPTY(*inode)) {
+			pbuf = PIPE_LAST_BUF(*inode);
+			chars = PAGE_SIZE - (pbuf->offset + pbuf->len);
+			if ((pbuf->flags & PIPE_BUF_FLAG_CAN_MERGE) && chars) {
+				if (chars > count)
+					chars = count;
+				left = copy_from_user(kmap(pbuf->page) +
+						      pbuf->offset + pbuf->len,
+						      buf, chars);
+				kunmap(pbuf->page);
+				if (left)
+					goto out;
+
+				written += chars;
+				pbuf->len += chars;
+				count -= chars;
+				buf += chars;
+				continue;
+			}
+		}
+
+		if (!PIPE_FULL(*inode)) {
+			struct page *page;
 
-		if ((space = PIPE_FREE(*inode)) != 0) {
+			ret = -ENOMEM;
+			page = pipe_alloc_page(inode);
+			if (!page)
+				goto out;
+
+			chars = PAGE_SIZE;
 			if (chars > count)
 				chars = count;
-			if (chars > space)
-				chars = space;
-
-			if (copy_from_user(pipebuf, buf, chars))
+			left = copy_from_user(kmap(page), buf, chars);
+			kunmap(page);
+			if (left) {
+				inode->i_pipe->tmp_page = page;
+				ret = -EFAULT;
 				goto out;
+			}
+
+			pbuf = PIPE_FREE_BUF(*inode);
+			pbuf->page = page;
+			pbuf->offset = 0;
+			pbuf->len = chars;
+			pbuf->flags = PIPE_BUF_FLAG_CAN_MERGE;
+			PIPE_NRBUFS(*inode)++;
 
 			written += chars;
-			PIPE_LEN(*inode) += chars;
 			count -= chars;
 			buf += chars;
-			space = PIPE_FREE(*inode);
+			ret = -EFAULT;
 			continue;
 		}
 
@@ -223,7 +318,7 @@ pipe_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
 				goto out;
 			if (!PIPE_READERS(*inode))
 				goto sigpipe;
-		} while (!PIPE_FREE(*inode));
+		} while (!pipe_space(inode));
 		ret = -EFAULT;
 	}
 
@@ -263,9 +358,16 @@ static int
 pipe_ioctl(struct inode *pino, struct file *filp,
 	   unsigned int cmd, unsigned long arg)
 {
+	int i, count;
+
 	switch (cmd) {
 		case FIONREAD:
-			return put_user(PIPE_LEN(*pino), (int *)arg);
+			down(PIPE_SEM(*pino));
+			count = 0;
+			for (i = 0; i < PIPE_NRBUFS(*pino); i++)
+				count += PIPE_BUF_NR(*pino, i)->len;
+			up(PIPE_SEM(*pino));
+			return put_user(count, (int *)arg);
 		default:
 			return -EINVAL;
 	}
@@ -281,9 +383,11 @@ pipe_poll(struct file *filp, poll_table *wait)
 	poll_wait(filp, PIPE_WAIT(*inode), wait);
 
 	/* Reading only -- no need for acquiring the semaphore.  */
-	mask = POLLIN | POLLRDNORM;
-	if (PIPE_EMPTY(*inode))
-		mask = POLLOUT | POLLWRNORM;
+	mask = 0;
+	if (!PIPE_EMPTY(*inode))
+		mask |= POLLIN | POLLRDNORM;
+	if (!PIPE_FULL(*inode))
+		mask |= POLLOUT | POLLWRNORM;
 	if (!PIPE_WRITERS(*inode) && filp->f_version != PIPE_WCOUNTER(*inode))
 		mask |= POLLHUP;
 	if (!PIPE_READERS(*inode))
@@ -302,10 +406,7 @@ pipe_release(struct inode *inode, int decr, int decw)
 	PIPE_READERS(*inode) -= decr;
 	PIPE_WRITERS(*inode) -= decw;
 	if (!PIPE_READERS(*inode) && !PIPE_WRITERS(*inode)) {
-		struct pipe_inode_info *info = inode->i_pipe;
-		inode->i_pipe = NULL;
-		free_page((unsigned long) info->base);
-		kfree(info);
+		free_pipe_info(inode);
 	} else {
 		wake_up_interruptible(PIPE_WAIT(*inode));
 	}
@@ -437,29 +538,99 @@ struct file_operations rdwr_pipe_fops = {
 
 struct inode* pipe_new(struct inode* inode)
 {
-	unsigned long page;
+	struct pipe_buffer *bufs;
 
-	page = __get_free_page(GFP_USER);
-	if (!page)
+	bufs = kmalloc(PIPE_DEF_BUFFERS * sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
 		return NULL;
 
 	inode->i_pipe = kmalloc(sizeof(struct pipe_inode_info), GFP_KERNEL);
 	if (!inode->i_pipe)
-		goto fail_page;
+		goto fail_bufs;
 
 	init_waitqueue_head(PIPE_WAIT(*inode));
-	PIPE_BASE(*inode) = (char*) page;
-	PIPE_START(*inode) = PIPE_LEN(*inode) = 0;
+	inode->i_pipe->bufs = bufs;
+	inode->i_pipe->tmp_page = NULL;
+	PIPE_BUFFERS(*inode) = PIPE_DEF_BUFFERS;
+	PIPE_CURBUF(*inode) = PIPE_NRBUFS(*inode) = 0;
 	PIPE_READERS(*inode) = PIPE_WRITERS(*inode) = 0;
 	PIPE_WAITING_READERS(*inode) = PIPE_WAITING_WRITERS(*inode) = 0;
 	PIPE_RCOUNTER(*inode) = PIPE_WCOUNTER(*inode) = 1;
 
 	return inode;
-fail_page:
-	free_page(page);
+fail_bufs:
+	kfree(bufs);
 	return NULL;
 }
 
+void free_pipe_info(struct inode* inode)
+{
+	struct pipe_inode_info *info = inode->i_pipe;
+
+	while (!PIPE_EMPTY(*inode)) {
+		pipe_buf_release(inode, PIPE_FIRST_BUF(*inode));
+		PIPE_CURBUF(*inode) = (PIPE_CURBUF(*inode) + 1) &
+				      (PIPE_BUFFERS(*inode) - 1);
+		PIPE_NRBUFS(*inode)--;
+	}
+	if (info->tmp_page)
+		__free_page(info->tmp_page);
+	inode->i_pipe = NULL;
+	kfree(info->bufs);
+	kfree(info);
+}
+
+/*
+ * F_SETPIPE_SZ and F_GETPIPE_SZ.  The ring holds a power of 2 pages, and
+ * cannot shrink below what is in it.
+ */
+long pipe_fcntl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct pipe_buffer *bufs;
+	unsigned int nr, i;
+	long ret;
+
+	if (!inode->i_pipe)
+		return -EBADF;
+
+	if (cmd == F_GETPIPE_SZ)
+		return PIPE_BUFFERS(*inode) * PAGE_SIZE;
+
+	if (arg > INT_MAX)
+		return -EINVAL;
+	for (nr = 1; nr * PAGE_SIZE < arg; nr <<= 1)
+		;
+	if (nr * PAGE_SIZE > pipe_max_size && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+
+	bufs = kmalloc(nr * sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	down(PIPE_SEM(*inode));
+	ret = -EBUSY;
+	if (!inode->i_pipe || PIPE_NRBUFS(*inode) > nr)
+		goto out;
+
+	for (i = 0; i < PIPE_NRBUFS(*inode); i++)
+		bufs[i] = *PIPE_BUF_NR(*inode, i);
+	kfree(inode->i_pipe->bufs);
+	inode->i_pipe->bufs = bufs;
+	bufs = NULL;
+	PIPE_BUFFERS(*inode) = nr;
+	PIPE_CURBUF(*inode) = 0;
+	ret = nr * PAGE_SIZE;
+
+	/* there may be more room now */
+	wake_up_interruptible(PIPE_WAIT(*inode));
+out:
+	up(PIPE_SEM(*inode));
+	if (bufs)
+		kfree(bufs);
+	return ret;
+}
+
 static struct vfsmount *pipe_mnt;
 static int pipefs_delete_dentry(struct dentry *dentry)
 {
@@ -501,6 +672,21 @@ fail_inode:
 	return NULL;
 }
 
+/*
+ * A pipe without files, which do_splice_direct() moves data through.
+ * It has a reader and a writer, so that nobody waits on it.
+ */
+struct inode *new_internal_pipe(void)
+{
+	return get_pipe_inode();
+}
+
+void free_internal_pipe(struct inode *inode)
+{
+	free_pipe_info(inode);
+	iput(inode);
+}
+
 int do_pipe(int *fd)
 {
 	struct qstr this;
@@ -571,9 +757,7 @@ close_f12_inode_i_j:
 close_f12_inode_i:
 	put_unused_fd(i);
 close_f12_inode:
-	free_page((unsigned long) PIPE_BASE(*inode));
-	kfree(inode->i_pipe);
-	inode->i_pipe = NULL;
+	free_pipe_info(inode);
 	iput(inode);
 close_f12:
 	put_filp(f2);
@@ -627,3 +627,12 @@ int proc_pid_cpu(struct task_struct *task, char * buffer)
 	return len;
 }
 #endif
+
+/*
+ * The CPUs the task may run on, as sched_getaffinity() reports them.
+ */
+int proc_pid_affinity(struct task_struct *task, char * buffer)
+{
+	return sprintf(buffer, "%0*lx\n", (int) (2 * sizeof(unsigned long)),
+		       task->cpus_allowed & cpu_online_map);
+}
@@ -0,0 +1,630 @@
+/*
+ *  linux/fs/splice.c
+ *
+ *  splice() and tee(): moving data into, out of and between pipes by
+ *  passing page references around instead of copying.
+ *
+ *  A pipe buffer is a reference to (a piece of) a page, see pipe_fs_i.h.
+ *  Splicing a page-cache file into a pipe just takes references on the
+ *  page-cache pages.  Splicing a pipe into a socket hands its pages to
+ *  ->sendpage(), which for a scatter-gather capable device sends them
+ *  without touching the data.  Pipe to pipe and tee() move or duplicate
+ *  the buffers themselves.  Everything else goes through ->read() or
+ *  ->write() with a kernel buffer, one copy instead of two.
+ *
+ *  A spliced page-cache page is not a snapshot: if the file is written
+ *  to before the reader gets to it, the reader sees the new data.
+ */
+
+#include <linux/mm.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/smp_lock.h>
+#include <linux/dnotify.h>
+
+#include <asm/uaccess.h>
+
+/*
+ * Wait for a free buffer in @pipe, whose semaphore we hold.  Returns 1
+ * when there is one.
+ */
+static int pipe_wait_space(struct inode *pipe, unsigned int flags)
+{
+	for (;;) {
+		if (!PIPE_READERS(*pipe)) {
+			send_sig(SIGPIPE, current, 0);
+			return -EPIPE;
+		}
+		if (!PIPE_FULL(*pipe))
+			return 1;
+		if (flags & SPLICE_F_NONBLOCK)
+			return -EAGAIN;
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		PIPE_WAITING_WRITERS(*pipe)++;
+		pipe_wait(pipe);
+		PIPE_WAITING_WRITERS(*pipe)--;
+	}
+}
+
+/*
+ * Wait for data in @pipe, whose semaphore we hold.  Returns 1 when
+ * there is some, 0 when there are no writers left to give any.
+ */
+static int pipe_wait_data(struct inode *pipe, unsigned int flags)
+{
+	for (;;) {
+		if (!PIPE_EMPTY(*pipe))
+			return 1;
+		if (!PIPE_WRITERS(*pipe))
+			return 0;
+		if (flags & SPLICE_F_NONBLOCK)
+			return -EAGAIN;
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		PIPE_WAITING_READERS(*pipe)++;
+		pipe_wait(pipe);
+		PIPE_WAITING_READERS(*pipe)--;
+	}
+}
+
+/*
+ * Take the semaphores of two pipes, always in the same order so that
+ * two processes splicing in opposite directions cannot deadlock.
+ */
+static int double_pipe_down(struct inode *a, struct inode *b)
+{
+	if (a > b) {
+		struct inode *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	if (down_interruptible(PIPE_SEM(*a)))
+		return -ERESTARTSYS;
+	if (down_interruptible(PIPE_SEM(*b))) {
+		up(PIPE_SEM(*a));
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+static void double_pipe_up(struct inode *a, struct inode *b)
+{
+	up(PIPE_SEM(*a));
+	up(PIPE_SEM(*b));
+}
+
+/*
+ * Lock both pipes and wait until @ipipe has data and @opipe has room.
+ * Returns 1 with both semaphores held; otherwise with neither, and 0
+ * at end of file or an error.  Only one semaphore is kept while asleep,
+ * that of the pipe we are waiting for.
+ */
+static int double_pipe_wait(struct inode *ipipe, struct inode *opipe,
+			    unsigned int flags)
+{
+	int ret;
+
+	for (;;) {
+		ret = double_pipe_down(ipipe, opipe);
+		if (ret)
+			return ret;
+
+		if (!PIPE_READERS(*opipe)) {
+			send_sig(SIGPIPE, current, 0);
+			ret = -EPIPE;
+			break;
+		}
+		if (PIPE_EMPTY(*ipipe)) {
+			ret = 0;
+			if (!PIPE_WRITERS(*ipipe))
+				break;
+			ret = -EAGAIN;
+			if (flags & SPLICE_F_NONBLOCK)
+				break;
+			up(PIPE_SEM(*opipe));
+			PIPE_WAITING_READERS(*ipipe)++;
+			pipe_wait(ipipe);
+			PIPE_WAITING_READERS(*ipipe)--;
+			up(PIPE_SEM(*ipipe));
+		} else if (PIPE_FULL(*opipe)) {
+			ret = -EAGAIN;
+			if (flags & SPLICE_F_NONBLOCK)
+				break;
+			up(PIPE_SEM(*ipipe));
+			PIPE_WAITING_WRITERS(*opipe)++;
+			pipe_wait(opipe);
+			PIPE_WAITING_WRITERS(*opipe)--;
+			up(PIPE_SEM(*opipe));
+		} else
+			return 1;
+
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+	double_pipe_up(ipipe, opipe);
+	return ret;
+}
+
+/*
+ * do_generic_file_read() actor: hang the page-cache page off the next
+ * free buffer of the pipe in desc->buf.
+ */
+static int pipe_splice_actor(read_descriptor_t * desc, struct page *page,
+			     unsigned long offset, unsigned long size)
+{
+	struct inode *pipe = (struct inode *) desc->buf;
+	struct pipe_buffer *buf;
+
+	if (PIPE_FULL(*pipe)) {
+		desc->count = 0;
+		return 0;
+	}
+	if (size > desc->count)
+		size = desc->count;
+
+	get_page(page);
+	buf = PIPE_FREE_BUF(*pipe);
+	buf->page = page;
+	buf->offset = offset;
+	buf->len = size;
+	buf->flags = 0;
+	PIPE_NRBUFS(*pipe)++;
+
+	desc->count -= size;
+	desc->written += size;
+	return size;
+}
+
+/*
+ * Fill the free buffers of @pipe from a file without a usable page
+ * cache, a socket say, through its ->read().
+ */
+static long read_into_pipe(struct file *in, loff_t *ppos, struct inode *pipe,
+			   size_t len)
+{
+	mm_segment_t old_fs;
+	long ret = 0;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (len && !PIPE_FULL(*pipe)) {
+		struct pipe_buffer *buf;
+		struct page *page;
+		size_t chars = PAGE_SIZE;
+		ssize_t n;
+
+		page = pipe_alloc_page(pipe);
+		if (!page) {
+			if (!ret)
+				ret = -ENOMEM;
+			break;
+		}
+		if (chars > len)
+			chars = len;
+		n = in->f_op->read(in, kmap(page), chars, ppos);
+		kunmap(page);
+		if (n <= 0) {
+			pipe->i_pipe->tmp_page = page;
+			if (!ret)
+				ret = n;
+			break;
+		}
+
+		buf = PIPE_FREE_BUF(*pipe);
+		buf->page = page;
+		buf->offset = 0;
+		buf->len = n;
+		buf->flags = PIPE_BUF_FLAG_CAN_MERGE;
+		PIPE_NRBUFS(*pipe)++;
+
+		ret += n;
+		len -= n;
+		/* a short read: don't block for more */
+		if (n < chars)
+			break;
+	}
+	set_fs(old_fs);
+	return ret;
+}
+
+/**
+ * do_splice_to - move data from a file into a pipe
+ * @in: the file, open for reading
+ * @ppos: where in @in to start, updated
+ * @pipe: the pipe's inode
+ * @len: at most this many bytes
+ * @flags: %SPLICE_F_*
+ *
+ * Waits for at least one free buffer in @pipe, then fills as many as
+ * there are.  Returns the number of bytes moved, 0 at the end of @in.
+ */
+long do_splice_to(struct file *in, loff_t *ppos, struct inode *pipe,
+		  size_t len, unsigned int flags)
+{
+	struct address_space *mapping = in->f_dentry->d_inode->i_mapping;
+	long ret;
+
+	ret = -EINVAL;
+	if (!in->f_op || !in->f_op->read)
+		goto out_nolock;
+
+	ret = -ERESTARTSYS;
+	if (down_interruptible(PIPE_SEM(*pipe)))
+		goto out_nolock;
+
+	ret = pipe_wait_space(pipe, flags);
+	if (ret <= 0)
+		goto out;
+
+	if (mapping->a_ops->readpage && !(in->f_flags & O_DIRECT)) {
+		read_descriptor_t desc;
+
+		desc.written = 0;
+		desc.count = len;
+		desc.buf = (char *) pipe;
+		desc.error = 0;
+		do_generic_file_read(in, ppos, &desc, pipe_splice_actor);
+
+		ret = desc.written;
+		if (!ret)
+			ret = desc.error;
+	} else
+		ret = read_into_pipe(in, ppos, pipe, len);
+
+	if (ret > 0)
+		wake_up_interruptible(PIPE_WAIT(*pipe));
+out:
+	up(PIPE_SEM(*pipe));
+out_nolock:
+	return ret;
+}
+
+/**
+ * do_splice_from - move data from a pipe into a file
+ * @pipe: the pipe's inode
+ * @out: the file, open for writing
+ * @ppos: where in @out to start, updated
+ * @len: at most this many bytes
+ * @flags: %SPLICE_F_*
+ *
+ * Waits for data in @pipe, then writes out what there is.  Returns the
+ * number of bytes moved, 0 if the pipe is empty and has no writers.
+ */
+long do_splice_from(struct inode *pipe, struct file *out, loff_t *ppos,
+		    size_t len, unsigned int flags)
+{
+	long ret, written = 0;
+
+	ret = -EINVAL;
+	if (!out->f_op || !out->f_op->write)
+		goto out_nolock;
+
+	ret = -ERESTARTSYS;
+	if (down_interruptible(PIPE_SEM(*pipe)))
+		goto out_nolock;
+
+	ret = pipe_wait_data(pipe, flags);
+	if (ret <= 0)
+		goto out;
+
+	while (len && !PIPE_EMPTY(*pipe)) {
+		struct pipe_buffer *buf = PIPE_FIRST_BUF(*pipe);
+		size_t chars = buf->len;
+
+		if (chars > len)
+			chars = len;
+
+		if (out->f_op->sendpage) {
+			int more = chars < len || (flags & SPLICE_F_MORE);
+
+			ret = out->f_op->sendpage(out, buf->page, buf->offset,
+						  chars, ppos, more);
+		} else {
+			mm_segment_t old_fs;
+
+			old_fs = get_fs();
+			set_fs(KERNEL_DS);
+			ret = out->f_op->write(out, kmap(buf->page) + buf->offset,
+					       chars, ppos);
+			kunmap(buf->page);
+			set_fs(old_fs);
+		}
+		if (ret <= 0)
+			break;
+
+		written += ret;
+		len -= ret;
+		pipe_consume(pipe, buf, ret);
+		if (ret < chars)
+			break;
+	}
+
+	if (written) {
+		ret = written;
+		wake_up_interruptible(PIPE_WAIT(*pipe));
+	}
+out:
+	up(PIPE_SEM(*pipe));
+out_nolock:
+	return ret;
+}
+
+/**
+ * do_splice_direct - move data between two files which are not pipes
+ * @in: the file to read, open for reading
+ * @ppos: where in @in to start, updated
+ * @out: the file to write at its f_pos, open for writing
+ * @len: at most this many bytes
+ *
+ * The data goes through a private pipe, a ring of pages at a time.
+ * If @out takes less than was read, *@ppos is wound back to match;
+ * that only helps if @in is seekable, from a socket the rest is lost.
+ */
+long do_splice_direct(struct file *in, loff_t *ppos, struct file *out,
+		      size_t len)
+{
+	struct inode *pipe;
+	long ret = 0, bytes = 0;
+
+	pipe = new_internal_pipe();
+	if (!pipe)
+		return -ENOMEM;
+
+	while (len) {
+		loff_t pos = *ppos;
+		long read, done = 0;
+
+		ret = do_splice_to(in, ppos, pipe, len, 0);
+		if (ret <= 0)
+			break;
+		read = ret;
+
+		while (done < read) {
+			unsigned int flags = read < len ? SPLICE_F_MORE : 0;
+
+			ret = do_splice_from(pipe, out, &out->f_pos,
+					     read - done, flags);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+
+		bytes += done;
+		len -= done;
+		if (done < read) {
+			*ppos = pos + done;
+			break;
+		}
+		if (signal_pending(current))
+			break;
+	}
+
+	free_internal_pipe(pipe);
+	if (bytes)
+		return bytes;
+	return ret;
+}
+
+/*
+ * Move buffers from one pipe to another, splitting the last one if
+ * @len ends inside it.  Both pipes are locked, in address order; they
+ * must not be the same.
+ */
+long splice_pipe_to_pipe(struct inode *ipipe, struct inode *opipe,
+				size_t len, unsigned int flags)
+{
+	long ret;
+
+	ret = double_pipe_wait(ipipe, opipe, flags);
+	if (ret <= 0)
+		return ret;
+
+	ret = 0;
+	while (len && !PIPE_EMPTY(*ipipe) && !PIPE_FULL(*opipe)) {
+		struct pipe_buffer *ibuf = PIPE_FIRST_BUF(*ipipe);
+		struct pipe_buffer *obuf = PIPE_FREE_BUF(*opipe);
+
+		*obuf = *ibuf;
+		if (ibuf->len <= len) {
+			ibuf->page = NULL;
+			PIPE_CURBUF(*ipipe) = (PIPE_CURBUF(*ipipe) + 1) &
+					      (PIPE_BUFFERS(*ipipe) - 1);
+			PIPE_NRBUFS(*ipipe)--;
+		} else {
+			/* both pipes now look at the page: neither may append */
+			get_page(obuf->page);
+			obuf->len = len;
+			obuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+			ibuf->offset += len;
+			ibuf->len -= len;
+		}
+		PIPE_NRBUFS(*opipe)++;
+
+		ret += obuf->len;
+		len -= obuf->len;
+	}
+
+	wake_up_interruptible(PIPE_WAIT(*ipipe));
+	wake_up_interruptible(PIPE_WAIT(*opipe));
+	double_pipe_up(ipipe, opipe);
+	return ret;
+}
+
+/*
+ * Duplicate the buffers of one pipe into another, leaving the first
+ * pipe as it was.
+ */
+static long do_tee(struct inode *ipipe, struct inode *opipe, size_t len,
+		   unsigned int flags)
+{
+	unsigned int i;
+	long ret;
+
+	ret = double_pipe_wait(ipipe, opipe, flags);
+	if (ret <= 0)
+		return ret;
+
+	ret = 0;
+	for (i = 0; len && i < PIPE_NRBUFS(*ipipe) && !PIPE_FULL(*opipe); i++) {
+		struct pipe_buffer *ibuf = PIPE_BUF_NR(*ipipe, i);
+		struct pipe_buffer *obuf = PIPE_FREE_BUF(*opipe);
+
+		ibuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+		*obuf = *ibuf;
+		get_page(obuf->page);
+		if (obuf->len > len)
+			obuf->len = len;
+		PIPE_NRBUFS(*opipe)++;
+
+		ret += obuf->len;
+		len -= obuf->len;
+	}
+
+	wake_up_interruptible(PIPE_WAIT(*opipe));
+	double_pipe_up(ipipe, opipe);
+	return ret;
+}
+
+static inline struct inode *file_pipe(struct file *file)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+
+	return inode->i_pipe ? inode : NULL;
+}
+
+/*
+ * One side of a splice has to be a pipe.  Offsets are only allowed on
+ * the other side, and only if it is seekable.
+ */
+asmlinkage long sys_splice(int fd_in, loff_t *off_in, int fd_out,
+			   loff_t *off_out, size_t len, unsigned int flags)
+{
+	struct file *in, *out;
+	struct inode *ipipe, *opipe;
+	loff_t pos, *ppos;
+	long ret;
+
+	if (!len)
+		return 0;
+
+	ret = -EBADF;
+	in = fget(fd_in);
+	if (!in)
+		goto out;
+	if (!(in->f_mode & FMODE_READ))
+		goto fput_in;
+	out = fget(fd_out);
+	if (!out)
+		goto fput_in;
+	if (!(out->f_mode & FMODE_WRITE))
+		goto fput_out;
+
+	ipipe = file_pipe(in);
+	opipe = file_pipe(out);
+
+	if (ipipe && opipe) {
+		ret = -ESPIPE;
+		if (off_in || off_out)
+			goto fput_out;
+		ret = -EINVAL;
+		if (ipipe == opipe)
+			goto fput_out;
+		ret = splice_pipe_to_pipe(ipipe, opipe, len, flags);
+		goto fput_out;
+	}
+
+	ret = -EINVAL;
+	if (!ipipe && !opipe)
+		goto fput_out;
+
+	if (ipipe) {
+		ret = -ESPIPE;
+		if (off_in)
+			goto fput_out;
+		ppos = &out->f_pos;
+		if (off_out) {
+			if (!out->f_op || !out->f_op->llseek)
+				goto fput_out;
+			ret = -EFAULT;
+			if (copy_from_user(&pos, off_out, sizeof(loff_t)))
+				goto fput_out;
+			ppos = &pos;
+		}
+		ret = rw_verify_area(WRITE, out, ppos, len);
+		if (ret)
+			goto fput_out;
+		ret = do_splice_from(ipipe, out, ppos, len, flags);
+		if (ret > 0)
+			dnotify_parent(out->f_dentry, DN_MODIFY);
+		if (off_out && put_user(pos, off_out))
+			ret = -EFAULT;
+	} else {
+		ret = -ESPIPE;
+		if (off_out)
+			goto fput_out;
+		ppos = &in->f_pos;
+		if (off_in) {
+			if (!in->f_op || !in->f_op->llseek)
+				goto fput_out;
+			ret = -EFAULT;
+			if (copy_from_user(&pos, off_in, sizeof(loff_t)))
+				goto fput_out;
+			ppos = &pos;
+		}
+		ret = rw_verify_area(READ, in, ppos, len);
+		if (ret)
+			goto fput_out;
+		ret = do_splice_to(in, ppos, opipe, len, flags);
+		if (ret > 0)
+			dnotify_parent(in->f_dentry, DN_ACCESS);
+		if (off_in && put_user(pos, off_in))
+			ret = -EFAULT;
+	}
+
+fput_out:
+	fput(out);
+fput_in:
+	fput(in);
+out:
+	return ret;
+}
+
+asmlinkage long sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+	struct file *in, *out;
+	struct inode *ipipe, *opipe;
+	long ret;
+
+	if (!len)
+		return 0;
+
+	ret = -EBADF;
+	in = fget(fd_in);
+	if (!in)
+		goto out;
+	if (!(in->f_mode & FMODE_READ))
+		goto fput_in;
+	out = fget(fd_out);
+	if (!out)
+		goto fput_in;
+	if (!(out->f_mode & FMODE_WRITE))
+		goto fput_out;
+
+	ret = -EINVAL;
+	ipipe = file_pipe(in);
+	opipe = file_pipe(out);
+	if (!ipipe || !opipe || ipipe == opipe)
+		goto fput_out;
+
+	ret = do_tee(ipipe, opipe, len, flags);
+
+fput_out:
+	fput(out);
+fput_in:
+	fput(in);
+out:
+	return ret;
+}
@@ -257,6 +257,13 @@
 #define __NR_alloc_hugepages	250
 #define __NR_free_hugepages	251
 #define __NR_exit_group		252
+#define __NR_lookup_dcookie	253
+#define __NR_epoll_create	254
+#define __NR_epoll_ctl		255
+#define __NR_epoll_wait		256
+
+#define __NR_splice		313
+#define __NR_tee		315
 
 /* user-visible error numbers are in the range -1 - -124: see <asm-i386/errno.h> */
 
@@ -0,0 +1,124 @@
+/*
+ *  include/linux/aio.h
+ *
+ *  Kernel asynchronous I/O.  See fs/aio.c.
+ */
+
+#ifndef _LINUX_AIO_H
+#define _LINUX_AIO_H
+
+#include <linux/aio_abi.h>
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/tqueue.h>
+#include <linux/time.h>
+#include <asm/atomic.h>
+
+struct kioctx;
+struct kiobuf;
+struct file;
+struct page;
+struct mm_struct;
+
+/*
+ * One request.  It lives from io_submit() until its completion has
+ * been written to the ring.  ki_list links it onto the aiod run list
+ * while it waits for a thread to execute it.
+ */
+struct kiocb {
+	struct list_head	ki_list;
+	struct kioctx		*ki_ctx;
+	struct file		*ki_filp;
+	struct iocb		*ki_user_iocb;	/* for io_cancel() and the event */
+	__u64			ki_user_data;	/* returned in the event */
+	unsigned short		ki_opcode;	/* IOCB_CMD_* */
+
+	char			*ki_buf;
+	size_t			ki_nbytes;
+	loff_t			ki_pos;
+
+	/* O_DIRECT requests */
+	struct kiobuf		*ki_iobuf;
+	ssize_t			ki_res;		/* bytes submitted */
+	struct tq_struct	ki_tq;		/* completes in process context */
+};
+
+/*
+ * The completion ring.  It is mapped into the process, so that
+ * userland can reap events without a system call, and pinned, so
+ * that completions can write to it from any context.
+ */
+#define AIO_RING_MAGIC			0xa10a10a1
+#define AIO_RING_COMPAT_FEATURES	1
+#define AIO_RING_INCOMPAT_FEATURES	0
+
+struct aio_ring {
+	unsigned	id;		/* kernel internal index number */
+	unsigned	nr;		/* number of io_events */
+	unsigned	head;		/* written by userland or io_getevents() */
+	unsigned	tail;		/* written by the kernel */
+
+	unsigned	magic;
+	unsigned	compat_features;
+	unsigned	incompat_features;
+	unsigned	header_length;	/* size of aio_ring */
+
+	struct io_event	io_events[0];
+};
+
+struct aio_ring_info {
+	unsigned long		mmap_base;
+	unsigned long		mmap_size;
+
+	struct page		**ring_pages;
+	spinlock_t		ring_lock;
+	long			nr_pages;
+
+	unsigned		nr, tail;
+};
+
+/* Cached kiobufs per context, they are expensive to set up */
+#define AIO_IOBUF_CACHE	8
+
+struct kioctx {
+	atomic_t		users;
+	int			dead;
+	struct mm_struct	*mm;
+	struct list_head	list;		/* on mm->ioctx_list */
+
+	/* The aio_context_t handed to userland */
+	unsigned long		user_id;
+
+	wait_queue_head_t	wait;		/* completions wake this */
+
+	spinlock_t		ctx_lock;
+	int			reqs_active;
+	unsigned		max_reqs;
+
+	struct kiobuf		*iobufs[AIO_IOBUF_CACHE];
+	int			nr_iobufs;
+
+	struct aio_ring_info	ring_info;
+};
+
+extern void exit_aio(struct mm_struct *mm);
+
+asmlinkage long sys_io_setup(unsigned nr_events, aio_context_t *ctxp);
+asmlinkage long sys_io_destroy(aio_context_t ctx);
+asmlinkage long sys_io_submit(aio_context_t ctx_id, long nr,
+			      struct iocb **iocbpp);
+asmlinkage long sys_io_cancel(aio_context_t ctx_id, struct iocb *iocb,
+			      struct io_event *result);
+asmlinkage long sys_io_getevents(aio_context_t ctx_id, long min_nr, long nr,
+				 struct io_event *events,
+				 struct timespec *timeout);
+
+extern int aio_max_nr, aio_nr;
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_AIO_H */
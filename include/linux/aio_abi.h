@@ -0,0 +1,67 @@
+/*
+ *  include/linux/aio_abi.h
+ *
+ *  The user visible side of kernel asynchronous I/O: io_setup(2),
+ *  io_destroy(2), io_submit(2), io_cancel(2), io_getevents(2).
+ */
+
+#ifndef _LINUX_AIO_ABI_H
+#define _LINUX_AIO_ABI_H
+
+#include <linux/types.h>
+#include <asm/byteorder.h>
+
+/* The handle io_setup() returns: the address of the completion ring */
+typedef unsigned long	aio_context_t;
+
+/* Valid aio_lio_opcode values */
+enum {
+	IOCB_CMD_PREAD = 0,
+	IOCB_CMD_PWRITE = 1,
+	IOCB_CMD_FSYNC = 2,
+	IOCB_CMD_FDSYNC = 3,
+};
+
+/* A completion, as read back by io_getevents() */
+struct io_event {
+	__u64		data;		/* the aio_data of the iocb */
+	__u64		obj;		/* the user address of the iocb */
+	__s64		res;		/* result code, as for read(2) etc. */
+	__s64		res2;		/* secondary result */
+};
+
+#if defined(__LITTLE_ENDIAN)
+#define PADDED(x, y)	x, y
+#elif defined(__BIG_ENDIAN)
+#define PADDED(x, y)	y, x
+#else
+#error edit for your odd byteorder.
+#endif
+
+/*
+ * An I/O request.  The layout is the same for 32 and 64 bit userland,
+ * the reserved fields must be zero.
+ */
+struct iocb {
+	/* these are internal to the kernel/libc. */
+	__u64	aio_data;	/* data to be returned in event's data */
+	__u32	PADDED(aio_key, aio_reserved1);
+				/* the kernel sets aio_key to the req # */
+
+	/* common fields */
+	__u16	aio_lio_opcode;	/* see IOCB_CMD_ above */
+	__s16	aio_reqprio;
+	__u32	aio_fildes;
+
+	__u64	aio_buf;
+	__u64	aio_nbytes;
+	__s64	aio_offset;
+
+	/* extra parameters */
+	__u64	aio_reserved2;
+	__u64	aio_reserved3;
+};
+
+#undef PADDED
+
+#endif /* _LINUX_AIO_ABI_H */
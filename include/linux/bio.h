@@ -0,0 +1,83 @@
+/*
+ *  include/linux/bio.h
+ *
+ *  Multi-page block I/O descriptors.  See fs/bio.c.
+ */
+
+#ifndef _LINUX_BIO_H
+#define _LINUX_BIO_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/kdev_t.h>
+#include <asm/atomic.h>
+
+struct page;
+struct buffer_head;
+
+/*
+ * One segment of a bio: a piece of a page.  The length and offset
+ * are multiples of 512 bytes.
+ */
+struct bio_vec {
+	struct page	*bv_page;
+	unsigned int	bv_len;
+	unsigned int	bv_offset;
+};
+
+struct bio;
+typedef void (bio_end_io_t)(struct bio *, int);
+
+/*
+ * A bio describes a transfer between a run of sectors on one device
+ * and an arbitrary list of page segments.  It is handed to the block
+ * layer in one go by submit_bio(), which only breaks it up where a
+ * request would grow beyond the queue's max_sectors or max_segments.
+ *
+ * The drivers still see buffer_heads: submit_bio() hangs one of them
+ * off each segment, and the bio completes when the last of those has.
+ */
+struct bio {
+	kdev_t			bi_dev;
+	unsigned long		bi_sector;	/* first sector on bi_dev */
+	struct bio		*bi_next;	/* for the owner's lists */
+	unsigned long		bi_flags;
+
+	unsigned short		bi_vcnt;	/* segments in use */
+	unsigned short		bi_max_vecs;	/* segments allocated */
+	unsigned int		bi_size;	/* bytes, sum of bv_len */
+
+	atomic_t		bi_cnt;		/* references */
+	atomic_t		bi_remaining;	/* buffer_heads in flight */
+
+	bio_end_io_t		*bi_end_io;
+	void			*bi_private;
+
+	struct bio_vec		*bi_io_vec;
+};
+
+/* bi_flags */
+#define BIO_UPTODATE	0	/* cleared by an I/O error */
+#define BIO_SYNC	1	/* unplug the queue once it is submitted */
+
+/* Keeps a bio, with its segments, within a page */
+#define BIO_MAX_VECS	256
+
+extern struct bio *bio_alloc(int gfp_mask, int nr_vecs);
+extern void bio_put(struct bio *);
+extern int bio_add_page(struct bio *, struct page *, unsigned int len,
+			unsigned int offset);
+extern struct buffer_head *bio_to_bh(int rw, struct bio *);
+extern void submit_bio(int rw, struct bio *);
+
+static inline void bio_get(struct bio *bio)
+{
+	atomic_inc(&bio->bi_cnt);
+}
+
+#define bio_sectors(bio)	((bio)->bi_size >> 9)
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_BIO_H */
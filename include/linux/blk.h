@@ -86,7 +86,15 @@ void initrd_init(void);
 
 static inline void blkdev_dequeue_request(struct request * req)
 {
+	request_queue_t *q = req->q;
+
 	list_del(&req->queue);
+	if (q) {
+		q->elevator.nr_dispatched++;
+		/* give the driver the next one, if the elevator holds any */
+		if (q->elevator.nr_queued && list_empty(&q->queue_head))
+			elevator_dispatch(q);
+	}
 }
 
 int end_that_request_first(struct request *req, int uptodate, char *name);
@@ -46,6 +46,10 @@ struct request {
 	struct buffer_head * bh;
 	struct buffer_head * bhtail;
 	request_queue_t *q;
+
+	/* for the deadline and anticipatory elevators */
+	struct list_head fifo;
+	pid_t pid;
 };
 
 #include <linux/elevator.h>
@@ -147,10 +151,10 @@ struct request_queue
 	unsigned long		bounce_pfn;
 
 	/*
-	 * Is meant to protect the queue in the future instead of
-	 * io_request_lock
+	 * Protects the queue: io_request_lock, unless the driver has
+	 * asked for one of its own (blk_queue_lock())
 	 */
-	spinlock_t		queue_lock;
+	spinlock_t		* queue_lock;
 
 	/*
 	 * Tasks wait here for free read and write requests
@@ -161,6 +165,7 @@ struct request_queue
 #define blk_queue_plugged(q)	(q)->plugged
 #define blk_fs_request(rq)	((rq)->cmd == READ || (rq)->cmd == WRITE)
 #define blk_queue_empty(q)	list_empty(&(q)->queue_head)
+#define elevator_queue_empty(q)	(blk_queue_empty(q) && !(q)->elevator.nr_queued)
 
 extern inline int rq_data_dir(struct request *rq)
 {
@@ -243,6 +248,7 @@ extern int blk_grow_request_list(request_queue_t *q, int nr_requests, int max_qu
 extern void blk_init_queue(request_queue_t *, request_fn_proc *);
 extern void blk_cleanup_queue(request_queue_t *);
 extern void blk_queue_headactive(request_queue_t *, int);
+extern void blk_queue_lock(request_queue_t *, spinlock_t *);
 extern void blk_queue_throttle_sectors(request_queue_t *, int);
 extern void blk_queue_make_request(request_queue_t *, make_request_fn *);
 extern void generic_unplug_device(void *);
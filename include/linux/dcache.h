@@ -6,6 +6,8 @@
 #include <asm/atomic.h>
 #include <linux/mount.h>
 #include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 
 /*
  * linux/include/linux/dcache.h
@@ -67,6 +69,7 @@ static __inline__ unsigned int full_name_hash(const unsigned char * name, unsign
 struct dentry {
 	atomic_t d_count;
 	unsigned int d_flags;
+	spinlock_t d_lock;		/* per dentry lock, see fs/dcache.c */
 	struct inode  * d_inode;	/* Where the name belongs to - NULL is negative */
 	struct dentry * d_parent;	/* parent directory */
 	struct list_head d_hash;	/* lookup hash list */
@@ -81,6 +84,7 @@ struct dentry {
 	struct super_block * d_sb;	/* The root of the dentry tree */
 	unsigned long d_vfs_flags;
 	void * d_fsdata;		/* fs-specific data */
+	struct rcu_head d_rcu;
 	unsigned char d_iname[DNAME_INLINE_LEN]; /* small names */
 };
 
@@ -105,10 +109,12 @@ locking rules:
 		big lock	dcache_lock	may block
 d_revalidate:	no		no		yes
 d_hash		no		no		yes
-d_compare:	no		yes		no
+d_compare:	no		no		no
 d_delete:	no		yes		no
 d_release:	no		no		yes
 d_iput:		no		no		yes
+
+d_compare is called with the d_lock of the dentry being compared held.
  */
 
 /* d_flags entries */
@@ -127,6 +133,20 @@ d_iput:		no		no		yes
 
 extern spinlock_t dcache_lock;
 
+/**
+ *	d_unhashed -	is dentry hashed
+ *	@dentry: entry to check
+ *
+ *	Returns true if the dentry passed is not currently hashed.
+ *	Lookups walk the hash chains without dcache_lock, so an unhashed
+ *	dentry keeps its ->d_hash.next and is marked by a NULL ->d_hash.prev.
+ */
+ 
+static __inline__ int d_unhashed(struct dentry *dentry)
+{
+	return dentry->d_hash.prev == NULL;
+}
+
 /**
  * d_drop - drop a dentry
  * @dentry: dentry to drop
@@ -144,11 +164,18 @@ extern spinlock_t dcache_lock;
  * timeouts or autofs deletes).
  */
 
+static __inline__ void __d_drop(struct dentry * dentry)
+{
+	if (!d_unhashed(dentry))
+		list_del_rcu(&dentry->d_hash);
+}
+
 static __inline__ void d_drop(struct dentry * dentry)
 {
 	spin_lock(&dcache_lock);
-	list_del(&dentry->d_hash);
-	INIT_LIST_HEAD(&dentry->d_hash);
+	spin_lock(&dentry->d_lock);
+	__d_drop(dentry);
+	spin_unlock(&dentry->d_lock);
 	spin_unlock(&dcache_lock);
 }
 
@@ -253,18 +280,6 @@ static __inline__ struct dentry * dget(struct dentry *dentry)
 
 extern struct dentry * dget_locked(struct dentry *);
 
-/**
- *	d_unhashed -	is dentry hashed
- *	@dentry: entry to check
- *
- *	Returns true if the dentry passed is not currently hashed.
- */
- 
-static __inline__ int d_unhashed(struct dentry *dentry)
-{
-	return list_empty(&dentry->d_hash);
-}
-
 extern void dput(struct dentry *);
 
 static __inline__ int d_mountpoint(struct dentry *dentry)
@@ -0,0 +1,28 @@
+/*
+ * dirhash.h
+ * Name hashes of indexed directories, see linux/lib/dirhash.c
+ */
+#ifndef _LINUX_DIRHASH_H
+#define _LINUX_DIRHASH_H
+
+#include <linux/types.h>
+
+/* Values of the hash_version field of the index root */
+#define DX_HASH_LEGACY		0
+#define DX_HASH_HALF_MD4	1
+#define DX_HASH_TEA		2
+
+struct dx_hash_info
+{
+	u32		hash;
+	u32		minor_hash;
+	int		hash_version;
+	u32		*seed;
+};
+
+/* Readdir's position past the last hash; no name hashes to it */
+#define DX_HASH_EOF	0x7fffffff
+
+extern int dx_hash(const char *name, int len, struct dx_hash_info *hinfo);
+
+#endif /* _LINUX_DIRHASH_H */
@@ -12,6 +12,21 @@ typedef void (elevator_merge_cleanup_fn) (request_queue_t *, struct request *, i
 
 typedef void (elevator_merge_req_fn) (struct request *, struct request *);
 
+typedef void (elevator_add_req_fn) (request_queue_t *, struct request *);
+typedef struct request *(elevator_next_req_fn) (request_queue_t *);
+typedef void (elevator_completed_req_fn) (request_queue_t *, struct request *);
+typedef struct list_head *(elevator_list_fn) (request_queue_t *, struct request *);
+typedef void (elevator_drain_fn) (request_queue_t *);
+typedef int (elevator_init_fn) (request_queue_t *, elevator_t *);
+typedef void (elevator_exit_fn) (elevator_t *);
+
+/*
+ * noop and linus sort requests straight into queue_head, where the
+ * driver finds them.  deadline and anticipatory hold requests back on
+ * lists of their own and hand the driver one at a time, whenever
+ * queue_head runs empty (see elevator_dispatch()).  The hooks from
+ * elevator_add_req_fn on are only used by the latter.
+ */
 struct elevator_s
 {
 	int read_latency;
@@ -20,7 +35,26 @@ struct elevator_s
 	elevator_merge_fn *elevator_merge_fn;
 	elevator_merge_req_fn *elevator_merge_req_fn;
 
+	int elevator_type;
+	const char *elevator_name;
+
+	elevator_add_req_fn *elevator_add_req_fn;
+	elevator_next_req_fn *elevator_next_req_fn;
+	elevator_completed_req_fn *elevator_completed_req_fn;
+	elevator_list_fn *elevator_list_fn;
+	elevator_drain_fn *elevator_drain_fn;
+	elevator_init_fn *elevator_init_fn;
+	elevator_exit_fn *elevator_exit_fn;
+
+	void *elevator_data;
+	unsigned int nr_queued;		/* requests held back from queue_head */
+
 	unsigned int queue_ID;
+
+	/* Statistics, in /proc/elevator */
+	unsigned long nr_dispatched;
+	unsigned long nr_merged;
+	unsigned long nr_expired;
 };
 
 int elevator_noop_merge(request_queue_t *, struct request **, struct list_head *, struct buffer_head *, int, int);
@@ -31,6 +65,24 @@ int elevator_linus_merge(request_queue_t *, struct request **, struct list_head
 void elevator_linus_merge_cleanup(request_queue_t *, struct request *, int);
 void elevator_linus_merge_req(struct request *, struct request *);
 
+int elevator_deadline_merge(request_queue_t *, struct request **, struct list_head *, struct buffer_head *, int, int);
+void elevator_deadline_merge_req(struct request *, struct request *);
+void elevator_deadline_add_req(request_queue_t *, struct request *);
+struct request *elevator_deadline_next_req(request_queue_t *);
+struct list_head *elevator_deadline_list(request_queue_t *, struct request *);
+void elevator_deadline_drain(request_queue_t *);
+int elevator_deadline_init(request_queue_t *, elevator_t *);
+void elevator_deadline_exit(elevator_t *);
+
+void elevator_as_add_req(request_queue_t *, struct request *);
+struct request *elevator_as_next_req(request_queue_t *);
+void elevator_as_completed_req(request_queue_t *, struct request *);
+
+/*
+ * max_bomb_segments is no longer used for its original purpose: it
+ * carries the ELEVATOR_TYPE_* of the queue, 0 on BLKELVSET meaning
+ * "leave it alone".
+ */
 typedef struct blkelv_ioctl_arg_s {
 	int queue_ID;
 	int read_latency;
@@ -38,13 +90,22 @@ typedef struct blkelv_ioctl_arg_s {
 	int max_bomb_segments;
 } blkelv_ioctl_arg_t;
 
+#define ELEVATOR_TYPE_NOOP		1
+#define ELEVATOR_TYPE_LINUS		2
+#define ELEVATOR_TYPE_DEADLINE		3
+#define ELEVATOR_TYPE_ANTICIPATORY	4
+
 #define BLKELVGET   _IOR(0x12,106,sizeof(blkelv_ioctl_arg_t))
 #define BLKELVSET   _IOW(0x12,107,sizeof(blkelv_ioctl_arg_t))
 
 extern int blkelvget_ioctl(elevator_t *, blkelv_ioctl_arg_t *);
-extern int blkelvset_ioctl(elevator_t *, const blkelv_ioctl_arg_t *);
+extern int blkelvset_ioctl(request_queue_t *, const blkelv_ioctl_arg_t *);
 
 extern void elevator_init(elevator_t *, elevator_t);
+extern int elevator_select(request_queue_t *, int);
+extern void elevator_exit(request_queue_t *);
+extern void elevator_dispatch(request_queue_t *);
+extern void elevator_start(request_queue_t *);
 
 /*
  * Return values from elevator merger
@@ -89,6 +150,9 @@ static inline int elevator_request_latency(elevator_t * elevator, int rw)
 									\
 	elevator_noop_merge,		/* elevator_merge_fn */		\
 	elevator_noop_merge_req,	/* elevator_merge_req_fn */	\
+									\
+	ELEVATOR_TYPE_NOOP,		/* elevator_type */		\
+	"noop",				/* elevator_name */		\
 	})
 
 #define ELEVATOR_LINUS							\
@@ -98,6 +162,53 @@ static inline int elevator_request_latency(elevator_t * elevator, int rw)
 									\
 	elevator_linus_merge,		/* elevator_merge_fn */		\
 	elevator_linus_merge_req,	/* elevator_merge_req_fn */	\
+									\
+	ELEVATOR_TYPE_LINUS,		/* elevator_type */		\
+	"linus",			/* elevator_name */		\
+	})
+
+/*
+ * The latencies of deadline and anticipatory are the FIFO expiry
+ * times, in milliseconds.
+ */
+#define ELEVATOR_DEADLINE						\
+((elevator_t) {								\
+	500,				/* read expiry */		\
+	5000,				/* write expiry */		\
+									\
+	elevator_deadline_merge,	/* elevator_merge_fn */		\
+	elevator_deadline_merge_req,	/* elevator_merge_req_fn */	\
+									\
+	ELEVATOR_TYPE_DEADLINE,		/* elevator_type */		\
+	"deadline",			/* elevator_name */		\
+									\
+	elevator_deadline_add_req,	/* elevator_add_req_fn */	\
+	elevator_deadline_next_req,	/* elevator_next_req_fn */	\
+	NULL,				/* elevator_completed_req_fn */	\
+	elevator_deadline_list,		/* elevator_list_fn */		\
+	elevator_deadline_drain,	/* elevator_drain_fn */		\
+	elevator_deadline_init,		/* elevator_init_fn */		\
+	elevator_deadline_exit,		/* elevator_exit_fn */		\
+	})
+
+#define ELEVATOR_ANTICIPATORY						\
+((elevator_t) {								\
+	125,				/* read expiry */		\
+	250,				/* write expiry */		\
+									\
+	elevator_deadline_merge,	/* elevator_merge_fn */		\
+	elevator_deadline_merge_req,	/* elevator_merge_req_fn */	\
+									\
+	ELEVATOR_TYPE_ANTICIPATORY,	/* elevator_type */		\
+	"anticipatory",			/* elevator_name */		\
+									\
+	elevator_as_add_req,		/* elevator_add_req_fn */	\
+	elevator_as_next_req,		/* elevator_next_req_fn */	\
+	elevator_as_completed_req,	/* elevator_completed_req_fn */	\
+	elevator_deadline_list,		/* elevator_list_fn */		\
+	elevator_deadline_drain,	/* elevator_drain_fn */		\
+	elevator_deadline_init,		/* elevator_init_fn */		\
+	elevator_deadline_exit,		/* elevator_exit_fn */		\
 	})
 
 #endif
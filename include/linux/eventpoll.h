@@ -0,0 +1,76 @@
+/*
+ *  include/linux/eventpoll.h
+ *
+ *  Efficient event polling: epoll_create(2), epoll_ctl(2), epoll_wait(2).
+ */
+
+#ifndef _LINUX_EVENTPOLL_H
+#define _LINUX_EVENTPOLL_H
+
+#include <linux/types.h>
+
+/* Valid opcodes to issue to sys_epoll_ctl() */
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+/* Set the One Shot behaviour for the target file descriptor */
+#define EPOLLONESHOT (1 << 30)
+
+/* Set the Edge Triggered behaviour for the target file descriptor */
+#define EPOLLET (1 << 31)
+
+/*
+ * On x86-64 make the 64bit structure have the same alignment as the
+ * 32bit structure.  This makes 32bit emulation easier.
+ */
+#ifdef __x86_64__
+#define EPOLL_PACKED __attribute__((packed))
+#else
+#define EPOLL_PACKED
+#endif
+
+struct epoll_event {
+	__u32 events;
+	__u64 data;
+} EPOLL_PACKED;
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/compiler.h>
+#include <linux/fs.h>
+
+/* Kernel space functions implementing the user space "epoll" API */
+asmlinkage long sys_epoll_create(int size);
+asmlinkage long sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+asmlinkage long sys_epoll_wait(int epfd, struct epoll_event *events,
+			       int maxevents, int timeout);
+
+/* Used to initialize the epoll bits inside the "struct file" */
+static inline void eventpoll_init_file(struct file *file)
+{
+	INIT_LIST_HEAD(&file->f_ep_links);
+	spin_lock_init(&file->f_ep_lock);
+}
+
+/* Used to release the epoll bits inside the "struct file" */
+extern void eventpoll_release_file(struct file *file);
+
+/*
+ * Called by fput() when the last reference to a file goes away.  The
+ * common case is a file that was never added to an epoll set, so keep
+ * that test inline and out of fs/eventpoll.c.
+ */
+static inline void eventpoll_release(struct file *file)
+{
+	if (likely(list_empty(&file->f_ep_links)))
+		return;
+
+	eventpoll_release_file(file);
+}
+
+#endif /* #ifdef __KERNEL__ */
+
+#endif /* #ifndef _LINUX_EVENTPOLL_H */
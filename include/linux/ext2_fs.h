@@ -33,6 +33,13 @@
 #define EXT2_PREALLOCATE
 #define EXT2_DEFAULT_PREALLOC_BLOCKS	8
 
+/*
+ * Reservation windows for regular files start at this many blocks and
+ * double, up to the maximum, for as long as the writer keeps using them
+ */
+#define EXT2_DEFAULT_RESERVE_BLOCKS	8
+#define EXT2_MAX_RESERVE_BLOCKS		1024
+
 /*
  * The second extended file system version
  */
@@ -198,6 +205,7 @@ struct ext2_group_desc
 #define EXT2_ECOMPR_FL			0x00000800 /* Compression error */
 /* End compression flags --- maybe not all used */	
 #define EXT2_BTREE_FL			0x00001000 /* btree format dir */
+#define EXT2_INDEX_FL			0x00001000 /* hash-indexed directory */
 #define EXT2_RESERVED_FL		0x80000000 /* reserved for ext2 lib */
 
 #define EXT2_FL_USER_VISIBLE		0x00001FFF /* User visible flags */
@@ -210,6 +218,19 @@ struct ext2_group_desc
 #define	EXT2_IOC_SETFLAGS		_IOW('f', 2, long)
 #define	EXT2_IOC_GETVERSION		_IOR('v', 1, long)
 #define	EXT2_IOC_SETVERSION		_IOW('v', 2, long)
+#define	EXT2_IOC_GETFRAG		_IOR('f', 9, struct ext2_frag_stats)
+
+/*
+ * Returned by EXT2_IOC_GETFRAG: how the file is laid out, and how the
+ * filesystem's reservation windows are doing
+ */
+struct ext2_frag_stats {
+	__u32	fs_blocks;		/* data blocks in the file */
+	__u32	fs_extents;		/* contiguous runs they make up */
+	__u32	fs_rsv_windows;		/* windows handed out on the fs */
+	__u32	fs_rsv_hits;		/* blocks allocated inside a window */
+	__u32	fs_rsv_misses;		/* ... and outside one */
+};
 
 /*
  * Structure of an inode on the disk
@@ -314,11 +335,19 @@ struct ext2_inode {
 #define EXT2_MOUNT_ERRORS_PANIC		0x0040	/* Panic on errors */
 #define EXT2_MOUNT_MINIX_DF		0x0080	/* Mimics the Minix statfs */
 #define EXT2_MOUNT_NO_UID32		0x0200  /* Disable 32-bit UIDs */
+#define EXT2_MOUNT_RESERVATION		0x0400	/* Reservation windows */
+#define EXT2_MOUNT_DELALLOC		0x0800	/* Delayed allocation */
 
 #define clear_opt(o, opt)		o &= ~EXT2_MOUNT_##opt
 #define set_opt(o, opt)			o |= EXT2_MOUNT_##opt
 #define test_opt(sb, opt)		((sb)->u.ext2_sb.s_mount_opt & \
 					 EXT2_MOUNT_##opt)
+
+/*
+ * Flags for ext2_new_blocks()
+ */
+#define EXT2_ALLOC_RESERVED		0x0001	/* Charged by ext2_reserve_blocks */
+
 /*
  * Maximal mount counts between two filesystem checks
  */
@@ -558,6 +587,24 @@ enum {
 #define EXT2_DIR_REC_LEN(name_len)	(((name_len) + 8 + EXT2_DIR_ROUND) & \
 					 ~EXT2_DIR_ROUND)
 
+/*
+ * Hashed directory indexes, in the same format as ext3's.  The
+ * EXT2_INDEX_FL of a directory is only trusted if the filesystem has
+ * the DIR_INDEX feature.
+ */
+#define EXT2_HASH_LEGACY	0
+#define EXT2_HASH_HALF_MD4	1
+#define EXT2_HASH_TEA		2
+
+#ifdef __KERNEL__
+#include <linux/dirhash.h>
+
+#define EXT2_HTREE_EOF	DX_HASH_EOF
+
+/* An index which is not one we understand */
+#define ERR_BAD_DX_DIR	-75000
+#endif
+
 #ifdef __KERNEL__
 /*
  * Function prototypes
@@ -576,10 +623,18 @@ extern int ext2_bg_has_super(struct super_block *sb, int group);
 extern unsigned long ext2_bg_num_gdb(struct super_block *sb, int group);
 extern int ext2_new_block (struct inode *, unsigned long,
 			   __u32 *, __u32 *, int *);
+extern int ext2_new_blocks (struct inode *, unsigned long,
+			    unsigned long *, int, int *);
 extern void ext2_free_blocks (struct inode *, unsigned long,
 			      unsigned long);
+extern void ext2_free_reserved_blocks (struct inode *, unsigned long,
+				       unsigned long);
+extern int ext2_reserve_blocks (struct inode *, unsigned long);
+extern void ext2_release_blocks (struct inode *, unsigned long);
 extern unsigned long ext2_count_free_blocks (struct super_block *);
 extern void ext2_check_blocks_bitmap (struct super_block *);
+extern void ext2_discard_reservation (struct inode *);
+extern int ext2_init_balloc (struct super_block *);
 extern struct ext2_group_desc * ext2_get_group_desc(struct super_block * sb,
 						    unsigned int block_group,
 						    struct buffer_head ** bh);
@@ -609,6 +664,7 @@ extern unsigned long ext2_count_free (struct buffer_head *, unsigned);
 extern void ext2_read_inode (struct inode *);
 extern void ext2_write_inode (struct inode *, int);
 extern void ext2_put_inode (struct inode *);
+extern void ext2_clear_inode (struct inode *);
 extern void ext2_delete_inode (struct inode *);
 extern int ext2_sync_inode (struct inode *);
 extern void ext2_discard_prealloc (struct inode *);
@@ -16,6 +16,21 @@
 #ifndef _LINUX_EXT2_FS_I
 #define _LINUX_EXT2_FS_I
 
+#include <linux/rbtree.h>
+
+/*
+ * A reservation window: the run of blocks [rsv_start, rsv_end] which
+ * the file's next allocations come from.  The blocks are not marked in
+ * use, so anyone may still take them when the disk is short of space.
+ */
+struct ext2_reserve_window {
+	rb_node_t	rsv_node;
+	__u32		rsv_start;
+	__u32		rsv_end;	/* 0 if the file has no window */
+	__u32		rsv_goal_size;	/* size to ask for next time */
+	__u32		rsv_alloc_hit;	/* blocks taken from this window */
+};
+
 /*
  * second extended file system inode data in memory
  */
@@ -35,6 +50,9 @@ struct ext2_inode_info {
 	__u32	i_prealloc_block;
 	__u32	i_prealloc_count;
 	__u32	i_dir_start_lookup;
+	__u32	i_delayed_blocks;	/* reserved by delayed allocation */
+	rwlock_t i_meta_lock;	/* the block map, i_prealloc_* and i_delayed_blocks */
+	struct ext2_reserve_window i_rsv_window;
 };
 
 /*
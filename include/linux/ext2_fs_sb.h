@@ -16,6 +16,11 @@
 #ifndef _LINUX_EXT2_FS_SB
 #define _LINUX_EXT2_FS_SB
 
+#ifdef __KERNEL__
+#include <linux/rbtree.h>
+#include <linux/percpu_counter.h>
+#endif
+
 /*
  * The following is not needed anymore since the descriptors buffer
  * heads are now dynamically allocated
@@ -24,6 +29,39 @@
 
 #define EXT2_MAX_GROUP_LOADED	8
 
+#ifdef __KERNEL__
+/*
+ * A group's block bitmap and free blocks count are changed under one
+ * of a few spinlocks, picked by hashing the group number.
+ */
+#ifdef CONFIG_SMP
+#define EXT2_BG_LOCKS		128
+#else
+#define EXT2_BG_LOCKS		1
+#endif
+
+struct ext2_bg_lock {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Block allocator state, too big for the superblock union
+ */
+struct ext2_balloc_info {
+	struct ext2_bg_lock bg_locks[EXT2_BG_LOCKS];
+	struct percpu_counter free_blocks;	/* s_free_blocks_count, live */
+	struct percpu_counter delayed_blocks;	/* reserved by delayed allocation */
+	spinlock_t rsv_lock;			/* protects rsv_root */
+	rb_root_t rsv_root;			/* reservation windows, by start */
+	struct percpu_counter rsv_windows;	/* windows handed out */
+	struct percpu_counter rsv_hits;		/* blocks taken from a window */
+	struct percpu_counter rsv_misses;	/* ... and from outside one */
+};
+
+#define ext2_bg_lock(sb, group)	\
+	(&(sb)->u.ext2_sb.s_balloc->bg_locks[(group) & (EXT2_BG_LOCKS-1)].lock)
+#endif
+
 /*
  * second extended-fs super-block data in memory
  */
@@ -41,12 +79,10 @@ struct ext2_sb_info {
 	struct buffer_head * s_sbh;	/* Buffer containing the super block */
 	struct ext2_super_block * s_es;	/* Pointer to the super block in the buffer */
 	struct buffer_head ** s_group_desc;
+	struct ext2_balloc_info * s_balloc;
 	unsigned short s_loaded_inode_bitmaps;
-	unsigned short s_loaded_block_bitmaps;
 	unsigned long s_inode_bitmap_number[EXT2_MAX_GROUP_LOADED];
 	struct buffer_head * s_inode_bitmap[EXT2_MAX_GROUP_LOADED];
-	unsigned long s_block_bitmap_number[EXT2_MAX_GROUP_LOADED];
-	struct buffer_head * s_block_bitmap[EXT2_MAX_GROUP_LOADED];
 	unsigned long  s_mount_opt;
 	uid_t s_resuid;
 	gid_t s_resgid;
@@ -56,6 +92,8 @@ struct ext2_sb_info {
 	int s_desc_per_block_bits;
 	int s_inode_size;
 	int s_first_ino;
+	u32 s_hash_seed[4];
+	int s_def_hash_version;
 };
 
 #endif	/* _LINUX_EXT2_FS_SB */
@@ -594,6 +594,25 @@ struct ext3_dir_entry_2 {
 #define EXT3_DIR_REC_LEN(name_len)	(((name_len) + 8 + EXT3_DIR_ROUND) & \
 					 ~EXT3_DIR_ROUND)
 
+/*
+ * Hashed directory indexes.  A directory with EXT3_INDEX_FL set keeps
+ * a tree of name hashes in blocks which look like empty directory
+ * blocks to anything which does not know about it.  The flag is only
+ * trusted if the filesystem has the DIR_INDEX feature.
+ */
+#define is_dx(dir) (EXT3_HAS_COMPAT_FEATURE((dir)->i_sb, \
+				EXT3_FEATURE_COMPAT_DIR_INDEX) && \
+		    (EXT3_I(dir)->i_flags & EXT3_INDEX_FL))
+
+#ifdef __KERNEL__
+#include <linux/dirhash.h>
+
+#define EXT3_HTREE_EOF	DX_HASH_EOF
+
+/* An index which is not one we understand */
+#define ERR_BAD_DX_DIR	-75000
+#endif
+
 #ifdef __KERNEL__
 /*
  * Describe an inode's exact location on disk and in memory
@@ -634,6 +653,8 @@ extern struct ext3_group_desc * ext3_get_group_desc(struct super_block * sb,
 extern int ext3_check_dir_entry(const char *, struct inode *,
 				struct ext3_dir_entry_2 *, struct buffer_head *,
 				unsigned long);
+extern int ext3_htree_store_dirent(struct file *, __u32, __u32,
+				   struct ext3_dir_entry_2 *);
 /* fsync.c */
 extern int ext3_sync_file (struct file *, struct dentry *, int);
 
@@ -669,6 +690,7 @@ extern int ext3_ioctl (struct inode *, struct file *, unsigned int,
 /* namei.c */
 extern int ext3_orphan_add(handle_t *, struct inode *);
 extern int ext3_orphan_del(handle_t *, struct inode *);
+extern int ext3_htree_fill_tree(struct file *, __u32, __u32, __u32 *);
 
 /* super.c */
 extern void ext3_error (struct super_block *, const char *, const char *, ...)
@@ -38,6 +38,11 @@
 
 #define EXT3_DATA_TRANS_BLOCKS		(3 * EXT3_SINGLEDATA_TRANS_BLOCKS - 2)
 
+/* Adding an entry to an indexed directory may split a leaf and an
+ * index node, and add a level to the tree. */
+
+#define EXT3_INDEX_EXTRA_TRANS_BLOCKS	8
+
 extern int ext3_writepage_trans_blocks(struct inode *inode);
 
 /* Delete operations potentially hit one directory's namespace plus an
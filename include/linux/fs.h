@@ -16,6 +16,7 @@
 #include <linux/kdev_t.h>
 #include <linux/ioctl.h>
 #include <linux/list.h>
+#include <linux/radix-tree.h>
 #include <linux/dcache.h>
 #include <linux/stat.h>
 #include <linux/cache.h>
@@ -406,6 +407,8 @@ struct address_space_operations {
 };
 
 struct address_space {
+	struct radix_tree_root	page_tree;	/* radix tree of all pages */
+	spinlock_t		page_lock;	/* and spinlock protecting it */
 	struct list_head	clean_pages;	/* list of clean pages */
 	struct list_head	dirty_pages;	/* list of dirty pages */
 	struct list_head	locked_pages;	/* list of locked pages */
@@ -418,6 +421,11 @@ struct address_space {
 	int			gfp_mask;	/* how to allocate the pages */
 };
 
+/*
+ * Radix tree tags of the pages in address_space->page_tree
+ */
+#define PAGECACHE_TAG_DIRTY	0	/* page is on mapping->dirty_pages */
+
 struct char_device {
 	struct list_head	hash;
 	atomic_t		count;
@@ -585,6 +593,10 @@ struct file {
 	/* preallocated helper kiobuf to speedup O_DIRECT */
 	struct kiobuf		*f_iobuf;
 	long			f_iobuf_lock;
+
+	/* Used by fs/eventpoll.c to link all the hooks to this file */
+	struct list_head	f_ep_links;
+	spinlock_t		f_ep_lock;
 };
 extern spinlock_t files_lock;
 #define file_list_lock() spin_lock(&files_lock);
@@ -1141,6 +1153,7 @@ extern int fs_may_remount_ro(struct super_block *);
 extern int FASTCALL(try_to_free_buffers(struct page *, unsigned int));
 extern void refile_buffer(struct buffer_head * buf);
 extern void create_empty_buffers(struct page *, kdev_t, unsigned long);
+extern void unmap_underlying_metadata(struct buffer_head *);
 extern void end_buffer_io_sync(struct buffer_head *bh, int uptodate);
 extern void end_buffer_io_async(struct buffer_head *bh, int uptodate);
 
@@ -1523,6 +1536,9 @@ extern ssize_t generic_file_write(struct file *, const char *, size_t, loff_t *)
 extern void do_generic_file_read(struct file *, loff_t *, read_descriptor_t *, read_actor_t);
 extern ssize_t do_generic_file_write(struct file *, const char *, size_t, loff_t *);
 extern ssize_t do_generic_direct_write(struct file *, const char *, size_t, loff_t *);
+extern ssize_t generic_file_aio_direct_IO(int, struct file *, struct kiobuf *, char *, size_t, loff_t);
+extern void generic_file_aio_direct_done(int, struct file *, struct kiobuf *, ssize_t);
+extern int filemap_start_read(struct file *, loff_t, size_t);
 extern loff_t no_llseek(struct file *file, loff_t offset, int origin);
 extern loff_t generic_file_llseek(struct file *file, loff_t offset, int origin);
 extern ssize_t generic_read_dir(struct file *, char *, size_t, loff_t *);
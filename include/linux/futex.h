@@ -0,0 +1,35 @@
+#ifndef _LINUX_FUTEX_H
+#define _LINUX_FUTEX_H
+
+/*
+ * Fast userspace mutexes.
+ *
+ * A futex is an aligned int in user memory.  Userspace does all of the
+ * uncontended work with atomic instructions on that word and only enters
+ * the kernel to sleep when the word says the lock is taken (FUTEX_WAIT),
+ * or to wake sleepers when the word says someone is waiting (FUTEX_WAKE).
+ * The classic three-state lock (0 = unlocked, 1 = locked, 2 = locked with
+ * waiters) therefore costs no system call at all unless it is contended.
+ *
+ * The kernel never interprets the value beyond FUTEX_WAIT's "is it still
+ * equal to val" check, which closes the race between userspace deciding
+ * to sleep and a concurrent wakeup.
+ */
+
+/* Second argument to futex syscall */
+#define FUTEX_WAIT	(0)
+#define FUTEX_WAKE	(1)
+#define FUTEX_REQUEUE	(3)
+
+#ifdef __KERNEL__
+
+#include <linux/linkage.h>
+#include <linux/types.h>
+#include <linux/time.h>
+
+asmlinkage long sys_futex(u32 *uaddr, int op, int val,
+			  struct timespec *utime, u32 *uaddr2);
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_FUTEX_H */
@@ -38,15 +38,16 @@ struct kiobuf
 	int		length;		/* Number of valid bytes of data */
 
 	unsigned int	locked : 1;	/* If set, pages has been locked */
+	unsigned int	async : 1;	/* brw_kiovec() must not wait for the IO */
 
 	struct page **  maplist;
-	struct buffer_head ** bh;
 	unsigned long * blocks;
 
 	/* Dynamic state for IO completion: */
 	atomic_t	io_count;	/* IOs still in progress */
 	int		errno;		/* Status of completed IO */
 	void		(*end_io) (struct kiobuf *); /* Completion callback */
+	void		*private;	/* For the end_io callback */
 	wait_queue_head_t wait_queue;
 };
 
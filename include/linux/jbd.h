@@ -296,6 +296,8 @@ enum jbd_state_bits {
 	BH_Revoked,		/* 1 if buffer has been revoked from the log */
 	BH_RevokeValid,		/* 1 if buffer revoked flag is valid */
 	BH_JBDDirty,		/* 1 if buffer is dirty but journaled */
+	BH_State,		/* Pins most journal_head state */
+	BH_JournalHead,		/* Pins bh->b_private and jh->b_bh */
 };
 
 /* Return true if the buffer is one which JBD is managing */
@@ -314,6 +316,65 @@ static inline struct journal_head *bh2jh(struct buffer_head *bh)
 	return bh->b_private;
 }
 
+/*
+ * Bit spinlocks in b_state.  BH_State serialises changes to a
+ * buffer's journalling state (its journal_head's transaction pointers,
+ * frozen and committed data) and BH_JournalHead pins the attachment of
+ * the journal_head itself.  Neither is ever taken from interrupts, and
+ * like any spinlock they must not be held across a sleep.
+ */
+static inline void jbd_bit_lock(int nr, struct buffer_head *bh)
+{
+#ifdef CONFIG_SMP
+	while (test_and_set_bit(nr, &bh->b_state)) {
+		while (test_bit(nr, &bh->b_state))
+			cpu_relax();
+	}
+#endif
+}
+
+static inline int jbd_bit_trylock(int nr, struct buffer_head *bh)
+{
+#ifdef CONFIG_SMP
+	return !test_and_set_bit(nr, &bh->b_state);
+#else
+	return 1;
+#endif
+}
+
+static inline void jbd_bit_unlock(int nr, struct buffer_head *bh)
+{
+#ifdef CONFIG_SMP
+	smp_mb__before_clear_bit();
+	clear_bit(nr, &bh->b_state);
+#endif
+}
+
+static inline void jbd_lock_bh_state(struct buffer_head *bh)
+{
+	jbd_bit_lock(BH_State, bh);
+}
+
+static inline int jbd_trylock_bh_state(struct buffer_head *bh)
+{
+	return jbd_bit_trylock(BH_State, bh);
+}
+
+static inline void jbd_unlock_bh_state(struct buffer_head *bh)
+{
+	jbd_bit_unlock(BH_State, bh);
+}
+
+static inline void jbd_lock_bh_journal_head(struct buffer_head *bh)
+{
+	jbd_bit_lock(BH_JournalHead, bh);
+}
+
+static inline void jbd_unlock_bh_journal_head(struct buffer_head *bh)
+{
+	jbd_bit_unlock(BH_JournalHead, bh);
+}
+
 #define HAVE_JOURNAL_CALLBACK_STATUS
 struct journal_callback {
 	struct list_head jcb_list;
@@ -322,6 +383,24 @@ struct journal_callback {
 };
 
 struct jbd_revoke_table_s;
+struct proc_dir_entry;
+
+/*
+ * Running totals for /proc/fs/jbd/<dev>/info.  Times are in jiffies.
+ * Commit time runs from the transaction being locked down to the
+ * commit record reaching disk; handle wait time is how long
+ * journal_start() spent waiting for a transaction to join.
+ */
+struct journal_stats {
+	unsigned long		js_commits;
+	unsigned long		js_commit_time;
+	unsigned long		js_commit_time_max;
+	unsigned long		js_commit_blocks;
+	unsigned long		js_handles;
+	unsigned long		js_handle_waits;
+	unsigned long		js_handle_wait_time;
+	unsigned long		js_handle_wait_max;
+};
 
 /**
  * The handle_t type represents a single atomic update being performed
@@ -393,6 +472,13 @@ struct handle_s
  * The transaction keeps track of all of the buffers modified by a
  * running transaction, and all of the buffers committed but not yet
  * flushed to home for finished transactions.
+ *
+ * Locking: t_state is protected by the journal's j_state_lock, the
+ * handle accounting (t_updates, t_outstanding_credits, t_handle_count
+ * and t_jcb) by t_handle_lock, and the buffer and checkpoint lists by
+ * the journal's j_list_lock.  A buffer can move from one transaction's
+ * lists to another's, so the list lock is per journal rather than per
+ * transaction.
  */
 
 struct transaction_s 
@@ -403,7 +489,7 @@ struct transaction_s
 	/* Sequence number for this transaction */
 	tid_t			t_tid;
 	
-	/* Transaction's current state */
+	/* Transaction's current state [j_state_lock] */
 	enum {
 		T_RUNNING,
 		T_LOCKED,
@@ -434,14 +520,14 @@ struct transaction_s
 	/*
 	 * Doubly-linked circular list of all data buffers still to be
 	 * flushed before this transaction can be committed.
-	 * Protected by journal_datalist_lock.
+	 * Protected by j_list_lock.
 	 */
 	struct journal_head *	t_sync_datalist;
 	
 	/*
 	 * Doubly-linked circular list of all writepage data buffers
 	 * still to be written before this transaction can be committed.
-	 * Protected by journal_datalist_lock.
+	 * Protected by j_list_lock.
 	 */
 	struct journal_head *	t_async_datalist;
 	
@@ -454,7 +540,7 @@ struct transaction_s
 	 * Doubly-linked circular list of all buffers still to be
 	 * flushed before this transaction can be checkpointed.
 	 */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	struct journal_head *	t_checkpoint_list;
 	
 	/* Doubly-linked circular list of temporary buffers currently
@@ -471,29 +557,33 @@ struct transaction_s
            to the log. */
 	struct journal_head *	t_log_list;
 	
+	/* Protects the handle accounting below */
+	spinlock_t		t_handle_lock;
+
 	/* Number of outstanding updates running on this transaction */
+	/* [t_handle_lock] */
 	int			t_updates;
 
 	/* Number of buffers reserved for use by all handles in this
-	 * transaction handle but not yet modified. */
+	 * transaction handle but not yet modified. [t_handle_lock] */
 	int			t_outstanding_credits;
 	
 	/*
 	 * Forward and backward links for the circular list of all
 	 * transactions awaiting checkpoint.
 	 */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	transaction_t		*t_cpnext, *t_cpprev;
 
 	/* When will the transaction expire (become due for commit), in
 	 * jiffies ? */
 	unsigned long		t_expires;
 
-	/* How many handles used this transaction? */
+	/* How many handles used this transaction? [t_handle_lock] */
 	int t_handle_count;
 
 	/* List of registered callback functions for this transaction.
-	 * Called when the transaction is committed. */
+	 * Called when the transaction is committed. [t_handle_lock] */
 	struct list_head	t_jcb;
 };
 
@@ -516,7 +606,9 @@ struct transaction_s
  * @j_wait_commit: Wait queue to trigger commit
  * @j_wait_updates: Wait queue to wait for updates to complete
  * @j_checkpoint_sem: Semaphore for locking against concurrent checkpoints
- * @j_sem: The main journal lock, used by lock_journal() 
+ * @j_state_lock: Protects the journal's state: the fields marked [j_state_lock]
+ * @j_list_lock: Protects the buffer lists and checkpoint lists of all transactions
+ * @j_revoke_lock: Protects the revoke table
  * @j_head: Journal head - identifies the first unused block in the journal
  * @j_tail: Journal tail - identifies the oldest still-used block in the journal.
  * @j_free: Journal free - how many free blocks are there in the journal?
@@ -540,15 +632,17 @@ struct transaction_s
  * @j_commit_timer_active: Timer flag
  * @j_all_journals:  Link all journals together - system-wide 
  * @j_revoke: The revoke table - maintains the list of revoked blocks in the current transaction.
+ * @j_stats: Commit and handle statistics, reported in /proc/fs/jbd/<dev>/info
+ * @j_proc_entry: This journal's directory in /proc/fs/jbd
  **/
 
 struct journal_s
 {
-	/* General journaling state flags */
+	/* General journaling state flags [j_state_lock] */
 	unsigned long		j_flags;
 
 	/* Is there an outstanding uncleared error on the journal (from */
-	/* a prior abort)? */
+	/* a prior abort)? [j_state_lock] */
 	int			j_errno;
 	
 	/* The superblock buffer */
@@ -559,20 +653,23 @@ struct journal_s
 	int			j_format_version;
 
 	/* Number of processes waiting to create a barrier lock */
+	/* [j_state_lock] */
 	int			j_barrier_count;
 	
 	/* The barrier lock itself */
 	struct semaphore	j_barrier;
 	
 	/* Transactions: The current running transaction... */
+	/* [j_state_lock] */
 	transaction_t *		j_running_transaction;
 	
 	/* ... the transaction we are pushing to disk ... */
+	/* [j_state_lock] */
 	transaction_t *		j_committing_transaction;
 	
 	/* ... and a linked circular list of all transactions waiting */
 	/* for checkpointing. */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	transaction_t *		j_checkpoint_transactions;
 
 	/* Wait queue for waiting for a locked transaction to start */
@@ -597,17 +694,26 @@ struct journal_s
 	/* Semaphore for locking against concurrent checkpoints */
 	struct semaphore 	j_checkpoint_sem;
 
-	/* The main journal lock, used by lock_journal() */
-	struct semaphore	j_sem;
+	/* Protects the fields marked [j_state_lock], and the t_state */
+	/* of this journal's transactions */
+	spinlock_t		j_state_lock;
+
+	/* Protects the buffer lists and checkpoint lists */
+	spinlock_t		j_list_lock;
+
+	/* Protects the revoke table */
+	spinlock_t		j_revoke_lock;
 		
 	/* Journal head: identifies the first unused block in the journal. */
+	/* [j_state_lock] */
 	unsigned long		j_head;
 	
 	/* Journal tail: identifies the oldest still-used block in the */
-	/* journal. */
+	/* journal. [j_state_lock] */
 	unsigned long		j_tail;
 
 	/* Journal free: how many free blocks are there in the journal? */
+	/* [j_state_lock] */
 	unsigned long		j_free;
 
 	/* Journal start and end: the block numbers of the first usable */
@@ -633,12 +739,16 @@ struct journal_s
 	struct inode *		j_inode;
 
 	/* Sequence number of the oldest transaction in the log */
+	/* [j_state_lock] */
 	tid_t			j_tail_sequence;
 	/* Sequence number of the next transaction to grant */
+	/* [j_state_lock] */
 	tid_t			j_transaction_sequence;
 	/* Sequence number of the most recently committed transaction */
+	/* [j_state_lock] */
 	tid_t			j_commit_sequence;
 	/* Sequence number of the most recent transaction wanting commit */
+	/* [j_state_lock] */
 	tid_t			j_commit_request;
 
 	/* Journal uuid: identifies the object (filesystem, LVM volume   */
@@ -662,14 +772,21 @@ struct journal_s
 
 	/* The timer used to wakeup the commit thread: */
 	struct timer_list *	j_commit_timer;
+	/* [j_state_lock] */
 	int			j_commit_timer_active;
 
 	/* Link all journals together - system-wide */
 	struct list_head	j_all_journals;
 
 	/* The revoke table: maintains the list of revoked blocks in the */
-        /*  current transaction. */
+        /*  current transaction. [j_revoke_lock] */
 	struct jbd_revoke_table_s *j_revoke;
+
+	/* Commit and handle statistics [j_state_lock] */
+	struct journal_stats	j_stats;
+
+	/* Our directory in /proc/fs/jbd */
+	struct proc_dir_entry *	j_proc_entry;
 };
 
 /* 
@@ -688,9 +805,9 @@ struct journal_s
 
 /* Filing buffers */
 extern void __journal_unfile_buffer(struct journal_head *);
-extern void journal_unfile_buffer(struct journal_head *);
+extern void journal_unfile_buffer(journal_t *, struct journal_head *);
 extern void __journal_refile_buffer(struct journal_head *);
-extern void journal_refile_buffer(struct journal_head *);
+extern void journal_refile_buffer(journal_t *, struct journal_head *);
 extern void __journal_file_buffer(struct journal_head *, transaction_t *, int);
 extern void __journal_free_buffer(struct journal_head *bh);
 extern void journal_file_buffer(struct journal_head *, transaction_t *, int);
@@ -718,39 +835,29 @@ journal_write_metadata_buffer(transaction_t	  *transaction,
 			      struct journal_head **jh_out,
 			      int		   blocknr);
 
-/* Transaction locking */
-extern void		__wait_on_journal (journal_t *);
-
 /*
  * Journal locking.
  *
- * We need to lock the journal during transaction state changes so that
- * nobody ever tries to take a handle on the running transaction while
- * we are in the middle of moving it to the commit phase.  
+ * There is no single journal lock.  j_state_lock covers transaction
+ * state changes, so that nobody ever tries to take a handle on the
+ * running transaction while we are in the middle of moving it to the
+ * commit phase; t_handle_lock covers a transaction's handle
+ * accounting; j_list_lock covers the buffer and checkpoint lists; and
+ * the BH_State bit lock covers each buffer's journal_head.  They nest
+ *
+ *	j_state_lock
+ *	    t_handle_lock
+ *	    jbd_lock_bh_state
+ *		j_list_lock
+ *		    jbd_lock_bh_journal_head
+ *
+ * and where commit walks a list and needs a buffer's state lock, it
+ * must only trylock it.  j_revoke_lock nests inside all of these.
  *
  * Note that the locking is completely interrupt unsafe.  We never touch
  * journal structures from interrupts.
- *
- * In 2.2, the BKL was required for lock_journal.  This is no longer
- * the case.
  */
 
-static inline void lock_journal(journal_t *journal)
-{
-	down(&journal->j_sem);
-}
-
-/* This returns zero if we acquired the semaphore */
-static inline int try_lock_journal(journal_t * journal)
-{
-	return down_trylock(&journal->j_sem);
-}
-
-static inline void unlock_journal(journal_t * journal)
-{
-	up(&journal->j_sem);
-}
-
 
 static inline handle_t *journal_current_handle(void)
 {
@@ -818,8 +925,9 @@ extern int	   journal_force_commit(journal_t *);
  */
 extern struct journal_head
 		*journal_add_journal_head(struct buffer_head *bh);
+extern struct journal_head
+		*journal_grab_journal_head(struct buffer_head *bh);
 extern void	journal_remove_journal_head(struct buffer_head *bh);
-extern void	__journal_remove_journal_head(struct buffer_head *bh);
 extern void	journal_unlock_journal_head(struct journal_head *jh);
 
 /* Primary revoke support */
@@ -846,12 +954,14 @@ extern void	   journal_brelse_array(struct buffer_head *b[], int n);
  * transitions on demand.
  */
 
-extern int	log_space_left (journal_t *); /* Called with journal locked */
+extern int	log_space_left (journal_t *); /* Called with j_state_lock */
 extern tid_t	log_start_commit (journal_t *, transaction_t *);
+extern int	__log_start_commit (journal_t *, tid_t);
 extern void	log_wait_commit (journal_t *, tid_t);
 extern int	log_do_checkpoint (journal_t *, int);
 
 extern void	log_wait_for_space(journal_t *, int nblocks);
+extern void	jbd_sleep_on_unlock(wait_queue_head_t *, spinlock_t *);
 extern void	__journal_drop_transaction(journal_t *, transaction_t *);
 extern int	cleanup_journal_tail(journal_t *);
 
@@ -943,18 +1053,17 @@ extern int journal_blocks_per_page(struct inode *inode);
  
 #ifdef __KERNEL__
 
-extern spinlock_t jh_splice_lock;
 /*
- * Once `expr1' has been found true, take jh_splice_lock
- * and then reevaluate everything.
+ * Once `expr1' has been found true, pin the journal_head with the
+ * buffer's BH_JournalHead lock and then reevaluate everything.
  */
-#define SPLICE_LOCK(expr1, expr2)				\
+#define SPLICE_LOCK(bh, expr1, expr2)				\
 	({							\
 		int ret = (expr1);				\
 		if (ret) {					\
-			spin_lock(&jh_splice_lock);		\
+			jbd_lock_bh_journal_head(bh);		\
 			ret = (expr1) && (expr2);		\
-			spin_unlock(&jh_splice_lock);		\
+			jbd_unlock_bh_journal_head(bh);		\
 		}						\
 		ret;						\
 	})
@@ -971,7 +1080,7 @@ extern spinlock_t jh_splice_lock;
 /* Return true if the buffer is on journal list `list' */
 static inline int buffer_jlist_eq(struct buffer_head *bh, int list)
 {
-	return SPLICE_LOCK(buffer_jbd(bh), bh2jh(bh)->b_jlist == list);
+	return SPLICE_LOCK(bh, buffer_jbd(bh), bh2jh(bh)->b_jlist == list);
 }
 
 /* Return true if this bufer is dirty wrt the journal */
@@ -983,7 +1092,7 @@ static inline int buffer_jdirty(struct buffer_head *bh)
 /* Return true if it's a data buffer which journalling is managing */
 static inline int buffer_jbd_data(struct buffer_head *bh)
 {
-	return SPLICE_LOCK(buffer_jbd(bh),
+	return SPLICE_LOCK(bh, buffer_jbd(bh),
 			bh2jh(bh)->b_jlist == BJ_SyncData ||
 			bh2jh(bh)->b_jlist == BJ_AsyncData);
 }
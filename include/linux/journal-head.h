@@ -21,49 +21,55 @@ struct journal_head {
 #endif
 
 	/* Reference count - see description in journal.c */
+	/* Protected by jbd_lock_bh_journal_head() */
 	int b_jcount;
 
 	/* Journaling list for this buffer */
+	/* Protected by j_list_lock */
 	unsigned b_jlist;
 
 	/* Copy of the buffer data frozen for writing to the log. */
+	/* Protected by jbd_lock_bh_state() */
 	char * b_frozen_data;
 
 	/* Pointer to a saved copy of the buffer containing no
            uncommitted deallocation references, so that allocations can
            avoid overwriting uncommitted deletes. */
+	/* Protected by jbd_lock_bh_state() */
 	char * b_committed_data;
 
 	/* Pointer to the compound transaction which owns this buffer's
            metadata: either the running transaction or the committing
            transaction (if there is one).  Only applies to buffers on a
            transaction's data or metadata journaling list. */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock and jbd_lock_bh_state(): either */
+	/* is enough to read it, both are needed to change it */
 	transaction_t * b_transaction;
 	
 	/* Pointer to the running compound transaction which is
            currently modifying the buffer's metadata, if there was
            already a transaction committing it when the new transaction
            touched it. */
+	/* Protected by j_list_lock and jbd_lock_bh_state() */
 	transaction_t * b_next_transaction;
 	
 	/* Doubly-linked list of buffers on a transaction's data,
            metadata or forget queue. */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	struct journal_head *b_tnext, *b_tprev;
 
 	/*
 	 * Pointer to the compound transaction against which this buffer
 	 * is checkpointed.  Only dirty buffers can be checkpointed.
 	 */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	transaction_t * b_cp_transaction;
 	
 	/*
 	 * Doubly-linked list of buffers still remaining to be flushed
 	 * before an old transaction can be checkpointed.
 	 */
-	/* Protected by journal_datalist_lock */
+	/* Protected by j_list_lock */
 	struct journal_head *b_cpnext, *b_cpprev;
 };
 
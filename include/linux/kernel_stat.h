@@ -26,6 +26,8 @@ struct kernel_stat {
 	unsigned int dk_drive_wblk[DK_MAX_MAJOR][DK_MAX_DISK];
 	unsigned int pgpgin, pgpgout;
 	unsigned int pswpin, pswpout;
+	unsigned int pgscan, pgsteal;	/* inactive pages scanned/reclaimed */
+	unsigned int pgunmap;		/* ptes cleared through the rmap */
 #if defined (__hppa__) 
 	unsigned int irqs[NR_CPUS][NR_IRQ_REGS][IRQ_PER_REGION];
 #elif !defined(CONFIG_ARCH_S390)
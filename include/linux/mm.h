@@ -18,9 +18,6 @@ extern unsigned long num_physpages;
 extern unsigned long num_mappedpages;
 extern void * high_memory;
 extern int page_cluster;
-/* The inactive_clean lists are per zone. */
-extern struct list_head active_list;
-extern struct list_head inactive_list;
 
 #include <asm/page.h>
 #include <asm/pgtable.h>
@@ -102,7 +99,7 @@ struct vm_area_struct {
 
 #define VM_DONTCOPY	0x00020000      /* Do not copy this vma on fork */
 #define VM_DONTEXPAND	0x00040000	/* Cannot expand with mremap() */
-#define VM_RESERVED	0x00080000	/* Don't unmap it from swap_out */
+#define VM_RESERVED	0x00080000	/* Don't unmap it in page reclaim */
 
 #ifndef VM_STACK_FLAGS
 #define VM_STACK_FLAGS	0x00000177
@@ -139,8 +136,8 @@ struct vm_operations_struct {
 /*
  * Each physical page in the system has a struct page associated with
  * it to keep track of whatever it is we are using the page for at the
- * moment. Note that we have no way to track which tasks are using
- * a page.
+ * moment.  The ptes mapping a user page are found through
+ * ->pte_chain, see mm/rmap.c.
  *
  * Try to keep the most commonly accessed fields in single cache lines
  * here (16 bytes or greater).  This ordering should be particularly
@@ -155,15 +152,17 @@ typedef struct page {
 	struct list_head list;		/* ->mapping has some page lists. */
 	struct address_space *mapping;	/* The inode (or ...) we belong to. */
 	unsigned long index;		/* Our offset within mapping. */
-	struct page *next_hash;		/* Next page sharing our hash bucket in
-					   the pagecache hash table. */
+	struct page *next_hash;		/* Not used by the page cache, free
+					   for the owner of the page. */
 	atomic_t count;			/* Usage count, see below. */
 	unsigned long flags;		/* atomic flags, some possibly
 					   updated asynchronously */
 	struct list_head lru;		/* Pageout list, eg. active_list;
-					   protected by pagemap_lru_lock !! */
-	struct page **pprev_hash;	/* Complement to *next_hash. */
+					   protected by zone->lru_lock !! */
+	struct page **pprev_hash;	/* Likewise. */
 	struct buffer_head * buffers;	/* Buffer maps us to a disk block. */
+	struct pte_chain * pte_chain;	/* Reverse mapping, protected by
+					   PG_chainlock. */
 
 	/*
 	 * On machines where all RAM is mapped into kernel address space,
@@ -199,6 +198,9 @@ typedef struct page {
 #define page_count(p)		atomic_read(&(p)->count)
 #define set_page_count(p,v) 	atomic_set(&(p)->count, v)
 
+/* Is the page mapped into any process?  Racy unless PG_chainlock is held. */
+#define page_mapped(p)		((p)->pte_chain != NULL)
+
 static inline struct page *nth_page(struct page *page, int n)
 {
 	return page + n;
@@ -247,9 +249,9 @@ static inline struct page *nth_page(struct page *page, int n)
  * using the page->list list_head. These fields are also used for
  * freelist managemet (when page->count==0).
  *
- * There is also a hash table mapping (mapping,index) to the page
- * in memory if present. The lists for this hash table use the fields
- * page->next_hash and page->pprev_hash.
+ * They are also indexed by page->index in the mapping->page_tree radix
+ * tree, which is what page cache lookups use.  Both the lists and the
+ * tree are protected by mapping->page_lock.
  *
  * All process pages can do I/O:
  * - inode pages may need to be read from disk,
@@ -273,7 +275,7 @@ static inline struct page *nth_page(struct page *page, int n)
  *
  * Note that the referenced bit, the page->lru list_head and the
  * active, inactive_dirty and inactive_clean lists are protected by
- * the pagemap_lru_lock, and *NOT* by the usual PG_locked bit!
+ * the lru_lock of the page's zone, and *NOT* by the usual PG_locked bit!
  *
  * PG_skip is used on sparc/sparc64 architectures to "skip" certain
  * parts of the address space.
@@ -305,6 +307,7 @@ static inline struct page *nth_page(struct page *page, int n)
 #define PG_reserved		14
 #define PG_launder		15	/* written out by VM pressure.. */
 #define PG_fs_1			16	/* Filesystem specific */
+#define PG_chainlock		17	/* Lock bit for ->pte_chain */
 
 #ifndef arch_set_page_uptodate
 #define arch_set_page_uptodate(page)
@@ -472,6 +475,7 @@ extern unsigned long FASTCALL(get_zeroed_page(unsigned int gfp_mask));
  */
 extern void FASTCALL(__free_pages(struct page *page, unsigned int order));
 extern void FASTCALL(free_pages(unsigned long addr, unsigned int order));
+extern void FASTCALL(free_cold_page(struct page *page));
 
 #define __free_page(page) __free_pages((page), 0)
 #define free_page(addr) free_pages((addr),0)
@@ -615,6 +619,7 @@ extern struct page *filemap_nopage(struct vm_area_struct *, unsigned long, int);
 #define __GFP_IO	0x40	/* Can start low memory physical IO? */
 #define __GFP_HIGHIO	0x80	/* Can start high mem physical IO? */
 #define __GFP_FS	0x100	/* Can call down to low-level FS? */
+#define __GFP_COLD	0x200	/* Cache-cold page wanted (device will fill it) */
 
 #define GFP_NOHIGHIO	(__GFP_HIGH | __GFP_WAIT | __GFP_IO)
 #define GFP_NOIO	(__GFP_HIGH | __GFP_WAIT)
@@ -8,6 +8,8 @@
 #include <linux/spinlock.h>
 #include <linux/list.h>
 #include <linux/wait.h>
+#include <linux/threads.h>
+#include <linux/cache.h>
 
 /*
  * Free memory management - zoned buddy allocator.
@@ -35,6 +37,29 @@ typedef struct zone_watermarks_s {
 	unsigned long min, low, high;
 } zone_watermarks_t;
 
+/*
+ * Each CPU keeps order-0 pages of each zone on lists of its own, taken
+ * from and given back to the buddy lists a batch at a time, so that most
+ * allocations and frees never touch zone->lock.  Pages just freed are
+ * likely still in the CPU's cache and go on the hot list; pages which
+ * a device is going to fill anyway come from the cold one.  The lists
+ * belong to their CPU and are only touched by it, with interrupts off.
+ */
+struct per_cpu_pages {
+	int count;		/* pages on the list */
+	int low;		/* refill the list when down to this */
+	int high;		/* drain the list when up to this */
+	int batch;		/* pages moved in one go */
+	struct list_head list;
+};
+
+struct per_cpu_pageset {
+	struct per_cpu_pages pcp[2];	/* 0: hot, 1: cold */
+	unsigned long hits;		/* allocations served by the lists */
+	unsigned long misses;		/* ... which had to refill them first */
+	unsigned long drains;		/* batches given back to the buddy lists */
+} ____cacheline_aligned_in_smp;
+
 
 /*
  * On machines where it is needed (eg PCs) we divide physical memory
@@ -49,7 +74,7 @@ typedef struct zone_struct {
 	 * Commonly accessed fields:
 	 */
 	spinlock_t		lock;
-	unsigned long		free_pages;
+	unsigned long		free_pages;	/* not counting the pagesets */
 	/*
 	 * We don't know if the memory that we're going to allocate will be freeable
 	 * or/and it will be released eventually, so to avoid totally wasting several
@@ -66,17 +91,25 @@ typedef struct zone_struct {
 	 * all architectures.
 	 */
 	unsigned long           need_balance;
-	/* protected by the pagemap_lru_lock */
-	unsigned long           nr_active_pages, nr_inactive_pages;
-	/* protected by the pagecache_lock */
+	/* protected by nr_cache_lock in mm/swap.c */
 	unsigned long           nr_cache_pages;
 
+	/*
+	 * The LRU lists of the pages in this zone.  nr_active_pages and
+	 * nr_inactive_pages count this zone only, unlike nr_cache_pages.
+	 */
+	spinlock_t		lru_lock;
+	struct list_head	active_list;
+	struct list_head	inactive_list;
+	unsigned long           nr_active_pages, nr_inactive_pages;
 
 	/*
 	 * free areas of different sizes
 	 */
 	free_area_t		free_area[MAX_ORDER];
 
+	struct per_cpu_pageset	pageset[NR_CPUS];
+
 	/*
 	 * wait_table		-- the array holding the hash table
 	 * wait_table_size	-- the size of the hash table array
@@ -147,7 +180,7 @@ typedef struct zonelist_struct {
  * On NUMA machines, each NUMA node would have a pg_data_t to describe
  * it's memory layout.
  *
- * XXX: we need to move the global memory statistics (active_list, ...)
+ * XXX: we need to move the global memory statistics (page_cache_size, ...)
  *      into the pg_data_t to properly support NUMA.
  */
 struct bootmem_data;
@@ -169,6 +169,8 @@ struct netif_rx_stats
 	unsigned fastroute_deferred_out;
 	unsigned fastroute_latency_reduction;
 	unsigned cpu_collision;
+	unsigned steered;		/* handed to another CPU's backlog */
+	unsigned processed;		/* taken off this CPU's backlog */
 } ____cacheline_aligned;
 
 extern struct netif_rx_stats netdev_rx_stat[];
@@ -527,6 +529,11 @@ struct softnet_data
 	struct list_head	poll_list;
 	struct net_device	*output_queue;
 	struct sk_buff		*completion_queue;
+#ifdef CONFIG_NET_RPS
+	int			rps_kick;	/* put blog_dev on our poll_list */
+#endif
+	struct sk_buff		*gro_list;	/* TCP flows being merged */
+	int			gro_count;
 
 	struct net_device	blog_dev;	/* Sorry. 8) */
 } ____cacheline_aligned;
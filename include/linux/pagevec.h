@@ -0,0 +1,59 @@
+#ifndef _LINUX_PAGEVEC_H
+#define _LINUX_PAGEVEC_H
+
+/*
+ * A pagevec is a small array of page pointers, used to batch up work
+ * on several pages so that a lock (typically a zone's lru_lock) is
+ * taken once per batch instead of once per page.  See mm/swap.c.
+ */
+
+#ifdef __KERNEL__
+
+/* The count and 15 pointers fill 64 bytes on 32-bit machines */
+#define PAGEVEC_SIZE	15
+
+struct page;
+
+struct pagevec {
+	unsigned int nr;
+	struct page *pages[PAGEVEC_SIZE];
+};
+
+static inline void pagevec_init(struct pagevec *pvec)
+{
+	pvec->nr = 0;
+}
+
+static inline unsigned int pagevec_count(struct pagevec *pvec)
+{
+	return pvec->nr;
+}
+
+static inline unsigned int pagevec_space(struct pagevec *pvec)
+{
+	return PAGEVEC_SIZE - pvec->nr;
+}
+
+/*
+ * Add a page to a pagevec.  Returns the number of slots still
+ * available, so zero means the caller must drain it now.
+ */
+static inline unsigned int pagevec_add(struct pagevec *pvec, struct page *page)
+{
+	pvec->pages[pvec->nr++] = page;
+	return pagevec_space(pvec);
+}
+
+extern void __pagevec_release(struct pagevec *pvec);
+extern void __pagevec_lru_add(struct pagevec *pvec);
+extern void __pagevec_activate(struct pagevec *pvec);
+
+static inline void pagevec_release(struct pagevec *pvec)
+{
+	if (pagevec_count(pvec))
+		__pagevec_release(pvec);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_PAGEVEC_H */
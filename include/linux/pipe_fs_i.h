@@ -2,11 +2,32 @@
 #define _LINUX_PIPE_FS_I_H
 
 #define PIPEFS_MAGIC 0x50495045
+
+/*
+ * A pipe is a ring of buffers, each of them a piece of a page which
+ * the pipe holds a reference on.  Pages which pipe_write() filled are
+ * the pipe's own and further writes may be appended to them; pages
+ * spliced in from elsewhere (the page cache, say) are only read.
+ */
+struct pipe_buffer {
+	struct page *page;
+	unsigned int offset;
+	unsigned int len;
+	unsigned int flags;
+};
+
+#define PIPE_BUF_FLAG_CAN_MERGE	0x01	/* ours, pipe_write() may append */
+
+/* The ring size of a new pipe: 16 pages */
+#define PIPE_DEF_BUFFERS	16
+
 struct pipe_inode_info {
 	wait_queue_head_t wait;
-	char *base;
-	unsigned int len;
-	unsigned int start;
+	unsigned int nrbufs;		/* buffers in use... */
+	unsigned int curbuf;		/* ...starting at this one */
+	unsigned int buffers;		/* ring size, a power of 2 */
+	struct pipe_buffer *bufs;
+	struct page *tmp_page;		/* a spare page for pipe_write() */
 	unsigned int readers;
 	unsigned int writers;
 	unsigned int waiting_readers;
@@ -15,15 +36,11 @@ struct pipe_inode_info {
 	unsigned int w_counter;
 };
 
-/* Differs from PIPE_BUF in that PIPE_SIZE is the length of the actual
-   memory allocation, whereas PIPE_BUF makes atomicity guarantees.  */
-#define PIPE_SIZE		PAGE_SIZE
-
 #define PIPE_SEM(inode)		(&(inode).i_sem)
 #define PIPE_WAIT(inode)	(&(inode).i_pipe->wait)
-#define PIPE_BASE(inode)	((inode).i_pipe->base)
-#define PIPE_START(inode)	((inode).i_pipe->start)
-#define PIPE_LEN(inode)		((inode).i_pipe->len)
+#define PIPE_NRBUFS(inode)	((inode).i_pipe->nrbufs)
+#define PIPE_CURBUF(inode)	((inode).i_pipe->curbuf)
+#define PIPE_BUFFERS(inode)	((inode).i_pipe->buffers)
 #define PIPE_READERS(inode)	((inode).i_pipe->readers)
 #define PIPE_WRITERS(inode)	((inode).i_pipe->writers)
 #define PIPE_WAITING_READERS(inode)	((inode).i_pipe->waiting_readers)
@@ -31,16 +48,44 @@ struct pipe_inode_info {
 #define PIPE_RCOUNTER(inode)	((inode).i_pipe->r_counter)
 #define PIPE_WCOUNTER(inode)	((inode).i_pipe->w_counter)
 
-#define PIPE_EMPTY(inode)	(PIPE_LEN(inode) == 0)
-#define PIPE_FULL(inode)	(PIPE_LEN(inode) == PIPE_SIZE)
-#define PIPE_FREE(inode)	(PIPE_SIZE - PIPE_LEN(inode))
-#define PIPE_END(inode)	((PIPE_START(inode) + PIPE_LEN(inode)) & (PIPE_SIZE-1))
-#define PIPE_MAX_RCHUNK(inode)	(PIPE_SIZE - PIPE_START(inode))
-#define PIPE_MAX_WCHUNK(inode)	(PIPE_SIZE - PIPE_END(inode))
+#define PIPE_EMPTY(inode)	(PIPE_NRBUFS(inode) == 0)
+#define PIPE_FULL(inode)	(PIPE_NRBUFS(inode) == PIPE_BUFFERS(inode))
+
+/* The n-th buffer in use, and the first free one */
+#define PIPE_BUF_NR(inode, n)	\
+	(&(inode).i_pipe->bufs[(PIPE_CURBUF(inode) + (n)) & (PIPE_BUFFERS(inode) - 1)])
+#define PIPE_FIRST_BUF(inode)	PIPE_BUF_NR(inode, 0)
+#define PIPE_LAST_BUF(inode)	PIPE_BUF_NR(inode, PIPE_NRBUFS(inode) - 1)
+#define PIPE_FREE_BUF(inode)	PIPE_BUF_NR(inode, PIPE_NRBUFS(inode))
 
 /* Drop the inode semaphore and wait for a pipe event, atomically */
 void pipe_wait(struct inode * inode);
 
 struct inode* pipe_new(struct inode* inode);
+void free_pipe_info(struct inode* inode);
+struct inode *new_internal_pipe(void);
+void free_internal_pipe(struct inode *inode);
+
+struct page *pipe_alloc_page(struct inode *inode);
+void pipe_buf_release(struct inode *inode, struct pipe_buffer *buf);
+void pipe_consume(struct inode *inode, struct pipe_buffer *buf, size_t len);
+
+long pipe_fcntl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+extern int pipe_max_size;
+
+/* splice() and tee() flags */
+#define SPLICE_F_MOVE		0x01	/* move pages rather than copy: a hint */
+#define SPLICE_F_NONBLOCK	0x02	/* don't wait on the pipe */
+#define SPLICE_F_MORE		0x04	/* more data follows */
+
+long do_splice_to(struct file *in, loff_t *ppos, struct inode *pipe,
+		  size_t len, unsigned int flags);
+long do_splice_from(struct inode *pipe, struct file *out, loff_t *ppos,
+		    size_t len, unsigned int flags);
+long do_splice_direct(struct file *in, loff_t *ppos, struct file *out,
+		      size_t len);
+long splice_pipe_to_pipe(struct inode *ipipe, struct inode *opipe,
+			 size_t len, unsigned int flags);
 
 #endif
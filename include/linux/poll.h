@@ -11,8 +11,17 @@
 #include <asm/uaccess.h>
 
 struct poll_table_page;
+struct poll_table_struct;
+
+/*
+ * poll_wait() hands each wait queue a ->poll method sleeps on to the
+ * table's queueing function.  select() and poll() use __pollwait(),
+ * eventpoll installs its own to hook a callback onto the queue.
+ */
+typedef void (*poll_queue_proc)(struct file *, wait_queue_head_t *, struct poll_table_struct *);
 
 typedef struct poll_table_struct {
+	poll_queue_proc qproc;
 	int error;
 	struct poll_table_page * table;
 } poll_table;
@@ -22,11 +31,17 @@ extern void __pollwait(struct file * filp, wait_queue_head_t * wait_address, pol
 static inline void poll_wait(struct file * filp, wait_queue_head_t * wait_address, poll_table *p)
 {
 	if (p && wait_address)
-		__pollwait(filp, wait_address, p);
+		p->qproc(filp, wait_address, p);
+}
+
+static inline void init_poll_funcptr(poll_table *pt, poll_queue_proc qproc)
+{
+	pt->qproc = qproc;
 }
 
 static inline void poll_initwait(poll_table* pt)
 {
+	init_poll_funcptr(pt, __pollwait);
 	pt->error = 0;
 	pt->table = NULL;
 }
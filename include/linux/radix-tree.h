@@ -0,0 +1,57 @@
+#ifndef _LINUX_RADIX_TREE_H
+#define _LINUX_RADIX_TREE_H
+
+/*
+ * A radix tree maps an unsigned long index to a pointer.  Lookups
+ * cost one node visit per RADIX_TREE_MAP_SHIFT bits of the largest
+ * index stored, and every slot can carry RADIX_TREE_TAGS tag bits
+ * which are propagated towards the root, so that all the tagged items
+ * in a range can be found without visiting the untagged ones.
+ *
+ * The tree does no locking of its own.  See lib/radix-tree.c.
+ */
+
+#ifdef __KERNEL__
+
+#define RADIX_TREE_TAGS		2
+
+struct radix_tree_node;
+
+struct radix_tree_root {
+	unsigned int		height;
+	int			gfp_mask;
+	struct radix_tree_node	*rnode;
+};
+
+#define RADIX_TREE_INIT(mask)	{ height: 0, gfp_mask: (mask), rnode: NULL }
+
+#define RADIX_TREE(name, mask) \
+	struct radix_tree_root name = RADIX_TREE_INIT(mask)
+
+#define INIT_RADIX_TREE(root, mask) do { \
+	(root)->height = 0; (root)->gfp_mask = (mask); (root)->rnode = NULL; \
+} while (0)
+
+extern int radix_tree_insert(struct radix_tree_root *, unsigned long, void *);
+extern void *radix_tree_lookup(struct radix_tree_root *, unsigned long);
+extern void *radix_tree_delete(struct radix_tree_root *, unsigned long);
+extern unsigned int radix_tree_gang_lookup(struct radix_tree_root *root,
+			void **results, unsigned long first_index,
+			unsigned int max_items);
+extern int radix_tree_preload(int gfp_mask);
+extern void radix_tree_init(void);
+
+extern void *radix_tree_tag_set(struct radix_tree_root *root,
+			unsigned long index, int tag);
+extern void *radix_tree_tag_clear(struct radix_tree_root *root,
+			unsigned long index, int tag);
+extern int radix_tree_tag_get(struct radix_tree_root *root,
+			unsigned long index, int tag);
+extern unsigned int radix_tree_gang_lookup_tag(struct radix_tree_root *root,
+			void **results, unsigned long first_index,
+			unsigned int max_items, int tag);
+extern int radix_tree_tagged(struct radix_tree_root *root, int tag);
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_RADIX_TREE_H */
@@ -0,0 +1,115 @@
+#ifndef __LINUX_RCUPDATE_H
+#define __LINUX_RCUPDATE_H
+
+/*
+ * Read-Copy Update mechanism for mutual exclusion.
+ *
+ * Readers walk a shared structure without taking any lock.  Writers
+ * unlink an element and hand it to call_rcu(), which invokes the
+ * callback once every CPU has passed through a quiescent state (a
+ * context switch, the idle loop or user mode), i.e. when no reader
+ * can still hold a pointer to the old element.
+ *
+ * The kernel is not preemptible, so a read-side critical section is
+ * simply a region that does not block.  See kernel/rcupdate.c.
+ */
+
+#ifdef __KERNEL__
+
+#include <linux/config.h>
+#include <linux/threads.h>
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <asm/system.h>
+
+struct rcu_head {
+	struct list_head list;
+	void (*func)(void *obj);
+	void *arg;
+};
+
+#define RCU_HEAD_INIT(head) \
+	{ list: LIST_HEAD_INIT(head.list), func: NULL, arg: NULL }
+#define RCU_HEAD(head) struct rcu_head head = RCU_HEAD_INIT(head)
+#define INIT_RCU_HEAD(ptr) do { \
+	INIT_LIST_HEAD(&(ptr)->list); (ptr)->func = NULL; (ptr)->arg = NULL; \
+} while (0)
+
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define rcu_read_lock_bh()	local_bh_disable()
+#define rcu_read_unlock_bh()	local_bh_enable()
+
+/*
+ * Alpha is the only port which can see a stale value through a
+ * freshly loaded pointer; everybody else gets the ordering for free.
+ */
+#if defined(__alpha__) && defined(CONFIG_SMP)
+#define rcu_read_barrier_depends()	mb()
+#else
+#define rcu_read_barrier_depends()	do { } while (0)
+#endif
+
+/*
+ * Load a pointer published with rcu_assign_pointer() for use on the
+ * read side.
+ */
+#define rcu_dereference(p) ({ \
+	typeof(p) _________p1 = (p); \
+	rcu_read_barrier_depends(); \
+	(_________p1); \
+})
+
+/*
+ * Publish a pointer to an initialized element.  The element's fields
+ * must be visible before the pointer to it is.
+ */
+#define rcu_assign_pointer(p, v) ({ \
+	wmb(); \
+	(p) = (v); \
+})
+
+/*
+ * List primitives for lists walked under RCU.  Writers serialize among
+ * themselves.  A deleted entry keeps its ->next pointer, so a reader
+ * standing on it can carry on; ->prev is cleared.
+ */
+static inline void list_add_rcu(struct list_head *new, struct list_head *head)
+{
+	new->next = head->next;
+	new->prev = head;
+	wmb();
+	head->next->prev = new;
+	head->next = new;
+}
+
+static inline void list_del_rcu(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	entry->prev = (void *) 0;
+}
+
+extern void call_rcu(struct rcu_head *head,
+		     void (*func)(void *arg), void *arg);
+extern void synchronize_kernel(void);
+extern void rcu_check_callbacks(int cpu, int user);
+extern void rcu_init(void);
+
+/*
+ * Per-CPU quiescent state counter, bumped on every context switch.
+ */
+struct rcu_data {
+	long		qsctr;		/* quiescent states passed */
+	long		last_qsctr;	/* value at start of current batch */
+	long		batch;		/* batch number curlist waits for */
+	struct list_head nxtlist;	/* callbacks not yet in a batch */
+	struct list_head curlist;	/* callbacks waiting for batch */
+} ____cacheline_aligned;
+
+extern struct rcu_data rcu_data[NR_CPUS];
+
+#define rcu_note_context_switch(cpu)	(rcu_data[(cpu)].qsctr++)
+
+#endif /* __KERNEL__ */
+
+#endif /* __LINUX_RCUPDATE_H */
@@ -0,0 +1,97 @@
+#ifndef _LINUX_RMAP_H
+#define _LINUX_RMAP_H
+
+/*
+ * Reverse mapping: every user page keeps a chain of the ptes which map
+ * it, and every page table page records the mm and the virtual address
+ * it covers.  Page reclaim uses this to unmap one particular page,
+ * instead of walking address spaces in the hope of finding its ptes.
+ * See mm/rmap.c.
+ */
+
+#ifdef __KERNEL__
+
+#include <linux/config.h>
+#include <linux/mm.h>
+#include <asm/bitops.h>
+#include <asm/processor.h>
+
+struct pte_chain {
+	struct pte_chain *next;
+	pte_t *ptep;
+};
+
+/*
+ * page->pte_chain is protected by a bit spinlock in page->flags.
+ * It nests inside mm->page_table_lock.
+ */
+static inline void pte_chain_lock(struct page *page)
+{
+#ifdef CONFIG_SMP
+	while (test_and_set_bit(PG_chainlock, &page->flags)) {
+		while (test_bit(PG_chainlock, &page->flags))
+			cpu_relax();
+	}
+#endif
+}
+
+static inline void pte_chain_unlock(struct page *page)
+{
+#ifdef CONFIG_SMP
+	smp_mb__before_clear_bit();
+	clear_bit(PG_chainlock, &page->flags);
+#endif
+}
+
+/*
+ * A page table page is tagged with its mm and base address when it
+ * is hooked into the page tables, so that a pte pointer found on a
+ * pte_chain can be turned back into (mm, address).
+ */
+static inline void pgtable_add_rmap(pte_t *ptep, struct mm_struct *mm,
+	unsigned long address)
+{
+	struct page *page = virt_to_page(ptep);
+
+	page->mapping = (void *) mm;
+	page->index = address & ~((PTRS_PER_PTE * PAGE_SIZE) - 1);
+}
+
+static inline void pgtable_remove_rmap(pte_t *ptep)
+{
+	struct page *page = virt_to_page(ptep);
+
+	page->mapping = NULL;
+	page->index = 0;
+}
+
+static inline struct mm_struct *ptep_to_mm(pte_t *ptep)
+{
+	return (struct mm_struct *) virt_to_page(ptep)->mapping;
+}
+
+static inline unsigned long ptep_to_address(pte_t *ptep)
+{
+	unsigned long offset = (unsigned long) ptep & ~PAGE_MASK;
+
+	return virt_to_page(ptep)->index +
+		((offset / sizeof(pte_t)) << PAGE_SHIFT);
+}
+
+/* try_to_unmap() return values */
+#define SWAP_SUCCESS	0	/* all the ptes are gone */
+#define SWAP_AGAIN	1	/* some page table was busy, retry later */
+#define SWAP_FAIL	2	/* the page can't be unmapped at all */
+
+extern struct pte_chain *pte_chain_alloc(int gfp_mask);
+extern void pte_chain_free(struct pte_chain *pte_chain);
+extern struct pte_chain *page_add_rmap(struct page *page, pte_t *ptep,
+	struct pte_chain *pte_chain);
+extern void page_remove_rmap(struct page *page, pte_t *ptep);
+extern int page_referenced(struct page *page);
+extern int try_to_unmap(struct page *page);
+extern void pte_chain_init(void);
+
+#endif /* __KERNEL__ */
+
+#endif /* _LINUX_RMAP_H */
@@ -73,7 +73,7 @@ extern unsigned long avenrun[];		/* Load averages */
 #define CT_TO_SECS(x)	((x) / HZ)
 #define CT_TO_USECS(x)	(((x) % HZ) * 1000000/HZ)
 
-extern int nr_running, nr_threads;
+extern int nr_threads;
 extern int last_pid;
 
 #include <linux/fs.h>
@@ -132,7 +132,6 @@ struct completion;
  * a separate lock).
  */
 extern rwlock_t tasklist_lock;
-extern spinlock_t runqueue_lock;
 extern spinlock_t mmlist_lock;
 
 extern void sched_init(void);
@@ -155,9 +154,13 @@ extern int current_is_keventd(void);
 
 #if CONFIG_SMP
 extern void set_cpus_allowed(struct task_struct *p, unsigned long new_mask);
+extern void scheduler_tick(int idle);
 #else
 # define set_cpus_allowed(p, new_mask) do { } while (0)
+# define scheduler_tick(idle) do { } while (0)
 #endif
+extern void set_user_nice(struct task_struct *p, long nice);
+extern unsigned long nr_running(void);
 
 /*
  * The default fd array needs to be at least BITS_PER_LONG,
@@ -225,10 +228,13 @@ struct mm_struct {
 	unsigned long rss, total_vm, locked_vm;
 	unsigned long def_flags;
 	unsigned long cpu_vm_mask;
-	unsigned long swap_address;
 
 	unsigned dumpable:1;
 
+	/* Kernel AIO contexts, see fs/aio.c */
+	rwlock_t ioctx_list_lock;
+	struct list_head ioctx_list;
+
 	/* Architecture-specific MM context */
 	mm_context_t context;
 };
@@ -244,6 +250,8 @@ extern int mmlist_nr;
 	mmap_sem:	__RWSEM_INITIALIZER(name.mmap_sem), \
 	page_table_lock: SPIN_LOCK_UNLOCKED, 		\
 	mmlist:		LIST_HEAD_INIT(name.mmlist),	\
+	ioctx_list_lock: RW_LOCK_UNLOCKED,		\
+	ioctx_list:	LIST_HEAD_INIT(name.ioctx_list), \
 }
 
 struct signal_struct {
@@ -299,8 +307,8 @@ struct task_struct {
 
 /*
  * offset 32 begins here on 32-bit platforms. We keep
- * all fields in a single cacheline that are needed for
- * the goodness() loop in schedule().
+ * all fields in a single cacheline that are needed by
+ * schedule().
  */
 	long counter;
 	long nice;
@@ -322,6 +330,8 @@ struct task_struct {
 	 */
 	struct list_head run_list;
 	unsigned long sleep_time;
+	int prio;			/* queue index in the runqueue's prio_array */
+	struct prio_array *array;	/* NULL if not on a runqueue */
 
 	struct task_struct *next_task, *prev_task;
 	struct mm_struct *active_mm;
@@ -894,17 +904,11 @@ do {									\
 
 #define thread_group_leader(p)	(p->pid == p->tgid)
 
-static inline void del_from_runqueue(struct task_struct * p)
-{
-	nr_running--;
-	p->sleep_time = jiffies;
-	list_del(&p->run_list);
-	p->run_list.next = NULL;
-}
+extern void del_from_runqueue(struct task_struct * p);
 
 static inline int task_on_runqueue(struct task_struct *p)
 {
-	return (p->run_list.next != NULL);
+	return (p->array != NULL);
 }
 
 static inline void unhash_process(struct task_struct *p)
@@ -190,6 +190,7 @@ struct sk_buff {
 	atomic_t	users;			/* User count - see datagram.c,tcp.c 		*/
 	unsigned short	protocol;		/* Packet protocol from driver. 		*/
 	unsigned short	security;		/* Security level of packet			*/
+	unsigned short	gso_size;		/* Segment size of a GSO/GRO super-packet	*/
 	unsigned int	truesize;		/* Buffer size 					*/
 
 	unsigned char	*head;			/* Head of buffer 				*/
@@ -241,6 +242,7 @@ extern struct sk_buff *		skb_copy_expand(const struct sk_buff *skb,
 						int newheadroom,
 						int newtailroom,
 						int priority);
+extern void			copy_skb_header(struct sk_buff *new, const struct sk_buff *old);
 extern struct sk_buff *		skb_pad(struct sk_buff *skb, int pad);
 #define dev_kfree_skb(a)	kfree_skb(a)
 extern void	skb_over_panic(struct sk_buff *skb, int len, void *here);
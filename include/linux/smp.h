@@ -28,6 +28,12 @@ extern void smp_send_stop(void);
  */
 extern void FASTCALL(smp_send_reschedule(int cpu));
 
+/*
+ * Raise a softirq on another CPU (only where the architecture has an
+ * IPI for it, see CONFIG_NET_RPS).
+ */
+extern void smp_raise_softirq(int cpu, int nr);
+
 
 /*
  * Boot processor call to load the other CPU's
@@ -86,14 +86,11 @@ extern int nr_swap_pages;
 extern unsigned int nr_free_pages(void);
 extern unsigned int nr_free_buffer_pages(void);
 extern unsigned int freeable_lowmem(void);
-extern int nr_active_pages;
-extern int nr_inactive_pages;
+extern unsigned int nr_active_pages(void);
+extern unsigned int nr_inactive_pages(void);
 extern unsigned long page_cache_size;
 extern atomic_t buffermem_pages;
 
-extern spinlock_cacheline_t pagecache_lock_cacheline;
-#define pagecache_lock (pagecache_lock_cacheline.lock)
-
 extern void __remove_inode_page(struct page *);
 
 /* Incomplete types for prototype declarations: */
@@ -109,6 +106,7 @@ extern void FASTCALL(__lru_cache_del(struct page *));
 extern void FASTCALL(lru_cache_del(struct page *));
 
 extern void FASTCALL(activate_page(struct page *));
+extern void lru_add_drain(void);
 
 extern void swap_setup(void);
 
@@ -116,7 +114,7 @@ extern void swap_setup(void);
 extern wait_queue_head_t kswapd_wait;
 extern int FASTCALL(try_to_free_pages_zone(zone_t *, unsigned int));
 extern int FASTCALL(try_to_free_pages(unsigned int));
-extern int vm_vfs_scan_ratio, vm_cache_scan_ratio, vm_lru_balance_ratio, vm_passes, vm_gfp_debug, vm_mapped_ratio, vm_anon_lru;
+extern int vm_vfs_scan_ratio, vm_cache_scan_ratio, vm_lru_balance_ratio, vm_passes, vm_gfp_debug, vm_mapped_ratio;
 
 /* linux/mm/page_io.c */
 extern void rw_swap_page(int, struct page *);
@@ -130,6 +128,8 @@ extern void rw_swap_page_nolock(int, swp_entry_t, char *);
 extern void show_swap_cache_info(void);
 #endif
 extern int add_to_swap_cache(struct page *, swp_entry_t);
+extern int move_to_swap_cache(struct page *, swp_entry_t);
+extern int add_to_swap(struct page *);
 extern void __delete_from_swap_cache(struct page *page);
 extern void delete_from_swap_cache(struct page *page);
 extern void free_page_and_swap_cache(struct page *page);
@@ -160,14 +160,11 @@ extern struct swap_list_t swap_list;
 asmlinkage long sys_swapoff(const char *);
 asmlinkage long sys_swapon(const char *, int);
 
-extern spinlock_cacheline_t pagemap_lru_lock_cacheline;
-#define pagemap_lru_lock pagemap_lru_lock_cacheline.lock
-
 extern void FASTCALL(mark_page_accessed(struct page *));
 
 /*
  * List add/del helper macros. These must be called
- * with the pagemap_lru_lock held!
+ * with the lru_lock of the page's zone held!
  */
 #define DEBUG_LRU_PAGE(page)			\
 do {						\
@@ -177,40 +174,34 @@ do {						\
 		BUG();				\
 } while (0)
 
-extern void delta_nr_active_pages(struct page *page, long delta);
-#define inc_nr_active_pages(page) delta_nr_active_pages(page, 1)
-#define dec_nr_active_pages(page) delta_nr_active_pages(page, -1)
-
-extern void delta_nr_inactive_pages(struct page *page, long delta);
-#define inc_nr_inactive_pages(page) delta_nr_inactive_pages(page, 1)
-#define dec_nr_inactive_pages(page) delta_nr_inactive_pages(page, -1)
-
 #define add_page_to_active_list(page)		\
 do {						\
+	zone_t *__zone = page_zone(page);	\
 	DEBUG_LRU_PAGE(page);			\
 	SetPageActive(page);			\
-	list_add(&(page)->lru, &active_list);	\
-	inc_nr_active_pages(page);		\
+	list_add(&(page)->lru, &__zone->active_list); \
+	__zone->nr_active_pages++;		\
 } while (0)
 
 #define add_page_to_inactive_list(page)		\
 do {						\
+	zone_t *__zone = page_zone(page);	\
 	DEBUG_LRU_PAGE(page);			\
-	list_add(&(page)->lru, &inactive_list);	\
-	inc_nr_inactive_pages(page);		\
+	list_add(&(page)->lru, &__zone->inactive_list); \
+	__zone->nr_inactive_pages++;		\
 } while (0)
 
 #define del_page_from_active_list(page)		\
 do {						\
 	list_del(&(page)->lru);			\
 	ClearPageActive(page);			\
-	dec_nr_active_pages(page);		\
+	page_zone(page)->nr_active_pages--;	\
 } while (0)
 
 #define del_page_from_inactive_list(page)	\
 do {						\
 	list_del(&(page)->lru);			\
-	dec_nr_inactive_pages(page);		\
+	page_zone(page)->nr_inactive_pages--;	\
 } while (0)
 
 extern void delta_nr_cache_pages(struct page *page, long delta);
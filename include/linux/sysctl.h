@@ -157,7 +157,7 @@ enum
 	VM_MAPPED_RATIO=20,	/* amount of unfreeable pages that triggers swapout */
 	VM_LAPTOP_MODE=21,	/* kernel in laptop flush mode */
 	VM_BLOCK_DUMP=22,	/* dump fs activity to log */
-	VM_ANON_LRU=23,		/* immediatly insert anon pages in the vm page lru */
+	VM_ANON_LRU=23,		/* unused, anon pages are always on the lru */
 };
 
 
@@ -224,6 +224,8 @@ enum
 	NET_CORE_MOD_CONG=16,
 	NET_CORE_DEV_WEIGHT=17,
 	NET_CORE_SOMAXCONN=18,
+	NET_CORE_RPS_CPUS=19,
+	NET_CORE_GRO=20,
 };
 
 /* /proc/sys/net/ethernet */
@@ -327,6 +329,7 @@ enum
 	NET_TCP_DEFAULT_WIN_SCALE=105,
 	NET_TCP_MODERATE_RCVBUF=106,
 	NET_TCP_BIC_BETA=108,
+	NET_TCP_GSO=109,
 };
 
 enum {
@@ -631,6 +634,9 @@ enum
 	FS_LEASE_TIME=15,	/* int: maximum time to wait for a lease break */
 	FS_DQSTATS=16,	/* dir: disc quota usage statistics and settings */
 	FS_XFS=17,	/* struct: control xfs parameters */
+	FS_AIO_NR=18,	/* int: current number of aio requests */
+	FS_AIO_MAX_NR=19,	/* int: system wide maximum number of aio requests */
+	FS_PIPE_MAX_SIZE=20,	/* int: pipe size limit for unprivileged users */
 };
 
 /* /proc/sys/fs/quota/ */
@@ -13,15 +13,20 @@
  * timeouts. You can use this field to distinguish between the different
  * invocations.
  */
+struct tvec_base;
+
 struct timer_list {
 	struct list_head list;
 	unsigned long expires;
 	unsigned long data;
 	void (*function)(unsigned long);
+	struct tvec_base *base;		/* per-CPU timer base while pending */
+	void *start_site;		/* who armed it, for /proc/timer_stats */
 };
 
 extern void add_timer(struct timer_list * timer);
 extern int del_timer(struct timer_list * timer);
+extern void bust_timer_locks(void);
 
 #ifdef CONFIG_SMP
 extern int del_timer_sync(struct timer_list * timer);
@@ -45,8 +50,13 @@ extern void it_real_fn(unsigned long);
 static inline void init_timer(struct timer_list * timer)
 {
 	timer->list.next = timer->list.prev = NULL;
+	timer->base = NULL;
 }
 
+/*
+ * Safe to call without any lock: a timer is pending from the moment
+ * it is queued until it is deleted or its handler is about to run.
+ */
 static inline int timer_pending (const struct timer_list * timer)
 {
 	return timer->list.next != NULL;
@@ -156,14 +156,31 @@ extern struct linux_mib	net_statistics[NR_CPUS*2];
 #define NET_INC_STATS(field)		SNMP_INC_STATS(net_statistics, field)
 #define NET_INC_STATS_BH(field)		SNMP_INC_STATS_BH(net_statistics, field)
 #define NET_INC_STATS_USER(field) 	SNMP_INC_STATS_USER(net_statistics, field)
+#define NET_ADD_STATS_BH(field, val)	SNMP_ADD_STATS_BH(net_statistics, field, val)
 
 extern int sysctl_local_port_range[2];
 extern int sysctl_ip_default_ttl;
 
+/*
+ * The size of the largest packet @skb leaves as: a TCP super-packet
+ * (see skb_gso_segment()) goes out in segments of gso_size bytes of
+ * payload, each with a copy of its headers.
+ */
+static inline unsigned int ip_skb_wire_len(struct sk_buff *skb)
+{
+	struct iphdr *iph = skb->nh.iph;
+	struct tcphdr *th;
+
+	if (!skb->gso_size)
+		return skb->len;
+	th = (struct tcphdr *)((u8 *)iph + iph->ihl * 4);
+	return iph->ihl * 4 + th->doff * 4 + skb->gso_size;
+}
+
 #ifdef CONFIG_INET
 static inline int ip_send(struct sk_buff *skb)
 {
-	if (skb->len > skb->dst->pmtu)
+	if (ip_skb_wire_len(skb) > skb->dst->pmtu)
 		return ip_fragment(skb, ip_finish_output);
 	else
 		return ip_finish_output(skb);
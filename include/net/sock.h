@@ -1069,6 +1069,36 @@ static inline void sock_hold(struct sock *sk)
 	atomic_inc(&sk->refcnt);
 }
 
+/* TCP looks up established sockets without taking the hash chain
+   lock where the architecture has cmpxchg(), see tcp_ipv4.c.  For a
+   lookup which races with the socket being freed to be safe, the sock
+   and TIME_WAIT caches then never give their pages back and freed
+   sockets keep a zero refcnt, which slab poisoning would break.
+ */
+#if defined(CONFIG_SMP) && defined(__HAVE_ARCH_CMPXCHG) && \
+    !defined(CONFIG_DEBUG_SLAB)
+#define SOCK_LOCKLESS_LOOKUP
+#define SOCK_CACHE_FLAGS	(SLAB_HWCACHE_ALIGN | SLAB_NO_REAP)
+
+/* Grab socket reference count, unless it has dropped to zero already
+   and the socket is being freed.  Returns 0 in the latter case.
+ */
+static inline int sock_hold_not_zero(struct sock *sk)
+{
+	int c = atomic_read(&sk->refcnt), old;
+
+	while (c != 0) {
+		old = cmpxchg(&sk->refcnt.counter, c, c + 1);
+		if (old == c)
+			return 1;
+		c = old;
+	}
+	return 0;
+}
+#else
+#define SOCK_CACHE_FLAGS	SLAB_HWCACHE_ALIGN
+#endif
+
 /* Ungrab socket in the context, which assumes that socket refcnt
    cannot hit zero, f.e. it is true in context of any socketcall.
  */
@@ -38,9 +38,60 @@
  */
 struct tcp_ehash_bucket {
 	rwlock_t	lock;
+	unsigned int	seq;	/* odd while the chains are being changed */
 	struct sock	*chain;
 } __attribute__((__aligned__(8)));
 
+/* Writers to the established and TIME_WAIT chains of a bucket take its
+ * lock and bump seq around the change, so that lookups which walk the
+ * chains without the lock can tell that they moved under them.  Both
+ * chains are covered by the lock and seq of the established bucket.
+ */
+static inline void tcp_ehash_write_lock(struct tcp_ehash_bucket *head)
+{
+	write_lock(&head->lock);
+	head->seq++;
+	smp_wmb();
+}
+
+static inline void tcp_ehash_write_unlock(struct tcp_ehash_bucket *head)
+{
+	smp_wmb();
+	head->seq++;
+	write_unlock(&head->lock);
+}
+
+static inline void tcp_ehash_write_lock_bh(struct tcp_ehash_bucket *head)
+{
+	local_bh_disable();
+	tcp_ehash_write_lock(head);
+}
+
+static inline void tcp_ehash_write_unlock_bh(struct tcp_ehash_bucket *head)
+{
+	tcp_ehash_write_unlock(head);
+	local_bh_enable();
+}
+
+/* Start a lockless walk of the bucket: returns the seq to check against */
+static inline unsigned int tcp_ehash_read_begin(struct tcp_ehash_bucket *head)
+{
+	unsigned int seq;
+
+	while ((seq = head->seq) & 1)
+		barrier();
+	smp_rmb();
+	return seq;
+}
+
+/* Did the chains change since tcp_ehash_read_begin() returned seq? */
+static inline int tcp_ehash_read_retry(struct tcp_ehash_bucket *head,
+				       unsigned int seq)
+{
+	smp_rmb();
+	return head->seq != seq;
+}
+
 /* This is for listening sockets, thus all sockets which possess wildcards. */
 #define TCP_LHTABLE_SIZE	32	/* Yes, really, this is all you need. */
 
@@ -193,7 +244,17 @@ struct tcp_tw_bucket {
 #endif
 };
 
+/* IPv4 buckets come from a cache of their own, sized without the
+ * IPv6 addresses at the end.
+ */
 extern kmem_cache_t *tcp_timewait_cachep;
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+extern kmem_cache_t *tcp6_timewait_cachep;
+#define tcp_tw_cachep(family)	\
+	((family) == PF_INET6 ? tcp6_timewait_cachep : tcp_timewait_cachep)
+#else
+#define tcp_tw_cachep(family)	tcp_timewait_cachep
+#endif
 
 static inline void tcp_tw_put(struct tcp_tw_bucket *tw)
 {
@@ -201,7 +262,7 @@ static inline void tcp_tw_put(struct tcp_tw_bucket *tw)
 #ifdef INET_REFCNT_DEBUG
 		printk(KERN_DEBUG "tw_bucket %p released\n", tw);
 #endif
-		kmem_cache_free(tcp_timewait_cachep, tw);
+		kmem_cache_free(tcp_tw_cachep(tw->family), tw);
 	}
 }
 
@@ -352,6 +413,8 @@ static __inline__ int tcp_sk_listen_hashfn(struct sock *sk)
 /* TIME_WAIT reaping mechanism. */
 #define TCP_TWKILL_SLOTS	8	/* Please keep this a power of 2. */
 #define TCP_TWKILL_PERIOD	(TCP_TIMEWAIT_LEN/TCP_TWKILL_SLOTS)
+#define TCP_TWKILL_QUOTA	100	/* buckets killed per timer run or
+					 * keventd pass */
 
 #define TCP_SYNQ_INTERVAL	(HZ/5)	/* Period of SYNACK timer */
 #define TCP_SYNQ_HSIZE		512	/* Size of SYNACK hash table */
@@ -493,6 +556,7 @@ extern int sysctl_tcp_bic_low_window;
 extern int sysctl_tcp_bic_beta;
 extern int sysctl_tcp_default_win_scale;
 extern int sysctl_tcp_moderate_rcvbuf;
+extern int sysctl_tcp_gso;
 
 extern atomic_t tcp_memory_allocated;
 extern atomic_t tcp_sockets_allocated;
@@ -655,6 +719,7 @@ extern struct tcp_mib tcp_statistics[NR_CPUS*2];
 #define TCP_INC_STATS(field)		SNMP_INC_STATS(tcp_statistics, field)
 #define TCP_INC_STATS_BH(field)		SNMP_INC_STATS_BH(tcp_statistics, field)
 #define TCP_INC_STATS_USER(field) 	SNMP_INC_STATS_USER(tcp_statistics, field)
+#define TCP_ADD_STATS(field, val)	SNMP_ADD_STATS(tcp_statistics, field, val)
 #define TCP_ADD_STATS_BH(field, val)	SNMP_ADD_STATS_BH(tcp_statistics, field, val)
 #define TCP_ADD_STATS_USER(field, val)	SNMP_ADD_STATS_USER(tcp_statistics, field, val)
 
@@ -28,6 +28,9 @@
 #include <linux/bootmem.h>
 #include <linux/file.h>
 #include <linux/tty.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/rmap.h>
 
 #include <asm/io.h>
 #include <asm/bugs.h>
@@ -372,6 +375,7 @@ asmlinkage void __init start_kernel(void)
 	init_IRQ();
 	sched_init();
 	softirq_init();
+	rcu_init();
 	time_init();
 
 	/*
@@ -420,9 +424,10 @@ asmlinkage void __init start_kernel(void)
   
 	fork_init(num_mappedpages);
 	proc_caches_init();
+	radix_tree_init();
+	pte_chain_init();
 	vfs_caches_init(num_physpages);
 	buffer_init(num_physpages);
-	page_cache_init(num_physpages);
 #if defined(CONFIG_ARCH_S390)
 	ccwcache_init();
 #endif
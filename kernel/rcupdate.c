@@ -0,0 +1,229 @@
+/*
+ * Read-Copy Update mechanism for mutual exclusion
+ *
+ * Callbacks registered with call_rcu() are collected per CPU and
+ * processed in batches.  A batch completes once every online CPU has
+ * gone through a quiescent state after the batch started: a context
+ * switch (counted in schedule()), or a timer tick taken in user mode
+ * or in the idle loop (checked from update_process_times()).  All the
+ * bookkeeping that is not on the tick itself runs from a per-CPU
+ * tasklet, so call_rcu() is cheap and safe from any context.
+ */
+
+#include <linux/config.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/interrupt.h>
+#include <linux/smp.h>
+#include <linux/completion.h>
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <asm/bitops.h>
+
+/*
+ * Global control block.  curbatch is the batch currently waiting for
+ * quiescent states, maxbatch the highest batch anybody asked for and
+ * cpumask the CPUs which still have to report for curbatch.
+ */
+static struct rcu_ctrlblk {
+	spinlock_t	mutex;
+	long		curbatch;
+	long		maxbatch;
+	unsigned long	cpumask;
+} rcu_ctrlblk = {
+	mutex:		SPIN_LOCK_UNLOCKED,
+	curbatch:	1,
+	maxbatch:	1,
+	cpumask:	0,
+};
+
+struct rcu_data rcu_data[NR_CPUS] __cacheline_aligned;
+
+static struct tasklet_struct rcu_tasklet[NR_CPUS];
+
+#define RCU_QSCTR_INVALID	0
+
+/* Batch numbers wrap, compare them like jiffies */
+#define rcu_batch_before(a, b)	((long)(a) - (long)(b) < 0)
+#define rcu_batch_after(a, b)	((long)(a) - (long)(b) > 0)
+
+/**
+ * call_rcu - queue an update to run after a grace period
+ * @head: structure used to queue the update
+ * @func: the function to call once no reader can see the old data
+ * @arg: argument to @func
+ *
+ * @func is called from softirq context, after all CPUs have passed
+ * through a quiescent state.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(void *arg), void *arg)
+{
+	unsigned long flags;
+
+	head->func = func;
+	head->arg = arg;
+	local_irq_save(flags);
+	list_add_tail(&head->list, &rcu_data[smp_processor_id()].nxtlist);
+	local_irq_restore(flags);
+}
+
+static void rcu_do_batch(struct list_head *list)
+{
+	struct rcu_head *head;
+
+	while (!list_empty(list)) {
+		head = list_entry(list->next, struct rcu_head, list);
+		list_del(&head->list);
+		head->func(head->arg);
+	}
+}
+
+/*
+ * Make sure a batch no earlier than newbatch gets processed, and
+ * start it right away if nothing is in progress.
+ * Must be called with rcu_ctrlblk.mutex held.
+ */
+static void rcu_start_batch(long newbatch)
+{
+	if (rcu_batch_before(rcu_ctrlblk.maxbatch, newbatch))
+		rcu_ctrlblk.maxbatch = newbatch;
+	if (rcu_batch_before(rcu_ctrlblk.maxbatch, rcu_ctrlblk.curbatch) ||
+	    rcu_ctrlblk.cpumask != 0)
+		return;
+	rcu_ctrlblk.cpumask = cpu_online_map;
+}
+
+/*
+ * Report this CPU if it went through a quiescent state since the
+ * current batch started.  The last CPU to report ends the batch.
+ */
+static void rcu_check_quiescent_state(int cpu)
+{
+	struct rcu_data *rdp = rcu_data + cpu;
+
+	if (!test_bit(cpu, &rcu_ctrlblk.cpumask))
+		return;
+
+	/*
+	 * The first time round just take a snapshot of the counter.
+	 * Racing with the local tick can at worst make us miss one
+	 * quiescent state, so no need to disable interrupts.
+	 */
+	if (rdp->last_qsctr == RCU_QSCTR_INVALID) {
+		rdp->last_qsctr = rdp->qsctr;
+		return;
+	}
+	if (rdp->qsctr == rdp->last_qsctr)
+		return;
+
+	spin_lock(&rcu_ctrlblk.mutex);
+	if (!test_bit(cpu, &rcu_ctrlblk.cpumask))
+		goto out_unlock;
+
+	clear_bit(cpu, &rcu_ctrlblk.cpumask);
+	rdp->last_qsctr = RCU_QSCTR_INVALID;
+	if (rcu_ctrlblk.cpumask != 0)
+		goto out_unlock;
+
+	rcu_ctrlblk.curbatch++;
+	rcu_start_batch(rcu_ctrlblk.maxbatch);
+
+out_unlock:
+	spin_unlock(&rcu_ctrlblk.mutex);
+}
+
+static void rcu_process_callbacks(unsigned long unused)
+{
+	int cpu = smp_processor_id();
+	struct rcu_data *rdp = rcu_data + cpu;
+	LIST_HEAD(list);
+
+	if (!list_empty(&rdp->curlist) &&
+	    rcu_batch_after(rcu_ctrlblk.curbatch, rdp->batch)) {
+		list_splice(&rdp->curlist, &list);
+		INIT_LIST_HEAD(&rdp->curlist);
+	}
+
+	local_irq_disable();
+	if (!list_empty(&rdp->nxtlist) && list_empty(&rdp->curlist)) {
+		list_splice(&rdp->nxtlist, &rdp->curlist);
+		INIT_LIST_HEAD(&rdp->nxtlist);
+		local_irq_enable();
+
+		spin_lock(&rcu_ctrlblk.mutex);
+		rdp->batch = rcu_ctrlblk.curbatch + 1;
+		rcu_start_batch(rdp->batch);
+		spin_unlock(&rcu_ctrlblk.mutex);
+	} else
+		local_irq_enable();
+
+	rcu_check_quiescent_state(cpu);
+	if (!list_empty(&list))
+		rcu_do_batch(&list);
+}
+
+static inline int rcu_pending(int cpu)
+{
+	struct rcu_data *rdp = rcu_data + cpu;
+
+	if (!list_empty(&rdp->curlist) &&
+	    rcu_batch_before(rdp->batch, rcu_ctrlblk.curbatch))
+		return 1;
+	if (list_empty(&rdp->curlist) && !list_empty(&rdp->nxtlist))
+		return 1;
+	if (test_bit(cpu, &rcu_ctrlblk.cpumask))
+		return 1;
+	return 0;
+}
+
+/*
+ * Called from the timer interrupt on every CPU.  A tick that hit user
+ * mode, or the idle task outside of any nested interrupt or bottom
+ * half, is a quiescent state.
+ */
+void rcu_check_callbacks(int cpu, int user)
+{
+	if (user || (!current->pid && !local_bh_count(cpu) &&
+		     local_irq_count(cpu) <= 1))
+		rcu_data[cpu].qsctr++;
+	if (rcu_pending(cpu))
+		tasklet_schedule(rcu_tasklet + cpu);
+}
+
+void __init rcu_init(void)
+{
+	int i;
+
+	for (i = 0; i < NR_CPUS; i++) {
+		struct rcu_data *rdp = rcu_data + i;
+
+		rdp->qsctr = 1;
+		rdp->last_qsctr = RCU_QSCTR_INVALID;
+		rdp->batch = 0;
+		INIT_LIST_HEAD(&rdp->nxtlist);
+		INIT_LIST_HEAD(&rdp->curlist);
+		tasklet_init(rcu_tasklet + i, rcu_process_callbacks, 0UL);
+	}
+}
+
+static void wakeme_after_rcu(void *arg)
+{
+	complete((struct completion *) arg);
+}
+
+/**
+ * synchronize_kernel - wait until all CPUs have gone through a
+ * quiescent state, so that every reader that started before the
+ * call has finished.  May sleep.
+ */
+void synchronize_kernel(void)
+{
+	struct rcu_head rcu;
+	DECLARE_COMPLETION(completion);
+
+	call_rcu(&rcu, wakeme_after_rcu, &completion);
+	wait_for_completion(&completion);
+}
+
+EXPORT_SYMBOL(call_rcu);
+EXPORT_SYMBOL(synchronize_kernel);
@@ -29,6 +29,7 @@
 #include <linux/completion.h>
 #include <linux/prefetch.h>
 #include <linux/compiler.h>
+#include <linux/rcupdate.h>
 
 #include <asm/uaccess.h>
 #include <asm/mmu_context.h>
@@ -75,271 +76,366 @@ extern void mem_use(void);
  *	Init task must be ok at boot for the ix86 as we will check its signals
  *	via the SMP irq return path.
  */
- 
+
 struct task_struct * init_tasks[NR_CPUS] = {&init_task, };
 
 /*
  * The tasklist_lock protects the linked list of processes.
  *
- * The runqueue_lock locks the parts that actually access
- * and change the run-queues, and have to be interrupt-safe.
- *
- * If both locks are to be concurrently held, the runqueue_lock
- * nests inside the tasklist_lock.
+ * Each CPU has its own runqueue, protected by its own interrupt-safe
+ * lock (rq->lock).  If a runqueue lock and the tasklist_lock are to be
+ * held together, the runqueue lock nests inside the tasklist_lock.
+ * Two runqueue locks are always taken in address order, see
+ * double_rq_lock().
  *
  * task->alloc_lock nests inside tasklist_lock.
  */
-spinlock_t runqueue_lock __cacheline_aligned = SPIN_LOCK_UNLOCKED;  /* inner */
 rwlock_t tasklist_lock __cacheline_aligned = RW_LOCK_UNLOCKED;	/* outer */
 
-static LIST_HEAD(runqueue_head);
+/*
+ * Priority layout.  0..MAX_RT_PRIO-1 are the realtime priorities
+ * (rt_priority 99 maps to 0), MAX_RT_PRIO..MAX_PRIO-1 are the forty
+ * nice levels of SCHED_OTHER.  A lower number is a better priority.
+ */
+#define MAX_RT_PRIO		100
+#define MAX_PRIO		(MAX_RT_PRIO + 40)
+
+#define NICE_TO_PRIO(nice)	(MAX_RT_PRIO + (nice) + 20)
+#define task_policy(p)		((p)->policy & ~SCHED_YIELD)
+
+/*
+ * One extra bit is kept permanently set as a sentinel, so the bitmap
+ * searches below never have to check for running off the end.
+ */
+#define BITMAP_SIZE ((MAX_PRIO + 1 + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+typedef struct prio_array prio_array_t;
+typedef struct runqueue runqueue_t;
+
+struct prio_array {
+	int nr_active;
+	unsigned long bitmap[BITMAP_SIZE];
+	struct list_head queue[MAX_PRIO];
+};
 
 /*
- * We align per-CPU scheduling data on cacheline boundaries,
- * to prevent cacheline ping-pong.
+ * The per-CPU runqueue.  Runnable tasks sit on the 'active' array
+ * until their timeslice (p->counter) runs out, then move over to the
+ * 'expired' array with a fresh one.  When the active array drains the
+ * two are switched, which replaces the old global counter
+ * recalculation loop.  The task running on the CPU stays queued.
  */
-static union {
-	struct schedule_data {
-		struct task_struct * curr;
-		cycles_t last_schedule;
-	} schedule_data;
-	char __pad [SMP_CACHE_BYTES];
-} aligned_data [NR_CPUS] __cacheline_aligned = { {{&init_task,0}}};
+struct runqueue {
+	spinlock_t lock;
+	unsigned long nr_running, nr_switches, nr_pulled;
+	struct task_struct *curr, *idle;
+	prio_array_t *active, *expired, arrays[2];
+	int prev_nr_running[NR_CPUS];
+} ____cacheline_aligned;
+
+static runqueue_t runqueues[NR_CPUS] __cacheline_aligned;
 
-#define cpu_curr(cpu) aligned_data[(cpu)].schedule_data.curr
-#define last_schedule(cpu) aligned_data[(cpu)].schedule_data.last_schedule
+#define cpu_rq(cpu)		(runqueues + (cpu))
+#define this_rq()		cpu_rq(smp_processor_id())
+#define task_rq(p)		cpu_rq((p)->processor)
 
 struct kernel_stat kstat;
 extern struct task_struct *child_reaper;
 
-#ifdef CONFIG_SMP
+void scheduling_functions_start_here(void) { }
 
-#define idle_task(cpu) (init_tasks[cpu_number_map(cpu)])
-#define can_schedule(p,cpu) \
-	((p)->cpus_runnable & (p)->cpus_allowed & (1UL << cpu))
+static inline void sched_set_bit(int nr, unsigned long *map)
+{
+	map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
 
-#else
+static inline void sched_clear_bit(int nr, unsigned long *map)
+{
+	map[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
 
-#define idle_task(cpu) (&init_task)
-#define can_schedule(p,cpu) (1)
+static inline int sched_find_first_bit(unsigned long *map)
+{
+	int i = 0;
 
-#endif
+	while (!map[i])
+		i++;
+	return i * BITS_PER_LONG + ffz(~map[i]);
+}
 
-void scheduling_functions_start_here(void) { }
+static inline int sched_find_next_bit(unsigned long *map, int nr)
+{
+	int i = nr / BITS_PER_LONG;
+	unsigned long word = map[i] & (~0UL << (nr % BITS_PER_LONG));
+
+	while (!word)
+		word = map[++i];
+	return i * BITS_PER_LONG + ffz(~word);
+}
 
 /*
- * This is the function that decides how desirable a process is..
- * You can weigh different processes against each other depending
- * on what CPU they've run on lately etc to try to handle cache
- * and TLB miss penalties.
- *
- * Return values:
- *	 -1000: never select this
- *	     0: out of time, recalculate counters (but it might still be
- *		selected)
- *	   +ve: "goodness" value (the larger, the better)
- *	 +1000: realtime process, select this.
+ * The priority a task is queued at.  SCHED_FIFO and SCHED_RR are
+ * ordered by rt_priority above every SCHED_OTHER task, SCHED_OTHER
+ * tasks by their nice value.  It is recomputed whenever a task is
+ * queued, so a plain write to p->nice takes effect at that point.
  */
-
-static inline int goodness(struct task_struct * p, int this_cpu, struct mm_struct *this_mm)
+static inline int effective_prio(struct task_struct *p)
 {
-	int weight;
+	if (task_policy(p) != SCHED_OTHER)
+		return MAX_RT_PRIO-1 - p->rt_priority;
+	return NICE_TO_PRIO(p->nice);
+}
 
-	/*
-	 * select the current process after every other
-	 * runnable process, but before the idle thread.
-	 * Also, dont trigger a counter recalculation.
-	 */
-	weight = -1;
-	if (p->policy & SCHED_YIELD)
-		goto out;
+static inline void dequeue_task(struct task_struct *p, prio_array_t *array)
+{
+	array->nr_active--;
+	list_del(&p->run_list);
+	if (list_empty(array->queue + p->prio))
+		sched_clear_bit(p->prio, array->bitmap);
+	p->array = NULL;
+}
 
-	/*
-	 * Non-RT process - normal case first.
-	 */
-	if (p->policy == SCHED_OTHER) {
-		/*
-		 * Give the process a first-approximation goodness value
-		 * according to the number of clock-ticks it has left.
-		 *
-		 * Don't do any other calculations if the time slice is
-		 * over..
-		 */
-		weight = p->counter;
-		if (!weight)
-			goto out;
-			
-#ifdef CONFIG_SMP
-		/* Give a largish advantage to the same processor...   */
-		/* (this is equivalent to penalizing other processors) */
-		if (p->processor == this_cpu)
-			weight += PROC_CHANGE_PENALTY;
-#endif
+/*
+ * This has to add the process to the _end_ of its priority
+ * queue, not the beginning.  This is important to get SCHED_FIFO
+ * and SCHED_RR right, where a process that is either pre-empted or
+ * its time slice has expired, should be moved to the tail of the
+ * run queue for its priority - Bhavesh Davda
+ */
+static inline void enqueue_task(struct task_struct *p, prio_array_t *array)
+{
+	list_add_tail(&p->run_list, array->queue + p->prio);
+	sched_set_bit(p->prio, array->bitmap);
+	array->nr_active++;
+	p->array = array;
+}
 
-		/* .. and a slight advantage to the current MM */
-		if (p->mm == this_mm || !p->mm)
-			weight += 1;
-		weight += 20 - p->nice;
-		goto out;
-	}
+static inline void activate_task(struct task_struct *p, runqueue_t *rq)
+{
+	p->prio = effective_prio(p);
+	enqueue_task(p, rq->active);
+	rq->nr_running++;
+}
 
-	/*
-	 * Realtime process, select the first one on the
-	 * runqueue (taking priorities within processes
-	 * into account).
-	 */
-	weight = 1000 + p->rt_priority;
-out:
-	return weight;
+static inline void deactivate_task(struct task_struct *p, runqueue_t *rq)
+{
+	rq->nr_running--;
+	dequeue_task(p, p->array);
+	p->sleep_time = jiffies;
 }
 
 /*
- * the 'goodness value' of replacing a process on a given CPU.
- * positive value means 'replace', zero or negative means 'dont'.
+ * p's timeslice is used up.  SCHED_RR goes to the back of its
+ * priority and carries on, SCHED_OTHER waits on the expired array
+ * until everybody else on this CPU had their turn.
  */
-static inline int preemption_goodness(struct task_struct * prev, struct task_struct * p, int cpu)
+static inline void expire_task(struct task_struct *p, runqueue_t *rq)
 {
-	return goodness(p, cpu, prev->active_mm) - goodness(prev, cpu, prev->active_mm);
+	dequeue_task(p, p->array);
+	p->counter = NICE_TO_TICKS(p->nice);
+	p->prio = effective_prio(p);
+	if (task_policy(p) == SCHED_RR)
+		enqueue_task(p, rq->active);
+	else
+		enqueue_task(p, rq->expired);
 }
 
 /*
- * This is ugly, but reschedule_idle() is very timing-critical.
- * We are called with the runqueue spinlock held and we must
- * not claim the tasklist_lock.
+ * Lock the runqueue a given task resides on.  The task can be
+ * moved to another CPU's runqueue until we hold the lock, hence
+ * the re-check.
  */
-static FASTCALL(void reschedule_idle(struct task_struct * p));
+static inline runqueue_t *task_rq_lock(struct task_struct *p, unsigned long *flags)
+{
+	runqueue_t *rq;
+
+repeat_lock_task:
+	local_irq_save(*flags);
+	rq = task_rq(p);
+	spin_lock(&rq->lock);
+	if (unlikely(rq != task_rq(p))) {
+		spin_unlock_irqrestore(&rq->lock, *flags);
+		goto repeat_lock_task;
+	}
+	return rq;
+}
+
+static inline void task_rq_unlock(runqueue_t *rq, unsigned long *flags)
+{
+	spin_unlock_irqrestore(&rq->lock, *flags);
+}
 
-static void fastcall reschedule_idle(struct task_struct * p)
+/*
+ * Tell a running task to reschedule.  If need_resched == -1 then we
+ * can skip sending the IPI altogether, tsk->need_resched is actively
+ * watched by the idle thread.
+ */
+static inline void resched_task(struct task_struct *p)
 {
 #ifdef CONFIG_SMP
+	int need_resched;
+
+	need_resched = p->need_resched;
+	p->need_resched = 1;
+	if (!need_resched && (p->processor != smp_processor_id()))
+		smp_send_reschedule(p->processor);
+#else
+	p->need_resched = 1;
+#endif
+}
+
+#ifdef CONFIG_SMP
+
+static inline int cpu_is_idle(int cpu)
+{
+	runqueue_t *rq = cpu_rq(cpu);
+
+	return rq->curr == rq->idle && !rq->nr_running;
+}
+
+/*
+ * Pick a processor for a task that is about to be queued and is not
+ * running anywhere.  Its last CPU is preferred while that is idle,
+ * then any idle CPU it may use, then its last CPU anyway.  The runqueues
+ * are looked at without locking, this only has to be a good guess.
+ */
+static int wake_target_cpu(struct task_struct *p, int sync)
+{
 	int this_cpu = smp_processor_id();
-	struct task_struct *tsk, *target_tsk;
-	int cpu, best_cpu, i, max_prio;
-	cycles_t oldest_idle;
+	int cpu = p->processor, fallback = -1, i;
 
 	/*
-	 * shortcut if the woken up task's last CPU is
-	 * idle now.
+	 * A synchronous waker is about to sleep, so the wakee may
+	 * as well run here.
 	 */
-	best_cpu = p->processor;
-	if (can_schedule(p, best_cpu)) {
-		tsk = idle_task(best_cpu);
-		if (cpu_curr(best_cpu) == tsk) {
-			int need_resched;
-send_now_idle:
-			/*
-			 * If need_resched == -1 then we can skip sending
-			 * the IPI altogether, tsk->need_resched is
-			 * actively watched by the idle thread.
-			 */
-			need_resched = tsk->need_resched;
-			tsk->need_resched = 1;
-			if ((best_cpu != this_cpu) && !need_resched)
-				smp_send_reschedule(best_cpu);
-			return;
-		}
-	}
+	if (sync && (p->cpus_allowed & (1UL << this_cpu)))
+		return this_cpu;
 
-	/*
-	 * We know that the preferred CPU has a cache-affine current
-	 * process, lets try to find a new idle CPU for the woken-up
-	 * process. Select the least recently active idle CPU. (that
-	 * one will have the least active cache context.) Also find
-	 * the executing process which has the least priority.
-	 */
-	oldest_idle = (cycles_t) -1;
-	target_tsk = NULL;
-	max_prio = 0;
+	if (p->cpus_allowed & (1UL << cpu)) {
+		if (cpu_is_idle(cpu))
+			return cpu;
+		fallback = cpu;
+	}
 
 	for (i = 0; i < smp_num_cpus; i++) {
-		cpu = cpu_logical_map(i);
-		if (!can_schedule(p, cpu))
-			continue;
-		tsk = cpu_curr(cpu);
-		/*
-		 * We use the first available idle CPU. This creates
-		 * a priority list between idle CPUs, but this is not
-		 * a problem.
-		 */
-		if (tsk == idle_task(cpu)) {
-#if defined(__i386__) && defined(CONFIG_SMP)
-                        /*
-			 * Check if two siblings are idle in the same
-			 * physical package. Use them if found.
-			 */
-			if (smp_num_siblings == 2) {
-				if (cpu_curr(cpu_sibling_map[cpu]) == 
-			            idle_task(cpu_sibling_map[cpu])) {
-					oldest_idle = last_schedule(cpu);
-					target_tsk = tsk;
-					break;
-				}
-				
-                        }
-#endif		
-			if (last_schedule(cpu) < oldest_idle) {
-				oldest_idle = last_schedule(cpu);
-				target_tsk = tsk;
-			}
-		} else {
-			if (oldest_idle == (cycles_t)-1) {
-				int prio = preemption_goodness(tsk, p, cpu);
+		int c = cpu_logical_map(i);
 
-				if (prio > max_prio) {
-					max_prio = prio;
-					target_tsk = tsk;
-				}
-			}
-		}
+		if (!(p->cpus_allowed & (1UL << c)))
+			continue;
+		if (cpu_is_idle(c))
+			return c;
+		if (fallback < 0)
+			fallback = c;
 	}
-	tsk = target_tsk;
-	if (tsk) {
-		if (oldest_idle != (cycles_t)-1) {
-			best_cpu = tsk->processor;
-			goto send_now_idle;
-		}
-		tsk->need_resched = 1;
-		if (tsk->processor != this_cpu)
-			smp_send_reschedule(tsk->processor);
+	return fallback < 0 ? cpu : fallback;
+}
+
+/*
+ * Take two runqueue locks in address order.  Interrupts must be
+ * disabled by the caller.
+ */
+static inline void double_rq_lock(runqueue_t *rq1, runqueue_t *rq2)
+{
+	if (rq1 == rq2)
+		spin_lock(&rq1->lock);
+	else if (rq1 < rq2) {
+		spin_lock(&rq1->lock);
+		spin_lock(&rq2->lock);
+	} else {
+		spin_lock(&rq2->lock);
+		spin_lock(&rq1->lock);
 	}
-	return;
-		
+}
 
-#else /* UP */
-	int this_cpu = smp_processor_id();
-	struct task_struct *tsk;
+static inline void double_rq_unlock(runqueue_t *rq1, runqueue_t *rq2)
+{
+	spin_unlock(&rq1->lock);
+	if (rq1 != rq2)
+		spin_unlock(&rq2->lock);
+}
 
-	tsk = cpu_curr(this_cpu);
-	if (preemption_goodness(tsk, p, this_cpu) > 0)
-		tsk->need_resched = 1;
-#endif
+/*
+ * Move a task that is not running anywhere to dest_cpu, whether it
+ * is queued somewhere or was taken off its queue by schedule() because
+ * its processor is no longer allowed.  A task that has started running
+ * again in the meantime is left alone; it will come back through
+ * __schedule_tail() when it is switched out.
+ */
+static void migrate_task(struct task_struct *p, int dest_cpu)
+{
+	runqueue_t *rq_src, *rq_dest;
+	unsigned long flags;
+
+	local_irq_save(flags);
+repeat:
+	rq_src = task_rq(p);
+	rq_dest = cpu_rq(dest_cpu);
+	double_rq_lock(rq_src, rq_dest);
+	if (unlikely(rq_src != task_rq(p))) {
+		double_rq_unlock(rq_src, rq_dest);
+		goto repeat;
+	}
+	if (task_has_cpu(p) || p->processor == dest_cpu)
+		goto out;
+	if (!p->array && p->state != TASK_RUNNING) {
+		/* asleep: the wakeup will queue it on the new CPU */
+		p->processor = dest_cpu;
+		goto out;
+	}
+	if (p->array)
+		deactivate_task(p, rq_src);
+	p->processor = dest_cpu;
+	activate_task(p, rq_dest);
+	if (p->prio < rq_dest->curr->prio)
+		resched_task(rq_dest->curr);
+out:
+	double_rq_unlock(rq_src, rq_dest);
+	local_irq_restore(flags);
 }
 
 /*
- * Careful!
- *
- * This has to add the process to the _end_ of the 
- * run-queue, not the beginning. The goodness value will
- * determine whether this process will run next. This is
- * important to get SCHED_FIFO and SCHED_RR right, where
- * a process that is either pre-empted or its time slice
- * has expired, should be moved to the tail of the run 
- * queue for its priority - Bhavesh Davda
+ * Find an allowed CPU for a task, this one if possible.
  */
-static inline void add_to_runqueue(struct task_struct * p)
+static inline int any_allowed_cpu(struct task_struct *p)
 {
-	list_add_tail(&p->run_list, &runqueue_head);
-	nr_running++;
+	int i, cpu = smp_processor_id();
+
+	if (p->cpus_allowed & (1UL << cpu))
+		return cpu;
+	for (i = 0; i < smp_num_cpus; i++) {
+		cpu = cpu_logical_map(i);
+		if (p->cpus_allowed & (1UL << cpu))
+			break;
+	}
+	return cpu;
 }
 
-static inline void move_last_runqueue(struct task_struct * p)
+/*
+ * prev was preempted but is still runnable.  If another processor it
+ * may use is idling, poke it: its idle load balance will pull prev
+ * over rather than leaving it to wait behind next.
+ */
+static void kick_idle_cpu(struct task_struct *p)
 {
-	list_del(&p->run_list);
-	list_add_tail(&p->run_list, &runqueue_head);
+	int this_cpu = smp_processor_id();
+	int i;
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		int cpu = cpu_logical_map(i);
+
+		if (cpu == this_cpu || !(p->cpus_allowed & (1UL << cpu)))
+			continue;
+		if (cpu_is_idle(cpu)) {
+			resched_task(cpu_rq(cpu)->idle);
+			break;
+		}
+	}
 }
 
+#endif /* CONFIG_SMP */
+
 /*
- * Wake up a process. Put it on the run-queue if it's not
+ * Wake up a process. Put it on its CPU's run-queue if it's not
  * already there.  The "current" process is always on the
  * run-queue (except when the actual re-schedule is in
  * progress), and as such you're allowed to do the simpler
@@ -350,20 +446,37 @@ static inline int try_to_wake_up(struct task_struct * p, int synchronous)
 {
 	unsigned long flags;
 	int success = 0;
+	runqueue_t *rq;
 
-	/*
-	 * We want the common case fall through straight, thus the goto.
-	 */
-	spin_lock_irqsave(&runqueue_lock, flags);
+#ifdef CONFIG_SMP
+repeat_lock_task:
+#endif
+	rq = task_rq_lock(p, &flags);
 	p->state = TASK_RUNNING;
-	if (task_on_runqueue(p))
+	if (p->array)
 		goto out;
-	add_to_runqueue(p);
-	if (!synchronous || !(p->cpus_allowed & (1UL << smp_processor_id())))
-		reschedule_idle(p);
+#ifdef CONFIG_SMP
+	/*
+	 * A task that is not running and not queued can have its CPU
+	 * changed under its current runqueue lock: everybody else
+	 * re-checks task_rq() once they hold the lock.
+	 */
+	if (likely(!task_has_cpu(p))) {
+		int cpu = wake_target_cpu(p, synchronous);
+
+		if (cpu != p->processor) {
+			p->processor = cpu;
+			task_rq_unlock(rq, &flags);
+			goto repeat_lock_task;
+		}
+	}
+#endif
+	activate_task(p, rq);
+	if (p->prio < rq->curr->prio)
+		resched_task(rq->curr);
 	success = 1;
 out:
-	spin_unlock_irqrestore(&runqueue_lock, flags);
+	task_rq_unlock(rq, &flags);
 	return success;
 }
 
@@ -372,6 +485,63 @@ inline int fastcall wake_up_process(struct task_struct * p)
 	return try_to_wake_up(p, 0);
 }
 
+/*
+ * Take a task off its runqueue by hand.  Only used by the SMP boot
+ * code for the idle threads it forks, which may be queued on a
+ * different CPU than the one p->processor already names.
+ */
+void del_from_runqueue(struct task_struct * p)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < NR_CPUS; i++) {
+		runqueue_t *rq = cpu_rq(i);
+
+		spin_lock_irqsave(&rq->lock, flags);
+		if (p->array == rq->active || p->array == rq->expired) {
+			deactivate_task(p, rq);
+			spin_unlock_irqrestore(&rq->lock, flags);
+			return;
+		}
+		spin_unlock_irqrestore(&rq->lock, flags);
+	}
+}
+
+/*
+ * Number of queued tasks, summed over all CPUs.  Only approximate,
+ * the runqueues are not locked.
+ */
+unsigned long nr_running(void)
+{
+	unsigned long i, sum = 0;
+
+	for (i = 0; i < smp_num_cpus; i++)
+		sum += cpu_rq(cpu_logical_map(i))->nr_running;
+	return sum;
+}
+
+/*
+ * /proc/schedstat, one line per CPU: runqueue length, tasks on the
+ * active and on the expired array, context switches, and tasks
+ * pulled over from other CPUs by load balancing.
+ */
+int get_sched_stats(char *page)
+{
+	int i, len = 0;
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		int cpu = cpu_logical_map(i);
+		runqueue_t *rq = cpu_rq(cpu);
+
+		len += sprintf(page + len, "cpu%d %lu %d %d %lu %lu\n", cpu,
+			rq->nr_running, rq->active->nr_active,
+			rq->expired->nr_active, rq->nr_switches,
+			rq->nr_pulled);
+	}
+	return len;
+}
+
 static void process_timeout(unsigned long __data)
 {
 	struct task_struct * p = (struct task_struct *) __data;
@@ -465,8 +635,6 @@ signed long fastcall schedule_timeout(signed long timeout)
 static inline void __schedule_tail(struct task_struct *prev)
 {
 #ifdef CONFIG_SMP
-	int policy;
-
 	/*
 	 * prev->policy can be written from here only before `prev'
 	 * can be scheduled (before setting prev->cpus_runnable to ~0UL).
@@ -477,8 +645,7 @@ static inline void __schedule_tail(struct task_struct *prev)
 	 * common code semantics allows code outside the critical section
 	 * to enter inside the critical section)
 	 */
-	policy = prev->policy;
-	prev->policy = policy & ~SCHED_YIELD;
+	prev->policy &= ~SCHED_YIELD;
 	wmb();
 
 	/*
@@ -497,33 +664,19 @@ out_unlock:
 	return;
 
 	/*
-	 * Slow path - we 'push' the previous process and
-	 * reschedule_idle() will attempt to find a new
-	 * processor for it. (but it might preempt the
-	 * current process as well.) We must take the runqueue
-	 * lock and re-check prev->state to be correct. It might
-	 * still happen that this process has a preemption
-	 * 'in progress' already - but this is not a problem and
-	 * might happen in other circumstances as well.
+	 * Slow path - prev is still runnable.  If this CPU is no
+	 * longer allowed for it, schedule() took it off our queue and
+	 * it is moved now that it has stopped running.  Otherwise see
+	 * whether an idle CPU could pick it up.
 	 */
 needs_resched:
-	{
-		unsigned long flags;
-
-		/*
-		 * Avoid taking the runqueue lock in cases where
-		 * no preemption-check is necessery:
-		 */
-		if ((prev == idle_task(smp_processor_id())) ||
-						(policy & SCHED_YIELD))
-			goto out_unlock;
-
-		spin_lock_irqsave(&runqueue_lock, flags);
-		if ((prev->state == TASK_RUNNING) && !task_has_cpu(prev))
-			reschedule_idle(prev);
-		spin_unlock_irqrestore(&runqueue_lock, flags);
+	if (prev == this_rq()->idle)
 		goto out_unlock;
-	}
+	if (unlikely(!(prev->cpus_allowed & (1UL << smp_processor_id()))))
+		migrate_task(prev, any_allowed_cpu(prev));
+	else
+		kick_idle_cpu(prev);
+	goto out_unlock;
 #else
 	prev->policy &= ~SCHED_YIELD;
 #endif /* CONFIG_SMP */
@@ -534,9 +687,217 @@ asmlinkage void schedule_tail(struct task_struct *prev)
 	__schedule_tail(prev);
 }
 
+#ifdef CONFIG_SMP
+
+/*
+ * Load balancing.  An idle CPU looks for work every tick and
+ * whenever it runs out of it, a busy CPU only every 200 msecs.
+ */
+#define IDLE_REBALANCE_TICK	(HZ/1000 ?: 1)
+#define BUSY_REBALANCE_TICK	(HZ/5 ?: 1)
+
+/*
+ * A task that ran within the last CACHE_DECAY_TICKS probably still
+ * has a warm cache where it ran, so a busy CPU leaves it there.
+ */
+#define CACHE_DECAY_TICKS	(HZ/100 ?: 1)
+
+#define task_hot(p, now)	((long)((now) - (p)->sleep_time) < CACHE_DECAY_TICKS)
+
+/*
+ * Lock the busiest runqueue as well, this_rq is locked already.
+ * Recalculate nr_running if we have to drop the runqueue lock.
+ */
+static inline unsigned int double_lock_balance(runqueue_t *this_rq,
+	runqueue_t *busiest, int this_cpu, int idle, unsigned int nr_running)
+{
+	if (unlikely(!spin_trylock(&busiest->lock))) {
+		if (busiest < this_rq) {
+			spin_unlock(&this_rq->lock);
+			spin_lock(&busiest->lock);
+			spin_lock(&this_rq->lock);
+			/* Need to recalculate nr_running */
+			if (idle || (this_rq->nr_running > this_rq->prev_nr_running[this_cpu]))
+				nr_running = this_rq->nr_running;
+			else
+				nr_running = this_rq->prev_nr_running[this_cpu];
+		} else
+			spin_lock(&busiest->lock);
+	}
+	return nr_running;
+}
+
+/*
+ * Find the busiest runqueue and lock it.  The load of each queue is
+ * the lower of its current and its previous length, so short spikes
+ * do not make tasks bounce between CPUs.  A busy CPU only balances
+ * on an imbalance of at least ~25%.
+ */
+static inline runqueue_t *find_busiest_queue(runqueue_t *this_rq, int this_cpu,
+					     int idle, int *imbalance)
+{
+	int nr_running, load, max_load, i;
+	runqueue_t *busiest, *rq_src;
+
+	if (idle || (this_rq->nr_running > this_rq->prev_nr_running[this_cpu]))
+		nr_running = this_rq->nr_running;
+	else
+		nr_running = this_rq->prev_nr_running[this_cpu];
+
+	busiest = NULL;
+	max_load = 1;
+	for (i = 0; i < smp_num_cpus; i++) {
+		int cpu = cpu_logical_map(i);
+
+		rq_src = cpu_rq(cpu);
+		if (idle || (rq_src->nr_running < this_rq->prev_nr_running[cpu]))
+			load = rq_src->nr_running;
+		else
+			load = this_rq->prev_nr_running[cpu];
+		this_rq->prev_nr_running[cpu] = rq_src->nr_running;
+
+		if ((load > max_load) && (rq_src != this_rq)) {
+			busiest = rq_src;
+			max_load = load;
+		}
+	}
+
+	if (likely(!busiest))
+		goto out;
+
+	*imbalance = (max_load - nr_running) / 2;
+
+	if (!idle && (*imbalance < (max_load + 3)/4)) {
+		busiest = NULL;
+		goto out;
+	}
+
+	nr_running = double_lock_balance(this_rq, busiest, this_cpu, idle, nr_running);
+	/*
+	 * Make sure nothing changed since we checked the
+	 * runqueue length.
+	 */
+	if (busiest->nr_running <= nr_running + 1) {
+		spin_unlock(&busiest->lock);
+		busiest = NULL;
+	}
+out:
+	return busiest;
+}
+
+/*
+ * Move a task from a remote runqueue to the local runqueue.
+ * Both runqueues must be locked.
+ */
+static inline void pull_task(runqueue_t *src_rq, prio_array_t *src_array,
+	struct task_struct *p, runqueue_t *this_rq, int this_cpu)
+{
+	dequeue_task(p, src_array);
+	src_rq->nr_running--;
+	p->processor = this_cpu;
+	this_rq->nr_running++;
+	enqueue_task(p, this_rq->active);
+	this_rq->nr_pulled++;
+	/*
+	 * Note that idle threads have a prio of MAX_PRIO, so this
+	 * always preempts them.
+	 */
+	if (p->prio < this_rq->curr->prio)
+		this_rq->curr->need_resched = 1;
+}
+
+/*
+ * Pull tasks from the busiest runqueue over to this one.  Called
+ * with this_rq locked and interrupts disabled.
+ *
+ * Expired tasks are taken first: they will not run again soon
+ * where they are and are the most likely to be cache-cold.  Within a
+ * priority the tasks at the tail of the queue have waited longest.
+ */
+static void load_balance(runqueue_t *this_rq, int idle)
+{
+	int imbalance, idx, this_cpu = smp_processor_id();
+	runqueue_t *busiest;
+	prio_array_t *array;
+	struct list_head *head, *curr;
+	struct task_struct *tmp;
+	unsigned long now = jiffies;
+
+	busiest = find_busiest_queue(this_rq, this_cpu, idle, &imbalance);
+	if (!busiest)
+		goto out;
+
+	if (busiest->expired->nr_active)
+		array = busiest->expired;
+	else
+		array = busiest->active;
+
+new_array:
+	idx = 0;
+skip_bitmap:
+	idx = sched_find_next_bit(array->bitmap, idx);
+	if (idx >= MAX_PRIO) {
+		if (array == busiest->expired) {
+			array = busiest->active;
+			goto new_array;
+		}
+		goto out_unlock;
+	}
+
+	head = array->queue + idx;
+	curr = head->prev;
+skip_queue:
+	tmp = list_entry(curr, struct task_struct, run_list);
+	curr = curr->prev;
+
+	/*
+	 * We do not migrate tasks that are:
+	 * 1) running (or still being switched out),
+	 * 2) not allowed on this CPU,
+	 * 3) cache-hot, unless this CPU is idle anyway.
+	 */
+	if (task_has_cpu(tmp) || !(tmp->cpus_allowed & (1UL << this_cpu)) ||
+	    (!idle && task_hot(tmp, now))) {
+		if (curr != head)
+			goto skip_queue;
+		idx++;
+		goto skip_bitmap;
+	}
+	pull_task(busiest, array, tmp, this_rq, this_cpu);
+	if (--imbalance > 0) {
+		if (curr != head)
+			goto skip_queue;
+		idx++;
+		goto skip_bitmap;
+	}
+out_unlock:
+	spin_unlock(&busiest->lock);
+out:
+	;
+}
+
+/*
+ * Called from the timer interrupt on every CPU.
+ */
+void scheduler_tick(int idle)
+{
+	runqueue_t *rq = this_rq();
+	unsigned long j = jiffies, flags;
+
+	if (j % (idle ? IDLE_REBALANCE_TICK : BUSY_REBALANCE_TICK))
+		return;
+	spin_lock_irqsave(&rq->lock, flags);
+	load_balance(rq, idle);
+	spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+#endif /* CONFIG_SMP */
+
 /*
- *  'schedule()' is the scheduler function. It's a very simple and nice
- * scheduler: it's not perfect, but certainly works for most things.
+ *  'schedule()' is the scheduler function.  It picks the first task
+ * of the highest priority queue on this CPU's active array, which
+ * is a bitmap search and does not depend on the number of runnable
+ * tasks.
  *
  * The goto is "interesting".
  *
@@ -546,18 +907,17 @@ asmlinkage void schedule_tail(struct task_struct *prev)
  */
 asmlinkage void schedule(void)
 {
-	struct schedule_data * sched_data;
-	struct task_struct *prev, *next, *p;
-	struct list_head *tmp;
-	int this_cpu, c;
-
-
-	spin_lock_prefetch(&runqueue_lock);
+	struct task_struct *prev, *next;
+	prio_array_t *array;
+	struct list_head *queue;
+	runqueue_t *rq;
+	int this_cpu, idx;
 
 	BUG_ON(!current->active_mm);
 need_resched_back:
 	prev = current;
 	this_cpu = prev->processor;
+	rq = cpu_rq(this_cpu);
 
 	if (unlikely(in_interrupt())) {
 		printk("Scheduling in interrupt\n");
@@ -566,20 +926,7 @@ need_resched_back:
 
 	release_kernel_lock(prev, this_cpu);
 
-	/*
-	 * 'sched_data' is protected by the fact that we can run
-	 * only one process per CPU.
-	 */
-	sched_data = & aligned_data[this_cpu].schedule_data;
-
-	spin_lock_irq(&runqueue_lock);
-
-	/* move an exhausted RR process to be last.. */
-	if (unlikely(prev->policy == SCHED_RR))
-		if (!prev->counter) {
-			prev->counter = NICE_TO_TICKS(prev->nice);
-			move_last_runqueue(prev);
-		}
+	spin_lock_irq(&rq->lock);
 
 	switch (prev->state) {
 		case TASK_INTERRUPTIBLE:
@@ -588,51 +935,77 @@ need_resched_back:
 				break;
 			}
 		default:
-			del_from_runqueue(prev);
+			if (prev->array)
+				deactivate_task(prev, rq);
 		case TASK_RUNNING:;
 	}
 	prev->need_resched = 0;
 
 	/*
-	 * this is the scheduler proper:
-	 */
-
-repeat_schedule:
-	/*
-	 * Default process to select..
+	 * Requeue a still runnable prev if its timeslice ran out,
+	 * it yielded, or its priority was changed under it.
 	 */
-	next = idle_task(this_cpu);
-	c = -1000;
-	list_for_each(tmp, &runqueue_head) {
-		p = list_entry(tmp, struct task_struct, run_list);
-		if (can_schedule(p, this_cpu)) {
-			int weight = goodness(p, this_cpu, prev->active_mm);
-			if (weight > c)
-				c = weight, next = p;
+	if (likely(prev->array != NULL)) {
+		if (unlikely(prev->counter <= 0 && task_policy(prev) != SCHED_FIFO))
+			expire_task(prev, rq);
+		else if (unlikely(prev->policy & SCHED_YIELD)) {
+			dequeue_task(prev, prev->array);
+			if (task_policy(prev) == SCHED_OTHER)
+				enqueue_task(prev, rq->expired);
+			else
+				enqueue_task(prev, rq->active);
+		} else if (unlikely(prev->prio != effective_prio(prev))) {
+			array = prev->array;
+			dequeue_task(prev, array);
+			prev->prio = effective_prio(prev);
+			enqueue_task(prev, array);
 		}
+#ifdef CONFIG_SMP
+		/* see __schedule_tail() */
+		if (unlikely(!(prev->cpus_allowed & (1UL << this_cpu))))
+			deactivate_task(prev, rq);
+#endif
 	}
 
-	/* Do we need to re-calculate counters? */
-	if (unlikely(!c)) {
-		struct task_struct *p;
+#ifdef CONFIG_SMP
+	if (unlikely(!rq->nr_running))
+		load_balance(rq, 1);
+#endif
+	if (unlikely(!rq->nr_running)) {
+		next = rq->idle;
+		goto switch_tasks;
+	}
 
-		spin_unlock_irq(&runqueue_lock);
-		read_lock(&tasklist_lock);
-		for_each_task(p)
-			p->counter = (p->counter >> 1) + NICE_TO_TICKS(p->nice);
-		read_unlock(&tasklist_lock);
-		spin_lock_irq(&runqueue_lock);
-		goto repeat_schedule;
+	array = rq->active;
+	if (unlikely(!array->nr_active)) {
+		/*
+		 * Switch the active and expired arrays.
+		 */
+		rq->active = rq->expired;
+		rq->expired = array;
+		array = rq->active;
 	}
 
+	idx = sched_find_first_bit(array->bitmap);
+	queue = array->queue + idx;
+	next = list_entry(queue->next, struct task_struct, run_list);
+
+switch_tasks:
+	prefetch(next);
+
 	/*
 	 * from this point on nothing can prevent us from
 	 * switching to the next task, save this fact in
-	 * sched_data.
+	 * the runqueue.
 	 */
-	sched_data->curr = next;
+	rq->curr = next;
 	task_set_cpu(next, this_cpu);
-	spin_unlock_irq(&runqueue_lock);
+	if (likely(prev != next)) {
+		rq->nr_switches++;
+		rcu_note_context_switch(this_cpu);
+		prev->sleep_time = jiffies;
+	}
+	spin_unlock_irq(&rq->lock);
 
 	if (unlikely(prev == next)) {
 		/* We won't go through the normal tail, so do this by hand */
@@ -640,24 +1013,6 @@ repeat_schedule:
 		goto same_process;
 	}
 
-#ifdef CONFIG_SMP
- 	/*
- 	 * maintain the per-process 'last schedule' value.
- 	 * (this has to be recalculated even if we reschedule to
- 	 * the same process) Currently this is only used on SMP,
-	 * and it's approximate, so we do not have to maintain
-	 * it while holding the runqueue spinlock.
- 	 */
- 	sched_data->last_schedule = get_cycles();
-
-	/*
-	 * We drop the scheduler lock early (it's a global spinlock),
-	 * thus we have to lock the previous process from getting
-	 * rescheduled during switch_to().
-	 */
-
-#endif /* CONFIG_SMP */
-
 	kstat.context_swtch++;
 	/*
 	 * there are 3 processes which are affected by a context switch:
@@ -725,6 +1080,16 @@ static inline void __wake_up_common (wait_queue_head_t *q, unsigned int mode,
                 wait_queue_t *curr = list_entry(tmp, wait_queue_t, task_list);
 
 		CHECK_MAGIC(curr->__magic);
+		if (curr->func) {
+			/*
+			 * Callback entries (eventpoll) decide for themselves
+			 * what a wakeup means.  They must not unlink themselves.
+			 */
+			if (curr->func(curr, mode, sync) &&
+			    (curr->flags&WQ_FLAG_EXCLUSIVE) && !--nr_exclusive)
+				break;
+			continue;
+		}
 		p = curr->task;
 		state = p->state;
 		if (state & mode) {
@@ -862,32 +1227,78 @@ void scheduling_functions_end_here(void) { }
  */
 void set_cpus_allowed(struct task_struct *p, unsigned long new_mask)
 {
+	unsigned long flags;
+	runqueue_t *rq;
+	int running;
+
 	new_mask &= cpu_online_map;
 	BUG_ON(!new_mask);
 
+	rq = task_rq_lock(p, &flags);
 	p->cpus_allowed = new_mask;
+	if (new_mask & (1UL << p->processor)) {
+		task_rq_unlock(rq, &flags);
+		return;
+	}
 
 	/*
-	 * If the task is on a no-longer-allowed processor, we need to move
-	 * it.  If the task is not current, then set need_resched and send
-	 * its processor an IPI to reschedule.
+	 * The task is on a no-longer-allowed processor.  If it is
+	 * running, set need_resched and send its processor an IPI to
+	 * reschedule; it is moved once it has been switched out.
+	 * Otherwise it can be moved right away.
 	 */
-	if (!(p->cpus_runnable & p->cpus_allowed)) {
-		if (p != current) {
-			p->need_resched = 1;
-			smp_send_reschedule(p->processor);
-		}
-		/*
-		 * Wait until we are on a legal processor.  If the task is
-		 * current, then we should be on a legal processor the next
-		 * time we reschedule.  Otherwise, we need to wait for the IPI.
-		 */
-		while (!(p->cpus_runnable & p->cpus_allowed))
-			schedule();
-	}
+	running = task_has_cpu(p);
+	if (running)
+		resched_task(p);
+	task_rq_unlock(rq, &flags);
+	if (!running)
+		migrate_task(p, any_allowed_cpu(p));
+
+	/*
+	 * Wait until we are on a legal processor.  If the task is
+	 * current, then we should be on a legal processor the next
+	 * time we reschedule.  Otherwise, we need to wait for the IPI.
+	 */
+	while (!(p->cpus_runnable & p->cpus_allowed))
+		schedule();
 }
 #endif /* CONFIG_SMP */
 
+/*
+ * Change the nice value of a task, requeueing it at the matching
+ * priority if it is on a runqueue.
+ */
+void set_user_nice(struct task_struct *p, long nice)
+{
+	unsigned long flags;
+	prio_array_t *array;
+	runqueue_t *rq;
+	int old_prio;
+
+	rq = task_rq_lock(p, &flags);
+	p->nice = nice;
+	array = p->array;
+	if (!array || task_policy(p) != SCHED_OTHER)
+		goto out_unlock;
+
+	old_prio = p->prio;
+	dequeue_task(p, array);
+	p->prio = effective_prio(p);
+	enqueue_task(p, array);
+
+	/*
+	 * If the task is running and lowered its priority, or
+	 * it is waiting and now beats the running task, reschedule.
+	 */
+	if (task_has_cpu(p)) {
+		if (p->prio > old_prio)
+			resched_task(p);
+	} else if (p->prio < rq->curr->prio)
+		resched_task(rq->curr);
+out_unlock:
+	task_rq_unlock(rq, &flags);
+}
+
 #ifndef __alpha__
 
 /*
@@ -919,7 +1330,7 @@ asmlinkage long sys_nice(int increment)
 		newprio = -20;
 	if (newprio > 19)
 		newprio = 19;
-	current->nice = newprio;
+	set_user_nice(current, newprio);
 	return 0;
 }
 
@@ -939,6 +1350,9 @@ static int setscheduler(pid_t pid, int policy,
 {
 	struct sched_param lp;
 	struct task_struct *p;
+	prio_array_t *array;
+	unsigned long flags;
+	runqueue_t *rq;
 	int retval;
 
 	retval = -EINVAL;
@@ -953,13 +1367,14 @@ static int setscheduler(pid_t pid, int policy,
 	 * We play safe to avoid deadlocks.
 	 */
 	read_lock_irq(&tasklist_lock);
-	spin_lock(&runqueue_lock);
 
 	p = find_process_by_pid(pid);
 
 	retval = -ESRCH;
 	if (!p)
-		goto out_unlock;
+		goto out_unlock_tasklist;
+
+	rq = task_rq_lock(p, &flags);
 			
 	if (policy < 0)
 		policy = p->policy;
@@ -989,13 +1404,25 @@ static int setscheduler(pid_t pid, int policy,
 		goto out_unlock;
 
 	retval = 0;
+	array = p->array;
+	if (array)
+		dequeue_task(p, array);
 	p->policy = policy;
 	p->rt_priority = lp.sched_priority;
+	if (array) {
+		/* realtime tasks never wait on the expired array */
+		p->prio = effective_prio(p);
+		if (policy != SCHED_OTHER)
+			array = rq->active;
+		enqueue_task(p, array);
+		resched_task(rq->curr);
+	}
 
 	current->need_resched = 1;
 
 out_unlock:
-	spin_unlock(&runqueue_lock);
+	task_rq_unlock(rq, &flags);
+out_unlock_tasklist:
 	read_unlock_irq(&tasklist_lock);
 
 out_nounlock:
@@ -1064,44 +1491,116 @@ out_unlock:
 	return retval;
 }
 
-asmlinkage long sys_sched_yield(void)
+/**
+ * sys_sched_setaffinity - set the cpu affinity of a process
+ * @pid: pid of the process
+ * @len: length in bytes of the bitmask pointed to by user_mask_ptr
+ * @user_mask_ptr: user-space pointer to the new cpu mask
+ *
+ * Offline CPUs are dropped from the mask; a mask with no online CPU
+ * left is rejected.  The task is moved off a no-longer-allowed CPU
+ * before this returns.
+ */
+asmlinkage long sys_sched_setaffinity(pid_t pid, unsigned int len,
+				      unsigned long *user_mask_ptr)
 {
+	unsigned long new_mask;
+	struct task_struct *p;
+	int retval;
+
+	if (len < sizeof(new_mask))
+		return -EINVAL;
+
+	if (copy_from_user(&new_mask, user_mask_ptr, sizeof(new_mask)))
+		return -EFAULT;
+
+	new_mask &= cpu_online_map;
+	if (!new_mask)
+		return -EINVAL;
+
+	read_lock(&tasklist_lock);
+	p = find_process_by_pid(pid);
+	if (!p) {
+		read_unlock(&tasklist_lock);
+		return -ESRCH;
+	}
+
 	/*
-	 * Trick. sched_yield() first counts the number of truly 
-	 * 'pending' runnable processes, then returns if it's
-	 * only the current processes. (This test does not have
-	 * to be atomic.) In threaded applications this optimization
-	 * gets triggered quite often.
+	 * It is not safe to call set_cpus_allowed with the
+	 * tasklist_lock held.  We will bump the task_struct's
+	 * usage count and then drop tasklist_lock.
 	 */
+	get_task_struct(p);
+	read_unlock(&tasklist_lock);
 
-	int nr_pending = nr_running;
+	retval = -EPERM;
+	if ((current->euid != p->euid) && (current->euid != p->uid) &&
+	    !capable(CAP_SYS_NICE))
+		goto out_unlock;
 
-#if CONFIG_SMP
-	int i;
+	retval = 0;
+	set_cpus_allowed(p, new_mask);
 
-	// Subtract non-idle processes running on other CPUs.
-	for (i = 0; i < smp_num_cpus; i++) {
-		int cpu = cpu_logical_map(i);
-		if (aligned_data[cpu].schedule_data.curr != idle_task(cpu))
-			nr_pending--;
+out_unlock:
+	free_task_struct(p);
+	return retval;
+}
+
+/**
+ * sys_sched_getaffinity - get the cpu affinity of a process
+ * @pid: pid of the process
+ * @len: length in bytes of the bitmask pointed to by user_mask_ptr
+ * @user_mask_ptr: user-space pointer to hold the current cpu mask
+ *
+ * Returns the size of the mask written.
+ */
+asmlinkage long sys_sched_getaffinity(pid_t pid, unsigned int len,
+				      unsigned long *user_mask_ptr)
+{
+	unsigned long mask;
+	struct task_struct *p;
+
+	if (len < sizeof(mask))
+		return -EINVAL;
+
+	read_lock(&tasklist_lock);
+	p = find_process_by_pid(pid);
+	if (!p) {
+		read_unlock(&tasklist_lock);
+		return -ESRCH;
 	}
-#else
-	// on UP this process is on the runqueue as well
-	nr_pending--;
-#endif
-	if (nr_pending) {
-		/*
-		 * This process can only be rescheduled by us,
-		 * so this is safe without any locking.
-		 */
-		if (current->policy == SCHED_OTHER)
-			current->policy |= SCHED_YIELD;
-		current->need_resched = 1;
+	mask = p->cpus_allowed & cpu_online_map;
+	read_unlock(&tasklist_lock);
+
+	if (copy_to_user(user_mask_ptr, &mask, sizeof(mask)))
+		return -EFAULT;
+	return sizeof(mask);
+}
+
+asmlinkage long sys_sched_yield(void)
+{
+	runqueue_t *rq = this_rq();
+	prio_array_t *array;
 
-		spin_lock_irq(&runqueue_lock);
-		move_last_runqueue(current);
-		spin_unlock_irq(&runqueue_lock);
+	spin_lock_irq(&rq->lock);
+	/*
+	 * Trick. Return right away if nothing else is runnable on
+	 * this CPU.  In threaded applications this optimization
+	 * gets triggered quite often.
+	 *
+	 * Otherwise a SCHED_OTHER task goes behind every other
+	 * runnable task on the expired array, realtime tasks go to
+	 * the back of their priority.
+	 */
+	array = current->array;
+	if (array && rq->nr_running > 1) {
+		dequeue_task(current, array);
+		if (task_policy(current) == SCHED_OTHER)
+			array = rq->expired;
+		enqueue_task(current, array);
+		current->need_resched = 1;
 	}
+	spin_unlock_irq(&rq->lock);
 	return 0;
 }
 
@@ -1285,6 +1784,8 @@ void show_state(void)
 void reparent_to_init(void)
 {
 	struct task_struct *this_task = current;
+	unsigned long flags;
+	runqueue_t *rq;
 
 	write_lock_irq(&tasklist_lock);
 
@@ -1297,9 +1798,9 @@ void reparent_to_init(void)
 	/* Set the exit signal to SIGCHLD so we signal init on exit */
 	this_task->exit_signal = SIGCHLD;
 
-	/* We also take the runqueue_lock while altering task fields
+	/* We also take the runqueue lock while altering task fields
 	 * which affect scheduling decisions */
-	spin_lock(&runqueue_lock);
+	rq = task_rq_lock(this_task, &flags);
 
 	this_task->ptrace = 0;
 	this_task->nice = DEF_NICE;
@@ -1314,7 +1815,7 @@ void reparent_to_init(void)
 	memcpy(this_task->rlim, init_task.rlim, sizeof(*(this_task->rlim)));
 	switch_uid(INIT_USER);
 
-	spin_unlock(&runqueue_lock);
+	task_rq_unlock(rq, &flags);
 	write_unlock_irq(&tasklist_lock);
 }
 
@@ -1354,16 +1855,19 @@ extern unsigned long wait_init_idle;
 
 void __init init_idle(void)
 {
-	struct schedule_data * sched_data;
-	sched_data = &aligned_data[smp_processor_id()].schedule_data;
+	runqueue_t *rq = this_rq();
+	unsigned long flags;
 
-	if (current != &init_task && task_on_runqueue(current)) {
-		printk("UGH! (%d:%d) was on the runqueue, removing.\n",
-			smp_processor_id(), current->pid);
-		del_from_runqueue(current);
+	spin_lock_irqsave(&rq->lock, flags);
+	if (current->array) {
+		if (current != &init_task)
+			printk("UGH! (%d:%d) was on the runqueue, removing.\n",
+				smp_processor_id(), current->pid);
+		deactivate_task(current, rq);
 	}
-	sched_data->curr = current;
-	sched_data->last_schedule = get_cycles();
+	current->prio = MAX_PRIO;
+	rq->curr = rq->idle = current;
+	spin_unlock_irqrestore(&rq->lock, flags);
 	clear_bit(current->processor, &wait_init_idle);
 }
 
@@ -1376,10 +1880,30 @@ void __init sched_init(void)
 	 * process right in SMP mode.
 	 */
 	int cpu = smp_processor_id();
-	int nr;
+	int nr, i, j, k;
 
 	init_task.processor = cpu;
 
+	for (i = 0; i < NR_CPUS; i++) {
+		runqueue_t *rq = cpu_rq(i);
+
+		spin_lock_init(&rq->lock);
+		rq->active = rq->arrays;
+		rq->expired = rq->arrays + 1;
+		/* until init_idle() runs there */
+		rq->curr = rq->idle = &init_task;
+		for (j = 0; j < 2; j++) {
+			prio_array_t *array = rq->arrays + j;
+
+			for (k = 0; k < MAX_PRIO; k++)
+				INIT_LIST_HEAD(array->queue + k);
+			memset(array->bitmap, 0, sizeof(array->bitmap));
+			/* delimiter for bitsearch */
+			sched_set_bit(MAX_PRIO, array->bitmap);
+		}
+	}
+	init_task.prio = MAX_PRIO;
+
 	for(nr = 0; nr < PIDHASH_SZ; nr++)
 		pidhash[nr] = NULL;
 
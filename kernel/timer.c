@@ -22,6 +22,9 @@
 #include <linux/smp_lock.h>
 #include <linux/interrupt.h>
 #include <linux/kernel_stat.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
 
 #include <asm/uaccess.h>
 
@@ -82,76 +85,125 @@ unsigned long prof_shift;
 #define TVR_MASK (TVR_SIZE - 1)
 
 struct timer_vec {
-	int index;
 	struct list_head vec[TVN_SIZE];
 };
 
 struct timer_vec_root {
-	int index;
 	struct list_head vec[TVR_SIZE];
 };
 
-static struct timer_vec tv5;
-static struct timer_vec tv4;
-static struct timer_vec tv3;
-static struct timer_vec tv2;
-static struct timer_vec_root tv1;
+/*
+ * Every CPU has its own set of timer vectors behind its own lock.
+ * add_timer() queues a timer on the local CPU, and a pending timer
+ * stays where it is when mod_timer() re-arms it, so arming and
+ * deleting a timer only ever takes one base lock and CPUs do not
+ * fight over a single timer list.
+ *
+ * The vector indices follow from base->timer_jiffies: tv1 is indexed
+ * by its low TVR_BITS, tv2..tv5 by the next groups of TVN_BITS.
+ *
+ * Expiry still happens from TIMER_BH, which walks every base in
+ * turn.  Timer handlers therefore keep the old guarantee of never
+ * running concurrently with each other or with other bottom halves.
+ */
+struct tvec_base {
+	spinlock_t lock;
+	unsigned long timer_jiffies;
+	struct list_head * run_timer_list_running;
+	struct timer_vec_root tv1;
+	struct timer_vec tv2;
+	struct timer_vec tv3;
+	struct timer_vec tv4;
+	struct timer_vec tv5;
+} ____cacheline_aligned_in_smp;
+
+static struct tvec_base tvec_bases[NR_CPUS] __cacheline_aligned;
+
+#define INDEX(base, n) \
+	(((base)->timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
 
-static struct timer_vec * const tvecs[] = {
-	(struct timer_vec *)&tv1, &tv2, &tv3, &tv4, &tv5
-};
+void init_timervecs (void)
+{
+	int cpu, i;
 
-static struct list_head * run_timer_list_running;
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct tvec_base *base = tvec_bases + cpu;
 
-#define NOOF_TVECS (sizeof(tvecs) / sizeof(tvecs[0]))
+		spin_lock_init(&base->lock);
+		for (i = 0; i < TVN_SIZE; i++) {
+			INIT_LIST_HEAD(base->tv5.vec + i);
+			INIT_LIST_HEAD(base->tv4.vec + i);
+			INIT_LIST_HEAD(base->tv3.vec + i);
+			INIT_LIST_HEAD(base->tv2.vec + i);
+		}
+		for (i = 0; i < TVR_SIZE; i++)
+			INIT_LIST_HEAD(base->tv1.vec + i);
+	}
+}
 
-void init_timervecs (void)
+/*
+ * Unlock the timer bases, so that an oops does not deadlock in the
+ * console unblank code.  Only for bust_spinlocks().
+ */
+void bust_timer_locks(void)
 {
-	int i;
+	int cpu;
 
-	for (i = 0; i < TVN_SIZE; i++) {
-		INIT_LIST_HEAD(tv5.vec + i);
-		INIT_LIST_HEAD(tv4.vec + i);
-		INIT_LIST_HEAD(tv3.vec + i);
-		INIT_LIST_HEAD(tv2.vec + i);
-	}
-	for (i = 0; i < TVR_SIZE; i++)
-		INIT_LIST_HEAD(tv1.vec + i);
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		spin_lock_init(&tvec_bases[cpu].lock);
 }
 
-static unsigned long timer_jiffies;
+/*
+ * /proc/timer_stats bookkeeping, see the end of this file.
+ */
+#define TIMER_STAT_ARM		0
+#define TIMER_STAT_EXPIRE	1
+#define TIMER_STAT_CASCADE	2
+
+static int timer_stats_active;
+
+static void __timer_stats_account(void *site, void (*fn)(unsigned long),
+				  int event);
+
+static inline void timer_stats_account(struct timer_list *timer, int event)
+{
+	if (unlikely(timer_stats_active))
+		__timer_stats_account(timer->start_site, timer->function,
+				      event);
+}
 
-static inline void internal_add_timer(struct timer_list *timer)
+static inline void internal_add_timer(struct tvec_base *base, struct timer_list *timer)
 {
 	/*
-	 * must be cli-ed when calling this
+	 * must be cli-ed and hold base->lock when calling this
 	 */
 	unsigned long expires = timer->expires;
-	unsigned long idx = expires - timer_jiffies;
+	unsigned long idx = expires - base->timer_jiffies;
 	struct list_head * vec;
 
-	if (run_timer_list_running)
-		vec = run_timer_list_running;
+	timer->base = base;
+	if (base->run_timer_list_running)
+		vec = base->run_timer_list_running;
 	else if (idx < TVR_SIZE) {
 		int i = expires & TVR_MASK;
-		vec = tv1.vec + i;
+		vec = base->tv1.vec + i;
 	} else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
 		int i = (expires >> TVR_BITS) & TVN_MASK;
-		vec = tv2.vec + i;
+		vec = base->tv2.vec + i;
 	} else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
 		int i = (expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK;
-		vec =  tv3.vec + i;
+		vec = base->tv3.vec + i;
 	} else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
 		int i = (expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK;
-		vec = tv4.vec + i;
+		vec = base->tv4.vec + i;
 	} else if ((signed long) idx < 0) {
 		/* can happen if you add a timer with expires == jiffies,
 		 * or you set a timer to go off in the past
 		 */
-		vec = tv1.vec + tv1.index;
+		vec = base->tv1.vec + (base->timer_jiffies & TVR_MASK);
 	} else if (idx <= 0xffffffffUL) {
 		int i = (expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK;
-		vec = tv5.vec + i;
+		vec = base->tv5.vec + i;
 	} else {
 		/* Can only get here on architectures with 64-bit jiffies */
 		INIT_LIST_HEAD(&timer->list);
@@ -163,9 +215,6 @@ static inline void internal_add_timer(struct timer_list *timer)
 	list_add(&timer->list, vec->prev);
 }
 
-/* Initialize both explicitly - let's try to have them in the same cache line */
-spinlock_t timerlist_lock = SPIN_LOCK_UNLOCKED;
-
 #ifdef CONFIG_SMP
 volatile struct timer_list * volatile running_timer;
 #define timer_enter(t) do { running_timer = t; mb(); } while (0)
@@ -177,18 +226,44 @@ volatile struct timer_list * volatile running_timer;
 #define timer_exit()		do { } while (0)
 #endif
 
+/*
+ * Lock the base a pending timer is queued on.  The timer may be
+ * deleted or moved while we wait for the lock, hence the re-check.
+ * Returns NULL, with nothing locked, if the timer is not pending.
+ */
+static inline struct tvec_base *lock_timer_base(struct timer_list *timer,
+						unsigned long *flags)
+{
+	struct tvec_base *base;
+
+	for (;;) {
+		base = timer->base;
+		if (!base)
+			return NULL;
+		spin_lock_irqsave(&base->lock, *flags);
+		if (likely(base == timer->base))
+			return base;
+		spin_unlock_irqrestore(&base->lock, *flags);
+	}
+}
+
 void add_timer(struct timer_list *timer)
 {
+	struct tvec_base *base;
 	unsigned long flags;
 
-	spin_lock_irqsave(&timerlist_lock, flags);
+	local_irq_save(flags);
+	base = tvec_bases + smp_processor_id();
+	spin_lock(&base->lock);
 	if (timer_pending(timer))
 		goto bug;
-	internal_add_timer(timer);
-	spin_unlock_irqrestore(&timerlist_lock, flags);
+	timer->start_site = __builtin_return_address(0);
+	internal_add_timer(base, timer);
+	timer_stats_account(timer, TIMER_STAT_ARM);
+	spin_unlock_irqrestore(&base->lock, flags);
 	return;
 bug:
-	spin_unlock_irqrestore(&timerlist_lock, flags);
+	spin_unlock_irqrestore(&base->lock, flags);
 	printk("bug: kernel timer added twice at %p.\n",
 			__builtin_return_address(0));
 }
@@ -198,31 +273,51 @@ static inline int detach_timer (struct timer_list *timer)
 	if (!timer_pending(timer))
 		return 0;
 	list_del(&timer->list);
+	timer->base = NULL;
 	return 1;
 }
 
 int mod_timer(struct timer_list *timer, unsigned long expires)
 {
-	int ret;
+	struct tvec_base *base;
 	unsigned long flags;
+	int ret;
 
-	spin_lock_irqsave(&timerlist_lock, flags);
+	local_irq_save(flags);
+repeat:
+	/*
+	 * A pending timer is re-armed on the CPU that owns it,
+	 * otherwise it goes to the local CPU.
+	 */
+	base = timer->base;
+	if (!base)
+		base = tvec_bases + smp_processor_id();
+	spin_lock(&base->lock);
+	if (unlikely(timer->base && timer->base != base)) {
+		spin_unlock(&base->lock);
+		goto repeat;
+	}
 	timer->expires = expires;
+	timer->start_site = __builtin_return_address(0);
 	ret = detach_timer(timer);
-	internal_add_timer(timer);
-	spin_unlock_irqrestore(&timerlist_lock, flags);
+	internal_add_timer(base, timer);
+	timer_stats_account(timer, TIMER_STAT_ARM);
+	spin_unlock_irqrestore(&base->lock, flags);
 	return ret;
 }
 
 int del_timer(struct timer_list * timer)
 {
-	int ret;
+	struct tvec_base *base;
 	unsigned long flags;
+	int ret;
 
-	spin_lock_irqsave(&timerlist_lock, flags);
+	base = lock_timer_base(timer, &flags);
+	if (!base)
+		return 0;
 	ret = detach_timer(timer);
 	timer->list.next = timer->list.prev = NULL;
-	spin_unlock_irqrestore(&timerlist_lock, flags);
+	spin_unlock_irqrestore(&base->lock, flags);
 	return ret;
 }
 
@@ -245,16 +340,14 @@ int del_timer_sync(struct timer_list * timer)
 	int ret = 0;
 
 	for (;;) {
-		unsigned long flags;
-		int running;
-
-		spin_lock_irqsave(&timerlist_lock, flags);
-		ret += detach_timer(timer);
-		timer->list.next = timer->list.prev = 0;
-		running = timer_is_running(timer);
-		spin_unlock_irqrestore(&timerlist_lock, flags);
-
-		if (!running)
+		ret += del_timer(timer);
+		/*
+		 * Handlers only run from TIMER_BH, one at a time, and
+		 * a timer is marked running before it stops being
+		 * pending, so this needs no lock of its own.
+		 */
+		rmb();
+		if (!timer_is_running(timer))
 			break;
 
 		timer_synchronize(timer);
@@ -264,46 +357,66 @@ int del_timer_sync(struct timer_list * timer)
 }
 #endif
 
+/*
+ * Re-hashing a bucket of a higher vector used to happen in one go
+ * with interrupts disabled, which gave a latency spike every 256
+ * ticks on a busy machine.  The bucket is now moved to a private
+ * list in O(1) and re-hashed in batches, dropping the lock between
+ * them.  del_timer() can still find and unlink timers on the private
+ * list meanwhile, since timer->base is unchanged.
+ */
+#define CASCADE_BATCH	32
 
-static inline void cascade_timers(struct timer_vec *tv)
+static int cascade_timers(struct tvec_base *base, struct timer_vec *tv, int index)
 {
 	/* cascade all the timers from tv up one level */
-	struct list_head *head, *curr, *next;
+	struct list_head *head = tv->vec + index;
+	LIST_HEAD(pending);
+	int n;
 
-	head = tv->vec + tv->index;
-	curr = head->next;
-	/*
-	 * We are removing _all_ timers from the list, so we don't  have to
-	 * detach them individually, just clear the list afterwards.
-	 */
-	while (curr != head) {
-		struct timer_list *tmp;
-
-		tmp = list_entry(curr, struct timer_list, list);
-		next = curr->next;
-		list_del(curr); // not needed
-		internal_add_timer(tmp);
-		curr = next;
-	}
+	if (list_empty(head))
+		return index;
+	list_splice(head, &pending);
 	INIT_LIST_HEAD(head);
-	tv->index = (tv->index + 1) & TVN_MASK;
+
+	for (;;) {
+		for (n = 0; n < CASCADE_BATCH && !list_empty(&pending); n++) {
+			struct timer_list *tmp;
+
+			tmp = list_entry(pending.next, struct timer_list, list);
+			list_del(&tmp->list);
+			internal_add_timer(base, tmp);
+			timer_stats_account(tmp, TIMER_STAT_CASCADE);
+		}
+		if (list_empty(&pending))
+			break;
+		spin_unlock_irq(&base->lock);
+		spin_lock_irq(&base->lock);
+	}
+	return index;
 }
 
-static inline void run_timer_list(void)
+static inline void run_timer_list(struct tvec_base *base)
 {
-	spin_lock_irq(&timerlist_lock);
-	while ((long)(jiffies - timer_jiffies) >= 0) {
+	spin_lock_irq(&base->lock);
+	while ((long)(jiffies - base->timer_jiffies) >= 0) {
 		LIST_HEAD(queued);
 		struct list_head *head, *curr;
-		if (!tv1.index) {
-			int n = 1;
-			do {
-				cascade_timers(tvecs[n]);
-			} while (tvecs[n]->index == 1 && ++n < NOOF_TVECS);
-		}
-		run_timer_list_running = &queued;
+		int index = base->timer_jiffies & TVR_MASK;
+
+		/*
+		 * Cascade timers down a level when the lower vector
+		 * wraps around.
+		 */
+		if (!index &&
+		    !cascade_timers(base, &base->tv2, INDEX(base, 0)) &&
+		    !cascade_timers(base, &base->tv3, INDEX(base, 1)) &&
+		    !cascade_timers(base, &base->tv4, INDEX(base, 2)))
+			cascade_timers(base, &base->tv5, INDEX(base, 3));
+
+		base->run_timer_list_running = &queued;
 repeat:
-		head = tv1.vec + tv1.index;
+		head = base->tv1.vec + index;
 		curr = head->next;
 		if (curr != head) {
 			struct timer_list *timer;
@@ -314,18 +427,22 @@ repeat:
  			fn = timer->function;
  			data= timer->data;
 
+			timer_stats_account(timer, TIMER_STAT_EXPIRE);
+			/*
+			 * Mark the timer running before it stops being
+			 * pending, del_timer_sync() relies on that order.
+			 */
+			timer_enter(timer);
 			detach_timer(timer);
 			timer->list.next = timer->list.prev = NULL;
-			timer_enter(timer);
-			spin_unlock_irq(&timerlist_lock);
+			spin_unlock_irq(&base->lock);
 			fn(data);
-			spin_lock_irq(&timerlist_lock);
+			spin_lock_irq(&base->lock);
 			timer_exit();
 			goto repeat;
 		}
-		run_timer_list_running = NULL;
-		++timer_jiffies; 
-		tv1.index = (tv1.index + 1) & TVR_MASK;
+		base->run_timer_list_running = NULL;
+		++base->timer_jiffies;
 
 		curr = queued.next;
 		while (curr != &queued) {
@@ -333,10 +450,18 @@ repeat:
 
 			timer = list_entry(curr, struct timer_list, list);
 			curr = curr->next;
-			internal_add_timer(timer);
-		}			
+			internal_add_timer(base, timer);
+		}
 	}
-	spin_unlock_irq(&timerlist_lock);
+	spin_unlock_irq(&base->lock);
+}
+
+static inline void run_all_timer_lists(void)
+{
+	int i;
+
+	for (i = 0; i < smp_num_cpus; i++)
+		run_timer_list(tvec_bases + cpu_logical_map(i));
 }
 
 spinlock_t tqueue_lock = SPIN_LOCK_UNLOCKED;
@@ -617,6 +742,8 @@ void update_process_times(int user_tick)
 		kstat.per_cpu_system[cpu] += system;
 	} else if (local_bh_count(cpu) || local_irq_count(cpu) > 1)
 		kstat.per_cpu_system[cpu] += system;
+	scheduler_tick(!p->pid);
+	rcu_check_callbacks(cpu, user_tick);
 }
 
 /*
@@ -693,7 +820,7 @@ static inline void update_times(void)
 void timer_bh(void)
 {
 	update_times();
-	run_timer_list();
+	run_all_timer_lists();
 }
 
 void do_timer(struct pt_regs *regs)
@@ -874,3 +1001,135 @@ asmlinkage long sys_nanosleep(struct timespec *rqtp, struct timespec *rmtp)
 	return 0;
 }
 
+
+/*
+ * /proc/timer_stats: how often timers were armed, expired and got
+ * cascaded, per call site of add_timer() or mod_timer() and timer
+ * function.  Collecting is off by default and then costs a single
+ * test; write 1 to the file to clear the counts and start, 0 to stop.
+ * Look the addresses up in System.map.
+ */
+#define TIMER_STATS_SIZE	512
+#define TIMER_STATS_PROBE	8
+
+struct timer_stat {
+	void *start_site;
+	void (*function)(unsigned long);
+	unsigned long count[3];
+};
+
+static struct timer_stat timer_stats[TIMER_STATS_SIZE];
+static unsigned long timer_stats_dropped;
+static spinlock_t timer_stats_lock = SPIN_LOCK_UNLOCKED;
+
+/*
+ * Called with interrupts disabled.
+ */
+static void __timer_stats_account(void *site, void (*fn)(unsigned long),
+				  int event)
+{
+	unsigned long hash = (((unsigned long) site ^ (unsigned long) fn) >> 2)
+			     % TIMER_STATS_SIZE;
+	struct timer_stat *ts;
+	int i;
+
+	spin_lock(&timer_stats_lock);
+	for (i = 0; i < TIMER_STATS_PROBE; i++) {
+		ts = timer_stats + (hash + i) % TIMER_STATS_SIZE;
+		if (ts->start_site == site && ts->function == fn)
+			goto found;
+		if (!ts->function) {
+			ts->start_site = site;
+			ts->function = fn;
+			goto found;
+		}
+	}
+	timer_stats_dropped++;
+	goto out;
+found:
+	ts->count[event]++;
+out:
+	spin_unlock(&timer_stats_lock);
+}
+
+#ifdef CONFIG_PROC_FS
+
+static int timer_stats_show(struct seq_file *m, void *v)
+{
+	struct timer_stat *ts;
+
+	seq_printf(m, "collecting: %d\n", timer_stats_active);
+	seq_printf(m, "%-*s %-*s %10s %10s %10s\n",
+		   (int) (2 * sizeof(long) + 2), "site",
+		   (int) (2 * sizeof(long) + 2), "function",
+		   "armed", "expired", "cascaded");
+	spin_lock_irq(&timer_stats_lock);
+	for (ts = timer_stats; ts < timer_stats + TIMER_STATS_SIZE; ts++) {
+		if (!ts->function)
+			continue;
+		seq_printf(m, "%p %p %10lu %10lu %10lu\n", ts->start_site,
+			   ts->function,
+			   ts->count[TIMER_STAT_ARM],
+			   ts->count[TIMER_STAT_EXPIRE],
+			   ts->count[TIMER_STAT_CASCADE]);
+	}
+	seq_printf(m, "dropped: %lu\n", timer_stats_dropped);
+	spin_unlock_irq(&timer_stats_lock);
+	return 0;
+}
+
+static int timer_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, timer_stats_show, NULL);
+}
+
+static ssize_t timer_stats_write(struct file *file, const char *buf,
+				 size_t count, loff_t *ppos)
+{
+	char c;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!count)
+		return 0;
+	if (get_user(c, buf))
+		return -EFAULT;
+
+	switch (c) {
+	case '0':
+		timer_stats_active = 0;
+		break;
+	case '1':
+		spin_lock_irq(&timer_stats_lock);
+		memset(timer_stats, 0, sizeof(timer_stats));
+		timer_stats_dropped = 0;
+		timer_stats_active = 1;
+		spin_unlock_irq(&timer_stats_lock);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return count;
+}
+
+static struct file_operations timer_stats_fops = {
+	open:		timer_stats_open,
+	read:		seq_read,
+	write:		timer_stats_write,
+	llseek:		seq_lseek,
+	release:	single_release,
+};
+
+static int __init timer_stats_init(void)
+{
+	struct proc_dir_entry *entry;
+
+	entry = create_proc_entry("timer_stats", S_IRUGO | S_IWUSR, NULL);
+	if (entry)
+		entry->proc_fops = &timer_stats_fops;
+	return 0;
+}
+
+__initcall(timer_stats_init);
+
+#endif /* CONFIG_PROC_FS */
@@ -0,0 +1,51 @@
+/*
+ * linux/lib/percpu_counter.c
+ *
+ * Approximate per-CPU counters.  See linux/percpu_counter.h.
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/percpu_counter.h>
+
+#ifdef CONFIG_SMP
+
+void percpu_counter_mod(struct percpu_counter *fbc, long amount)
+{
+	long count;
+	long *pcount;
+
+	pcount = &fbc->counters[smp_processor_id()].count;
+	count = *pcount + amount;
+	if (count >= FBC_BATCH || count <= -FBC_BATCH) {
+		spin_lock(&fbc->lock);
+		fbc->count += count;
+		spin_unlock(&fbc->lock);
+		count = 0;
+	}
+	*pcount = count;
+}
+
+EXPORT_SYMBOL(percpu_counter_mod);
+
+/*
+ * The shared count with what the CPUs have not folded in yet.  Slow:
+ * it takes the lock and looks at every CPU's slot.
+ */
+long percpu_counter_sum(struct percpu_counter *fbc)
+{
+	long ret;
+	int cpu;
+
+	spin_lock(&fbc->lock);
+	ret = fbc->count;
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		ret += fbc->counters[cpu].count;
+	spin_unlock(&fbc->lock);
+	return ret;
+}
+
+EXPORT_SYMBOL(percpu_counter_sum);
+
+#endif
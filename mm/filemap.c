@@ -15,6 +15,7 @@
 #include <linux/mman.h>
 #include <linux/locks.h>
 #include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/swap.h>
 #include <linux/smp_lock.h>
 #include <linux/blkdev.h>
@@ -43,8 +44,6 @@
  */
 
 unsigned long page_cache_size;
-unsigned int page_hash_bits;
-struct page **page_hash_table;
 
 int vm_max_readahead = 31;
 int vm_min_readahead = 3;
@@ -52,43 +51,50 @@ EXPORT_SYMBOL(vm_max_readahead);
 EXPORT_SYMBOL(vm_min_readahead);
 
 
-spinlock_cacheline_t pagecache_lock_cacheline  = {SPIN_LOCK_UNLOCKED};
 /*
- * NOTE: to avoid deadlocking you must never acquire the pagemap_lru_lock 
- *	with the pagecache_lock held.
+ * Every address_space keeps its pages in a radix tree indexed by
+ * page->index, under its own page_lock.  That lock also covers the
+ * clean/dirty/locked lists and nrpages of the mapping, and the
+ * page->mapping and page->index of the pages on them.  Pages on the
+ * dirty list are tagged PAGECACHE_TAG_DIRTY in the tree, so writeback
+ * can find them in index order.
+ *
+ * NOTE: to avoid deadlocking you must never acquire a zone lru_lock
+ *	with a page_lock held.  That includes dropping what may be the
+ *	last reference to a page which is on the LRU.
  *
  * Ordering:
  *	swap_lock ->
- *		pagemap_lru_lock ->
- *			pagecache_lock
+ *		zone->lru_lock ->
+ *			mapping->page_lock
  */
-spinlock_cacheline_t pagemap_lru_lock_cacheline = {SPIN_LOCK_UNLOCKED};
 
 #define CLUSTER_PAGES		(1 << page_cluster)
 #define CLUSTER_OFFSET(x)	(((x) >> page_cluster) << page_cluster)
 
-static void FASTCALL(add_page_to_hash_queue(struct page * page, struct page **p));
-static void fastcall add_page_to_hash_queue(struct page * page, struct page **p)
+/*
+ * Insert a page into the radix tree and onto the clean list of the
+ * mapping.  Must be called with mapping->page_lock held.  Fails with
+ * -EEXIST if there already is a page at @index, or with -ENOMEM if
+ * the tree needed a node and there was no preloaded one left.
+ */
+static inline int add_page_to_inode_queue(struct address_space *mapping, struct page * page, unsigned long index)
 {
-	struct page *next = *p;
+	struct list_head *head = &mapping->clean_pages;
+	int error;
 
-	*p = page;
-	page->next_hash = next;
-	page->pprev_hash = p;
-	if (next)
-		next->pprev_hash = &page->next_hash;
+	error = radix_tree_insert(&mapping->page_tree, index, page);
+	if (error)
+		return error;
 	if (page->buffers)
 		PAGE_BUG(page);
-	inc_nr_cache_pages(page);
-}
-
-static inline void add_page_to_inode_queue(struct address_space *mapping, struct page * page)
-{
-	struct list_head *head = &mapping->clean_pages;
 
+	page->index = index;
 	mapping->nrpages++;
 	list_add(&page->list, head);
 	page->mapping = mapping;
+	inc_nr_cache_pages(page);
+	return 0;
 }
 
 static inline void remove_page_from_inode_queue(struct page * page)
@@ -98,45 +104,36 @@ static inline void remove_page_from_inode_queue(struct page * page)
 	if (mapping->a_ops->removepage)
 		mapping->a_ops->removepage(page);
 	
+	radix_tree_delete(&mapping->page_tree, page->index);
 	list_del(&page->list);
 	page->mapping = NULL;
 	wmb();
 	mapping->nrpages--;
 	if (!mapping->nrpages)
 		refile_inode(mapping->host);
-}
-
-static inline void remove_page_from_hash_queue(struct page * page)
-{
-	struct page *next = page->next_hash;
-	struct page **pprev = page->pprev_hash;
-
-	if (next)
-		next->pprev_hash = pprev;
-	*pprev = next;
-	page->pprev_hash = NULL;
 	dec_nr_cache_pages(page);
 }
 
 /*
  * Remove a page from the page cache and free it. Caller has to make
  * sure the page is locked and that nobody else uses it - or that usage
- * is safe.
+ * is safe.  Called with page->mapping->page_lock held.
  */
 void __remove_inode_page(struct page *page)
 {
 	remove_page_from_inode_queue(page);
-	remove_page_from_hash_queue(page);
 }
 
 void remove_inode_page(struct page *page)
 {
+	struct address_space *mapping = page->mapping;
+
 	if (!PageLocked(page))
 		PAGE_BUG(page);
 
-	spin_lock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
 	__remove_inode_page(page);
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&mapping->page_lock);
 }
 
 static inline int sync_page(struct page *page)
@@ -157,15 +154,19 @@ void fastcall set_page_dirty(struct page *page)
 		struct address_space *mapping = page->mapping;
 
 		if (mapping) {
-			spin_lock(&pagecache_lock);
-			mapping = page->mapping;
-			if (mapping) {	/* may have been truncated */
+			int moved = 0;
+
+			spin_lock(&mapping->page_lock);
+			if (page->mapping == mapping) {	/* may have been truncated */
 				list_del(&page->list);
 				list_add(&page->list, &mapping->dirty_pages);
+				radix_tree_tag_set(&mapping->page_tree,
+						page->index, PAGECACHE_TAG_DIRTY);
+				moved = 1;
 			}
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 
-			if (mapping && mapping->host)
+			if (moved && mapping->host)
 				mark_inode_dirty_pages(mapping->host);
 			if (block_dump)
 				printk(KERN_DEBUG "%s: dirtied page\n", current->comm);
@@ -183,13 +184,17 @@ void fastcall set_page_dirty(struct page *page)
 
 void invalidate_inode_pages(struct inode * inode)
 {
+	struct address_space *mapping = inode->i_mapping;
 	struct list_head *head, *curr;
 	struct page * page;
+	struct pagevec pvec;
 
-	head = &inode->i_mapping->clean_pages;
+	head = &mapping->clean_pages;
+	pagevec_init(&pvec);
+	lru_add_drain();
 
-	spin_lock(&pagemap_lru_lock);
-	spin_lock(&pagecache_lock);
+restart:
+	spin_lock(&mapping->page_lock);
 	curr = head->next;
 
 	while (curr != head) {
@@ -210,18 +215,27 @@ void invalidate_inode_pages(struct inode * inode)
 		if (page_count(page) != 1)
 			goto unlock;
 
-		__lru_cache_del(page);
 		__remove_inode_page(page);
 		UnlockPage(page);
-		page_cache_release(page);
+
+		/*
+		 * Freeing the page takes it off the LRU, under the zone
+		 * lru_lock, so the last reference is dropped only once
+		 * the page_lock is released.
+		 */
+		if (!pagevec_add(&pvec, page)) {
+			spin_unlock(&mapping->page_lock);
+			__pagevec_release(&pvec);
+			goto restart;
+		}
 		continue;
 unlock:
 		UnlockPage(page);
 		continue;
 	}
 
-	spin_unlock(&pagecache_lock);
-	spin_unlock(&pagemap_lru_lock);
+	spin_unlock(&mapping->page_lock);
+	pagevec_release(&pvec);
 }
 
 static int do_flushpage(struct page *page, unsigned long offset)
@@ -259,66 +273,37 @@ static void truncate_complete_page(struct page *page)
 	page_cache_release(page);
 }
 
-static int FASTCALL(truncate_list_pages(struct list_head *, unsigned long, unsigned *));
-static int fastcall truncate_list_pages(struct list_head *head, unsigned long start, unsigned *partial)
-{
-	struct list_head *curr;
-	struct page * page;
-	int unlocked = 0;
-
- restart:
-	curr = head->prev;
-	while (curr != head) {
-		unsigned long offset;
-
-		page = list_entry(curr, struct page, list);
-		offset = page->index;
-
-		/* Is one of the pages to truncate? */
-		if ((offset >= start) || (*partial && (offset + 1) == start)) {
-			int failed;
-
-			page_cache_get(page);
-			failed = TryLockPage(page);
-
-			list_del(head);
-			if (!failed)
-				/* Restart after this page */
-				list_add_tail(head, curr);
-			else
-				/* Restart on this page */
-				list_add(head, curr);
-
-			spin_unlock(&pagecache_lock);
-			unlocked = 1;
-
- 			if (!failed) {
-				if (*partial && (offset + 1) == start) {
-					truncate_partial_page(page, *partial);
-					*partial = 0;
-				} else 
-					truncate_complete_page(page);
-
-				UnlockPage(page);
-			} else
- 				wait_on_page(page);
-
-			page_cache_release(page);
+/*
+ * Number of pages picked up from the radix tree at a time, by the
+ * range walks below.
+ */
+#define PAGE_BATCH	16
 
-			if (current->need_resched) {
-				__set_current_state(TASK_RUNNING);
-				schedule();
-			}
+/**
+ * find_get_pages - gang page cache lookup
+ * @mapping: the address_space to search
+ * @start: the starting page index
+ * @nr_pages: the maximum number of pages
+ * @pages: where the resulting pages are placed
+ *
+ * Grab a reference to, and return, up to @nr_pages pages of @mapping
+ * at index @start or above, in index order.  Returns the number of
+ * pages found.
+ */
+unsigned int find_get_pages(struct address_space *mapping, unsigned long start,
+			    unsigned int nr_pages, struct page **pages)
+{
+	unsigned int i, ret;
 
-			spin_lock(&pagecache_lock);
-			goto restart;
-		}
-		curr = curr->prev;
-	}
-	return unlocked;
+	spin_lock(&mapping->page_lock);
+	ret = radix_tree_gang_lookup(&mapping->page_tree,
+				(void **)pages, start, nr_pages);
+	for (i = 0; i < ret; i++)
+		page_cache_get(pages[i]);
+	spin_unlock(&mapping->page_lock);
+	return ret;
 }
 
-
 /**
  * truncate_inode_pages - truncate *all* the pages from an offset
  * @mapping: mapping to truncate
@@ -327,31 +312,60 @@ static int fastcall truncate_list_pages(struct list_head *head, unsigned long st
  * Truncate the page cache at a set offset, removing the pages
  * that are beyond that offset (and zeroing out partial pages).
  * If any page is locked we wait for it to become unlocked.
+ *
+ * Only the pages at or beyond the offset are visited, in index
+ * order, however many pages the mapping has below it.
  */
 void truncate_inode_pages(struct address_space * mapping, loff_t lstart) 
 {
 	unsigned long start = (lstart + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
 	unsigned partial = lstart & (PAGE_CACHE_SIZE - 1);
-	int unlocked;
+	struct page *pages[PAGE_BATCH];
+	unsigned long next;
+	unsigned int i, nr;
 
-	spin_lock(&pagecache_lock);
-	do {
-		unlocked = truncate_list_pages(&mapping->clean_pages, start, &partial);
-		unlocked |= truncate_list_pages(&mapping->dirty_pages, start, &partial);
-		unlocked |= truncate_list_pages(&mapping->locked_pages, start, &partial);
-	} while (unlocked);
-	/* Traversed all three lists without dropping the lock */
-	spin_unlock(&pagecache_lock);
+	if (partial) {
+		struct page *page = find_lock_page(mapping, start - 1);
+
+		if (page) {
+			truncate_partial_page(page, partial);
+			UnlockPage(page);
+			page_cache_release(page);
+		}
+	}
+
+	next = start;
+	while ((nr = find_get_pages(mapping, next, PAGE_BATCH, pages)) != 0) {
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
+
+			next = page->index + 1;
+			lock_page(page);
+			/* Has the page been truncated while we slept? */
+			if (page->mapping == mapping)
+				truncate_complete_page(page);
+			UnlockPage(page);
+			page_cache_release(page);
+		}
+		if (!next)
+			break;		/* wrapped past the last index */
+
+		if (current->need_resched) {
+			__set_current_state(TASK_RUNNING);
+			schedule();
+		}
+	}
 }
 
-static inline int invalidate_this_page2(struct page * page,
+static inline int invalidate_this_page2(struct address_space * mapping,
+					struct page * page,
 					struct list_head * curr,
 					struct list_head * head)
 {
 	int unlocked = 1;
 
 	/*
-	 * The page is locked and we hold the pagecache_lock as well
+	 * The page is locked and we hold the mapping's page_lock as well
 	 * so both page_count(page) and page->buffers stays constant here.
 	 */
 	if (page_count(page) == 1 + !!page->buffers) {
@@ -360,7 +374,7 @@ static inline int invalidate_this_page2(struct page * page,
 		list_add_tail(head, curr);
 
 		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
+		spin_unlock(&mapping->page_lock);
 		truncate_complete_page(page);
 	} else {
 		if (page->buffers) {
@@ -369,7 +383,7 @@ static inline int invalidate_this_page2(struct page * page,
 			list_add_tail(head, curr);
 
 			page_cache_get(page);
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			block_invalidate_page(page);
 		} else
 			unlocked = 0;
@@ -381,8 +395,8 @@ static inline int invalidate_this_page2(struct page * page,
 	return unlocked;
 }
 
-static int FASTCALL(invalidate_list_pages2(struct list_head *));
-static int fastcall invalidate_list_pages2(struct list_head *head)
+static int FASTCALL(invalidate_list_pages2(struct address_space *, struct list_head *));
+static int fastcall invalidate_list_pages2(struct address_space * mapping, struct list_head *head)
 {
 	struct list_head *curr;
 	struct page * page;
@@ -396,7 +410,7 @@ static int fastcall invalidate_list_pages2(struct list_head *head)
 		if (!TryLockPage(page)) {
 			int __unlocked;
 
-			__unlocked = invalidate_this_page2(page, curr, head);
+			__unlocked = invalidate_this_page2(mapping, page, curr, head);
 			UnlockPage(page);
 			unlocked |= __unlocked;
 			if (!__unlocked) {
@@ -409,7 +423,7 @@ static int fastcall invalidate_list_pages2(struct list_head *head)
 			list_add(head, curr);
 
 			page_cache_get(page);
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			unlocked = 1;
 			wait_on_page(page);
 		}
@@ -420,7 +434,7 @@ static int fastcall invalidate_list_pages2(struct list_head *head)
 			schedule();
 		}
 
-		spin_lock(&pagecache_lock);
+		spin_lock(&mapping->page_lock);
 		goto restart;
 	}
 	return unlocked;
@@ -435,66 +449,47 @@ void invalidate_inode_pages2(struct address_space * mapping)
 {
 	int unlocked;
 
-	spin_lock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
 	do {
-		unlocked = invalidate_list_pages2(&mapping->clean_pages);
-		unlocked |= invalidate_list_pages2(&mapping->dirty_pages);
-		unlocked |= invalidate_list_pages2(&mapping->locked_pages);
+		unlocked = invalidate_list_pages2(mapping, &mapping->clean_pages);
+		unlocked |= invalidate_list_pages2(mapping, &mapping->dirty_pages);
+		unlocked |= invalidate_list_pages2(mapping, &mapping->locked_pages);
 	} while (unlocked);
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&mapping->page_lock);
 }
 
-static inline struct page * __find_page_nolock(struct address_space *mapping, unsigned long offset, struct page *page)
+static inline struct page * __find_page_nolock(struct address_space *mapping, unsigned long offset)
 {
-	goto inside;
-
-	for (;;) {
-		page = page->next_hash;
-inside:
-		if (!page)
-			goto not_found;
-		if (page->mapping != mapping)
-			continue;
-		if (page->index == offset)
-			break;
-	}
-
-not_found:
-	return page;
+	return radix_tree_lookup(&mapping->page_tree, offset);
 }
 
-static int do_buffer_fdatasync(struct list_head *head, unsigned long start, unsigned long end, int (*fn)(struct page *))
+static int do_buffer_fdatasync(struct address_space *mapping, unsigned long start, unsigned long end, int (*fn)(struct page *))
 {
-	struct list_head *curr;
-	struct page *page;
+	struct page *pages[PAGE_BATCH];
+	unsigned long next = start;
+	unsigned int i, nr;
 	int retval = 0;
 
-	spin_lock(&pagecache_lock);
-	curr = head->next;
-	while (curr != head) {
-		page = list_entry(curr, struct page, list);
-		curr = curr->next;
-		if (!page->buffers)
-			continue;
-		if (page->index >= end)
-			continue;
-		if (page->index < start)
-			continue;
+	while (next < end &&
+	       (nr = find_get_pages(mapping, next, PAGE_BATCH, pages)) != 0) {
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
 
-		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
-		lock_page(page);
+			next = page->index + 1;
+			if (page->index < end && page->buffers) {
+				lock_page(page);
 
-		/* The buffers could have been free'd while we waited for the page lock */
-		if (page->buffers)
-			retval |= fn(page);
+				/* The buffers could have been free'd while we waited for the page lock */
+				if (page->buffers)
+					retval |= fn(page);
 
-		UnlockPage(page);
-		spin_lock(&pagecache_lock);
-		curr = page->list.next;
-		page_cache_release(page);
+				UnlockPage(page);
+			}
+			page_cache_release(page);
+		}
+		if (!next)
+			break;
 	}
-	spin_unlock(&pagecache_lock);
 
 	return retval;
 }
@@ -507,15 +502,11 @@ int generic_buffer_fdatasync(struct inode *inode, unsigned long start_idx, unsig
 {
 	int retval;
 
-	/* writeout dirty buffers on pages from both clean and dirty lists */
-	retval = do_buffer_fdatasync(&inode->i_mapping->dirty_pages, start_idx, end_idx, writeout_one_page);
-	retval |= do_buffer_fdatasync(&inode->i_mapping->clean_pages, start_idx, end_idx, writeout_one_page);
-	retval |= do_buffer_fdatasync(&inode->i_mapping->locked_pages, start_idx, end_idx, writeout_one_page);
+	/* writeout dirty buffers on all the pages in the range */
+	retval = do_buffer_fdatasync(inode->i_mapping, start_idx, end_idx, writeout_one_page);
 
-	/* now wait for locked buffers on pages from both clean and dirty lists */
-	retval |= do_buffer_fdatasync(&inode->i_mapping->dirty_pages, start_idx, end_idx, waitfor_one_page);
-	retval |= do_buffer_fdatasync(&inode->i_mapping->clean_pages, start_idx, end_idx, waitfor_one_page);
-	retval |= do_buffer_fdatasync(&inode->i_mapping->locked_pages, start_idx, end_idx, waitfor_one_page);
+	/* now wait for locked buffers on them */
+	retval |= do_buffer_fdatasync(inode->i_mapping, start_idx, end_idx, waitfor_one_page);
 
 	return retval;
 }
@@ -549,46 +540,70 @@ int fail_writepage(struct page *page)
 
 EXPORT_SYMBOL(fail_writepage);
 
+/*
+ * Take up to @nr pages tagged dirty in @mapping, in index order from
+ * *@index on, and move them from the dirty to the locked list.  The
+ * pages are returned with a reference held and *@index is advanced
+ * past the last one.
+ */
+static unsigned int grab_dirty_pages(struct address_space * mapping,
+		unsigned long * index, struct page ** pages, unsigned int nr)
+{
+	unsigned int i, ret;
+
+	spin_lock(&mapping->page_lock);
+	ret = radix_tree_gang_lookup_tag(&mapping->page_tree, (void **)pages,
+				*index, nr, PAGECACHE_TAG_DIRTY);
+	for (i = 0; i < ret; i++) {
+		struct page *page = pages[i];
+
+		radix_tree_tag_clear(&mapping->page_tree, page->index,
+				PAGECACHE_TAG_DIRTY);
+		list_del(&page->list);
+		list_add(&page->list, &mapping->locked_pages);
+		page_cache_get(page);
+	}
+	if (ret)
+		*index = pages[ret - 1]->index + 1;
+	spin_unlock(&mapping->page_lock);
+	return ret;
+}
+
 /**
  *      filemap_fdatawrite - walk the list of dirty pages of the given address space
  *     	and writepage() each unlocked page (does not wait on locked pages).
  * 
  *      @mapping: address space structure to write
  *
+ *	The pages are written in index order.
  */
 int filemap_fdatawrite(struct address_space * mapping)
 {
 	int ret = 0;
 	int (*writepage)(struct page *) = mapping->a_ops->writepage;
-
-	spin_lock(&pagecache_lock);
-
-	while (!list_empty(&mapping->dirty_pages)) {
-		struct page *page = list_entry(mapping->dirty_pages.prev, struct page, list);
-
-		list_del(&page->list);
-		list_add(&page->list, &mapping->locked_pages);
-
-		if (!PageDirty(page))
-			continue;
-
-		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
-
-		if (!TryLockPage(page)) {
-			if (PageDirty(page)) {
-				int err;
-				ClearPageDirty(page);
-				err = writepage(page);
-				if (err && !ret)
-					ret = err;
-			} else
-				UnlockPage(page);
+	struct page *pages[PAGE_BATCH];
+	unsigned long index = 0;
+	unsigned int i, nr;
+
+	while ((nr = grab_dirty_pages(mapping, &index, pages, PAGE_BATCH)) != 0) {
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
+
+			if (PageDirty(page) && !TryLockPage(page)) {
+				if (PageDirty(page)) {
+					int err;
+					ClearPageDirty(page);
+					err = writepage(page);
+					if (err && !ret)
+						ret = err;
+				} else
+					UnlockPage(page);
+			}
+			page_cache_release(page);
 		}
-		page_cache_release(page);
-		spin_lock(&pagecache_lock);
+		if (!index)
+			break;
 	}
-	spin_unlock(&pagecache_lock);
 	return ret;
 }
 
@@ -598,41 +613,41 @@ int filemap_fdatawrite(struct address_space * mapping)
  * 
  *      @mapping: address space structure to write
  *
+ *	The pages are written in index order.
  */
 int filemap_fdatasync(struct address_space * mapping)
 {
 	int ret = 0;
 	int (*writepage)(struct page *) = mapping->a_ops->writepage;
+	struct page *pages[PAGE_BATCH];
+	unsigned long index = 0;
+	unsigned int i, nr;
 
-	spin_lock(&pagecache_lock);
-
-        while (!list_empty(&mapping->dirty_pages)) {
-		struct page *page = list_entry(mapping->dirty_pages.prev, struct page, list);
-
-		list_del(&page->list);
-		list_add(&page->list, &mapping->locked_pages);
-
-		if (!PageDirty(page))
-			continue;
+	while ((nr = grab_dirty_pages(mapping, &index, pages, PAGE_BATCH)) != 0) {
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
 
-		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
+			if (!PageDirty(page)) {
+				page_cache_release(page);
+				continue;
+			}
 
-		lock_page(page);
+			lock_page(page);
 
-		if (PageDirty(page)) {
-			int err;
-			ClearPageDirty(page);
-			err = writepage(page);
-			if (err && !ret)
-				ret = err;
-		} else
-			UnlockPage(page);
+			if (PageDirty(page)) {
+				int err;
+				ClearPageDirty(page);
+				err = writepage(page);
+				if (err && !ret)
+					ret = err;
+			} else
+				UnlockPage(page);
 
-		page_cache_release(page);
-		spin_lock(&pagecache_lock);
+			page_cache_release(page);
+		}
+		if (!index)
+			break;
 	}
-	spin_unlock(&pagecache_lock);
 	return ret;
 }
 
@@ -647,7 +662,7 @@ int filemap_fdatawait(struct address_space * mapping)
 {
 	int ret = 0;
 
-	spin_lock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
 
         while (!list_empty(&mapping->locked_pages)) {
 		struct page *page = list_entry(mapping->locked_pages.next, struct page, list);
@@ -659,16 +674,16 @@ int filemap_fdatawait(struct address_space * mapping)
 			continue;
 
 		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
+		spin_unlock(&mapping->page_lock);
 
 		___wait_on_page(page);
 		if (PageError(page))
 			ret = -EIO;
 
 		page_cache_release(page);
-		spin_lock(&pagecache_lock);
+		spin_lock(&mapping->page_lock);
 	}
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&mapping->page_lock);
 	return ret;
 }
 
@@ -677,30 +692,45 @@ int filemap_fdatawait(struct address_space * mapping)
  *
  * The caller must have locked the page and 
  * set all the page flags correctly..
+ *
+ * None of the add_to_page_cache functions sleep, so they can be called
+ * under a spinlock.  They fail with -ENOMEM if the radix tree needs a
+ * node that cannot be allocated atomically; callers which are able to
+ * sleep should page_cache_preload() beforehand.
  */
-void add_to_page_cache_locked(struct page * page, struct address_space *mapping, unsigned long index)
+int add_to_page_cache_locked(struct page * page, struct address_space *mapping, unsigned long index)
 {
+	int error;
+
 	if (!PageLocked(page))
 		BUG();
 
-	page->index = index;
 	page_cache_get(page);
-	spin_lock(&pagecache_lock);
-	add_page_to_inode_queue(mapping, page);
-	add_page_to_hash_queue(page, page_hash(mapping, index));
-	spin_unlock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
+	error = add_page_to_inode_queue(mapping, page, index);
+	spin_unlock(&mapping->page_lock);
 
-	lru_cache_add(page);
+	if (!error)
+		lru_cache_add(page);
+	else
+		page_cache_release(page);
+	return error;
 }
 
 /*
  * This adds a page to the page cache, starting out as locked,
  * owned by us, but unreferenced, not uptodate and with no errors.
+ * Called with mapping->page_lock held, after page_cache_preload().
  */
-static inline void __add_to_page_cache(struct page * page,
-	struct address_space *mapping, unsigned long offset,
-	struct page **hash)
+static inline int __add_to_page_cache(struct page * page,
+	struct address_space *mapping, unsigned long offset)
 {
+	int error;
+
+	error = add_page_to_inode_queue(mapping, page, offset);
+	if (error)
+		return error;
+
 	/*
 	 * Yes this is inefficient, however it is needed.  The problem
 	 * is that we could be adding a page to the swap cache while
@@ -715,39 +745,60 @@ static inline void __add_to_page_cache(struct page * page,
 	ClearPageChecked(page);
 	LockPage(page);
 	page_cache_get(page);
-	page->index = offset;
-	add_page_to_inode_queue(mapping, page);
-	add_page_to_hash_queue(page, hash);
+	return 0;
 }
 
-void add_to_page_cache(struct page * page, struct address_space * mapping, unsigned long offset)
+int add_to_page_cache(struct page * page, struct address_space * mapping, unsigned long offset)
 {
-	spin_lock(&pagecache_lock);
-	__add_to_page_cache(page, mapping, offset, page_hash(mapping, offset));
-	spin_unlock(&pagecache_lock);
-	lru_cache_add(page);
+	int error;
+
+	spin_lock(&mapping->page_lock);
+	error = __add_to_page_cache(page, mapping, offset);
+	spin_unlock(&mapping->page_lock);
+	if (!error)
+		lru_cache_add(page);
+	return error;
 }
 
+/*
+ * Insertion into the radix tree fails with -EEXIST by itself when the
+ * index is taken, so this is add_to_page_cache() under its old name.
+ */
 int add_to_page_cache_unique(struct page * page,
-	struct address_space *mapping, unsigned long offset,
-	struct page **hash)
+	struct address_space *mapping, unsigned long offset)
 {
-	int err;
-	struct page *alias;
+	return add_to_page_cache(page, mapping, offset);
+}
 
-	spin_lock(&pagecache_lock);
-	alias = __find_page_nolock(mapping, offset, *hash);
+/*
+ * Move a locked page from its mapping to index @offset of @to, holding
+ * both page_locks (@to's first) so that it is always in one or the
+ * other.  If it cannot go into @to, -EEXIST or -ENOMEM, it stays where
+ * it was.  The page cache reference and the page flags go with it.
+ */
+int move_page_cache(struct page * page, struct address_space *to,
+		    unsigned long offset)
+{
+	struct address_space *from = page->mapping;
+	int error;
 
-	err = 1;
-	if (!alias) {
-		__add_to_page_cache(page,mapping,offset,hash);
-		err = 0;
-	}
+	if (!PageLocked(page))
+		PAGE_BUG(page);
 
-	spin_unlock(&pagecache_lock);
-	if (!err)
-		lru_cache_add(page);
-	return err;
+	spin_lock(&to->page_lock);
+	spin_lock(&from->page_lock);
+	error = radix_tree_insert(&to->page_tree, offset, page);
+	if (!error) {
+		remove_page_from_inode_queue(page);
+		page->index = offset;
+		to->nrpages++;
+		list_add(&page->list, &to->clean_pages);
+		page->mapping = to;
+		inc_nr_cache_pages(page);
+	}
+	spin_unlock(&from->page_lock);
+	spin_unlock(&to->page_lock);
+	return error;
 }
 
 /*
@@ -758,30 +809,77 @@ static int FASTCALL(page_cache_read(struct file * file, unsigned long offset));
 static int fastcall page_cache_read(struct file * file, unsigned long offset)
 {
 	struct address_space *mapping = file->f_dentry->d_inode->i_mapping;
-	struct page **hash = page_hash(mapping, offset);
 	struct page *page; 
+	int error;
 
-	spin_lock(&pagecache_lock);
-	page = __find_page_nolock(mapping, offset, *hash);
-	spin_unlock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
+	page = __find_page_nolock(mapping, offset);
+	spin_unlock(&mapping->page_lock);
 	if (page)
 		return 0;
 
-	page = page_cache_alloc(mapping);
+	page = page_cache_alloc_cold(mapping);
 	if (!page)
 		return -ENOMEM;
 
-	if (!add_to_page_cache_unique(page, mapping, offset, hash)) {
-		int error = mapping->a_ops->readpage(file, page);
+	page_cache_preload(mapping);
+	error = add_to_page_cache_unique(page, mapping, offset);
+	if (!error) {
+		error = mapping->a_ops->readpage(file, page);
 		page_cache_release(page);
 		return error;
 	}
 	/*
 	 * We arrive here in the unlikely event that someone 
-	 * raced with us and added our page to the cache first.
+	 * raced with us and added our page to the cache first,
+	 * or that we ran out of memory for the radix tree.
 	 */
 	page_cache_release(page);
-	return 0;
+	return error == -EEXIST ? 0 : error;
+}
+
+/*
+ * Start reading whatever part of a file range is not in the page cache
+ * yet, without waiting for any of it.  Returns the number of pages in
+ * the range which are not uptodate; zero means that reading the range
+ * won't have to wait for I/O.
+ */
+int filemap_start_read(struct file * file, loff_t pos, size_t count)
+{
+	struct address_space *mapping = file->f_dentry->d_inode->i_mapping;
+	struct inode *inode = mapping->host;
+	unsigned long index, end, max;
+	int missing = 0;
+
+	if (!mapping->a_ops->readpage)
+		return -EINVAL;
+	if (!count || pos >= inode->i_size)
+		return 0;
+	if (pos + count > inode->i_size)
+		count = inode->i_size - pos;
+
+	index = pos >> PAGE_CACHE_SHIFT;
+	end = (pos + count - 1) >> PAGE_CACHE_SHIFT;
+
+	/* Don't start more than do_readahead() would */
+	max = (nr_free_pages() + nr_inactive_pages()) / 2;
+
+	for (; index <= end; index++) {
+		struct page *page = find_get_page(mapping, index);
+
+		if (!page) {
+			if (max) {
+				page_cache_read(file, index);
+				max--;
+			}
+			missing++;
+			continue;
+		}
+		if (!Page_Uptodate(page))
+			missing++;
+		page_cache_release(page);
+	}
+	return missing;
 }
 
 /*
@@ -982,22 +1080,21 @@ void fastcall lock_page(struct page *page)
 
 /*
  * a rather lightweight function, finding and getting a reference to a
- * hashed page atomically.
+ * page cache page atomically.
  */
-struct page * __find_get_page(struct address_space *mapping,
-			      unsigned long offset, struct page **hash)
+struct page * find_get_page(struct address_space *mapping, unsigned long offset)
 {
 	struct page *page;
 
 	/*
-	 * We scan the hash list read-only. Addition to and removal from
-	 * the hash-list needs a held write-lock.
+	 * Only this mapping's lock is needed to walk its radix tree,
+	 * lookups in other files go on in parallel.
 	 */
-	spin_lock(&pagecache_lock);
-	page = __find_page_nolock(mapping, offset, *hash);
+	spin_lock(&mapping->page_lock);
+	page = __find_page_nolock(mapping, offset);
 	if (page)
 		page_cache_get(page);
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&mapping->page_lock);
 	return page;
 }
 
@@ -1007,41 +1104,36 @@ struct page * __find_get_page(struct address_space *mapping,
 struct page *find_trylock_page(struct address_space *mapping, unsigned long offset)
 {
 	struct page *page;
-	struct page **hash = page_hash(mapping, offset);
 
-	spin_lock(&pagecache_lock);
-	page = __find_page_nolock(mapping, offset, *hash);
+	spin_lock(&mapping->page_lock);
+	page = __find_page_nolock(mapping, offset);
 	if (page) {
 		if (TryLockPage(page))
 			page = NULL;
 	}
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&mapping->page_lock);
 	return page;
 }
 
 /*
- * Must be called with the pagecache lock held,
+ * Must be called with the mapping's page_lock held,
  * will return with it held (but it may be dropped
  * during blocking operations..
  */
-static struct page * FASTCALL(__find_lock_page_helper(struct address_space *, unsigned long, struct page *));
+static struct page * FASTCALL(__find_lock_page_helper(struct address_space *, unsigned long));
 static struct page * fastcall __find_lock_page_helper(struct address_space *mapping,
-					unsigned long offset, struct page *hash)
+					unsigned long offset)
 {
 	struct page *page;
 
-	/*
-	 * We scan the hash list read-only. Addition to and removal from
-	 * the hash-list needs a held write-lock.
-	 */
 repeat:
-	page = __find_page_nolock(mapping, offset, hash);
+	page = __find_page_nolock(mapping, offset);
 	if (page) {
 		page_cache_get(page);
 		if (TryLockPage(page)) {
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			lock_page(page);
-			spin_lock(&pagecache_lock);
+			spin_lock(&mapping->page_lock);
 
 			/* Has the page been re-allocated while we slept? */
 			if (page->mapping != mapping || page->index != offset) {
@@ -1058,14 +1150,13 @@ repeat:
  * Same as the above, but lock the page too, verifying that
  * it's still valid once we own it.
  */
-struct page * __find_lock_page (struct address_space *mapping,
-				unsigned long offset, struct page **hash)
+struct page * find_lock_page(struct address_space *mapping, unsigned long offset)
 {
 	struct page *page;
 
-	spin_lock(&pagecache_lock);
-	page = __find_lock_page_helper(mapping, offset, *hash);
-	spin_unlock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
+	page = __find_lock_page_helper(mapping, offset);
+	spin_unlock(&mapping->page_lock);
 	return page;
 }
 
@@ -1075,22 +1166,22 @@ struct page * __find_lock_page (struct address_space *mapping,
 struct page * find_or_create_page(struct address_space *mapping, unsigned long index, unsigned int gfp_mask)
 {
 	struct page *page;
-	struct page **hash = page_hash(mapping, index);
 
-	spin_lock(&pagecache_lock);
-	page = __find_lock_page_helper(mapping, index, *hash);
-	spin_unlock(&pagecache_lock);
+	spin_lock(&mapping->page_lock);
+	page = __find_lock_page_helper(mapping, index);
+	spin_unlock(&mapping->page_lock);
 	if (!page) {
 		struct page *newpage = alloc_page(gfp_mask);
 		if (newpage) {
-			spin_lock(&pagecache_lock);
-			page = __find_lock_page_helper(mapping, index, *hash);
-			if (likely(!page)) {
+			page_cache_preload(mapping);
+			spin_lock(&mapping->page_lock);
+			page = __find_lock_page_helper(mapping, index);
+			if (likely(!page) &&
+			    !__add_to_page_cache(newpage, mapping, index)) {
 				page = newpage;
-				__add_to_page_cache(page, mapping, index, hash);
 				newpage = NULL;
 			}
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			if (newpage == NULL)
 				lru_cache_add(page);
 			else 
@@ -1108,10 +1199,9 @@ struct page * find_or_create_page(struct address_space *mapping, unsigned long i
  */
 struct page *grab_cache_page_nowait(struct address_space *mapping, unsigned long index)
 {
-	struct page *page, **hash;
+	struct page *page;
 
-	hash = page_hash(mapping, index);
-	page = __find_get_page(mapping, index, hash);
+	page = find_get_page(mapping, index);
 
 	if ( page ) {
 		if ( !TryLockPage(page) ) {
@@ -1136,8 +1226,9 @@ struct page *grab_cache_page_nowait(struct address_space *mapping, unsigned long
 	if ( unlikely(!page) )
 		return NULL;	/* Failed to allocate a page */
 
-	if ( unlikely(add_to_page_cache_unique(page, mapping, index, hash)) ) {
-		/* Someone else grabbed the page already. */
+	page_cache_preload(mapping);
+	if ( unlikely(add_to_page_cache_unique(page, mapping, index)) ) {
+		/* Someone else grabbed the page already, or no memory. */
 		page_cache_release(page);
 		return NULL;
 	}
@@ -1459,7 +1550,7 @@ void do_generic_file_read(struct file * filp, loff_t *ppos, read_descriptor_t *
 	}
 
 	for (;;) {
-		struct page *page, **hash;
+		struct page *page;
 		unsigned long end_index, nr, ret;
 
 		end_index = inode->i_size >> PAGE_CACHE_SHIFT;
@@ -1478,15 +1569,13 @@ void do_generic_file_read(struct file * filp, loff_t *ppos, read_descriptor_t *
 		/*
 		 * Try to find the data in the page cache..
 		 */
-		hash = page_hash(mapping, index);
-
-		spin_lock(&pagecache_lock);
-		page = __find_page_nolock(mapping, index, *hash);
+		spin_lock(&mapping->page_lock);
+		page = __find_page_nolock(mapping, index);
 		if (!page)
 			goto no_cached_page;
 found_page:
 		page_cache_get(page);
-		spin_unlock(&pagecache_lock);
+		spin_unlock(&mapping->page_lock);
 
 		if (!Page_Uptodate(page))
 			goto page_not_up_to_date;
@@ -1577,32 +1666,37 @@ no_cached_page:
 		 * Ok, it wasn't cached, so we need to create a new
 		 * page..
 		 *
-		 * We get here with the page cache lock held.
+		 * We get here with the mapping's page_lock held.
 		 */
+		spin_unlock(&mapping->page_lock);
 		if (!cached_page) {
-			spin_unlock(&pagecache_lock);
 			cached_page = page_cache_alloc(mapping);
 			if (!cached_page) {
 				desc->error = -ENOMEM;
 				break;
 			}
-
-			/*
-			 * Somebody may have added the page while we
-			 * dropped the page cache lock. Check for that.
-			 */
-			spin_lock(&pagecache_lock);
-			page = __find_page_nolock(mapping, index, *hash);
-			if (page)
-				goto found_page;
 		}
+		page_cache_preload(mapping);
 
 		/*
-		 * Ok, add the new page to the hash-queues...
+		 * Somebody may have added the page while we
+		 * dropped the page lock. Check for that.
+		 */
+		spin_lock(&mapping->page_lock);
+		page = __find_page_nolock(mapping, index);
+		if (page)
+			goto found_page;
+
+		/*
+		 * Ok, add the new page to the page cache...
 		 */
 		page = cached_page;
-		__add_to_page_cache(page, mapping, index, hash);
-		spin_unlock(&pagecache_lock);
+		error = __add_to_page_cache(page, mapping, index);
+		spin_unlock(&mapping->page_lock);
+		if (error) {
+			desc->error = error;
+			break;
+		}
 		lru_cache_add(page);		
 		cached_page = NULL;
 
@@ -1726,6 +1820,104 @@ static ssize_t generic_file_direct_IO(int rw, struct file * filp, char * buf, si
 	return retval;
 }
 
+/*
+ * The AIO flavour of generic_file_direct_IO(): the blocks are mapped
+ * and the I/O is started, but not waited for.  iobuf->end_io runs once
+ * io_count drops to zero, possibly from interrupt context; the caller
+ * holds a count of its own across this call.
+ *
+ * Only aligned transfers which fit one kiobuf and don't extend the
+ * file are done this way.  -ENOTBLK means nothing was done and the
+ * caller should fall back to the synchronous path.  Once the kiobuf
+ * has been mapped, i_alloc_sem stays held for read until
+ * generic_file_aio_direct_done() is called after the I/O.
+ */
+ssize_t generic_file_aio_direct_IO(int rw, struct file * filp, struct kiobuf * iobuf, char * buf, size_t count, loff_t offset)
+{
+	struct address_space * mapping = filp->f_dentry->d_inode->i_mapping;
+	struct inode * inode = mapping->host;
+	int blocksize_bits = inode->i_blkbits;
+	int blocksize_mask = (1 << blocksize_bits) - 1;
+	ssize_t retval;
+
+	if (!have_mapping_directIO(mapping) || count > (KIO_MAX_ATOMIC_IO << 10))
+		return -ENOTBLK;
+	if ((offset & blocksize_mask) || (count & blocksize_mask) || ((unsigned long) buf & blocksize_mask))
+		return -EINVAL;
+
+	down_read(&inode->i_alloc_sem);
+	down(&inode->i_sem);
+
+	if (rw == READ) {
+		retval = 0;
+		if (offset >= inode->i_size)
+			goto out_unlock;
+		if (offset + count > inode->i_size)
+			count = inode->i_size - offset;
+	} else {
+		retval = precheck_file_write(filp, inode, &count, &offset);
+		if (retval || !count)
+			goto out_unlock;
+		retval = -ENOTBLK;
+		if (offset + count > inode->i_size && !S_ISBLK(inode->i_mode))
+			goto out_unlock;
+		remove_suid(inode);
+		inode->i_ctime = inode->i_mtime = CURRENT_TIME;
+		mark_inode_dirty_sync(inode);
+	}
+
+	retval = filemap_fdatasync(mapping);
+	if (retval == 0)
+		retval = fsync_inode_data_buffers(inode);
+	if (retval == 0)
+		retval = filemap_fdatawait(mapping);
+	if (retval < 0)
+		goto out_unlock;
+
+	retval = map_user_kiobuf(rw, iobuf, (unsigned long) buf, count);
+	if (retval)
+		goto out_unlock;
+
+	iobuf->async = 1;
+	retval = do_call_directIO(rw, filp, iobuf, offset >> blocksize_bits, 1 << blocksize_bits);
+	iobuf->async = 0;
+	if (retval == -ENOTBLK) {
+		/* a hole: nothing was submitted */
+		unmap_kiobuf(iobuf);
+		goto out_unlock;
+	}
+	up(&inode->i_sem);
+	return retval;
+
+ out_unlock:
+	up(&inode->i_sem);
+	up_read(&inode->i_alloc_sem);
+	return retval;
+}
+
+/*
+ * Finish an I/O started by generic_file_aio_direct_IO(), once its
+ * end_io has run.  Process context only.
+ */
+void generic_file_aio_direct_done(int rw, struct file * filp, struct kiobuf * iobuf, ssize_t bytes)
+{
+	struct address_space * mapping = filp->f_dentry->d_inode->i_mapping;
+	struct inode * inode = mapping->host;
+
+	if (!iobuf->nr_pages)
+		return;
+
+	if (rw == READ && bytes > 0)
+		mark_dirty_kiobuf(iobuf, bytes);
+	unmap_kiobuf(iobuf);
+	up_read(&inode->i_alloc_sem);
+
+	if (rw == READ)
+		UPDATE_ATIME(inode);
+	else if (bytes > 0)
+		invalidate_inode_pages2(mapping);
+}
+
 int file_read_actor(read_descriptor_t * desc, struct page *page, unsigned long offset, unsigned long size)
 {
 	char *kaddr;
@@ -1815,45 +2007,22 @@ ssize_t generic_file_read(struct file * filp, char * buf, size_t count, loff_t *
 	}
 }
 
-static int file_send_actor(read_descriptor_t * desc, struct page *page, unsigned long offset , unsigned long size)
-{
-	ssize_t written;
-	unsigned long count = desc->count;
-	struct file *file = (struct file *) desc->buf;
-
-	if (size > count)
-		size = count;
-
- 	if (file->f_op->sendpage) {
- 		written = file->f_op->sendpage(file, page, offset,
-					       size, &file->f_pos, size<count);
-	} else {
-		char *kaddr;
-		mm_segment_t old_fs;
-
-		old_fs = get_fs();
-		set_fs(KERNEL_DS);
-
-		kaddr = kmap(page);
-		written = file->f_op->write(file, kaddr + offset, size, &file->f_pos);
-		kunmap(page);
-
-		set_fs(old_fs);
-	}
-	if (written < 0) {
-		desc->error = written;
-		written = 0;
-	}
-	desc->count = count - written;
-	desc->written += written;
-	return written;
-}
-
-static ssize_t common_sendfile(int out_fd, int in_fd, loff_t *offset, size_t count)
+/*
+ * sendfile() moves data from any readable file to any writable one:
+ * page-cache pages are passed to the output by reference through a
+ * pipe (see fs/splice.c), into ->sendpage() for sockets, and only
+ * copied when they land in the output file.  A pipe on either side
+ * is spliced from or into directly.
+ *
+ * @max is the highest input offset the caller can report back.
+ */
+static ssize_t common_sendfile(int out_fd, int in_fd, loff_t *offset,
+			       size_t count, loff_t max)
 {
 	ssize_t retval;
 	struct file * in_file, * out_file;
 	struct inode * in_inode, * out_inode;
+	loff_t *ppos;
 
 	/*
 	 * Get input file, and verify that it is ok..
@@ -1868,9 +2037,8 @@ static ssize_t common_sendfile(int out_fd, int in_fd, loff_t *offset, size_t cou
 	in_inode = in_file->f_dentry->d_inode;
 	if (!in_inode)
 		goto fput_in;
-	if (!in_inode->i_mapping->a_ops->readpage)
-		goto fput_in;
-	retval = rw_verify_area(READ, in_file, &in_file->f_pos, count);
+	ppos = offset ? offset : &in_file->f_pos;
+	retval = rw_verify_area(READ, in_file, ppos, count);
 	if (retval)
 		goto fput_in;
 
@@ -1891,23 +2059,37 @@ static ssize_t common_sendfile(int out_fd, int in_fd, loff_t *offset, size_t cou
 	if (retval)
 		goto fput_out;
 
-	retval = 0;
-	if (count) {
-		read_descriptor_t desc;
-		
-		if (!offset)
-			offset = &in_file->f_pos;
+	if (!max)
+		max = in_inode->i_sb->s_maxbytes;
+	if (*ppos + count > max) {
+		retval = -EOVERFLOW;
+		if (*ppos >= max)
+			goto fput_out;
+		count = max - *ppos;
+	}
 
-		desc.written = 0;
-		desc.count = count;
-		desc.buf = (char *) out_file;
-		desc.error = 0;
-		do_generic_file_read(in_file, offset, &desc, file_send_actor);
+	retval = 0;
+	if (!count)
+		goto fput_out;
 
-		retval = desc.written;
-		if (!retval)
-			retval = desc.error;
-	}
+	if (in_inode->i_pipe) {
+		retval = -ESPIPE;
+		if (offset)
+			goto fput_out;
+		if (out_inode->i_pipe) {
+			/* pipe_write() would take the second lock out of order */
+			retval = -EINVAL;
+			if (in_inode == out_inode)
+				goto fput_out;
+			retval = splice_pipe_to_pipe(in_inode, out_inode,
+						     count, 0);
+		} else
+			retval = do_splice_from(in_inode, out_file,
+						&out_file->f_pos, count, 0);
+	} else if (out_inode->i_pipe)
+		retval = do_splice_to(in_file, ppos, out_inode, count, 0);
+	else
+		retval = do_splice_direct(in_file, ppos, out_file, count);
 
 fput_out:
 	fput(out_file);
@@ -1928,9 +2110,9 @@ asmlinkage ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t cou
 		pos = off;
 		ppos = &pos;
 	}
-	ret = common_sendfile(out_fd, in_fd, ppos, count);
-	if (offset)
-		put_user((off_t)pos, offset);
+	ret = common_sendfile(out_fd, in_fd, ppos, count, MAX_NON_LFS);
+	if (offset && put_user((off_t)pos, offset))
+		ret = -EFAULT;
 	return ret;
 }
 
@@ -1943,9 +2125,9 @@ asmlinkage ssize_t sys_sendfile64(int out_fd, int in_fd, loff_t *offset, size_t
 			return -EFAULT;
 		ppos = &pos;
 	}
-	ret = common_sendfile(out_fd, in_fd, ppos, count);
-	if (offset)
-		put_user(pos, offset);
+	ret = common_sendfile(out_fd, in_fd, ppos, count, 0);
+	if (offset && copy_to_user(offset, &pos, sizeof(loff_t)))
+		ret = -EFAULT;
 	return ret;
 }
 
@@ -1966,7 +2148,7 @@ static ssize_t do_readahead(struct file *file, unsigned long index, unsigned lon
 		nr = max;
 
 	/* And limit it to a sane percentage of the inactive list.. */
-	max = (nr_free_pages() + nr_inactive_pages) / 2;
+	max = (nr_free_pages() + nr_inactive_pages()) / 2;
 	if (nr > max)
 		nr = max;
 
@@ -2065,7 +2247,7 @@ struct page * filemap_nopage(struct vm_area_struct * area, unsigned long address
 	struct file *file = area->vm_file;
 	struct address_space *mapping = file->f_dentry->d_inode->i_mapping;
 	struct inode *inode = mapping->host;
-	struct page *page, **hash;
+	struct page *page;
 	unsigned long size, pgoff, endoff;
 
 	pgoff = ((address - area->vm_start) >> PAGE_CACHE_SHIFT) + area->vm_pgoff;
@@ -2087,9 +2269,8 @@ retry_all:
 	/*
 	 * Do we have something in the page cache already?
 	 */
-	hash = page_hash(mapping, pgoff);
 retry_find:
-	page = __find_get_page(mapping, pgoff, hash);
+	page = find_get_page(mapping, pgoff);
 	if (!page)
 		goto no_cached_page;
 
@@ -2797,13 +2978,13 @@ static unsigned char mincore_page(struct vm_area_struct * vma,
 {
 	unsigned char present = 0;
 	struct address_space * as = vma->vm_file->f_dentry->d_inode->i_mapping;
-	struct page * page, ** hash = page_hash(as, pgoff);
+	struct page * page;
 
-	spin_lock(&pagecache_lock);
-	page = __find_page_nolock(as, pgoff, *hash);
+	spin_lock(&as->page_lock);
+	page = __find_page_nolock(as, pgoff);
 	if ((page) && (Page_Uptodate(page)))
 		present = 1;
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&as->page_lock);
 
 	return present;
 }
@@ -2946,11 +3127,10 @@ struct page *__read_cache_page(struct address_space *mapping,
 				int (*filler)(void *,struct page*),
 				void *data)
 {
-	struct page **hash = page_hash(mapping, index);
 	struct page *page, *cached_page = NULL;
 	int err;
 repeat:
-	page = __find_get_page(mapping, index, hash);
+	page = find_get_page(mapping, index);
 	if (!page) {
 		if (!cached_page) {
 			cached_page = page_cache_alloc(mapping);
@@ -2958,8 +3138,14 @@ repeat:
 				return ERR_PTR(-ENOMEM);
 		}
 		page = cached_page;
-		if (add_to_page_cache_unique(page, mapping, index, hash))
+		page_cache_preload(mapping);
+		err = add_to_page_cache_unique(page, mapping, index);
+		if (err == -EEXIST)
 			goto repeat;
+		if (err) {
+			page_cache_release(cached_page);
+			return ERR_PTR(err);
+		}
 		cached_page = NULL;
 		err = filler(data, page);
 		if (err < 0) {
@@ -3014,9 +3200,10 @@ retry:
 static inline struct page * __grab_cache_page(struct address_space *mapping,
 				unsigned long index, struct page **cached_page)
 {
-	struct page *page, **hash = page_hash(mapping, index);
+	struct page *page;
+	int err;
 repeat:
-	page = __find_lock_page(mapping, index, hash);
+	page = find_lock_page(mapping, index);
 	if (!page) {
 		if (!*cached_page) {
 			*cached_page = page_cache_alloc(mapping);
@@ -3024,8 +3211,12 @@ repeat:
 				return NULL;
 		}
 		page = *cached_page;
-		if (add_to_page_cache_unique(page, mapping, index, hash))
+		page_cache_preload(mapping);
+		err = add_to_page_cache_unique(page, mapping, index);
+		if (err == -EEXIST)
 			goto repeat;
+		if (err)
+			return NULL;
 		*cached_page = NULL;
 	}
 	return page;
@@ -3377,30 +3568,3 @@ generic_file_write(struct file *file,const char *buf,size_t count, loff_t *ppos)
 
 	return err;
 }
-
-void __init page_cache_init(unsigned long mempages)
-{
-	unsigned long htable_size, order;
-
-	htable_size = mempages;
-	htable_size *= sizeof(struct page *);
-	for(order = 0; (PAGE_SIZE << order) < htable_size; order++)
-		;
-
-	do {
-		unsigned long tmp = (PAGE_SIZE << order) / sizeof(struct page *);
-
-		page_hash_bits = 0;
-		while((tmp >>= 1UL) != 0UL)
-			page_hash_bits++;
-
-		page_hash_table = (struct page **)
-			__get_free_pages(GFP_ATOMIC, order);
-	} while(page_hash_table == NULL && --order > 0);
-
-	printk("Page-cache hash table entries: %d (order: %ld, %ld bytes)\n",
-	       (1 << page_hash_bits), order, (PAGE_SIZE << order));
-	if (!page_hash_table)
-		panic("Failed to allocate page hash table\n");
-	memset((void *)page_hash_table, 0, PAGE_HASH_SIZE * sizeof(struct page *));
-}
@@ -45,6 +45,7 @@
 #include <linux/highmem.h>
 #include <linux/pagemap.h>
 #include <linux/module.h>
+#include <linux/rmap.h>
 
 #include <asm/pgalloc.h>
 #include <asm/uaccess.h>
@@ -103,6 +104,7 @@ static inline void free_one_pmd(pmd_t * dir)
 	}
 	pte = pte_offset(dir, 0);
 	pmd_clear(dir);
+	pgtable_remove_rmap(pte);
 	pte_free(pte);
 }
 
@@ -171,7 +173,8 @@ void clear_page_tables(struct mm_struct *mm, unsigned long first, int nr)
  *         variable count and make things faster. -jj
  *
  * dst->page_table_lock is held on entry and exit,
- * but may be dropped within pmd_alloc() and pte_alloc().
+ * but may be dropped within pmd_alloc() and pte_alloc(), and to
+ * allocate pte_chains when GFP_ATOMIC can't get one.
  */
 int copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 			struct vm_area_struct *vma)
@@ -180,6 +183,16 @@ int copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 	unsigned long address = vma->vm_start;
 	unsigned long end = vma->vm_end;
 	unsigned long cow = (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE;
+	struct pte_chain *pte_chain;
+
+	pte_chain = pte_chain_alloc(GFP_ATOMIC);
+	if (!pte_chain) {
+		spin_unlock(&dst->page_table_lock);
+		pte_chain = pte_chain_alloc(GFP_KERNEL);
+		spin_lock(&dst->page_table_lock);
+		if (!pte_chain)
+			goto nomem;
+	}
 
 	src_pgd = pgd_offset(src, address)-1;
 	dst_pgd = pgd_offset(dst, address)-1;
@@ -258,6 +271,28 @@ skip_copy_pte_range:		address = (address + PMD_SIZE) & PMD_MASK;
 				pte = pte_mkold(pte);
 				get_page(ptepage);
 				dst->rss++;
+				set_pte(dst_pte, pte);
+
+				pte_chain = page_add_rmap(ptepage, dst_pte, pte_chain);
+				if (pte_chain)
+					goto cont_copy_pte_range_noset;
+				pte_chain = pte_chain_alloc(GFP_ATOMIC);
+				if (pte_chain)
+					goto cont_copy_pte_range_noset;
+
+				/*
+				 * The parent's mmap_sem is held for writing and
+				 * the child isn't running yet, so neither set of
+				 * page tables can go away while we sleep.
+				 */
+				spin_unlock(&src->page_table_lock);
+				spin_unlock(&dst->page_table_lock);
+				pte_chain = pte_chain_alloc(GFP_KERNEL);
+				spin_lock(&dst->page_table_lock);
+				spin_lock(&src->page_table_lock);
+				if (!pte_chain)
+					goto nomem_unlock;
+				goto cont_copy_pte_range_noset;
 
 cont_copy_pte_range:		set_pte(dst_pte, pte);
 cont_copy_pte_range_noset:	address += PAGE_SIZE;
@@ -275,8 +310,12 @@ cont_copy_pmd_range:	src_pmd++;
 out_unlock:
 	spin_unlock(&src->page_table_lock);
 out:
+	pte_chain_free(pte_chain);
 	return 0;
+nomem_unlock:
+	spin_unlock(&src->page_table_lock);
 nomem:
+	pte_chain_free(pte_chain);
 	return -ENOMEM;
 }
 
@@ -315,8 +354,10 @@ static inline int zap_pte_range(mmu_gather_t *tlb, pmd_t * pmd, unsigned long ad
 			continue;
 		if (pte_present(pte)) {
 			struct page *page = pte_page(pte);
-			if (VALID_PAGE(page) && !PageReserved(page))
+			if (VALID_PAGE(page) && !PageReserved(page)) {
 				freed ++;
+				page_remove_rmap(page, ptep);
+			}
 			/* This will eventually call __free_pte on the pte. */
 			tlb_remove_page(tlb, ptep, address + offset);
 		} else {
@@ -951,13 +992,18 @@ static int do_wp_page(struct mm_struct *mm, struct vm_area_struct * vma,
 	unsigned long address, pte_t *page_table, pte_t pte)
 {
 	struct page *old_page, *new_page;
+	struct pte_chain *pte_chain;
 
 	old_page = pte_page(pte);
 	if (!VALID_PAGE(old_page))
 		goto bad_wp_page;
 
 	if (!TryLockPage(old_page)) {
-		int reuse = can_share_swap_page(old_page);
+		int reuse;
+
+		/* A reference held by an LRU batch would look like a sharer */
+		lru_add_drain();
+		reuse = can_share_swap_page(old_page);
 		unlock_page(old_page);
 		if (reuse) {
 			flush_cache_page(vma, address);
@@ -973,9 +1019,12 @@ static int do_wp_page(struct mm_struct *mm, struct vm_area_struct * vma,
 	page_cache_get(old_page);
 	spin_unlock(&mm->page_table_lock);
 
+	pte_chain = pte_chain_alloc(GFP_KERNEL);
+	if (!pte_chain)
+		goto no_mem;
 	new_page = alloc_page(GFP_HIGHUSER);
 	if (!new_page)
-		goto no_mem;
+		goto no_mem_chain;
 	copy_cow_page(old_page,new_page,address);
 
 	/*
@@ -985,14 +1034,16 @@ static int do_wp_page(struct mm_struct *mm, struct vm_area_struct * vma,
 	if (pte_same(*page_table, pte)) {
 		if (PageReserved(old_page))
 			++mm->rss;
+		page_remove_rmap(old_page, page_table);
 		break_cow(vma, new_page, address, page_table);
-		if (vm_anon_lru)
-			lru_cache_add(new_page);
+		pte_chain = page_add_rmap(new_page, page_table, pte_chain);
+		lru_cache_add(new_page);
 
 		/* Free the old page.. */
 		new_page = old_page;
 	}
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	page_cache_release(new_page);
 	page_cache_release(old_page);
 	return 1;	/* Minor fault */
@@ -1001,6 +1052,8 @@ bad_wp_page:
 	spin_unlock(&mm->page_table_lock);
 	printk("do_wp_page: bogus page at address %08lx (page 0x%lx)\n",address,(unsigned long)old_page);
 	return -1;
+no_mem_chain:
+	pte_chain_free(pte_chain);
 no_mem:
 	page_cache_release(old_page);
 	return -1;
@@ -1123,6 +1176,7 @@ static int do_swap_page(struct mm_struct * mm,
 {
 	struct page *page;
 	swp_entry_t entry = pte_to_swp_entry(orig_pte);
+	struct pte_chain *pte_chain;
 	pte_t pte;
 	int ret = 1;
 
@@ -1148,6 +1202,13 @@ static int do_swap_page(struct mm_struct * mm,
 	}
 
 	mark_page_accessed(page);
+	lru_add_drain();	/* for can_share_swap_page() below */
+
+	pte_chain = pte_chain_alloc(GFP_KERNEL);
+	if (!pte_chain) {
+		page_cache_release(page);
+		return -1;
+	}
 
 	lock_page(page);
 
@@ -1160,6 +1221,7 @@ static int do_swap_page(struct mm_struct * mm,
 		spin_unlock(&mm->page_table_lock);
 		unlock_page(page);
 		page_cache_release(page);
+		pte_chain_free(pte_chain);
 		return 1;
 	}
 
@@ -1178,10 +1240,12 @@ static int do_swap_page(struct mm_struct * mm,
 	flush_page_to_ram(page);
 	flush_icache_page(vma, page);
 	set_pte(page_table, pte);
+	pte_chain = page_add_rmap(page, page_table, pte_chain);
 
 	/* No need to invalidate - it was non-present before */
 	update_mmu_cache(vma, address, pte);
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	return ret;
 }
 
@@ -1192,6 +1256,7 @@ static int do_swap_page(struct mm_struct * mm,
  */
 static int do_anonymous_page(struct mm_struct * mm, struct vm_area_struct * vma, pte_t *page_table, int write_access, unsigned long addr)
 {
+	struct pte_chain *pte_chain = NULL;
 	pte_t entry;
 
 	/* Read-only mapping of ZERO_PAGE. */
@@ -1204,6 +1269,9 @@ static int do_anonymous_page(struct mm_struct * mm, struct vm_area_struct * vma,
 		/* Allocate our own private page. */
 		spin_unlock(&mm->page_table_lock);
 
+		pte_chain = pte_chain_alloc(GFP_KERNEL);
+		if (!pte_chain)
+			goto no_mem;
 		page = alloc_page(GFP_HIGHUSER);
 		if (!page)
 			goto no_mem;
@@ -1213,24 +1281,27 @@ static int do_anonymous_page(struct mm_struct * mm, struct vm_area_struct * vma,
 		if (!pte_none(*page_table)) {
 			page_cache_release(page);
 			spin_unlock(&mm->page_table_lock);
+			pte_chain_free(pte_chain);
 			return 1;
 		}
 		mm->rss++;
 		flush_page_to_ram(page);
 		entry = pte_mkwrite(pte_mkdirty(mk_pte(page, vma->vm_page_prot)));
-		if (vm_anon_lru)
-			lru_cache_add(page);
+		lru_cache_add(page);
 		mark_page_accessed(page);
-	}
-
-	set_pte(page_table, entry);
+		set_pte(page_table, entry);
+		pte_chain = page_add_rmap(page, page_table, pte_chain);
+	} else
+		set_pte(page_table, entry);
 
 	/* No need to invalidate - it was non-present before */
 	update_mmu_cache(vma, addr, entry);
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	return 1;	/* Minor fault */
 
 no_mem:
+	pte_chain_free(pte_chain);
 	return -1;
 }
 
@@ -1250,6 +1321,7 @@ static int do_no_page(struct mm_struct * mm, struct vm_area_struct * vma,
 	unsigned long address, int write_access, pte_t *page_table)
 {
 	struct page * new_page;
+	struct pte_chain *pte_chain;
 	pte_t entry;
 
 	if (!vma->vm_ops || !vma->vm_ops->nopage)
@@ -1263,19 +1335,20 @@ static int do_no_page(struct mm_struct * mm, struct vm_area_struct * vma,
 	if (new_page == NOPAGE_OOM)
 		return -1;
 
+	pte_chain = pte_chain_alloc(GFP_KERNEL);
+	if (!pte_chain)
+		goto oom;
+
 	/*
 	 * Should we do an early C-O-W break?
 	 */
 	if (write_access && !(vma->vm_flags & VM_SHARED)) {
 		struct page * page = alloc_page(GFP_HIGHUSER);
-		if (!page) {
-			page_cache_release(new_page);
-			return -1;
-		}
+		if (!page)
+			goto oom;
 		copy_user_highpage(page, new_page, address);
 		page_cache_release(new_page);
-		if (vm_anon_lru)
-			lru_cache_add(page);
+		lru_cache_add(page);
 		new_page = page;
 	}
 
@@ -1300,17 +1373,25 @@ static int do_no_page(struct mm_struct * mm, struct vm_area_struct * vma,
 		if (write_access)
 			entry = pte_mkwrite(pte_mkdirty(entry));
 		set_pte(page_table, entry);
+		pte_chain = page_add_rmap(new_page, page_table, pte_chain);
 	} else {
 		/* One of our sibling threads was faster, back out. */
 		page_cache_release(new_page);
 		spin_unlock(&mm->page_table_lock);
+		pte_chain_free(pte_chain);
 		return 1;
 	}
 
 	/* no need to invalidate: a not-present page shouldn't be cached */
 	update_mmu_cache(vma, address, entry);
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	return 2;	/* Major fault */
+
+oom:
+	page_cache_release(new_page);
+	pte_chain_free(pte_chain);
+	return -1;
 }
 
 /*
@@ -1459,6 +1540,7 @@ pte_t fastcall *pte_alloc(struct mm_struct *mm, pmd_t *pmd, unsigned long addres
 				goto out;
 			}
 		}
+		pgtable_add_rmap(new, mm, address);
 		pmd_populate(mm, pmd, new);
 	}
 out:
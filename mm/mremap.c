@@ -9,6 +9,7 @@
 #include <linux/shm.h>
 #include <linux/mman.h>
 #include <linux/swap.h>
+#include <linux/rmap.h>
 
 #include <asm/uaccess.h>
 #include <asm/pgalloc.h>
@@ -57,19 +58,27 @@ static inline pte_t *alloc_one_pte(struct mm_struct *mm, unsigned long addr)
 	return pte;
 }
 
-static inline int copy_one_pte(struct mm_struct *mm, pte_t * src, pte_t * dst)
+static inline int copy_one_pte(struct mm_struct *mm, pte_t * src, pte_t * dst,
+	struct pte_chain ** pte_chainp)
 {
 	int error = 0;
+	struct page *page = NULL;
 	pte_t pte;
 
 	if (!pte_none(*src)) {
 		pte = ptep_get_and_clear(src);
+		if (pte_present(pte)) {
+			page = pte_page(pte);
+			page_remove_rmap(page, src);
+		}
 		if (!dst) {
 			/* No dest?  We must put it back. */
 			dst = src;
 			error++;
 		}
 		set_pte(dst, pte);
+		if (page)
+			*pte_chainp = page_add_rmap(page, dst, *pte_chainp);
 	}
 	return error;
 }
@@ -78,6 +87,11 @@ static int move_one_page(struct mm_struct *mm, unsigned long old_addr, unsigned
 {
 	int error = 0;
 	pte_t * src, * dst;
+	struct pte_chain *pte_chain;
+
+	pte_chain = pte_chain_alloc(GFP_KERNEL);
+	if (!pte_chain)
+		return -1;
 
 	spin_lock(&mm->page_table_lock);
 	src = get_one_pte(mm, old_addr);
@@ -85,9 +99,10 @@ static int move_one_page(struct mm_struct *mm, unsigned long old_addr, unsigned
 		dst = alloc_one_pte(mm, new_addr);
 		src = get_one_pte(mm, old_addr);
 		if (src) 
-			error = copy_one_pte(mm, src, dst);
+			error = copy_one_pte(mm, src, dst, &pte_chain);
 	}
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	return error;
 }
 
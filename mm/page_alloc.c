@@ -23,10 +23,6 @@
 #include <linux/module.h>
 
 int nr_swap_pages;
-int nr_active_pages;
-int nr_inactive_pages;
-LIST_HEAD(inactive_list);
-LIST_HEAD(active_list);
 pg_data_t *pgdat_list;
 
 /*
@@ -46,7 +42,7 @@ static int lower_zone_reserve_ratio[MAX_NR_ZONES-1] = { 256, 32 };
 
 int vm_gfp_debug = 0;
 
-static void FASTCALL(__free_pages_ok (struct page *page, unsigned int order));
+static void FASTCALL(__free_pages_ok (struct page *page, unsigned int order, int cold));
 
 static spinlock_t free_pages_ok_no_irq_lock = SPIN_LOCK_UNLOCKED;
 struct page * free_pages_ok_no_irq_head;
@@ -65,7 +61,7 @@ static void do_free_pages_ok_no_irq(void * arg)
        while (page) {
                __page = page;
                page = page->next_hash;
-               __free_pages_ok(__page, __page->index);
+               __free_pages_ok(__page, __page->index, 0);
        }
 }
 
@@ -107,13 +103,101 @@ static struct tq_struct free_pages_ok_no_irq_task = {
  * triggers coalescing into a block of larger size.            
  *
  * -- wli
+ *
+ * Called with zone->lock held.
  */
 
-static void fastcall __free_pages_ok (struct page *page, unsigned int order)
+static inline void __free_one_page (zone_t *zone, struct page *page,
+				    unsigned int order)
 {
-	unsigned long index, page_idx, mask, flags;
+	unsigned long index, page_idx, mask;
 	free_area_t *area;
 	struct page *base;
+
+	mask = (~0UL) << order;
+	base = zone->zone_mem_map;
+	page_idx = page - base;
+	if (page_idx & ~mask)
+		BUG();
+	index = page_idx >> (1 + order);
+
+	area = zone->free_area + order;
+
+	zone->free_pages -= mask;
+
+	while (mask + (1 << (MAX_ORDER-1))) {
+		struct page *buddy1, *buddy2;
+
+		if (area >= zone->free_area + MAX_ORDER)
+			BUG();
+		if (!__test_and_change_bit(index, area->map))
+			/*
+			 * the buddy page is still allocated.
+			 */
+			break;
+		/*
+		 * Move the buddy up one level.
+		 * This code is taking advantage of the identity:
+		 * 	-mask = 1+~mask
+		 */
+		buddy1 = base + (page_idx ^ -mask);
+		buddy2 = base + page_idx;
+		if (BAD_RANGE(zone,buddy1))
+			BUG();
+		if (BAD_RANGE(zone,buddy2))
+			BUG();
+
+		list_del(&buddy1->list);
+		mask <<= 1;
+		area++;
+		index >>= 1;
+		page_idx &= mask;
+	}
+	list_add(&(base + page_idx)->list, &area->free_list);
+}
+
+/*
+ * Give count order-0 pages from the tail of a per-CPU list back to the
+ * buddy lists.  Called with interrupts off.
+ */
+static int free_pages_bulk (zone_t *zone, int count, struct list_head *list)
+{
+	struct page *page;
+	int freed = 0;
+
+	spin_lock(&zone->lock);
+	while (freed < count && !list_empty(list)) {
+		page = list_entry(list->prev, struct page, list);
+		list_del(&page->list);
+		__free_one_page(zone, page, 0);
+		freed++;
+	}
+	spin_unlock(&zone->lock);
+	return freed;
+}
+
+static void free_hot_cold_page (zone_t *zone, struct page *page, int cold)
+{
+	struct per_cpu_pageset *pset;
+	struct per_cpu_pages *pcp;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pset = zone->pageset + smp_processor_id();
+	pcp = pset->pcp + cold;
+	if (pcp->count >= pcp->high) {
+		pcp->count -= free_pages_bulk(zone, pcp->batch, &pcp->list);
+		pset->drains++;
+	}
+	list_add(&page->list, &pcp->list);
+	pcp->count++;
+	local_irq_restore(flags);
+}
+
+static void fastcall __free_pages_ok (struct page *page, unsigned int order,
+				      int cold)
+{
+	unsigned long flags;
 	zone_t *zone;
 
 	/*
@@ -142,6 +226,8 @@ static void fastcall __free_pages_ok (struct page *page, unsigned int order)
 		BUG();
 	if (page->mapping)
 		BUG();
+	if (page->pte_chain)
+		BUG();
 	if (!VALID_PAGE(page))
 		BUG();
 	if (PageLocked(page))
@@ -157,49 +243,13 @@ static void fastcall __free_pages_ok (struct page *page, unsigned int order)
 
 	zone = page_zone(page);
 
-	mask = (~0UL) << order;
-	base = zone->zone_mem_map;
-	page_idx = page - base;
-	if (page_idx & ~mask)
-		BUG();
-	index = page_idx >> (1 + order);
-
-	area = zone->free_area + order;
-
-	spin_lock_irqsave(&zone->lock, flags);
-
-	zone->free_pages -= mask;
-
-	while (mask + (1 << (MAX_ORDER-1))) {
-		struct page *buddy1, *buddy2;
-
-		if (area >= zone->free_area + MAX_ORDER)
-			BUG();
-		if (!__test_and_change_bit(index, area->map))
-			/*
-			 * the buddy page is still allocated.
-			 */
-			break;
-		/*
-		 * Move the buddy up one level.
-		 * This code is taking advantage of the identity:
-		 * 	-mask = 1+~mask
-		 */
-		buddy1 = base + (page_idx ^ -mask);
-		buddy2 = base + page_idx;
-		if (BAD_RANGE(zone,buddy1))
-			BUG();
-		if (BAD_RANGE(zone,buddy2))
-			BUG();
-
-		list_del(&buddy1->list);
-		mask <<= 1;
-		area++;
-		index >>= 1;
-		page_idx &= mask;
+	if (order == 0) {
+		free_hot_cold_page(zone, page, cold);
+		return;
 	}
-	list_add(&(base + page_idx)->list, &area->free_list);
 
+	spin_lock_irqsave(&zone->lock, flags);
+	__free_one_page(zone, page, order);
 	spin_unlock_irqrestore(&zone->lock, flags);
 	return;
 
@@ -238,16 +288,17 @@ static inline struct page * expand (zone_t *zone, struct page *page,
 	return page;
 }
 
-static FASTCALL(struct page * rmqueue(zone_t *zone, unsigned int order));
-static struct page * fastcall rmqueue(zone_t *zone, unsigned int order)
+/*
+ * Take a block of 2^order pages off the buddy lists.  Called with
+ * zone->lock held.
+ */
+static struct page * __rmqueue(zone_t *zone, unsigned int order)
 {
 	free_area_t * area = zone->free_area + order;
 	unsigned int curr_order = order;
 	struct list_head *head, *curr;
-	unsigned long flags;
 	struct page *page;
 
-	spin_lock_irqsave(&zone->lock, flags);
 	do {
 		head = &area->free_list;
 		curr = head->next;
@@ -264,26 +315,85 @@ static struct page * fastcall rmqueue(zone_t *zone, unsigned int order)
 				MARK_USED(index, curr_order, area);
 			zone->free_pages -= 1UL << order;
 
-			page = expand(zone, page, index, order, curr_order, area);
-			spin_unlock_irqrestore(&zone->lock, flags);
-
-			set_page_count(page, 1);
-			if (BAD_RANGE(zone,page))
-				BUG();
-			if (PageLRU(page))
-				BUG();
-			if (PageActive(page))
-				BUG();
-			return page;	
+			return expand(zone, page, index, order, curr_order, area);
 		}
 		curr_order++;
 		area++;
 	} while (curr_order < MAX_ORDER);
-	spin_unlock_irqrestore(&zone->lock, flags);
 
 	return NULL;
 }
 
+/*
+ * Move count order-0 pages from the buddy lists to the tail of a per-CPU
+ * list.  Called with interrupts off.
+ */
+static int rmqueue_bulk(zone_t *zone, int count, struct list_head *list)
+{
+	struct page *page;
+	int allocated = 0;
+
+	spin_lock(&zone->lock);
+	while (allocated < count) {
+		page = __rmqueue(zone, 0);
+		if (!page)
+			break;
+		list_add_tail(&page->list, list);
+		allocated++;
+	}
+	spin_unlock(&zone->lock);
+	return allocated;
+}
+
+/*
+ * Single pages come from this CPU's hot or cold list, refilled first if
+ * it is running low.  Anything bigger, or anything the list could not
+ * provide, comes from the buddy lists.
+ */
+static FASTCALL(struct page * rmqueue(zone_t *zone, unsigned int order, int cold));
+static struct page * fastcall rmqueue(zone_t *zone, unsigned int order, int cold)
+{
+	struct page *page = NULL;
+	unsigned long flags;
+
+	if (order == 0) {
+		struct per_cpu_pageset *pset;
+		struct per_cpu_pages *pcp;
+
+		local_irq_save(flags);
+		pset = zone->pageset + smp_processor_id();
+		pcp = pset->pcp + cold;
+		if (pcp->count <= pcp->low) {
+			pcp->count += rmqueue_bulk(zone, pcp->batch, &pcp->list);
+			pset->misses++;
+		} else
+			pset->hits++;
+		if (pcp->count) {
+			page = list_entry(pcp->list.next, struct page, list);
+			list_del(&page->list);
+			pcp->count--;
+		}
+		local_irq_restore(flags);
+	}
+
+	if (!page) {
+		spin_lock_irqsave(&zone->lock, flags);
+		page = __rmqueue(zone, order);
+		spin_unlock_irqrestore(&zone->lock, flags);
+		if (!page)
+			return NULL;
+	}
+
+	set_page_count(page, 1);
+	if (BAD_RANGE(zone,page))
+		BUG();
+	if (PageLRU(page))
+		BUG();
+	if (PageActive(page))
+		BUG();
+	return page;
+}
+
 #ifndef CONFIG_DISCONTIGMEM
 struct page * fastcall _alloc_pages(unsigned int gfp_mask, unsigned int order)
 {
@@ -351,7 +461,7 @@ static struct page * fastcall balance_classzone(zone_t * classzone, unsigned int
 		while ((entry = local_pages->prev) != local_pages) {
 			list_del(entry);
 			tmp = list_entry(entry, struct page, list);
-			__free_pages_ok(tmp, tmp->index);
+			__free_pages_ok(tmp, tmp->index, 0);
 			if (!nr_pages--)
 				BUG();
 		}
@@ -376,6 +486,8 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 	zone_t **zone, * classzone;
 	struct page * page;
 	int freed, class_idx;
+	/* A DMA buffer is a device's to fill, just like a readahead page */
+	int cold = (gfp_mask & (__GFP_COLD | __GFP_DMA)) != 0;
 
 	zone = zonelist->zones;
 	classzone = *zone;
@@ -387,7 +499,7 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 			break;
 
 		if (zone_free_pages(z, order) > z->watermarks[class_idx].low) {
-			page = rmqueue(z, order);
+			page = rmqueue(z, order, cold);
 			if (page)
 				return page;
 		}
@@ -409,7 +521,7 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 		if (!(gfp_mask & __GFP_WAIT))
 			min >>= 2;
 		if (zone_free_pages(z, order) > min) {
-			page = rmqueue(z, order);
+			page = rmqueue(z, order, cold);
 			if (page)
 				return page;
 		}
@@ -425,7 +537,7 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 			if (!z)
 				break;
 
-			page = rmqueue(z, order);
+			page = rmqueue(z, order, cold);
 			if (page)
 				return page;
 		}
@@ -449,7 +561,7 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 				break;
 
 			if (zone_free_pages(z, order) > z->watermarks[class_idx].min) {
-				page = rmqueue(z, order);
+				page = rmqueue(z, order, cold);
 				if (page)
 					return page;
 			}
@@ -466,7 +578,7 @@ struct page * fastcall __alloc_pages(unsigned int gfp_mask, unsigned int order,
 				break;
 
 			if (zone_free_pages(z, order) > z->watermarks[class_idx].high) {
-				page = rmqueue(z, order);
+				page = rmqueue(z, order, cold);
 				if (page)
 					return page;
 			}
@@ -510,7 +622,13 @@ fastcall unsigned long get_zeroed_page(unsigned int gfp_mask)
 fastcall void __free_pages(struct page *page, unsigned int order)
 {
 	if (!PageReserved(page) && put_page_testzero(page))
-		__free_pages_ok(page, order);
+		__free_pages_ok(page, order, 0);
+}
+
+fastcall void free_cold_page(struct page *page)
+{
+	if (!PageReserved(page) && put_page_testzero(page))
+		__free_pages_ok(page, 0, 1);
 }
 
 fastcall void free_pages(unsigned long addr, unsigned int order)
@@ -533,6 +651,32 @@ unsigned int nr_free_pages (void)
 	return sum;
 }
 
+/*
+ * Number of pages on the active and inactive lists of all zones.
+ * Unlocked, so only approximate.
+ */
+unsigned int nr_active_pages (void)
+{
+	unsigned int sum = 0;
+	zone_t *zone;
+
+	for_each_zone(zone)
+		sum += zone->nr_active_pages;
+
+	return sum;
+}
+
+unsigned int nr_inactive_pages (void)
+{
+	unsigned int sum = 0;
+	zone_t *zone;
+
+	for_each_zone(zone)
+		sum += zone->nr_inactive_pages;
+
+	return sum;
+}
+
 /*
  * Amount of free RAM allocatable as buffer memory:
  */
@@ -621,8 +765,8 @@ void show_free_areas_core(pg_data_t *pgdat)
 	}
 
 	printk("( Active: %d, inactive: %d, free: %d )\n",
-	       nr_active_pages,
-	       nr_inactive_pages,
+	       nr_active_pages(),
+	       nr_inactive_pages(),
 	       nr_free_pages());
 
 	for (type = 0; type < MAX_NR_ZONES; type++) {
@@ -660,6 +804,38 @@ void show_free_areas(void)
 	show_free_areas_core(pgdat_list);
 }
 
+/*
+ * /proc/pagesets, one line per CPU and zone: pages on the hot and cold
+ * lists against their high marks, allocations served by the lists
+ * without and with a refill, and batches drained back to the zone.
+ * The counters are read without locking, they are only statistics.
+ */
+int get_pageset_stats(char *page)
+{
+	int i, len = 0;
+	zone_t *zone;
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		int cpu = cpu_logical_map(i);
+
+		for_each_zone(zone) {
+			struct per_cpu_pageset *pset = zone->pageset + cpu;
+
+			if (!zone->size)
+				continue;
+			if (len > PAGE_SIZE - 128)
+				return len;
+			len += sprintf(page + len, "cpu%d %-7s hot %d/%d "
+				       "cold %d/%d hits %lu misses %lu "
+				       "drains %lu\n", cpu, zone->name,
+				       pset->pcp[0].count, pset->pcp[0].high,
+				       pset->pcp[1].count, pset->pcp[1].high,
+				       pset->hits, pset->misses, pset->drains);
+		}
+	}
+	return len;
+}
+
 /*
  * Builds allocation fallback zone lists.
  */
@@ -806,7 +982,7 @@ void __init free_area_init_core(int nid, pg_data_t *pgdat, struct page **gmap,
 		zone_t *zone = pgdat->node_zones + j;
 		unsigned long mask;
 		unsigned long size, realsize;
-		int idx;
+		int idx, batch;
 
 		zone_table[nid * MAX_NR_ZONES + j] = zone;
 		realsize = size = zones_size[j];
@@ -821,8 +997,36 @@ void __init free_area_init_core(int nid, pg_data_t *pgdat, struct page **gmap,
 		zone->zone_pgdat = pgdat;
 		zone->free_pages = 0;
 		zone->need_balance = 0;
-		 zone->nr_active_pages = zone->nr_inactive_pages = 0;
+		zone->lru_lock = SPIN_LOCK_UNLOCKED;
+		INIT_LIST_HEAD(&zone->active_list);
+		INIT_LIST_HEAD(&zone->inactive_list);
+		zone->nr_active_pages = zone->nr_inactive_pages = 0;
 
+		/*
+		 * The per-CPU lists move about a quarter of a megabyte's
+		 * worth of pages at a time (less in small zones).  The hot
+		 * list is kept between two and six batches long, the cold
+		 * one is only refilled when empty.
+		 */
+		batch = realsize / 1024;
+		if (batch * PAGE_SIZE > 256 * 1024)
+			batch = (256 * 1024) / PAGE_SIZE;
+		batch /= 4;
+		if (batch < 1)
+			batch = 1;
+		for (i = 0; i < NR_CPUS; i++) {
+			struct per_cpu_pageset *pset = zone->pageset + i;
+
+			memset(pset, 0, sizeof(*pset));
+			pset->pcp[0].low = 2 * batch;
+			pset->pcp[0].high = 6 * batch;
+			pset->pcp[0].batch = batch;
+			INIT_LIST_HEAD(&pset->pcp[0].list);
+			pset->pcp[1].low = 0;
+			pset->pcp[1].high = 2 * batch;
+			pset->pcp[1].batch = batch;
+			INIT_LIST_HEAD(&pset->pcp[1].list);
+		}
 
 		if (!size)
 			continue;
@@ -0,0 +1,229 @@
+/*
+ *  linux/mm/rmap.c
+ *
+ *  Reverse mapping of user pages to the ptes which map them.
+ *
+ *  Every pte pointing at a pageable page is recorded on the page's
+ *  pte_chain when it is set up and taken off again when it is torn
+ *  down.  Page table pages carry the owning mm in ->mapping and the
+ *  virtual address they start at in ->index (see pgtable_add_rmap()),
+ *  so a pte pointer on a chain is enough to find the mm, the vma and
+ *  the address.  Page reclaim uses this to look at the referenced bits
+ *  of, and to unmap, one particular page off the inactive list, where
+ *  swap_out() used to scan whole address spaces in virtual order.
+ *
+ *  Locking:
+ *	mm->page_table_lock
+ *	    page->pte_chain (PG_chainlock)
+ *
+ *  The reclaim side starts from the page and holds PG_chainlock, so it
+ *  can only trylock the page_table_lock.  A pte pointer on a chain
+ *  stays valid as long as PG_chainlock is held: the page table page
+ *  can't be freed before the pte has been zapped, and zapping takes
+ *  the pte off the chain first.
+ */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/pagemap.h>
+#include <linux/kernel_stat.h>
+#include <linux/init.h>
+#include <linux/rmap.h>
+
+#include <asm/pgalloc.h>
+
+static kmem_cache_t *pte_chain_cache;
+
+/**
+ * pte_chain_alloc - allocate a pte_chain for a later page_add_rmap()
+ * @gfp_mask: allocation flags
+ *
+ * Callers which are about to map a page allocate the chain before they
+ * take the page_table_lock, so that page_add_rmap() itself never has
+ * to allocate memory.
+ */
+struct pte_chain *pte_chain_alloc(int gfp_mask)
+{
+	return kmem_cache_alloc(pte_chain_cache, gfp_mask);
+}
+
+void pte_chain_free(struct pte_chain *pte_chain)
+{
+	if (pte_chain)
+		kmem_cache_free(pte_chain_cache, pte_chain);
+}
+
+/**
+ * page_add_rmap - note that a pte now maps a page
+ * @page: the page
+ * @ptep: the pte, already set up to point at @page
+ * @pte_chain: a chain from pte_chain_alloc()
+ *
+ * Returns @pte_chain if it was not needed (the page isn't pageable),
+ * NULL if it was used.  Called with the page_table_lock held.
+ */
+struct pte_chain *page_add_rmap(struct page *page, pte_t *ptep,
+	struct pte_chain *pte_chain)
+{
+	if (!VALID_PAGE(page) || PageReserved(page))
+		return pte_chain;
+	if (!pte_chain)
+		BUG();
+
+	pte_chain->ptep = ptep;
+	pte_chain_lock(page);
+	pte_chain->next = page->pte_chain;
+	page->pte_chain = pte_chain;
+	pte_chain_unlock(page);
+	return NULL;
+}
+
+/**
+ * page_remove_rmap - note that a pte no longer maps a page
+ * @page: the page
+ * @ptep: the pte which used to point at @page
+ *
+ * Called with the page_table_lock held, before the pte is cleared.
+ */
+void page_remove_rmap(struct page *page, pte_t *ptep)
+{
+	struct pte_chain *pc, **pcp;
+
+	if (!VALID_PAGE(page) || PageReserved(page))
+		return;
+
+	pte_chain_lock(page);
+	for (pcp = &page->pte_chain; (pc = *pcp) != NULL; pcp = &pc->next) {
+		if (pc->ptep == ptep) {
+			*pcp = pc->next;
+			pte_chain_unlock(page);
+			pte_chain_free(pc);
+			return;
+		}
+	}
+	pte_chain_unlock(page);
+	printk(KERN_ERR "page_remove_rmap: pte %p not found for page %p\n",
+	       ptep, page);
+}
+
+/**
+ * page_referenced - test and clear the accessed bits of a page's ptes
+ * @page: the page
+ *
+ * Returns the number of ptes mapping @page which had been accessed
+ * since the last call.  PG_referenced is left alone, the LRU code has
+ * its own use for it.
+ */
+int page_referenced(struct page *page)
+{
+	struct pte_chain *pc;
+	int referenced = 0;
+
+	pte_chain_lock(page);
+	for (pc = page->pte_chain; pc; pc = pc->next) {
+		if (ptep_test_and_clear_young(pc->ptep))
+			referenced++;
+	}
+	pte_chain_unlock(page);
+	return referenced;
+}
+
+/*
+ * Unmap the page from one pte.  Called with PG_chainlock held; the
+ * caller holds the page lock and a reference on the page, so the
+ * page_cache_release() below never frees it.
+ */
+static int try_to_unmap_one(struct page *page, pte_t *ptep)
+{
+	struct mm_struct *mm = ptep_to_mm(ptep);
+	unsigned long address = ptep_to_address(ptep);
+	struct vm_area_struct *vma;
+	pte_t pte;
+	int ret = SWAP_AGAIN;
+
+	if (!spin_trylock(&mm->page_table_lock))
+		return ret;
+
+	/* The vma list is stable under the page_table_lock */
+	vma = find_vma(mm, address);
+	ret = SWAP_FAIL;
+	if (!vma || (vma->vm_flags & (VM_LOCKED | VM_RESERVED)))
+		goto out_unlock;
+
+	flush_cache_page(vma, address);
+	pte = ptep_get_and_clear(ptep);
+	flush_tlb_page(vma, address);
+
+	/*
+	 * An anonymous page is in the swap cache by now, so the pte
+	 * becomes a swap entry.  A file page is simply faulted back in.
+	 */
+	if (PageSwapCache(page)) {
+		swp_entry_t entry;
+
+		entry.val = page->index;
+		swap_duplicate(entry);
+		set_pte(ptep, swp_entry_to_pte(entry));
+	}
+
+	if (pte_dirty(pte))
+		set_page_dirty(page);
+
+	mm->rss--;
+	page_cache_release(page);
+	kstat.pgunmap++;
+	ret = SWAP_SUCCESS;
+
+out_unlock:
+	spin_unlock(&mm->page_table_lock);
+	return ret;
+}
+
+/**
+ * try_to_unmap - unmap a page from every pte which maps it
+ * @page: the page, locked, with a reference held by the caller
+ *
+ * Returns SWAP_SUCCESS if all the ptes are gone, SWAP_AGAIN if some
+ * page table was busy and SWAP_FAIL if the page sits in a locked vma
+ * or has no backing store to be faulted back in from.
+ */
+int try_to_unmap(struct page *page)
+{
+	struct pte_chain *pc, **pcp;
+	int ret = SWAP_SUCCESS;
+
+	if (!PageLocked(page))
+		BUG();
+	if (!page->mapping)
+		return SWAP_FAIL;
+
+	pte_chain_lock(page);
+	pcp = &page->pte_chain;
+	while ((pc = *pcp) != NULL) {
+		switch (try_to_unmap_one(page, pc->ptep)) {
+		case SWAP_SUCCESS:
+			*pcp = pc->next;
+			pte_chain_free(pc);
+			continue;
+		case SWAP_AGAIN:
+			ret = SWAP_AGAIN;
+			break;
+		case SWAP_FAIL:
+			ret = SWAP_FAIL;
+			goto out;
+		}
+		pcp = &pc->next;
+	}
+out:
+	pte_chain_unlock(page);
+	return ret;
+}
+
+void __init pte_chain_init(void)
+{
+	pte_chain_cache = kmem_cache_create("pte_chain",
+			sizeof(struct pte_chain), 0, 0, NULL, NULL);
+	if (!pte_chain_cache)
+		panic("Failed to create pte_chain cache\n");
+}
@@ -502,8 +502,7 @@ found:
 	inode = info->inode;
 	mapping = inode->i_mapping;
 	delete_from_swap_cache(page);
-	if (add_to_page_cache_unique(page,
-			mapping, idx, page_hash(mapping, idx)) == 0) {
+	if (add_to_page_cache_unique(page, mapping, idx) == 0) {
 		info->flags |= SHMEM_PAGEIN;
 		ptr[offset].val = 0;
 		info->swapped--;
@@ -528,6 +527,8 @@ int shmem_unuse(swp_entry_t entry, struct page *page)
 	struct shmem_inode_info *info;
 	int found = 0;
 
+	/* The page moves from the swap cache to a page cache under spinlocks */
+	radix_tree_preload(GFP_KERNEL);
 	spin_lock(&shmem_ilock);
 	list_for_each(p, &shmem_inodes) {
 		info = list_entry(p, struct shmem_inode_info, list);
@@ -553,6 +554,7 @@ static int shmem_writepage(struct page *page)
 	struct address_space *mapping;
 	unsigned long index;
 	struct inode *inode;
+	int err;
 
 	BUG_ON(!PageLocked(page));
 	if (!PageLaunder(page))
@@ -569,6 +571,8 @@ getswap:
 	if (!swap.val)
 		goto fail;
 
+	/* Radix tree nodes for the swap cache, if it needs any */
+	page_cache_preload(mapping);
 	spin_lock(&info->lock);
 	if (index >= info->next_index) {
 		BUG_ON(!(info->flags & SHMEM_TRUNCATE));
@@ -580,21 +584,19 @@ getswap:
 	BUG_ON(!entry);
 	BUG_ON(entry->val);
 
-	/* Remove it from the page cache */
-	remove_inode_page(page);
-	page_cache_release(page);
-
-	/* Add it to the swap cache */
-	if (add_to_swap_cache(page, swap) != 0) {
-		/*
-		 * Raced with "speculative" read_swap_cache_async.
-		 * Add page back to page cache, unref swap, try again.
-		 */
-		add_to_page_cache_locked(page, mapping, index);
-		info->flags |= SHMEM_PAGEIN;
+	/*
+	 * Move it from the page cache to the swap cache.  If that fails
+	 * it stays in the file: after a race with "speculative"
+	 * read_swap_cache_async try another entry, without memory for
+	 * the swap cache give up for now.
+	 */
+	err = move_to_swap_cache(page, swap);
+	if (err) {
 		spin_unlock(&info->lock);
 		swap_free(swap);
-		goto getswap;
+		if (err == -EEXIST)
+			goto getswap;
+		goto fail;
 	}
 
 	*entry = swap;
@@ -645,6 +647,7 @@ repeat:
 	if (filepage && Page_Uptodate(filepage))
 		goto done;
 
+	page_cache_preload(mapping);
 	spin_lock(&info->lock);
 	entry = shmem_swp_alloc(info, idx, sgp);
 	if (IS_ERR(entry)) {
@@ -706,8 +709,7 @@ repeat:
 			SetPageUptodate(filepage);
 			SetPageDirty(filepage);
 			swap_free(swap);
-		} else if (add_to_page_cache_unique(swappage,
-			mapping, idx, page_hash(mapping, idx)) == 0) {
+		} else if (add_to_page_cache_unique(swappage, mapping, idx) == 0) {
 			info->flags |= SHMEM_PAGEIN;
 			entry->val = 0;
 			info->swapped--;
@@ -759,13 +761,13 @@ repeat:
 				goto failed;
 			}
 
+			page_cache_preload(mapping);
 			spin_lock(&info->lock);
 			entry = shmem_swp_alloc(info, idx, sgp);
 			if (IS_ERR(entry))
 				error = PTR_ERR(entry);
 			if (error || entry->val ||
-			    add_to_page_cache_unique(filepage,
-			    mapping, idx, page_hash(mapping, idx)) != 0) {
+			    add_to_page_cache_unique(filepage, mapping, idx) != 0) {
 				spin_unlock(&info->lock);
 				page_cache_release(filepage);
 				shmem_free_block(inode);
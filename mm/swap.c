@@ -18,6 +18,7 @@
 #include <linux/swap.h>
 #include <linux/swapctl.h>
 #include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/init.h>
 
 #include <asm/dma.h>
@@ -33,6 +34,20 @@ pager_daemon_t pager_daemon = {
 	8,	/* do swap I/O in clusters of this size */
 };
 
+/*
+ * Pages being added to the LRU, or moved to the active list, are
+ * collected per CPU and handed over PAGEVEC_SIZE at a time, so that
+ * the zone lru_lock is taken once per batch rather than once per page.
+ * Each pagevec holds a reference on its pages.  The vectors are only
+ * touched from process context, with no blocking in between.
+ */
+struct lru_pagevecs {
+	struct pagevec add;
+	struct pagevec activate;
+} ____cacheline_aligned;
+
+static struct lru_pagevecs lru_pagevecs[NR_CPUS];
+
 /*
  * Move an inactive page to the active list.
  */
@@ -44,102 +59,164 @@ static inline void activate_page_nolock(struct page * page)
 	}
 }
 
+/**
+ * activate_page: move a page to the active list
+ * @page: the page to activate
+ *
+ * The move happens when this CPU's batch is full, or at the next
+ * lru_add_drain().
+ */
 void fastcall activate_page(struct page * page)
 {
-	spin_lock(&pagemap_lru_lock);
-	activate_page_nolock(page);
-	spin_unlock(&pagemap_lru_lock);
+	struct lru_pagevecs *pvecs = &lru_pagevecs[smp_processor_id()];
+
+	page_cache_get(page);
+	if (!pagevec_add(&pvecs->activate, page)) {
+		/* Pages added from this CPU must be on a list to move */
+		if (pagevec_count(&pvecs->add))
+			__pagevec_lru_add(&pvecs->add);
+		__pagevec_activate(&pvecs->activate);
+	}
 }
 
 /**
  * lru_cache_add: add a page to the page lists
  * @page: the page to add
+ *
+ * The page goes on the inactive list when this CPU's batch is full,
+ * or at the next lru_add_drain().
  */
 void fastcall lru_cache_add(struct page * page)
 {
-	if (!PageLRU(page)) {
-		spin_lock(&pagemap_lru_lock);
-		if (!TestSetPageLRU(page))
-			add_page_to_inactive_list(page);
-		spin_unlock(&pagemap_lru_lock);
-	}
+	struct pagevec *pvec = &lru_pagevecs[smp_processor_id()].add;
+
+	if (PageLRU(page))
+		return;
+	page_cache_get(page);
+	if (!pagevec_add(pvec, page))
+		__pagevec_lru_add(pvec);
 }
 
 /**
- * __lru_cache_del: remove a page from the page lists
- * @page: the page to add
+ * lru_add_drain: flush this CPU's pending LRU batches
  *
- * This function is for when the caller already holds
- * the pagemap_lru_lock.
+ * Page reclaim calls this before it looks at the lists, so that pages
+ * which were just added or activated are where it expects them, and
+ * are not held busy by the extra reference of a pagevec.
  */
-void fastcall __lru_cache_del(struct page * page)
+void lru_add_drain(void)
 {
-	if (TestClearPageLRU(page)) {
-		if (PageActive(page)) {
-			del_page_from_active_list(page);
-		} else {
-			del_page_from_inactive_list(page);
-		}
-	}
+	struct lru_pagevecs *pvecs = &lru_pagevecs[smp_processor_id()];
+
+	if (pagevec_count(&pvecs->add))
+		__pagevec_lru_add(&pvecs->add);
+	if (pagevec_count(&pvecs->activate))
+		__pagevec_activate(&pvecs->activate);
 }
 
 /**
- * lru_cache_del: remove a page from the page lists
- * @page: the page to remove
+ * __pagevec_release: drop the references held by a pagevec
+ * @pvec: the pages
+ *
+ * Must not be called with a zone lru_lock held, as a page may be freed
+ * here and freeing takes it off the LRU.
  */
-void fastcall lru_cache_del(struct page * page)
+void __pagevec_release(struct pagevec *pvec)
 {
-	spin_lock(&pagemap_lru_lock);
-	__lru_cache_del(page);
-	spin_unlock(&pagemap_lru_lock);
+	unsigned int i;
+
+	for (i = 0; i < pagevec_count(pvec); i++)
+		page_cache_release(pvec->pages[i]);
+	pagevec_init(pvec);
 }
 
 /**
- * delta_nr_active_pages: alter the number of active pages.
- *
- * @page: the page which is being activated/deactivated
- * @delta: +1 for activation, -1 for deactivation
+ * __pagevec_lru_add: add a batch of pages to the inactive lists
+ * @pvec: the pages, with a reference held on each
  *
- * Called under pagecache_lock
+ * Runs of pages from the same zone are added under one acquisition of
+ * that zone's lru_lock.  The references are dropped afterwards.
  */
-void delta_nr_active_pages(struct page *page, long delta)
+void __pagevec_lru_add(struct pagevec *pvec)
 {
-	pg_data_t *pgdat;
-	zone_t *classzone, *overflow;
+	zone_t *zone = NULL;
+	unsigned int i;
 
-	classzone = page_zone(page);
-	pgdat = classzone->zone_pgdat;
-	overflow = pgdat->node_zones + pgdat->nr_zones;
+	for (i = 0; i < pagevec_count(pvec); i++) {
+		struct page *page = pvec->pages[i];
+		zone_t *pagezone = page_zone(page);
 
-	while (classzone < overflow) {
-		classzone->nr_active_pages += delta;
-		classzone++;
+		if (pagezone != zone) {
+			if (zone)
+				spin_unlock(&zone->lru_lock);
+			zone = pagezone;
+			spin_lock(&zone->lru_lock);
+		}
+		if (!TestSetPageLRU(page))
+			add_page_to_inactive_list(page);
 	}
-	nr_active_pages += delta;
+	if (zone)
+		spin_unlock(&zone->lru_lock);
+	__pagevec_release(pvec);
 }
 
 /**
- * delta_nr_inactive_pages: alter the number of inactive pages.
+ * __pagevec_activate: move a batch of pages to the active lists
+ * @pvec: the pages, with a reference held on each
  *
- * @page: the page which is being deactivated/activated
- * @delta: +1 for deactivation, -1 for activation
- *
- * Called under pagecache_lock
+ * As __pagevec_lru_add(), for pages which have been referenced again.
  */
-void delta_nr_inactive_pages(struct page *page, long delta)
+void __pagevec_activate(struct pagevec *pvec)
 {
-	pg_data_t *pgdat;
-	zone_t *classzone, *overflow;
+	zone_t *zone = NULL;
+	unsigned int i;
 
-	classzone = page_zone(page);
-	pgdat = classzone->zone_pgdat;
-	overflow = pgdat->node_zones + pgdat->nr_zones;
+	for (i = 0; i < pagevec_count(pvec); i++) {
+		struct page *page = pvec->pages[i];
+		zone_t *pagezone = page_zone(page);
 
-	while (classzone < overflow) {
-		classzone->nr_inactive_pages += delta;
-		classzone++;
+		if (pagezone != zone) {
+			if (zone)
+				spin_unlock(&zone->lru_lock);
+			zone = pagezone;
+			spin_lock(&zone->lru_lock);
+		}
+		activate_page_nolock(page);
+	}
+	if (zone)
+		spin_unlock(&zone->lru_lock);
+	__pagevec_release(pvec);
+}
+
+/**
+ * __lru_cache_del: remove a page from the page lists
+ * @page: the page to add
+ *
+ * This function is for when the caller already holds
+ * the lru_lock of the page's zone.
+ */
+void fastcall __lru_cache_del(struct page * page)
+{
+	if (TestClearPageLRU(page)) {
+		if (PageActive(page)) {
+			del_page_from_active_list(page);
+		} else {
+			del_page_from_inactive_list(page);
+		}
 	}
-	nr_inactive_pages += delta;
+}
+
+/**
+ * lru_cache_del: remove a page from the page lists
+ * @page: the page to remove
+ */
+void fastcall lru_cache_del(struct page * page)
+{
+	zone_t *zone = page_zone(page);
+
+	spin_lock(&zone->lru_lock);
+	__lru_cache_del(page);
+	spin_unlock(&zone->lru_lock);
 }
 
 /**
@@ -148,8 +225,11 @@ void delta_nr_inactive_pages(struct page *page, long delta)
  * @page: the page which is being added/removed
  * @delta: +1 for addition, -1 for removal
  *
- * Called under pagecache_lock
+ * Called under the page_lock of the page's mapping, which does not
+ * serialize against other mappings, hence nr_cache_lock.
  */
+static spinlock_t nr_cache_lock = SPIN_LOCK_UNLOCKED;
+
 void delta_nr_cache_pages(struct page *page, long delta)
 {
 	pg_data_t *pgdat;
@@ -159,11 +239,13 @@ void delta_nr_cache_pages(struct page *page, long delta)
 	pgdat = classzone->zone_pgdat;
 	overflow = pgdat->node_zones + pgdat->nr_zones;
 
+	spin_lock(&nr_cache_lock);
 	while (classzone < overflow) {
 		classzone->nr_cache_pages += delta;
 		classzone++;
 	}
 	page_cache_size += delta;
+	spin_unlock(&nr_cache_lock);
 }
 
 /*
@@ -37,11 +37,12 @@ static struct address_space_operations swap_aops = {
 };
 
 struct address_space swapper_space = {
-	LIST_HEAD_INIT(swapper_space.clean_pages),
-	LIST_HEAD_INIT(swapper_space.dirty_pages),
-	LIST_HEAD_INIT(swapper_space.locked_pages),
-	0,				/* nrpages	*/
-	&swap_aops,
+	page_tree:	RADIX_TREE_INIT(GFP_ATOMIC),
+	page_lock:	SPIN_LOCK_UNLOCKED,
+	clean_pages:	LIST_HEAD_INIT(swapper_space.clean_pages),
+	dirty_pages:	LIST_HEAD_INIT(swapper_space.dirty_pages),
+	locked_pages:	LIST_HEAD_INIT(swapper_space.locked_pages),
+	a_ops:		&swap_aops,
 };
 
 #ifdef SWAP_CACHE_INFO
@@ -69,17 +70,20 @@ void show_swap_cache_info(void)
 
 int add_to_swap_cache(struct page *page, swp_entry_t entry)
 {
+	int error;
+
 	if (page->mapping)
 		BUG();
 	if (!swap_duplicate(entry)) {
 		INC_CACHE_INFO(noent_race);
 		return -ENOENT;
 	}
-	if (add_to_page_cache_unique(page, &swapper_space, entry.val,
-			page_hash(&swapper_space, entry.val)) != 0) {
+	error = add_to_page_cache_unique(page, &swapper_space, entry.val);
+	if (error) {
 		swap_free(entry);
-		INC_CACHE_INFO(exist_race);
-		return -EEXIST;
+		if (error == -EEXIST)
+			INC_CACHE_INFO(exist_race);
+		return error;
 	}
 	if (!PageLocked(page))
 		BUG();
@@ -89,6 +93,68 @@ int add_to_swap_cache(struct page *page, swp_entry_t entry)
 	return 0;
 }
 
+/*
+ * Move a locked page from the page cache straight into the swap cache.
+ * If that fails it is left in the page cache, and the error returned.
+ */
+int move_to_swap_cache(struct page *page, swp_entry_t entry)
+{
+	int error;
+
+	if (!swap_duplicate(entry)) {
+		INC_CACHE_INFO(noent_race);
+		return -ENOENT;
+	}
+	error = move_page_cache(page, &swapper_space, entry.val);
+	if (error) {
+		swap_free(entry);
+		if (error == -EEXIST)
+			INC_CACHE_INFO(exist_race);
+		return error;
+	}
+	INC_CACHE_INFO(add_total);
+	return 0;
+}
+
+/*
+ * Give an anonymous page a swap slot and put it in the swap cache,
+ * dirty, so that try_to_unmap() can replace its ptes with swap
+ * entries.  The page must be locked.  Returns 0 if swap is full.
+ */
+int add_to_swap(struct page *page)
+{
+	swp_entry_t entry;
+	int error;
+
+	if (!PageLocked(page))
+		BUG();
+
+	for (;;) {
+		entry = get_swap_page();
+		if (!entry.val)
+			return 0;
+		radix_tree_preload(GFP_NOIO);
+		error = add_to_swap_cache(page, entry);
+		/*
+		 * The swap cache takes its own reference on the entry,
+		 * and try_to_unmap() one per pte, so ours goes either way.
+		 */
+		swap_free(entry);
+		if (!error) {
+			/*
+			 * Adding to the page cache clears the dirty and
+			 * uptodate bits, so we need to set them again.
+			 */
+			SetPageUptodate(page);
+			set_page_dirty(page);
+			return 1;
+		}
+		/* -EEXIST: raced with "speculative" read_swap_cache_async */
+		if (error != -EEXIST)
+			return 0;
+	}
+}
+
 /*
  * This must be called only on pages that have
  * been verified to be in the swap cache.
@@ -122,9 +188,9 @@ void delete_from_swap_cache(struct page *page)
 
 	entry.val = page->index;
 
-	spin_lock(&pagecache_lock);
+	spin_lock(&swapper_space.page_lock);
 	__delete_from_swap_cache(page);
-	spin_unlock(&pagecache_lock);
+	spin_unlock(&swapper_space.page_lock);
 
 	swap_free(entry);
 	page_cache_release(page);
@@ -212,9 +278,12 @@ struct page * read_swap_cache_async(swp_entry_t entry)
 		 * our caller observed it.  May fail (-EEXIST) if there
 		 * is already a page associated with this entry in the
 		 * swap cache: added by a racing read_swap_cache_async,
-		 * or by try_to_swap_out (or shmem_writepage) re-using
+		 * or by shrink_cache (or shmem_writepage) re-using
 		 * the just freed swap entry for an existing page.
+		 * May fail (-ENOMEM) if the swap cache radix tree needs
+		 * a node and none was left after the preload.
 		 */
+		radix_tree_preload(GFP_KERNEL);
 		err = add_to_swap_cache(new_page, entry);
 		if (!err) {
 			/*
@@ -223,7 +292,7 @@ struct page * read_swap_cache_async(swp_entry_t entry)
 			rw_swap_page(READ, new_page);
 			return new_page;
 		}
-	} while (err != -ENOENT);
+	} while (err == -EEXIST);
 
 	if (new_page)
 		page_cache_release(new_page);
@@ -14,6 +14,7 @@
 #include <linux/vmalloc.h>
 #include <linux/pagemap.h>
 #include <linux/shm.h>
+#include <linux/rmap.h>
 
 #include <asm/pgtable.h>
 
@@ -237,11 +238,11 @@ static int exclusive_swap_page(struct page *page)
 	if (p) {
 		/* Is the only swap cache user the cache itself? */
 		if (p->swap_map[SWP_OFFSET(entry)] == 1) {
-			/* Recheck the page count with the pagecache lock held.. */
-			spin_lock(&pagecache_lock);
+			/* Recheck the page count with the swap cache lock held.. */
+			spin_lock(&swapper_space.page_lock);
 			if (page_count(page) - !!page->buffers == 2)
 				retval = 1;
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&swapper_space.page_lock);
 		}
 		swap_info_put(p);
 	}
@@ -305,14 +306,14 @@ int fastcall remove_exclusive_swap_page(struct page *page)
 	/* Is the only swap cache user the cache itself? */
 	retval = 0;
 	if (p->swap_map[SWP_OFFSET(entry)] == 1) {
-		/* Recheck the page count with the pagecache lock held.. */
-		spin_lock(&pagecache_lock);
+		/* Recheck the page count with the swap cache lock held.. */
+		spin_lock(&swapper_space.page_lock);
 		if (page_count(page) - !!page->buffers == 2) {
 			__delete_from_swap_cache(page);
 			SetPageDirty(page);
 			retval = 1;
 		}
-		spin_unlock(&pagecache_lock);
+		spin_unlock(&swapper_space.page_lock);
 	}
 	swap_info_put(p);
 
@@ -363,7 +364,8 @@ void free_swap_and_cache(swp_entry_t entry)
  */
 /* mmlist_lock and vma->vm_mm->page_table_lock are held */
 static inline void unuse_pte(struct vm_area_struct * vma, unsigned long address,
-	pte_t *dir, swp_entry_t entry, struct page* page)
+	pte_t *dir, swp_entry_t entry, struct page* page,
+	struct pte_chain ** pte_chainp)
 {
 	pte_t pte = *dir;
 
@@ -373,6 +375,7 @@ static inline void unuse_pte(struct vm_area_struct * vma, unsigned long address,
 		return;
 	get_page(page);
 	set_pte(dir, pte_mkold(mk_pte(page, vma->vm_page_prot)));
+	*pte_chainp = page_add_rmap(page, dir, *pte_chainp);
 	swap_free(entry);
 	++vma->vm_mm->rss;
 }
@@ -380,7 +383,7 @@ static inline void unuse_pte(struct vm_area_struct * vma, unsigned long address,
 /* mmlist_lock and vma->vm_mm->page_table_lock are held */
 static inline void unuse_pmd(struct vm_area_struct * vma, pmd_t *dir,
 	unsigned long address, unsigned long size, unsigned long offset,
-	swp_entry_t entry, struct page* page)
+	swp_entry_t entry, struct page* page, struct pte_chain ** pte_chainp)
 {
 	pte_t * pte;
 	unsigned long end;
@@ -399,7 +402,10 @@ static inline void unuse_pmd(struct vm_area_struct * vma, pmd_t *dir,
 	if (end > PMD_SIZE)
 		end = PMD_SIZE;
 	do {
-		unuse_pte(vma, offset+address-vma->vm_start, pte, entry, page);
+		unuse_pte(vma, offset+address-vma->vm_start, pte, entry, page,
+			  pte_chainp);
+		if (!*pte_chainp)
+			return;
 		address += PAGE_SIZE;
 		pte++;
 	} while (address && (address < end));
@@ -408,7 +414,7 @@ static inline void unuse_pmd(struct vm_area_struct * vma, pmd_t *dir,
 /* mmlist_lock and vma->vm_mm->page_table_lock are held */
 static inline void unuse_pgd(struct vm_area_struct * vma, pgd_t *dir,
 	unsigned long address, unsigned long size,
-	swp_entry_t entry, struct page* page)
+	swp_entry_t entry, struct page* page, struct pte_chain ** pte_chainp)
 {
 	pmd_t * pmd;
 	unsigned long offset, end;
@@ -430,7 +436,9 @@ static inline void unuse_pgd(struct vm_area_struct * vma, pgd_t *dir,
 		BUG();
 	do {
 		unuse_pmd(vma, pmd, address, end - address, offset, entry,
-			  page);
+			  page, pte_chainp);
+		if (!*pte_chainp)
+			return;
 		address = (address + PMD_SIZE) & PMD_MASK;
 		pmd++;
 	} while (address && (address < end));
@@ -438,14 +446,18 @@ static inline void unuse_pgd(struct vm_area_struct * vma, pgd_t *dir,
 
 /* mmlist_lock and vma->vm_mm->page_table_lock are held */
 static void unuse_vma(struct vm_area_struct * vma, pgd_t *pgdir,
-			swp_entry_t entry, struct page* page)
+			swp_entry_t entry, struct page* page,
+			struct pte_chain ** pte_chainp)
 {
 	unsigned long start = vma->vm_start, end = vma->vm_end;
 
 	if (start >= end)
 		BUG();
 	do {
-		unuse_pgd(vma, pgdir, start, end - start, entry, page);
+		unuse_pgd(vma, pgdir, start, end - start, entry, page,
+			  pte_chainp);
+		if (!*pte_chainp)
+			return;
 		start = (start + PGDIR_SIZE) & PGDIR_MASK;
 		pgdir++;
 	} while (start && (start < end));
@@ -455,16 +467,31 @@ static void unuse_process(struct mm_struct * mm,
 			swp_entry_t entry, struct page* page)
 {
 	struct vm_area_struct* vma;
+	struct pte_chain *pte_chain;
+
+	/*
+	 * We may be under mmlist_lock, so we can't wait for memory.
+	 * Should this fail the entry stays in use, and try_to_unuse()
+	 * comes back to it on its next pass.
+	 */
+	pte_chain = pte_chain_alloc(GFP_ATOMIC);
+	if (!pte_chain)
+		return;
 
 	/*
-	 * Go through process' page directory.
+	 * Go through process' page directory.  A swap entry is mapped
+	 * at most once in an mm, so we can stop as soon as the
+	 * pte_chain has been used.
 	 */
 	spin_lock(&mm->page_table_lock);
 	for (vma = mm->mmap; vma; vma = vma->vm_next) {
 		pgd_t * pgd = pgd_offset(mm, vma->vm_start);
-		unuse_vma(vma, pgd, entry, page);
+		unuse_vma(vma, pgd, entry, page, &pte_chain);
+		if (!pte_chain)
+			break;
 	}
 	spin_unlock(&mm->page_table_lock);
+	pte_chain_free(pte_chain);
 	return;
 }
 
@@ -531,7 +558,7 @@ static int try_to_unuse(unsigned int type)
 	 *
 	 * A simpler strategy would be to start at the last mm we
 	 * freed the previous entry from; but that would take less
-	 * advantage of mmlist ordering (now preserved by swap_out()),
+	 * advantage of mmlist ordering,
 	 * which clusters forked address spaces together, most recent
 	 * child immediately after parent.  If we race with dup_mmap(),
 	 * we very much want to resolve parent before child, otherwise
@@ -663,7 +690,7 @@ static int try_to_unuse(unsigned int type)
 
 		/*
 		 * If a reference remains (rare), we would like to leave
-		 * the page in the swap cache; but try_to_swap_out could
+		 * the page in the swap cache; but try_to_unmap could
 		 * then re-duplicate the entry once we drop page lock,
 		 * so we might loop indefinitely; also, that page could
 		 * not be swapped out to other storage meanwhile.  So:
@@ -694,7 +721,7 @@ static int try_to_unuse(unsigned int type)
 		/*
 		 * So we could skip searching mms once swap count went
 		 * to 1, we did not mark any present ptes as dirty: must
-		 * mark page dirty so try_to_swap_out will preserve it.
+		 * mark page dirty so shrink_cache will preserve it.
 		 */
 		SetPageDirty(page);
 		UnlockPage(page);
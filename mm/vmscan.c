@@ -23,6 +23,7 @@
 #include <linux/init.h>
 #include <linux/highmem.h>
 #include <linux/file.h>
+#include <linux/rmap.h>
 
 #include <asm/pgalloc.h>
 
@@ -64,343 +65,28 @@ int vm_lru_balance_ratio = 2;
  */
 int vm_vfs_scan_ratio = 6;
 
-/*
- * "vm_anon_lru" select if to immdiatly insert anon pages in the
- * lru. Immediatly means as soon as they're allocated during the
- * page faults.
- *
- * If this is set to 0, they're inserted only after the first
- * swapout.
- *
- * Having anon pages immediatly inserted in the lru allows the
- * VM to know better when it's worthwhile to start swapping
- * anonymous ram, it will start to swap earlier and it should
- * swap smoother and faster, but it will decrease scalability
- * on the >16-ways of an order of magnitude. Big SMP/NUMA
- * definitely can't take an hit on a global spinlock at
- * every anon page allocation. So this is off by default.
- *
- * Low ram machines that swaps all the time want to turn
- * this on (i.e. set to 1).
- */
-int vm_anon_lru = 0;
-
-/*
- * The swap-out function returns 1 if it successfully
- * scanned all the pages it was asked to (`count').
- * It returns zero if it couldn't do anything,
- *
- * rss may decrease because pages are shared, but this
- * doesn't count as having freed a page.
- */
-
-/* mm->page_table_lock is held. mmap_sem is not held */
-static inline int try_to_swap_out(struct mm_struct * mm, struct vm_area_struct* vma, unsigned long address, pte_t * page_table, struct page *page, zone_t * classzone)
-{
-	pte_t pte;
-	swp_entry_t entry;
-
-	/* Don't look at this pte if it's been accessed recently. */
-	if ((vma->vm_flags & VM_LOCKED) || ptep_test_and_clear_young(page_table)) {
-		mark_page_accessed(page);
-		return 0;
-	}
-
-	/* Don't bother unmapping pages that are active */
-	if (PageActive(page))
-		return 0;
-
-	/* Don't bother replenishing zones not under pressure.. */
-	if (!memclass(page_zone(page), classzone))
-		return 0;
-
-	if (TryLockPage(page))
-		return 0;
-
-	/* From this point on, the odds are that we're going to
-	 * nuke this pte, so read and clear the pte.  This hook
-	 * is needed on CPUs which update the accessed and dirty
-	 * bits in hardware.
-	 */
-	flush_cache_page(vma, address);
-	pte = ptep_get_and_clear(page_table);
-	flush_tlb_page(vma, address);
-
-	if (pte_dirty(pte))
-		set_page_dirty(page);
-
-	/*
-	 * Is the page already in the swap cache? If so, then
-	 * we can just drop our reference to it without doing
-	 * any IO - it's already up-to-date on disk.
-	 */
-	if (PageSwapCache(page)) {
-		entry.val = page->index;
-		swap_duplicate(entry);
-set_swap_pte:
-		set_pte(page_table, swp_entry_to_pte(entry));
-drop_pte:
-		mm->rss--;
-		UnlockPage(page);
-		{
-			int freeable = page_count(page) - !!page->buffers <= 2;
-			page_cache_release(page);
-			return freeable;
-		}
-	}
-
-	/*
-	 * Is it a clean page? Then it must be recoverable
-	 * by just paging it in again, and we can just drop
-	 * it..  or if it's dirty but has backing store,
-	 * just mark the page dirty and drop it.
-	 *
-	 * However, this won't actually free any real
-	 * memory, as the page will just be in the page cache
-	 * somewhere, and as such we should just continue
-	 * our scan.
-	 *
-	 * Basically, this just makes it possible for us to do
-	 * some real work in the future in "refill_inactive()".
-	 */
-	if (page->mapping)
-		goto drop_pte;
-	if (!PageDirty(page))
-		goto drop_pte;
-
-	/*
-	 * Anonymous buffercache pages can be left behind by
-	 * concurrent truncate and pagefault.
-	 */
-	if (page->buffers)
-		goto preserve;
-
-	/*
-	 * This is a dirty, swappable page.  First of all,
-	 * get a suitable swap entry for it, and make sure
-	 * we have the swap cache set up to associate the
-	 * page with that swap entry.
-	 */
-	for (;;) {
-		entry = get_swap_page();
-		if (!entry.val)
-			break;
-		/* Add it to the swap cache and mark it dirty
-		 * (adding to the page cache will clear the dirty
-		 * and uptodate bits, so we need to do it again)
-		 */
-		if (add_to_swap_cache(page, entry) == 0) {
-			SetPageUptodate(page);
-			set_page_dirty(page);
-			goto set_swap_pte;
-		}
-		/* Raced with "speculative" read_swap_cache_async */
-		swap_free(entry);
-	}
-
-	/* No swap space left */
-preserve:
-	set_pte(page_table, pte);
-	UnlockPage(page);
-	return 0;
-}
-
-/* mm->page_table_lock is held. mmap_sem is not held */
-static inline int swap_out_pmd(struct mm_struct * mm, struct vm_area_struct * vma, pmd_t *dir, unsigned long address, unsigned long end, int count, zone_t * classzone)
-{
-	pte_t * pte;
-	unsigned long pmd_end;
-
-	if (pmd_none(*dir))
-		return count;
-	if (pmd_bad(*dir)) {
-		pmd_ERROR(*dir);
-		pmd_clear(dir);
-		return count;
-	}
-	
-	pte = pte_offset(dir, address);
-	
-	pmd_end = (address + PMD_SIZE) & PMD_MASK;
-	if (end > pmd_end)
-		end = pmd_end;
-
-	do {
-		if (pte_present(*pte)) {
-			struct page *page = pte_page(*pte);
-
-			if (VALID_PAGE(page) && !PageReserved(page)) {
-				count -= try_to_swap_out(mm, vma, address, pte, page, classzone);
-				if (!count) {
-					address += PAGE_SIZE;
-					break;
-				}
-			}
-		}
-		address += PAGE_SIZE;
-		pte++;
-	} while (address && (address < end));
-	mm->swap_address = address;
-	return count;
-}
-
-/* mm->page_table_lock is held. mmap_sem is not held */
-static inline int swap_out_pgd(struct mm_struct * mm, struct vm_area_struct * vma, pgd_t *dir, unsigned long address, unsigned long end, int count, zone_t * classzone)
-{
-	pmd_t * pmd;
-	unsigned long pgd_end;
-
-	if (pgd_none(*dir))
-		return count;
-	if (pgd_bad(*dir)) {
-		pgd_ERROR(*dir);
-		pgd_clear(dir);
-		return count;
-	}
-
-	pmd = pmd_offset(dir, address);
-
-	pgd_end = (address + PGDIR_SIZE) & PGDIR_MASK;	
-	if (pgd_end && (end > pgd_end))
-		end = pgd_end;
-	
-	do {
-		count = swap_out_pmd(mm, vma, pmd, address, end, count, classzone);
-		if (!count)
-			break;
-		address = (address + PMD_SIZE) & PMD_MASK;
-		pmd++;
-	} while (address && (address < end));
-	return count;
-}
-
-/* mm->page_table_lock is held. mmap_sem is not held */
-static inline int swap_out_vma(struct mm_struct * mm, struct vm_area_struct * vma, unsigned long address, int count, zone_t * classzone)
-{
-	pgd_t *pgdir;
-	unsigned long end;
-
-	/* Don't swap out areas which are reserved */
-	if (vma->vm_flags & VM_RESERVED)
-		return count;
-
-	pgdir = pgd_offset(mm, address);
-
-	end = vma->vm_end;
-	BUG_ON(address >= end);
-	do {
-		count = swap_out_pgd(mm, vma, pgdir, address, end, count, classzone);
-		if (!count)
-			break;
-		address = (address + PGDIR_SIZE) & PGDIR_MASK;
-		pgdir++;
-	} while (address && (address < end));
-	return count;
-}
-
-/* Placeholder for swap_out(): may be updated by fork.c:mmput() */
-struct mm_struct *swap_mm = &init_mm;
+static void FASTCALL(refill_inactive(int nr_pages, zone_t * zone));
+static int FASTCALL(shrink_cache(int nr_pages, zone_t * zone, unsigned int gfp_mask));
 
 /*
- * Returns remaining count of pages to be swapped out by followup call.
+ * Scan the inactive list of one zone.  Called with zone->lru_lock
+ * held, returns with it released.
  */
-static inline int swap_out_mm(struct mm_struct * mm, int count, int * mmcounter, zone_t * classzone)
-{
-	unsigned long address;
-	struct vm_area_struct* vma;
-
-	/*
-	 * Find the proper vm-area after freezing the vma chain 
-	 * and ptes.
-	 */
-	spin_lock(&mm->page_table_lock);
-	address = mm->swap_address;
-	if (address == TASK_SIZE || swap_mm != mm) {
-		/* We raced: don't count this mm but try again */
-		++*mmcounter;
-		goto out_unlock;
-	}
-	vma = find_vma(mm, address);
-	if (vma) {
-		if (address < vma->vm_start)
-			address = vma->vm_start;
-
-		for (;;) {
-			count = swap_out_vma(mm, vma, address, count, classzone);
-			vma = vma->vm_next;
-			if (!vma)
-				break;
-			if (!count)
-				goto out_unlock;
-			address = vma->vm_start;
-		}
-	}
-	/* Indicate that we reached the end of address space */
-	mm->swap_address = TASK_SIZE;
-
-out_unlock:
-	spin_unlock(&mm->page_table_lock);
-	return count;
-}
-
-static int FASTCALL(swap_out(zone_t * classzone));
-static int fastcall swap_out(zone_t * classzone)
-{
-	int counter, nr_pages = SWAP_CLUSTER_MAX;
-	struct mm_struct *mm;
-
-	counter = mmlist_nr << 1;
-	do {
-		if (unlikely(current->need_resched)) {
-			__set_current_state(TASK_RUNNING);
-			schedule();
-		}
-
-		spin_lock(&mmlist_lock);
-		mm = swap_mm;
-		while (mm->swap_address == TASK_SIZE || mm == &init_mm) {
-			mm->swap_address = 0;
-			mm = list_entry(mm->mmlist.next, struct mm_struct, mmlist);
-			if (mm == swap_mm)
-				goto empty;
-			swap_mm = mm;
-		}
-
-		/* Make sure the mm doesn't disappear when we drop the lock.. */
-		atomic_inc(&mm->mm_users);
-		spin_unlock(&mmlist_lock);
-
-		nr_pages = swap_out_mm(mm, nr_pages, &counter, classzone);
-
-		mmput(mm);
-
-		if (!nr_pages)
-			return 1;
-	} while (--counter >= 0);
-
-	return 0;
-
-empty:
-	spin_unlock(&mmlist_lock);
-	return 0;
-}
-
-static void FASTCALL(refill_inactive(int nr_pages, zone_t * classzone));
-static int FASTCALL(shrink_cache(int nr_pages, zone_t * classzone, unsigned int gfp_mask, int * failed_swapout));
-static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int gfp_mask, int * failed_swapout)
+static int fastcall shrink_cache(int nr_pages, zone_t * zone, unsigned int gfp_mask)
 {
 	struct list_head * entry;
-	int max_scan = (classzone->nr_inactive_pages + classzone->nr_active_pages) / vm_cache_scan_ratio;
+	int max_scan = (zone->nr_inactive_pages + zone->nr_active_pages) / vm_cache_scan_ratio;
 	int max_mapped = vm_mapped_ratio * nr_pages;
 
-	while (max_scan && classzone->nr_inactive_pages && (entry = inactive_list.prev) != &inactive_list) {
+	while (max_scan && zone->nr_inactive_pages && (entry = zone->inactive_list.prev) != &zone->inactive_list) {
+		struct address_space * mapping;
 		struct page * page;
 
 		if (unlikely(current->need_resched)) {
-			spin_unlock(&pagemap_lru_lock);
+			spin_unlock(&zone->lru_lock);
 			__set_current_state(TASK_RUNNING);
 			schedule();
-			spin_lock(&pagemap_lru_lock);
+			spin_lock(&zone->lru_lock);
 			continue;
 		}
 
@@ -410,7 +96,7 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 		BUG_ON(PageActive(page));
 
 		list_del(entry);
-		list_add(entry, &inactive_list);
+		list_add(entry, &zone->inactive_list);
 
 		/*
 		 * Zero page counts can happen because we unlink the pages
@@ -419,14 +105,13 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 		if (unlikely(!page_count(page)))
 			continue;
 
-		if (!memclass(page_zone(page), classzone))
-			continue;
-
 		max_scan--;
+		kstat.pgscan++;
 
 		/* Racy check to avoid trylocking when not worthwhile */
-		if (!page->buffers && (page_count(page) != 1 || !page->mapping))
-			goto page_mapped;
+		if (!page->buffers && !page_mapped(page) &&
+		    (page_count(page) != 1 || !page->mapping))
+			goto page_busy;
 
 		/*
 		 * The page is locked. IO in progress?
@@ -435,14 +120,55 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 		if (unlikely(TryLockPage(page))) {
 			if (PageLaunder(page) && (gfp_mask & __GFP_FS)) {
 				page_cache_get(page);
-				spin_unlock(&pagemap_lru_lock);
+				spin_unlock(&zone->lru_lock);
 				wait_on_page(page);
 				page_cache_release(page);
-				spin_lock(&pagemap_lru_lock);
+				spin_lock(&zone->lru_lock);
 			}
 			continue;
 		}
 
+		/*
+		 * Unmap the page from all the ptes which map it, found
+		 * through the reverse map, unless one of them says it has
+		 * been used lately.  An anonymous page gets a swap slot
+		 * first, so that the code below sees a dirty swap cache
+		 * page and writes it out.
+		 */
+		if (page_mapped(page)) {
+			int ret;
+
+			if (page_referenced(page))
+				goto activate_locked;
+			if (!page->mapping &&
+			    (page->buffers || !(gfp_mask & __GFP_IO)))
+				goto keep_locked;
+
+			/*
+			 * Unmapping dirties the page, which takes the
+			 * mapping's and the inode's locks: drop ours.
+			 */
+			page_cache_get(page);
+			spin_unlock(&zone->lru_lock);
+
+			if (!page->mapping && !add_to_swap(page))
+				ret = SWAP_FAIL;	/* swap is full */
+			else
+				ret = try_to_unmap(page);
+			if (ret != SWAP_SUCCESS) {
+				if (ret == SWAP_FAIL)
+					activate_page(page);
+				UnlockPage(page);
+				page_cache_release(page);
+				spin_lock(&zone->lru_lock);
+				continue;
+			}
+
+			/* The page is still in the (swap) page cache */
+			page_cache_release(page);
+			spin_lock(&zone->lru_lock);
+		}
+
 		if (PageDirty(page) && is_page_cache_freeable(page) && page->mapping) {
 			/*
 			 * It is not critical here to write it only if
@@ -459,12 +185,12 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 				ClearPageDirty(page);
 				SetPageLaunder(page);
 				page_cache_get(page);
-				spin_unlock(&pagemap_lru_lock);
+				spin_unlock(&zone->lru_lock);
 
 				writepage(page);
 				page_cache_release(page);
 
-				spin_lock(&pagemap_lru_lock);
+				spin_lock(&zone->lru_lock);
 				continue;
 			}
 		}
@@ -475,7 +201,7 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 		 * the page as well.
 		 */
 		if (page->buffers) {
-			spin_unlock(&pagemap_lru_lock);
+			spin_unlock(&zone->lru_lock);
 
 			/* avoid to free a locked page */
 			page_cache_get(page);
@@ -488,13 +214,14 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 					 * the LRU, so we unlock the page after
 					 * taking the lru lock
 					 */
-					spin_lock(&pagemap_lru_lock);
+					spin_lock(&zone->lru_lock);
 					UnlockPage(page);
 					__lru_cache_del(page);
 
 					/* effectively free the page here */
 					page_cache_release(page);
 
+					kstat.pgsteal++;
 					if (--nr_pages)
 						continue;
 					break;
@@ -506,19 +233,28 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 					 */
 					page_cache_release(page);
 
-					spin_lock(&pagemap_lru_lock);
+					spin_lock(&zone->lru_lock);
 				}
 			} else {
 				/* failed to drop the buffers so stop here */
 				UnlockPage(page);
 				page_cache_release(page);
 
-				spin_lock(&pagemap_lru_lock);
+				spin_lock(&zone->lru_lock);
 				continue;
 			}
 		}
 
-		spin_lock(&pagecache_lock);
+		/*
+		 * page->mapping cannot change while we hold the page
+		 * lock, so it tells us which page_lock to take.
+		 */
+		mapping = page->mapping;
+		if (!mapping) {
+			UnlockPage(page);
+			goto page_busy;
+		}
+		spin_lock(&mapping->page_lock);
 
 		/*
 		 * This is the non-racy check for busy page.
@@ -528,12 +264,12 @@ static int fastcall shrink_cache(int nr_pages, zone_t * classzone, unsigned int
 		 * nobody can refill page->buffers under us because we still
 		 * hold the page lock.
 		 */
-		if (!page->mapping || page_count(page) > 1) {
-			spin_unlock(&pagecache_lock);
+		if (page_count(page) > 1) {
+			spin_unlock(&mapping->page_lock);
 			UnlockPage(page);
-page_mapped:
+page_busy:
 			if (--max_mapped < 0) {
-				spin_unlock(&pagemap_lru_lock);
+				spin_unlock(&zone->lru_lock);
 
 				nr_pages -= kmem_cache_reap(gfp_mask);
 				if (nr_pages <= 0)
@@ -545,19 +281,16 @@ page_mapped:
 				shrink_dqcache_memory(vm_vfs_scan_ratio, gfp_mask);
 #endif
 
-				if (!*failed_swapout)
-					*failed_swapout = !swap_out(classzone);
-
 				max_mapped = nr_pages * vm_mapped_ratio;
 
-				spin_lock(&pagemap_lru_lock);
-				refill_inactive(nr_pages, classzone);
+				spin_lock(&zone->lru_lock);
+				refill_inactive(nr_pages, zone);
 			}
 			continue;
 			
 		}
 		if (PageDirty(page)) {
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			UnlockPage(page);
 			continue;
 		}
@@ -567,25 +300,34 @@ page_mapped:
 		/* point of no return */
 		if (likely(!PageSwapCache(page))) {
 			__remove_inode_page(page);
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 		} else {
 			swp_entry_t swap;
 			swap.val = page->index;
 			__delete_from_swap_cache(page);
-			spin_unlock(&pagecache_lock);
+			spin_unlock(&mapping->page_lock);
 			swap_free(swap);
 		}
 
 		UnlockPage(page);
 
-		/* effectively free the page here */
-		page_cache_release(page);
+		/* effectively free the page here: long unused, so cold */
+		free_cold_page(page);
 
+		kstat.pgsteal++;
 		if (--nr_pages)
 			continue;
 		break;
+
+activate_locked:
+		if (PageLRU(page) && !PageActive(page)) {
+			del_page_from_inactive_list(page);
+			add_page_to_active_list(page);
+		}
+keep_locked:
+		UnlockPage(page);
 	}
-	spin_unlock(&pagemap_lru_lock);
+	spin_unlock(&zone->lru_lock);
 
  out:
 	return nr_pages;
@@ -593,27 +335,30 @@ page_mapped:
 
 /*
  * This moves pages from the active list to
- * the inactive list.
+ * the inactive list of a zone.
  *
  * We move them the other way when we see the
  * reference bit on the page.
+ *
+ * Called with zone->lru_lock held.
  */
-static void fastcall refill_inactive(int nr_pages, zone_t * classzone)
+static void fastcall refill_inactive(int nr_pages, zone_t * zone)
 {
 	struct list_head * entry;
 	unsigned long ratio;
 
-	ratio = (unsigned long) nr_pages * classzone->nr_active_pages / (((unsigned long) classzone->nr_inactive_pages * vm_lru_balance_ratio) + 1);
+	ratio = (unsigned long) nr_pages * zone->nr_active_pages / (((unsigned long) zone->nr_inactive_pages * vm_lru_balance_ratio) + 1);
 
-	entry = active_list.prev;
-	while (ratio && entry != &active_list) {
+	entry = zone->active_list.prev;
+	while (ratio && entry != &zone->active_list) {
 		struct page * page;
 
 		page = list_entry(entry, struct page, lru);
 		entry = entry->prev;
-		if (PageTestandClearReferenced(page)) {
+		if (PageTestandClearReferenced(page) ||
+		    (page_mapped(page) && page_referenced(page))) {
 			list_del(&page->lru);
-			list_add(&page->lru, &active_list);
+			list_add(&page->lru, &zone->active_list);
 			continue;
 		}
 
@@ -624,23 +369,40 @@ static void fastcall refill_inactive(int nr_pages, zone_t * classzone)
 		SetPageReferenced(page);
 	}
 
-	if (entry != &active_list) {
-		list_del(&active_list);
-		list_add(&active_list, entry);
+	if (entry != &zone->active_list) {
+		list_del(&zone->active_list);
+		list_add(&zone->active_list, entry);
 	}
 }
 
-static int FASTCALL(shrink_caches(zone_t * classzone, unsigned int gfp_mask, int nr_pages, int * failed_swapout));
-static int fastcall shrink_caches(zone_t * classzone, unsigned int gfp_mask, int nr_pages, int * failed_swapout)
+static int FASTCALL(shrink_caches(zone_t * classzone, unsigned int gfp_mask, int nr_pages));
+static int fastcall shrink_caches(zone_t * classzone, unsigned int gfp_mask, int nr_pages)
 {
+	zone_t * first_zone = classzone->zone_pgdat->node_zones;
+	zone_t * zone;
+
 	nr_pages -= kmem_cache_reap(gfp_mask);
 	if (nr_pages <= 0)
 		goto out;
 
-	spin_lock(&pagemap_lru_lock);
-	refill_inactive(nr_pages, classzone);
+	lru_add_drain();
 
-	nr_pages = shrink_cache(nr_pages, classzone, gfp_mask, failed_swapout);
+	/*
+	 * Every zone has its own LRU.  Any zone up to the classzone can
+	 * satisfy the allocation, so work from the classzone down, each
+	 * zone aged against its own lists.
+	 */
+	for (zone = classzone; zone >= first_zone; zone--) {
+		if (!zone->size)
+			continue;
+
+		spin_lock(&zone->lru_lock);
+		refill_inactive(nr_pages, zone);
+
+		nr_pages = shrink_cache(nr_pages, zone, gfp_mask);
+		if (nr_pages <= 0)
+			break;
+	}
 
 out:
         return nr_pages;
@@ -654,11 +416,10 @@ int fastcall try_to_free_pages_zone(zone_t *classzone, unsigned int gfp_mask)
 
 	for (;;) {
 		int tries = vm_passes;
-		int failed_swapout = !(gfp_mask & __GFP_IO);
 		int nr_pages = SWAP_CLUSTER_MAX;
 
 		do {
-			nr_pages = shrink_caches(classzone, gfp_mask, nr_pages, &failed_swapout);
+			nr_pages = shrink_caches(classzone, gfp_mask, nr_pages);
 			if (nr_pages <= 0)
 				return 1;
 			shrink_dcache_memory(vm_vfs_scan_ratio, gfp_mask);
@@ -666,8 +427,6 @@ int fastcall try_to_free_pages_zone(zone_t *classzone, unsigned int gfp_mask)
 #ifdef CONFIG_QUOTA
 			shrink_dqcache_memory(vm_vfs_scan_ratio, gfp_mask);
 #endif
-			if (!failed_swapout)
-				failed_swapout = !swap_out(classzone);
 		} while (--tries);
 
 #ifdef	CONFIG_OOM_KILLER
@@ -96,10 +96,16 @@
 #include <net/pkt_sched.h>
 #include <net/profile.h>
 #include <net/checksum.h>
+#include <net/ip.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
 #include <linux/kmod.h>
 #include <linux/module.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #if defined(CONFIG_NET_RADIO) || defined(CONFIG_NET_PCMCIA_RADIO)
 #include <linux/wireless.h>		/* Note : will define WIRELESS_EXT */
 #include <net/iw_handler.h>
@@ -1019,6 +1025,228 @@ illegal_highdma(struct net_device *dev, struct sk_buff *skb)
 #define illegal_highdma(dev, skb)	(0)
 #endif
 
+/*
+ * Generic segmentation offload.  TCP hands down super-packets of up
+ * to 64K: a head skb with the IP and TCP headers, and the segments,
+ * one per skb, chained on its frag_list; gso_size is the MSS.  A flow
+ * merged on receive (see dev_gro_receive()) looks the same, except
+ * that its head also carries the first segment.
+ *
+ * skb_gso_segment() turns such a packet back into a list of ordinary
+ * ones on the way into the queue.  The segments keep their buffers,
+ * only the headers are copied in front of them.  A packet which lost
+ * its frag_list on the way (netfilter linearizes what it looks at) is
+ * cut up by copying instead.  The checksums are left to the device, or
+ * to skb_checksum_help() if it cannot do them.
+ * @skb is consumed, even on failure.
+ */
+static int skb_gso_segment(struct sk_buff *skb, struct sk_buff **segsp)
+{
+	struct sk_buff *segs = NULL, **tail = &segs;
+	struct sk_buff *list, *next, *seg;
+	struct sock *sk = NULL;
+	struct iphdr *iph;
+	struct tcphdr *th;
+	unsigned int mss = skb->gso_size;
+	unsigned int listlen = 0, headpay, off, len;
+	int nhoff, thoff, hdrlen;
+	u32 seq;
+	u16 id;
+
+	iph = skb->nh.iph;
+	nhoff = skb->nh.raw - skb->data;
+	if (skb->protocol != htons(ETH_P_IP) || nhoff < 0 ||
+	    skb_headlen(skb) < nhoff + sizeof(struct iphdr) ||
+	    iph->protocol != IPPROTO_TCP)
+		goto drop;
+	thoff = nhoff + iph->ihl * 4;
+	if (skb_headlen(skb) < thoff + sizeof(struct tcphdr))
+		goto drop;
+	th = (struct tcphdr *)(skb->data + thoff);
+	hdrlen = thoff + th->doff * 4;
+	if (skb_headlen(skb) < hdrlen)
+		goto drop;
+
+	for (list = skb_shinfo(skb)->frag_list; list; list = list->next)
+		listlen += list->len;
+	if (listlen == 0)
+		goto copy;
+	if (skb->len - listlen < hdrlen)
+		goto drop;
+	headpay = skb->len - listlen - hdrlen;
+	if (headpay > mss)
+		goto drop;
+
+	/* A head which carries data goes out itself, with new headers */
+	if (headpay && skb_cloned(skb)) {
+		if (pskb_expand_head(skb, 0, 0, GFP_ATOMIC))
+			goto drop;
+		iph = (struct iphdr *)(skb->data + nhoff);
+		th = (struct tcphdr *)(skb->data + thoff);
+	}
+
+	if (skb->destructor == sock_wfree)
+		sk = skb->sk;
+	seq = ntohl(th->seq);
+	id = ntohs(iph->id);
+
+	list = skb_shinfo(skb)->frag_list;
+	skb_shinfo(skb)->frag_list = NULL;
+	if (headpay) {
+		skb->len -= listlen;
+		skb->data_len -= listlen;
+		*tail = skb;
+		tail = &skb->next;
+	}
+
+	for (; list; list = next) {
+		next = list->next;
+		list->next = NULL;
+
+		/* Charge the socket for each segment on its own */
+		skb->truesize -= list->truesize;
+		if (sk)
+			atomic_sub(list->truesize, &sk->wmem_alloc);
+
+		seg = list;
+		if (skb_shared(seg)) {
+			seg = skb_clone(list, GFP_ATOMIC);
+			kfree_skb(list);
+			if (seg == NULL)
+				goto fail;
+		}
+		if (seg->len == 0 || seg->len > mss ||
+		    (skb_headroom(seg) < hdrlen &&
+		     pskb_expand_head(seg, hdrlen - skb_headroom(seg), 0,
+				      GFP_ATOMIC))) {
+			kfree_skb(seg);
+			goto fail;
+		}
+
+		copy_skb_header(seg, skb);
+		memcpy(skb_push(seg, hdrlen), skb->data, hdrlen);
+		seg->mac.raw = seg->data;
+		seg->nh.raw = seg->data + nhoff;
+		seg->h.raw = seg->data + thoff;
+		if (sk)
+			skb_set_owner_w(seg, sk);
+
+		*tail = seg;
+		tail = &seg->next;
+	}
+
+	if (!headpay)
+		kfree_skb(skb);
+
+fixup:
+	for (seg = segs; seg; seg = seg->next) {
+		len = seg->len - thoff;
+
+		iph = seg->nh.iph;
+		iph->tot_len = htons(seg->len - nhoff);
+		iph->id = htons(id++);
+		ip_send_check(iph);
+
+		th = seg->h.th;
+		th->seq = htonl(seq);
+		seq += len - th->doff * 4;
+		if (seg != segs)
+			th->cwr = 0;
+		if (seg->next)
+			th->fin = th->psh = 0;
+		th->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, len,
+					       IPPROTO_TCP, 0);
+		seg->csum = offsetof(struct tcphdr, check);
+		seg->ip_summed = CHECKSUM_HW;
+		seg->gso_size = 0;
+	}
+
+	*segsp = segs;
+	return 0;
+
+fail:
+	while ((seg = segs) != NULL) {
+		segs = seg->next;
+		seg->next = NULL;
+		kfree_skb(seg);
+	}
+	while ((seg = next) != NULL) {
+		next = seg->next;
+		seg->next = NULL;
+		kfree_skb(seg);
+	}
+	if (!headpay)
+		kfree_skb(skb);
+	return -ENOMEM;
+
+copy:
+	if (skb->len <= hdrlen)
+		goto drop;
+	if (skb->destructor == sock_wfree)
+		sk = skb->sk;
+	seq = ntohl(th->seq);
+	id = ntohs(iph->id);
+	headpay = 0;
+	next = NULL;
+
+	for (off = hdrlen; off < skb->len; off += len) {
+		len = min_t(unsigned int, skb->len - off, mss);
+		seg = alloc_skb(skb_headroom(skb) + hdrlen + len, GFP_ATOMIC);
+		if (seg == NULL)
+			goto fail;
+		skb_reserve(seg, skb_headroom(skb));
+		copy_skb_header(seg, skb);
+		memcpy(skb_put(seg, hdrlen), skb->data, hdrlen);
+		if (skb_copy_bits(skb, off, skb_put(seg, len), len)) {
+			kfree_skb(seg);
+			goto fail;
+		}
+		seg->mac.raw = seg->data;
+		seg->nh.raw = seg->data + nhoff;
+		seg->h.raw = seg->data + thoff;
+		if (sk)
+			skb_set_owner_w(seg, sk);
+
+		*tail = seg;
+		tail = &seg->next;
+	}
+
+	kfree_skb(skb);
+	goto fixup;
+
+drop:
+	kfree_skb(skb);
+	return -EINVAL;
+}
+
+/*
+ * Queue the segments of a super-packet one by one.  The result is the
+ * first segment's; if it went out but a later one did not, the caller
+ * is told about congestion, as TCP would be for a dropped segment.
+ */
+static int dev_gso_xmit(struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next;
+	int err, ret;
+
+	err = skb_gso_segment(skb, &segs);
+	if (err)
+		return err;
+
+	next = segs->next;
+	segs->next = NULL;
+	err = dev_queue_xmit(segs);
+
+	while ((segs = next) != NULL) {
+		next = segs->next;
+		segs->next = NULL;
+		ret = dev_queue_xmit(segs);
+		if (ret && !err)
+			err = NET_XMIT_CN;
+	}
+	return err;
+}
+
 /**
  *	dev_queue_xmit - transmit a buffer
  *	@skb: buffer to transmit
@@ -1037,6 +1265,9 @@ int dev_queue_xmit(struct sk_buff *skb)
 	struct net_device *dev = skb->dev;
 	struct Qdisc  *q;
 
+	if (skb->gso_size)
+		return dev_gso_xmit(skb);
+
 	if (skb_shinfo(skb)->frag_list &&
 	    !(dev->features&NETIF_F_FRAGLIST) &&
 	    skb_linearize(skb, GFP_ATOMIC) != 0) {
@@ -1253,42 +1484,104 @@ static void sample_queue(unsigned long dummy)
 #endif
 
 
-/**
- *	netif_rx	-	post buffer to the network code
- *	@skb: buffer to post
+/*
+ * Receive packet steering: instead of being processed by whichever CPU
+ * took the interrupt, packets are queued to the backlog of a CPU picked
+ * by a hash of their flow, from the set in net.core.rps_cpus.  All the
+ * packets of a flow go to the same CPU, so they stay in order.
  *
- *	This function receives a packet from a device driver and queues it for
- *	the upper (protocol) levels to process.  It always succeeds. The buffer
- *	may be dropped during processing for congestion control or by the 
- *	protocol layers.
- *      
- *	return values:
- *	NET_RX_SUCCESS	(no congestion)           
- *	NET_RX_CN_LOW     (low congestion) 
- *	NET_RX_CN_MOD     (moderate congestion)
- *	NET_RX_CN_HIGH    (high congestion) 
- *	NET_RX_DROP    (packet was dropped)
- *      
- *      
+ * Other CPUs add to a backlog, so under CONFIG_NET_RPS the queue lock
+ * guards input_pkt_queue, throttle and the congestion statistics, on
+ * top of the owner disabling interrupts.  When the backlog of another
+ * CPU needs polling, its owner is told through rps_kick and a
+ * NET_RX_SOFTIRQ raised with an IPI, and net_rx_action() puts blog_dev
+ * on its poll_list.
  */
+#ifdef CONFIG_NET_RPS
+#define rps_lock(queue)		spin_lock(&(queue)->input_pkt_queue.lock)
+#define rps_unlock(queue)	spin_unlock(&(queue)->input_pkt_queue.lock)
 
-int netif_rx(struct sk_buff *skb)
+int netdev_rps_cpus;			/* CPU mask, 0 is off */
+static u32 rps_hash_rnd;
+
+/*
+ * The CPU to process @skb on, or -1 to keep it here.  Only IPv4 is
+ * steered; the ports are left out of fragments, which carry them in
+ * the first one only.
+ */
+static int rps_target_cpu(struct sk_buff *skb)
+{
+	unsigned long mask = netdev_rps_cpus & cpu_online_map;
+	struct iphdr *iph;
+	u32 ports = 0, hash;
+	int ihl, n, cpu;
+
+	if (!mask || skb->protocol != htons(ETH_P_IP))
+		return -1;
+	if (skb_headlen(skb) < sizeof(struct iphdr))
+		return -1;
+
+	iph = (struct iphdr *) skb->data;
+	ihl = iph->ihl * 4;
+	if (!(iph->frag_off & htons(IP_MF|IP_OFFSET)) &&
+	    (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+	    skb_headlen(skb) >= ihl + 4)
+		ports = *(u32 *) (skb->data + ihl);
+
+	hash = jhash_3words(iph->saddr, iph->daddr, ports,
+			    rps_hash_rnd ^ iph->protocol);
+
+	/* the (hash % weight)-th CPU of the mask */
+	n = ((u64) hash * hweight32(mask)) >> 32;
+	for (cpu = 0; ; cpu++) {
+		if (!(mask & (1UL << cpu)))
+			continue;
+		if (!n--)
+			return cpu;
+	}
+}
+
+/* The backlog of @cpu has packets: make sure the CPU will poll it */
+static inline void rps_schedule(struct softnet_data *queue, int cpu)
+{
+	if (cpu == smp_processor_id()) {
+		netif_rx_schedule(&queue->blog_dev);
+		return;
+	}
+	if (netif_rx_schedule_prep(&queue->blog_dev)) {
+		queue->rps_kick = 1;
+		smp_raise_softirq(cpu, NET_RX_SOFTIRQ);
+	}
+}
+#else
+#define rps_lock(queue)		do { } while (0)
+#define rps_unlock(queue)	do { } while (0)
+#define rps_schedule(queue, cpu) netif_rx_schedule(&(queue)->blog_dev)
+#endif
+
+/*
+ * Queue @skb to the backlog of @cpu.  What was received and steered is
+ * counted for this CPU, what the backlog throttled and dropped for the
+ * backlog's own, under its lock.
+ */
+static int enqueue_to_backlog(struct sk_buff *skb, int cpu)
 {
 	int this_cpu = smp_processor_id();
 	struct softnet_data *queue;
 	unsigned long flags;
-
-	if (skb->stamp.tv_sec == 0)
-		do_gettimeofday(&skb->stamp);
+	int ret;
 
 	/* The code is rearranged so that the path is the most
 	   short when CPU is congested, but is still operating.
 	 */
-	queue = &softnet_data[this_cpu];
+	queue = &softnet_data[cpu];
 
 	local_irq_save(flags);
+	rps_lock(queue);
 
 	netdev_rx_stat[this_cpu].total++;
+	if (cpu != this_cpu)
+		netdev_rx_stat[this_cpu].steered++;
 	if (queue->input_pkt_queue.qlen <= netdev_max_backlog) {
 		if (queue->input_pkt_queue.qlen) {
 			if (queue->throttle)
@@ -1297,11 +1590,13 @@ int netif_rx(struct sk_buff *skb)
 enqueue:
 			dev_hold(skb->dev);
 			__skb_queue_tail(&queue->input_pkt_queue,skb);
-			local_irq_restore(flags);
 #ifndef OFFLINE_SAMPLE
-			get_sample_stats(this_cpu);
+			get_sample_stats(cpu);
 #endif
-			return queue->cng_level;
+			ret = queue->cng_level;
+			rps_unlock(queue);
+			local_irq_restore(flags);
+			return ret;
 		}
 
 		if (queue->throttle) {
@@ -1312,26 +1607,64 @@ enqueue:
 #endif
 		}
 
-		netif_rx_schedule(&queue->blog_dev);
+		rps_schedule(queue, cpu);
 		goto enqueue;
 	}
 
 	if (queue->throttle == 0) {
 		queue->throttle = 1;
-		netdev_rx_stat[this_cpu].throttled++;
+		netdev_rx_stat[cpu].throttled++;
 #ifdef CONFIG_NET_HW_FLOWCONTROL
 		atomic_inc(&netdev_dropping);
 #endif
 	}
 
 drop:
-	netdev_rx_stat[this_cpu].dropped++;
+	netdev_rx_stat[cpu].dropped++;
+	rps_unlock(queue);
 	local_irq_restore(flags);
 
 	kfree_skb(skb);
 	return NET_RX_DROP;
 }
 
+/**
+ *	netif_rx	-	post buffer to the network code
+ *	@skb: buffer to post
+ *
+ *	This function receives a packet from a device driver and queues it for
+ *	the upper (protocol) levels to process.  It always succeeds. The buffer
+ *	may be dropped during processing for congestion control or by the 
+ *	protocol layers.
+ *      
+ *	return values:
+ *	NET_RX_SUCCESS	(no congestion)           
+ *	NET_RX_CN_LOW     (low congestion) 
+ *	NET_RX_CN_MOD     (moderate congestion)
+ *	NET_RX_CN_HIGH    (high congestion) 
+ *	NET_RX_DROP    (packet was dropped)
+ *      
+ *      
+ */
+
+int netif_rx(struct sk_buff *skb)
+{
+	int cpu = smp_processor_id();
+
+	if (skb->stamp.tv_sec == 0)
+		do_gettimeofday(&skb->stamp);
+
+#ifdef CONFIG_NET_RPS
+	{
+		int target = rps_target_cpu(skb);
+
+		if (target >= 0)
+			cpu = target;
+	}
+#endif
+	return enqueue_to_backlog(skb, cpu);
+}
+
 /* Deliver skb to an old protocol, which is not threaded well
    or which do not understand shared skbs.
  */
@@ -1458,7 +1791,7 @@ static inline int handle_diverter(struct sk_buff *skb)
 }
 #endif   /* CONFIG_NET_DIVERT */
 
-int netif_receive_skb(struct sk_buff *skb)
+static int __netif_receive_skb(struct sk_buff *skb)
 {
 	struct packet_type *ptype, *pt_prev;
 	int ret = NET_RX_DROP;
@@ -1540,6 +1873,220 @@ int netif_receive_skb(struct sk_buff *skb)
 	return ret;
 }
 
+/*
+ * Generic receive offload: consecutive in-order segments of a TCP flow
+ * are merged into one packet before the protocols see them, so that
+ * ip_rcv() and tcp_v4_rcv() run once for up to 64K of data.  The flows
+ * being merged are held on the softnet gro_list of this CPU, the first
+ * segment as the head and the others, their headers pulled off, on its
+ * frag_list; net_rx_action() passes all of them up before it returns.
+ *
+ * Only plain segments are merged: IPv4 without options and with DF
+ * set, a checksum which checks out, no flags but ACK and PSH, and the
+ * same ACK, window and TCP options as the head.  A segment shorter
+ * than the first one, or one with PSH set, ends the packet.  Anything
+ * else of a flow being held flushes it first, so nothing is reordered.
+ */
+int netdev_gro = 1;
+
+#define GRO_MAX_FLOWS	8		/* held per CPU */
+#define GRO_MAX_SIZE	65535		/* IP total length of a merged packet */
+
+struct gro_cb {
+	struct sk_buff	*last;		/* the tail of the frag_list */
+	u32		next_seq;	/* the sequence number to come next */
+	unsigned int	mss;		/* payload of the first segment */
+	int		short_seg;	/* a shorter segment ended it */
+};
+
+#define GRO_CB(skb)	((struct gro_cb *)(skb)->cb)
+
+static void gro_complete(struct sk_buff *skb)
+{
+	struct net_device *dev = skb->dev;
+	struct iphdr *iph = (struct iphdr *)skb->data;
+
+	skb->next = NULL;
+	if (skb_shinfo(skb)->frag_list) {
+		iph->tot_len = htons(skb->len);
+		ip_send_check(iph);
+		skb->gso_size = GRO_CB(skb)->mss;
+	}
+	memset(skb->cb, 0, sizeof(skb->cb));
+
+	__netif_receive_skb(skb);
+	dev_put(dev);
+}
+
+static void gro_flush(struct softnet_data *queue)
+{
+	struct sk_buff *skb;
+
+	while ((skb = queue->gro_list) != NULL) {
+		queue->gro_list = skb->next;
+		gro_complete(skb);
+	}
+	queue->gro_count = 0;
+}
+
+/* Returns the TCP payload of @skb if it may be merged, else 0 */
+static unsigned int gro_tcp_payload(struct sk_buff *skb, struct iphdr *iph,
+				    struct tcphdr *th)
+{
+	unsigned int len = skb->len - sizeof(struct iphdr);
+	unsigned int thlen = th->doff * 4;
+
+	if (skb->pkt_type != PACKET_HOST || skb_shared(skb) ||
+	    skb_cloned(skb) || skb_is_nonlinear(skb))
+		return 0;
+	if (iph->frag_off != htons(IP_DF) || ntohs(iph->tot_len) != skb->len ||
+	    ip_fast_csum((u8 *)iph, 5))
+		return 0;
+	if (thlen < sizeof(struct tcphdr) || len <= thlen)
+		return 0;
+	if (!th->ack || th->syn || th->fin || th->rst || th->urg ||
+	    th->ece || th->cwr)
+		return 0;
+
+	if (skb->ip_summed != CHECKSUM_UNNECESSARY) {
+		if (csum_tcpudp_magic(iph->saddr, iph->daddr, len, IPPROTO_TCP,
+				      csum_partial((u8 *)th, len, 0)))
+			return 0;
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+	return len - thlen;
+}
+
+/* Can @skb, with @len bytes of data, be added to the held @p? */
+static int gro_can_merge(struct sk_buff *p, struct tcphdr *th, unsigned int len)
+{
+	struct tcphdr *th2 = (struct tcphdr *)(p->data + sizeof(struct iphdr));
+
+	return GRO_CB(p)->next_seq == ntohl(th->seq) &&
+	       !GRO_CB(p)->short_seg && len <= GRO_CB(p)->mss &&
+	       p->len + len <= GRO_MAX_SIZE &&
+	       th->ack_seq == th2->ack_seq && th->window == th2->window &&
+	       th->doff == th2->doff &&
+	       !memcmp(th + 1, th2 + 1, th->doff * 4 - sizeof(struct tcphdr));
+}
+
+/*
+ * Returns 1 if @skb was taken in, to be passed up later; 0 if the
+ * caller is to pass it up now.
+ */
+static int dev_gro_receive(struct sk_buff *skb)
+{
+	struct softnet_data *queue = &softnet_data[smp_processor_id()];
+	struct sk_buff *p, **pp;
+	struct iphdr *iph;
+	struct tcphdr *th;
+	unsigned int len;
+
+	if (!netdev_gro || skb->protocol != htons(ETH_P_IP) ||
+	    skb_headlen(skb) < sizeof(struct iphdr) + sizeof(struct tcphdr))
+		goto flush;
+	iph = (struct iphdr *)skb->data;
+	if (iph->version != 4 || iph->ihl != 5 || iph->protocol != IPPROTO_TCP)
+		goto flush;
+	th = (struct tcphdr *)(skb->data + sizeof(struct iphdr));
+
+	for (pp = &queue->gro_list; (p = *pp) != NULL; pp = &p->next) {
+		struct iphdr *iph2 = (struct iphdr *)p->data;
+		struct tcphdr *th2 = (struct tcphdr *)(iph2 + 1);
+
+		if (p->dev == skb->dev &&
+		    iph->saddr == iph2->saddr && iph->daddr == iph2->daddr &&
+		    th->source == th2->source && th->dest == th2->dest)
+			break;
+	}
+
+	len = gro_tcp_payload(skb, iph, th);
+
+	if (p) {
+		if (len && gro_can_merge(p, th, len)) {
+			struct tcphdr *th2 = (struct tcphdr *)(p->data +
+							       sizeof(struct iphdr));
+
+			__skb_pull(skb, sizeof(struct iphdr) + th->doff * 4);
+			if (GRO_CB(p)->last)
+				GRO_CB(p)->last->next = skb;
+			else
+				skb_shinfo(p)->frag_list = skb;
+			GRO_CB(p)->last = skb;
+			skb->next = NULL;
+			p->len += len;
+			p->data_len += len;
+			p->truesize += skb->truesize;
+			GRO_CB(p)->next_seq += len;
+			if (len < GRO_CB(p)->mss)
+				GRO_CB(p)->short_seg = 1;
+
+			if (th->psh) {
+				th2->psh = 1;
+				*pp = p->next;
+				queue->gro_count--;
+				gro_complete(p);
+			}
+			return 1;
+		}
+
+		/* The flow is broken: what was merged so far goes first */
+		*pp = p->next;
+		queue->gro_count--;
+		gro_complete(p);
+	}
+
+	if (!len || th->psh)
+		return 0;
+
+	if (queue->gro_count >= GRO_MAX_FLOWS) {
+		p = queue->gro_list;
+		queue->gro_list = p->next;
+		queue->gro_count--;
+		gro_complete(p);
+	}
+
+	for (pp = &queue->gro_list; *pp; pp = &(*pp)->next)
+		;
+	*pp = skb;
+	skb->next = NULL;
+	queue->gro_count++;
+	dev_hold(skb->dev);
+
+	memset(skb->cb, 0, sizeof(skb->cb));
+	GRO_CB(skb)->next_seq = ntohl(th->seq) + len;
+	GRO_CB(skb)->mss = len;
+	return 1;
+
+flush:
+	/*
+	 * We cannot tell which flow this one belongs to, if any: let
+	 * everything held go up first, so that nothing passes it.
+	 */
+	gro_flush(queue);
+	return 0;
+}
+
+/*
+ * Called by NAPI drivers from their ->poll(); packets for a flow
+ * which is steered elsewhere go to that CPU's backlog instead.
+ */
+int netif_receive_skb(struct sk_buff *skb)
+{
+#ifdef CONFIG_NET_RPS
+	int cpu = rps_target_cpu(skb);
+
+	if (cpu >= 0 && cpu != smp_processor_id()) {
+		if (skb->stamp.tv_sec == 0)
+			do_gettimeofday(&skb->stamp);
+		return enqueue_to_backlog(skb, cpu);
+	}
+#endif
+	if (dev_gro_receive(skb))
+		return NET_RX_SUCCESS;
+	return __netif_receive_skb(skb);
+}
+
 static int process_backlog(struct net_device *backlog_dev, int *budget)
 {
 	int work = 0;
@@ -1553,14 +2100,19 @@ static int process_backlog(struct net_device *backlog_dev, int *budget)
 		struct net_device *dev;
 
 		local_irq_disable();
+		rps_lock(queue);
 		skb = __skb_dequeue(&queue->input_pkt_queue);
 		if (skb == NULL)
 			goto job_done;
+		rps_unlock(queue);
 		local_irq_enable();
 
+		netdev_rx_stat[this_cpu].processed++;
+
 		dev = skb->dev;
 
-		netif_receive_skb(skb);
+		if (!dev_gro_receive(skb))
+			__netif_receive_skb(skb);
 
 		dev_put(dev);
 
@@ -1571,8 +2123,17 @@ static int process_backlog(struct net_device *backlog_dev, int *budget)
 
 #ifdef CONFIG_NET_HW_FLOWCONTROL
 		if (queue->throttle && queue->input_pkt_queue.qlen < no_cong_thresh ) {
-			queue->throttle = 0;
-			if (atomic_dec_and_test(&netdev_dropping)) {
+			int wakeup = 0;
+
+			local_irq_disable();
+			rps_lock(queue);
+			if (queue->throttle) {
+				queue->throttle = 0;
+				wakeup = atomic_dec_and_test(&netdev_dropping);
+			}
+			rps_unlock(queue);
+			local_irq_enable();
+			if (wakeup) {
 				netdev_wakeup();
 				break;
 			}
@@ -1599,6 +2160,7 @@ job_done:
 			netdev_wakeup();
 #endif
 	}
+	rps_unlock(queue);
 	local_irq_enable();
 	return 0;
 }
@@ -1613,6 +2175,16 @@ static void net_rx_action(struct softirq_action *h)
 	br_read_lock(BR_NETPROTO_LOCK);
 	local_irq_disable();
 
+#ifdef CONFIG_NET_RPS
+	/* Another CPU has filled our backlog */
+	rps_lock(queue);
+	if (queue->rps_kick) {
+		queue->rps_kick = 0;
+		__netif_rx_schedule(&queue->blog_dev);
+	}
+	rps_unlock(queue);
+#endif
+
 	while (!list_empty(&queue->poll_list)) {
 		struct net_device *dev;
 
@@ -1638,6 +2210,7 @@ static void net_rx_action(struct softirq_action *h)
 	}
 
 	local_irq_enable();
+	gro_flush(queue);
 	br_read_unlock(BR_NETPROTO_LOCK);
 	return;
 
@@ -1646,6 +2219,7 @@ softnet_break:
 	__cpu_raise_softirq(this_cpu, NET_RX_SOFTIRQ);
 
 	local_irq_enable();
+	gro_flush(queue);
 	br_read_unlock(BR_NETPROTO_LOCK);
 }
 
@@ -1857,7 +2431,7 @@ static int dev_proc_stats(char *buffer, char **start, off_t offset,
 
 	for (lcpu=0; lcpu<smp_num_cpus; lcpu++) {
 		i = cpu_logical_map(lcpu);
-		len += sprintf(buffer+len, "%08x %08x %08x %08x %08x %08x %08x %08x %08x\n",
+		len += sprintf(buffer+len, "%08x %08x %08x %08x %08x %08x %08x %08x %08x %08x %08x\n",
 			       netdev_rx_stat[i].total,
 			       netdev_rx_stat[i].dropped,
 			       netdev_rx_stat[i].time_squeeze,
@@ -1867,10 +2441,12 @@ static int dev_proc_stats(char *buffer, char **start, off_t offset,
 			       netdev_rx_stat[i].fastroute_defer,
 			       netdev_rx_stat[i].fastroute_deferred_out,
 #if 0
-			       netdev_rx_stat[i].fastroute_latency_reduction
+			       netdev_rx_stat[i].fastroute_latency_reduction,
 #else
-			       netdev_rx_stat[i].cpu_collision
+			       netdev_rx_stat[i].cpu_collision,
 #endif
+			       netdev_rx_stat[i].steered,
+			       netdev_rx_stat[i].processed
 			       );
 	}
 
@@ -2783,6 +3359,9 @@ int __init net_dev_init(void)
 		queue->blog_dev.poll = process_backlog;
 		atomic_set(&queue->blog_dev.refcnt, 1);
 	}
+#ifdef CONFIG_NET_RPS
+	get_random_bytes(&rps_hash_rnd, sizeof(rps_hash_rnd));
+#endif
 
 #ifdef CONFIG_NET_PROFILE
 	net_profile_init();
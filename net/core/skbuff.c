@@ -238,6 +238,7 @@ static inline void skb_headerinit(void *p, kmem_cache_t *cache,
 	skb->ip_summed = 0;
 	skb->priority = 0;
 	skb->security = 0;	/* By default packets are insecure */
+	skb->gso_size = 0;
 	skb->destructor = NULL;
 
 #ifdef CONFIG_NETFILTER
@@ -380,6 +381,7 @@ struct sk_buff *skb_clone(struct sk_buff *skb, int gfp_mask)
 	atomic_set(&n->users, 1);
 	C(protocol);
 	C(security);
+	C(gso_size);
 	C(truesize);
 	C(head);
 	C(data);
@@ -409,7 +411,7 @@ struct sk_buff *skb_clone(struct sk_buff *skb, int gfp_mask)
 	return n;
 }
 
-static void copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
+void copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
 {
 	/*
 	 *	Shift between the two data areas in bytes
@@ -432,6 +434,7 @@ static void copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
 	new->stamp=old->stamp;
 	new->destructor = NULL;
 	new->security=old->security;
+	new->gso_size=old->gso_size;
 #ifdef CONFIG_NETFILTER
 	new->nfmark=old->nfmark;
 	new->nfcache=old->nfcache;
@@ -17,6 +17,10 @@ extern int no_cong_thresh;
 extern int no_cong;
 extern int lo_cong;
 extern int mod_cong;
+#ifdef CONFIG_NET_RPS
+extern int netdev_rps_cpus;
+#endif
+extern int netdev_gro;
 extern int netdev_fastroute;
 extern int net_msg_cost;
 extern int net_msg_burst;
@@ -67,6 +71,14 @@ ctl_table core_table[] = {
 	{NET_CORE_MOD_CONG, "mod_cong",
 	 &mod_cong, sizeof(int), 0644, NULL,
 	 &proc_dointvec},
+#ifdef CONFIG_NET_RPS
+	{NET_CORE_RPS_CPUS, "rps_cpus",
+	 &netdev_rps_cpus, sizeof(int), 0644, NULL,
+	 &proc_dointvec},
+#endif
+	{NET_CORE_GRO, "gro",
+	 &netdev_gro, sizeof(int), 0644, NULL,
+	 &proc_dointvec},
 #ifdef CONFIG_NET_FASTROUTE
 	{NET_CORE_FASTROUTE, "netdev_fastroute",
 	 &netdev_fastroute, sizeof(int), 0644, NULL,
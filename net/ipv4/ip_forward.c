@@ -130,7 +130,7 @@ int ip_forward(struct sk_buff *skb)
 	 * If the indicated interface is up and running, kick it.
 	 */
 
-	if (skb->len > mtu && (ntohs(iph->frag_off) & IP_DF))
+	if (ip_skb_wire_len(skb) > mtu && (ntohs(iph->frag_off) & IP_DF))
 		goto frag_needed;
 
 #ifdef CONFIG_IP_ROUTE_NAT
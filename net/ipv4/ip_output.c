@@ -313,7 +313,7 @@ static inline int ip_queue_xmit2(struct sk_buff *skb)
 		iph = skb->nh.iph;
 	}
 
-	if (skb->len > rt->u.dst.pmtu)
+	if (ip_skb_wire_len(skb) > rt->u.dst.pmtu)
 		goto fragment;
 
 	ip_select_ident(iph, &rt->u.dst, sk);
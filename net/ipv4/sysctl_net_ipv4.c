@@ -271,6 +271,9 @@ ctl_table ipv4_table[] = {
 	{NET_TCP_BIC_BETA, "tcp_bic_beta",
 	 &sysctl_tcp_bic_beta, sizeof(int), 0644, NULL,
 	 &proc_dointvec},
+	{NET_TCP_GSO, "tcp_gso",
+	 &sysctl_tcp_gso, sizeof(int), 0644, NULL,
+	 &proc_dointvec},
 	{0}
 };
 
@@ -267,6 +267,9 @@ struct tcp_mib	tcp_statistics[NR_CPUS*2];
 kmem_cache_t *tcp_openreq_cachep;
 kmem_cache_t *tcp_bucket_cachep;
 kmem_cache_t *tcp_timewait_cachep;
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+kmem_cache_t *tcp6_timewait_cachep;
+#endif
 
 atomic_t tcp_orphan_count = ATOMIC_INIT(0);
 
@@ -2564,12 +2567,29 @@ void __init tcp_init(void)
 	if(!tcp_bucket_cachep)
 		panic("tcp_init: Cannot alloc tcp_bind_bucket cache.");
 
+	/* There can be a million of these, so they are packed rather
+	 * than cacheline aligned, and IPv4 ones leave out the IPv6
+	 * addresses.
+	 */
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+	tcp_timewait_cachep = kmem_cache_create("tcp_tw_bucket",
+						offsetof(struct tcp_tw_bucket, v6_daddr),
+						0, SOCK_CACHE_FLAGS & ~SLAB_HWCACHE_ALIGN,
+						NULL, NULL);
+	tcp6_timewait_cachep = kmem_cache_create("tcp6_tw_bucket",
+						 sizeof(struct tcp_tw_bucket),
+						 0, SOCK_CACHE_FLAGS & ~SLAB_HWCACHE_ALIGN,
+						 NULL, NULL);
+	if(!tcp_timewait_cachep || !tcp6_timewait_cachep)
+		panic("tcp_init: Cannot alloc tcp_tw_bucket cache.");
+#else
 	tcp_timewait_cachep = kmem_cache_create("tcp_tw_bucket",
 						sizeof(struct tcp_tw_bucket),
-						0, SLAB_HWCACHE_ALIGN,
+						0, SOCK_CACHE_FLAGS & ~SLAB_HWCACHE_ALIGN,
 						NULL, NULL);
 	if(!tcp_timewait_cachep)
 		panic("tcp_init: Cannot alloc tcp_tw_bucket cache.");
+#endif
 
 	/* Size and allocate the main established and bind bucket
 	 * hash tables.
@@ -2597,6 +2617,7 @@ void __init tcp_init(void)
 		panic("Failed to allocate TCP established hash table\n");
 	for (i = 0; i < (tcp_ehash_size<<1); i++) {
 		tcp_ehash[i].lock = RW_LOCK_UNLOCKED;
+		tcp_ehash[i].seq = 0;
 		tcp_ehash[i].chain = NULL;
 	}
 
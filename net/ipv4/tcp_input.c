@@ -141,9 +141,10 @@ static __inline__ void tcp_measure_rcv_mss(struct tcp_opt *tp, struct sk_buff *s
 	tp->ack.last_seg_size = 0; 
 
 	/* skb->len may jitter because of SACKs, even if peer
-	 * sends good full-sized frames.
+	 * sends good full-sized frames.  Segments merged on receive
+	 * tell their size in gso_size.
 	 */
-	len = skb->len;
+	len = skb->gso_size ? skb->gso_size : skb->len;
 	if (len >= tp->ack.rcv_mss) {
 		tp->ack.rcv_mss = len;
 	} else {
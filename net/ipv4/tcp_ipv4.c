@@ -63,6 +63,7 @@
 #include <net/tcp.h>
 #include <net/ipv6.h>
 #include <net/inet_common.h>
+#include <net/profile.h>
 
 #include <linux/inet.h>
 #include <linux/stddef.h>
@@ -73,6 +74,9 @@ extern int sysctl_ip_default_ttl;
 int sysctl_tcp_tw_reuse = 0;
 int sysctl_tcp_low_latency = 0;
 
+/* Under pktgen load, /proc/net/profile shows what the demux costs */
+NET_PROFILE_DEFINE(tcp_v4_lookup)
+
 /* Check TCP sequence numbers in ICMP packets. */
 #define ICMP_MIN_LENGTH 8
 
@@ -353,25 +357,27 @@ void tcp_listen_wlock(void)
 
 static __inline__ void __tcp_v4_hash(struct sock *sk, const int listen_possible)
 {
+	struct tcp_ehash_bucket *head = NULL;
 	struct sock **skp;
-	rwlock_t *lock;
 
 	BUG_TRAP(sk->pprev==NULL);
 	if(listen_possible && sk->state == TCP_LISTEN) {
 		skp = &tcp_listening_hash[tcp_sk_listen_hashfn(sk)];
-		lock = &tcp_lhash_lock;
 		tcp_listen_wlock();
 	} else {
-		skp = &tcp_ehash[(sk->hashent = tcp_sk_hashfn(sk))].chain;
-		lock = &tcp_ehash[sk->hashent].lock;
-		write_lock(lock);
+		head = &tcp_ehash[(sk->hashent = tcp_sk_hashfn(sk))];
+		skp = &head->chain;
+		tcp_ehash_write_lock(head);
 	}
 	if((sk->next = *skp) != NULL)
 		(*skp)->pprev = &sk->next;
 	*skp = sk;
 	sk->pprev = skp;
 	sock_prot_inc_use(sk->prot);
-	write_unlock(lock);
+	if (head)
+		tcp_ehash_write_unlock(head);
+	else
+		write_unlock(&tcp_lhash_lock);
 	if (listen_possible && sk->state == TCP_LISTEN)
 		wake_up(&tcp_lhash_wait);
 }
@@ -387,7 +393,7 @@ static void tcp_v4_hash(struct sock *sk)
 
 void tcp_unhash(struct sock *sk)
 {
-	rwlock_t *lock;
+	struct tcp_ehash_bucket *head = NULL;
 
 	if (!sk->pprev)
 		goto ende;
@@ -395,11 +401,9 @@ void tcp_unhash(struct sock *sk)
 	if (sk->state == TCP_LISTEN) {
 		local_bh_disable();
 		tcp_listen_wlock();
-		lock = &tcp_lhash_lock;
 	} else {
-		struct tcp_ehash_bucket *head = &tcp_ehash[sk->hashent];
-		lock = &head->lock;
-		write_lock_bh(&head->lock);
+		head = &tcp_ehash[sk->hashent];
+		tcp_ehash_write_lock_bh(head);
 	}
 
 	if(sk->pprev) {
@@ -409,7 +413,10 @@ void tcp_unhash(struct sock *sk)
 		sk->pprev = NULL;
 		sock_prot_dec_use(sk->prot);
 	}
-	write_unlock_bh(lock);
+	if (head)
+		tcp_ehash_write_unlock_bh(head);
+	else
+		write_unlock_bh(&tcp_lhash_lock);
 
  ende:
 	if (sk->state == TCP_LISTEN)
@@ -488,6 +495,72 @@ sherry_cache:
  * Local BH must be disabled here.
  */
 
+#ifdef SOCK_LOCKLESS_LOOKUP
+/* The chains are walked without the bucket lock, which every incoming
+ * segment would otherwise bounce between the CPUs.  What makes it safe:
+ *
+ * - A socket or TIME_WAIT bucket found on a chain may be unhashed and
+ *   freed under us, but its memory stays a sock (or a TIME_WAIT bucket)
+ *   with a valid next pointer, see SOCK_CACHE_FLAGS.  We may wander
+ *   off along such a pointer; the bucket seq, checked at every step,
+ *   tells us, and we start over.
+ * - The reference is taken with sock_hold_not_zero(), which does not
+ *   bring a freed socket back.  If seq has not moved by then, the
+ *   socket was on the chain all the time, so the reference is good.
+ *   Otherwise it is dropped again and we start over.
+ */
+#define tcp_ehash_moved(head, seq) \
+	(*(volatile unsigned int *)&(head)->seq != (seq))
+
+static inline struct sock *__tcp_v4_lookup_established(u32 saddr, u16 sport,
+						       u32 daddr, u16 hnum, int dif)
+{
+	struct tcp_ehash_bucket *head;
+	TCP_V4_ADDR_COOKIE(acookie, saddr, daddr)
+	__u32 ports = TCP_COMBINED_PORTS(sport, hnum);
+	struct sock *sk;
+	unsigned int seq;
+	int hash, tw;
+
+	hash = tcp_hashfn(daddr, hnum, saddr, sport);
+	head = &tcp_ehash[hash];
+
+restart:
+	seq = tcp_ehash_read_begin(head);
+	tw = 0;
+	for(sk = head->chain; sk; sk = sk->next) {
+		if (tcp_ehash_moved(head, seq))
+			goto restart;
+		if(TCP_IPV4_MATCH(sk, acookie, saddr, daddr, ports, dif))
+			goto hit;
+	}
+
+	tw = 1;
+	for(sk = (head + tcp_ehash_size)->chain; sk; sk = sk->next) {
+		if (tcp_ehash_moved(head, seq))
+			goto restart;
+		if(TCP_IPV4_MATCH(sk, acookie, saddr, daddr, ports, dif))
+			goto hit;
+	}
+
+	/* A socket moving to TIME_WAIT may have been missed */
+	if (tcp_ehash_read_retry(head, seq))
+		goto restart;
+	return NULL;
+
+hit:
+	if (!sock_hold_not_zero(sk))
+		goto restart;
+	if (tcp_ehash_read_retry(head, seq)) {
+		if (tw)
+			tcp_tw_put((struct tcp_tw_bucket *)sk);
+		else
+			sock_put(sk);
+		goto restart;
+	}
+	return sk;
+}
+#else
 static inline struct sock *__tcp_v4_lookup_established(u32 saddr, u16 sport,
 						       u32 daddr, u16 hnum, int dif)
 {
@@ -521,6 +594,7 @@ hit:
 	read_unlock(&head->lock);
 	return sk;
 }
+#endif
 
 static inline struct sock *__tcp_v4_lookup(u32 saddr, u16 sport,
 					   u32 daddr, u16 hnum, int dif)
@@ -568,7 +642,7 @@ static int __tcp_v4_check_established(struct sock *sk, __u16 lport,
 	struct sock *sk2, **skp;
 	struct tcp_tw_bucket *tw;
 
-	write_lock(&head->lock);
+	tcp_ehash_write_lock(head);
 
 	/* Check TIME-WAIT sockets first. */
 	for(skp = &(head + tcp_ehash_size)->chain; (sk2=*skp) != NULL;
@@ -627,7 +701,7 @@ unique:
 	sk->pprev = skp;
 	sk->hashent = hash;
 	sock_prot_inc_use(sk->prot);
-	write_unlock(&head->lock);
+	tcp_ehash_write_unlock(head);
 
 	if (twp) {
 		*twp = tw;
@@ -644,7 +718,7 @@ unique:
 	return 0;
 
 not_unique:
-	write_unlock(&head->lock);
+	tcp_ehash_write_unlock(head);
 	return -EADDRNOTAVAIL;
 }
 
@@ -1749,8 +1823,10 @@ int tcp_v4_rcv(struct sk_buff *skb)
 	TCP_SKB_CB(skb)->flags = skb->nh.iph->tos;
 	TCP_SKB_CB(skb)->sacked = 0;
 
+	NET_PROFILE_ENTER(tcp_v4_lookup);
 	sk = __tcp_v4_lookup(skb->nh.iph->saddr, th->source,
 			     skb->nh.iph->daddr, ntohs(th->dest), tcp_v4_iif(skb));
+	NET_PROFILE_LEAVE(tcp_v4_lookup);
 
 	if (!sk)
 		goto no_tcp_socket;
@@ -2311,6 +2387,10 @@ void __init tcp_v4_init(struct net_proto_family *ops)
 {
 	int err;
 
+#ifdef CONFIG_NET_PROFILE
+	NET_PROFILE_REGISTER(tcp_v4_lookup);
+#endif
+
 	tcp_inode.i_mode = S_IFSOCK;
 	tcp_inode.i_sock = 1;
 	tcp_inode.i_uid = 0;
@@ -61,16 +61,16 @@ void tcp_timewait_kill(struct tcp_tw_bucket *tw)
 
 	/* Unlink from established hashes. */
 	ehead = &tcp_ehash[tw->hashent];
-	write_lock(&ehead->lock);
+	tcp_ehash_write_lock(ehead);
 	if (!tw->pprev) {
-		write_unlock(&ehead->lock);
+		tcp_ehash_write_unlock(ehead);
 		return;
 	}
 	if(tw->next)
 		tw->next->pprev = tw->pprev;
 	*(tw->pprev) = tw->next;
 	tw->pprev = NULL;
-	write_unlock(&ehead->lock);
+	tcp_ehash_write_unlock(ehead);
 
 	/* Disassociate with bind bucket. */
 	bhead = &tcp_bhash[tcp_bhashfn(tw->num)];
@@ -317,7 +317,7 @@ static void __tcp_tw_hashdance(struct sock *sk, struct tcp_tw_bucket *tw)
 	tw->bind_pprev = &tw->tb->owners;
 	spin_unlock(&bhead->lock);
 
-	write_lock(&ehead->lock);
+	tcp_ehash_write_lock(ehead);
 
 	/* Step 2: Remove SK from established hash. */
 	if (sk->pprev) {
@@ -337,7 +337,7 @@ static void __tcp_tw_hashdance(struct sock *sk, struct tcp_tw_bucket *tw)
 	sktw->pprev = head;
 	atomic_inc(&tw->refcnt);
 
-	write_unlock(&ehead->lock);
+	tcp_ehash_write_unlock(ehead);
 }
 
 /* 
@@ -353,7 +353,7 @@ void tcp_time_wait(struct sock *sk, int state, int timeo)
 		recycle_ok = tp->af_specific->remember_stamp(sk);
 
 	if (tcp_tw_count < sysctl_tcp_max_tw_buckets)
-		tw = kmem_cache_alloc(tcp_timewait_cachep, SLAB_ATOMIC);
+		tw = kmem_cache_alloc(tcp_tw_cachep(sk->family), SLAB_ATOMIC);
 
 	if(tw != NULL) {
 		int rto = (tp->rto<<2) - (tp->rto>>1);
@@ -420,18 +420,34 @@ void tcp_time_wait(struct sock *sk, int state, int timeo)
 	tcp_done(sk);
 }
 
-/* Kill off TIME_WAIT sockets once their lifetime has expired. */
+/* Kill off TIME_WAIT sockets once their lifetime has expired.
+ *
+ * With a million buckets about, a slot of the death row holds more
+ * than a hundred thousand of them: far too many to kill from one
+ * timer run.  So the timer kills at most TCP_TWKILL_QUOTA and moves
+ * what is left of the slot to the reap list, which keventd works
+ * through a quota at a time, letting bottom halves run in between.
+ */
 static int tcp_tw_death_row_slot = 0;
 
 static void tcp_twkill(unsigned long);
+static void tcp_twkill_work(void *);
 
 static struct tcp_tw_bucket *tcp_tw_death_row[TCP_TWKILL_SLOTS];
+static struct tcp_tw_bucket *tcp_tw_reap_list;
 static spinlock_t tw_death_lock = SPIN_LOCK_UNLOCKED;
 static struct timer_list tcp_tw_timer = { function: tcp_twkill };
+static struct tq_struct tcp_twkill_tq = { routine: tcp_twkill_work };
 
-static void SMP_TIMER_NAME(tcp_twkill)(unsigned long dummy)
+/* Kill up to quota buckets off the front of a death list.  Called
+ * with tw_death_lock held and BHs off.  Returns non-zero if some are
+ * left.
+ */
+static int tcp_do_twkill(struct tcp_tw_bucket **list, int quota)
 {
 	struct tcp_tw_bucket *tw;
+	unsigned long now = jiffies;
+	unsigned long lag = 0;
 	int killed = 0;
 
 	/* NOTE: compare this to previous version where lock
@@ -440,16 +456,13 @@ static void SMP_TIMER_NAME(tcp_twkill)(unsigned long dummy)
 	 * in 2.3 (with netfilter), and with softnet it is common, because
 	 * soft irqs are not sequenced.
 	 */
-	spin_lock(&tw_death_lock);
-
-	if (tcp_tw_count == 0)
-		goto out;
-
-	while((tw = tcp_tw_death_row[tcp_tw_death_row_slot]) != NULL) {
-		tcp_tw_death_row[tcp_tw_death_row_slot] = tw->next_death;
+	while ((tw = *list) != NULL && killed < quota) {
+		*list = tw->next_death;
 		if (tw->next_death)
 			tw->next_death->pprev_death = tw->pprev_death;
 		tw->pprev_death = NULL;
+		if ((long)(now - tw->ttd) > 0)
+			lag += now - tw->ttd;
 		spin_unlock(&tw_death_lock);
 
 		tcp_timewait_kill(tw);
@@ -459,16 +472,57 @@ static void SMP_TIMER_NAME(tcp_twkill)(unsigned long dummy)
 
 		spin_lock(&tw_death_lock);
 	}
+
+	tcp_tw_count -= killed;
+	NET_ADD_STATS_BH(TimeWaited, killed);
+	NET_ADD_STATS_BH(TimeWaitReapLag, lag * 1000 / HZ);
+	return *list != NULL;
+}
+
+static void SMP_TIMER_NAME(tcp_twkill)(unsigned long dummy)
+{
+	struct tcp_tw_bucket **slot;
+
+	spin_lock(&tw_death_lock);
+
+	if (tcp_tw_count == 0)
+		goto out;
+
+	slot = &tcp_tw_death_row[tcp_tw_death_row_slot];
+	if (tcp_do_twkill(slot, TCP_TWKILL_QUOTA) && tcp_tw_reap_list == NULL) {
+		/* Everything in the slot has expired: hand it over whole.
+		 * Should keventd still be busy with an earlier one, the
+		 * rest waits for this slot to come round again.
+		 */
+		tcp_tw_reap_list = *slot;
+		tcp_tw_reap_list->pprev_death = &tcp_tw_reap_list;
+		*slot = NULL;
+		schedule_task(&tcp_twkill_tq);
+		NET_INC_STATS_BH(TimeWaitReapDeferred);
+	}
 	tcp_tw_death_row_slot =
 		((tcp_tw_death_row_slot + 1) & (TCP_TWKILL_SLOTS - 1));
 
-	if ((tcp_tw_count -= killed) != 0)
+	if (tcp_tw_count != 0)
 		mod_timer(&tcp_tw_timer, jiffies+TCP_TWKILL_PERIOD);
-	net_statistics[smp_processor_id()*2].TimeWaited += killed;
 out:
 	spin_unlock(&tw_death_lock);
 }
 
+static void tcp_twkill_work(void *dummy)
+{
+	int more;
+
+	do {
+		spin_lock_bh(&tw_death_lock);
+		more = tcp_do_twkill(&tcp_tw_reap_list, TCP_TWKILL_QUOTA);
+		spin_unlock_bh(&tw_death_lock);
+
+		if (current->need_resched)
+			schedule();
+	} while (more);
+}
+
 SMP_TIMER_DEFINE(tcp_twkill, tcp_twkill_task);
 
 /* These are always called from BH context.  See callers in
@@ -650,7 +704,14 @@ struct sock *tcp_create_openreq_child(struct sock *sk, struct open_request *req,
 		struct sk_filter *filter;
 #endif
 
-		memcpy(newsk, sk, sizeof(*newsk));
+		/* Everything but the refcnt: a lockless lookup may still
+		 * be looking at this memory, and must not take a reference
+		 * before the socket is set up.
+		 */
+		memcpy(newsk, sk, offsetof(struct sock, refcnt));
+		memcpy((char *)newsk + offsetof(struct sock, lock),
+		       (char *)sk + offsetof(struct sock, lock),
+		       sizeof(*newsk) - offsetof(struct sock, lock));
 		newsk->state = TCP_SYN_RECV;
 
 		/* SANITY */
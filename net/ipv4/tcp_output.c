@@ -44,6 +44,9 @@
 /* People can turn this off for buggy TCP's found in printers etc. */
 int sysctl_tcp_retrans_collapse = 1;
 
+/* Send runs of full-sized segments as one super-packet */
+int sysctl_tcp_gso = 1;
+
 static __inline__
 void update_send_head(struct sock *sk, struct tcp_opt *tp, struct sk_buff *skb)
 {
@@ -552,6 +555,106 @@ int tcp_sync_mss(struct sock *sk, u32 pmtu)
 }
 
 
+/* Can a super-packet start with skb, a full-sized segment at the send
+ * head?  Checksums must be left to the device layer, and the packet
+ * must not be one which IP could fragment: the device layer cuts it
+ * up into segments only just before the driver.  Urgent data and ECN
+ * mark single segments, so they are sent the usual way.
+ */
+static __inline__ int tcp_can_gso(struct sock *sk, struct tcp_opt *tp,
+				  struct sk_buff *skb, unsigned int mss_now)
+{
+	struct dst_entry *dst = __sk_dst_get(sk);
+
+	return sysctl_tcp_gso &&
+	       sk->family == AF_INET &&
+	       skb->ip_summed == CHECKSUM_HW &&
+	       skb->len == mss_now &&
+	       TCP_SKB_CB(skb)->flags == TCPCB_FLAG_ACK &&
+	       !tcp_skb_is_last(sk, skb) &&
+	       !tp->urg_mode &&
+	       !(tp->ecn_flags & TCP_ECN_OK) &&
+	       dst != NULL && ip_dont_fragment(sk, dst);
+}
+
+/* Send skb and the segments after it which the windows allow as one
+ * super-packet: a header-only skb with clones of the segments on its
+ * frag_list, up to 64K.  The headers are built once for all of them.
+ * On failure nothing is sent and the send head is left where it was.
+ */
+static int tcp_write_gso(struct sock *sk, struct sk_buff *skb,
+			 unsigned int mss_now, int nonagle)
+{
+	struct tcp_opt *tp = &(sk->tp_pinfo.af_tcp);
+	struct sk_buff *first = skb, *last = skb;
+	struct sk_buff *head, *clone, **tail;
+	__u32 snd_nxt = tp->snd_nxt;
+	int segs = 0, err;
+
+	head = alloc_skb(MAX_TCP_HEADER, GFP_ATOMIC);
+	if (head == NULL)
+		return -ENOBUFS;
+	skb_reserve(head, MAX_TCP_HEADER);
+	tail = &skb_shinfo(head)->frag_list;
+
+	for (;;) {
+		TCP_SKB_CB(skb)->when = tcp_time_stamp;
+		clone = skb_clone(skb, GFP_ATOMIC);
+		if (clone == NULL)
+			break;
+		*tail = clone;
+		tail = &clone->next;
+		head->len += clone->len;
+		head->data_len += clone->len;
+		head->truesize += clone->truesize;
+
+		update_send_head(sk, tp, skb);
+		tcp_minshall_update(tp, mss_now, skb);
+		last = skb;
+		segs++;
+
+		if (TCP_SKB_CB(skb)->flags != TCPCB_FLAG_ACK ||
+		    skb->len != mss_now)
+			break;
+
+		skb = tp->send_head;
+		if (skb == NULL ||
+		    head->len + mss_now > 0xFFFF - MAX_TCP_HEADER ||
+		    !tcp_snd_test(tp, skb, mss_now,
+				  tcp_skb_is_last(sk, skb) ? nonagle : 1))
+			break;
+		if (skb->len > mss_now && tcp_fragment(sk, skb, mss_now))
+			break;
+		if (skb->ip_summed != CHECKSUM_HW ||
+		    (TCP_SKB_CB(skb)->flags & ~(TCPCB_FLAG_ACK | TCPCB_FLAG_PSH |
+						TCPCB_FLAG_FIN)))
+			break;
+	}
+
+	if (segs <= 1) {
+		clone = skb_shinfo(head)->frag_list;
+		skb_shinfo(head)->frag_list = NULL;
+		kfree_skb(head);
+		err = tcp_transmit_skb(sk, clone);
+	} else {
+		memcpy(head->cb, first->cb, sizeof(head->cb));
+		TCP_SKB_CB(head)->end_seq = TCP_SKB_CB(last)->end_seq;
+		TCP_SKB_CB(head)->flags |= TCP_SKB_CB(last)->flags;
+		head->ip_summed = CHECKSUM_HW;
+		head->gso_size = mss_now;
+		err = tcp_transmit_skb(sk, head);
+		if (!err)
+			TCP_ADD_STATS(TcpOutSegs, segs - 1);
+	}
+
+	if (err) {
+		tp->send_head = first;
+		tp->snd_nxt = snd_nxt;
+		tp->packets_out -= segs;
+	}
+	return err;
+}
+
 /* This routine writes packets to the network.  It advances the
  * send_head.  This happens as incoming acks open up the remote
  * window for us.
@@ -586,6 +689,13 @@ int tcp_write_xmit(struct sock *sk, int nonagle)
 					break;
 			}
 
+			if (tcp_can_gso(sk, tp, skb, mss_now)) {
+				if (tcp_write_gso(sk, skb, mss_now, nonagle))
+					break;
+				sent_pkts = 1;
+				continue;
+			}
+
 			TCP_SKB_CB(skb)->when = tcp_time_stamp;
 			if (tcp_transmit_skb(sk, skb_clone(skb, GFP_ATOMIC)))
 				break;
@@ -215,19 +215,18 @@ fail:
 
 static __inline__ void __tcp_v6_hash(struct sock *sk)
 {
+	struct tcp_ehash_bucket *head = NULL;
 	struct sock **skp;
-	rwlock_t *lock;
 
 	BUG_TRAP(sk->pprev==NULL);
 
 	if(sk->state == TCP_LISTEN) {
 		skp = &tcp_listening_hash[tcp_sk_listen_hashfn(sk)];
-		lock = &tcp_lhash_lock;
 		tcp_listen_wlock();
 	} else {
-		skp = &tcp_ehash[(sk->hashent = tcp_v6_sk_hashfn(sk))].chain;
-		lock = &tcp_ehash[sk->hashent].lock;
-		write_lock(lock);
+		head = &tcp_ehash[(sk->hashent = tcp_v6_sk_hashfn(sk))];
+		skp = &head->chain;
+		tcp_ehash_write_lock(head);
 	}
 
 	if((sk->next = *skp) != NULL)
@@ -235,7 +234,10 @@ static __inline__ void __tcp_v6_hash(struct sock *sk)
 	*skp = sk;
 	sk->pprev = skp;
 	sock_prot_inc_use(sk->prot);
-	write_unlock(lock);
+	if (head)
+		tcp_ehash_write_unlock(head);
+	else
+		write_unlock(&tcp_lhash_lock);
 }
 
 
@@ -452,7 +454,7 @@ static int tcp_v6_check_established(struct sock *sk)
 	struct sock *sk2, **skp;
 	struct tcp_tw_bucket *tw;
 
-	write_lock_bh(&head->lock);
+	tcp_ehash_write_lock_bh(head);
 
 	for(skp = &(head + tcp_ehash_size)->chain; (sk2=*skp)!=NULL; skp = &sk2->next) {
 		tw = (struct tcp_tw_bucket*)sk2;
@@ -493,7 +495,7 @@ unique:
 	sk->pprev = skp;
 	sk->hashent = hash;
 	sock_prot_inc_use(sk->prot);
-	write_unlock_bh(&head->lock);
+	tcp_ehash_write_unlock_bh(head);
 
 	if (tw) {
 		/* Silly. Should hash-dance instead... */
@@ -508,7 +510,7 @@ unique:
 	return 0;
 
 not_unique:
-	write_unlock_bh(&head->lock);
+	tcp_ehash_write_unlock_bh(head);
 	return -EADDRNOTAVAIL;
 }
 